@@ -18,12 +18,58 @@
 #define H_HAL_FLASH_
 
 #include <inttypes.h>
+#include "os/os.h"
 
 int flash_read(uint32_t address, void *dst, uint32_t num_bytes);
 int flash_write(uint32_t address, const void *src, uint32_t num_bytes);
 int flash_erase_sector(uint32_t sector_address);
 int flash_erase(uint32_t address, uint32_t num_bytes);
+int flash_map(uint32_t address, uint32_t num_bytes, const void **out_ptr);
 int flash_init(void);
 
+/*
+ * Driver primitives used by the asynchronous request layer.  An erase is
+ * started and then polled; the caller is free to do other work while the
+ * flash is busy.
+ */
+int flash_erase_sector_start(uint32_t sector_address);
+int flash_busy(void);
+
+/*** Asynchronous requests. */
+
+#define FLASH_REQ_OP_READ           1
+#define FLASH_REQ_OP_WRITE          2
+#define FLASH_REQ_OP_ERASE_SECTOR   3
+
+struct flash_req;
+
+/**
+ * Called from the flash task when a request completes.  The request may be
+ * resubmitted from within the callback.
+ *
+ * @param req                   The completed request.
+ * @param status                0 on success; nonzero on failure.
+ * @param arg                   The request's fr_cb_arg.
+ */
+typedef void flash_req_cb(struct flash_req *req, int status, void *arg);
+
+struct flash_req {
+    uint8_t fr_op;
+    uint32_t fr_address;
+    uint32_t fr_num_bytes;
+    void *fr_dst;           /* FLASH_REQ_OP_READ. */
+    const void *fr_src;     /* FLASH_REQ_OP_WRITE. */
+    flash_req_cb *fr_cb;
+    void *fr_cb_arg;
+
+    /* Private to the request layer. */
+    uint8_t fr_queued;
+    STAILQ_ENTRY(flash_req) fr_next;
+};
+
+int flash_req_init(uint8_t prio, os_stack_t *stack, uint16_t stack_size);
+int flash_req_submit(struct flash_req *req);
+int flash_req_cancel(struct flash_req *req);
+
 #endif
 
@@ -14,9 +14,9 @@
  * limitations under the License.
  */
 
-#ifndef H_CRC32_
-#define H_CRC32_
+#ifndef H_HAL_TEST_
+#define H_HAL_TEST_
 
-uint32_t crc32(uint32_t crc, const void *buf, size_t size);
+int hal_test_all(void);
 
 #endif
@@ -0,0 +1,201 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Asynchronous flash requests.  Requests are queued to a dedicated flash task
+ * and executed in submission order.  Reads and writes are performed with the
+ * synchronous driver calls.  An erase is started with
+ * flash_erase_sector_start() and then polled once per tick, so the flash task
+ * sleeps rather than spins while the erase is in progress, and lower priority
+ * tasks get to run.  Each request's callback is executed in the flash task
+ * when the request completes.
+ *
+ * Latency: erase completion is only noticed when the flash task polls, so an
+ * erase's callback runs up to one OS tick after the hardware finishes, plus
+ * any time the flash task waits for higher priority tasks.  Every request
+ * queued behind the erase inherits the delay.  With OS_TICKS_PER_SEC at 1000
+ * this is negligible next to sector erase times (hundreds of milliseconds),
+ * but a port with a slow tick, or a part with fast page erases, should call
+ * flash_erase_sector() directly when erase latency matters.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include "os/os.h"
+#include "hal/hal_flash.h"
+
+static STAILQ_HEAD(, flash_req) flash_req_list =
+    STAILQ_HEAD_INITIALIZER(flash_req_list);
+
+/** One token per queued request. */
+static struct os_sem flash_req_sem;
+
+static struct os_task flash_req_task;
+
+static int
+flash_req_exec(struct flash_req *req)
+{
+    int rc;
+
+    switch (req->fr_op) {
+    case FLASH_REQ_OP_READ:
+        return flash_read(req->fr_address, req->fr_dst, req->fr_num_bytes);
+
+    case FLASH_REQ_OP_WRITE:
+        return flash_write(req->fr_address, req->fr_src, req->fr_num_bytes);
+
+    case FLASH_REQ_OP_ERASE_SECTOR:
+        rc = flash_erase_sector_start(req->fr_address);
+        if (rc != 0) {
+            return rc;
+        }
+
+        /* Tick granularity; see the latency note above. */
+        while (flash_busy()) {
+            os_time_delay(1);
+        }
+        return 0;
+
+    default:
+        assert(0);
+        return -1;
+    }
+}
+
+static void
+flash_req_task_handler(void *arg)
+{
+    struct flash_req *req;
+    os_sr_t sr;
+    int rc;
+
+    while (1) {
+        os_sem_pend(&flash_req_sem, OS_TIMEOUT_NEVER);
+
+        OS_ENTER_CRITICAL(sr);
+        req = STAILQ_FIRST(&flash_req_list);
+        if (req != NULL) {
+            STAILQ_REMOVE_HEAD(&flash_req_list, fr_next);
+            req->fr_queued = 0;
+        }
+        OS_EXIT_CRITICAL(sr);
+
+        /* The request may have been cancelled. */
+        if (req == NULL) {
+            continue;
+        }
+
+        rc = flash_req_exec(req);
+        if (req->fr_cb != NULL) {
+            req->fr_cb(req, rc, req->fr_cb_arg);
+        }
+    }
+}
+
+/**
+ * Queues a flash request.  The request must remain valid until its callback
+ * is executed.
+ *
+ * @param req                   The request to queue.
+ *
+ * @return                      0 on success;
+ *                              -1 if the request is malformed or already
+ *                                  queued.
+ */
+int
+flash_req_submit(struct flash_req *req)
+{
+    os_sr_t sr;
+
+    switch (req->fr_op) {
+    case FLASH_REQ_OP_READ:
+    case FLASH_REQ_OP_WRITE:
+    case FLASH_REQ_OP_ERASE_SECTOR:
+        break;
+
+    default:
+        return -1;
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    if (req->fr_queued) {
+        OS_EXIT_CRITICAL(sr);
+        return -1;
+    }
+    req->fr_queued = 1;
+    STAILQ_INSERT_TAIL(&flash_req_list, req, fr_next);
+    OS_EXIT_CRITICAL(sr);
+
+    os_sem_release(&flash_req_sem);
+
+    return 0;
+}
+
+/**
+ * Removes a request from the queue.  A request which the flash task has
+ * already started cannot be cancelled; its callback will still execute.
+ *
+ * @return                      0 if the request was dequeued;
+ *                              -1 if the request was not queued.
+ */
+int
+flash_req_cancel(struct flash_req *req)
+{
+    os_sr_t sr;
+    int rc;
+
+    OS_ENTER_CRITICAL(sr);
+    if (req->fr_queued) {
+        STAILQ_REMOVE(&flash_req_list, req, flash_req, fr_next);
+        req->fr_queued = 0;
+        rc = 0;
+    } else {
+        rc = -1;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    return rc;
+}
+
+/**
+ * Creates the flash task.  Must be called before the OS is started.
+ *
+ * @param prio                  The flash task's priority.
+ * @param stack                 The flash task's stack.
+ * @param stack_size            The size of the stack, in os_stack_t units.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+flash_req_init(uint8_t prio, os_stack_t *stack, uint16_t stack_size)
+{
+    int rc;
+
+    STAILQ_INIT(&flash_req_list);
+
+    rc = os_sem_init(&flash_req_sem, 0);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = os_task_init(&flash_req_task, "flash", flash_req_task_handler, NULL,
+                      prio, OS_WAIT_FOREVER, stack, stack_size);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return 0;
+}
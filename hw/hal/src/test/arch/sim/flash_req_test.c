@@ -0,0 +1,302 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include "testutil/testutil.h"
+#include "os/os.h"
+#include "hal/hal_flash.h"
+#include "hal/hal_test.h"
+#include "mcu/native_flash.h"
+
+#define FLASH_REQ_TEST_STACK_SIZE   1024
+
+/* The test task outranks the flash task, so everything it submits is queued
+ * before the flash task gets to run.
+ */
+#define FLASH_REQ_TEST_TASK_PRIO    1
+#define FLASH_REQ_TEST_FLASH_PRIO   2
+
+/** Sector 1 of the native flash. */
+#define FLASH_REQ_TEST_SECTOR       0x00004000
+
+#define FLASH_REQ_TEST_MAX_DONE     8
+
+static struct os_task flash_req_test_task;
+static os_stack_t flash_req_test_task_stack[
+    OS_STACK_ALIGN(FLASH_REQ_TEST_STACK_SIZE)];
+static os_stack_t flash_req_test_flash_stack[
+    OS_STACK_ALIGN(FLASH_REQ_TEST_STACK_SIZE)];
+
+/** Released by the completion callback. */
+static struct os_sem flash_req_test_sem;
+
+/** Completed requests, in completion order. */
+static struct {
+    struct flash_req *req;
+    int status;
+    os_time_t time;
+} flash_req_test_done[FLASH_REQ_TEST_MAX_DONE];
+static int flash_req_test_num_done;
+
+static struct flash_req flash_req_test_reqs[5];
+
+static void
+flash_req_test_restart(void)
+{
+    struct sigaction sa;
+    struct itimerval it;
+
+    g_os_started = 0;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGALRM, &sa, NULL);
+    sigaction(SIGVTALRM, &sa, NULL);
+
+    memset(&it, 0, sizeof it);
+    setitimer(ITIMER_VIRTUAL, &it, NULL);
+
+    tu_restart();
+}
+
+static void
+flash_req_test_cb(struct flash_req *req, int status, void *arg)
+{
+    TEST_ASSERT_FATAL(flash_req_test_num_done < FLASH_REQ_TEST_MAX_DONE);
+
+    flash_req_test_done[flash_req_test_num_done].req = req;
+    flash_req_test_done[flash_req_test_num_done].status = status;
+    flash_req_test_done[flash_req_test_num_done].time = os_time_get();
+    flash_req_test_num_done++;
+
+    os_sem_release(&flash_req_test_sem);
+}
+
+static void
+flash_req_test_fill(struct flash_req *req, uint8_t op, uint32_t address,
+                    uint32_t num_bytes, void *dst, const void *src)
+{
+    memset(req, 0, sizeof *req);
+    req->fr_op = op;
+    req->fr_address = address;
+    req->fr_num_bytes = num_bytes;
+    req->fr_dst = dst;
+    req->fr_src = src;
+    req->fr_cb = flash_req_test_cb;
+}
+
+static void
+flash_req_test_wait(int num_done)
+{
+    int rc;
+
+    while (flash_req_test_num_done < num_done) {
+        rc = os_sem_pend(&flash_req_test_sem, OS_TICKS_PER_SEC);
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+}
+
+static void
+flash_req_test_init(os_task_func_t handler)
+{
+    struct flash_native_timing timing;
+    int rc;
+
+    memset(flash_req_test_done, 0, sizeof flash_req_test_done);
+    flash_req_test_num_done = 0;
+
+    /* Erases run in the background for a few ticks. */
+    memset(&timing, 0, sizeof timing);
+    timing.fnt_erase_us_per_sector = 3000;
+    timing.fnt_async_pct = 100;
+    flash_native_timing_set(&timing);
+
+    os_init();
+
+    rc = os_sem_init(&flash_req_test_sem, 0);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    rc = flash_req_init(FLASH_REQ_TEST_FLASH_PRIO, flash_req_test_flash_stack,
+                        OS_STACK_ALIGN(FLASH_REQ_TEST_STACK_SIZE));
+    TEST_ASSERT_FATAL(rc == 0);
+
+    os_task_init(&flash_req_test_task, "flash_req_test", handler, NULL,
+                 FLASH_REQ_TEST_TASK_PRIO, OS_WAIT_FOREVER,
+                 flash_req_test_task_stack,
+                 OS_STACK_ALIGN(FLASH_REQ_TEST_STACK_SIZE));
+
+    os_start();
+}
+
+static void
+flash_req_test_order_handler(void *arg)
+{
+    static const uint8_t data[4] = { 1, 2, 3, 4 };
+    struct flash_req *reqs;
+    uint8_t buf1[8];
+    uint8_t buf2[4];
+    os_time_t start;
+    int rc;
+    int i;
+
+    reqs = flash_req_test_reqs;
+
+    /* Dirty the sector so that the erase is observable. */
+    rc = flash_erase_sector(FLASH_REQ_TEST_SECTOR);
+    TEST_ASSERT_FATAL(rc == 0);
+    memset(buf1, 0, sizeof buf1);
+    rc = flash_write(FLASH_REQ_TEST_SECTOR, buf1, sizeof buf1);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = flash_write(FLASH_REQ_TEST_SECTOR + 16, buf1, sizeof buf2);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    flash_req_test_fill(reqs + 0, FLASH_REQ_OP_ERASE_SECTOR,
+                        FLASH_REQ_TEST_SECTOR, 0, NULL, NULL);
+    flash_req_test_fill(reqs + 1, FLASH_REQ_OP_WRITE,
+                        FLASH_REQ_TEST_SECTOR, sizeof data, NULL, data);
+    flash_req_test_fill(reqs + 2, FLASH_REQ_OP_READ,
+                        FLASH_REQ_TEST_SECTOR, sizeof buf1, buf1, NULL);
+    flash_req_test_fill(reqs + 3, FLASH_REQ_OP_WRITE,
+                        FLASH_REQ_TEST_SECTOR + 16, sizeof data, NULL, data);
+    flash_req_test_fill(reqs + 4, FLASH_REQ_OP_READ,
+                        FLASH_REQ_TEST_SECTOR + 16, sizeof buf2, buf2, NULL);
+
+    start = os_time_get();
+    for (i = 0; i < 5; i++) {
+        rc = flash_req_submit(reqs + i);
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+
+    /* A request cannot be queued twice. */
+    rc = flash_req_submit(reqs + 1);
+    TEST_ASSERT(rc == -1);
+
+    /* Cancel a queued request; a second cancel fails. */
+    rc = flash_req_cancel(reqs + 3);
+    TEST_ASSERT(rc == 0);
+    rc = flash_req_cancel(reqs + 3);
+    TEST_ASSERT(rc == -1);
+
+    flash_req_test_wait(4);
+
+    /* Completions arrive in submission order; the cancelled request never
+     * completes.
+     */
+    TEST_ASSERT(flash_req_test_done[0].req == reqs + 0);
+    TEST_ASSERT(flash_req_test_done[1].req == reqs + 1);
+    TEST_ASSERT(flash_req_test_done[2].req == reqs + 2);
+    TEST_ASSERT(flash_req_test_done[3].req == reqs + 4);
+    for (i = 0; i < 4; i++) {
+        TEST_ASSERT(flash_req_test_done[i].status == 0);
+    }
+
+    /* The erase finished before the write, and the read saw the write. */
+    TEST_ASSERT(memcmp(buf1, data, sizeof data) == 0);
+    for (i = sizeof data; i < sizeof buf1; i++) {
+        TEST_ASSERT(buf1[i] == 0xff);
+    }
+
+    /* The cancelled write was not executed. */
+    for (i = 0; i < sizeof buf2; i++) {
+        TEST_ASSERT(buf2[i] == 0xff);
+    }
+
+    /* The erase is polled once per tick, so its completion is observed on a
+     * later tick than its submission.
+     */
+    TEST_ASSERT(OS_TIME_TICK_GT(flash_req_test_done[0].time, start));
+    TEST_ASSERT(OS_TIME_TICK_GEQ(flash_req_test_done[1].time,
+                                flash_req_test_done[0].time));
+
+    flash_req_test_restart();
+}
+
+static void
+flash_req_test_cancel_started_handler(void *arg)
+{
+    struct flash_req *req;
+    int rc;
+
+    req = flash_req_test_reqs;
+    flash_req_test_fill(req, FLASH_REQ_OP_ERASE_SECTOR, FLASH_REQ_TEST_SECTOR,
+                        0, NULL, NULL);
+
+    rc = flash_req_submit(req);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    /* Let the flash task dequeue the request and start the erase. */
+    while (req->fr_queued) {
+        os_time_delay(1);
+    }
+    TEST_ASSERT(flash_req_test_num_done == 0);
+
+    /* An erase in progress cannot be cancelled; its callback still runs. */
+    rc = flash_req_cancel(req);
+    TEST_ASSERT(rc == -1);
+
+    flash_req_test_wait(1);
+    TEST_ASSERT(flash_req_test_done[0].req == req);
+    TEST_ASSERT(flash_req_test_done[0].status == 0);
+
+    /* A completed request can be submitted again. */
+    rc = flash_req_submit(req);
+    TEST_ASSERT(rc == 0);
+    flash_req_test_wait(2);
+    TEST_ASSERT(flash_req_test_done[1].req == req);
+
+    flash_req_test_restart();
+}
+
+TEST_CASE(flash_req_test_order)
+{
+    flash_req_test_init(flash_req_test_order_handler);
+}
+
+TEST_CASE(flash_req_test_cancel_started)
+{
+    flash_req_test_init(flash_req_test_cancel_started_handler);
+}
+
+TEST_SUITE(flash_req_test_suite)
+{
+    flash_req_test_order();
+    flash_req_test_cancel_started();
+}
+
+int
+hal_test_all(void)
+{
+    flash_req_test_suite();
+
+    return tu_any_failed;
+}
+
+#ifdef PKG_TEST
+
+int
+main(void)
+{
+    tu_config.tc_print_results = 1;
+    tu_init();
+
+    hal_test_all();
+
+    return tu_any_failed;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_NATIVE_CPUTIME_
+#define H_NATIVE_CPUTIME_
+
+#include <inttypes.h>
+
+/**
+ * Manual clock, for deterministic tests.  Once set, cputime stands still
+ * except when advanced, and timers expire exactly on time, in the context of
+ * the caller of cputime_native_advance().
+ */
+void cputime_native_manual_set(uint32_t cputime);
+void cputime_native_advance(uint32_t ticks);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_NATIVE_FLASH_
+#define H_NATIVE_FLASH_
+
+#include <inttypes.h>
+
+/**
+ * Simulated device timing.  Synchronous operations do not sleep; they
+ * accumulate the time the modelled part would have spent busy, so that
+ * benchmarks can report device time alongside host time.  An erase started
+ * with flash_erase_sector_start() keeps the flash busy for
+ * fnt_async_pct percent of its modelled duration in host time.
+ */
+struct flash_native_timing {
+    uint32_t fnt_read_ns_per_byte;
+    uint32_t fnt_prog_ns_per_byte;
+    uint32_t fnt_erase_us_per_sector;
+    uint32_t fnt_erase_us_per_kb;
+    uint32_t fnt_async_pct;
+};
+
+struct flash_native_stats {
+    uint64_t fns_bytes_read;
+    uint64_t fns_bytes_written;
+    uint64_t fns_bytes_erased;
+    uint32_t fns_num_reads;
+    uint32_t fns_num_writes;
+    uint32_t fns_num_erases;
+    uint64_t fns_device_ns;
+};
+
+int flash_native_file_set(const char *path);
+void flash_native_timing_set(const struct flash_native_timing *timing);
+void flash_native_stats_get(struct flash_native_stats *out_stats);
+void flash_native_stats_clear(void);
+int flash_native_fail_after(int num_ops);
+int flash_native_num_sectors(void);
+int flash_native_sector_info(int sector_idx, uint32_t *out_offset,
+                             uint32_t *out_length, uint32_t *out_erase_cnt);
+
+int flash_native_overwrite(uint32_t address, const void *src,
+                           uint32_t length);
+int flash_native_memset(uint32_t offset, uint8_t c, uint32_t len);
+
+#endif
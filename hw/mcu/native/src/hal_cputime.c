@@ -0,0 +1,453 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include "os/os.h"
+#include "hal/hal_cputime.h"
+#include "mcu/native_cputime.h"
+
+/*
+ * cputime for the native MCU.  The counter is derived from the host's
+ * monotonic clock, so all processes on a host see the same cputime (as long
+ * as they use the same frequency).  There is no timer interrupt; expired
+ * timers are found by a poller task.
+ *
+ * The poller runs at the highest task priority and checks once per OS tick,
+ * so a callback runs between 0 and 1 / OS_TICKS_PER_SEC seconds (1 ms on the
+ * sim arch) after its expiry, plus however long the host takes to schedule
+ * the process.  Nothing in the OS can delay it further.  The worst lateness
+ * seen is kept in g_cputime.max_late_ticks.  Code that needs exact timing
+ * (e.g. the simulated PHY) must work from the timer's expiry time rather than
+ * from the time the callback runs.
+ *
+ * For deterministic tests, the clock can be switched to manual mode with
+ * cputime_native_manual_set(); see mcu/native_cputime.h.
+ */
+
+#define CPUTIME_POLLER_STACK_SZ     1024
+#define CPUTIME_POLLER_PRIO         0
+
+/* CPUTIME data */
+struct cputime_data
+{
+    uint32_t ticks_per_usec;    /* number of ticks per usec */
+    uint32_t timer_isrs;        /* Number of timer "interrupts" (polls) */
+    uint32_t ocmp_ints;         /* Number of expired timers */
+    uint32_t max_late_ticks;    /* Worst callback lateness seen */
+};
+struct cputime_data g_cputime;
+
+/* Manual clock; see cputime_native_manual_set() */
+static uint8_t cputime_manual;
+static uint64_t cputime_manual_now;
+
+/* Queue for timers */
+TAILQ_HEAD(cputime_qhead, cpu_timer) g_cputimer_q;
+
+static struct os_task cputime_poller_task;
+static os_stack_t cputime_poller_stack[CPUTIME_POLLER_STACK_SZ];
+
+/**
+ * cputime chk expiration
+ *
+ * Iterates through the cputimer queue to determine if any timers have expired.
+ * If the timer has expired the timer is removed from the queue and the timer
+ * callback function is executed.
+ */
+static void
+cputime_chk_expiration(void)
+{
+    os_sr_t sr;
+    uint32_t late;
+    struct cpu_timer *timer;
+
+    OS_ENTER_CRITICAL(sr);
+    ++g_cputime.timer_isrs;
+    while ((timer = TAILQ_FIRST(&g_cputimer_q)) != NULL) {
+        late = cputime_get32() - timer->cputime;
+        if ((int32_t)late >= 0) {
+            if (late > g_cputime.max_late_ticks) {
+                g_cputime.max_late_ticks = late;
+            }
+            TAILQ_REMOVE(&g_cputimer_q, timer, link);
+            timer->link.tqe_prev = NULL;
+            ++g_cputime.ocmp_ints;
+            timer->cb(timer->arg);
+        } else {
+            break;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+}
+
+static void
+cputime_poller(void *arg)
+{
+    while (1) {
+        cputime_chk_expiration();
+        os_time_delay(1);
+    }
+}
+
+/**
+ * cputime init
+ *
+ * Initialize the cputime module. This must be called after os_init is called
+ * and before any other timer API are used. This should be called only once
+ * and should be called before the hardware timer is used.
+ *
+ * @param clock_freq The desired cputime frequency, in hertz (Hz).
+ *
+ * @return int 0 on success; -1 on error.
+ */
+int
+cputime_init(uint32_t clock_freq)
+{
+    int rc;
+
+    /* Clock frequency must be a whole number of MHz */
+    if ((clock_freq < 1000000U) || ((clock_freq % 1000000U) != 0)) {
+        return -1;
+    }
+
+    TAILQ_INIT(&g_cputimer_q);
+    g_cputime.ticks_per_usec = clock_freq / 1000000U;
+
+    rc = os_task_init(&cputime_poller_task, "cputime_poller", cputime_poller,
+                      NULL, CPUTIME_POLLER_PRIO, OS_WAIT_FOREVER,
+                      cputime_poller_stack, CPUTIME_POLLER_STACK_SZ);
+    if (rc != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * cputime get64
+ *
+ * Returns cputime as a 64-bit number.
+ *
+ * @return uint64_t The 64-bit representation of cputime.
+ */
+uint64_t
+cputime_get64(void)
+{
+    struct timespec ts;
+    uint64_t usecs;
+
+    if (cputime_manual) {
+        return cputime_manual_now;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    usecs = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    return usecs * g_cputime.ticks_per_usec;
+}
+
+/**
+ * cputime get32
+ *
+ * Returns the low 32 bits of cputime.
+ *
+ * @return uint32_t The lower 32 bits of cputime
+ */
+uint32_t
+cputime_get32(void)
+{
+    return (uint32_t)cputime_get64();
+}
+
+/**
+ * cputime nsecs to ticks
+ *
+ * Converts the given number of nanoseconds into cputime ticks.
+ *
+ * @param usecs The number of nanoseconds to convert to ticks
+ *
+ * @return uint32_t The number of ticks corresponding to 'nsecs'
+ */
+uint32_t
+cputime_nsecs_to_ticks(uint32_t nsecs)
+{
+    uint32_t ticks;
+
+    ticks = ((nsecs * g_cputime.ticks_per_usec) + 999) / 1000;
+    return ticks;
+}
+
+/**
+ * cputime ticks to nsecs
+ *
+ * Convert the given number of ticks into nanoseconds.
+ *
+ * @param ticks The number of ticks to convert to nanoseconds.
+ *
+ * @return uint32_t The number of nanoseconds corresponding to 'ticks'
+ */
+uint32_t
+cputime_ticks_to_nsecs(uint32_t ticks)
+{
+    uint32_t nsecs;
+
+    nsecs = ((ticks * 1000) + (g_cputime.ticks_per_usec - 1)) /
+            g_cputime.ticks_per_usec;
+
+    return nsecs;
+}
+
+/**
+ * cputime usecs to ticks
+ *
+ * Converts the given number of microseconds into cputime ticks.
+ *
+ * @param usecs The number of microseconds to convert to ticks
+ *
+ * @return uint32_t The number of ticks corresponding to 'usecs'
+ */
+uint32_t
+cputime_usecs_to_ticks(uint32_t usecs)
+{
+    uint32_t ticks;
+
+    ticks = (usecs * g_cputime.ticks_per_usec);
+    return ticks;
+}
+
+/**
+ * cputime ticks to usecs
+ *
+ * Convert the given number of ticks into microseconds.
+ *
+ * @param ticks The number of ticks to convert to microseconds.
+ *
+ * @return uint32_t The number of microseconds corresponding to 'ticks'
+ */
+uint32_t
+cputime_ticks_to_usecs(uint32_t ticks)
+{
+    uint32_t us;
+
+    us =  (ticks + (g_cputime.ticks_per_usec - 1)) / g_cputime.ticks_per_usec;
+    return us;
+}
+
+/**
+ * cputime delay ticks
+ *
+ * Wait until the number of ticks has elapsed. This is a blocking delay.
+ *
+ * @param ticks The number of ticks to wait.
+ */
+void
+cputime_delay_ticks(uint32_t ticks)
+{
+    uint32_t until;
+
+    until = cputime_get32() + ticks;
+    while ((int32_t)(cputime_get32() - until) < 0) {
+        /* Loop here till finished */
+    }
+}
+
+/**
+ * cputime delay nsecs
+ *
+ * Wait until 'nsecs' nanoseconds has elapsed. This is a blocking delay.
+ *
+ * @param nsecs The number of nanoseconds to wait.
+ */
+void
+cputime_delay_nsecs(uint32_t nsecs)
+{
+    uint32_t ticks;
+
+    ticks = cputime_nsecs_to_ticks(nsecs);
+    cputime_delay_ticks(ticks);
+}
+
+/**
+ * cputime delay usecs
+ *
+ * Wait until 'usecs' microseconds has elapsed. This is a blocking delay.
+ *
+ * @param usecs The number of usecs to wait.
+ */
+void
+cputime_delay_usecs(uint32_t usecs)
+{
+    uint32_t ticks;
+
+    ticks = cputime_usecs_to_ticks(usecs);
+    cputime_delay_ticks(ticks);
+}
+
+/**
+ * cputime timer init
+ *
+ *
+ * @param timer The timer to initialize. Cannot be NULL.
+ * @param fp    The timer callback function. Cannot be NULL.
+ * @param arg   Pointer to data object to pass to timer.
+ */
+void
+cputime_timer_init(struct cpu_timer *timer, cputimer_func fp, void *arg)
+{
+    assert(timer != NULL);
+    assert(fp != NULL);
+
+    timer->cb = fp;
+    timer->arg = arg;
+    timer->link.tqe_prev = (void *) NULL;
+}
+
+/**
+ * cputime timer start
+ *
+ * Start a cputimer that will expire at 'cputime'. If cputime has already
+ * passed, the timer callback will still be called (from the poller task).
+ * Restarting a running timer moves it to the new expiry time.
+ *
+ * @param timer     Pointer to timer to start. Cannot be NULL.
+ * @param cputime   The cputime at which the timer should expire.
+ */
+void
+cputime_timer_start(struct cpu_timer *timer, uint32_t cputime)
+{
+    struct cpu_timer *entry;
+    os_sr_t sr;
+
+    assert(timer != NULL);
+
+    OS_ENTER_CRITICAL(sr);
+
+    if (timer->link.tqe_prev != NULL) {
+        TAILQ_REMOVE(&g_cputimer_q, timer, link);
+    }
+
+    timer->cputime = cputime;
+    TAILQ_FOREACH(entry, &g_cputimer_q, link) {
+        if ((int32_t)(timer->cputime - entry->cputime) < 0) {
+            TAILQ_INSERT_BEFORE(entry, timer, link);
+            break;
+        }
+    }
+    if (!entry) {
+        TAILQ_INSERT_TAIL(&g_cputimer_q, timer, link);
+    }
+
+    OS_EXIT_CRITICAL(sr);
+}
+
+/**
+ * cputimer timer relative
+ *
+ * Sets a cpu timer that will expire 'usecs' microseconds from the current
+ * cputime.
+ *
+ * @param timer Pointer to timer. Cannot be NULL.
+ * @param usecs The number of usecs from now at which the timer will expire.
+ */
+void
+cputime_timer_relative(struct cpu_timer *timer, uint32_t usecs)
+{
+    uint32_t cputime;
+
+    assert(timer != NULL);
+
+    cputime = cputime_get32() + cputime_usecs_to_ticks(usecs);
+    cputime_timer_start(timer, cputime);
+}
+
+/**
+ * cputime timer stop
+ *
+ * Stops a cputimer from running. The timer is removed from the timer queue.
+ * Can be called even if timer is not running.
+ *
+ * @param timer Pointer to cputimer to stop. Cannot be NULL.
+ */
+void
+cputime_timer_stop(struct cpu_timer *timer)
+{
+    os_sr_t sr;
+
+    assert(timer != NULL);
+
+    OS_ENTER_CRITICAL(sr);
+
+    if (timer->link.tqe_prev != NULL) {
+        TAILQ_REMOVE(&g_cputimer_q, timer, link);
+        timer->link.tqe_prev = NULL;
+    }
+
+    OS_EXIT_CRITICAL(sr);
+}
+
+/**
+ * cputime native manual set
+ *
+ * Stops the clock at the given cputime. From now on, cputime only moves when
+ * cputime_native_advance() is called. Must be called after cputime_init().
+ *
+ * @param cputime The cputime at which to start.
+ */
+void
+cputime_native_manual_set(uint32_t cputime)
+{
+    cputime_manual = 1;
+    cputime_manual_now = cputime;
+}
+
+/**
+ * cputime native advance
+ *
+ * Moves a manual clock forward. The timers that expire on the way are run in
+ * order, from the calling context; while a callback runs, cputime is the
+ * timer's expiry time, so callbacks are never late.
+ *
+ * @param ticks The number of ticks to move the clock forward by.
+ */
+void
+cputime_native_advance(uint32_t ticks)
+{
+    os_sr_t sr;
+    uint32_t until;
+    struct cpu_timer *timer;
+
+    assert(cputime_manual);
+
+    until = (uint32_t)cputime_manual_now + ticks;
+
+    OS_ENTER_CRITICAL(sr);
+    while ((timer = TAILQ_FIRST(&g_cputimer_q)) != NULL) {
+        if ((int32_t)(until - timer->cputime) < 0) {
+            break;
+        }
+        if ((int32_t)(timer->cputime - (uint32_t)cputime_manual_now) > 0) {
+            cputime_manual_now += timer->cputime - (uint32_t)cputime_manual_now;
+        }
+        TAILQ_REMOVE(&g_cputimer_q, timer, link);
+        timer->link.tqe_prev = NULL;
+        ++g_cputime.ocmp_ints;
+        timer->cb(timer->arg);
+    }
+    cputime_manual_now += until - (uint32_t)cputime_manual_now;
+    OS_EXIT_CRITICAL(sr);
+}
@@ -14,13 +14,41 @@
  * limitations under the License.
  */
 
-#include <stdio.h>
+/**
+ * Simulated flash for the native target.  The flash contents live in a
+ * memory mapping; reads, writes, and erases are plain memory operations.  By
+ * default the mapping is anonymous, so each run starts with erased flash.  If
+ * a backing file is specified via flash_native_file_set(), the file is mapped
+ * instead and its contents persist across runs.
+ *
+ * Each operation is charged against a simple timing model, and erases are
+ * counted per sector.  See mcu/native_flash.h.
+ *
+ * Asynchronous erases are performed by a worker thread.  The worker never
+ * calls into the OS; it only touches the flash mapping and clears the busy
+ * flag when it is done.  Other flash operations wait for an outstanding erase
+ * to complete, as a read or program stalls on hardware while the bank is
+ * being erased.
+ */
+
 #include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "hal/hal_flash.h"
+#include "mcu/native_flash.h"
 
-static FILE *file;
+static char *flash_native_path;
+static uint8_t *flash_native_mem;
+static uint32_t flash_native_size;
 
 static const struct flash_area_desc {
     uint32_t fad_offset;
@@ -44,107 +72,417 @@ static const struct flash_area_desc {
 #define FLASH_NUM_AREAS   (int)(sizeof flash_area_descs /       \
                                 sizeof flash_area_descs[0])
 
-static void
-flash_native_erase(uint32_t addr, uint32_t len)
+static uint32_t flash_native_erase_cnts[FLASH_NUM_AREAS];
+
+/**
+ * Default timing roughly follows the STM32F4 datasheet typicals (168 MHz,
+ * x8 program parallelism): 16 us per programmed byte, and sector erases of
+ * 0.5 s (16 KB) to 2 s (128 KB).
+ */
+static struct flash_native_timing flash_native_timing = {
+    .fnt_read_ns_per_byte = 6,
+    .fnt_prog_ns_per_byte = 16000,
+    .fnt_erase_us_per_sector = 250000,
+    .fnt_erase_us_per_kb = 14000,
+    .fnt_async_pct = 0,
+};
+
+static struct flash_native_stats flash_native_stats;
+
+/**
+ * Number of program and erase operations permitted before all such
+ * operations fail; -1 means no limit.
+ */
+static int flash_native_ops_left = -1;
+
+/** Number of operations which failed due to the limit. */
+static int flash_native_ops_failed;
+
+/** Written by the OS side to wake the erase worker. */
+static int flash_native_worker_pipe[2];
+static int flash_native_worker_started;
+static pthread_t flash_native_worker_thread;
+
+/** Description of the outstanding asynchronous erase. */
+static uint32_t flash_native_async_offset;
+static uint32_t flash_native_async_length;
+static uint64_t flash_native_async_delay_ns;
+static int flash_native_async_busy;
+
+/**
+ * Maps the backing file, creating it if necessary.  Any portion of the file
+ * which did not previously exist is initialized to the erased state.
+ */
+static uint8_t *
+flash_native_map_file(const char *path, uint32_t size)
 {
-    static uint8_t buf[256];
-    uint32_t end;
-    int chunk_sz;
+    struct stat st;
+    void *map;
+    int fd;
     int rc;
 
-    end = addr + len;
-    memset(buf, 0xff, sizeof buf);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return NULL;
+    }
 
-    rc = fseek(file, addr, SEEK_SET);
-    assert(rc == 0);
+    rc = fstat(fd, &st);
+    if (rc != 0) {
+        close(fd);
+        return NULL;
+    }
 
-    while (addr < end) {
-        if (end - addr < sizeof buf) {
-            chunk_sz = end - addr;
-        } else {
-            chunk_sz = sizeof buf;
+    if (st.st_size < size) {
+        rc = ftruncate(fd, size);
+        if (rc != 0) {
+            close(fd);
+            return NULL;
         }
-        rc = fwrite(buf, chunk_sz, 1, file);
-        assert(rc == 1);
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    /* The mapping keeps the file referenced. */
+    close(fd);
 
-        addr += chunk_sz;
+    if (map == MAP_FAILED) {
+        return NULL;
     }
-    fflush(file);
+
+    if (st.st_size < size) {
+        memset((uint8_t *)map + st.st_size, 0xff, size - st.st_size);
+    }
+
+    return map;
 }
 
 static void
-flash_native_ensure_file_open(void)
+flash_native_ensure_open(void)
 {
-    int expected_sz;
+    void *map;
+    uint32_t size;
     int i;
 
-    if (file == NULL) {
-        expected_sz = 0;
-        for (i = 0; i < FLASH_NUM_AREAS; i++) {
-            expected_sz += flash_area_descs[i].fad_length;
+    if (flash_native_mem != NULL) {
+        return;
+    }
+
+    size = 0;
+    for (i = 0; i < FLASH_NUM_AREAS; i++) {
+        size += flash_area_descs[i].fad_length;
+    }
+
+    if (flash_native_path != NULL) {
+        map = flash_native_map_file(flash_native_path, size);
+        assert(map != NULL);
+    } else {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(map != MAP_FAILED);
+        memset(map, 0xff, size);
+    }
+
+    flash_native_mem = map;
+    flash_native_size = size;
+}
+
+static void
+flash_native_async_wait(void)
+{
+    while (__atomic_load_n(&flash_native_async_busy, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void *
+flash_native_worker(void *arg)
+{
+    struct timespec ts;
+    uint8_t b;
+
+    while (1) {
+        if (read(flash_native_worker_pipe[0], &b, 1) != 1) {
+            continue;
+        }
+
+        memset(flash_native_mem + flash_native_async_offset, 0xff,
+               flash_native_async_length);
+
+        if (flash_native_async_delay_ns != 0) {
+            ts.tv_sec = flash_native_async_delay_ns / 1000000000;
+            ts.tv_nsec = flash_native_async_delay_ns % 1000000000;
+            while (nanosleep(&ts, &ts) != 0) {
+            }
         }
 
-        file = tmpfile();
-        assert(file != NULL);
-        flash_native_erase(0, expected_sz);
+        __atomic_store_n(&flash_native_async_busy, 0, __ATOMIC_RELEASE);
     }
+
+    return NULL;
 }
 
+/**
+ * Starts the erase worker thread.  All signals are blocked in the worker so
+ * that the sim OS tick and context switch signals are always delivered to the
+ * thread running the OS.
+ */
 static int
-flash_native_write_internal(uint32_t address, const void *src, uint32_t length,
-                            int allow_overwrite)
+flash_native_worker_start(void)
 {
-    static uint8_t buf[256];
-    uint32_t cur;
-    uint32_t end;
-    int chunk_sz;
+    sigset_t all;
+    sigset_t prev;
     int rc;
-    int i;
 
-    if (length == 0) {
+    if (flash_native_worker_started) {
         return 0;
     }
 
-    end = address + length;
+    rc = pipe(flash_native_worker_pipe);
+    if (rc != 0) {
+        return -1;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    rc = pthread_create(&flash_native_worker_thread, NULL,
+                        flash_native_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    if (rc != 0) {
+        close(flash_native_worker_pipe[0]);
+        close(flash_native_worker_pipe[1]);
+        return -1;
+    }
 
-    flash_native_ensure_file_open();
+    flash_native_worker_started = 1;
+    return 0;
+}
 
-    fseek(file, address, SEEK_SET);
+static int
+flash_native_range_ok(uint32_t address, uint32_t length)
+{
+    return address <= flash_native_size &&
+           length <= flash_native_size - address;
+}
 
-    cur = address;
-    while (cur < end) {
-        if (end - cur < sizeof buf) {
-            chunk_sz = end - cur;
-        } else {
-            chunk_sz = sizeof buf;
-        }
+/**
+ * Specifies a file to back the simulated flash.  The file's contents persist
+ * across runs; a new or short file is extended with erased flash.  This must
+ * be called before flash is first accessed.
+ *
+ * @param path                  The path of the backing file.
+ *
+ * @return                      0 on success;
+ *                              -1 if flash is already in use or on
+ *                                  allocation failure.
+ */
+int
+flash_native_file_set(const char *path)
+{
+    char *copy;
 
-        /* Ensure data is not being overwritten. */
-        if (!allow_overwrite) {
-            rc = flash_read(cur, buf, chunk_sz);
-            assert(rc == 0);
-            for (i = 0; i < chunk_sz; i++) {
-                assert(buf[i] == 0xff);
-            }
-        }
+    if (flash_native_mem != NULL) {
+        return -1;
+    }
+
+    copy = strdup(path);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    free(flash_native_path);
+    flash_native_path = copy;
+
+    return 0;
+}
+
+void
+flash_native_timing_set(const struct flash_native_timing *timing)
+{
+    flash_native_timing = *timing;
+}
+
+void
+flash_native_stats_get(struct flash_native_stats *out_stats)
+{
+    *out_stats = flash_native_stats;
+}
+
+void
+flash_native_stats_clear(void)
+{
+    memset(&flash_native_stats, 0, sizeof flash_native_stats);
+}
+
+/**
+ * Simulates a power failure: after the specified number of further program
+ * and erase operations succeed, every subsequent program or erase fails
+ * without modifying flash.  Used by tests to interrupt an operation at each
+ * possible step.
+ *
+ * @param num_ops               The number of operations to permit; -1 to
+ *                                  remove the limit.
+ *
+ * @return                      The number of operations which failed due to
+ *                                  the previous limit.
+ */
+int
+flash_native_fail_after(int num_ops)
+{
+    int num_failed;
+
+    num_failed = flash_native_ops_failed;
+    flash_native_ops_failed = 0;
+    flash_native_ops_left = num_ops;
+
+    return num_failed;
+}
+
+/**
+ * Consumes one permitted program or erase operation.
+ *
+ * @return                      0 if the operation may proceed;
+ *                              -1 if it should fail.
+ */
+static int
+flash_native_op_permitted(void)
+{
+    if (flash_native_ops_left == -1) {
+        return 0;
+    }
+
+    if (flash_native_ops_left == 0) {
+        flash_native_ops_failed++;
+        return -1;
+    }
+
+    flash_native_ops_left--;
+    return 0;
+}
 
-        cur += chunk_sz;
+int
+flash_native_num_sectors(void)
+{
+    return FLASH_NUM_AREAS;
+}
+
+/**
+ * Retrieves the location and wear of the specified sector.  Erase counts are
+ * kept in RAM, so they cover the current run only.
+ *
+ * @return                      0 on success;
+ *                              -1 if the sector index is invalid.
+ */
+int
+flash_native_sector_info(int sector_idx, uint32_t *out_offset,
+                         uint32_t *out_length, uint32_t *out_erase_cnt)
+{
+    if (sector_idx < 0 || sector_idx >= FLASH_NUM_AREAS) {
+        return -1;
+    }
+
+    if (out_offset != NULL) {
+        *out_offset = flash_area_descs[sector_idx].fad_offset;
+    }
+    if (out_length != NULL) {
+        *out_length = flash_area_descs[sector_idx].fad_length;
+    }
+    if (out_erase_cnt != NULL) {
+        *out_erase_cnt = flash_native_erase_cnts[sector_idx];
+    }
+
+    return 0;
+}
+
+/**
+ * Charges an erase of the specified area to the timing and wear model.
+ *
+ * @return                      The modelled duration of the erase, in ns.
+ */
+static uint64_t
+flash_native_erase_account(int area_idx)
+{
+    const struct flash_area_desc *area;
+    uint64_t ns;
+
+    area = flash_area_descs + area_idx;
+
+    ns = (uint64_t)flash_native_timing.fnt_erase_us_per_sector * 1000 +
+         (uint64_t)flash_native_timing.fnt_erase_us_per_kb *
+            area->fad_length / 1024 * 1000;
+
+    flash_native_erase_cnts[area_idx]++;
+    flash_native_stats.fns_num_erases++;
+    flash_native_stats.fns_bytes_erased += area->fad_length;
+    flash_native_stats.fns_device_ns += ns;
+
+    return ns;
+}
+
+static void
+flash_native_erase_area(int area_idx)
+{
+    const struct flash_area_desc *area;
+
+    area = flash_area_descs + area_idx;
+    memset(flash_native_mem + area->fad_offset, 0xff, area->fad_length);
+
+    flash_native_erase_account(area_idx);
+}
+
+static int
+flash_native_write_internal(uint32_t address, const void *src, uint32_t length,
+                            int allow_overwrite)
+{
+    uint32_t i;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    flash_native_ensure_open();
+    flash_native_async_wait();
+
+    if (!flash_native_range_ok(address, length)) {
+        return -1;
+    }
+
+    /* Ensure data is not being overwritten. */
+    if (!allow_overwrite) {
+        for (i = 0; i < length; i++) {
+            assert(flash_native_mem[address + i] == 0xff);
+        }
     }
 
-    fseek(file, address, SEEK_SET);
-    rc = fwrite(src, length, 1, file);
-    assert(rc == 1);
+    memcpy(flash_native_mem + address, src, length);
 
-    fflush(file);
     return 0;
 }
 
 int
 flash_write(uint32_t address, const void *src, uint32_t length)
 {
-    return flash_native_write_internal(address, src, length, 0);
+    int rc;
+
+    if (flash_native_op_permitted() != 0) {
+        return -1;
+    }
+
+    rc = flash_native_write_internal(address, src, length, 0);
+    if (rc == 0) {
+        flash_native_stats.fns_num_writes++;
+        flash_native_stats.fns_bytes_written += length;
+        flash_native_stats.fns_device_ns +=
+            (uint64_t)flash_native_timing.fnt_prog_ns_per_byte * length;
+    }
+
+    return rc;
 }
 
+/**
+ * Writes to flash without checking that the destination is erased, and
+ * without charging the operation to the timing model.  Used by tests to
+ * simulate corruption.
+ */
 int
 flash_native_overwrite(uint32_t address, const void *src, uint32_t length)
 {
@@ -154,38 +492,63 @@ flash_native_overwrite(uint32_t address, const void *src, uint32_t length)
 int
 flash_native_memset(uint32_t offset, uint8_t c, uint32_t len)
 {
-    uint8_t buf[256];
-    int chunk_sz;
-    int rc;
+    flash_native_ensure_open();
+    flash_native_async_wait();
 
-    memset(buf, c, sizeof buf);
+    if (!flash_native_range_ok(offset, len)) {
+        return -1;
+    }
 
-    while (len > 0) {
-        if (len > sizeof buf) {
-            chunk_sz = sizeof buf;
-        } else {
-            chunk_sz = len;
-        }
+    memset(flash_native_mem + offset, c, len);
 
-        rc = flash_native_overwrite(offset, buf, chunk_sz);
-        if (rc != 0) {
-            return rc;
-        }
+    return 0;
+}
 
-        offset += chunk_sz;
-        len -= chunk_sz;
+int
+flash_read(uint32_t address, void *dst, uint32_t length)
+{
+    flash_native_ensure_open();
+    flash_native_async_wait();
+
+    if (!flash_native_range_ok(address, length)) {
+        return -1;
     }
 
+    memcpy(dst, flash_native_mem + address, length);
+
+    flash_native_stats.fns_num_reads++;
+    flash_native_stats.fns_bytes_read += length;
+    flash_native_stats.fns_device_ns +=
+        (uint64_t)flash_native_timing.fnt_read_ns_per_byte * length;
+
     return 0;
 }
 
+/**
+ * Retrieves a pointer through which the specified flash region can be read
+ * directly.  The pointer refers to the simulated flash itself, so it always
+ * reflects the current flash contents.  The whole region is charged to the
+ * timing model as a read.
+ *
+ * @return                      0 on success;
+ *                              -1 if the region is not within flash.
+ */
 int
-flash_read(uint32_t address, void *dst, uint32_t length)
+flash_map(uint32_t address, uint32_t num_bytes, const void **out_ptr)
 {
-    flash_native_ensure_file_open();
-    fseek(file, address, SEEK_SET);
-    fread(dst, length, 1, file);
+    flash_native_ensure_open();
+    flash_native_async_wait();
+
+    if (!flash_native_range_ok(address, num_bytes)) {
+        return -1;
+    }
+
+    flash_native_stats.fns_num_reads++;
+    flash_native_stats.fns_bytes_read += num_bytes;
+    flash_native_stats.fns_device_ns +=
+        (uint64_t)flash_native_timing.fnt_read_ns_per_byte * num_bytes;
 
+    *out_ptr = flash_native_mem + address;
     return 0;
 }
 
@@ -210,17 +573,21 @@ flash_erase_sector(uint32_t sector_address)
     int sector_id;
     int area_id;
 
-    flash_native_ensure_file_open();
+    flash_native_ensure_open();
+    flash_native_async_wait();
 
     area_id = find_area(sector_address);
     if (area_id == -1) {
         return -1;
     }
 
+    if (flash_native_op_permitted() != 0) {
+        return -1;
+    }
+
     sector_id = flash_area_descs[area_id].fad_sector_id;
     while (1) {
-        flash_native_erase(sector_address,
-                           flash_area_descs[area_id].fad_length);
+        flash_native_erase_area(area_id);
 
         area_id++;
         if (area_id >= FLASH_NUM_AREAS) {
@@ -245,7 +612,8 @@ flash_erase(uint32_t address, uint32_t num_bytes)
     uint32_t end;
     int i;
 
-    flash_native_ensure_file_open();
+    flash_native_ensure_open();
+    flash_native_async_wait();
 
     end = address + num_bytes;
 
@@ -259,16 +627,83 @@ flash_erase(uint32_t address, uint32_t num_bytes)
         if (address >= area->fad_offset &&
             address < area->fad_offset + area->fad_length) {
 
-            flash_native_erase(area->fad_offset, area->fad_length);
+            if (flash_native_op_permitted() != 0) {
+                return -1;
+            }
+            flash_native_erase_area(i);
         }
     }
 
     return 0;
 }
 
+/**
+ * Starts erasing the specified sector and returns without waiting for the
+ * erase to complete.  The erase is performed by the worker thread; use
+ * flash_busy() to determine when it is done.
+ *
+ * @return                      0 on success;
+ *                              -1 if the address is not the start of a
+ *                                  sector, or if the worker could not be
+ *                                  started.
+ */
+int
+flash_erase_sector_start(uint32_t sector_address)
+{
+    uint64_t ns;
+    uint32_t length;
+    uint8_t b;
+    int area_id;
+    int rc;
+
+    flash_native_ensure_open();
+    flash_native_async_wait();
+
+    area_id = find_area(sector_address);
+    if (area_id == -1) {
+        return -1;
+    }
+
+    if (flash_native_op_permitted() != 0) {
+        return -1;
+    }
+
+    rc = flash_native_worker_start();
+    if (rc != 0) {
+        return -1;
+    }
+
+    /* Erase every area belonging to the same sector. */
+    ns = 0;
+    length = 0;
+    do {
+        ns += flash_native_erase_account(area_id);
+        length += flash_area_descs[area_id].fad_length;
+        area_id++;
+    } while (area_id < FLASH_NUM_AREAS &&
+             flash_area_descs[area_id].fad_sector_id ==
+             flash_area_descs[area_id - 1].fad_sector_id);
+
+    flash_native_async_offset = sector_address;
+    flash_native_async_length = length;
+    flash_native_async_delay_ns = ns * flash_native_timing.fnt_async_pct / 100;
+    __atomic_store_n(&flash_native_async_busy, 1, __ATOMIC_RELEASE);
+
+    b = 0;
+    while (write(flash_native_worker_pipe[1], &b, 1) != 1) {
+    }
+
+    return 0;
+}
+
+int
+flash_busy(void)
+{
+    return __atomic_load_n(&flash_native_async_busy, __ATOMIC_ACQUIRE);
+}
+
 int
 flash_init(void)
 {
     return 0;
 }
-
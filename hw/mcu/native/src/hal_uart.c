@@ -18,13 +18,19 @@
 #include "hal/hal_uart.h"
 #include "bsp/bsp.h"
 
+#ifdef __linux__
+#include <pty.h>
+#else
 #include <util.h>
+#endif
 #include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdio.h>
 
-#define UART_MAX_BYTES_PER_POLL	64
+#define UART_MAX_BYTES_PER_POLL	256
 #define UART_POLLER_STACK_SZ	1024
 #define UART_POLLER_PRIO	0
 
@@ -32,11 +38,18 @@ struct uart {
     int u_open;
     int u_fd;
     int u_tx_run;
-    int u_rx_char;
     hal_uart_rx_char u_rx_func;
     hal_uart_tx_char u_tx_func;
     hal_uart_tx_done u_tx_done;
     void *u_func_arg;
+    /* Bytes read but not yet taken by the upper layer */
+    int u_rx_off;
+    int u_rx_len;
+    uint8_t u_rx_buf[UART_MAX_BYTES_PER_POLL];
+    /* Bytes taken from the upper layer but not yet written */
+    int u_tx_off;
+    int u_tx_len;
+    uint8_t u_tx_buf[UART_MAX_BYTES_PER_POLL];
 };
 
 /*
@@ -48,14 +61,88 @@ static int uart_poller_running;
 static struct os_task uart_poller_task;
 static os_stack_t uart_poller_stack[UART_POLLER_STACK_SZ];
 
+/*
+ * Collect up to UART_MAX_BYTES_PER_POLL bytes from the upper layer and write
+ * them with one system call.
+ */
 static void
-uart_poller(void *arg)
+uart_poll_tx(struct uart *uart)
+{
+    int rc;
+    int sr;
+
+    if (uart->u_tx_off == uart->u_tx_len) {
+        uart->u_tx_off = 0;
+        uart->u_tx_len = 0;
+        OS_ENTER_CRITICAL(sr);
+        while (uart->u_tx_run && (uart->u_tx_len < UART_MAX_BYTES_PER_POLL)) {
+            rc = uart->u_tx_func(uart->u_func_arg);
+            if (rc < 0) {
+                /*
+                 * No more data to send.
+                 */
+                uart->u_tx_run = 0;
+                if (uart->u_tx_done) {
+                    uart->u_tx_done(uart->u_func_arg);
+                }
+                break;
+            }
+            uart->u_tx_buf[uart->u_tx_len++] = rc;
+        }
+        OS_EXIT_CRITICAL(sr);
+    }
+
+    if (uart->u_tx_off < uart->u_tx_len) {
+        rc = write(uart->u_fd, uart->u_tx_buf + uart->u_tx_off,
+                   uart->u_tx_len - uart->u_tx_off);
+        if (rc > 0) {
+            uart->u_tx_off += rc;
+        } else if (rc == 0 || errno != EAGAIN) {
+            /* XXX EOF/error, what now? */
+            assert(0);
+        }
+    }
+}
+
+/*
+ * Read up to UART_MAX_BYTES_PER_POLL bytes with one system call and give
+ * them to the upper layer. Bytes it cannot take now are kept for the next
+ * poll.
+ */
+static void
+uart_poll_rx(struct uart *uart)
 {
-    int i;
     int rc;
-    int bytes;
     int sr;
-    char ch;
+
+    if (uart->u_rx_off == uart->u_rx_len) {
+        rc = read(uart->u_fd, uart->u_rx_buf, UART_MAX_BYTES_PER_POLL);
+        if (rc == 0) {
+            /* XXX EOF, what now? */
+            assert(0);
+        } else if (rc < 0) {
+            return;
+        }
+        uart->u_rx_off = 0;
+        uart->u_rx_len = rc;
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    while (uart->u_rx_off < uart->u_rx_len) {
+        rc = uart->u_rx_func(uart->u_func_arg, uart->u_rx_buf[uart->u_rx_off]);
+        if (rc < 0) {
+            break;
+        }
+        /* Delivered */
+        ++uart->u_rx_off;
+    }
+    OS_EXIT_CRITICAL(sr);
+}
+
+static void
+uart_poller(void *arg)
+{
+    int i;
     struct uart *uart;
 
     while (1) {
@@ -64,61 +151,15 @@ uart_poller(void *arg)
                 continue;
             }
             uart = &uarts[i];
-
-            for (bytes = 0; bytes < UART_MAX_BYTES_PER_POLL; bytes++) {
-                if (uart->u_tx_run) {
-                    OS_ENTER_CRITICAL(sr);
-                    rc = uart->u_tx_func(uart->u_func_arg);
-                    if (rc < 0) {
-                        /*
-                         * No more data to send.
-                         */
-                        uart->u_tx_run = 0;
-                        if (uart->u_tx_done) {
-                            uart->u_tx_done(uart->u_func_arg);
-                        }
-                        OS_EXIT_CRITICAL(sr);
-                        break;
-                    }
-                    OS_EXIT_CRITICAL(sr);
-                    ch = rc;
-                    rc = write(uart->u_fd, &ch, 1);
-                    if (rc <= 0) {
-                        /* XXX EOF/error, what now? */
-                        assert(0);
-                        break;
-                    }
-                }
-            }
-            for (bytes = 0; bytes < UART_MAX_BYTES_PER_POLL; bytes++) {
-                if (uart->u_rx_char < 0) {
-                    rc = read(uart->u_fd, &ch, 1);
-                    if (rc == 0) {
-                        /* XXX EOF, what now? */
-                        assert(0);
-                    } else if (rc < 0) {
-                        break;
-                    } else {
-                        uart->u_rx_char = ch;
-                    }
-                }
-                if (uart->u_rx_char >= 0) {
-                    OS_ENTER_CRITICAL(sr);
-                    rc = uart->u_rx_func(uart->u_func_arg, uart->u_rx_char);
-                    /* Delivered */
-                    if (rc >= 0) {
-                        uart->u_rx_char = -1;
-                    }
-                    OS_EXIT_CRITICAL(sr);
-                }
-            }
+            uart_poll_tx(uart);
+            uart_poll_rx(uart);
         }
-        os_time_delay(10);
+        os_time_delay(1);
     }
 }
 
 static int
-uart_pty(void)
+uart_pty(int port)
 {
     int fd;
     int loop_slave;
@@ -156,7 +197,7 @@ uart_pty(void)
         goto err;
     }
 
-    printf("console at %s\n", pty_name);
+    printf("uart%d at %s\n", port, pty_name);
     return fd;
 err:
     close(fd);
@@ -202,7 +243,10 @@ hal_uart_init_cbs(int port, hal_uart_tx_char tx_func, hal_uart_tx_done tx_done,
     uart->u_tx_done = tx_done;
     uart->u_rx_func = rx_func;
     uart->u_func_arg = arg;
-    uart->u_rx_char = -1;
+    uart->u_rx_off = 0;
+    uart->u_rx_len = 0;
+    uart->u_tx_off = 0;
+    uart->u_tx_len = 0;
 
     if (!uart_poller_running) {
         uart_poller_running = 1;
@@ -228,7 +272,7 @@ hal_uart_config(int port, int32_t baudrate, uint8_t databits, uint8_t stopbits,
     if (uart->u_open) {
         return -1;
     }
-    uart->u_fd = uart_pty();
+    uart->u_fd = uart_pty(port);
     if (uart->u_fd < 0) {
         return -1;
     }
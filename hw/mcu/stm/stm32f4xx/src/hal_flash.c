@@ -49,6 +49,29 @@ flash_read(uint32_t address, void *dst, uint32_t num_bytes)
     return 0;
 }
 
+/**
+ * Retrieves a pointer through which the specified flash region can be read
+ * directly.  Internal flash is memory mapped, so the address is the pointer.
+ *
+ * @return                      0 on success;
+ *                              -1 if the region is not within flash.
+ */
+int
+flash_map(uint32_t address, uint32_t num_bytes, const void **out_ptr)
+{
+    const struct flash_area_desc *last;
+
+    last = flash_area_descs + FLASH_NUM_AREAS - 1;
+    if (address < flash_area_descs[0].fad_offset ||
+        address + num_bytes > last->fad_offset + last->fad_length) {
+
+        return -1;
+    }
+
+    *out_ptr = (const void *)address;
+    return 0;
+}
+
 int
 flash_write(uint32_t address, const void *src, uint32_t num_bytes)
 {
@@ -75,21 +98,73 @@ flash_erase_sector_id(int sector_id)
     FLASH_Erase_Sector(sector_id, FLASH_VOLTAGE_RANGE_1);
 }
 
-int
-flash_erase_sector(uint32_t sector_address)
+static int
+flash_find_sector_id(uint32_t sector_address)
 {
     int i;
 
     for (i = 0; i < FLASH_NUM_AREAS; i++) {
         if (flash_area_descs[i].fad_offset == sector_address) {
-            flash_erase_sector_id(flash_area_descs[i].fad_sector_id);
-            return 0;
+            return flash_area_descs[i].fad_sector_id;
         }
     }
 
     return -1;
 }
 
+/**
+ * Indicates whether a flash operation is in progress.  Once the controller
+ * is idle, the sector erase bits are cleared so that subsequent programming
+ * operations are unaffected.
+ */
+int
+flash_busy(void)
+{
+    if (__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY)) {
+        return 1;
+    }
+
+    FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+    return 0;
+}
+
+int
+flash_erase_sector(uint32_t sector_address)
+{
+    int rc;
+
+    rc = flash_erase_sector_start(sector_address);
+    if (rc != 0) {
+        return rc;
+    }
+
+    while (flash_busy()) {
+    }
+
+    return 0;
+}
+
+/**
+ * Starts erasing the specified sector and returns without waiting for the
+ * erase to complete.  Use flash_busy() to determine when it is done.
+ */
+int
+flash_erase_sector_start(uint32_t sector_address)
+{
+    int sector_id;
+
+    sector_id = flash_find_sector_id(sector_address);
+    if (sector_id == -1) {
+        return -1;
+    }
+
+    while (flash_busy()) {
+    }
+    flash_erase_sector_id(sector_id);
+
+    return 0;
+}
+
 int
 flash_erase(uint32_t address, uint32_t num_bytes)
 {
@@ -109,7 +184,7 @@ flash_erase(uint32_t address, uint32_t num_bytes)
         if (address >= area->fad_offset &&
             address < area->fad_offset + area->fad_length) {
 
-            flash_erase_sector_id(area->fad_sector_id);
+            flash_erase_sector(area->fad_offset);
         }
     }
 
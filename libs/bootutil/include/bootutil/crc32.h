@@ -17,6 +17,10 @@
 #ifndef H_CRC32_
 #define H_CRC32_
 
+#include <stddef.h>
+#include <inttypes.h>
+
+void crc32_init(void);
 uint32_t crc32(uint32_t crc, const void *buf, size_t size);
 
 #endif
@@ -23,6 +23,8 @@
 #define IMAGE_MAGIC_NONE            0xffffffff
 
 #define IMAGE_F_PIC                 0x00000001
+#define IMAGE_F_DELTA               0x00000002 /* Body is an image_delta. */
+#define IMAGE_F_COMPRESSED          0x00000004 /* Body is an image_comp. */
 
 #define IMAGE_HEADER_CRC_OFFSET     4
 
@@ -48,4 +50,54 @@ struct image_header {
 _Static_assert(sizeof(struct image_header) == IMAGE_HEADER_SIZE,
                "struct image_header not required size");
 
+/**
+ * Delta images.  The body of an image with the IMAGE_F_DELTA flag set
+ * consists of an image_delta_hdr followed by a sequence of operations.
+ * Applying the operations in order to the base image (header included)
+ * produces the target image (header included).  Each operation is an
+ * image_delta_op; a DATA operation is immediately followed by ido_len bytes
+ * of literal target data.  The outer header carries the target image's
+ * version number.
+ */
+#define IMAGE_DELTA_MAGIC           0x44a1e7a5
+
+#define IMAGE_DELTA_OP_COPY         1 /* Copy from base image at ido_src. */
+#define IMAGE_DELTA_OP_DATA         2 /* Copy literal bytes from the delta. */
+
+struct image_delta_hdr {
+    uint32_t idh_magic;
+    uint32_t idh_base_crc32;    /* ih_crc32 of the base image. */
+    uint32_t idh_base_size;     /* Size of base image, including header. */
+    uint32_t idh_tgt_size;      /* Size of target image, including header. */
+};
+
+struct image_delta_op {
+    uint16_t ido_type;
+    uint16_t ido_reserved;
+    uint32_t ido_len;
+    uint32_t ido_src;           /* COPY only; offset within base image. */
+};
+
+_Static_assert(sizeof(struct image_delta_hdr) == 16,
+               "struct image_delta_hdr not required size");
+_Static_assert(sizeof(struct image_delta_op) == 12,
+               "struct image_delta_op not required size");
+
+/**
+ * Compressed images.  The body of an image with the IMAGE_F_COMPRESSED flag
+ * set consists of an image_comp_hdr followed by a single LZ4 block (see the
+ * LZ4 block format specification).  Decompressing the block produces the
+ * target image, header included.  The outer header carries the target
+ * image's version number.  A compressed image cannot also be a delta.
+ */
+#define IMAGE_COMP_MAGIC            0x1c4a9e37
+
+struct image_comp_hdr {
+    uint32_t ich_magic;
+    uint32_t ich_tgt_size;      /* Size of target image, including header. */
+};
+
+_Static_assert(sizeof(struct image_comp_hdr) == 8,
+               "struct image_comp_hdr not required size");
+
 #endif
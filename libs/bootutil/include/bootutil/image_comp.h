@@ -0,0 +1,25 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_IMAGE_COMP_
+#define H_IMAGE_COMP_
+
+#include <inttypes.h>
+
+int image_comp_create(const uint8_t *tgt, uint32_t tgt_len,
+                      uint8_t **out_body, uint32_t *out_body_len);
+
+#endif
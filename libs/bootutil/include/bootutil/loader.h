@@ -49,6 +49,13 @@ struct boot_req {
 
     /** The index of the area to use as the image scratch area. */
     uint8_t br_scratch_area_idx;
+
+    /**
+     * Set to nonzero to boot images without checking their CRC.  By
+     * default, an image is verified before it is swapped into the primary
+     * slot and before it is booted.
+     */
+    uint8_t br_skip_verify;
 };
 
 /**
@@ -23,6 +23,9 @@
 #include "bootutil/image.h"
 #include "bootutil_priv.h"
 
+/** Size of the buffer used to checksum flash which is not memory mapped. */
+#define BOOT_CRC_BUF_SZ     4096
+
 static int
 boot_vect_read_one(struct image_version *ver, const char *path)
 {
@@ -145,12 +148,177 @@ boot_read_image_headers(struct image_header *out_headers,
     }
 }
 
+/**
+ * Calculates the CRC of an image in flash.  The CRC covers the portion of the
+ * header following the ih_crc32 field, and the image body.  If the flash
+ * driver can map the image into memory, the CRC is calculated directly over
+ * the mapping; otherwise, the image is read through a buffer.
+ *
+ * @param hdr                   The image's header.
+ * @param addr                  The flash address of the image header.
+ * @param out_crc               On success, the calculated CRC gets written
+ *                                  here.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+boot_image_crc(const struct image_header *hdr, uint32_t addr,
+               uint32_t *out_crc)
+{
+    static uint8_t buf[BOOT_CRC_BUF_SZ];
+
+    const void *ptr;
+    uint32_t start;
+    uint32_t end;
+    uint32_t crc;
+    int chunk_sz;
+    int rc;
+
+    if (hdr->ih_hdr_size < IMAGE_HEADER_SIZE ||
+        hdr->ih_img_size > UINT32_MAX - hdr->ih_hdr_size - addr) {
+
+        return BOOT_EBADIMAGE;
+    }
+
+    start = addr + IMAGE_HEADER_CRC_OFFSET + sizeof hdr->ih_crc32;
+    end = addr + hdr->ih_hdr_size + hdr->ih_img_size;
+
+    rc = flash_map(start, end - start, &ptr);
+    if (rc == 0) {
+        *out_crc = crc32(0, ptr, end - start);
+        return 0;
+    }
+
+    crc = 0;
+    while (start < end) {
+        if (end - start > sizeof buf) {
+            chunk_sz = sizeof buf;
+        } else {
+            chunk_sz = end - start;
+        }
+
+        rc = flash_read(start, buf, chunk_sz);
+        if (rc != 0) {
+            return BOOT_EFLASH;
+        }
+
+        crc = crc32(crc, buf, chunk_sz);
+        start += chunk_sz;
+    }
+
+    *out_crc = crc;
+    return 0;
+}
+
+/**
+ * Reads the cached image verification results.
+ *
+ * @param out_verified          On success, one entry per slot gets written
+ *                                  here.
+ * @param num_slots             The number of image slots.
+ *
+ * @return                      0 on success; nonzero if there is no valid
+ *                                  cache.
+ */
+int
+boot_read_verified(struct boot_verified *out_verified, int num_slots)
+{
+    uint32_t bytes_read;
+    int rc;
+
+    rc = nffsutil_read_file(BOOT_PATH_VERIFIED, 0,
+                            num_slots * sizeof *out_verified, out_verified,
+                            &bytes_read);
+    if (rc != 0 || bytes_read != num_slots * sizeof *out_verified) {
+        return BOOT_EBADSTATUS;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the image verification results to the cache.
+ *
+ * @param verified              One entry per slot.
+ * @param num_slots             The number of image slots.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+boot_write_verified(const struct boot_verified *verified, int num_slots)
+{
+    int rc;
+
+    rc = nffsutil_write_file(BOOT_PATH_VERIFIED, verified,
+                             num_slots * sizeof *verified);
+    if (rc != 0) {
+        return BOOT_EFILE;
+    }
+
+    return 0;
+}
+
+/**
+ * Erases the image verification cache.  Every image is checksummed again
+ * before it is next booted.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+boot_clear_verified(void)
+{
+    int rc;
+
+    rc = nffs_unlink(BOOT_PATH_VERIFIED);
+    if (rc != 0 && rc != NFFS_ENOENT) {
+        return BOOT_EFILE;
+    }
+
+    return 0;
+}
+
+/**
+ * Applies a boot status record to an array of boot status entries.
+ *
+ * @param entries               The array of boot status entries to update.
+ * @param num_areas             The length of the entries array.
+ * @param rec                   The record to apply.
+ *
+ * @return                      0 on success;
+ *                              BOOT_EBADSTATUS if the record is invalid.
+ */
+int
+boot_apply_status_rec(struct boot_status_entry *entries, int num_areas,
+                      const struct boot_status_rec *rec)
+{
+    if (rec->bsr_src_idx >= num_areas || rec->bsr_dst_idx >= num_areas ||
+        rec->bsr_src_idx == rec->bsr_dst_idx) {
+
+        return BOOT_EBADSTATUS;
+    }
+
+    if (entries[rec->bsr_src_idx].bse_image_num == BOOT_IMAGE_NUM_NONE) {
+        return BOOT_EBADSTATUS;
+    }
+
+    entries[rec->bsr_dst_idx] = entries[rec->bsr_src_idx];
+    entries[rec->bsr_src_idx].bse_image_num = BOOT_IMAGE_NUM_NONE;
+    entries[rec->bsr_src_idx].bse_part_num = BOOT_IMAGE_NUM_NONE;
+
+    return 0;
+}
+
 /**
  * Reads the boot status from the flash file system.  The boot status contains
  * the current state of an interrupted image copy operation.  If the boot
  * status is not present in the file system, the implication is that there is
  * no copy operation in progress.
  *
+ * The status file consists of a snapshot of the boot status entries followed
+ * by a log of records, one per completed copy.  The records are applied to
+ * the snapshot in order.  A truncated trailing record indicates that the
+ * system was reset while the record was being written; it is ignored.
+ *
  * @param out_status            On success, the boot status gets written here.
  * @param out_entries           On success, the array of boot entries gets
  *                                  written here.
@@ -165,6 +333,7 @@ boot_read_status(struct boot_status *out_status,
                  struct boot_status_entry *out_entries,
                  int num_areas)
 {
+    struct boot_status_rec rec;
     struct nffs_file *file;
     uint32_t bytes_read;
     int rc;
@@ -189,6 +358,22 @@ boot_read_status(struct boot_status *out_status,
         goto done;
     }
 
+    while (1) {
+        rc = nffs_read(file, sizeof rec, &rec, &bytes_read);
+        if (rc != 0) {
+            rc = BOOT_EBADSTATUS;
+            goto done;
+        }
+        if (bytes_read != sizeof rec) {
+            break;
+        }
+
+        rc = boot_apply_status_rec(out_entries, num_areas, &rec);
+        if (rc != 0) {
+            goto done;
+        }
+    }
+
     if (out_status->bs_img1_length == 0xffffffff) {
         out_status->bs_img1_length = 0;
     }
@@ -220,7 +405,8 @@ done:
 
 /**
  * Writes the supplied boot status to the flash file system.  The boot status
- * contains the current state of an in-progress image copy operation.
+ * contains the current state of an in-progress image copy operation.  Any
+ * existing status, including its log of records, is replaced.
  *
  * @param status                The boot status base to write.
  * @param entries               The array of boot status entries to write.
@@ -264,6 +450,42 @@ done:
     return rc;
 }
 
+/**
+ * Appends a record to the boot status in the flash file system.  The record
+ * is written with a single file system write, so it is either fully present
+ * or absent after a reset.  A status must already have been written with
+ * boot_write_status().
+ *
+ * @param rec                   The record to append.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+boot_append_status(const struct boot_status_rec *rec)
+{
+    struct nffs_file *file;
+    int rc;
+
+    rc = nffs_open(BOOT_PATH_STATUS, NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND,
+                   &file);
+    if (rc != 0) {
+        rc = BOOT_EFILE;
+        goto done;
+    }
+
+    rc = nffs_write(file, rec, sizeof *rec);
+    if (rc != 0) {
+        rc = BOOT_EFILE;
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    nffs_close(file);
+    return rc;
+}
+
 /**
  * Erases the boot status from the flash file system.  The boot status
  * contains the current state of an in-progress image copy operation.  By
@@ -275,3 +497,106 @@ boot_clear_status(void)
 {
     nffs_unlink(BOOT_PATH_STATUS);
 }
+
+/**
+ * Reads the progress of an interrupted image rebuild.
+ *
+ * @param out_state             On success, the most recent complete progress
+ *                                  record gets written here.
+ *
+ * @return                      0 on success; nonzero if no rebuild is in
+ *                                  progress.
+ */
+int
+boot_read_rebuild_state(struct boot_rebuild_state *out_state)
+{
+    struct boot_rebuild_state state;
+    struct nffs_file *file;
+    uint32_t bytes_read;
+    int found;
+    int rc;
+
+    rc = nffs_open(BOOT_PATH_REBUILD, NFFS_ACCESS_READ, &file);
+    if (rc != 0) {
+        return BOOT_EBADSTATUS;
+    }
+
+    found = 0;
+    while (1) {
+        rc = nffs_read(file, sizeof state, &state, &bytes_read);
+        if (rc != 0) {
+            rc = BOOT_EBADSTATUS;
+            goto done;
+        }
+        if (bytes_read != sizeof state) {
+            /* End of file, or a record truncated by a reset. */
+            break;
+        }
+
+        *out_state = state;
+        found = 1;
+    }
+
+    if (!found) {
+        rc = BOOT_EBADSTATUS;
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    nffs_close(file);
+    return rc;
+}
+
+/**
+ * Records the progress of an image rebuild.
+ *
+ * @param state                 The progress record to write.
+ * @param first                 1 if this is the first record of a new
+ *                                  rebuild; any existing records are
+ *                                  discarded.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+boot_append_rebuild_state(const struct boot_rebuild_state *state, int first)
+{
+    struct nffs_file *file;
+    uint8_t access;
+    int rc;
+
+    access = NFFS_ACCESS_WRITE;
+    if (first) {
+        access |= NFFS_ACCESS_TRUNCATE;
+    } else {
+        access |= NFFS_ACCESS_APPEND;
+    }
+
+    rc = nffs_open(BOOT_PATH_REBUILD, access, &file);
+    if (rc != 0) {
+        rc = BOOT_EFILE;
+        goto done;
+    }
+
+    rc = nffs_write(file, state, sizeof *state);
+    if (rc != 0) {
+        rc = BOOT_EFILE;
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    nffs_close(file);
+    return rc;
+}
+
+/**
+ * Erases the rebuild progress, indicating no rebuild is in progress.
+ */
+void
+boot_clear_rebuild_state(void)
+{
+    nffs_unlink(BOOT_PATH_REBUILD);
+}
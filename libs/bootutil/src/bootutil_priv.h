@@ -29,15 +29,20 @@ struct image_header;
 
 #define BOOT_IMAGE_NUM_NONE     0xff
 
+/** Number of image slots in flash; currently limited to two. */
+#define BOOT_NUM_SLOTS          2
+
 #define BOOT_PATH_MAIN      "/boot/main"
 #define BOOT_PATH_TEST      "/boot/test"
 #define BOOT_PATH_STATUS    "/boot/status"
+#define BOOT_PATH_VERIFIED  "/boot/verified"
+#define BOOT_PATH_REBUILD   "/boot/rebuild"
 
 struct boot_status {
     uint32_t bs_img1_length;
     uint32_t bs_img2_length;
-    /* Followed by sequence of boot status entries; file size indicates number
-     * of entries.
+    /* Followed by one boot status entry per image area, and then by a
+     * sequence of boot status records.
      */
 };
 
@@ -46,6 +51,45 @@ struct boot_status_entry {
     uint8_t bse_part_num;
 };
 
+/**
+ * Appended to the boot status file each time an image part is copied.  The
+ * part previously stored in the source area now resides in the destination
+ * area; the source area no longer holds useful data.  Both fields are indices
+ * into the array of boot status entries.
+ */
+struct boot_status_rec {
+    uint8_t bsr_src_idx;
+    uint8_t bsr_dst_idx;
+};
+
+/**
+ * The cached result of verifying the image in a slot.  The verified file
+ * contains one of these per image slot.  An entry only applies while its slot
+ * holds an image with an identical header.  Only the primary slot's entry is
+ * used; the secondary slot can be rewritten by the application without its
+ * header changing.  See boot_image_check().
+ */
+struct boot_verified {
+    struct image_header bv_hdr;
+    uint32_t bv_valid;  /* 1 if the image passed; only passes are cached. */
+};
+
+/**
+ * Progress of rebuilding a full image in the second slot from a delta or
+ * compressed image.  The rebuild file is a sequence of these records; the
+ * last complete one is current.  A record is appended each time the rebuilt
+ * image fills a flash area, so an interrupted rebuild restarts at the
+ * beginning of the area it was writing.
+ */
+struct boot_rebuild_state {
+    uint32_t brs_in_off;        /* Offset of next unread input byte. */
+    uint32_t brs_tgt_off;       /* Number of target bytes in flash. */
+    uint32_t brs_op_src;        /* Current op's next source offset. */
+    uint32_t brs_op_len;        /* Bytes remaining in current op. */
+    uint16_t brs_op_type;       /* Current op type; 0 if none. */
+    uint16_t brs_lz_match;      /* Compressed: 1 + pending match nibble. */
+};
+
 int boot_vect_read_test(struct image_version *out_ver);
 int boot_vect_read_main(struct image_version *out_ver);
 int boot_vect_delete_test(void);
@@ -58,7 +102,18 @@ int boot_read_status(struct boot_status *out_status,
 int boot_write_status(const struct boot_status *status,
                       const struct boot_status_entry *entries,
                       int num_areas);
+int boot_append_status(const struct boot_status_rec *rec);
+int boot_apply_status_rec(struct boot_status_entry *entries, int num_areas,
+                          const struct boot_status_rec *rec);
 void boot_clear_status(void);
+int boot_image_crc(const struct image_header *hdr, uint32_t addr,
+                   uint32_t *out_crc);
+int boot_read_verified(struct boot_verified *out_verified, int num_slots);
+int boot_write_verified(const struct boot_verified *verified, int num_slots);
+int boot_clear_verified(void);
+int boot_read_rebuild_state(struct boot_rebuild_state *out_state);
+int boot_append_rebuild_state(const struct boot_rebuild_state *state, int first);
+void boot_clear_rebuild_state(void);
 
 #endif
 
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * CRC-32 (IEEE 802.3, reflected polynomial 0xedb88320), as used for the
+ * ih_crc32 field of image headers.
+ *
+ * The implementation processes four bytes per step using four lookup tables
+ * ("slicing-by-4").  The tables occupy 4 KB; they are generated in RAM on
+ * first use rather than stored in flash, since the boot loader's code area is
+ * small.
+ */
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "bootutil/crc32.h"
+
+#if !defined(__BYTE_ORDER__) || (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "crc32 requires a little endian machine"
+#endif
+
+#define CRC32_POLY      0xedb88320
+
+static uint32_t crc32_tab[4][256];
+static int crc32_tab_ready;
+
+/**
+ * Generates the lookup tables.  This is called implicitly by the first call
+ * to crc32(); a multithreaded host program should call it explicitly before
+ * starting any threads.
+ */
+void
+crc32_init(void)
+{
+    uint32_t c;
+    int i;
+    int j;
+
+    if (crc32_tab_ready) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            if (c & 1) {
+                c = CRC32_POLY ^ (c >> 1);
+            } else {
+                c >>= 1;
+            }
+        }
+        crc32_tab[0][i] = c;
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = crc32_tab[0][i];
+        for (j = 1; j < 4; j++) {
+            c = crc32_tab[0][c & 0xff] ^ (c >> 8);
+            crc32_tab[j][i] = c;
+        }
+    }
+
+    crc32_tab_ready = 1;
+}
+
+/**
+ * Continues a CRC-32 calculation.
+ *
+ * @param crc                   The CRC of the preceding data; 0 to start a
+ *                                  new calculation.
+ * @param buf                   The data to process.
+ * @param size                  The number of bytes to process.
+ *
+ * @return                      The CRC of the preceding data and buf.
+ */
+uint32_t
+crc32(uint32_t crc, const void *buf, size_t size)
+{
+    const uint8_t *p;
+
+    crc32_init();
+
+    p = buf;
+    crc = ~crc;
+
+    /* Process leading bytes until the pointer is word aligned. */
+    while (size > 0 && ((uintptr_t)p & 3) != 0) {
+        crc = crc32_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        size--;
+    }
+
+    while (size >= 4) {
+        crc ^= *(const uint32_t *)p;
+        crc = crc32_tab[3][crc & 0xff] ^
+              crc32_tab[2][(crc >> 8) & 0xff] ^
+              crc32_tab[1][(crc >> 16) & 0xff] ^
+              crc32_tab[0][crc >> 24];
+        p += 4;
+        size -= 4;
+    }
+
+    while (size > 0) {
+        crc = crc32_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        size--;
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,272 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Compressed image generation.  This runs on the host (bin2img, unit tests);
+ * the boot loader only decompresses.
+ *
+ * The output is a standard LZ4 block, produced by a greedy parse over hash
+ * chains.  Decompression needs no RAM window, since the boot loader reads
+ * matches back from the image it has already written to flash.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "bootutil/image.h"
+#include "bootutil/image_comp.h"
+#include "bootutil_priv.h"
+
+#define IMAGE_COMP_MIN_MATCH        4
+#define IMAGE_COMP_MAX_DIST         65535
+
+/** LZ4 block rules: the last match must start this far from the end... */
+#define IMAGE_COMP_MF_LIMIT         12
+/** ...and the last bytes of the block are always literals. */
+#define IMAGE_COMP_LAST_LITERALS    5
+
+#define IMAGE_COMP_HASH_BITS        16
+#define IMAGE_COMP_MAX_CHAIN        64
+
+#define IMAGE_COMP_NONE             0xffffffff
+
+struct image_comp_buf {
+    uint8_t *icb_data;
+    uint32_t icb_len;
+    uint32_t icb_cap;
+};
+
+static uint8_t *
+image_comp_reserve(struct image_comp_buf *buf, uint32_t len)
+{
+    uint8_t *new_data;
+    uint32_t new_cap;
+    uint8_t *p;
+
+    if (buf->icb_len + len > buf->icb_cap) {
+        new_cap = buf->icb_cap * 2;
+        if (new_cap < buf->icb_len + len) {
+            new_cap = buf->icb_len + len;
+        }
+
+        new_data = realloc(buf->icb_data, new_cap);
+        if (new_data == NULL) {
+            return NULL;
+        }
+
+        buf->icb_data = new_data;
+        buf->icb_cap = new_cap;
+    }
+
+    p = buf->icb_data + buf->icb_len;
+    buf->icb_len += len;
+
+    return p;
+}
+
+static uint8_t *
+image_comp_put_len(uint8_t *p, uint32_t len)
+{
+    while (len >= 255) {
+        *p++ = 255;
+        len -= 255;
+    }
+    *p++ = len;
+
+    return p;
+}
+
+/**
+ * Emits one LZ4 sequence.  A match length of 0 indicates the final,
+ * literals-only sequence.
+ */
+static int
+image_comp_emit(struct image_comp_buf *buf, const uint8_t *lit,
+                uint32_t lit_len, uint32_t dist, uint32_t match_len)
+{
+    uint32_t max_len;
+    uint32_t ml;
+    uint8_t *start;
+    uint8_t *p;
+
+    /* Worst case: token, both length extensions, literals, offset. */
+    max_len = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    start = image_comp_reserve(buf, max_len);
+    if (start == NULL) {
+        return BOOT_ENOMEM;
+    }
+    p = start + 1;
+
+    if (lit_len >= 15) {
+        *start = 15 << 4;
+        p = image_comp_put_len(p, lit_len - 15);
+    } else {
+        *start = lit_len << 4;
+    }
+
+    memcpy(p, lit, lit_len);
+    p += lit_len;
+
+    if (match_len != 0) {
+        *p++ = dist & 0xff;
+        *p++ = dist >> 8;
+
+        ml = match_len - IMAGE_COMP_MIN_MATCH;
+        if (ml >= 15) {
+            *start |= 15;
+            p = image_comp_put_len(p, ml - 15);
+        } else {
+            *start |= ml;
+        }
+    }
+
+    /* Give back the unused part of the worst case reservation. */
+    buf->icb_len -= max_len - (p - start);
+
+    return 0;
+}
+
+static uint32_t
+image_comp_hash(const uint8_t *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof val);
+    return (val * 2654435761U) >> (32 - IMAGE_COMP_HASH_BITS);
+}
+
+/**
+ * Generates the body of a compressed image.
+ *
+ * @param tgt                   The image to compress, header included.
+ * @param tgt_len               The length of the image, in bytes.
+ * @param out_body              On success, a malloc'd buffer containing the
+ *                                  compressed image body is written here.
+ *                                  The caller must free it.
+ * @param out_body_len          On success, the length of the body is written
+ *                                  here.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+image_comp_create(const uint8_t *tgt, uint32_t tgt_len,
+                  uint8_t **out_body, uint32_t *out_body_len)
+{
+    struct image_comp_hdr comp_hdr;
+    struct image_comp_buf buf;
+    uint32_t *heads;
+    uint32_t *prev;
+    uint32_t match_limit;
+    uint32_t lit_start;
+    uint32_t best_len;
+    uint32_t best_pos;
+    uint32_t cand;
+    uint32_t len;
+    uint32_t pos;
+    uint32_t h;
+    uint8_t *p;
+    int chain;
+    int rc;
+
+    memset(&buf, 0, sizeof buf);
+    heads = malloc((1 << IMAGE_COMP_HASH_BITS) * sizeof *heads);
+    prev = malloc((tgt_len + 1) * sizeof *prev);
+    if (heads == NULL || prev == NULL) {
+        rc = BOOT_ENOMEM;
+        goto done;
+    }
+    memset(heads, 0xff, (1 << IMAGE_COMP_HASH_BITS) * sizeof *heads);
+
+    comp_hdr.ich_magic = IMAGE_COMP_MAGIC;
+    comp_hdr.ich_tgt_size = tgt_len;
+    p = image_comp_reserve(&buf, sizeof comp_hdr);
+    if (p == NULL) {
+        rc = BOOT_ENOMEM;
+        goto done;
+    }
+    memcpy(p, &comp_hdr, sizeof comp_hdr);
+
+    if (tgt_len > IMAGE_COMP_MF_LIMIT) {
+        match_limit = tgt_len - IMAGE_COMP_MF_LIMIT;
+    } else {
+        match_limit = 0;
+    }
+
+    lit_start = 0;
+    pos = 0;
+    while (pos < match_limit) {
+        h = image_comp_hash(tgt + pos);
+
+        best_len = 0;
+        best_pos = 0;
+        chain = 0;
+        for (cand = heads[h];
+             cand != IMAGE_COMP_NONE && pos - cand <= IMAGE_COMP_MAX_DIST &&
+             chain < IMAGE_COMP_MAX_CHAIN;
+             cand = prev[cand], chain++) {
+
+            len = 0;
+            while (pos + len < tgt_len - IMAGE_COMP_LAST_LITERALS &&
+                   tgt[cand + len] == tgt[pos + len]) {
+
+                len++;
+            }
+            if (len > best_len) {
+                best_len = len;
+                best_pos = cand;
+            }
+        }
+
+        prev[pos] = heads[h];
+        heads[h] = pos;
+
+        if (best_len < IMAGE_COMP_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+
+        rc = image_comp_emit(&buf, tgt + lit_start, pos - lit_start,
+                             pos - best_pos, best_len);
+        if (rc != 0) {
+            goto done;
+        }
+
+        /* Index the matched bytes so later data can refer to them. */
+        for (len = 1; len < best_len && pos + len < match_limit; len++) {
+            h = image_comp_hash(tgt + pos + len);
+            prev[pos + len] = heads[h];
+            heads[h] = pos + len;
+        }
+
+        pos += best_len;
+        lit_start = pos;
+    }
+
+    rc = image_comp_emit(&buf, tgt + lit_start, tgt_len - lit_start, 0, 0);
+    if (rc != 0) {
+        goto done;
+    }
+
+    *out_body = buf.icb_data;
+    *out_body_len = buf.icb_len;
+    buf.icb_data = NULL;
+    rc = 0;
+
+done:
+    free(buf.icb_data);
+    free(heads);
+    free(prev);
+    return rc;
+}
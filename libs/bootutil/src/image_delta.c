@@ -0,0 +1,284 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Delta image generation.  This runs on the host (bin2img, unit tests); the
+ * boot loader only applies deltas and never links this file in.
+ *
+ * The target is scanned from start to end.  At each position, the base image
+ * is searched for the longest run of matching bytes, using a hash table keyed
+ * on the next IMAGE_DELTA_KEY_LEN bytes.  Matches of at least
+ * IMAGE_DELTA_MIN_MATCH bytes become COPY operations; everything else is
+ * emitted as literal DATA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "bootutil/image.h"
+#include "bootutil/image_delta.h"
+#include "bootutil_priv.h"
+
+#define IMAGE_DELTA_KEY_LEN         8
+
+/** Shorter matches are cheaper to send as literal data. */
+#define IMAGE_DELTA_MIN_MATCH       (2 * sizeof (struct image_delta_op))
+
+/** Bounds the work done per target position. */
+#define IMAGE_DELTA_MAX_CHAIN       64
+
+#define IMAGE_DELTA_NONE            0xffffffff
+
+struct image_delta_buf {
+    uint8_t *idb_data;
+    uint32_t idb_len;
+    uint32_t idb_cap;
+};
+
+static int
+image_delta_append(struct image_delta_buf *buf, const void *data, uint32_t len)
+{
+    uint8_t *new_data;
+    uint32_t new_cap;
+
+    if (buf->idb_len + len > buf->idb_cap) {
+        new_cap = buf->idb_cap * 2;
+        if (new_cap < buf->idb_len + len) {
+            new_cap = buf->idb_len + len;
+        }
+
+        new_data = realloc(buf->idb_data, new_cap);
+        if (new_data == NULL) {
+            return BOOT_ENOMEM;
+        }
+
+        buf->idb_data = new_data;
+        buf->idb_cap = new_cap;
+    }
+
+    memcpy(buf->idb_data + buf->idb_len, data, len);
+    buf->idb_len += len;
+
+    return 0;
+}
+
+static int
+image_delta_emit(struct image_delta_buf *buf, int type, uint32_t len,
+                 uint32_t src, const uint8_t *data)
+{
+    struct image_delta_op op;
+    int rc;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    memset(&op, 0, sizeof op);
+    op.ido_type = type;
+    op.ido_len = len;
+    if (type == IMAGE_DELTA_OP_COPY) {
+        op.ido_src = src;
+    }
+
+    rc = image_delta_append(buf, &op, sizeof op);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (type == IMAGE_DELTA_OP_DATA) {
+        rc = image_delta_append(buf, data, len);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t
+image_delta_hash(const uint8_t *key, int bits)
+{
+    uint64_t val;
+
+    memcpy(&val, key, sizeof val);
+    return (uint32_t)((val * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+}
+
+static uint32_t
+image_delta_match_len(const uint8_t *base, uint32_t base_len, uint32_t src,
+                      const uint8_t *tgt, uint32_t tgt_len, uint32_t pos)
+{
+    uint32_t len;
+
+    len = 0;
+    while (src + len < base_len && pos + len < tgt_len &&
+           base[src + len] == tgt[pos + len]) {
+
+        len++;
+    }
+
+    return len;
+}
+
+/**
+ * Generates the body of a delta image.  Both images are complete, i.e.,
+ * they begin with an image header.
+ *
+ * @param base                  The image currently installed on the device.
+ * @param base_len              The length of the base image, in bytes.
+ * @param tgt                   The image to be installed.
+ * @param tgt_len               The length of the target image, in bytes.
+ * @param out_body              On success, a malloc'd buffer containing the
+ *                                  delta image body is written here.  The
+ *                                  caller must free it.
+ * @param out_body_len          On success, the length of the body is written
+ *                                  here.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+image_delta_create(const uint8_t *base, uint32_t base_len,
+                   const uint8_t *tgt, uint32_t tgt_len,
+                   uint8_t **out_body, uint32_t *out_body_len)
+{
+    const struct image_header *base_hdr;
+    struct image_delta_hdr delta_hdr;
+    struct image_delta_buf buf;
+    uint32_t *heads;
+    uint32_t *next;
+    uint32_t lit_start;
+    uint32_t best_src;
+    uint32_t best_len;
+    uint32_t disp;
+    uint32_t cand;
+    uint32_t len;
+    uint32_t pos;
+    uint32_t h;
+    int chain;
+    int bits;
+    int rc;
+
+    heads = NULL;
+    next = NULL;
+    memset(&buf, 0, sizeof buf);
+
+    if (base_len < sizeof *base_hdr) {
+        rc = BOOT_EBADIMAGE;
+        goto done;
+    }
+    base_hdr = (const struct image_header *)base;
+
+    bits = 10;
+    while ((1U << bits) < base_len && bits < 24) {
+        bits++;
+    }
+
+    heads = malloc((1U << bits) * sizeof *heads);
+    next = malloc(base_len * sizeof *next);
+    if (heads == NULL || next == NULL) {
+        rc = BOOT_ENOMEM;
+        goto done;
+    }
+    memset(heads, 0xff, (1U << bits) * sizeof *heads);
+
+    /* Index every base position; chains lead from later to earlier
+     * positions.
+     */
+    for (pos = 0; pos + IMAGE_DELTA_KEY_LEN <= base_len; pos++) {
+        h = image_delta_hash(base + pos, bits);
+        next[pos] = heads[h];
+        heads[h] = pos;
+    }
+
+    delta_hdr.idh_magic = IMAGE_DELTA_MAGIC;
+    delta_hdr.idh_base_crc32 = base_hdr->ih_crc32;
+    delta_hdr.idh_base_size = base_len;
+    delta_hdr.idh_tgt_size = tgt_len;
+    rc = image_delta_append(&buf, &delta_hdr, sizeof delta_hdr);
+    if (rc != 0) {
+        goto done;
+    }
+
+    /* Displacement of the most recent match; code which has merely shifted
+     * keeps matching at the same displacement.
+     */
+    disp = 0;
+
+    lit_start = 0;
+    pos = 0;
+    while (pos + IMAGE_DELTA_KEY_LEN <= tgt_len) {
+        best_len = 0;
+        best_src = 0;
+
+        cand = pos - disp;
+        if (cand < base_len) {
+            best_len = image_delta_match_len(base, base_len, cand,
+                                             tgt, tgt_len, pos);
+            best_src = cand;
+        }
+
+        h = image_delta_hash(tgt + pos, bits);
+        chain = 0;
+        for (cand = heads[h];
+             cand != IMAGE_DELTA_NONE && chain < IMAGE_DELTA_MAX_CHAIN;
+             cand = next[cand], chain++) {
+
+            len = image_delta_match_len(base, base_len, cand,
+                                        tgt, tgt_len, pos);
+            if (len > best_len) {
+                best_len = len;
+                best_src = cand;
+            }
+        }
+
+        if (best_len < IMAGE_DELTA_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+
+        rc = image_delta_emit(&buf, IMAGE_DELTA_OP_DATA, pos - lit_start, 0,
+                              tgt + lit_start);
+        if (rc != 0) {
+            goto done;
+        }
+
+        rc = image_delta_emit(&buf, IMAGE_DELTA_OP_COPY, best_len, best_src,
+                              NULL);
+        if (rc != 0) {
+            goto done;
+        }
+
+        disp = pos - best_src;
+        pos += best_len;
+        lit_start = pos;
+    }
+
+    rc = image_delta_emit(&buf, IMAGE_DELTA_OP_DATA, tgt_len - lit_start, 0,
+                          tgt + lit_start);
+    if (rc != 0) {
+        goto done;
+    }
+
+    *out_body = buf.idb_data;
+    *out_body_len = buf.idb_len;
+    buf.idb_data = NULL;
+    rc = 0;
+
+done:
+    free(buf.idb_data);
+    free(heads);
+    free(next);
+    return rc;
+}
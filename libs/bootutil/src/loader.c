@@ -26,9 +26,6 @@
 #include "bootutil/image.h"
 #include "bootutil_priv.h"
 
-/** Number of image slots in flash; currently limited to two. */
-#define BOOT_NUM_SLOTS              2
-
 /** The request object provided by the client. */
 static const struct boot_req *boot_req;
 
@@ -45,6 +42,9 @@ struct boot_status boot_status;
 /** The entries associated with the boot status header. */
 struct boot_status_entry *boot_status_entries;
 
+/** Used for reading and copying flash areas. */
+static uint8_t boot_copy_buf[1024];
+
 /**
  * Calculates the flash offset of the specified image slot.
  *
@@ -125,6 +125,72 @@ boot_select_image_slot(void)
     return -1;
 }
 
+/**
+ * Verifies the integrity of an image by checking its CRC.  A successful
+ * result for the primary slot is cached in the file system, so a good image
+ * is only checksummed the first time it boots.  The cache is keyed on the
+ * image header, which says nothing about the body, so it is only trusted for
+ * a slot that nothing but the boot loader writes:
+ *     o The secondary slot is written by the application (e.g., an upload
+ *       which is interrupted, or retried with the same image); it is always
+ *       checksummed.
+ *     o The primary slot is only written by a swap; the cache is dropped
+ *       before every swap begins.
+ * Failures are not cached, so a damaged body can be repaired without the
+ * header changing.
+ *
+ * @param hdr                   The header of the image to check.
+ * @param slot                  The slot the image currently occupies.
+ *
+ * @return                      0 if the image is intact;
+ *                              BOOT_EBADIMAGE if it is corrupt or absent;
+ *                              other nonzero on failure.
+ */
+static int
+boot_image_check(const struct image_header *hdr, int slot)
+{
+    struct boot_verified verified[BOOT_NUM_SLOTS];
+    uint32_t crc;
+    int rc;
+
+    if (hdr->ih_magic != IMAGE_MAGIC) {
+        return BOOT_EBADIMAGE;
+    }
+
+    if (boot_req->br_skip_verify) {
+        return 0;
+    }
+
+    rc = boot_read_verified(verified, BOOT_NUM_SLOTS);
+    if (rc != 0) {
+        memset(verified, 0xff, sizeof verified);
+    }
+
+    if (slot == 0 && verified[0].bv_valid == 1 &&
+        memcmp(&verified[0].bv_hdr, hdr, sizeof *hdr) == 0) {
+        return 0;
+    }
+
+    rc = boot_image_crc(hdr, boot_slot_addr(slot), &crc);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (crc != hdr->ih_crc32) {
+        return BOOT_EBADIMAGE;
+    }
+
+    if (slot == 0) {
+        verified[0].bv_hdr = *hdr;
+        verified[0].bv_valid = 1;
+
+        /* Failure to update the cache only costs a checksum next boot. */
+        boot_write_verified(verified, BOOT_NUM_SLOTS);
+    }
+
+    return 0;
+}
+
 /**
  * Searches the current boot status for the specified image-num,part-num pair.
  *
@@ -193,12 +259,65 @@ boot_find_image_area_idx(int area_idx)
     return -1;
 }
 
+/**
+ * Indicates whether the specified area is fully erased.
+ *
+ * @param area_idx              The index of the area to check.
+ *
+ * @return                      1 if the area is erased;
+ *                              0 if it contains data or on read failure.
+ */
+static int
+boot_area_is_blank(int area_idx)
+{
+    const struct nffs_area_desc *area_desc;
+    uint32_t off;
+    int chunk_sz;
+    int rc;
+    int i;
+
+    area_desc = boot_req->br_area_descs + area_idx;
+
+    off = 0;
+    while (off < area_desc->nad_length) {
+        if (area_desc->nad_length - off > sizeof boot_copy_buf) {
+            chunk_sz = sizeof boot_copy_buf;
+        } else {
+            chunk_sz = area_desc->nad_length - off;
+        }
+
+        rc = flash_read(area_desc->nad_offset + off, boot_copy_buf, chunk_sz);
+        if (rc != 0) {
+            return 0;
+        }
+
+        for (i = 0; i < chunk_sz; i++) {
+            if (boot_copy_buf[i] != 0xff) {
+                return 0;
+            }
+        }
+
+        off += chunk_sz;
+    }
+
+    return 1;
+}
+
+/**
+ * Erases the specified area, unless it is already erased.  Each area
+ * corresponds to a single flash sector, so an erase here costs one sector
+ * erase cycle; skipping needless erases saves both time and wear.
+ */
 static int
 boot_erase_area(int area_idx)
 {
     const struct nffs_area_desc *area_desc;
     int rc;
 
+    if (boot_area_is_blank(area_idx)) {
+        return 0;
+    }
+
     area_desc = boot_req->br_area_descs + area_idx;
     rc = flash_erase(area_desc->nad_offset, area_desc->nad_length);
     if (rc != 0) {
@@ -210,7 +329,8 @@ boot_erase_area(int area_idx)
 
 /**
  * Copies the contents of one area to another.  The destination area must
- * be erased prior to this function being called.
+ * be erased prior to this function being called.  Erased chunks of the source
+ * area are not programmed, as the destination already contains 0xff bytes.
  *
  * @param from_area_idx       The index of the source area.
  * @param to_area_idx         The index of the destination area.
@@ -226,9 +346,9 @@ boot_copy_area(int from_area_idx, int to_area_idx)
     uint32_t to_addr;
     uint32_t off;
     int chunk_sz;
+    int blank;
     int rc;
-
-    static uint8_t buf[1024];
+    int i;
 
     from_area_desc = boot_req->br_area_descs + from_area_idx;
     to_area_desc = boot_req->br_area_descs + to_area_idx;
@@ -237,22 +357,32 @@ boot_copy_area(int from_area_idx, int to_area_idx)
 
     off = 0;
     while (off < from_area_desc->nad_length) {
-        if (from_area_desc->nad_length - off > sizeof buf) {
-            chunk_sz = sizeof buf;
+        if (from_area_desc->nad_length - off > sizeof boot_copy_buf) {
+            chunk_sz = sizeof boot_copy_buf;
         } else {
             chunk_sz = from_area_desc->nad_length - off;
         }
 
         from_addr = from_area_desc->nad_offset + off;
-        rc = flash_read(from_addr, buf, chunk_sz);
+        rc = flash_read(from_addr, boot_copy_buf, chunk_sz);
         if (rc != 0) {
             return rc;
         }
 
-        to_addr = to_area_desc->nad_offset + off;
-        rc = flash_write(to_addr, buf, chunk_sz);
-        if (rc != 0) {
-            return rc;
+        blank = 1;
+        for (i = 0; i < chunk_sz; i++) {
+            if (boot_copy_buf[i] != 0xff) {
+                blank = 0;
+                break;
+            }
+        }
+
+        if (!blank) {
+            to_addr = to_area_desc->nad_offset + off;
+            rc = flash_write(to_addr, boot_copy_buf, chunk_sz);
+            if (rc != 0) {
+                return rc;
+            }
         }
 
         off += chunk_sz;
@@ -262,23 +392,53 @@ boot_copy_area(int from_area_idx, int to_area_idx)
 }
 
 /**
- * Swaps the contents of two flash areas.
+ * Records that the image part in one area has been copied to another.  The
+ * in-RAM boot status is updated, and a record is appended to the boot status
+ * file.
  *
- * @param area_idx_1            The index of one area to swap.  This area
- *                                  must be part of the first image slot.
- * @param part_num_1            The image part number stored in the first
- *                                  area.
- * @param area_idx_2            The index of the other area to swap.  This
- *                                  area must be part of the second image
- *                                  slot.
- * @param part_num_2            The image part number stored in the second
- *                                  area.
+ * @param src_image_idx         The image area array index of the source.
+ * @param dst_image_idx         The image area array index of the
+ *                                  destination.
  *
  * @return                      0 on success; nonzero on failure.
  */
 static int
-boot_move_area(int from_area_idx, int to_area_idx,
-                 int img_num, uint8_t part_num)
+boot_record_copy(int src_image_idx, int dst_image_idx)
+{
+    struct boot_status_rec rec;
+    int rc;
+
+    rec.bsr_src_idx = src_image_idx;
+    rec.bsr_dst_idx = dst_image_idx;
+
+    rc = boot_apply_status_rec(boot_status_entries,
+                               boot_req->br_num_image_areas, &rec);
+    assert(rc == 0);
+
+    rc = boot_append_status(&rec);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return 0;
+}
+
+/**
+ * Moves an image part from one area to another, and records the move in the
+ * boot status.  If the system is reset before the record is written, the move
+ * is simply repeated on the next boot.
+ *
+ * The source area is not erased here; vacated areas are erased once all parts
+ * are in place (see boot_erase_vacated_areas()), so an area which is
+ * subsequently refilled is only erased once.
+ *
+ * @param from_area_idx         The index of the area to move.
+ * @param to_area_idx           The index of the destination area.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_move_area(int from_area_idx, int to_area_idx)
 {
     int src_image_idx;
     int dst_image_idx;
@@ -300,17 +460,7 @@ boot_move_area(int from_area_idx, int to_area_idx,
         return rc;
     }
 
-    boot_status_entries[src_image_idx].bse_image_num = BOOT_IMAGE_NUM_NONE;
-    boot_status_entries[src_image_idx].bse_part_num = BOOT_IMAGE_NUM_NONE;
-    boot_status_entries[dst_image_idx].bse_image_num = img_num;
-    boot_status_entries[dst_image_idx].bse_part_num = part_num;
-    rc = boot_write_status(&boot_status, boot_status_entries,
-                           boot_req->br_num_image_areas);
-    if (rc != 0) {
-        return rc;
-    }
-
-    rc = boot_erase_area(from_area_idx);
+    rc = boot_record_copy(src_image_idx, dst_image_idx);
     if (rc != 0) {
         return rc;
     }
@@ -319,99 +469,140 @@ boot_move_area(int from_area_idx, int to_area_idx,
 }
 
 /**
- * Swaps the contents of two flash areas.
+ * Swaps the contents of two flash areas via the scratch area.
  *
- * @param area_idx_1          The index of one area to swap.  This area
+ * @param area_idx_1            The index of one area to swap.  This area
  *                                  must be part of the first image slot.
- * @param part_num_1            The image part number stored in the first
- *                                  area.
- * @param area_idx_2          The index of the other area to swap.  This
+ * @param area_idx_2            The index of the other area to swap.  This
  *                                  area must be part of the second image
  *                                  slot.
- * @param part_num_2            The image part number stored in the second
- *                                  area.
  *
  * @return                      0 on success; nonzero on failure.
  */
 static int
-boot_swap_areas(int area_idx_1, int img_num_1, uint8_t part_num_1,
-                  int area_idx_2, int img_num_2, uint8_t part_num_2)
+boot_swap_areas(int area_idx_1, int area_idx_2)
 {
-    int scratch_image_idx;
-    int image_idx_1;
-    int image_idx_2;
     int rc;
 
     assert(area_idx_1 != area_idx_2);
     assert(area_idx_1 != boot_req->br_scratch_area_idx);
     assert(area_idx_2 != boot_req->br_scratch_area_idx);
 
-    image_idx_1 = boot_find_image_area_idx(area_idx_1);
-    assert(image_idx_1 != -1);
-
-    image_idx_2 = boot_find_image_area_idx(area_idx_2);
-    assert(image_idx_2 != -1);
-
-    scratch_image_idx =
-        boot_find_image_area_idx(boot_req->br_scratch_area_idx);
-    assert(scratch_image_idx != -1);
-
-    rc = boot_erase_area(boot_req->br_scratch_area_idx);
+    rc = boot_move_area(area_idx_2, boot_req->br_scratch_area_idx);
     if (rc != 0) {
         return rc;
     }
 
-    rc = boot_copy_area(area_idx_2, boot_req->br_scratch_area_idx);
+    rc = boot_move_area(area_idx_1, area_idx_2);
     if (rc != 0) {
         return rc;
     }
 
-    boot_status_entries[scratch_image_idx] = boot_status_entries[image_idx_2];
-    boot_status_entries[image_idx_2].bse_image_num = BOOT_IMAGE_NUM_NONE;
-    boot_status_entries[image_idx_2].bse_part_num = BOOT_IMAGE_NUM_NONE;
-
-    rc = boot_write_status(&boot_status, boot_status_entries,
-                           boot_req->br_num_image_areas);
+    rc = boot_move_area(boot_req->br_scratch_area_idx, area_idx_1);
     if (rc != 0) {
         return rc;
     }
 
-    rc = boot_erase_area(area_idx_2);
-    if (rc != 0) {
-        return rc;
+    return 0;
+}
+
+/**
+ * Determines which area an image part occupies once the images have been
+ * swapped: parts of image 1 go to the first slot; parts of image 0 go to the
+ * second.
+ *
+ * @param entry                 The boot status entry describing the part.
+ *
+ * @return                      The destination area index.
+ */
+static int
+boot_part_dst_area_idx(const struct boot_status_entry *entry)
+{
+    int slot;
+
+    if (entry->bse_image_num == 1) {
+        slot = 0;
+    } else {
+        slot = 1;
     }
 
-    rc = boot_copy_area(area_idx_1, area_idx_2);
-    if (rc != 0) {
-        return rc;
+    return boot_slot_to_area_idx(slot) + entry->bse_part_num;
+}
+
+/**
+ * Completes a swap which was interrupted while a part was held in the
+ * scratch area.  The scratch area must be emptied before it can be used by
+ * another swap.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_drain_scratch(void)
+{
+    const struct boot_status_entry *entry;
+    int scratch_image_idx;
+    int dst_image_idx;
+    int dst_area_idx;
+    int rc;
+
+    scratch_image_idx =
+        boot_find_image_area_idx(boot_req->br_scratch_area_idx);
+    assert(scratch_image_idx != -1);
+
+    entry = boot_status_entries + scratch_image_idx;
+    if (entry->bse_image_num == BOOT_IMAGE_NUM_NONE) {
+        return 0;
     }
 
-    boot_status_entries[image_idx_2] = boot_status_entries[image_idx_1];
-    boot_status_entries[image_idx_1].bse_image_num = BOOT_IMAGE_NUM_NONE;
-    boot_status_entries[image_idx_1].bse_part_num = BOOT_IMAGE_NUM_NONE;
-    rc = boot_write_status(&boot_status, boot_status_entries,
-                           boot_req->br_num_image_areas);
-    if (rc != 0) {
-        return rc;
+    dst_area_idx = boot_part_dst_area_idx(entry);
+    dst_image_idx = boot_find_image_area_idx(dst_area_idx);
+    if (dst_image_idx == -1) {
+        return BOOT_EBADSTATUS;
     }
 
-    rc = boot_erase_area(area_idx_1);
-    if (rc != 0) {
-        return rc;
+    entry = boot_status_entries + dst_image_idx;
+    if (entry->bse_image_num != BOOT_IMAGE_NUM_NONE) {
+        /* The second step of the swap did not complete; the destination
+         * still holds the other image's part.  Its own destination is the
+         * area which was emptied into the scratch area.
+         */
+        rc = boot_move_area(dst_area_idx, boot_part_dst_area_idx(entry));
+        if (rc != 0) {
+            return rc;
+        }
     }
 
-    rc = boot_copy_area(boot_req->br_scratch_area_idx, area_idx_1);
+    rc = boot_move_area(boot_req->br_scratch_area_idx, dst_area_idx);
     if (rc != 0) {
         return rc;
     }
 
-    boot_status_entries[image_idx_1] = boot_status_entries[scratch_image_idx];
-    boot_status_entries[scratch_image_idx].bse_image_num = BOOT_IMAGE_NUM_NONE;
-    boot_status_entries[scratch_image_idx].bse_part_num = BOOT_IMAGE_NUM_NONE;
-    rc = boot_write_status(&boot_status, boot_status_entries,
-                           boot_req->br_num_image_areas);
-    if (rc != 0) {
-        return rc;
+    return 0;
+}
+
+/**
+ * Erases each image area which no longer contains an image part.  The
+ * scratch area is left as is; it is erased before its next use.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_erase_vacated_areas(void)
+{
+    int area_idx;
+    int rc;
+    int i;
+
+    for (i = 0; i < boot_req->br_num_image_areas; i++) {
+        area_idx = boot_req->br_image_areas[i];
+        if (area_idx != boot_req->br_scratch_area_idx &&
+            boot_status_entries[i].bse_image_num == BOOT_IMAGE_NUM_NONE) {
+
+            rc = boot_erase_area(area_idx);
+            if (rc != 0) {
+                return rc;
+            }
+        }
     }
 
     return 0;
@@ -425,8 +616,6 @@ boot_fill_slot(int img_num, uint32_t img_length, int start_area_idx)
     int dst_image_area_idx;
     int src_area_idx;
     int dst_area_idx;
-    int src_img_num;
-    int dst_img_num;
     int part_num;
     int rc;
 
@@ -454,14 +643,10 @@ boot_fill_slot(int img_num, uint32_t img_length, int start_area_idx)
                 /* The destination doesn't contain anything useful; we don't
                  * need to back up its contents.
                  */
-                rc = boot_move_area(src_area_idx, dst_area_idx,
-                                    img_num, part_num);
+                rc = boot_move_area(src_area_idx, dst_area_idx);
             } else {
                 /* Swap the two areas. */
-                src_img_num = img_num ^ 1;
-                dst_img_num = img_num;
-                rc = boot_swap_areas(src_area_idx, src_img_num, part_num,
-                                     dst_area_idx, dst_img_num, part_num);
+                rc = boot_swap_areas(src_area_idx, dst_area_idx);
             }
             if (rc != 0) {
                 return rc;
@@ -491,6 +676,11 @@ boot_copy_image(uint32_t img1_length, uint32_t img2_length)
 {
     int rc;
 
+    rc = boot_drain_scratch();
+    if (rc != 0) {
+        return rc;
+    }
+
     rc = boot_fill_slot(1, img2_length, boot_slot_to_area_idx(0));
     if (rc != 0) {
         return rc;
@@ -501,9 +691,548 @@ boot_copy_image(uint32_t img1_length, uint32_t img2_length)
         return rc;
     }
 
+    rc = boot_erase_vacated_areas();
+    if (rc != 0) {
+        return rc;
+    }
+
     return 0;
 }
 
+/**
+ * Calculates the number of bytes available in an image slot.  A slot spans
+ * consecutive image areas, up to the next slot or the scratch area.
+ *
+ * @param slot_num              The slot to measure.
+ *
+ * @return                      The size of the slot, in bytes.
+ */
+static uint32_t
+boot_slot_size(int slot_num)
+{
+    uint32_t size;
+    int end_area_idx;
+    int area_idx;
+
+    if (slot_num + 1 < BOOT_NUM_SLOTS) {
+        end_area_idx = boot_slot_to_area_idx(slot_num + 1);
+    } else {
+        end_area_idx = -1;
+    }
+
+    size = 0;
+    for (area_idx = boot_slot_to_area_idx(slot_num);
+         boot_req->br_area_descs[area_idx].nad_length != 0;
+         area_idx++) {
+
+        if (area_idx == end_area_idx ||
+            area_idx == boot_req->br_scratch_area_idx ||
+            boot_find_image_area_idx(area_idx) == -1) {
+
+            break;
+        }
+
+        size += boot_req->br_area_descs[area_idx].nad_length;
+    }
+
+    return size;
+}
+
+/** Rebuild op: copy from earlier in the target image (LZ4 match). */
+#define BOOT_REBUILD_OP_MATCH       3
+
+/** Describes the input of an image rebuild. */
+struct boot_rebuild_desc {
+    uint32_t brd_flags;         /* IMAGE_F_DELTA or IMAGE_F_COMPRESSED. */
+    uint32_t brd_base_size;     /* Delta only. */
+    uint32_t brd_tgt_size;
+    uint32_t brd_in_addr;       /* Flash address of the ops or LZ4 block. */
+    uint32_t brd_in_len;
+};
+
+/**
+ * Reads and validates the headers of the delta or compressed image held in
+ * the scratch area.
+ *
+ * @param out_desc              On success, a description of the image gets
+ *                                  written here.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_rebuild_read_hdr(struct boot_rebuild_desc *out_desc)
+{
+    const struct nffs_area_desc *scratch_desc;
+    struct image_delta_hdr delta_hdr;
+    struct image_comp_hdr comp_hdr;
+    struct image_header hdr;
+    uint32_t body_addr;
+    int rc;
+
+    scratch_desc = boot_req->br_area_descs + boot_req->br_scratch_area_idx;
+
+    rc = flash_read(scratch_desc->nad_offset, &hdr, sizeof hdr);
+    if (rc != 0) {
+        return BOOT_EFLASH;
+    }
+
+    if (hdr.ih_magic != IMAGE_MAGIC ||
+        hdr.ih_hdr_size > scratch_desc->nad_length ||
+        hdr.ih_img_size > scratch_desc->nad_length - hdr.ih_hdr_size) {
+
+        return BOOT_EBADIMAGE;
+    }
+
+    body_addr = scratch_desc->nad_offset + hdr.ih_hdr_size;
+    out_desc->brd_flags = hdr.ih_flags & (IMAGE_F_DELTA | IMAGE_F_COMPRESSED);
+
+    switch (out_desc->brd_flags) {
+    case IMAGE_F_DELTA:
+        if (hdr.ih_img_size < sizeof delta_hdr) {
+            return BOOT_EBADIMAGE;
+        }
+
+        rc = flash_read(body_addr, &delta_hdr, sizeof delta_hdr);
+        if (rc != 0) {
+            return BOOT_EFLASH;
+        }
+
+        if (delta_hdr.idh_magic != IMAGE_DELTA_MAGIC ||
+            delta_hdr.idh_base_size > boot_slot_size(0)) {
+
+            return BOOT_EBADIMAGE;
+        }
+
+        out_desc->brd_base_size = delta_hdr.idh_base_size;
+        out_desc->brd_tgt_size = delta_hdr.idh_tgt_size;
+        out_desc->brd_in_addr = body_addr + sizeof delta_hdr;
+        out_desc->brd_in_len = hdr.ih_img_size - sizeof delta_hdr;
+        break;
+
+    case IMAGE_F_COMPRESSED:
+        if (hdr.ih_img_size < sizeof comp_hdr) {
+            return BOOT_EBADIMAGE;
+        }
+
+        rc = flash_read(body_addr, &comp_hdr, sizeof comp_hdr);
+        if (rc != 0) {
+            return BOOT_EFLASH;
+        }
+
+        if (comp_hdr.ich_magic != IMAGE_COMP_MAGIC) {
+            return BOOT_EBADIMAGE;
+        }
+
+        out_desc->brd_base_size = 0;
+        out_desc->brd_tgt_size = comp_hdr.ich_tgt_size;
+        out_desc->brd_in_addr = body_addr + sizeof comp_hdr;
+        out_desc->brd_in_len = hdr.ih_img_size - sizeof comp_hdr;
+        break;
+
+    default:
+        return BOOT_EBADIMAGE;
+    }
+
+    if (out_desc->brd_tgt_size > boot_slot_size(1)) {
+        return BOOT_EBADIMAGE;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the next delta operation and makes it current.
+ *
+ * @param state                 The rebuild progress to update.
+ * @param desc                  Describes the delta being applied.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_delta_next_op(struct boot_rebuild_state *state,
+                   const struct boot_rebuild_desc *desc)
+{
+    struct image_delta_op op;
+    int rc;
+
+    if (state->brs_in_off > desc->brd_in_len ||
+        desc->brd_in_len - state->brs_in_off < sizeof op) {
+
+        return BOOT_EBADIMAGE;
+    }
+
+    rc = flash_read(desc->brd_in_addr + state->brs_in_off, &op, sizeof op);
+    if (rc != 0) {
+        return BOOT_EFLASH;
+    }
+    state->brs_in_off += sizeof op;
+
+    switch (op.ido_type) {
+    case IMAGE_DELTA_OP_COPY:
+        if (op.ido_src > desc->brd_base_size ||
+            op.ido_len > desc->brd_base_size - op.ido_src) {
+
+            return BOOT_EBADIMAGE;
+        }
+        break;
+
+    case IMAGE_DELTA_OP_DATA:
+        if (op.ido_len > desc->brd_in_len - state->brs_in_off) {
+            return BOOT_EBADIMAGE;
+        }
+        break;
+
+    default:
+        return BOOT_EBADIMAGE;
+    }
+
+    state->brs_op_type = op.ido_type;
+    state->brs_op_len = op.ido_len;
+    state->brs_op_src = op.ido_src;
+
+    return 0;
+}
+
+/**
+ * Reads an LZ4 length: a base value, extended by a run of bytes while the
+ * base and each subsequent byte are at their maximum.
+ */
+static int
+boot_lz_read_len(struct boot_rebuild_state *state,
+                 const struct boot_rebuild_desc *desc, uint32_t base,
+                 uint32_t *out_len)
+{
+    uint8_t b;
+    int rc;
+
+    *out_len = base;
+    if (base != 15) {
+        return 0;
+    }
+
+    do {
+        if (state->brs_in_off >= desc->brd_in_len) {
+            return BOOT_EBADIMAGE;
+        }
+
+        rc = flash_read(desc->brd_in_addr + state->brs_in_off, &b, 1);
+        if (rc != 0) {
+            return BOOT_EFLASH;
+        }
+        state->brs_in_off++;
+
+        *out_len += b;
+        if (*out_len > desc->brd_tgt_size) {
+            return BOOT_EBADIMAGE;
+        }
+    } while (b == 255);
+
+    return 0;
+}
+
+/**
+ * Parses the next LZ4 sequence element and makes it the current op.  Each
+ * sequence consists of a token, literal data, and a match; the literals
+ * become a DATA op and the match a MATCH op.  The match nibble is kept in
+ * the rebuild state while the literals are copied.
+ *
+ * @param state                 The rebuild progress to update.
+ * @param desc                  Describes the compressed image.
+ * @param pos                   The target offset the op will produce.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_lz_next_op(struct boot_rebuild_state *state,
+                const struct boot_rebuild_desc *desc, uint32_t pos)
+{
+    uint32_t len;
+    uint16_t dist;
+    uint8_t token;
+    int rc;
+
+    if (state->brs_lz_match != 0) {
+        if (desc->brd_in_len - state->brs_in_off < sizeof dist) {
+            return BOOT_EBADIMAGE;
+        }
+
+        rc = flash_read(desc->brd_in_addr + state->brs_in_off, &dist,
+                        sizeof dist);
+        if (rc != 0) {
+            return BOOT_EFLASH;
+        }
+        state->brs_in_off += sizeof dist;
+
+        if (dist == 0 || dist > pos) {
+            return BOOT_EBADIMAGE;
+        }
+
+        rc = boot_lz_read_len(state, desc, state->brs_lz_match - 1, &len);
+        if (rc != 0) {
+            return rc;
+        }
+
+        state->brs_op_type = BOOT_REBUILD_OP_MATCH;
+        state->brs_op_len = len + 4;
+        state->brs_op_src = pos - dist;
+        state->brs_lz_match = 0;
+
+        return 0;
+    }
+
+    if (state->brs_in_off >= desc->brd_in_len) {
+        return BOOT_EBADIMAGE;
+    }
+
+    rc = flash_read(desc->brd_in_addr + state->brs_in_off, &token, 1);
+    if (rc != 0) {
+        return BOOT_EFLASH;
+    }
+    state->brs_in_off++;
+
+    rc = boot_lz_read_len(state, desc, token >> 4, &len);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (len > desc->brd_in_len - state->brs_in_off) {
+        return BOOT_EBADIMAGE;
+    }
+
+    state->brs_op_type = IMAGE_DELTA_OP_DATA;
+    state->brs_op_len = len;
+    state->brs_lz_match = (token & 0x0f) + 1;
+
+    return 0;
+}
+
+/**
+ * Rebuilds a full image in the second slot from the delta or compressed
+ * image held in the scratch area.  A delta's base image is read from the
+ * first slot; a compressed image's matches are read back from the part of
+ * the target already produced.  Output is staged in the copy buffer and
+ * written in buffer-sized chunks; each slot area is erased just before it is
+ * first written.  Progress is recorded each time an area is filled.
+ *
+ * @param state                 The progress to resume from.  For a new
+ *                                  rebuild, this is all zeros.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_rebuild_run(struct boot_rebuild_state *state)
+{
+    struct boot_rebuild_desc desc;
+    uint32_t area_start;
+    uint32_t area_end;
+    uint32_t base_addr;
+    uint32_t tgt_addr;
+    uint32_t chunk_sz;
+    uint32_t buf_len;
+    uint32_t pos;
+    int area_idx;
+    int rc;
+
+    rc = boot_rebuild_read_hdr(&desc);
+    if (rc != 0) {
+        return rc;
+    }
+
+    base_addr = boot_slot_addr(0);
+    tgt_addr = boot_slot_addr(1);
+
+    area_idx = -1;
+    area_end = 0;
+    buf_len = 0;
+    while (state->brs_tgt_off < desc.brd_tgt_size) {
+        if (area_idx == -1) {
+            /* Locate and erase the area containing the next target byte.
+             * Progress is only recorded at area boundaries, so the area may
+             * hold a partial write from before a reset.
+             */
+            area_idx = boot_slot_to_area_idx(1);
+            area_start = 0;
+            while (1) {
+                area_end = area_start +
+                           boot_req->br_area_descs[area_idx].nad_length;
+                if (state->brs_tgt_off < area_end) {
+                    break;
+                }
+                area_start = area_end;
+                area_idx++;
+            }
+
+            rc = boot_erase_area(area_idx);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+
+        pos = state->brs_tgt_off + buf_len;
+
+        if (state->brs_op_len == 0) {
+            if (desc.brd_flags == IMAGE_F_DELTA) {
+                rc = boot_delta_next_op(state, &desc);
+            } else {
+                rc = boot_lz_next_op(state, &desc, pos);
+            }
+            if (rc != 0) {
+                return rc;
+            }
+            continue;
+        }
+
+        chunk_sz = state->brs_op_len;
+        if (chunk_sz > sizeof boot_copy_buf - buf_len) {
+            chunk_sz = sizeof boot_copy_buf - buf_len;
+        }
+        if (chunk_sz > area_end - pos) {
+            chunk_sz = area_end - pos;
+        }
+        if (chunk_sz > desc.brd_tgt_size - pos) {
+            chunk_sz = desc.brd_tgt_size - pos;
+        }
+
+        switch (state->brs_op_type) {
+        case IMAGE_DELTA_OP_COPY:
+            rc = flash_read(base_addr + state->brs_op_src,
+                            boot_copy_buf + buf_len, chunk_sz);
+            state->brs_op_src += chunk_sz;
+            break;
+
+        case IMAGE_DELTA_OP_DATA:
+            rc = flash_read(desc.brd_in_addr + state->brs_in_off,
+                            boot_copy_buf + buf_len, chunk_sz);
+            state->brs_in_off += chunk_sz;
+            break;
+
+        case BOOT_REBUILD_OP_MATCH:
+            /* The source either has been written to flash or is still in the
+             * copy buffer.  A match may overlap its own output, so never
+             * copy more than the distance between source and destination at
+             * once.
+             */
+            if (chunk_sz > pos - state->brs_op_src) {
+                chunk_sz = pos - state->brs_op_src;
+            }
+            if (state->brs_op_src < state->brs_tgt_off) {
+                if (chunk_sz > state->brs_tgt_off - state->brs_op_src) {
+                    chunk_sz = state->brs_tgt_off - state->brs_op_src;
+                }
+                rc = flash_read(tgt_addr + state->brs_op_src,
+                                boot_copy_buf + buf_len, chunk_sz);
+            } else {
+                memcpy(boot_copy_buf + buf_len,
+                       boot_copy_buf + state->brs_op_src - state->brs_tgt_off,
+                       chunk_sz);
+                rc = 0;
+            }
+            state->brs_op_src += chunk_sz;
+            break;
+
+        default:
+            return BOOT_EBADIMAGE;
+        }
+        if (rc != 0) {
+            return BOOT_EFLASH;
+        }
+
+        state->brs_op_len -= chunk_sz;
+        buf_len += chunk_sz;
+        pos += chunk_sz;
+
+        if (buf_len == sizeof boot_copy_buf || pos == area_end ||
+            pos == desc.brd_tgt_size) {
+
+            rc = flash_write(tgt_addr + state->brs_tgt_off, boot_copy_buf,
+                             buf_len);
+            if (rc != 0) {
+                return BOOT_EFLASH;
+            }
+            state->brs_tgt_off += buf_len;
+            buf_len = 0;
+
+            if (state->brs_tgt_off == area_end) {
+                rc = boot_append_rebuild_state(state, 0);
+                if (rc != 0) {
+                    return rc;
+                }
+                area_idx = -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Begins rebuilding the delta or compressed image in the second slot into a
+ * full image.  The image is first copied to the scratch area, freeing the
+ * second slot to receive the rebuilt image.  The image must therefore fit in
+ * the first area of the second slot, and that area must be no larger than
+ * the scratch area.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+boot_rebuild_start(void)
+{
+    struct boot_rebuild_state state;
+    struct image_delta_hdr delta_hdr;
+    const struct image_header *hdr;
+    uint32_t img_len;
+    int area_idx;
+    int rc;
+
+    hdr = &boot_img_hdrs[1];
+
+    if (hdr->ih_flags & IMAGE_F_DELTA) {
+        rc = flash_read(boot_slot_addr(1) + hdr->ih_hdr_size, &delta_hdr,
+                        sizeof delta_hdr);
+        if (rc != 0) {
+            return BOOT_EFLASH;
+        }
+
+        /* The delta only applies to the exact image it was generated
+         * from.
+         */
+        if (delta_hdr.idh_magic != IMAGE_DELTA_MAGIC ||
+            boot_img_hdrs[0].ih_magic != IMAGE_MAGIC ||
+            boot_img_hdrs[0].ih_crc32 != delta_hdr.idh_base_crc32 ||
+            boot_status.bs_img1_length != delta_hdr.idh_base_size) {
+
+            return BOOT_EBADIMAGE;
+        }
+    }
+
+    area_idx = boot_slot_to_area_idx(1);
+    img_len = hdr->ih_hdr_size + hdr->ih_img_size;
+    if (img_len > boot_req->br_area_descs[area_idx].nad_length ||
+        boot_req->br_area_descs[area_idx].nad_length >
+        boot_req->br_area_descs[boot_req->br_scratch_area_idx].nad_length) {
+
+        return BOOT_EBADIMAGE;
+    }
+
+    rc = boot_erase_area(boot_req->br_scratch_area_idx);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = boot_copy_area(area_idx, boot_req->br_scratch_area_idx);
+    if (rc != 0) {
+        return BOOT_EFLASH;
+    }
+
+    memset(&state, 0, sizeof state);
+    rc = boot_append_rebuild_state(&state, 1);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return boot_rebuild_run(&state);
+}
+
 /**
  * Builds a single default boot status for the specified image slot.
  */
@@ -553,17 +1282,19 @@ boot_build_status(void)
            boot_req->br_num_image_areas * sizeof *boot_status_entries);
 
     if (boot_img_hdrs[0].ih_magic == IMAGE_MAGIC) {
-        boot_status.bs_img1_length = boot_img_hdrs[0].ih_img_size;
+        boot_status.bs_img1_length = boot_img_hdrs[0].ih_hdr_size +
+                                     boot_img_hdrs[0].ih_img_size;
         boot_build_status_one(0, boot_slot_addr(0),
-                              boot_img_hdrs[0].ih_img_size);
+                              boot_status.bs_img1_length);
     } else {
         boot_status.bs_img1_length = 0;
     }
 
     if (boot_img_hdrs[1].ih_magic == IMAGE_MAGIC) {
-        boot_status.bs_img2_length = boot_img_hdrs[1].ih_img_size;
+        boot_status.bs_img2_length = boot_img_hdrs[1].ih_hdr_size +
+                                     boot_img_hdrs[1].ih_img_size;
         boot_build_status_one(1, boot_slot_addr(1),
-                              boot_img_hdrs[1].ih_img_size);
+                              boot_status.bs_img2_length);
     } else {
         boot_status.bs_img2_length = 0;
     }
@@ -615,6 +1346,7 @@ int
 boot_go(const struct boot_req *req, struct boot_rsp *rsp)
 {
     uint32_t image_addrs[BOOT_NUM_SLOTS];
+    struct boot_rebuild_state rebuild_state;
     int slot;
     int rc;
     int i;
@@ -654,6 +1386,16 @@ boot_go(const struct boot_req *req, struct boot_rsp *rsp)
         }
     }
 
+    /* Finish rebuilding a delta or compressed image if the system was reset
+     * part way through.  On failure, the second slot holds an incomplete
+     * image which fails verification below.
+     */
+    rc = boot_read_rebuild_state(&rebuild_state);
+    if (rc == 0) {
+        boot_rebuild_run(&rebuild_state);
+        boot_clear_rebuild_state();
+    }
+
     /* Cache the flash address of each image slot. */
     for (i = 0; i < BOOT_NUM_SLOTS; i++) {
         image_addrs[i] = boot_slot_addr(i);
@@ -684,6 +1426,28 @@ boot_go(const struct boot_req *req, struct boot_rsp *rsp)
         }
     }
 
+    if (slot == 1 && boot_image_check(&boot_img_hdrs[1], 1) != 0) {
+        /* Never move a corrupt image into the primary slot. */
+        slot = 0;
+    }
+
+    if (slot == 1 &&
+        boot_img_hdrs[1].ih_flags & (IMAGE_F_DELTA | IMAGE_F_COMPRESSED)) {
+
+        /* Rebuild the full image in the secondary slot, then verify it like
+         * any other.
+         */
+        rc = boot_rebuild_start();
+        boot_clear_rebuild_state();
+
+        boot_read_image_headers(boot_img_hdrs, image_addrs, BOOT_NUM_SLOTS);
+        boot_build_status();
+
+        if (rc != 0 || boot_image_check(&boot_img_hdrs[1], 1) != 0) {
+            slot = 0;
+        }
+    }
+
     switch (slot) {
     case 0:
         rsp->br_hdr = &boot_img_hdrs[0];
@@ -691,8 +1455,22 @@ boot_go(const struct boot_req *req, struct boot_rsp *rsp)
 
     case 1:
         /* The user wants to run the image in the secondary slot.  The contents
-         * of this slot need to moved to the primary slot.
+         * of this slot need to moved to the primary slot.  The primary slot's
+         * cached verification no longer applies once the swap starts writing
+         * it, so drop the cache first.  Then write the initial boot status;
+         * each subsequent copy appends a record to it.
          */
+        rc = boot_clear_verified();
+        if (rc != 0) {
+            return rc;
+        }
+
+        rc = boot_write_status(&boot_status, boot_status_entries,
+                               boot_req->br_num_image_areas);
+        if (rc != 0) {
+            return rc;
+        }
+
         rc = boot_copy_image(boot_status.bs_img1_length,
                              boot_status.bs_img2_length);
 
@@ -714,6 +1492,15 @@ boot_go(const struct boot_req *req, struct boot_rsp *rsp)
     /* Always boot from the primary slot. */
     rsp->br_image_addr = image_addrs[0];
 
+    if (rsp->br_hdr->ih_flags & (IMAGE_F_DELTA | IMAGE_F_COMPRESSED)) {
+        return BOOT_EBADIMAGE;
+    }
+
+    rc = boot_image_check(rsp->br_hdr, 0);
+    if (rc != 0) {
+        return rc;
+    }
+
     /* After successful boot, there should not be a status file. */
     nffs_unlink(BOOT_PATH_STATUS);
 
@@ -24,12 +24,19 @@
 #include "hal/hal_flash.h"
 #include "nffs/nffs.h"
 #include "nffs/nffsutil.h"
+#include "bootutil/crc32.h"
 #include "bootutil/image.h"
+#include "bootutil/image_comp.h"
+#include "bootutil/image_delta.h"
 #include "bootutil/loader.h"
 #include "../src/bootutil_priv.h"
 
 #define BOOT_TEST_HEADER_SIZE       0x200
 
+int flash_native_fail_after(int num_ops);
+int flash_native_memset(uint32_t offset, uint8_t c, uint32_t len);
+int flash_native_overwrite(uint32_t address, const void *src, uint32_t length);
+
 /** Internal flash layout. */
 static struct nffs_area_desc boot_test_area_descs[] = {
     [0] =  { 0x00000000, 16 * 1024 },
@@ -187,11 +194,16 @@ boot_test_util_swap_areas(int area_idx1, int area_idx2)
     free(buf2);
 }
 
+/**
+ * Writes an image to the specified slot.  The header's CRC field is filled in
+ * to match the image contents.
+ */
 static void
-boot_test_util_write_image(const struct image_header *hdr, int slot)
+boot_test_util_write_image(struct image_header *hdr, int slot)
 {
     uint32_t image_off;
     uint32_t off;
+    uint32_t crc;
     uint8_t buf[256];
     int chunk_sz;
     int rc;
@@ -199,12 +211,22 @@ boot_test_util_write_image(const struct image_header *hdr, int slot)
 
     TEST_ASSERT(slot == 0 || slot == 1);
 
-    off = boot_test_img_addrs[slot];
-
-    rc = flash_write(off, hdr, sizeof *hdr);
-    TEST_ASSERT(rc == 0);
+    /* The CRC covers the rest of the header, the erased padding between the
+     * header and the body, and the body.
+     */
+    crc = crc32(0, (uint8_t *)hdr + IMAGE_HEADER_CRC_OFFSET + 4,
+                sizeof *hdr - IMAGE_HEADER_CRC_OFFSET - 4);
+    memset(buf, 0xff, sizeof buf);
+    for (off = sizeof *hdr; off < hdr->ih_hdr_size; off += chunk_sz) {
+        if (hdr->ih_hdr_size - off > sizeof buf) {
+            chunk_sz = sizeof buf;
+        } else {
+            chunk_sz = hdr->ih_hdr_size - off;
+        }
+        crc = crc32(crc, buf, chunk_sz);
+    }
 
-    off += hdr->ih_hdr_size;
+    off = boot_test_img_addrs[slot] + hdr->ih_hdr_size;
 
     image_off = 0;
     while (image_off < hdr->ih_img_size) {
@@ -221,8 +243,13 @@ boot_test_util_write_image(const struct image_header *hdr, int slot)
         rc = flash_write(off + image_off, buf, chunk_sz);
         TEST_ASSERT(rc == 0);
 
+        crc = crc32(crc, buf, chunk_sz);
         image_off += chunk_sz;
     }
+
+    hdr->ih_crc32 = crc;
+    rc = flash_write(boot_test_img_addrs[slot], hdr, sizeof *hdr);
+    TEST_ASSERT(rc == 0);
 }
 
 static void
@@ -338,6 +365,222 @@ boot_test_util_verify_flash(const struct image_header *hdr0, int orig_slot_0,
     }
 }
 
+#define BOOT_TEST_DELTA_BASE_SZ     (BOOT_TEST_HEADER_SIZE + 150 * 1024)
+#define BOOT_TEST_DELTA_TGT_SZ      (BOOT_TEST_HEADER_SIZE + 190 * 1024)
+
+static uint8_t boot_test_delta_base[BOOT_TEST_DELTA_BASE_SZ];
+static uint8_t boot_test_delta_tgt[BOOT_TEST_DELTA_TGT_SZ];
+
+static uint32_t boot_test_rand_state;
+
+static uint8_t
+boot_test_util_rand_byte(void)
+{
+    boot_test_rand_state = boot_test_rand_state * 1103515245 + 12345;
+    return boot_test_rand_state >> 16;
+}
+
+/**
+ * Fills in an image's header and calculates its CRC.  The image body must
+ * already be in place.
+ */
+static void
+boot_test_util_finish_image(uint8_t *img, struct image_header *hdr)
+{
+    memset(img + sizeof *hdr, 0xff, hdr->ih_hdr_size - sizeof *hdr);
+    memcpy(img, hdr, sizeof *hdr);
+
+    hdr->ih_crc32 = crc32(0, img + IMAGE_HEADER_CRC_OFFSET + 4,
+                          hdr->ih_hdr_size + hdr->ih_img_size -
+                          IMAGE_HEADER_CRC_OFFSET - 4);
+    memcpy(img, hdr, sizeof *hdr);
+}
+
+/**
+ * Builds a pair of images for delta tests.  The target is the base with
+ * bytes inserted, modified, and removed, and a new tail.
+ */
+static void
+boot_test_util_delta_build(struct image_header *base_hdr,
+                           struct image_header *tgt_hdr)
+{
+    uint8_t *base_body;
+    uint8_t *tgt_body;
+    uint32_t off;
+    int i;
+
+    base_body = boot_test_delta_base + BOOT_TEST_HEADER_SIZE;
+    tgt_body = boot_test_delta_tgt + BOOT_TEST_HEADER_SIZE;
+
+    boot_test_rand_state = 1;
+    for (i = 0; i < base_hdr->ih_img_size; i++) {
+        base_body[i] = boot_test_util_rand_byte();
+    }
+
+    off = 0;
+    memcpy(tgt_body + off, base_body, 10000);
+    off += 10000;
+    for (i = 0; i < 777; i++) {
+        tgt_body[off++] = boot_test_util_rand_byte();
+    }
+    memcpy(tgt_body + off, base_body + 10000, 50000);
+    for (i = 0; i < 50000; i += 4096) {
+        tgt_body[off + i] ^= 0x5a;
+    }
+    off += 50000;
+    memcpy(tgt_body + off, base_body + 62000, 150 * 1024 - 62000);
+    off += 150 * 1024 - 62000;
+    while (off < tgt_hdr->ih_img_size) {
+        tgt_body[off++] = boot_test_util_rand_byte();
+    }
+
+    boot_test_util_finish_image(boot_test_delta_base, base_hdr);
+    boot_test_util_finish_image(boot_test_delta_tgt, tgt_hdr);
+}
+
+/**
+ * Writes the base image to the first slot and a delta image which turns it
+ * into the target to the second slot.
+ */
+static void
+boot_test_util_delta_write(const struct image_header *tgt_hdr)
+{
+    struct image_header delta_hdr;
+    uint8_t *body;
+    uint32_t body_len;
+    uint32_t crc;
+    int rc;
+
+    rc = image_delta_create(boot_test_delta_base, BOOT_TEST_DELTA_BASE_SZ,
+                            boot_test_delta_tgt, BOOT_TEST_DELTA_TGT_SZ,
+                            &body, &body_len);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    /* Most of the target is shared with the base. */
+    TEST_ASSERT(body_len < BOOT_TEST_DELTA_TGT_SZ / 3);
+
+    memset(&delta_hdr, 0, sizeof delta_hdr);
+    delta_hdr.ih_magic = IMAGE_MAGIC;
+    delta_hdr.ih_hdr_size = sizeof delta_hdr;
+    delta_hdr.ih_img_size = body_len;
+    delta_hdr.ih_flags = IMAGE_F_DELTA;
+    delta_hdr.ih_ver = tgt_hdr->ih_ver;
+
+    crc = crc32(0, (uint8_t *)&delta_hdr + IMAGE_HEADER_CRC_OFFSET + 4,
+                sizeof delta_hdr - IMAGE_HEADER_CRC_OFFSET - 4);
+    delta_hdr.ih_crc32 = crc32(crc, body, body_len);
+
+    rc = flash_write(boot_test_img_addrs[0], boot_test_delta_base,
+                     BOOT_TEST_DELTA_BASE_SZ);
+    TEST_ASSERT(rc == 0);
+
+    rc = flash_write(boot_test_img_addrs[1], &delta_hdr, sizeof delta_hdr);
+    TEST_ASSERT(rc == 0);
+    rc = flash_write(boot_test_img_addrs[1] + sizeof delta_hdr, body,
+                     body_len);
+    TEST_ASSERT(rc == 0);
+
+    free(body);
+}
+
+/**
+ * Builds a pair of images for compression tests.  The target consists of
+ * short runs drawn from a small set, so that it compresses roughly as well
+ * as typical code.
+ */
+static void
+boot_test_util_comp_build(struct image_header *base_hdr,
+                          struct image_header *tgt_hdr)
+{
+    uint8_t dict[32][16];
+    uint8_t *tgt_body;
+    uint32_t off;
+    int len;
+    int i;
+
+    boot_test_util_delta_build(base_hdr, tgt_hdr);
+
+    for (i = 0; i < sizeof dict; i++) {
+        dict[i / 16][i % 16] = boot_test_util_rand_byte();
+    }
+
+    tgt_body = boot_test_delta_tgt + BOOT_TEST_HEADER_SIZE;
+    for (off = 0; off < tgt_hdr->ih_img_size; off += len) {
+        len = 4 + boot_test_util_rand_byte() % 13;
+        if (len > tgt_hdr->ih_img_size - off) {
+            len = tgt_hdr->ih_img_size - off;
+        }
+        memcpy(tgt_body + off, dict[boot_test_util_rand_byte() % 32], len);
+        tgt_body[off] = boot_test_util_rand_byte();
+    }
+
+    boot_test_util_finish_image(boot_test_delta_tgt, tgt_hdr);
+}
+
+/**
+ * Writes the base image to the first slot and the compressed target image
+ * to the second slot.
+ */
+static void
+boot_test_util_comp_write(const struct image_header *tgt_hdr,
+                          const uint8_t *body, uint32_t body_len)
+{
+    struct image_header comp_hdr;
+    uint32_t crc;
+    int rc;
+
+    memset(&comp_hdr, 0, sizeof comp_hdr);
+    comp_hdr.ih_magic = IMAGE_MAGIC;
+    comp_hdr.ih_hdr_size = sizeof comp_hdr;
+    comp_hdr.ih_img_size = body_len;
+    comp_hdr.ih_flags = IMAGE_F_COMPRESSED;
+    comp_hdr.ih_ver = tgt_hdr->ih_ver;
+
+    crc = crc32(0, (uint8_t *)&comp_hdr + IMAGE_HEADER_CRC_OFFSET + 4,
+                sizeof comp_hdr - IMAGE_HEADER_CRC_OFFSET - 4);
+    comp_hdr.ih_crc32 = crc32(crc, body, body_len);
+
+    rc = flash_write(boot_test_img_addrs[0], boot_test_delta_base,
+                     BOOT_TEST_DELTA_BASE_SZ);
+    TEST_ASSERT(rc == 0);
+
+    rc = flash_write(boot_test_img_addrs[1], &comp_hdr, sizeof comp_hdr);
+    TEST_ASSERT(rc == 0);
+    rc = flash_write(boot_test_img_addrs[1] + sizeof comp_hdr, body,
+                     body_len);
+    TEST_ASSERT(rc == 0);
+}
+
+static void
+boot_test_util_verify_buf(uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+    uint8_t chunk[256];
+    uint32_t off;
+    int chunk_sz;
+    int rc;
+
+    for (off = 0; off < len; off += chunk_sz) {
+        chunk_sz = len - off;
+        if (chunk_sz > sizeof chunk) {
+            chunk_sz = sizeof chunk;
+        }
+
+        rc = flash_read(addr + off, chunk, chunk_sz);
+        TEST_ASSERT(rc == 0);
+        TEST_ASSERT_FATAL(memcmp(chunk, buf + off, chunk_sz) == 0);
+    }
+}
+
+static void
+boot_test_util_verify_rebuild_clear(void)
+{
+    struct nffs_file *file;
+    int rc;
+
+    rc = nffs_open(BOOT_PATH_REBUILD, NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == NFFS_ENOENT);
+}
+
 TEST_CASE(boot_test_nv_ns_10)
 {
     struct boot_rsp rsp;
@@ -917,6 +1160,664 @@ TEST_CASE(boot_test_vb_ns_11)
     }
 }
 
+TEST_CASE(boot_test_vb_ns_11_2areas_reset)
+{
+    struct boot_rsp rsp;
+    int num_failed;
+    int num_ops;
+    int rc;
+
+    struct image_header hdr0 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 150 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 5, 21, 432 },
+    };
+
+    struct image_header hdr1 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 190 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 1, 2, 3, 432 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+    };
+
+    /* Interrupt the swap after each flash operation in turn; the next boot
+     * must always complete it.
+     */
+    for (num_ops = 0; ; num_ops++) {
+        boot_test_util_init_flash();
+        boot_test_util_write_image(&hdr0, 0);
+        boot_test_util_write_image(&hdr1, 1);
+
+        rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver,
+                                 sizeof hdr0.ih_ver);
+        TEST_ASSERT(rc == 0);
+
+        rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver,
+                                 sizeof hdr1.ih_ver);
+        TEST_ASSERT(rc == 0);
+
+        flash_native_fail_after(num_ops);
+        rc = boot_go(&req, &rsp);
+        num_failed = flash_native_fail_after(-1);
+
+        if (num_failed > 0) {
+            /* Simulated power failure; reboot. */
+            rc = boot_go(&req, &rsp);
+        }
+        TEST_ASSERT_FATAL(rc == 0);
+
+        TEST_ASSERT(memcmp(rsp.br_hdr, &hdr1, sizeof hdr1) == 0);
+        TEST_ASSERT(rsp.br_image_addr == boot_test_img_addrs[0]);
+
+        boot_test_util_verify_flash(&hdr1, 1, &hdr0, 0);
+        boot_test_util_verify_status_clear();
+
+        if (num_failed == 0) {
+            break;
+        }
+    }
+}
+
+TEST_CASE(boot_test_crc32)
+{
+    static const char data[] = "123456789";
+    uint32_t crc;
+    int i;
+
+    TEST_ASSERT(crc32(0, data, 9) == 0xcbf43926);
+
+    /* Calculating in pieces must yield the same result, regardless of
+     * alignment.
+     */
+    for (i = 0; i <= 9; i++) {
+        crc = crc32(0, data, i);
+        crc = crc32(crc, data + i, 9 - i);
+        TEST_ASSERT(crc == 0xcbf43926);
+    }
+}
+
+TEST_CASE(boot_test_nv_ns_10_corrupt)
+{
+    struct boot_rsp rsp;
+    int rc;
+
+    struct image_header hdr = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 12 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 2, 3, 4 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+    };
+
+    boot_test_util_init_flash();
+    boot_test_util_write_image(&hdr, 0);
+
+    rc = flash_native_memset(boot_test_img_addrs[0] + hdr.ih_hdr_size + 100,
+                             0x00, 1);
+    TEST_ASSERT(rc == 0);
+
+    /* The only image is corrupt; nothing can be booted. */
+    rc = boot_go(&req, &rsp);
+    TEST_ASSERT(rc != 0);
+
+    /* The corrupt image was not booted; without verification it is. */
+    req.br_skip_verify = 1;
+    rc = boot_go(&req, &rsp);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(memcmp(rsp.br_hdr, &hdr, sizeof hdr) == 0);
+}
+
+TEST_CASE(boot_test_nv_ns_10_repaired)
+{
+    struct boot_rsp rsp;
+    uint32_t addr;
+    uint8_t orig;
+    int rc;
+    int i;
+
+    struct image_header hdr = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 12 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 2, 3, 4 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+    };
+
+    boot_test_util_init_flash();
+    boot_test_util_write_image(&hdr, 0);
+
+    addr = boot_test_img_addrs[0] + hdr.ih_hdr_size + 100;
+    rc = flash_read(addr, &orig, 1);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = flash_native_memset(addr, orig ^ 0xff, 1);
+    TEST_ASSERT(rc == 0);
+
+    /* A failed check is not cached; every attempt recomputes the CRC. */
+    for (i = 0; i < 2; i++) {
+        rc = boot_go(&req, &rsp);
+        TEST_ASSERT(rc != 0);
+    }
+
+    /* Repair the body without touching the header; the image boots. */
+    rc = flash_native_overwrite(addr, &orig, 1);
+    TEST_ASSERT(rc == 0);
+
+    rc = boot_go(&req, &rsp);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(memcmp(rsp.br_hdr, &hdr, sizeof hdr) == 0);
+    TEST_ASSERT(rsp.br_image_addr == boot_test_img_addrs[0]);
+}
+
+TEST_CASE(boot_test_vb_ns_11_corrupt)
+{
+    struct boot_rsp rsp;
+    int rc;
+    int i;
+
+    struct image_header hdr0 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 5 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 5, 21, 432 },
+    };
+
+    struct image_header hdr1 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 32 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 1, 2, 3, 432 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+    };
+
+    boot_test_util_init_flash();
+    boot_test_util_write_image(&hdr0, 0);
+    boot_test_util_write_image(&hdr1, 1);
+
+    rc = flash_native_memset(boot_test_img_addrs[1] + hdr1.ih_hdr_size + 7,
+                             0x00, 1);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver, sizeof hdr0.ih_ver);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver, sizeof hdr1.ih_ver);
+    TEST_ASSERT(rc == 0);
+
+    /* The corrupt test image must not be swapped in. */
+    for (i = 0; i < 2; i++) {
+        rc = boot_go(&req, &rsp);
+        TEST_ASSERT(rc == 0);
+
+        TEST_ASSERT(memcmp(rsp.br_hdr, &hdr0, sizeof hdr0) == 0);
+        TEST_ASSERT(rsp.br_image_addr == boot_test_img_addrs[0]);
+
+        boot_test_util_verify_area(boot_test_area_descs + 5, &hdr0,
+                                   boot_test_img_addrs[0], 0);
+        boot_test_util_verify_status_clear();
+    }
+}
+
+TEST_CASE(boot_test_vb_ns_11_reupload)
+{
+    struct boot_verified verified[BOOT_NUM_SLOTS];
+    struct boot_rsp rsp;
+    uint32_t crc;
+    int num_failed;
+    int num_ops;
+    int rc;
+
+    struct image_header hdr0 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 5 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 5, 21, 432 },
+    };
+
+    struct image_header hdr1 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 32 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 1, 2, 3, 432 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+    };
+
+    boot_test_util_init_flash();
+    boot_test_util_write_image(&hdr0, 0);
+    boot_test_util_write_image(&hdr1, 1);
+
+    /* The image in the secondary slot was verified before, and is now
+     * uploaded again.  The second upload is torn, leaving the header intact.
+     */
+    memset(verified, 0xff, sizeof verified);
+    verified[1].bv_hdr = hdr1;
+    verified[1].bv_valid = 1;
+    rc = boot_write_verified(verified, BOOT_NUM_SLOTS);
+    TEST_ASSERT(rc == 0);
+
+    rc = flash_native_memset(boot_test_img_addrs[1] + hdr1.ih_hdr_size + 7,
+                             0x00, 1);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver, sizeof hdr0.ih_ver);
+    TEST_ASSERT(rc == 0);
+    rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver, sizeof hdr1.ih_ver);
+    TEST_ASSERT(rc == 0);
+
+    /* The cached result is not trusted; the torn image stays put. */
+    rc = boot_go(&req, &rsp);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(memcmp(rsp.br_hdr, &hdr0, sizeof hdr0) == 0);
+    boot_test_util_verify_area(boot_test_area_descs + 5, &hdr0,
+                               boot_test_img_addrs[0], 0);
+    boot_test_util_verify_status_clear();
+
+    /* The primary slot's image is now cached. */
+    rc = boot_read_verified(verified, BOOT_NUM_SLOTS);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT(verified[0].bv_valid == 1);
+    TEST_ASSERT(memcmp(&verified[0].bv_hdr, &hdr0, sizeof hdr0) == 0);
+
+    /* Complete the upload and interrupt the swap after each flash operation
+     * in turn.  Whenever the cache still vouches for the primary slot, the
+     * slot must be intact.
+     */
+    for (num_ops = 0; ; num_ops++) {
+        boot_test_util_init_flash();
+        boot_test_util_write_image(&hdr0, 0);
+        boot_test_util_write_image(&hdr1, 1);
+
+        memset(verified, 0xff, sizeof verified);
+        verified[0].bv_hdr = hdr0;
+        verified[0].bv_valid = 1;
+        rc = boot_write_verified(verified, BOOT_NUM_SLOTS);
+        TEST_ASSERT(rc == 0);
+
+        rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver,
+                                 sizeof hdr0.ih_ver);
+        TEST_ASSERT(rc == 0);
+        rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver,
+                                 sizeof hdr1.ih_ver);
+        TEST_ASSERT(rc == 0);
+
+        flash_native_fail_after(num_ops);
+        rc = boot_go(&req, &rsp);
+        num_failed = flash_native_fail_after(-1);
+
+        if (num_failed > 0) {
+            rc = boot_read_verified(verified, BOOT_NUM_SLOTS);
+            if (rc == 0 && verified[0].bv_valid == 1 &&
+                memcmp(&verified[0].bv_hdr, &hdr0, sizeof hdr0) == 0) {
+
+
+                rc = boot_image_crc(&hdr0, boot_test_img_addrs[0], &crc);
+                TEST_ASSERT(rc == 0);
+                TEST_ASSERT(crc == hdr0.ih_crc32);
+            }
+
+            /* Simulated power failure; reboot. */
+            rc = boot_go(&req, &rsp);
+        }
+        TEST_ASSERT_FATAL(rc == 0);
+
+        TEST_ASSERT(memcmp(rsp.br_hdr, &hdr1, sizeof hdr1) == 0);
+        TEST_ASSERT(rsp.br_image_addr == boot_test_img_addrs[0]);
+        boot_test_util_verify_flash(&hdr1, 1, &hdr0, 0);
+        boot_test_util_verify_status_clear();
+
+        if (num_failed == 0) {
+            break;
+        }
+    }
+}
+
+TEST_CASE(boot_test_delta)
+{
+    struct boot_rsp rsp;
+    int rc;
+
+    struct image_header hdr0 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 150 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 5, 21, 432 },
+    };
+
+    struct image_header hdr1 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 190 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 1, 2, 3, 432 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+    };
+
+    boot_test_util_delta_build(&hdr0, &hdr1);
+
+    boot_test_util_init_flash();
+    boot_test_util_delta_write(&hdr1);
+
+    rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver, sizeof hdr0.ih_ver);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver, sizeof hdr1.ih_ver);
+    TEST_ASSERT(rc == 0);
+
+    /* The target is reconstructed and swapped in; the base is kept in the
+     * second slot.
+     */
+    rc = boot_go(&req, &rsp);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    TEST_ASSERT(memcmp(rsp.br_hdr, &hdr1, sizeof hdr1) == 0);
+    TEST_ASSERT(rsp.br_image_addr == boot_test_img_addrs[0]);
+
+    boot_test_util_verify_buf(boot_test_img_addrs[0], boot_test_delta_tgt,
+                              BOOT_TEST_DELTA_TGT_SZ);
+    boot_test_util_verify_buf(boot_test_img_addrs[1], boot_test_delta_base,
+                              BOOT_TEST_DELTA_BASE_SZ);
+    boot_test_util_verify_status_clear();
+    boot_test_util_verify_rebuild_clear();
+
+    /* The target was not confirmed; the next boot reverts to the base. */
+    rc = boot_go(&req, &rsp);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    TEST_ASSERT(memcmp(rsp.br_hdr, &hdr0, sizeof hdr0) == 0);
+    boot_test_util_verify_buf(boot_test_img_addrs[0], boot_test_delta_base,
+                              BOOT_TEST_DELTA_BASE_SZ);
+}
+
+TEST_CASE(boot_test_delta_reset)
+{
+    struct boot_rsp rsp;
+    int num_failed;
+    int num_ops;
+    int rc;
+
+    struct image_header hdr0 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 150 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 5, 21, 432 },
+    };
+
+    struct image_header hdr1 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 190 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 1, 2, 3, 432 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+    };
+
+    boot_test_util_delta_build(&hdr0, &hdr1);
+
+    /* Interrupt the boot after each flash operation in turn; the next boot
+     * must always complete the update.
+     */
+    for (num_ops = 0; ; num_ops++) {
+        boot_test_util_init_flash();
+        boot_test_util_delta_write(&hdr1);
+
+        rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver,
+                                 sizeof hdr0.ih_ver);
+        TEST_ASSERT(rc == 0);
+
+        rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver,
+                                 sizeof hdr1.ih_ver);
+        TEST_ASSERT(rc == 0);
+
+        flash_native_fail_after(num_ops);
+        rc = boot_go(&req, &rsp);
+        num_failed = flash_native_fail_after(-1);
+
+        if (num_failed > 0) {
+            /* Simulated power failure; reboot. */
+            rc = boot_go(&req, &rsp);
+        }
+        TEST_ASSERT_FATAL(rc == 0);
+
+        TEST_ASSERT_FATAL(memcmp(rsp.br_hdr, &hdr1, sizeof hdr1) == 0);
+        boot_test_util_verify_buf(boot_test_img_addrs[0],
+                                  boot_test_delta_tgt,
+                                  BOOT_TEST_DELTA_TGT_SZ);
+        boot_test_util_verify_buf(boot_test_img_addrs[1],
+                                  boot_test_delta_base,
+                                  BOOT_TEST_DELTA_BASE_SZ);
+        boot_test_util_verify_status_clear();
+        boot_test_util_verify_rebuild_clear();
+
+        if (num_failed == 0) {
+            break;
+        }
+    }
+}
+
+TEST_CASE(boot_test_delta_wrong_base)
+{
+    struct boot_rsp rsp;
+    uint8_t byte;
+    int rc;
+
+    struct image_header hdr0 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 150 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 5, 21, 432 },
+    };
+
+    struct image_header hdr1 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 190 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 1, 2, 3, 432 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+    };
+
+    boot_test_util_delta_build(&hdr0, &hdr1);
+
+    boot_test_util_init_flash();
+    boot_test_util_delta_write(&hdr1);
+
+    /* Replace the base with a different image of the same size. */
+    byte = boot_test_delta_base[BOOT_TEST_HEADER_SIZE + 5] ^ 0xff;
+    boot_test_delta_base[BOOT_TEST_HEADER_SIZE + 5] = byte;
+    boot_test_util_finish_image(boot_test_delta_base, &hdr0);
+
+    rc = flash_erase(boot_test_img_addrs[0], 128 * 1024);
+    TEST_ASSERT(rc == 0);
+    rc = flash_erase(boot_test_img_addrs[0] + 128 * 1024, 128 * 1024);
+    TEST_ASSERT(rc == 0);
+    rc = flash_write(boot_test_img_addrs[0], boot_test_delta_base,
+                     BOOT_TEST_DELTA_BASE_SZ);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver, sizeof hdr0.ih_ver);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver, sizeof hdr1.ih_ver);
+    TEST_ASSERT(rc == 0);
+
+    /* The delta does not apply; the installed image keeps running. */
+    rc = boot_go(&req, &rsp);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    TEST_ASSERT(memcmp(rsp.br_hdr, &hdr0, sizeof hdr0) == 0);
+    boot_test_util_verify_buf(boot_test_img_addrs[0], boot_test_delta_base,
+                              BOOT_TEST_DELTA_BASE_SZ);
+    boot_test_util_verify_status_clear();
+    boot_test_util_verify_rebuild_clear();
+}
+
+TEST_CASE(boot_test_comp)
+{
+    struct boot_rsp rsp;
+    uint32_t body_len;
+    uint8_t *body;
+    int num_failed;
+    int num_ops;
+    int rc;
+
+    struct image_header hdr0 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 150 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 0, 5, 21, 432 },
+    };
+
+    struct image_header hdr1 = {
+        .ih_magic = IMAGE_MAGIC,
+        .ih_crc32 = 0,
+        .ih_hdr_size = BOOT_TEST_HEADER_SIZE,
+        .ih_img_size = 190 * 1024,
+        .ih_flags = 0,
+        .ih_ver = { 1, 2, 3, 432 },
+    };
+
+    struct boot_req req = {
+        .br_area_descs = boot_test_area_descs,
+        .br_image_areas = boot_test_img_areas,
+        .br_slot_areas = boot_test_slot_areas,
+        .br_scratch_area_idx = BOOT_TEST_AREA_IDX_SCRATCH,
+        .br_num_image_areas = BOOT_TEST_NUM_IMG_AREAS,
+    };
+
+    boot_test_util_comp_build(&hdr0, &hdr1);
+
+    rc = image_comp_create(boot_test_delta_tgt, BOOT_TEST_DELTA_TGT_SZ,
+                           &body, &body_len);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT_FATAL(body_len < 128 * 1024 - sizeof (struct image_header));
+
+    /* Interrupt the boot after each flash operation in turn; the next boot
+     * must always complete the update.
+     */
+    for (num_ops = 0; ; num_ops++) {
+        boot_test_util_init_flash();
+        boot_test_util_comp_write(&hdr1, body, body_len);
+
+        rc = nffsutil_write_file(BOOT_PATH_MAIN, &hdr0.ih_ver,
+                                 sizeof hdr0.ih_ver);
+        TEST_ASSERT(rc == 0);
+
+        rc = nffsutil_write_file(BOOT_PATH_TEST, &hdr1.ih_ver,
+                                 sizeof hdr1.ih_ver);
+        TEST_ASSERT(rc == 0);
+
+        flash_native_fail_after(num_ops);
+        rc = boot_go(&req, &rsp);
+        num_failed = flash_native_fail_after(-1);
+
+        if (num_failed > 0) {
+            /* Simulated power failure; reboot. */
+            rc = boot_go(&req, &rsp);
+        }
+        TEST_ASSERT_FATAL(rc == 0);
+
+        TEST_ASSERT_FATAL(memcmp(rsp.br_hdr, &hdr1, sizeof hdr1) == 0);
+        boot_test_util_verify_buf(boot_test_img_addrs[0],
+                                  boot_test_delta_tgt,
+                                  BOOT_TEST_DELTA_TGT_SZ);
+        boot_test_util_verify_buf(boot_test_img_addrs[1],
+                                  boot_test_delta_base,
+                                  BOOT_TEST_DELTA_BASE_SZ);
+        boot_test_util_verify_status_clear();
+        boot_test_util_verify_rebuild_clear();
+
+        if (num_failed == 0) {
+            break;
+        }
+    }
+
+    free(body);
+}
+
 TEST_SUITE(boot_test_main)
 {
     boot_test_nv_ns_10();
@@ -931,6 +1832,16 @@ TEST_SUITE(boot_test_main)
     boot_test_nv_bs_11();
     boot_test_nv_bs_11_2areas();
     boot_test_vb_ns_11();
+    boot_test_vb_ns_11_2areas_reset();
+    boot_test_crc32();
+    boot_test_nv_ns_10_corrupt();
+    boot_test_nv_ns_10_repaired();
+    boot_test_vb_ns_11_corrupt();
+    boot_test_vb_ns_11_reupload();
+    boot_test_delta();
+    boot_test_delta_reset();
+    boot_test_delta_wrong_base();
+    boot_test_comp();
 }
 
 int
@@ -90,6 +90,11 @@ console_write(char *str, int cnt)
 {
     int i;
 
+    /* Nothing to write to until console_init() (e.g. in unit tests) */
+    if (!console_tty.ct_tx.cr_buf) {
+        return;
+    }
+
     i = 0;
     for (i = 0; i < cnt; i++) {
         if (str[i] == '\n') {
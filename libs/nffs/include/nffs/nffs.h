@@ -43,6 +43,8 @@
 #define NFFS_EEXIST             11
 #define NFFS_EACCESS            12
 #define NFFS_EUNINIT            13
+#define NFFS_ENOTSUP            14
+#define NFFS_EBUSY              15
 
 struct nffs_config {
     /** Maximum number of inodes; default=1024. */
@@ -62,10 +64,23 @@ struct nffs_config {
 
     /** Data block cache size; default=64. */
     uint32_t nc_num_cache_blocks;
+
+    /** Maximum number of concurrent readers; default=4. */
+    uint32_t nc_num_readers;
+
+    /** Maximum size of the objects in one transaction, in bytes;
+     *  default=512. */
+    uint32_t nc_txn_buf_sz;
 };
 
 extern struct nffs_config nffs_config;
 
+struct nffs_mem_stats {
+    uint32_t nms_bytes_total;   /* Pool memory reserved by nffs_init(). */
+    uint32_t nms_bytes_in_use;  /* Pool memory currently allocated. */
+    uint32_t nms_bytes_hwm;     /* Peak pool memory allocated. */
+};
+
 struct nffs_area_desc {
     uint32_t nad_offset;    /* Flash offset of start of area. */
     uint32_t nad_length;    /* Size of area, in bytes. */
@@ -83,14 +98,25 @@ int nffs_detect(const struct nffs_area_desc *area_descs);
 int nffs_format(const struct nffs_area_desc *area_descs);
 int nffs_read(struct nffs_file *file, uint32_t len, void *out_data,
               uint32_t *out_len);
+int nffs_read_ptr(struct nffs_file *file, uint32_t len, const void **out_ptr,
+                  uint32_t *out_len);
+int nffs_read_ptr_release(const void *ptr);
 int nffs_write(struct nffs_file *file, const void *data, int len);
+int nffs_truncate(struct nffs_file *file, uint32_t len);
+int nffs_reserve(uint32_t len, uint32_t num_writes);
 int nffs_seek(struct nffs_file *file, uint32_t offset);
 uint32_t nffs_getpos(const struct nffs_file *file);
 int nffs_file_len(struct nffs_file *file, uint32_t *out_len);
 int nffs_rename(const char *from, const char *to);
 int nffs_unlink(const char *filename);
 int nffs_mkdir(const char *path);
+int nffs_mklog(const char *path, uint32_t capacity);
+int nffs_txn_begin(void);
+int nffs_txn_commit(void);
+int nffs_txn_abort(void);
 int nffs_ready(void);
+void nffs_mem_stats_get(struct nffs_mem_stats *out_stats);
+void nffs_mem_stats_clear(void);
 
 int nffs_opendir(const char *path, struct nffs_dir **out_dir);
 int nffs_readdir(struct nffs_dir *dir, struct nffs_dirent **out_dirent);
@@ -20,7 +20,6 @@
 #include <assert.h>
 #include "hal/hal_flash.h"
 #include "os/os_mempool.h"
-#include "os/os_mutex.h"
 #include "os/os_malloc.h"
 #include "nffs_priv.h"
 #include "nffs/nffs.h"
@@ -47,26 +46,6 @@ void *nffs_dir_mem;
 struct nffs_inode_entry *nffs_root_dir;
 struct nffs_inode_entry *nffs_lost_found_dir;
 
-static struct os_mutex nffs_mutex;
-
-static void
-nffs_lock(void)
-{
-    int rc;
-
-    rc = os_mutex_pend(&nffs_mutex, 0xffffffff);
-    assert(rc == 0 || rc == OS_NOT_STARTED);
-}
-
-static void
-nffs_unlock(void)
-{
-    int rc;
-
-    rc = os_mutex_release(&nffs_mutex);
-    assert(rc == 0 || rc == OS_NOT_STARTED);
-}
-
 /**
  * Opens a file at the specified path.  The result of opening a nonexistent
  * file depends on the access flags specified.  All intermediate directories
@@ -91,9 +70,16 @@ nffs_unlock(void)
 int
 nffs_open(const char *path, uint8_t access_flags, struct nffs_file **out_file)
 {
+    int read_only;
     int rc;
 
-    nffs_lock();
+    /* A read-only open does not modify the file system. */
+    read_only = !(access_flags & NFFS_ACCESS_WRITE);
+    if (read_only) {
+        nffs_lock_read();
+    } else {
+        nffs_lock_write();
+    }
 
     if (!nffs_ready()) {
         rc = NFFS_EUNINIT;
@@ -106,7 +92,11 @@ nffs_open(const char *path, uint8_t access_flags, struct nffs_file **out_file)
     }
 
 done:
-    nffs_unlock();
+    if (read_only) {
+        nffs_unlock_read();
+    } else {
+        nffs_unlock_write();
+    }
     if (rc != 0) {
         *out_file = NULL;
     }
@@ -131,9 +121,15 @@ nffs_close(struct nffs_file *file)
         return 0;
     }
 
-    nffs_lock();
+    nffs_lock_read();
     rc = nffs_file_close(file);
-    nffs_unlock();
+    nffs_unlock_read();
+
+    if (rc == NFFS_EEXCL) {
+        nffs_lock_write();
+        rc = nffs_file_close(file);
+        nffs_unlock_write();
+    }
 
     return rc;
 }
@@ -153,9 +149,9 @@ nffs_seek(struct nffs_file *file, uint32_t offset)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_read();
     rc = nffs_file_seek(file, offset);
-    nffs_unlock();
+    nffs_unlock_read();
 
     return rc;
 }
@@ -172,9 +168,9 @@ nffs_getpos(const struct nffs_file *file)
 {
     uint32_t offset;
 
-    nffs_lock();
+    nffs_lock_read();
     offset = file->nf_offset;
-    nffs_unlock();
+    nffs_unlock_read();
 
     return offset;
 }
@@ -193,9 +189,9 @@ nffs_file_len(struct nffs_file *file, uint32_t *out_len)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_read();
     rc = nffs_inode_data_len(file->nf_inode_entry, out_len);
-    nffs_unlock();
+    nffs_unlock_read();
 
     return rc;
 }
@@ -219,13 +215,76 @@ nffs_read(struct nffs_file *file, uint32_t len, void *out_data,
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_read();
     rc = nffs_file_read(file, len, out_data, out_len);
-    nffs_unlock();
+    nffs_unlock_read();
+
+    return rc;
+}
+
+/**
+ * Retrieves a pointer to data in the specified file, without copying it into a
+ * caller-supplied buffer.  This is only supported when the underlying flash is
+ * memory mapped (i.e., the HAL implements flash_map()).  The returned region
+ * lies within a single data block, so fewer bytes than requested may be
+ * returned even if more data remains in the file; call this function
+ * repeatedly to iterate through the file.  On success, the file's read
+ * position is advanced past the returned data.
+ *
+ * The returned pointer refers directly to flash, and the data it points to
+ * must not be written.  Each non-null pointer must be passed to
+ * nffs_read_ptr_release() once the caller is done with it.  Until then,
+ * garbage collection is refused (operations which need it fail with
+ * NFFS_EBUSY), so the mapped data stays in place even if the file is
+ * subsequently modified or unlinked; the pointer continues to show the data as
+ * it was when mapped.  Data written in an open transaction cannot be mapped.
+ *
+ * @param file              The file to read from.
+ * @param len               The maximum number of bytes to retrieve.
+ * @param out_ptr           On success, points to the file data.
+ * @param out_len           On success, the number of bytes available at
+ *                              out_ptr gets written here.  0 indicates end of
+ *                              file.
+ *
+ * @return                  0 on success;
+ *                          NFFS_ENOTSUP if the flash is not memory mapped,
+ *                              or if the data is staged in an open
+ *                              transaction; use nffs_read() instead;
+ *                          other nonzero on failure.
+ */
+int
+nffs_read_ptr(struct nffs_file *file, uint32_t len, const void **out_ptr,
+              uint32_t *out_len)
+{
+    int rc;
+
+    nffs_lock_read();
+    rc = nffs_file_read_ptr(file, len, out_ptr, out_len);
+    nffs_unlock_read();
 
     return rc;
 }
 
+/**
+ * Releases a pointer returned by nffs_read_ptr().  The pointer must not be
+ * dereferenced afterwards.
+ *
+ * @param ptr               The pointer to release.  Null pointers (returned
+ *                              at end of file) are ignored.
+ *
+ * @return                  0 on success;
+ *                          NFFS_EINVAL if no pointer is outstanding.
+ */
+int
+nffs_read_ptr_release(const void *ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    return nffs_gc_unpin();
+}
+
 /**
  * Writes the supplied data to the current offset of the specified file handle.
  *
@@ -240,7 +299,7 @@ nffs_write(struct nffs_file *file, const void *data, int len)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_write();
 
     if (!nffs_ready()) {
         rc = NFFS_EUNINIT;
@@ -255,7 +314,95 @@ nffs_write(struct nffs_file *file, const void *data, int len)
     rc = 0;
 
 done:
-    nffs_unlock();
+    nffs_unlock_write();
+    return rc;
+}
+
+/**
+ * Truncates the specified file to the given length.  Only the end of the
+ * file's block chain is rewritten; at most one new data block is written to
+ * flash.  File handles positioned beyond the new end of the file read nothing,
+ * and write at the new end.
+ *
+ * @param file              The file to truncate.  It must be open for
+ *                              writing.
+ * @param len               The new length of the file, in bytes.  This must
+ *                              not exceed the current length.
+ *
+ * @return                  0 on success;
+ *                          NFFS_ERANGE if len exceeds the file length;
+ *                          nonzero on other failure.
+ */
+int
+nffs_truncate(struct nffs_file *file, uint32_t len)
+{
+    int rc;
+
+    nffs_lock_write();
+
+    if (!nffs_ready()) {
+        rc = NFFS_EUNINIT;
+        goto done;
+    }
+
+    rc = nffs_write_truncate(file, len);
+    if (rc != 0) {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    nffs_unlock_write();
+    return rc;
+}
+
+/**
+ * Performs garbage collection ahead of time, if necessary, so that a
+ * subsequent burst of appends does not have to.  After this call succeeds, up
+ * to 'num_writes' calls to nffs_write() appending a total of 'len' bytes will
+ * not trigger garbage collection, provided nothing else is written in the
+ * meantime.  Overwrites replace whole data blocks, and may require more space
+ * than the data they write.
+ *
+ * @param len               The total number of bytes to be appended.
+ * @param num_writes        The number of nffs_write() calls that will append
+ *                              them.
+ *
+ * @return                  0 on success;
+ *                          NFFS_EFULL if the space cannot be made
+ *                              available;
+ *                          nonzero on other failure.
+ */
+int
+nffs_reserve(uint32_t len, uint32_t num_writes)
+{
+    uint32_t num_blocks;
+    uint32_t space;
+    int rc;
+
+    nffs_lock_write();
+
+    if (!nffs_ready()) {
+        rc = NFFS_EUNINIT;
+        goto done;
+    }
+
+    /* Each write produces one block per started nffs_block_max_data_sz bytes
+     * of data.
+     */
+    num_blocks = num_writes + len / nffs_block_max_data_sz;
+    space = len + num_blocks * sizeof (struct nffs_disk_block);
+
+    rc = nffs_misc_ensure_space(space);
+    if (rc != 0) {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    nffs_unlock_write();
     return rc;
 }
 
@@ -274,7 +421,7 @@ nffs_unlink(const char *path)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_write();
 
     if (!nffs_ready()) {
         rc = NFFS_EUNINIT;
@@ -289,7 +436,7 @@ nffs_unlink(const char *path)
     rc = 0;
 
 done:
-    nffs_unlock();
+    nffs_unlock_write();
     return rc;
 }
 
@@ -314,7 +461,7 @@ nffs_rename(const char *from, const char *to)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_write();
 
     if (!nffs_ready()) {
         rc = NFFS_EUNINIT;
@@ -329,7 +476,7 @@ nffs_rename(const char *from, const char *to)
     rc = 0;
 
 done:
-    nffs_unlock();
+    nffs_unlock_write();
     return rc;
 }
 
@@ -348,7 +495,7 @@ nffs_mkdir(const char *path)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_write();
 
     if (!nffs_ready()) {
         rc = NFFS_EUNINIT;
@@ -361,7 +508,168 @@ nffs_mkdir(const char *path)
     }
 
 done:
-    nffs_unlock();
+    nffs_unlock_write();
+    return rc;
+}
+
+/**
+ * Creates an empty circular log at the specified path.  A log is a file with a
+ * fixed capacity; once appends fill it, the oldest data is discarded to make
+ * room for new data.  Data expires a whole block at a time, so the log
+ * normally holds somewhat less than its capacity.  If each record is appended
+ * with a single nffs_write() of no more than one block's worth of data, the
+ * start of the log is always the start of a record.
+ *
+ * Offset 0 is always the oldest data still in the log.  When data expires,
+ * each open handle to the log is moved back accordingly, so that it keeps
+ * pointing at the same data; a handle positioned in expired data moves to the
+ * start of the log.
+ *
+ * Expiry does not write to flash, and garbage collection discards expired
+ * data rather than copying it.  The log is opened with nffs_open() like any
+ * other file.  It can be emptied with nffs_truncate(), but not shortened to
+ * any other length.
+ *
+ * @param path                  The log to create.
+ * @param capacity              The log's capacity, in bytes.  This must be a
+ *                                  power of two no less than 256.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EINVAL if the capacity is invalid;
+ *                              NFFS_EEXIST if the path already exists;
+ *                              nonzero on other failure.
+ */
+int
+nffs_mklog(const char *path, uint32_t capacity)
+{
+    uint8_t order;
+    int rc;
+
+    nffs_lock_write();
+
+    if (!nffs_ready()) {
+        rc = NFFS_EUNINIT;
+        goto done;
+    }
+
+    for (order = NFFS_LOG_ORDER_MIN; order <= NFFS_LOG_ORDER_MAX; order++) {
+        if (capacity == (uint32_t)1 << order) {
+            break;
+        }
+    }
+    if (order > NFFS_LOG_ORDER_MAX) {
+        rc = NFFS_EINVAL;
+        goto done;
+    }
+
+    rc = nffs_path_new_log(path, order);
+    if (rc != 0) {
+        goto done;
+    }
+
+done:
+    nffs_unlock_write();
+    return rc;
+}
+
+/**
+ * Opens a transaction.  Until the transaction is committed, every change to
+ * the file system is buffered in RAM rather than written to flash; this
+ * applies to changes made by any task, not just the caller.  The changes are
+ * visible to readers immediately.  nffs_txn_commit() then writes all of them
+ * in a single flash write.  If the system resets before the commit completes,
+ * none of the changes survive.
+ *
+ * A transaction can hold at most nffs_config.nc_txn_buf_sz bytes of inodes
+ * and data blocks.  Once it is full, further changes fail with NFFS_EFULL.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EINVAL if a transaction is already open;
+ *                              nonzero on other failure.
+ */
+int
+nffs_txn_begin(void)
+{
+    int rc;
+
+    nffs_lock_write();
+
+    if (!nffs_ready()) {
+        rc = NFFS_EUNINIT;
+        goto done;
+    }
+
+    rc = nffs_txn_open();
+    if (rc != 0) {
+        goto done;
+    }
+
+done:
+    nffs_unlock_write();
+    return rc;
+}
+
+/**
+ * Writes the changes made in the open transaction to flash, atomically.  If
+ * the write fails, the changes are discarded as with nffs_txn_abort().  If a
+ * file or directory is open at the time, the changes cannot be discarded in
+ * place: the file system becomes uninitialized (other calls fail with
+ * NFFS_EUNINIT) until every handle is closed and nffs_detect() is called.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EINVAL if no transaction is open;
+ *                              nonzero on other failure.
+ */
+int
+nffs_txn_commit(void)
+{
+    int rc;
+
+    nffs_lock_write();
+
+    if (!nffs_ready()) {
+        rc = NFFS_EUNINIT;
+        goto done;
+    }
+
+    rc = nffs_txn_flush();
+    if (rc != 0) {
+        goto done;
+    }
+
+done:
+    nffs_unlock_write();
+    return rc;
+}
+
+/**
+ * Discards the changes made in the open transaction.  The file system state is
+ * reloaded from flash, so all files and directories must be closed first.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EINVAL if no transaction is open, or if
+ *                                  any file or directory is open;
+ *                              nonzero on other failure.
+ */
+int
+nffs_txn_abort(void)
+{
+    int rc;
+
+    nffs_lock_write();
+
+    if (!nffs_ready()) {
+        rc = NFFS_EUNINIT;
+        goto done;
+    }
+
+    rc = nffs_txn_discard();
+    if (rc != 0) {
+        goto done;
+    }
+
+done:
+    nffs_unlock_write();
     return rc;
 }
 
@@ -386,7 +694,7 @@ nffs_opendir(const char *path, struct nffs_dir **out_dir)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_read();
 
     if (!nffs_ready()) {
         rc = NFFS_EUNINIT;
@@ -396,7 +704,7 @@ nffs_opendir(const char *path, struct nffs_dir **out_dir)
     rc = nffs_dir_open(path, out_dir);
 
 done:
-    nffs_unlock();
+    nffs_unlock_read();
     return rc;
 }
 
@@ -417,9 +725,19 @@ nffs_readdir(struct nffs_dir *dir, struct nffs_dirent **out_dirent)
 {
     int rc;
 
-    nffs_lock();
+    /* Directory walks only need the shared lock.  Stepping past an entry
+     * which was unlinked while the directory was open drops the entry's last
+     * reference; that case is retried exclusively.
+     */
+    nffs_lock_read();
     rc = nffs_dir_read(dir, out_dirent);
-    nffs_unlock();
+    nffs_unlock_read();
+
+    if (rc == NFFS_EEXCL) {
+        nffs_lock_write();
+        rc = nffs_dir_read(dir, out_dirent);
+        nffs_unlock_write();
+    }
 
     return rc;
 }
@@ -436,9 +754,15 @@ nffs_closedir(struct nffs_dir *dir)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_read();
     rc = nffs_dir_close(dir);
-    nffs_unlock();
+    nffs_unlock_read();
+
+    if (rc == NFFS_EEXCL) {
+        nffs_lock_write();
+        rc = nffs_dir_close(dir);
+        nffs_unlock_write();
+    }
 
     return rc;
 }
@@ -465,13 +789,13 @@ nffs_dirent_name(struct nffs_dirent *dirent, size_t max_len,
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_read();
 
     assert(dirent != NULL && dirent->nde_inode_entry != NULL);
     rc = nffs_inode_read_filename(dirent->nde_inode_entry, max_len, out_name,
                                   out_name_len);
 
-    nffs_unlock();
+    nffs_unlock_read();
 
     return rc;
 }
@@ -490,12 +814,12 @@ nffs_dirent_is_dir(const struct nffs_dirent *dirent)
 {
     uint32_t id;
 
-    nffs_lock();
+    nffs_lock_read();
 
     assert(dirent != NULL && dirent->nde_inode_entry != NULL);
     id = dirent->nde_inode_entry->nie_hash_entry.nhe_id;
 
-    nffs_unlock();
+    nffs_unlock_read();
 
     return nffs_hash_id_is_dir(id);
 }
@@ -507,16 +831,22 @@ nffs_dirent_is_dir(const struct nffs_dirent *dirent)
  * @param area_descs        The set of areas to format.
  *
  * @return                  0 on success;
- *                          nonzero on failure.
+ *                          NFFS_EBUSY if a pointer returned by
+ *                              nffs_read_ptr() has not been released;
+ *                          other nonzero on failure.
  */
 int
 nffs_format(const struct nffs_area_desc *area_descs)
 {
     int rc;
 
-    nffs_lock();
-    rc = nffs_format_full(area_descs);
-    nffs_unlock();
+    nffs_lock_write();
+    if (nffs_gc_pinned()) {
+        rc = NFFS_EBUSY;
+    } else {
+        rc = nffs_format_full(area_descs);
+    }
+    nffs_unlock_write();
 
     return rc;
 }
@@ -539,9 +869,9 @@ nffs_detect(const struct nffs_area_desc *area_descs)
 {
     int rc;
 
-    nffs_lock();
+    nffs_lock_write();
     rc = nffs_restore_full(area_descs);
-    nffs_unlock();
+    nffs_unlock_write();
 
     return rc;
 }
@@ -558,6 +888,59 @@ nffs_ready(void)
     return nffs_root_dir != NULL;
 }
 
+static struct os_mempool *const nffs_pools[] = {
+    &nffs_file_pool,
+    &nffs_dir_pool,
+    &nffs_inode_entry_pool,
+    &nffs_block_entry_pool,
+    &nffs_cache_inode_pool,
+    &nffs_cache_block_pool,
+};
+
+#define NFFS_NUM_POOLS  (sizeof nffs_pools / sizeof nffs_pools[0])
+
+/**
+ * Reports how much of nffs's pool memory is in use.  The high-water mark is
+ * the sum of each pool's individual peak since the last call to
+ * nffs_mem_stats_clear() (or since the pools were last reset by a format or
+ * detect), so it is an upper bound on the true combined peak.
+ *
+ * @param out_stats         On success, the memory statistics get written
+ *                              here.
+ */
+void
+nffs_mem_stats_get(struct nffs_mem_stats *out_stats)
+{
+    const struct os_mempool *pool;
+    int i;
+
+    memset(out_stats, 0, sizeof *out_stats);
+
+    for (i = 0; i < NFFS_NUM_POOLS; i++) {
+        pool = nffs_pools[i];
+        out_stats->nms_bytes_total += pool->mp_num_blocks * pool->mp_block_size;
+        out_stats->nms_bytes_in_use +=
+            (pool->mp_num_blocks - pool->mp_num_free) * pool->mp_block_size;
+        out_stats->nms_bytes_hwm +=
+            (pool->mp_num_blocks - pool->mp_min_free) * pool->mp_block_size;
+    }
+}
+
+/**
+ * Resets the pool memory high-water mark to the current usage.
+ */
+void
+nffs_mem_stats_clear(void)
+{
+    struct os_mempool *pool;
+    int i;
+
+    for (i = 0; i < NFFS_NUM_POOLS; i++) {
+        pool = nffs_pools[i];
+        pool->mp_min_free = pool->mp_num_free;
+    }
+}
+
 /**
  * Initializes the nffs memory and data structures.  This must be called before
  * any nffs operations are attempted.
@@ -573,9 +956,9 @@ nffs_init(void)
 
     nffs_cache_clear();
 
-    rc = os_mutex_init(&nffs_mutex);
+    rc = nffs_lock_init();
     if (rc != 0) {
-        return NFFS_EOS;
+        return rc;
     }
 
     free(nffs_file_mem);
@@ -625,6 +1008,14 @@ nffs_init(void)
         return NFFS_ENOMEM;
     }
 
+    free(nffs_txn_mem);
+    nffs_txn_mem = malloc(sizeof (struct nffs_disk_txn) +
+                          nffs_config.nc_txn_buf_sz +
+                          sizeof (struct nffs_disk_commit));
+    if (nffs_txn_mem == NULL) {
+        return NFFS_ENOMEM;
+    }
+
     rc = nffs_misc_reset();
     if (rc != 0) {
         return rc;
@@ -143,7 +143,13 @@ nffs_block_from_disk(struct nffs_block *out_block,
 
     if (disk_block->ndb_prev_id != NFFS_ID_NONE) {
         out_block->nb_prev = nffs_hash_find_block(disk_block->ndb_prev_id);
-        if (out_block->nb_prev == NULL) {
+
+        /* The oldest block of a circular log refers to a block which has
+         * expired.  For any other file, a missing block is corruption.
+         */
+        if (out_block->nb_prev == NULL &&
+            out_block->nb_inode_entry->nie_log_order == 0) {
+
             return NFFS_ECORRUPT;
         }
     }
@@ -186,17 +192,32 @@ nffs_block_to_disk(const struct nffs_block *block,
 int
 nffs_block_delete_from_ram(struct nffs_hash_entry *block_entry)
 {
-    struct nffs_block block;
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_disk_block disk_block;
+    uint32_t area_offset;
+    uint8_t area_idx;
     int rc;
 
-    rc = nffs_block_from_hash_entry(&block, block_entry);
+    nffs_flash_loc_expand(block_entry->nhe_flash_loc, &area_idx, &area_offset);
+    rc = nffs_block_read_disk(area_idx, area_offset, &disk_block);
     if (rc != 0) {
         return rc;
     }
 
-    assert(block.nb_inode_entry != NULL);
-    if (block.nb_inode_entry->nie_last_block_entry == block_entry) {
-        block.nb_inode_entry->nie_last_block_entry = block.nb_prev;
+    /* The previous block is not required to exist.  A deleted inode's chain
+     * has gaps wherever garbage collection has already discarded its blocks;
+     * in that case the chain just ends here.
+     */
+    inode_entry = nffs_hash_find_inode(disk_block.ndb_inode_id);
+    if (inode_entry != NULL &&
+        inode_entry->nie_last_block_entry == block_entry) {
+
+        if (disk_block.ndb_prev_id == NFFS_ID_NONE) {
+            inode_entry->nie_last_block_entry = NULL;
+        } else {
+            inode_entry->nie_last_block_entry =
+                nffs_hash_find_block(disk_block.ndb_prev_id);
+        }
     }
 
     nffs_hash_remove(block_entry);
@@ -296,3 +317,34 @@ nffs_block_read_data(const struct nffs_block *block, uint16_t offset,
 
     return 0;
 }
+
+/**
+ * Retrieves a pointer to the data contents of the specified block.  This is
+ * the zero-copy counterpart to nffs_block_read_data(); it only succeeds if the
+ * underlying flash is memory mapped.
+ */
+int
+nffs_block_map_data(const struct nffs_block *block, uint16_t offset,
+                    uint16_t length, const void **out_ptr)
+{
+    uint32_t area_offset;
+    uint8_t area_idx;
+    int rc;
+
+    nffs_flash_loc_expand(block->nb_hash_entry->nhe_flash_loc,
+                         &area_idx, &area_offset);
+    area_offset += sizeof (struct nffs_disk_block);
+    area_offset += offset;
+
+    /* The staging buffer is reused once the transaction ends. */
+    if (nffs_txn_find(area_idx, area_offset, length) != NULL) {
+        return NFFS_ENOTSUP;
+    }
+
+    rc = nffs_flash_map(area_idx, area_offset, length, out_ptr);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return 0;
+}
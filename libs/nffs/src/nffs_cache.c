@@ -23,6 +23,13 @@ TAILQ_HEAD(nffs_cache_inode_list, nffs_cache_inode);
 static struct nffs_cache_inode_list nffs_cache_inode_list =
     TAILQ_HEAD_INITIALIZER(nffs_cache_inode_list);
 
+/**
+ * Incremented whenever a cached inode or block is freed.  A reader which
+ * releases the cache mutex can compare this value before and after to
+ * determine whether its cache pointers are still valid.
+ */
+uint32_t nffs_cache_gen;
+
 static void nffs_cache_collect_blocks(void);
 
 static struct nffs_cache_block *
@@ -43,6 +50,7 @@ nffs_cache_block_free(struct nffs_cache_block *entry)
 {
     if (entry != NULL) {
         os_memblock_put(&nffs_cache_block_pool, entry);
+        nffs_cache_gen++;
     }
 }
 
@@ -112,6 +120,7 @@ nffs_cache_inode_free(struct nffs_cache_inode *entry)
     if (entry != NULL) {
         nffs_cache_inode_free_blocks(entry);
         os_memblock_put(&nffs_cache_inode_pool, entry);
+        nffs_cache_gen++;
     }
 }
 
@@ -242,6 +251,56 @@ nffs_cache_inode_delete(const struct nffs_inode_entry *inode_entry)
     nffs_cache_inode_free(entry);
 }
 
+/**
+ * Discards the cached blocks of the specified inode, keeping the cached inode
+ * itself.  This is necessary when the inode's block chain gets restructured,
+ * e.g., when garbage collection collates several blocks into one.
+ */
+void
+nffs_cache_inode_delete_blocks(const struct nffs_inode_entry *inode_entry)
+{
+    struct nffs_cache_inode *entry;
+
+    entry = nffs_cache_inode_find(inode_entry);
+    if (entry != NULL) {
+        nffs_cache_inode_free_blocks(entry);
+    }
+}
+
+/**
+ * Updates a cached inode when a block expires from the start of a circular
+ * log.  The block is removed from the cache if it is cached.  The offsets of
+ * the remaining cached blocks, and the file size, shrink by its length.
+ *
+ * @param cache_inode           The cached log.
+ * @param block_entry           The expiring block; the first in the log.
+ * @param len                   The length of the expiring block.
+ */
+void
+nffs_cache_inode_expire(struct nffs_cache_inode *cache_inode,
+                        const struct nffs_hash_entry *block_entry,
+                        uint16_t len)
+{
+    struct nffs_cache_block *cache_block;
+
+    cache_block = TAILQ_FIRST(&cache_inode->nci_block_list);
+    if (cache_block != NULL &&
+        cache_block->ncb_block.nb_hash_entry == block_entry) {
+
+        assert(cache_block->ncb_file_offset == 0);
+        TAILQ_REMOVE(&cache_inode->nci_block_list, cache_block, ncb_link);
+        nffs_cache_block_free(cache_block);
+    }
+
+    TAILQ_FOREACH(cache_block, &cache_inode->nci_block_list, ncb_link) {
+        if (cache_block->ncb_block.nb_prev == block_entry) {
+            cache_block->ncb_block.nb_prev = NULL;
+        }
+        cache_block->ncb_file_offset -= len;
+    }
+    cache_inode->nci_file_size -= len;
+}
+
 int
 nffs_cache_inode_ensure(struct nffs_cache_inode **out_cache_inode,
                         struct nffs_inode_entry *inode_entry)
@@ -25,6 +25,8 @@ const struct nffs_config nffs_config_dflt = {
     .nc_num_cache_inodes = 4,
     .nc_num_cache_blocks = 64,
     .nc_num_dirs = 4,
+    .nc_num_readers = 4,
+    .nc_txn_buf_sz = 512,
 };
 
 void
@@ -48,4 +50,10 @@ nffs_config_init(void)
     if (nffs_config.nc_num_dirs == 0) {
         nffs_config.nc_num_dirs = nffs_config_dflt.nc_num_dirs;
     }
+    if (nffs_config.nc_num_readers == 0) {
+        nffs_config.nc_num_readers = nffs_config_dflt.nc_num_readers;
+    }
+    if (nffs_config.nc_txn_buf_sz == 0) {
+        nffs_config.nc_txn_buf_sz = nffs_config_dflt.nc_txn_buf_sz;
+    }
 }
@@ -23,24 +23,26 @@ nffs_crc_flash(uint16_t initial_crc, uint8_t area_idx, uint32_t area_offset,
 {
     uint32_t chunk_len;
     uint16_t crc;
+    uint8_t *buf;
     int rc;
 
     crc = initial_crc;
+    buf = nffs_scratch_buf();
 
-    /* Copy data in chunks small enough to fit in the flash buffer. */
+    /* Copy data in chunks small enough to fit in the scratch buffer. */
     while (len > 0) {
-        if (len > sizeof nffs_flash_buf) {
-            chunk_len = sizeof nffs_flash_buf;
+        if (len > NFFS_SCRATCH_BUF_SZ) {
+            chunk_len = NFFS_SCRATCH_BUF_SZ;
         } else {
             chunk_len = len;
         }
 
-        rc = nffs_flash_read(area_idx, area_offset, nffs_flash_buf, chunk_len);
+        rc = nffs_flash_read(area_idx, area_offset, buf, chunk_len);
         if (rc != 0) {
             return rc;
         }
 
-        crc = crc16_ccitt(crc, nffs_flash_buf, chunk_len);
+        crc = crc16_ccitt(crc, buf, chunk_len);
 
         area_offset += chunk_len;
         len -= chunk_len;
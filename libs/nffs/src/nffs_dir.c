@@ -47,6 +47,39 @@ nffs_dir_free(struct nffs_dir *dir)
     return 0;
 }
 
+/**
+ * Drops a directory handle's reference to an inode.  A reader may only
+ * decrement a reference count which stays above zero; releasing the last
+ * reference deletes the inode from RAM, which requires the exclusive lock.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EEXCL if the caller holds the lock in
+ *                                  shared mode and this is the last
+ *                                  reference; the count is left unchanged;
+ *                              other nonzero on error.
+ */
+static int
+nffs_dir_put_inode(struct nffs_inode_entry *inode_entry)
+{
+    int done;
+
+    nffs_lock_cache();
+    done = inode_entry->nie_refcnt > 1;
+    if (done) {
+        inode_entry->nie_refcnt--;
+    }
+    nffs_unlock_cache();
+
+    if (done) {
+        return 0;
+    }
+    if (!nffs_lock_held_exclusive()) {
+        return NFFS_EEXCL;
+    }
+
+    return nffs_inode_dec_refcnt(inode_entry);
+}
+
 int
 nffs_dir_open(const char *path, struct nffs_dir **out_dir)
 {
@@ -60,10 +93,13 @@ nffs_dir_open(const char *path, struct nffs_dir **out_dir)
 
     rc = nffs_path_find_inode_entry(path, &dir->nd_parent_inode_entry);
     if (rc != 0) {
+        nffs_dir_free(dir);
         return rc;
     }
 
+    nffs_lock_cache();
     dir->nd_parent_inode_entry->nie_refcnt++;
+    nffs_unlock_cache();
     memset(&dir->nd_dirent, 0, sizeof dir->nd_dirent);
 
     *out_dir = dir;
@@ -81,7 +117,7 @@ nffs_dir_read(struct nffs_dir *dir, struct nffs_dirent **out_dirent)
         child = SLIST_FIRST(&dir->nd_parent_inode_entry->nie_child_list);
     } else {
         child = SLIST_NEXT(dir->nd_dirent.nde_inode_entry, nie_sibling_next);
-        rc = nffs_inode_dec_refcnt(dir->nd_dirent.nde_inode_entry);
+        rc = nffs_dir_put_inode(dir->nd_dirent.nde_inode_entry);
         if (rc != 0) {
             /* XXX: Need to clean up anything? */
             return rc;
@@ -94,7 +130,9 @@ nffs_dir_read(struct nffs_dir *dir, struct nffs_dirent **out_dirent)
         return NFFS_ENOENT;
     }
 
+    nffs_lock_cache();
     child->nie_refcnt++;
+    nffs_unlock_cache();
     *out_dirent = &dir->nd_dirent;
 
     return 0;
@@ -109,14 +147,18 @@ nffs_dir_close(struct nffs_dir *dir)
         return 0;
     }
 
+    /* Clear each reference as it is dropped; a reader which gets
+     * NFFS_EEXCL retries the close under the exclusive lock.
+     */
     if (dir->nd_dirent.nde_inode_entry != NULL) {
-        rc = nffs_inode_dec_refcnt(dir->nd_dirent.nde_inode_entry);
+        rc = nffs_dir_put_inode(dir->nd_dirent.nde_inode_entry);
         if (rc != 0) {
             return rc;
         }
+        dir->nd_dirent.nde_inode_entry = NULL;
     }
 
-    rc = nffs_inode_dec_refcnt(dir->nd_parent_inode_entry);
+    rc = nffs_dir_put_inode(dir->nd_parent_inode_entry);
     if (rc != 0) {
         return rc;
     }
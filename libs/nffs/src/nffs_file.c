@@ -19,6 +19,8 @@
 #include "nffs_priv.h"
 #include "nffs/nffs.h"
 
+struct nffs_file_list nffs_file_list = SLIST_HEAD_INITIALIZER(nffs_file_list);
+
 static struct nffs_file *
 nffs_file_alloc(void)
 {
@@ -56,6 +58,8 @@ nffs_file_free(struct nffs_file *file)
  * @param filename_len          The length of the filename, in characters.
  * @param is_dir                1 if this is a directory; 0 if it is a normal
  *                                  file.
+ * @param log_order             log2 of the capacity if the new file is a
+ *                                  circular log; 0 otherwise.
  * @param out_inode_entry       On success, this points to the inode
  *                                  corresponding to the new file.
  *
@@ -63,7 +67,7 @@ nffs_file_free(struct nffs_file *file)
  */
 int
 nffs_file_new(struct nffs_inode_entry *parent, const char *filename,
-              uint8_t filename_len, int is_dir,
+              uint8_t filename_len, int is_dir, uint8_t log_order,
               struct nffs_inode_entry **out_inode_entry)
 {
     struct nffs_disk_inode disk_inode;
@@ -85,7 +89,6 @@ nffs_file_new(struct nffs_inode_entry *parent, const char *filename,
     }
 
     memset(&disk_inode, 0xff, sizeof disk_inode);
-    disk_inode.ndi_magic = NFFS_INODE_MAGIC;
     if (is_dir) {
         disk_inode.ndi_id = nffs_hash_next_dir_id++;
     } else {
@@ -97,6 +100,13 @@ nffs_file_new(struct nffs_inode_entry *parent, const char *filename,
     } else {
         disk_inode.ndi_parent_id = parent->nie_hash_entry.nhe_id;
     }
+    if (log_order == 0) {
+        disk_inode.ndi_magic = NFFS_INODE_MAGIC;
+        disk_inode.ndi_log_order = NFFS_LOG_ORDER_NONE;
+    } else {
+        disk_inode.ndi_magic = NFFS_INODE_LOG_MAGIC;
+        disk_inode.ndi_log_order = log_order;
+    }
     disk_inode.ndi_filename_len = filename_len;
     nffs_crc_disk_inode_fill(&disk_inode, filename);
 
@@ -109,6 +119,7 @@ nffs_file_new(struct nffs_inode_entry *parent, const char *filename,
     inode_entry->nie_hash_entry.nhe_flash_loc =
         nffs_flash_loc(area_idx, offset);
     inode_entry->nie_refcnt = 1;
+    inode_entry->nie_log_order = log_order;
 
     if (parent != NULL) {
         rc = nffs_inode_add_child(parent, inode_entry);
@@ -148,6 +159,7 @@ nffs_file_open(struct nffs_file **out_file, const char *path,
     struct nffs_inode_entry *parent;
     struct nffs_inode_entry *inode;
     struct nffs_file *file;
+    uint8_t log_order;
     int rc;
 
     file = NULL;
@@ -191,7 +203,7 @@ nffs_file_open(struct nffs_file **out_file, const char *path,
 
         /* Create a new file at the specified path. */
         rc = nffs_file_new(parent, parser.npp_token, parser.npp_token_len, 0,
-                          &file->nf_inode_entry);
+                          0, &file->nf_inode_entry);
         if (rc != 0) {
             goto err;
         }
@@ -206,11 +218,15 @@ nffs_file_open(struct nffs_file **out_file, const char *path,
 
         if (access_flags & NFFS_ACCESS_TRUNCATE) {
             /* The user is truncating the file.  Unlink the old file and create
-             * a new one in its place.
+             * a new one in its place.  A circular log stays a log.
              */
-            nffs_path_unlink(path);
+            log_order = inode->nie_log_order;
+            rc = nffs_path_unlink(path);
+            if (rc != 0) {
+                goto err;
+            }
             rc = nffs_file_new(parent, parser.npp_token, parser.npp_token_len,
-                              0, &file->nf_inode_entry);
+                              0, log_order, &file->nf_inode_entry);
             if (rc != 0) {
                 goto err;
             }
@@ -230,7 +246,10 @@ nffs_file_open(struct nffs_file **out_file, const char *path,
     } else {
         file->nf_offset = 0;
     }
+    nffs_lock_cache();
     file->nf_inode_entry->nie_refcnt++;
+    SLIST_INSERT_HEAD(&nffs_file_list, file, nf_next);
+    nffs_unlock_cache();
     file->nf_access_flags = access_flags;
 
     *out_file = file;
@@ -271,6 +290,31 @@ nffs_file_seek(struct nffs_file *file, uint32_t offset)
     return 0;
 }
 
+/**
+ * Moves back the read and write position of each handle open to the specified
+ * file.  This is done when data expires from the start of a circular log, so
+ * that each handle keeps pointing at the same data.  A handle positioned in
+ * the expired data moves to the start of the file.
+ *
+ * @param inode_entry       The file whose start was removed.
+ * @param len               The number of bytes removed.
+ */
+void
+nffs_file_shift(const struct nffs_inode_entry *inode_entry, uint32_t len)
+{
+    struct nffs_file *file;
+
+    SLIST_FOREACH(file, &nffs_file_list, nf_next) {
+        if (file->nf_inode_entry == inode_entry) {
+            if (file->nf_offset > len) {
+                file->nf_offset -= len;
+            } else {
+                file->nf_offset = 0;
+            }
+        }
+    }
+}
+
 /**
  * Reads data from the specified file.  If more data is requested than remains
  * in the file, all available data is retrieved.  Note: this type of short read
@@ -313,6 +357,52 @@ nffs_file_read(struct nffs_file *file, uint32_t len, void *out_data,
     return 0;
 }
 
+/**
+ * Retrieves a pointer to data in the specified file, without copying it.  The
+ * file's read position is advanced past the returned data, and garbage
+ * collection is pinned until the pointer is released.  See nffs_read_ptr()
+ * for details.
+ *
+ * @param file              The file to read from.
+ * @param len               The maximum number of bytes to retrieve.
+ * @param out_ptr           On success, points to the file data.
+ * @param out_len           On success, the number of bytes available at
+ *                              out_ptr gets written here.
+ *
+ * @return                  0 on success; nonzero on failure.
+ */
+int
+nffs_file_read_ptr(struct nffs_file *file, uint32_t len, const void **out_ptr,
+                   uint32_t *out_len)
+{
+    int rc;
+
+    if (!nffs_ready()) {
+        return NFFS_EUNINIT;
+    }
+
+    if (!(file->nf_access_flags & NFFS_ACCESS_READ)) {
+        return NFFS_EACCESS;
+    }
+
+    rc = nffs_inode_read_ptr(file->nf_inode_entry, file->nf_offset, len,
+                             out_ptr, out_len);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (*out_ptr != NULL) {
+        /* Keep the mapped area from being erased until the caller releases
+         * the pointer.
+         */
+        nffs_gc_pin();
+    }
+
+    file->nf_offset += *out_len;
+
+    return 0;
+}
+
 /**
  * Closes the specified file and invalidates the file handle.  If the file has
  * already been unlinked, and this is the last open handle to the file, this
@@ -320,16 +410,37 @@ nffs_file_read(struct nffs_file *file, uint32_t len, void *out_data,
  *
  * @param file              The file handle to close.
  *
- * @return                  0 on success; nonzero on failure.
+ * @return                  0 on success;
+ *                          NFFS_EEXCL if the caller holds the lock in shared
+ *                              mode and this is the last reference to the
+ *                              inode; the handle is left open;
+ *                          other nonzero on failure.
  */
 int
 nffs_file_close(struct nffs_file *file)
 {
+    int done;
     int rc;
 
-    rc = nffs_inode_dec_refcnt(file->nf_inode_entry);
-    if (rc != 0) {
-        return rc;
+    nffs_lock_cache();
+    done = file->nf_inode_entry->nie_refcnt > 1;
+    if (done) {
+        file->nf_inode_entry->nie_refcnt--;
+        SLIST_REMOVE(&nffs_file_list, file, nffs_file, nf_next);
+    }
+    nffs_unlock_cache();
+
+    if (!done) {
+        if (!nffs_lock_held_exclusive()) {
+            return NFFS_EEXCL;
+        }
+
+        rc = nffs_inode_dec_refcnt(file->nf_inode_entry);
+        if (rc != 0) {
+            return rc;
+        }
+
+        SLIST_REMOVE(&nffs_file_list, file, nffs_file, nf_next);
     }
 
     rc = nffs_file_free(file);
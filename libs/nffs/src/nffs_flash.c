@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #include "hal/hal_flash.h"
 #include "nffs/nffs.h"
 #include "nffs_priv.h"
@@ -23,7 +24,8 @@
 uint8_t nffs_flash_buf[NFFS_FLASH_BUF_SZ];
 
 /**
- * Reads a chunk of data from flash.
+ * Reads a chunk of data from flash.  Objects staged by an open transaction
+ * are read from the transaction buffer.
  *
  * @param area_idx              The index of the area to read from.
  * @param area_offset           The offset within the area to read from.
@@ -41,6 +43,7 @@ nffs_flash_read(uint8_t area_idx, uint32_t area_offset, void *data,
                 uint32_t len)
 {
     const struct nffs_area *area;
+    const void *staged;
     int rc;
 
     assert(area_idx < nffs_num_areas);
@@ -51,6 +54,14 @@ nffs_flash_read(uint8_t area_idx, uint32_t area_offset, void *data,
         return NFFS_ERANGE;
     }
 
+    if (nffs_txn_staged_len != 0) {
+        staged = nffs_txn_find(area_idx, area_offset, len);
+        if (staged != NULL) {
+            memcpy(data, staged, len);
+            return 0;
+        }
+    }
+
     rc = flash_read(area->na_offset + area_offset, data, len);
     if (rc != 0) {
         return NFFS_EFLASH_ERROR;
@@ -60,7 +71,54 @@ nffs_flash_read(uint8_t area_idx, uint32_t area_offset, void *data,
 }
 
 /**
- * Writes a chunk of data to flash.
+ * Retrieves a pointer through which a chunk of flash can be read directly.
+ * This is only possible if the underlying flash is memory mapped.
+ *
+ * @param area_idx              The index of the area to map.
+ * @param area_offset           The offset within the area to map.
+ * @param len                   The number of bytes to map.
+ * @param out_ptr               On success, a pointer to the flash contents is
+ *                                  written here.
+ *
+ * @return                      0 on success;
+ *                              NFFS_ERANGE on an attempt to map an invalid
+ *                                  address range;
+ *                              NFFS_ENOTSUP if the flash cannot be accessed
+ *                                  directly.
+ */
+int
+nffs_flash_map(uint8_t area_idx, uint32_t area_offset, uint32_t len,
+               const void **out_ptr)
+{
+    const struct nffs_area *area;
+    int rc;
+
+    assert(area_idx < nffs_num_areas);
+
+    area = nffs_areas + area_idx;
+
+    if (area_offset + len > area->na_length) {
+        return NFFS_ERANGE;
+    }
+
+    if (nffs_txn_staged_len != 0) {
+        *out_ptr = nffs_txn_find(area_idx, area_offset, len);
+        if (*out_ptr != NULL) {
+            return 0;
+        }
+    }
+
+    rc = flash_map(area->na_offset + area_offset, len, out_ptr);
+    if (rc != 0) {
+        return NFFS_ENOTSUP;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a chunk of data to flash.  While a transaction is open, the data is
+ * staged in the transaction buffer instead.
  *
  * @param area_idx              The index of the area to write to.
  * @param area_offset           The offset within the area to write to.
@@ -91,6 +149,10 @@ nffs_flash_write(uint8_t area_idx, uint32_t area_offset, const void *data,
         return NFFS_ERANGE;
     }
 
+    if (nffs_txn_is_active()) {
+        return nffs_txn_write(area_idx, area_offset, data, len);
+    }
+
     rc = flash_write(area->na_offset + area_offset, data, len);
     if (rc != 0) {
         return NFFS_EFLASH_ERROR;
@@ -118,24 +180,25 @@ nffs_flash_copy(uint8_t area_idx_from, uint32_t area_offset_from,
                 uint32_t len)
 {
     uint32_t chunk_len;
+    uint8_t *buf;
     int rc;
 
-    /* Copy data in chunks small enough to fit in the flash buffer. */
+    buf = nffs_scratch_buf();
+
+    /* Copy data in chunks small enough to fit in the scratch buffer. */
     while (len > 0) {
-        if (len > sizeof nffs_flash_buf) {
-            chunk_len = sizeof nffs_flash_buf;
+        if (len > NFFS_SCRATCH_BUF_SZ) {
+            chunk_len = NFFS_SCRATCH_BUF_SZ;
         } else {
             chunk_len = len;
         }
 
-        rc = nffs_flash_read(area_idx_from, area_offset_from, nffs_flash_buf,
-                             chunk_len);
+        rc = nffs_flash_read(area_idx_from, area_offset_from, buf, chunk_len);
         if (rc != 0) {
             return rc;
         }
 
-        rc = nffs_flash_write(area_idx_to, area_offset_to, nffs_flash_buf,
-                              chunk_len);
+        rc = nffs_flash_write(area_idx_to, area_offset_to, buf, chunk_len);
         if (rc != 0) {
             return rc;
         }
@@ -153,7 +153,7 @@ nffs_format_full(const struct nffs_area_desc *area_descs)
     }
 
     /* Create root directory. */
-    rc = nffs_file_new(NULL, "", 0, 1, &nffs_root_dir);
+    rc = nffs_file_new(NULL, "", 0, 1, 0, &nffs_root_dir);
     if (rc != 0) {
         goto err;
     }
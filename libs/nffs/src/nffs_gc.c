@@ -21,6 +21,16 @@
 #include "nffs_priv.h"
 #include "nffs/nffs.h"
 
+/** The number of inode deletion records checked per scan of the disk. */
+#define NFFS_GC_DELETION_BATCH  16
+
+/**
+ * Number of outstanding nffs_read_ptr() mappings.  A garbage collection cycle
+ * erases an area, so it is refused while any mapping is outstanding.  Readers
+ * update this count, so it is protected by the cache mutex.
+ */
+static uint32_t nffs_gc_pin_cnt;
+
 static int
 nffs_gc_copy_object(struct nffs_hash_entry *entry, uint16_t object_size,
                     uint8_t to_area_idx)
@@ -118,7 +128,8 @@ nffs_gc_block_chain_copy(struct nffs_hash_entry *last_entry, uint32_t data_len,
     data_bytes_copied = 0;
     entry = last_entry;
 
-    while (data_bytes_copied < data_len) {
+    /* A zero-length block (an empty truncated file) still gets copied. */
+    do {
         assert(entry != NULL);
 
         rc = nffs_block_from_hash_entry(&block, entry);
@@ -134,7 +145,7 @@ nffs_gc_block_chain_copy(struct nffs_hash_entry *last_entry, uint32_t data_len,
         data_bytes_copied += block.nb_data_len;
 
         entry = block.nb_prev;
-    }
+    } while (data_bytes_copied < data_len);
 
     return 0;
 }
@@ -171,6 +182,7 @@ nffs_gc_block_chain_collate(struct nffs_hash_entry *last_entry,
     uint32_t to_area_offset;
     uint32_t from_area_offset;
     uint32_t data_offset;
+    uint32_t last_seq;
     uint8_t *data;
     uint8_t from_area_idx;
     int rc;
@@ -185,6 +197,7 @@ nffs_gc_block_chain_collate(struct nffs_hash_entry *last_entry,
 
     entry = last_entry;
     data_offset = data_len;
+    last_seq = 0;
     while (data_offset > 0) {
         rc = nffs_block_from_hash_entry(&block, entry);
         if (rc != 0) {
@@ -192,6 +205,10 @@ nffs_gc_block_chain_collate(struct nffs_hash_entry *last_entry,
         }
         data_offset -= block.nb_data_len;
 
+        if (entry == last_entry) {
+            last_seq = block.nb_seq;
+        }
+
         nffs_flash_loc_expand(block.nb_hash_entry->nhe_flash_loc,
                               &from_area_idx, &from_area_offset);
         from_area_offset += sizeof disk_block;
@@ -212,8 +229,11 @@ nffs_gc_block_chain_collate(struct nffs_hash_entry *last_entry,
 
     memset(&disk_block, 0, sizeof disk_block);
     disk_block.ndb_magic = NFFS_BLOCK_MAGIC;
-    disk_block.ndb_id = block.nb_hash_entry->nhe_id;
-    disk_block.ndb_seq = block.nb_seq + 1;
+    /* The collated block supersedes the last block in the chain; the others
+     * have already been deleted from RAM.
+     */
+    disk_block.ndb_id = last_entry->nhe_id;
+    disk_block.ndb_seq = last_seq + 1;
     disk_block.ndb_inode_id = block.nb_inode_entry->nie_hash_entry.nhe_id;
     if (entry == NULL) {
         disk_block.ndb_prev_id = NFFS_ID_NONE;
@@ -238,6 +258,9 @@ nffs_gc_block_chain_collate(struct nffs_hash_entry *last_entry,
 
     last_entry->nhe_flash_loc = nffs_flash_loc(to_area_idx, to_area_offset);
 
+    /* The cached blocks of this inode refer to the entries just deleted. */
+    nffs_cache_inode_delete_blocks(block.nb_inode_entry);
+
     rc = 0;
 
     ASSERT_IF_TEST(nffs_crc_disk_block_validate(&disk_block, to_area_idx,
@@ -331,7 +354,11 @@ nffs_gc_inode_blocks(struct nffs_inode_entry *inode_entry,
             prospective_data_len = data_len + block.nb_data_len;
             if (prospective_data_len <= nffs_block_max_data_sz) {
                 data_len = prospective_data_len;
-                if (last_entry != entry) {
+
+                /* A circular log's blocks are not collated; the log expires
+                 * a block at a time, and should keep doing so in small steps.
+                 */
+                if (last_entry != entry && inode_entry->nie_log_order == 0) {
                     multiple_blocks = 1;
                 }
             } else {
@@ -372,6 +399,159 @@ nffs_gc_inode_blocks(struct nffs_inode_entry *inode_entry,
     return 0;
 }
 
+/**
+ * Determines which of a batch of inode deletion records must survive garbage
+ * collection of their area.  A record is still needed if any other area
+ * contains an older record of the same inode or a record of one of its
+ * children; without the deletion record, the next restore would resurrect
+ * them.  The other areas are scanned once for the whole batch.
+ *
+ * @param ids                   The IDs of the deleted inodes.
+ * @param num_ids               The number of IDs in the batch; no more than
+ *                                  NFFS_GC_DELETION_BATCH.
+ * @param from_area_idx         The index of the area being collected.
+ * @param out_needed            On success, a bitmask of the needed records
+ *                                  gets written here; bit n corresponds to
+ *                                  ids[n].
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_gc_inode_deletions_needed(const uint32_t *ids, int num_ids,
+                               uint8_t from_area_idx, uint32_t *out_needed)
+{
+    struct nffs_disk_object disk_object;
+    struct nffs_disk_inode *disk_inode;
+    uint32_t area_offset;
+    uint32_t needed;
+    uint32_t all;
+    int rc;
+    int i;
+    int j;
+
+    needed = 0;
+    all = (1UL << num_ids) - 1;
+
+    for (i = 0; i < nffs_num_areas && needed != all; i++) {
+        if (i == from_area_idx || i == nffs_scratch_area_idx) {
+            continue;
+        }
+
+        area_offset = sizeof (struct nffs_disk_area);
+        while (area_offset < nffs_areas[i].na_cur && needed != all) {
+            rc = nffs_restore_disk_object(i, area_offset, &disk_object);
+            if (rc == NFFS_ECORRUPT) {
+                area_offset++;
+                continue;
+            }
+            if (rc != 0) {
+                return rc;
+            }
+
+            if (disk_object.ndo_type == NFFS_OBJECT_TYPE_INODE) {
+                disk_inode = &disk_object.ndo_disk_inode;
+                for (j = 0; j < num_ids; j++) {
+                    if ((disk_inode->ndi_id == ids[j] &&
+                         disk_inode->ndi_parent_id != NFFS_ID_NONE) ||
+                        disk_inode->ndi_parent_id == ids[j]) {
+
+                        needed |= 1UL << j;
+                    }
+                }
+            }
+
+            area_offset += nffs_restore_disk_object_size(&disk_object);
+        }
+    }
+
+    *out_needed = needed;
+    return 0;
+}
+
+/**
+ * Copies the inode deletion records in the source area which are still
+ * needed.  Deleted inodes are not present in the RAM representation, so these
+ * records are found by scanning the source area itself.  Records are checked
+ * in batches, so that the other areas are not rescanned for each one.
+ *
+ * @param from_area_idx         The index of the area being collected.
+ * @param to_area_idx           The index of the area to copy to.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_gc_copy_inode_deletions(uint8_t from_area_idx, uint8_t to_area_idx)
+{
+    struct nffs_disk_object disk_object;
+    struct nffs_disk_inode *disk_inode;
+    uint32_t offsets[NFFS_GC_DELETION_BATCH];
+    uint32_t ids[NFFS_GC_DELETION_BATCH];
+    uint16_t lens[NFFS_GC_DELETION_BATCH];
+    uint32_t area_offset;
+    uint32_t needed;
+    uint16_t copy_len;
+    int num_ids;
+    int rc;
+    int i;
+
+    num_ids = 0;
+    area_offset = sizeof (struct nffs_disk_area);
+    while (1) {
+        if (area_offset < nffs_areas[from_area_idx].na_cur) {
+            rc = nffs_restore_disk_object(from_area_idx, area_offset,
+                                          &disk_object);
+            if (rc == NFFS_ECORRUPT) {
+                area_offset++;
+                continue;
+            }
+            if (rc != 0) {
+                return rc;
+            }
+
+            copy_len = nffs_restore_disk_object_size(&disk_object);
+
+            if (disk_object.ndo_type == NFFS_OBJECT_TYPE_INODE) {
+                disk_inode = &disk_object.ndo_disk_inode;
+                if (disk_inode->ndi_parent_id == NFFS_ID_NONE &&
+                    disk_inode->ndi_id != NFFS_ID_ROOT_DIR) {
+
+                    ids[num_ids] = disk_inode->ndi_id;
+                    offsets[num_ids] = area_offset;
+                    lens[num_ids] = copy_len;
+                    num_ids++;
+                }
+            }
+
+            area_offset += copy_len;
+            if (num_ids < NFFS_GC_DELETION_BATCH) {
+                continue;
+            }
+        }
+
+        if (num_ids == 0) {
+            return 0;
+        }
+
+        rc = nffs_gc_inode_deletions_needed(ids, num_ids, from_area_idx,
+                                            &needed);
+        if (rc != 0) {
+            return rc;
+        }
+
+        for (i = 0; i < num_ids; i++) {
+            if (needed & (1UL << i)) {
+                rc = nffs_flash_copy(from_area_idx, offsets[i], to_area_idx,
+                                     nffs_areas[to_area_idx].na_cur,
+                                     lens[i]);
+                if (rc != 0) {
+                    return rc;
+                }
+            }
+        }
+        num_ids = 0;
+    }
+}
+
 /**
  * Triggers a garbage collection cycle.  This is implemented as follows:
  *
@@ -397,6 +577,9 @@ nffs_gc_inode_blocks(struct nffs_inode_entry *inode_entry,
  *              are consolidated and copied to the destination area as a single
  *              new block.
  *
+ *      Inode deletion records in the source area are copied if the deleted
+ *      inode still has older records elsewhere on disk.
+ *
  *  (4) The source area is reformatted as a scratch sector (i.e., its header
  *      indicates an ID of 0xffff).  The area's garbage collection sequence
  *      number is incremented prior to rewriting the header.  This area is now
@@ -406,7 +589,10 @@ nffs_gc_inode_blocks(struct nffs_inode_entry *inode_entry,
  *                              written here.  Pass null if you do not need
  *                              this information.
  *
- * @return                  0 on success; nonzero on error.
+ * @return                  0 on success;
+ *                          NFFS_EBUSY if a pointer returned by
+ *                              nffs_read_ptr() has not been released;
+ *                          other nonzero on error.
  */
 int
 nffs_gc(uint8_t *out_area_idx)
@@ -422,6 +608,13 @@ nffs_gc(uint8_t *out_area_idx)
     int rc;
     int i;
 
+    /* Staged objects would be left behind in the source area. */
+    assert(!nffs_txn_is_active());
+
+    if (nffs_gc_pinned()) {
+        return NFFS_EBUSY;
+    }
+
     from_area_idx = nffs_gc_select_area();
     from_area = nffs_areas + from_area_idx;
     to_area = nffs_areas + nffs_scratch_area_idx;
@@ -432,6 +625,7 @@ nffs_gc(uint8_t *out_area_idx)
         return rc;
     }
 
+    nffs_hash_walk_begin();
     for (i = 0; i < NFFS_HASH_SIZE; i++) {
         entry = SLIST_FIRST(nffs_hash + i);
         while (entry != NULL) {
@@ -446,6 +640,7 @@ nffs_gc(uint8_t *out_area_idx)
                     rc = nffs_gc_copy_inode(inode_entry,
                                             nffs_scratch_area_idx);
                     if (rc != 0) {
+                        nffs_hash_walk_end();
                         return rc;
                     }
                 }
@@ -457,6 +652,7 @@ nffs_gc(uint8_t *out_area_idx)
                     rc = nffs_gc_inode_blocks(inode_entry, from_area_idx,
                                               nffs_scratch_area_idx, &next);
                     if (rc != 0) {
+                        nffs_hash_walk_end();
                         return rc;
                     }
                 }
@@ -465,6 +661,12 @@ nffs_gc(uint8_t *out_area_idx)
             entry = next;
         }
     }
+    nffs_hash_walk_end();
+
+    rc = nffs_gc_copy_inode_deletions(from_area_idx, nffs_scratch_area_idx);
+    if (rc != 0) {
+        return rc;
+    }
 
     /* The amount of written data should never increase as a result of a gc
      * cycle.
@@ -521,3 +723,48 @@ nffs_gc_until(uint32_t space, uint8_t *out_area_idx)
 
     return NFFS_EFULL;
 }
+
+/**
+ * Prevents garbage collection until a matching call to nffs_gc_unpin().  Used
+ * while the application holds a pointer directly into flash.
+ */
+void
+nffs_gc_pin(void)
+{
+    nffs_lock_cache();
+    nffs_gc_pin_cnt++;
+    nffs_unlock_cache();
+}
+
+/**
+ * Releases a pin acquired with nffs_gc_pin().
+ *
+ * @return                  0 on success;
+ *                          NFFS_EINVAL if no pin is outstanding.
+ */
+int
+nffs_gc_unpin(void)
+{
+    int rc;
+
+    nffs_lock_cache();
+    if (nffs_gc_pin_cnt == 0) {
+        rc = NFFS_EINVAL;
+    } else {
+        nffs_gc_pin_cnt--;
+        rc = 0;
+    }
+    nffs_unlock_cache();
+
+    return rc;
+}
+
+/**
+ * Indicates whether garbage collection is currently prevented by an
+ * outstanding pin.
+ */
+int
+nffs_gc_pinned(void)
+{
+    return nffs_gc_pin_cnt != 0;
+}
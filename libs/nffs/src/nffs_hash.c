@@ -26,6 +26,9 @@ uint32_t nffs_hash_next_dir_id;
 uint32_t nffs_hash_next_file_id;
 uint32_t nffs_hash_next_block_id;
 
+/** Nonzero while some caller is iterating over the entire hash table. */
+static uint8_t nffs_hash_walk_depth;
+
 int
 nffs_hash_id_is_dir(uint32_t id)
 {
@@ -70,8 +73,12 @@ nffs_hash_find(uint32_t id)
     prev = NULL;
     SLIST_FOREACH(entry, list, nhe_next) {
         if (entry->nhe_id == id) {
-            /* Put entry at the front of the list. */
-            if (prev != NULL) {
+            /* Put entry at the front of the list.  Concurrent readers may
+             * be traversing the list, so only a writer reorders it, and
+             * never while the writer itself is walking the table.
+             */
+            if (prev != NULL && nffs_hash_walk_depth == 0 &&
+                nffs_lock_held_exclusive()) {
                 SLIST_NEXT(prev, nhe_next) = SLIST_NEXT(entry, nhe_next);
                 SLIST_INSERT_HEAD(list, entry, nhe_next);
             }
@@ -118,6 +125,25 @@ nffs_hash_insert(struct nffs_hash_entry *entry)
     SLIST_INSERT_HEAD(list, entry, nhe_next);
 }
 
+/**
+ * Indicates that the caller is about to iterate through the entire hash
+ * table.  Until the matching call to nffs_hash_walk_end(), lookups leave the
+ * bucket lists in their current order so that a saved "next" pointer is not
+ * reordered out from under the caller.  Walks may nest.
+ */
+void
+nffs_hash_walk_begin(void)
+{
+    nffs_hash_walk_depth++;
+}
+
+void
+nffs_hash_walk_end(void)
+{
+    assert(nffs_hash_walk_depth > 0);
+    nffs_hash_walk_depth--;
+}
+
 void
 nffs_hash_remove(struct nffs_hash_entry *entry)
 {
@@ -136,6 +162,7 @@ nffs_hash_init(void)
     int i;
 
     free(nffs_hash);
+    nffs_hash_walk_depth = 0;
 
     nffs_hash = malloc(NFFS_HASH_SIZE * sizeof *nffs_hash);
     if (nffs_hash == NULL) {
@@ -23,13 +23,10 @@
 #include "nffs_priv.h"
 #include "crc16.h"
 
-/* Partition the flash buffer into two equal halves; used for filename
- * comparisons.
+/* Filename comparisons partition the calling task's scratch buffer into two
+ * equal halves.
  */
-#define NFFS_INODE_FILENAME_BUF_SZ   (sizeof nffs_flash_buf / 2)
-static uint8_t *nffs_inode_filename_buf0 = nffs_flash_buf;
-static uint8_t *nffs_inode_filename_buf1 =
-    nffs_flash_buf + NFFS_INODE_FILENAME_BUF_SZ;
+#define NFFS_INODE_FILENAME_BUF_SZ   (NFFS_SCRATCH_BUF_SZ / 2)
 
 /** A list of directory inodes with pending unlink operations. */
 static struct nffs_hash_list nffs_inode_unlink_list;
@@ -73,7 +70,9 @@ nffs_inode_read_disk(uint8_t area_idx, uint32_t offset,
     if (rc != 0) {
         return rc;
     }
-    if (out_disk_inode->ndi_magic != NFFS_INODE_MAGIC) {
+    if (out_disk_inode->ndi_magic != NFFS_INODE_MAGIC &&
+        out_disk_inode->ndi_magic != NFFS_INODE_LOG_MAGIC) {
+
         return NFFS_EUNEXP;
     }
 
@@ -140,14 +139,16 @@ nffs_inode_data_len(struct nffs_inode_entry *inode_entry, uint32_t *out_len)
     struct nffs_cache_inode *cache_inode;
     int rc;
 
+    nffs_lock_cache();
+
     rc = nffs_cache_inode_ensure(&cache_inode, inode_entry);
-    if (rc != 0) {
-        return rc;
+    if (rc == 0) {
+        *out_len = cache_inode->nci_file_size;
     }
 
-    *out_len = cache_inode->nci_file_size;
+    nffs_unlock_cache();
 
-    return 0;
+    return rc;
 }
 
 int
@@ -176,6 +177,7 @@ nffs_inode_from_entry(struct nffs_inode *out_inode,
         out_inode->ni_parent = nffs_hash_find_inode(disk_inode.ndi_parent_id);
     }
     out_inode->ni_filename_len = disk_inode.ndi_filename_len;
+    out_inode->ni_log_order = nffs_log_order_from_disk(&disk_inode);
 
     if (out_inode->ni_filename_len > NFFS_SHORT_FILENAME_LEN) {
         cached_name_len = NFFS_SHORT_FILENAME_LEN;
@@ -362,6 +364,7 @@ nffs_inode_delete_from_disk(struct nffs_inode *inode)
     disk_inode.ndi_id = inode->ni_inode_entry->nie_hash_entry.nhe_id;
     disk_inode.ndi_seq = inode->ni_seq;
     disk_inode.ndi_parent_id = NFFS_ID_NONE;
+    disk_inode.ndi_log_order = NFFS_LOG_ORDER_NONE;
     disk_inode.ndi_filename_len = 0;
     nffs_crc_disk_inode_fill(&disk_inode, "");
 
@@ -378,9 +381,13 @@ nffs_inode_rename(struct nffs_inode_entry *inode_entry,
                  struct nffs_inode_entry *new_parent,
                  const char *new_filename)
 {
+    struct nffs_inode_entry *old_parent;
     struct nffs_disk_inode disk_inode;
     struct nffs_inode inode;
+    uint32_t old_area_offset;
     uint32_t area_offset;
+    uint8_t *scratch;
+    uint8_t old_area_idx;
     uint8_t area_idx;
     int filename_len;
     int rc;
@@ -389,34 +396,13 @@ nffs_inode_rename(struct nffs_inode_entry *inode_entry,
     if (rc != 0) {
         return rc;
     }
-
-    if (inode.ni_parent != new_parent) {
-        if (inode.ni_parent != NULL) {
-            nffs_inode_remove_child(&inode);
-        }
-        if (new_parent != NULL) {
-            rc = nffs_inode_add_child(new_parent, inode.ni_inode_entry);
-            if (rc != 0) {
-                return rc;
-            }
-        }
-        inode.ni_parent = new_parent;
-    }
+    old_parent = inode.ni_parent;
+    inode.ni_parent = new_parent;
 
     if (new_filename != NULL) {
         filename_len = strlen(new_filename);
     } else {
         filename_len = inode.ni_filename_len;
-        nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
-                              &area_idx, &area_offset);
-        rc = nffs_flash_read(area_idx,
-                             area_offset + sizeof (struct nffs_disk_inode),
-                             nffs_flash_buf, filename_len);
-        if (rc != 0) {
-            return rc;
-        }
-
-        new_filename = (char *)nffs_flash_buf;
     }
 
     rc = nffs_misc_reserve_space(sizeof disk_inode + filename_len,
@@ -425,10 +411,33 @@ nffs_inode_rename(struct nffs_inode_entry *inode_entry,
         return rc;
     }
 
-    disk_inode.ndi_magic = NFFS_INODE_MAGIC;
+    if (new_filename == NULL) {
+        /* Read the old filename only after space has been reserved; garbage
+         * collection may relocate the inode and uses the scratch buffer.
+         */
+        nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                              &old_area_idx, &old_area_offset);
+        scratch = nffs_scratch_buf();
+        rc = nffs_flash_read(old_area_idx,
+                             old_area_offset + sizeof (struct nffs_disk_inode),
+                             scratch, filename_len);
+        if (rc != 0) {
+            return rc;
+        }
+
+        new_filename = (char *)scratch;
+    }
+
     disk_inode.ndi_id = inode_entry->nie_hash_entry.nhe_id;
     disk_inode.ndi_seq = inode.ni_seq + 1;
     disk_inode.ndi_parent_id = nffs_inode_parent_id(&inode);
+    if (inode.ni_log_order == 0) {
+        disk_inode.ndi_magic = NFFS_INODE_MAGIC;
+        disk_inode.ndi_log_order = NFFS_LOG_ORDER_NONE;
+    } else {
+        disk_inode.ndi_magic = NFFS_INODE_LOG_MAGIC;
+        disk_inode.ndi_log_order = inode.ni_log_order;
+    }
     disk_inode.ndi_filename_len = filename_len;
     nffs_crc_disk_inode_fill(&disk_inode, new_filename);
 
@@ -441,6 +450,21 @@ nffs_inode_rename(struct nffs_inode_entry *inode_entry,
     inode_entry->nie_hash_entry.nhe_flash_loc =
         nffs_flash_loc(area_idx, area_offset);
 
+    /* Child lists are sorted by filename, so the inode is relinked even if
+     * its parent is unchanged.  This happens after the new inode is written,
+     * as the sort reads the filename from flash.
+     */
+    if (old_parent != NULL) {
+        inode.ni_parent = old_parent;
+        nffs_inode_remove_child(&inode);
+    }
+    if (new_parent != NULL) {
+        rc = nffs_inode_add_child(new_parent, inode_entry);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
     return 0;
 }
 
@@ -576,12 +600,15 @@ nffs_inode_filename_cmp_ram(const struct nffs_inode *inode,
                             const char *name, int name_len,
                             int *result)
 {
+    uint8_t *buf;
     int short_len;
     int chunk_len;
     int rem_len;
     int off;
     int rc;
 
+    buf = nffs_scratch_buf();
+
     if (name_len < inode->ni_filename_len) {
         short_len = name_len;
     } else {
@@ -604,15 +631,12 @@ nffs_inode_filename_cmp_ram(const struct nffs_inode *inode,
             chunk_len = rem_len;
         }
 
-        rc = nffs_inode_read_filename_chunk(inode, off,
-                                            nffs_inode_filename_buf0,
-                                            chunk_len);
+        rc = nffs_inode_read_filename_chunk(inode, off, buf, chunk_len);
         if (rc != 0) {
             return rc;
         }
 
-        *result = strncmp((char *)nffs_inode_filename_buf0, name + off,
-                          chunk_len);
+        *result = strncmp((char *)buf, name + off, chunk_len);
         off += chunk_len;
     }
 
@@ -628,12 +652,17 @@ nffs_inode_filename_cmp_flash(const struct nffs_inode *inode1,
                               const struct nffs_inode *inode2,
                               int *result)
 {
+    uint8_t *buf0;
+    uint8_t *buf1;
     int short_len;
     int chunk_len;
     int rem_len;
     int off;
     int rc;
 
+    buf0 = nffs_scratch_buf();
+    buf1 = buf0 + NFFS_INODE_FILENAME_BUF_SZ;
+
     if (inode1->ni_filename_len < inode2->ni_filename_len) {
         short_len = inode1->ni_filename_len;
     } else {
@@ -658,23 +687,17 @@ nffs_inode_filename_cmp_flash(const struct nffs_inode *inode1,
             chunk_len = rem_len;
         }
 
-        rc = nffs_inode_read_filename_chunk(inode1, off,
-                                            nffs_inode_filename_buf0,
-                                            chunk_len);
+        rc = nffs_inode_read_filename_chunk(inode1, off, buf0, chunk_len);
         if (rc != 0) {
             return rc;
         }
 
-        rc = nffs_inode_read_filename_chunk(inode2, off,
-                                            nffs_inode_filename_buf1,
-                                            chunk_len);
+        rc = nffs_inode_read_filename_chunk(inode2, off, buf1, chunk_len);
         if (rc != 0) {
             return rc;
         }
 
-        *result = strncmp((char *)nffs_inode_filename_buf0,
-                          (char *)nffs_inode_filename_buf1,
-                          chunk_len);
+        *result = strncmp((char *)buf0, (char *)buf1, chunk_len);
         off += chunk_len;
     }
 
@@ -773,6 +796,8 @@ nffs_inode_read(struct nffs_inode_entry *inode_entry, uint32_t offset,
 {
     struct nffs_cache_inode *cache_inode;
     struct nffs_cache_block *cache_block;
+    struct nffs_block block;
+    uint32_t cache_gen;
     uint32_t block_end;
     uint32_t dst_off;
     uint32_t src_off;
@@ -789,9 +814,22 @@ nffs_inode_read(struct nffs_inode_entry *inode_entry, uint32_t offset,
         return 0;
     }
 
+    nffs_lock_cache();
+
     rc = nffs_cache_inode_ensure(&cache_inode, inode_entry);
     if (rc != 0) {
-        return rc;
+        goto done;
+    }
+
+    /* The offset may lie beyond the end of the file if the file was
+     * truncated through another handle.
+     */
+    if (offset >= cache_inode->nci_file_size) {
+        if (out_len != NULL) {
+            *out_len = 0;
+        }
+        rc = 0;
+        goto done;
     }
 
     src_end = offset + len;
@@ -812,7 +850,7 @@ nffs_inode_read(struct nffs_inode_entry *inode_entry, uint32_t offset,
         if (cache_block == NULL) {
             rc = nffs_cache_seek(cache_inode, src_off - 1, &cache_block);
             if (rc != 0) {
-                return rc;
+                goto done;
             }
         }
 
@@ -832,20 +870,114 @@ nffs_inode_read(struct nffs_inode_entry *inode_entry, uint32_t offset,
         dst_off -= chunk_sz;
         src_off -= chunk_sz;
 
-        rc = nffs_block_read_data(&cache_block->ncb_block, block_off, chunk_sz,
-                                  dptr + dst_off);
+        /* Don't hold the cache mutex while reading file data; other readers
+         * would be blocked for the duration of the flash access.
+         */
+        block = cache_block->ncb_block;
+        cache_gen = nffs_cache_gen;
+        nffs_unlock_cache();
+
+        rc = nffs_block_read_data(&block, block_off, chunk_sz, dptr + dst_off);
+
+        nffs_lock_cache();
         if (rc != 0) {
-            return rc;
+            goto done;
         }
 
-        cache_block = TAILQ_PREV(cache_block, nffs_cache_block_list, ncb_link);
+        if (nffs_cache_gen != cache_gen) {
+            /* Another reader freed cache entries while the mutex was
+             * released; the cached pointers may be stale.
+             */
+            rc = nffs_cache_inode_ensure(&cache_inode, inode_entry);
+            if (rc != 0) {
+                goto done;
+            }
+            cache_block = NULL;
+        } else {
+            cache_block = TAILQ_PREV(cache_block, nffs_cache_block_list,
+                                     ncb_link);
+        }
     }
 
     if (out_len != NULL) {
         *out_len = src_end - offset;
     }
 
-    return 0;
+    rc = 0;
+
+done:
+    nffs_unlock_cache();
+    return rc;
+}
+
+/**
+ * Retrieves a pointer to file data within the specified inode.  The returned
+ * region is contiguous in flash, so it never extends past the end of the
+ * data block containing the requested offset; fewer bytes than requested may
+ * be returned even when the file contains more data.
+ *
+ * @param inode_entry           The inode to read from.
+ * @param offset                The offset within the file to start the read
+ *                                  at.
+ * @param len                   The maximum number of bytes to map.
+ * @param out_ptr               On success, a pointer to the file data gets
+ *                                  written here.
+ * @param out_len               On success, the number of bytes accessible
+ *                                  through the pointer gets written here.  0
+ *                                  indicates end of file.
+ *
+ * @return                      0 on success;
+ *                              NFFS_ENOTSUP if the flash is not memory
+ *                                  mapped, or if the data is staged in an
+ *                                  open transaction;
+ *                              other nonzero on failure.
+ */
+int
+nffs_inode_read_ptr(struct nffs_inode_entry *inode_entry, uint32_t offset,
+                    uint32_t len, const void **out_ptr, uint32_t *out_len)
+{
+    struct nffs_cache_inode *cache_inode;
+    struct nffs_cache_block *cache_block;
+    uint32_t chunk_sz;
+    uint16_t block_off;
+    int rc;
+
+    nffs_lock_cache();
+
+    rc = nffs_cache_inode_ensure(&cache_inode, inode_entry);
+    if (rc != 0) {
+        goto done;
+    }
+
+    if (len == 0 || offset >= cache_inode->nci_file_size) {
+        *out_ptr = NULL;
+        *out_len = 0;
+        rc = 0;
+        goto done;
+    }
+
+    rc = nffs_cache_seek(cache_inode, offset, &cache_block);
+    if (rc != 0) {
+        goto done;
+    }
+
+    block_off = offset - cache_block->ncb_file_offset;
+    chunk_sz = cache_block->ncb_block.nb_data_len - block_off;
+    if (chunk_sz > len) {
+        chunk_sz = len;
+    }
+
+    rc = nffs_block_map_data(&cache_block->ncb_block, block_off, chunk_sz,
+                             out_ptr);
+    if (rc != 0) {
+        goto done;
+    }
+
+    *out_len = chunk_sz;
+
+done:
+    nffs_unlock_cache();
+    return rc;
 }
 
 int
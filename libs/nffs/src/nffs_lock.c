@@ -0,0 +1,332 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * nffs access control.  The file system is protected by a reader-writer lock.
+ * Operations which only inspect the file system (reads, seeks, read-only
+ * opens, directory walks) acquire the lock in shared mode and may proceed
+ * concurrently.  Operations which modify the file system acquire the lock in
+ * exclusive mode.  A reader which would drop the last reference to an inode
+ * (e.g., closing the last handle to an unlinked file) cannot delete the inode
+ * in shared mode; it backs out and repeats the operation exclusively.
+ *
+ * Readers still modify a small amount of RAM state: the inode and block
+ * caches, and inode reference counts.  This state is protected by a separate
+ * cache mutex.  The cache mutex is only held while RAM structures are being
+ * updated; it is never held across a read of file data.
+ *
+ * Each lock holder is assigned a scratch buffer for the duration of its
+ * operation.  The scratch buffer belongs to the calling task, so concurrent
+ * readers can compare filenames and verify CRCs without contending for
+ * nffs_flash_buf.
+ *
+ * Priority inheritance: the old single os_mutex boosted its holder to the
+ * priority of the highest waiter.  The reader-writer lock is built from
+ * semaphores, which have no owner and therefore no inheritance.  A
+ * low-priority reader or writer can be preempted by a medium-priority task
+ * while a high-priority task waits for the nffs lock, so the high-priority
+ * task's worst-case wait is no longer bounded by the lock holder's own run
+ * time.  Applications with hard deadlines on file system access should give
+ * every task which uses nffs the same priority, or serialize access
+ * themselves.  The state and cache mutexes do inherit, but they are only held
+ * for short RAM updates.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "os/os.h"
+#include "nffs/nffs.h"
+#include "nffs_priv.h"
+
+struct nffs_lock_scratch {
+    struct os_task *nls_owner;
+    uint8_t nls_in_use;
+    uint8_t nls_buf[NFFS_SCRATCH_BUF_SZ];
+};
+
+/** One scratch buffer per permitted concurrent reader. */
+static struct nffs_lock_scratch *nffs_lock_scratch;
+
+/** Held by a writer, or collectively by the set of active readers. */
+static struct os_sem nffs_lock_excl_sem;
+
+/**
+ * Passed through by readers and held by a waiting writer; prevents a steady
+ * stream of readers from starving writers.
+ */
+static struct os_sem nffs_lock_turnstile_sem;
+
+/** Limits the number of concurrent readers to the number of scratch bufs. */
+static struct os_sem nffs_lock_reader_sem;
+
+/** Protects the reader count and the scratch buffer assignments. */
+static struct os_mutex nffs_lock_state_mutex;
+
+/** Protects the caches and reference counts; see above. */
+static struct os_mutex nffs_lock_cache_mutex;
+
+static int nffs_lock_num_readers;
+static int nffs_lock_exclusive;
+
+static void
+nffs_lock_sem_pend(struct os_sem *sem)
+{
+    int rc;
+
+    rc = os_sem_pend(sem, OS_TIMEOUT_NEVER);
+    assert(rc == 0 || rc == OS_NOT_STARTED);
+}
+
+static void
+nffs_lock_sem_release(struct os_sem *sem)
+{
+    int rc;
+
+    rc = os_sem_release(sem);
+    assert(rc == 0 || rc == OS_NOT_STARTED);
+}
+
+static void
+nffs_lock_mutex_pend(struct os_mutex *mutex)
+{
+    int rc;
+
+    rc = os_mutex_pend(mutex, OS_TIMEOUT_NEVER);
+    assert(rc == 0 || rc == OS_NOT_STARTED);
+}
+
+static void
+nffs_lock_mutex_release(struct os_mutex *mutex)
+{
+    int rc;
+
+    rc = os_mutex_release(mutex);
+    assert(rc == 0 || rc == OS_NOT_STARTED);
+}
+
+/**
+ * Assigns a free scratch buffer to the current task.  The caller must hold
+ * the state mutex.
+ */
+static void
+nffs_lock_scratch_assign(void)
+{
+    struct nffs_lock_scratch *scratch;
+    int i;
+
+    for (i = 0; i < nffs_config.nc_num_readers; i++) {
+        scratch = nffs_lock_scratch + i;
+        if (!scratch->nls_in_use) {
+            scratch->nls_in_use = 1;
+            scratch->nls_owner = os_sched_get_current_task();
+            return;
+        }
+    }
+
+    /* The reader semaphore guarantees a free buffer. */
+    assert(0);
+}
+
+static struct nffs_lock_scratch *
+nffs_lock_scratch_find(void)
+{
+    struct nffs_lock_scratch *scratch;
+    struct os_task *task;
+    int i;
+
+    if (nffs_lock_scratch == NULL) {
+        return NULL;
+    }
+
+    task = os_sched_get_current_task();
+    for (i = 0; i < nffs_config.nc_num_readers; i++) {
+        scratch = nffs_lock_scratch + i;
+        if (scratch->nls_in_use && scratch->nls_owner == task) {
+            return scratch;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Releases the current task's scratch buffer.  The caller must hold the state
+ * mutex.
+ */
+static void
+nffs_lock_scratch_unassign(void)
+{
+    struct nffs_lock_scratch *scratch;
+
+    scratch = nffs_lock_scratch_find();
+    assert(scratch != NULL);
+
+    scratch->nls_in_use = 0;
+    scratch->nls_owner = NULL;
+}
+
+/**
+ * Retrieves the scratch buffer belonging to the current task.  The buffer is
+ * NFFS_SCRATCH_BUF_SZ bytes in size, and remains valid until the task
+ * releases the nffs lock.  Code which executes without holding the lock (e.g.,
+ * host tools which call nffs internals directly) gets the shared flash buffer.
+ */
+uint8_t *
+nffs_scratch_buf(void)
+{
+    struct nffs_lock_scratch *scratch;
+
+    scratch = nffs_lock_scratch_find();
+    if (scratch == NULL) {
+        return nffs_flash_buf;
+    }
+
+    return scratch->nls_buf;
+}
+
+/**
+ * Acquires the nffs lock in shared mode.  Other readers may hold the lock
+ * concurrently; writers are excluded.
+ */
+void
+nffs_lock_read(void)
+{
+    nffs_lock_sem_pend(&nffs_lock_reader_sem);
+
+    nffs_lock_sem_pend(&nffs_lock_turnstile_sem);
+    nffs_lock_sem_release(&nffs_lock_turnstile_sem);
+
+    nffs_lock_mutex_pend(&nffs_lock_state_mutex);
+    if (nffs_lock_num_readers++ == 0) {
+        nffs_lock_sem_pend(&nffs_lock_excl_sem);
+    }
+    nffs_lock_scratch_assign();
+    nffs_lock_mutex_release(&nffs_lock_state_mutex);
+}
+
+void
+nffs_unlock_read(void)
+{
+    nffs_lock_mutex_pend(&nffs_lock_state_mutex);
+    nffs_lock_scratch_unassign();
+    assert(nffs_lock_num_readers > 0);
+    if (--nffs_lock_num_readers == 0) {
+        nffs_lock_sem_release(&nffs_lock_excl_sem);
+    }
+    nffs_lock_mutex_release(&nffs_lock_state_mutex);
+
+    nffs_lock_sem_release(&nffs_lock_reader_sem);
+}
+
+/**
+ * Acquires the nffs lock in exclusive mode.  No other readers or writers hold
+ * the lock while a writer holds it.
+ */
+void
+nffs_lock_write(void)
+{
+    nffs_lock_sem_pend(&nffs_lock_turnstile_sem);
+    nffs_lock_sem_pend(&nffs_lock_excl_sem);
+    nffs_lock_sem_release(&nffs_lock_turnstile_sem);
+
+    nffs_lock_mutex_pend(&nffs_lock_state_mutex);
+    assert(!nffs_lock_exclusive);
+    nffs_lock_exclusive = 1;
+    nffs_lock_scratch_assign();
+    nffs_lock_mutex_release(&nffs_lock_state_mutex);
+}
+
+void
+nffs_unlock_write(void)
+{
+    nffs_lock_mutex_pend(&nffs_lock_state_mutex);
+    nffs_lock_scratch_unassign();
+    assert(nffs_lock_exclusive);
+    nffs_lock_exclusive = 0;
+    nffs_lock_mutex_release(&nffs_lock_state_mutex);
+
+    nffs_lock_sem_release(&nffs_lock_excl_sem);
+}
+
+/**
+ * Indicates whether the nffs lock is currently held by a writer.  Code which
+ * may run in either mode uses this to decide whether it is allowed to
+ * reorganize shared RAM structures.
+ */
+int
+nffs_lock_held_exclusive(void)
+{
+    return nffs_lock_exclusive;
+}
+
+/**
+ * Acquires the cache mutex.  A reader must hold this while it modifies the
+ * inode cache, the block cache, or an inode's reference count.  The mutex is
+ * recursive, and is uncontended when taken by a writer.
+ */
+void
+nffs_lock_cache(void)
+{
+    nffs_lock_mutex_pend(&nffs_lock_cache_mutex);
+}
+
+void
+nffs_unlock_cache(void)
+{
+    nffs_lock_mutex_release(&nffs_lock_cache_mutex);
+}
+
+int
+nffs_lock_init(void)
+{
+    int rc;
+
+    free(nffs_lock_scratch);
+    nffs_lock_scratch = malloc(nffs_config.nc_num_readers *
+                               sizeof *nffs_lock_scratch);
+    if (nffs_lock_scratch == NULL) {
+        return NFFS_ENOMEM;
+    }
+    memset(nffs_lock_scratch, 0,
+           nffs_config.nc_num_readers * sizeof *nffs_lock_scratch);
+
+    nffs_lock_num_readers = 0;
+    nffs_lock_exclusive = 0;
+
+    rc = os_sem_init(&nffs_lock_excl_sem, 1);
+    if (rc != 0) {
+        return NFFS_EOS;
+    }
+    rc = os_sem_init(&nffs_lock_turnstile_sem, 1);
+    if (rc != 0) {
+        return NFFS_EOS;
+    }
+    rc = os_sem_init(&nffs_lock_reader_sem, nffs_config.nc_num_readers);
+    if (rc != 0) {
+        return NFFS_EOS;
+    }
+    rc = os_mutex_init(&nffs_lock_state_mutex);
+    if (rc != 0) {
+        return NFFS_EOS;
+    }
+    rc = os_mutex_init(&nffs_lock_cache_mutex);
+    if (rc != 0) {
+        return NFFS_EOS;
+    }
+
+    return 0;
+}
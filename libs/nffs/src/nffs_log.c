@@ -0,0 +1,275 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Circular logs.  A log is a file with a fixed capacity.  When an append
+ * pushes the log past its capacity, whole blocks are dropped from the start
+ * of the log until it fits again; the last block is always kept.
+ *
+ * Expiry writes nothing to flash.  The expired blocks are only deleted from
+ * RAM; on disk, the oldest live block still names its expired predecessor.
+ * Since no inode refers to the expired blocks any more, garbage collection
+ * discards them rather than copying them.  Restore reapplies the same rule:
+ * walking back from the last block, blocks are kept as long as they fit.  The
+ * set of live blocks is therefore fully determined by the block lengths on
+ * disk.
+ */
+
+#include <assert.h>
+#include "nffs_priv.h"
+#include "nffs/nffs.h"
+
+#define NFFS_LOG_HEAD_SZ    32
+
+/**
+ * The IDs of the oldest blocks of the log that was expired most recently,
+ * newest first.  Finding a log's oldest block otherwise requires walking its
+ * whole chain, as blocks only refer to their predecessors.  A single walk
+ * fills the queue, and serves the next NFFS_LOG_HEAD_SZ expiries.
+ */
+static struct {
+    const struct nffs_inode_entry *nlh_inode_entry;
+    uint32_t nlh_ids[NFFS_LOG_HEAD_SZ];
+    int nlh_num_ids;
+} nffs_log_head;
+
+/**
+ * Extracts the log order from a disk inode.  Only inodes written with the log
+ * magic number are logs.  Regular inodes written by older versions of nffs
+ * contain an arbitrary value in the log order field.
+ *
+ * @return                      log2 of the log's capacity;
+ *                              0 if the inode is not a circular log.
+ */
+uint8_t
+nffs_log_order_from_disk(const struct nffs_disk_inode *disk_inode)
+{
+    if (disk_inode->ndi_magic != NFFS_INODE_LOG_MAGIC ||
+        disk_inode->ndi_log_order < NFFS_LOG_ORDER_MIN ||
+        disk_inode->ndi_log_order > NFFS_LOG_ORDER_MAX) {
+
+        return 0;
+    }
+
+    return disk_inode->ndi_log_order;
+}
+
+uint32_t
+nffs_log_capacity(const struct nffs_inode_entry *inode_entry)
+{
+    assert(inode_entry->nie_log_order != 0);
+    return (uint32_t)1 << inode_entry->nie_log_order;
+}
+
+/**
+ * Finds the newest expired block in a circular log's chain.  This is used
+ * during restore, when the expired blocks are still present in RAM.
+ *
+ * @param inode_entry           The log to inspect.
+ * @param out_entry             On success, the newest block which does not
+ *                                  fit in the log gets written here; null if
+ *                                  all blocks are live.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+nffs_log_find_expired(struct nffs_inode_entry *inode_entry,
+                      struct nffs_hash_entry **out_entry)
+{
+    struct nffs_hash_entry *cur;
+    struct nffs_block block;
+    uint32_t capacity;
+    uint32_t len;
+    int rc;
+
+    capacity = nffs_log_capacity(inode_entry);
+
+    len = 0;
+    cur = inode_entry->nie_last_block_entry;
+    while (cur != NULL) {
+        rc = nffs_block_from_hash_entry(&block, cur);
+        if (rc != 0) {
+            return rc;
+        }
+
+        if (cur != inode_entry->nie_last_block_entry &&
+            len + block.nb_data_len > capacity) {
+
+            *out_entry = cur;
+            return 0;
+        }
+
+        len += block.nb_data_len;
+        cur = block.nb_prev;
+    }
+
+    *out_entry = NULL;
+    return 0;
+}
+
+/**
+ * Refills the head queue with the oldest blocks of the specified log.
+ *
+ * @param inode_entry           The log to inspect.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_log_fill_head(struct nffs_inode_entry *inode_entry)
+{
+    struct nffs_hash_entry *cur;
+    struct nffs_block block;
+    uint32_t ring[NFFS_LOG_HEAD_SZ];
+    int num_blocks;
+    int rc;
+    int i;
+
+    nffs_log_head.nlh_inode_entry = NULL;
+    nffs_log_head.nlh_num_ids = 0;
+
+    /* Walking from the end of the log, the last blocks seen are the oldest.
+     * Remember the most recent few in a ring.
+     */
+    num_blocks = 0;
+    cur = inode_entry->nie_last_block_entry;
+    while (cur != NULL) {
+        rc = nffs_block_from_hash_entry(&block, cur);
+        if (rc != 0) {
+            return rc;
+        }
+
+        ring[num_blocks % NFFS_LOG_HEAD_SZ] = cur->nhe_id;
+        num_blocks++;
+        cur = block.nb_prev;
+    }
+    if (num_blocks == 0) {
+        return NFFS_ENOENT;
+    }
+
+    /* Unroll the ring, newest first; the oldest block is at the end. */
+    if (num_blocks > NFFS_LOG_HEAD_SZ) {
+        nffs_log_head.nlh_num_ids = NFFS_LOG_HEAD_SZ;
+    } else {
+        nffs_log_head.nlh_num_ids = num_blocks;
+    }
+    for (i = 0; i < nffs_log_head.nlh_num_ids; i++) {
+        nffs_log_head.nlh_ids[nffs_log_head.nlh_num_ids - 1 - i] =
+            ring[(num_blocks - 1 - i) % NFFS_LOG_HEAD_SZ];
+    }
+    nffs_log_head.nlh_inode_entry = inode_entry;
+
+    return 0;
+}
+
+/**
+ * Finds the oldest block of a circular log.  The oldest block of the log that
+ * was expired most recently is usually found in the head queue, without a
+ * walk of the block chain.  A queued ID is only used if the block still
+ * exists, belongs to the log, and has no predecessor; this guards against
+ * garbage collection having collated it, and against the log having been
+ * truncated or deleted.  Otherwise, the queue is refilled.
+ *
+ * @param inode_entry           The log to inspect.
+ * @param out_block             On success, the oldest block gets written here.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_log_oldest(struct nffs_inode_entry *inode_entry,
+                struct nffs_block *out_block)
+{
+    struct nffs_hash_entry *entry;
+    int rc;
+
+    if (nffs_log_head.nlh_inode_entry == inode_entry &&
+        nffs_log_head.nlh_num_ids > 0) {
+
+        entry = nffs_hash_find_block(
+            nffs_log_head.nlh_ids[nffs_log_head.nlh_num_ids - 1]);
+        if (entry != NULL) {
+            rc = nffs_block_from_hash_entry(out_block, entry);
+            if (rc != 0) {
+                return rc;
+            }
+            if (out_block->nb_inode_entry == inode_entry &&
+                out_block->nb_prev == NULL) {
+
+                return 0;
+            }
+        }
+    }
+
+    rc = nffs_log_fill_head(inode_entry);
+    if (rc != 0) {
+        return rc;
+    }
+
+    entry = nffs_hash_find_block(
+        nffs_log_head.nlh_ids[nffs_log_head.nlh_num_ids - 1]);
+    assert(entry != NULL);
+
+    return nffs_block_from_hash_entry(out_block, entry);
+}
+
+/**
+ * Drops blocks from the start of a circular log until it fits within its
+ * capacity.  Open handles to the log are moved back by the amount of data
+ * dropped.
+ *
+ * @param cache_inode           The log to expire blocks from.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+int
+nffs_log_expire(struct nffs_cache_inode *cache_inode)
+{
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_hash_entry *entry;
+    struct nffs_block block;
+    uint32_t expired_len;
+    uint32_t capacity;
+    int rc;
+
+    inode_entry = cache_inode->nci_inode.ni_inode_entry;
+    capacity = nffs_log_capacity(inode_entry);
+
+    expired_len = 0;
+    rc = 0;
+    while (cache_inode->nci_file_size > capacity) {
+        rc = nffs_log_oldest(inode_entry, &block);
+        if (rc != 0) {
+            break;
+        }
+
+        entry = block.nb_hash_entry;
+        if (entry == inode_entry->nie_last_block_entry) {
+            break;
+        }
+
+        nffs_cache_inode_expire(cache_inode, entry, block.nb_data_len);
+        expired_len += block.nb_data_len;
+        nffs_log_head.nlh_num_ids--;
+
+        nffs_hash_remove(entry);
+        nffs_block_entry_free(entry);
+    }
+
+    if (expired_len > 0) {
+        nffs_file_shift(inode_entry, expired_len);
+    }
+
+    return rc;
+}
@@ -117,7 +117,8 @@ nffs_misc_reserve_space_area(uint8_t area_idx, uint16_t space,
 
 /**
  * Finds an area that can accommodate an object of the specified size.  If no
- * such area exists, this function performs a garbage collection cycle.
+ * such area exists, this function performs a garbage collection cycle.  While
+ * a transaction is open, space is taken from the transaction buffer instead.
  *
  * @param space                 The number of bytes of free space required.
  * @param out_area_idx          On success, the index of the suitable area gets
@@ -135,6 +136,10 @@ nffs_misc_reserve_space(uint16_t space,
     int rc;
     int i;
 
+    if (nffs_txn_is_active()) {
+        return nffs_txn_reserve_space(space, out_area_idx, out_area_offset);
+    }
+
     /* Find the first area with sufficient free space. */
     for (i = 0; i < nffs_num_areas; i++) {
         if (i != nffs_scratch_area_idx) {
@@ -166,6 +171,41 @@ nffs_misc_reserve_space(uint16_t space,
     return rc;
 }
 
+/**
+ * Ensures that objects totaling the specified number of bytes can be written
+ * without triggering garbage collection.  Each object is written to the first
+ * area with room for it, so this is the case as soon as any single area has
+ * the requested amount of free space.  Garbage collection is performed now if
+ * no area does.  While a transaction is open, the objects must fit in the
+ * transaction buffer.
+ *
+ * @param space                 The number of bytes of free space required.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EFULL if the space could not be freed;
+ *                              nonzero on other failure.
+ */
+int
+nffs_misc_ensure_space(uint32_t space)
+{
+    uint8_t area_idx;
+    int i;
+
+    if (nffs_txn_is_active()) {
+        return nffs_txn_ensure_space(space);
+    }
+
+    for (i = 0; i < nffs_num_areas; i++) {
+        if (i != nffs_scratch_area_idx &&
+            nffs_area_free_space(nffs_areas + i) >= space) {
+
+            return 0;
+        }
+    }
+
+    return nffs_gc_until(space, &area_idx);
+}
+
 int
 nffs_misc_set_num_areas(uint8_t num_areas)
 {
@@ -285,7 +325,9 @@ nffs_misc_reset(void)
     int rc;
 
     nffs_cache_clear();
+    nffs_txn_reset();
 
+    SLIST_INIT(&nffs_file_list);
     rc = os_mempool_init(&nffs_file_pool, nffs_config.nc_num_files,
                          sizeof (struct nffs_file), nffs_file_mem,
                          "nffs_file_pool");
@@ -285,9 +285,14 @@ nffs_path_rename(const char *from, const char *to)
 }
 
 /**
- * Creates a new directory at the specified path.
+ * Creates a new inode at the specified path.
  *
- * @param path                  The path of the directory to create.
+ * @param path                  The path of the inode to create.
+ * @param is_dir                1 to create a directory; 0 for a file.
+ * @param log_order             log2 of the capacity to create a circular log;
+ *                                  0 otherwise.
+ * @param out_inode_entry       On success, the new inode gets written here;
+ *                                  pass null if you don't need it.
  *
  * @return                      0 on success;
  *                              NFFS_EEXIST if there is another file or
@@ -295,8 +300,9 @@ nffs_path_rename(const char *from, const char *to)
  *                              NFFS_ENONT if a required intermediate directory
  *                                  does not exist.
  */
-int
-nffs_path_new_dir(const char *path, struct nffs_inode_entry **out_inode_entry)
+static int
+nffs_path_new(const char *path, int is_dir, uint8_t log_order,
+              struct nffs_inode_entry **out_inode_entry)
 {
     struct nffs_path_parser parser;
     struct nffs_inode_entry *inode_entry;
@@ -315,8 +321,8 @@ nffs_path_new_dir(const char *path, struct nffs_inode_entry **out_inode_entry)
         return NFFS_ENOENT;
     }
 
-    rc = nffs_file_new(parent, parser.npp_token, parser.npp_token_len, 1, 
-                       &inode_entry);
+    rc = nffs_file_new(parent, parser.npp_token, parser.npp_token_len, is_dir,
+                       log_order, &inode_entry);
     if (rc != 0) {
         return rc;
     }
@@ -327,3 +333,38 @@ nffs_path_new_dir(const char *path, struct nffs_inode_entry **out_inode_entry)
 
     return 0;
 }
+
+/**
+ * Creates a new directory at the specified path.
+ *
+ * @param path                  The path of the directory to create.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EEXIST if there is another file or
+ *                                  directory at the specified path.
+ *                              NFFS_ENONT if a required intermediate directory
+ *                                  does not exist.
+ */
+int
+nffs_path_new_dir(const char *path, struct nffs_inode_entry **out_inode_entry)
+{
+    return nffs_path_new(path, 1, 0, out_inode_entry);
+}
+
+/**
+ * Creates an empty circular log at the specified path.
+ *
+ * @param path                  The path of the log to create.
+ * @param log_order             log2 of the log's capacity, in bytes.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EEXIST if there is another file or
+ *                                  directory at the specified path.
+ *                              NFFS_ENONT if a required intermediate directory
+ *                                  does not exist.
+ */
+int
+nffs_path_new_log(const char *path, uint8_t log_order)
+{
+    return nffs_path_new(path, 0, log_order, NULL);
+}
@@ -40,6 +40,9 @@
 #define NFFS_AREA_MAGIC3             0xb185fc8e
 #define NFFS_BLOCK_MAGIC             0x53ba23b9
 #define NFFS_INODE_MAGIC             0x925f8bc0
+#define NFFS_INODE_LOG_MAGIC         0x4c6f4721
+#define NFFS_TXN_MAGIC               0x6e2d41f7
+#define NFFS_COMMIT_MAGIC            0xc3a5179d
 
 #define NFFS_AREA_ID_NONE            0xff
 #define NFFS_AREA_VER                0
@@ -49,6 +52,17 @@
 
 #define NFFS_BLOCK_MAX_DATA_SZ_MAX   2048
 
+#define NFFS_LOG_ORDER_NONE          0xff
+#define NFFS_LOG_ORDER_MIN           8
+#define NFFS_LOG_ORDER_MAX           31
+
+/**
+ * Internal status: the operation dropped the last reference to an inode while
+ * the lock was held in shared mode.  Nothing was changed; the caller retries
+ * with the lock held exclusively.  Never returned to the application.
+ */
+#define NFFS_EEXCL                   0x100
+
 /** On-disk representation of an area header. */
 struct nffs_disk_area {
     uint32_t nda_magic[4];  /* NFFS_AREA_MAGIC{0,1,2,3} */
@@ -61,12 +75,17 @@ struct nffs_disk_area {
 
 /** On-disk representation of an inode (file or directory). */
 struct nffs_disk_inode {
-    uint32_t ndi_magic;         /* NFFS_INODE_MAGIC */
+    uint32_t ndi_magic;         /* NFFS_INODE_MAGIC, or
+                                   NFFS_INODE_LOG_MAGIC if a circular log. */
     uint32_t ndi_id;            /* Unique object ID. */
     uint32_t ndi_seq;           /* Sequence number; greater supersedes
                                    lesser. */
     uint32_t ndi_parent_id;     /* Object ID of parent directory inode. */
-    uint8_t reserved8;
+    uint8_t ndi_log_order;      /* log2 of circular log capacity;
+                                   NFFS_LOG_ORDER_NONE if not a log.  Only
+                                   meaningful with NFFS_INODE_LOG_MAGIC;
+                                   older versions left this byte
+                                   uninitialized. */
     uint8_t ndi_filename_len;   /* Length of filename, in bytes. */
     uint16_t ndi_crc16;         /* Covers rest of header and filename. */
     /* Followed by filename. */
@@ -89,6 +108,22 @@ struct nffs_disk_block {
 
 #define NFFS_DISK_BLOCK_OFFSET_CRC  20
 
+/**
+ * On-disk representation of a transaction header.  The header is followed by
+ * the transaction's objects and a commit marker.
+ */
+struct nffs_disk_txn {
+    uint32_t ndt_magic;     /* NFFS_TXN_MAGIC */
+    uint32_t ndt_len;       /* Length of the objects that follow, in bytes. */
+};
+
+/** On-disk representation of a transaction commit marker. */
+struct nffs_disk_commit {
+    uint32_t ndc_magic;     /* NFFS_COMMIT_MAGIC */
+    uint16_t ndc_crc16;     /* Covers transaction header and objects. */
+    uint16_t reserved16;
+};
+
 /**
  * What gets stored in the hash table.  Each entry represents a data block or
  * an inode.
@@ -112,6 +147,7 @@ struct nffs_inode_entry {
         struct nffs_hash_entry *nie_last_block_entry;    /* If file */
     };
     uint8_t nie_refcnt;
+    uint8_t nie_log_order;      /* 0 if not a circular log. */
 };
 
 /** Full inode representation; not stored permanently RAM. */
@@ -122,6 +158,7 @@ struct nffs_inode {
     struct nffs_inode_entry *ni_parent;      /* Points to parent directory. */
     uint8_t ni_filename_len;                 /* # chars in filename. */
     uint8_t ni_filename[NFFS_SHORT_FILENAME_LEN]; /* First 3 bytes. */
+    uint8_t ni_log_order;                    /* 0 if not a circular log. */
 };
 
 /** Full data block representation; not stored permanently RAM. */
@@ -136,11 +173,14 @@ struct nffs_block {
 };
 
 struct nffs_file {
+    SLIST_ENTRY(nffs_file) nf_next;
     struct nffs_inode_entry *nf_inode_entry;
     uint32_t nf_offset;
     uint8_t nf_access_flags;
 };
 
+SLIST_HEAD(nffs_file_list, nffs_file);
+
 struct nffs_area {
     uint32_t na_offset;
     uint32_t na_length;
@@ -156,6 +196,7 @@ struct nffs_disk_object {
     union {
         struct nffs_disk_inode ndo_disk_inode;
         struct nffs_disk_block ndo_disk_block;
+        struct nffs_disk_txn ndo_disk_txn;
     };
 };
 
@@ -167,6 +208,9 @@ struct nffs_seek_info {
 
 #define NFFS_OBJECT_TYPE_INODE   1
 #define NFFS_OBJECT_TYPE_BLOCK   2
+#define NFFS_OBJECT_TYPE_TXN     3  /* Header of a committed transaction. */
+#define NFFS_OBJECT_TYPE_TXN_BAD 4  /* Whole uncommitted transaction. */
+#define NFFS_OBJECT_TYPE_COMMIT  5
 
 #define NFFS_PATH_TOKEN_NONE     0
 #define NFFS_PATH_TOKEN_BRANCH   1
@@ -212,6 +256,8 @@ extern void *nffs_inode_mem;
 extern void *nffs_cache_inode_mem;
 extern void *nffs_cache_block_mem;
 extern void *nffs_dir_mem;
+extern void *nffs_txn_mem;
+extern uint32_t nffs_txn_staged_len;
 extern struct os_mempool nffs_file_pool;
 extern struct os_mempool nffs_dir_pool;
 extern struct os_mempool nffs_inode_entry_pool;
@@ -229,6 +275,13 @@ extern uint16_t nffs_block_max_data_sz;
 #define NFFS_FLASH_BUF_SZ        256
 extern uint8_t nffs_flash_buf[NFFS_FLASH_BUF_SZ];
 
+#define NFFS_SCRATCH_BUF_SZ      NFFS_FLASH_BUF_SZ
+
+extern uint32_t nffs_cache_gen;
+
+/** Every open file handle. */
+extern struct nffs_file_list nffs_file_list;
+
 extern struct nffs_hash_list *nffs_hash;
 extern struct nffs_inode_entry *nffs_root_dir;
 extern struct nffs_inode_entry *nffs_lost_found_dir;
@@ -263,15 +316,21 @@ int nffs_block_from_hash_entry(struct nffs_block *out_block,
                                struct nffs_hash_entry *entry);
 int nffs_block_read_data(const struct nffs_block *block, uint16_t offset,
                          uint16_t length, void *dst);
+int nffs_block_map_data(const struct nffs_block *block, uint16_t offset,
+                        uint16_t length, const void **out_ptr);
 
 /* @cache */
 void nffs_cache_inode_delete(const struct nffs_inode_entry *inode_entry);
+void nffs_cache_inode_delete_blocks(const struct nffs_inode_entry *entry);
 int nffs_cache_inode_ensure(struct nffs_cache_inode **out_entry,
                             struct nffs_inode_entry *inode_entry);
 void nffs_cache_inode_range(const struct nffs_cache_inode *cache_inode,
                             uint32_t *out_start, uint32_t *out_end);
 int nffs_cache_seek(struct nffs_cache_inode *cache_inode, uint32_t to,
                     struct nffs_cache_block **out_cache_block);
+void nffs_cache_inode_expire(struct nffs_cache_inode *cache_inode,
+                             const struct nffs_hash_entry *block_entry,
+                             uint16_t len);
 void nffs_cache_clear(void);
 
 /* @crc */
@@ -301,10 +360,14 @@ int nffs_file_open(struct nffs_file **out_file, const char *filename,
 int nffs_file_seek(struct nffs_file *file, uint32_t offset);
 int nffs_file_read(struct nffs_file *file, uint32_t len, void *out_data,
                    uint32_t *out_len);
+int nffs_file_read_ptr(struct nffs_file *file, uint32_t len,
+                       const void **out_ptr, uint32_t *out_len);
 int nffs_file_close(struct nffs_file *file);
 int nffs_file_new(struct nffs_inode_entry *parent, const char *filename,
-                  uint8_t filename_len, int is_dir,
+                  uint8_t filename_len, int is_dir, uint8_t log_order,
                   struct nffs_inode_entry **out_inode_entry);
+void nffs_file_shift(const struct nffs_inode_entry *inode_entry,
+                     uint32_t len);
 
 /* @format */
 int nffs_format_area(uint8_t area_idx, int is_scratch);
@@ -314,6 +377,9 @@ int nffs_format_full(const struct nffs_area_desc *area_descs);
 /* @gc */
 int nffs_gc(uint8_t *out_area_idx);
 int nffs_gc_until(uint32_t space, uint8_t *out_area_idx);
+void nffs_gc_pin(void);
+int nffs_gc_unpin(void);
+int nffs_gc_pinned(void);
 
 /* @flash */
 struct nffs_area *nffs_flash_find_area(uint16_t logical_id);
@@ -321,6 +387,8 @@ int nffs_flash_read(uint8_t area_idx, uint32_t offset,
                     void *data, uint32_t len);
 int nffs_flash_write(uint8_t area_idx, uint32_t offset,
                      const void *data, uint32_t len);
+int nffs_flash_map(uint8_t area_idx, uint32_t offset, uint32_t len,
+                   const void **out_ptr);
 int nffs_flash_copy(uint8_t area_id_from, uint32_t offset_from,
                     uint8_t area_id_to, uint32_t offset_to,
                     uint32_t len);
@@ -338,6 +406,8 @@ struct nffs_inode_entry *nffs_hash_find_inode(uint32_t id);
 struct nffs_hash_entry *nffs_hash_find_block(uint32_t id);
 void nffs_hash_insert(struct nffs_hash_entry *entry);
 void nffs_hash_remove(struct nffs_hash_entry *entry);
+void nffs_hash_walk_begin(void);
+void nffs_hash_walk_end(void);
 int nffs_hash_init(void);
 
 /* @inode */
@@ -378,6 +448,9 @@ int nffs_inode_filename_cmp_flash(const struct nffs_inode *inode1,
                                   int *result);
 int nffs_inode_read(struct nffs_inode_entry *inode_entry, uint32_t offset,
                     uint32_t len, void *data, uint32_t *out_len);
+int nffs_inode_read_ptr(struct nffs_inode_entry *inode_entry, uint32_t offset,
+                        uint32_t len, const void **out_ptr,
+                        uint32_t *out_len);
 int nffs_inode_seek(struct nffs_inode_entry *inode_entry, uint32_t offset,
                     uint32_t length, struct nffs_seek_info *out_seek_info);
 int nffs_inode_from_entry(struct nffs_inode *out_inode,
@@ -386,9 +459,28 @@ int nffs_inode_unlink_from_ram(struct nffs_inode *inode,
                                struct nffs_hash_entry **out_next);
 int nffs_inode_unlink(struct nffs_inode *inode);
 
+/* @lock */
+int nffs_lock_init(void);
+void nffs_lock_read(void);
+void nffs_unlock_read(void);
+void nffs_lock_write(void);
+void nffs_unlock_write(void);
+int nffs_lock_held_exclusive(void);
+void nffs_lock_cache(void);
+void nffs_unlock_cache(void);
+uint8_t *nffs_scratch_buf(void);
+
+/* @log */
+uint8_t nffs_log_order_from_disk(const struct nffs_disk_inode *disk_inode);
+uint32_t nffs_log_capacity(const struct nffs_inode_entry *inode_entry);
+int nffs_log_find_expired(struct nffs_inode_entry *inode_entry,
+                          struct nffs_hash_entry **out_entry);
+int nffs_log_expire(struct nffs_cache_inode *cache_inode);
+
 /* @misc */
 int nffs_misc_reserve_space(uint16_t space,
                             uint8_t *out_area_idx, uint32_t *out_area_offset);
+int nffs_misc_ensure_space(uint32_t space);
 int nffs_misc_set_num_areas(uint8_t num_areas);
 int nffs_misc_validate_root_dir(void);
 int nffs_misc_validate_scratch(void);
@@ -408,12 +500,31 @@ int nffs_path_unlink(const char *filename);
 int nffs_path_rename(const char *from, const char *to);
 int nffs_path_new_dir(const char *path,
                       struct nffs_inode_entry **out_inode_entry);
+int nffs_path_new_log(const char *path, uint8_t log_order);
 
 /* @restore */
 int nffs_restore_full(const struct nffs_area_desc *area_descs);
+int nffs_restore_disk_object(int area_idx, uint32_t area_offset,
+                             struct nffs_disk_object *out_disk_object);
+int nffs_restore_disk_object_size(const struct nffs_disk_object *disk_object);
+
+/* @txn */
+int nffs_txn_is_active(void);
+int nffs_txn_open(void);
+int nffs_txn_reserve_space(uint16_t space,
+                           uint8_t *out_area_idx, uint32_t *out_area_offset);
+int nffs_txn_ensure_space(uint32_t space);
+int nffs_txn_write(uint8_t area_idx, uint32_t area_offset, const void *data,
+                   uint32_t len);
+const void *nffs_txn_find(uint8_t area_idx, uint32_t area_offset,
+                          uint32_t len);
+int nffs_txn_flush(void);
+int nffs_txn_discard(void);
+void nffs_txn_reset(void);
 
 /* @write */
 int nffs_write_to_file(struct nffs_file *file, const void *data, int len);
+int nffs_write_truncate(struct nffs_file *file, uint32_t len);
 
 
 #define NFFS_HASH_FOREACH(entry, i)                                      \
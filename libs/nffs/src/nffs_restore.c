@@ -76,17 +76,22 @@ nffs_restore_validate_block_chain(struct nffs_hash_entry *last_block_entry)
  * all its children to the lost+found directory.
  *
  * @param inode_entry           The parent inode to test and empty.
+ * @param out_migrated          On success, 1 gets written here if any
+ *                                  children were moved; 0 otherwise.
  *
  * @return                      0 on success; nonzero on failure.
  */
 static int
-nffs_restore_migrate_orphan_children(struct nffs_inode_entry *inode_entry)
+nffs_restore_migrate_orphan_children(struct nffs_inode_entry *inode_entry,
+                                     int *out_migrated)
 {
     struct nffs_inode_entry *lost_found_sub;
     struct nffs_inode_entry *child_entry;
     char buf[32];
     int rc;
 
+    *out_migrated = 0;
+
     if (!nffs_hash_id_is_dir(inode_entry->nie_hash_entry.nhe_id)) {
         /* Not a directory. */
         return 0;
@@ -120,6 +125,8 @@ nffs_restore_migrate_orphan_children(struct nffs_inode_entry *inode_entry)
         }
     }
 
+    *out_migrated = 1;
+
     return 0;
 }
 
@@ -188,16 +195,158 @@ nffs_restore_inode_from_dummy_entry(struct nffs_inode *out_inode,
     out_inode->ni_inode_entry = inode_entry;
 }
 
+/**
+ * Cuts the expired blocks off the start of each circular log.  Expired blocks
+ * remain on disk until their area is garbage collected, and the oldest live
+ * block of a log still refers to them.  Deleting the expired blocks from RAM
+ * ends the chain.  This must happen before anything gets garbage collected,
+ * lest expired blocks be collated with live ones.
+ *
+ * This is also called part way through a restore, when the block pool runs
+ * out.  A log's chain may then be incomplete, but blocks read later can only
+ * be newer than those already seen, so nothing live gets cut.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_restore_expire_logs(void)
+{
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_hash_entry *expired;
+    struct nffs_hash_entry *entry;
+    struct nffs_block block;
+    int rc;
+    int i;
+
+    for (i = 0; i < NFFS_HASH_SIZE; i++) {
+        entry = SLIST_FIRST(nffs_hash + i);
+        while (entry != NULL) {
+            inode_entry = (struct nffs_inode_entry *)entry;
+            if (nffs_hash_id_is_file(entry->nhe_id) &&
+                inode_entry->nie_log_order != 0) {
+
+                rc = nffs_log_find_expired(inode_entry, &expired);
+                if (rc == NFFS_ECORRUPT) {
+                    /* Left for the sweep to delete. */
+                    expired = NULL;
+                } else if (rc != 0) {
+                    return rc;
+                }
+
+                if (expired != NULL) {
+                    while (expired != NULL) {
+                        rc = nffs_block_from_hash_entry(&block, expired);
+                        if (rc != 0) {
+                            return rc;
+                        }
+
+                        nffs_hash_remove(expired);
+                        nffs_block_entry_free(expired);
+                        expired = block.nb_prev;
+                    }
+
+                    /* A removed block may have been the next entry in this
+                     * bucket; start the bucket over.  Logs which have already
+                     * been cut have nothing more to expire.
+                     */
+                    entry = SLIST_FIRST(nffs_hash + i);
+                    continue;
+                }
+            }
+
+            entry = SLIST_NEXT(entry, nhe_next);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Deletes from RAM every data block that is not part of a file's block chain.
+ * Such blocks are left behind when an inode with a broken block chain gets
+ * swept, and by truncation: the blocks cut off the end of a file remain on
+ * disk until their area is garbage collected.
+ *
+ * Reachable blocks are marked in a temporary bitmap indexed by the block
+ * entry's position in its memory pool.  No unreachable block is read from
+ * flash, as garbage collection during the sweep may already have erased it.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_restore_sweep_blocks(void)
+{
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_hash_entry *entry;
+    struct nffs_hash_entry *next;
+    struct nffs_hash_entry *cur;
+    struct nffs_block block;
+    uint8_t *reachable;
+    int idx;
+    int rc;
+    int i;
+
+    reachable = malloc((nffs_config.nc_num_blocks + 7) / 8);
+    if (reachable == NULL) {
+        return NFFS_ENOMEM;
+    }
+    memset(reachable, 0, (nffs_config.nc_num_blocks + 7) / 8);
+
+    NFFS_HASH_FOREACH(entry, i) {
+        if (nffs_hash_id_is_file(entry->nhe_id)) {
+            inode_entry = (struct nffs_inode_entry *)entry;
+            for (cur = inode_entry->nie_last_block_entry;
+                 cur != NULL;
+                 cur = block.nb_prev) {
+
+                rc = nffs_block_from_hash_entry(&block, cur);
+                if (rc != 0) {
+                    goto done;
+                }
+
+                idx = cur - (struct nffs_hash_entry *)nffs_block_entry_mem;
+                reachable[idx / 8] |= 1 << (idx % 8);
+            }
+        }
+    }
+
+    for (i = 0; i < NFFS_HASH_SIZE; i++) {
+        entry = SLIST_FIRST(nffs_hash + i);
+        while (entry != NULL) {
+            next = SLIST_NEXT(entry, nhe_next);
+
+            if (nffs_hash_id_is_block(entry->nhe_id)) {
+                idx = entry - (struct nffs_hash_entry *)nffs_block_entry_mem;
+                if (!(reachable[idx / 8] & (1 << (idx % 8)))) {
+                    nffs_hash_remove(entry);
+                    nffs_block_entry_free(entry);
+                }
+            }
+
+            entry = next;
+        }
+    }
+
+    rc = 0;
+
+done:
+    free(reachable);
+    return rc;
+}
+
 /**
  * Performs a sweep of the RAM representation at the end of a successful
- * restore.  The sweep phase performs the following actions of each inode in
- * the file system:
+ * restore.  First, expired blocks are cut off the start of each circular log.
+ * Then the sweep phase performs the following actions of each inode in the
+ * file system:
  *     1. If the inode is a dummy directory, its children are migrated to the
  *        lost+found directory.
  *     2. Else if the inode is a dummy file, it is fully deleted from RAM.
  *     3. Else, a CRC check is performed on each of the inode's constituent
  *        blocks.  If corruption is detected, the inode is fully deleted from
  *        RAM.
+ * Finally, data blocks which are not part of any remaining file are deleted
+ * from RAM.
  *
  * @return                      0 on success; nonzero on failure.
  */
@@ -209,10 +358,18 @@ nffs_restore_sweep(void)
     struct nffs_hash_entry *next;
     struct nffs_hash_list *list;
     struct nffs_inode inode;
+    int migrated;
     int del;
     int rc;
     int i;
 
+    nffs_hash_walk_begin();
+
+    rc = nffs_restore_expire_logs();
+    if (rc != 0) {
+        goto done;
+    }
+
     /* Iterate through every object in the hash table, deleting all inodes that
      * should be removed.
      */
@@ -229,15 +386,23 @@ nffs_restore_sweep(void)
                  * corrupted.  Move the directory's children inodes to the
                  * lost+found directory.
                  */
-                rc = nffs_restore_migrate_orphan_children(inode_entry);
+                rc = nffs_restore_migrate_orphan_children(inode_entry,
+                                                          &migrated);
                 if (rc != 0) {
-                    return rc;
+                    goto done;
+                }
+                if (migrated) {
+                    /* The migration wrote to flash, possibly triggering a
+                     * garbage collection cycle that freed the next entry.
+                     * Restart this bucket when done with the dummy.
+                     */
+                    next = SLIST_FIRST(list);
                 }
 
                 /* Determine if this inode needs to be deleted. */
                 rc = nffs_restore_should_sweep_inode_entry(inode_entry, &del);
                 if (rc != 0) {
-                    return rc;
+                    goto done;
                 }
 
                 if (del) {
@@ -249,14 +414,14 @@ nffs_restore_sweep(void)
                     } else {
                         rc = nffs_inode_from_entry(&inode, inode_entry);
                         if (rc != 0) {
-                            return rc;
+                            goto done;
                         }
                     }
 
                     /* Remove the inode and all its children from RAM. */
                     rc = nffs_inode_unlink_from_ram(&inode, &next);
                     if (rc != 0) {
-                        return rc;
+                        goto done;
                     }
                     next = SLIST_FIRST(list);
                 }
@@ -266,7 +431,38 @@ nffs_restore_sweep(void)
         }
     }
 
-    return 0;
+    /* Delete blocks that are not part of any file's block chain. */
+    rc = nffs_restore_sweep_blocks();
+    if (rc != 0) {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    nffs_hash_walk_end();
+    return rc;
+}
+
+/**
+ * Ensures that newly created inodes are not assigned the specified ID.  IDs
+ * must not be reused as long as any object referring to them remains on
+ * disk, even if the inode itself has been garbage collected.
+ *
+ * @param id                    An inode ID present on disk.
+ */
+static void
+nffs_restore_reserve_inode_id(uint32_t id)
+{
+    if (nffs_hash_id_is_file(id)) {
+        if (id >= nffs_hash_next_file_id) {
+            nffs_hash_next_file_id = id + 1;
+        }
+    } else {
+        if (id >= nffs_hash_next_dir_id) {
+            nffs_hash_next_dir_id = id + 1;
+        }
+    }
 }
 
 /**
@@ -296,6 +492,7 @@ nffs_restore_dummy_inode(uint32_t id,
     inode_entry->nie_refcnt = 0;
 
     nffs_hash_insert(&inode_entry->nie_hash_entry);
+    nffs_restore_reserve_inode_id(id);
 
     *out_inode_entry = inode_entry;
 
@@ -424,6 +621,7 @@ nffs_restore_inode(const struct nffs_disk_inode *disk_inode, uint8_t area_idx,
 
     if (do_add) {
         inode_entry->nie_refcnt = 1;
+        inode_entry->nie_log_order = nffs_log_order_from_disk(disk_inode);
 
         if (disk_inode->ndi_parent_id != NFFS_ID_NONE) {
             parent = nffs_hash_find_inode(disk_inode->ndi_parent_id);
@@ -447,20 +645,13 @@ nffs_restore_inode(const struct nffs_disk_inode *disk_inode, uint8_t area_idx,
         }
     }
 
-    if (nffs_hash_id_is_file(inode_entry->nie_hash_entry.nhe_id)) {
-        if (inode_entry->nie_hash_entry.nhe_id >= nffs_hash_next_file_id) {
-            nffs_hash_next_file_id = inode_entry->nie_hash_entry.nhe_id + 1;
-        }
-    } else {
-        if (inode_entry->nie_hash_entry.nhe_id >= nffs_hash_next_dir_id) {
-            nffs_hash_next_dir_id = inode_entry->nie_hash_entry.nhe_id + 1;
-        }
-    }
+    nffs_restore_reserve_inode_id(inode_entry->nie_hash_entry.nhe_id);
 
     return 0;
 
 err:
     if (new_inode) {
+        nffs_hash_remove(&inode_entry->nie_hash_entry);
         nffs_inode_entry_free(inode_entry);
     }
     return rc;
@@ -557,6 +748,16 @@ nffs_restore_block(const struct nffs_disk_block *disk_block, uint8_t area_idx,
     }
 
     entry = nffs_block_entry_alloc();
+    if (entry == NULL) {
+        /* Expired log blocks hold on to entries until the sweep; reclaim
+         * them now.
+         */
+        rc = nffs_restore_expire_logs();
+        if (rc != 0) {
+            goto err;
+        }
+        entry = nffs_block_entry_alloc();
+    }
     if (entry == NULL) {
         rc = NFFS_ENOMEM;
         goto err;
@@ -575,8 +776,13 @@ nffs_restore_block(const struct nffs_disk_block *disk_block, uint8_t area_idx,
         }
     }
 
+    /* Block IDs increase along a chain: appended blocks get a fresh ID, while
+     * overwritten and collated blocks keep the ID of the block they replace.
+     * The last block is therefore the one with the greatest ID, regardless of
+     * the order in which the blocks are encountered on disk.
+     */
     if (inode_entry->nie_last_block_entry == NULL ||
-        inode_entry->nie_last_block_entry->nhe_id == disk_block->ndb_prev_id) {
+        inode_entry->nie_last_block_entry->nhe_id < disk_block->ndb_id) {
 
         inode_entry->nie_last_block_entry = entry;
     }
@@ -629,6 +835,13 @@ nffs_restore_object(const struct nffs_disk_object *disk_object)
                                disk_object->ndo_offset);
         break;
 
+    case NFFS_OBJECT_TYPE_TXN:
+    case NFFS_OBJECT_TYPE_TXN_BAD:
+    case NFFS_OBJECT_TYPE_COMMIT:
+        /* Transaction framing; nothing to restore. */
+        rc = 0;
+        break;
+
     default:
         assert(0);
         rc = NFFS_EINVAL;
@@ -639,7 +852,72 @@ nffs_restore_object(const struct nffs_disk_object *disk_object)
 }
 
 /**
- * Reads a single disk object from flash.
+ * Reads a transaction header from flash and determines whether the
+ * transaction was committed.  A transaction is committed if a commit marker
+ * with a matching CRC immediately follows its objects.
+ *
+ * @param area_idx              The area to read the header from.
+ * @param area_offset           The offset within the area to read from.
+ * @param out_disk_object       On success, the header gets written here.  The
+ *                                  object type is NFFS_OBJECT_TYPE_TXN if the
+ *                                  transaction was committed, or
+ *                                  NFFS_OBJECT_TYPE_TXN_BAD if it was not.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_restore_disk_txn(int area_idx, uint32_t area_offset,
+                      struct nffs_disk_object *out_disk_object)
+{
+    struct nffs_disk_commit disk_commit;
+    struct nffs_disk_txn *disk_txn;
+    uint32_t commit_offset;
+    uint16_t crc;
+    int rc;
+
+    disk_txn = &out_disk_object->ndo_disk_txn;
+    out_disk_object->ndo_type = NFFS_OBJECT_TYPE_TXN_BAD;
+
+    rc = nffs_flash_read(area_idx, area_offset, disk_txn, sizeof *disk_txn);
+    if (rc != 0) {
+        return rc;
+    }
+
+    commit_offset = area_offset + sizeof *disk_txn + disk_txn->ndt_len;
+    if (disk_txn->ndt_len >= nffs_areas[area_idx].na_length ||
+        commit_offset + sizeof disk_commit > nffs_areas[area_idx].na_length) {
+
+        /* The header itself is incomplete. */
+        return 0;
+    }
+
+    rc = nffs_flash_read(area_idx, commit_offset, &disk_commit,
+                         sizeof disk_commit);
+    if (rc != 0) {
+        return rc;
+    }
+    if (disk_commit.ndc_magic != NFFS_COMMIT_MAGIC) {
+        return 0;
+    }
+
+    rc = nffs_crc_flash(0, area_idx, area_offset,
+                        sizeof *disk_txn + disk_txn->ndt_len, &crc);
+    if (rc != 0) {
+        return rc;
+    }
+    if (crc != disk_commit.ndc_crc16) {
+        return 0;
+    }
+
+    out_disk_object->ndo_type = NFFS_OBJECT_TYPE_TXN;
+    return 0;
+}
+
+/**
+ * Reads a single disk object from flash.  A transaction header is reported as
+ * an object of its own; if the transaction was not committed, the object
+ * spans the entire transaction, so that scanning past it skips the
+ * uncommitted objects.
  *
  * @param area_idx              The area to read the object from.
  * @param area_offset           The offset within the area to read from.
@@ -648,7 +926,7 @@ nffs_restore_object(const struct nffs_disk_object *disk_object)
  *
  * @return                      0 on success; nonzero on failure.
  */
-static int
+int
 nffs_restore_disk_object(int area_idx, uint32_t area_offset,
                          struct nffs_disk_object *out_disk_object)
 {
@@ -662,6 +940,7 @@ nffs_restore_disk_object(int area_idx, uint32_t area_offset,
 
     switch (magic) {
     case NFFS_INODE_MAGIC:
+    case NFFS_INODE_LOG_MAGIC:
         out_disk_object->ndo_type = NFFS_OBJECT_TYPE_INODE;
         rc = nffs_inode_read_disk(area_idx, area_offset,
                                  &out_disk_object->ndo_disk_inode);
@@ -673,6 +952,15 @@ nffs_restore_disk_object(int area_idx, uint32_t area_offset,
                                  &out_disk_object->ndo_disk_block);
         break;
 
+    case NFFS_TXN_MAGIC:
+        rc = nffs_restore_disk_txn(area_idx, area_offset, out_disk_object);
+        break;
+
+    case NFFS_COMMIT_MAGIC:
+        out_disk_object->ndo_type = NFFS_OBJECT_TYPE_COMMIT;
+        rc = 0;
+        break;
+
     case 0xffffffff:
         rc = NFFS_EEMPTY;
         break;
@@ -692,12 +980,39 @@ nffs_restore_disk_object(int area_idx, uint32_t area_offset,
     return 0;
 }
 
+/**
+ * Calculates the disk space occupied by an uncommitted transaction.  If the
+ * header's length field is unusable, the transaction is assumed to extend to
+ * the end of the area; nothing can have been written after it.
+ */
+static int
+nffs_restore_disk_txn_bad_size(const struct nffs_disk_object *disk_object)
+{
+    uint32_t remaining;
+    uint32_t len;
+
+    remaining = nffs_areas[disk_object->ndo_area_idx].na_length -
+                disk_object->ndo_offset;
+
+    len = disk_object->ndo_disk_txn.ndt_len;
+    if (len >= remaining) {
+        return remaining;
+    }
+
+    len += sizeof (struct nffs_disk_txn) + sizeof (struct nffs_disk_commit);
+    if (len > remaining) {
+        return remaining;
+    }
+
+    return len;
+}
+
 /**
  * Calculates the disk space occupied by the specified disk object.
  *
  * @param disk_object
  */
-static int
+int
 nffs_restore_disk_object_size(const struct nffs_disk_object *disk_object)
 {
     switch (disk_object->ndo_type) {
@@ -709,6 +1024,15 @@ nffs_restore_disk_object_size(const struct nffs_disk_object *disk_object)
         return sizeof disk_object->ndo_disk_block +
                       disk_object->ndo_disk_block.ndb_data_len;
 
+    case NFFS_OBJECT_TYPE_TXN:
+        return sizeof disk_object->ndo_disk_txn;
+
+    case NFFS_OBJECT_TYPE_TXN_BAD:
+        return nffs_restore_disk_txn_bad_size(disk_object);
+
+    case NFFS_OBJECT_TYPE_COMMIT:
+        return sizeof (struct nffs_disk_commit);
+
     default:
         assert(0);
         return 1;
@@ -824,6 +1148,7 @@ nffs_restore_corrupt_scratch(void)
     }
 
     /* Invalidate all objects resident in the bad area. */
+    nffs_hash_walk_begin();
     for (i = 0; i < NFFS_HASH_SIZE; i++) {
         entry = SLIST_FIRST(&nffs_hash[i]);
         while (entry != NULL) {
@@ -835,6 +1160,7 @@ nffs_restore_corrupt_scratch(void)
                 if (nffs_hash_id_is_block(entry->nhe_id)) {
                     rc = nffs_block_delete_from_ram(entry);
                     if (rc != 0) {
+                        nffs_hash_walk_end();
                         return rc;
                     }
                 } else {
@@ -846,6 +1172,7 @@ nffs_restore_corrupt_scratch(void)
             entry = next;
         }
     }
+    nffs_hash_walk_end();
 
     /* Now that the objects in the scratch area have been invalidated, reload
      * everything from the good area.
@@ -865,6 +1192,60 @@ nffs_restore_corrupt_scratch(void)
     return 0;
 }
 
+/**
+ * Indicates whether the specified area header is fully erased.
+ */
+static int
+nffs_restore_area_is_blank(const struct nffs_disk_area *disk_area)
+{
+    const uint8_t *u8p;
+    int i;
+
+    u8p = (const uint8_t *)disk_area;
+    for (i = 0; i < sizeof *disk_area; i++) {
+        if (u8p[i] != 0xff) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Turns a blank area into the scratch area.  A blank area is left behind when
+ * the system resets after a garbage collection cycle has erased its source
+ * area, but before the new scratch header is written.  Every live object in
+ * the source area has already been copied, so nothing is lost.
+ *
+ * @param area_desc             The blank area.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_restore_blank_scratch(const struct nffs_area_desc *area_desc)
+{
+    int area_idx;
+    int rc;
+
+    area_idx = nffs_num_areas;
+    rc = nffs_misc_set_num_areas(nffs_num_areas + 1);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nffs_areas[area_idx].na_offset = area_desc->nad_offset;
+    nffs_areas[area_idx].na_length = area_desc->nad_length;
+    nffs_areas[area_idx].na_gc_seq = 0;
+
+    rc = nffs_format_area(area_idx, 1);
+    if (rc != 0) {
+        return rc;
+    }
+    nffs_scratch_area_idx = area_idx;
+
+    return 0;
+}
+
 /**
  * Searches for a valid nffs file system among the specified areas.  This
  * function succeeds if a file system is detected among any subset of the
@@ -882,6 +1263,7 @@ int
 nffs_restore_full(const struct nffs_area_desc *area_descs)
 {
     struct nffs_disk_area disk_area;
+    int blank_area_idx;
     int cur_area_idx;
     int use_area;
     int rc;
@@ -890,6 +1272,7 @@ nffs_restore_full(const struct nffs_area_desc *area_descs)
     /* Start from a clean state. */
     nffs_misc_reset();
     nffs_restore_largest_block_data_len = 0;
+    blank_area_idx = -1;
 
     /* Read each area from flash. */
     for (i = 0; area_descs[i].nad_length != 0; i++) {
@@ -907,6 +1290,11 @@ nffs_restore_full(const struct nffs_area_desc *area_descs)
 
         case NFFS_ECORRUPT:
             use_area = 0;
+            if (blank_area_idx == -1 &&
+                nffs_restore_area_is_blank(&disk_area)) {
+
+                blank_area_idx = i;
+            }
             break;
 
         default:
@@ -954,6 +1342,14 @@ nffs_restore_full(const struct nffs_area_desc *area_descs)
          * a garbage collection cycle.  Look for a candidate scratch area.
          */
         rc = nffs_restore_corrupt_scratch();
+        if (rc == NFFS_ENOENT && blank_area_idx != -1 &&
+            nffs_root_dir != NULL) {
+
+            /* The cycle completed, but the reset happened before the source
+             * area became the new scratch area.
+             */
+            rc = nffs_restore_blank_scratch(area_descs + blank_area_idx);
+        }
         if (rc != 0) {
             if (rc == NFFS_ENOENT) {
                 rc = NFFS_ECORRUPT;
@@ -983,7 +1379,10 @@ nffs_restore_full(const struct nffs_area_desc *area_descs)
     /* Delete from RAM any objects that were invalidated when subsequent areas
      * were restored.
      */
-    nffs_restore_sweep();
+    rc = nffs_restore_sweep();
+    if (rc != 0) {
+        goto err;
+    }
 
     /* Set the maximum data block size according to the size of the smallest
      * area.
@@ -0,0 +1,357 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Transactions.  While a transaction is open, every object nffs would write
+ * to flash is appended to a RAM buffer instead.  Space for the whole buffer is
+ * reserved in one area when the transaction begins, so each staged object is
+ * assigned the flash location it will eventually occupy, and the RAM
+ * representation is updated exactly as it would be without a transaction.
+ * Reads of a staged object are served from the buffer.
+ *
+ * On commit, the staged objects are written in a single flash write, framed
+ * by a transaction header and a commit marker:
+ *
+ *     [nffs_disk_txn] [object] [object] ... [nffs_disk_commit]
+ *
+ * The commit marker's CRC covers the header and all of the objects.  A group
+ * without a valid commit marker is skipped in its entirety when an area is
+ * scanned, so either all of a transaction's objects are restored or none are.
+ * Once committed, the objects are ordinary objects; garbage collection copies
+ * them individually and drops the framing.
+ *
+ * Since no object is written to flash before commit, aborting a transaction
+ * only requires the RAM representation to be rebuilt from flash.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include "nffs/nffs.h"
+#include "nffs_priv.h"
+#include "crc16.h"
+
+void *nffs_txn_mem;
+
+/**
+ * Bytes of objects staged in the open transaction; 0 if no transaction is
+ * open.  Flash reads check this before looking for staged data, so reads
+ * outside a transaction cost no more than they did before transactions.
+ */
+uint32_t nffs_txn_staged_len;
+
+static struct {
+    uint8_t nt_active;
+    uint8_t nt_area_idx;
+    uint32_t nt_area_offset;    /* Location of the transaction header. */
+} nffs_txn;
+
+#define NFFS_TXN_OBJ_OFF    (sizeof (struct nffs_disk_txn))
+
+static uint32_t
+nffs_txn_total_len(uint32_t obj_len)
+{
+    return sizeof (struct nffs_disk_txn) + obj_len +
+           sizeof (struct nffs_disk_commit);
+}
+
+/**
+ * Indicates whether a transaction is currently open.
+ */
+int
+nffs_txn_is_active(void)
+{
+    return nffs_txn.nt_active;
+}
+
+/**
+ * Opens a transaction.  Space for a full transaction buffer is reserved now;
+ * this may trigger garbage collection.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EINVAL if a transaction is already open;
+ *                              other nonzero on failure.
+ */
+int
+nffs_txn_open(void)
+{
+    uint32_t area_offset;
+    uint32_t total_len;
+    uint8_t area_idx;
+    int rc;
+
+    if (nffs_txn.nt_active) {
+        return NFFS_EINVAL;
+    }
+
+    total_len = nffs_txn_total_len(nffs_config.nc_txn_buf_sz);
+    if (total_len > UINT16_MAX) {
+        return NFFS_EINVAL;
+    }
+
+    rc = nffs_misc_reserve_space(total_len, &area_idx, &area_offset);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nffs_txn.nt_area_idx = area_idx;
+    nffs_txn.nt_area_offset = area_offset;
+    nffs_txn_staged_len = 0;
+    nffs_txn.nt_active = 1;
+
+    return 0;
+}
+
+/**
+ * Reserves space for an object within the open transaction.  This is the
+ * transaction counterpart of nffs_misc_reserve_space().
+ *
+ * @return                      0 on success;
+ *                              NFFS_EFULL if the transaction buffer has
+ *                                  insufficient space.
+ */
+int
+nffs_txn_reserve_space(uint16_t space,
+                       uint8_t *out_area_idx, uint32_t *out_area_offset)
+{
+    assert(nffs_txn.nt_active);
+
+    if (nffs_txn_staged_len + space > nffs_config.nc_txn_buf_sz) {
+        return NFFS_EFULL;
+    }
+
+    *out_area_idx = nffs_txn.nt_area_idx;
+    *out_area_offset = nffs_txn.nt_area_offset + NFFS_TXN_OBJ_OFF +
+                       nffs_txn_staged_len;
+    return 0;
+}
+
+/**
+ * Indicates whether objects totaling the specified number of bytes still fit
+ * in the open transaction.
+ *
+ * @return                      0 if they fit; NFFS_EFULL otherwise.
+ */
+int
+nffs_txn_ensure_space(uint32_t space)
+{
+    assert(nffs_txn.nt_active);
+
+    if (nffs_txn_staged_len + space > nffs_config.nc_txn_buf_sz) {
+        return NFFS_EFULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Appends data to the transaction buffer.  Writes must be strictly
+ * sequential, as they are to flash.
+ *
+ * @return                      0 on success;
+ *                              NFFS_ERANGE if the write does not follow the
+ *                                  staged data, or overflows the buffer.
+ */
+int
+nffs_txn_write(uint8_t area_idx, uint32_t area_offset, const void *data,
+               uint32_t len)
+{
+    uint32_t obj_off;
+
+    assert(nffs_txn.nt_active);
+
+    if (area_idx != nffs_txn.nt_area_idx) {
+        return NFFS_ERANGE;
+    }
+
+    obj_off = area_offset - nffs_txn.nt_area_offset - NFFS_TXN_OBJ_OFF;
+    if (area_offset < nffs_txn.nt_area_offset + NFFS_TXN_OBJ_OFF ||
+        obj_off != nffs_txn_staged_len ||
+        obj_off + len > nffs_config.nc_txn_buf_sz) {
+
+        return NFFS_ERANGE;
+    }
+
+    memcpy((uint8_t *)nffs_txn_mem + NFFS_TXN_OBJ_OFF + obj_off, data, len);
+    nffs_txn_staged_len += len;
+
+    return 0;
+}
+
+/**
+ * Looks up staged data by the flash location it will be written to.
+ *
+ * @return                      A pointer into the transaction buffer if the
+ *                                  specified range has been staged;
+ *                              NULL if it has not, in which case it must be
+ *                                  read from flash.
+ */
+const void *
+nffs_txn_find(uint8_t area_idx, uint32_t area_offset, uint32_t len)
+{
+    uint32_t obj_off;
+
+    if (!nffs_txn.nt_active || area_idx != nffs_txn.nt_area_idx ||
+        area_offset < nffs_txn.nt_area_offset + NFFS_TXN_OBJ_OFF) {
+
+        return NULL;
+    }
+
+    obj_off = area_offset - nffs_txn.nt_area_offset - NFFS_TXN_OBJ_OFF;
+    if (obj_off + len > nffs_txn_staged_len) {
+        return NULL;
+    }
+
+    return (uint8_t *)nffs_txn_mem + NFFS_TXN_OBJ_OFF + obj_off;
+}
+
+/**
+ * Rebuilds the RAM representation from flash, discarding everything that was
+ * staged.
+ */
+static int
+nffs_txn_reload(void)
+{
+    struct nffs_area_desc *area_descs;
+    int rc;
+    int i;
+
+    area_descs = malloc((nffs_num_areas + 1) * sizeof *area_descs);
+    if (area_descs == NULL) {
+        return NFFS_ENOMEM;
+    }
+
+    for (i = 0; i < nffs_num_areas; i++) {
+        area_descs[i].nad_offset = nffs_areas[i].na_offset;
+        area_descs[i].nad_length = nffs_areas[i].na_length;
+    }
+    area_descs[i].nad_length = 0;
+
+    rc = nffs_restore_full(area_descs);
+
+    free(area_descs);
+    return rc;
+}
+
+/**
+ * Indicates whether any file or directory handle is open.  Handles point into
+ * the RAM representation, so it cannot be rebuilt while any are open.
+ */
+static int
+nffs_txn_handles_open(void)
+{
+    return !SLIST_EMPTY(&nffs_file_list) ||
+           nffs_dir_pool.mp_num_free != nffs_dir_pool.mp_num_blocks;
+}
+
+/**
+ * Writes the staged objects to flash as a single group.  On failure, the
+ * transaction is discarded as though it had been aborted.  If a file or
+ * directory is open, the RAM representation cannot be rebuilt; the file system
+ * is marked as uninitialized instead.  Open handles can still be closed, and
+ * nffs_detect() restores the committed state once they are.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EINVAL if no transaction is open;
+ *                              other nonzero on failure.
+ */
+int
+nffs_txn_flush(void)
+{
+    struct nffs_disk_commit disk_commit;
+    struct nffs_disk_txn disk_txn;
+    uint8_t *buf;
+    int reload_rc;
+    int rc;
+
+    if (!nffs_txn.nt_active) {
+        return NFFS_EINVAL;
+    }
+    nffs_txn.nt_active = 0;
+
+    if (nffs_txn_staged_len == 0) {
+        return 0;
+    }
+
+    buf = nffs_txn_mem;
+
+    memset(&disk_txn, 0xff, sizeof disk_txn);
+    disk_txn.ndt_magic = NFFS_TXN_MAGIC;
+    disk_txn.ndt_len = nffs_txn_staged_len;
+    memcpy(buf, &disk_txn, sizeof disk_txn);
+
+    memset(&disk_commit, 0xff, sizeof disk_commit);
+    disk_commit.ndc_magic = NFFS_COMMIT_MAGIC;
+    disk_commit.ndc_crc16 =
+        crc16_ccitt(0, buf, NFFS_TXN_OBJ_OFF + nffs_txn_staged_len);
+    memcpy(buf + NFFS_TXN_OBJ_OFF + nffs_txn_staged_len, &disk_commit,
+           sizeof disk_commit);
+
+    rc = nffs_flash_write(nffs_txn.nt_area_idx, nffs_txn.nt_area_offset, buf,
+                          nffs_txn_total_len(nffs_txn_staged_len));
+    nffs_txn_staged_len = 0;
+    if (rc != 0) {
+        /* RAM still reflects the objects which did not reach flash. */
+        if (nffs_txn_handles_open()) {
+            nffs_root_dir = NULL;
+            return rc;
+        }
+
+        reload_rc = nffs_txn_reload();
+        if (reload_rc != 0) {
+            return reload_rc;
+        }
+        return rc;
+    }
+
+    return 0;
+}
+
+/**
+ * Discards the open transaction.  The RAM representation gets rebuilt from
+ * flash, so no file or directory may be open.
+ *
+ * @return                      0 on success;
+ *                              NFFS_EINVAL if no transaction is open, or if a
+ *                                  file or directory is open;
+ *                              other nonzero on failure.
+ */
+int
+nffs_txn_discard(void)
+{
+    if (!nffs_txn.nt_active) {
+        return NFFS_EINVAL;
+    }
+
+    if (nffs_txn_handles_open()) {
+        return NFFS_EINVAL;
+    }
+
+    nffs_txn.nt_active = 0;
+    nffs_txn_staged_len = 0;
+    return nffs_txn_reload();
+}
+
+/**
+ * Forgets any open transaction; called when the RAM representation is
+ * reset.
+ */
+void
+nffs_txn_reset(void)
+{
+    nffs_txn.nt_active = 0;
+    nffs_txn_staged_len = 0;
+}
@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #include "testutil/testutil.h"
 #include "nffs/nffs.h"
 #include "nffs_priv.h"
@@ -85,21 +86,24 @@ nffs_write_fill_crc16_overwrite(struct nffs_disk_block *disk_block,
  *                                  than the existing block's data length,
  *                                  previous data at the end of the block is
  *                                  retained.
+ * @param dst_area_idx          The area to write the new block to.
+ * @param dst_area_offset       The offset within the area to write the new
+ *                                  block to.  The caller must already have
+ *                                  reserved the space.
  *
  * @return                      0 on success; nonzero on failure.
  */
 static int
 nffs_write_over_block(struct nffs_hash_entry *entry, uint16_t left_copy_len,
-                      const void *new_data, uint16_t new_data_len)
+                      const void *new_data, uint16_t new_data_len,
+                      uint8_t dst_area_idx, uint32_t dst_area_offset)
 {
     struct nffs_disk_block disk_block;
     struct nffs_block block;
     uint32_t src_area_offset;
-    uint32_t dst_area_offset;
     uint16_t right_copy_len;
     uint16_t block_off;
     uint8_t src_area_idx;
-    uint8_t dst_area_idx;
     int rc;
 
     rc = nffs_block_from_hash_entry(&block, entry);
@@ -134,12 +138,6 @@ nffs_write_over_block(struct nffs_hash_entry *entry, uint16_t left_copy_len,
         return rc;
     }
 
-    rc = nffs_misc_reserve_space(sizeof disk_block + disk_block.ndb_data_len,
-                                 &dst_area_idx, &dst_area_offset);
-    if (rc != 0) {
-        return rc;
-    }
-
     block_off = 0;
 
     /* Write the block header. */
@@ -197,7 +195,10 @@ nffs_write_over_block(struct nffs_hash_entry *entry, uint16_t left_copy_len,
 }
 
 /**
- * Appends a new block to an inode block chain.
+ * Appends a new block to an inode block chain.  If the file is empty but still
+ * has a block, that block is the zero-length placeholder left by a truncation
+ * (see nffs_write_truncate()); the new block supersedes it rather than
+ * following it.
  *
  * @param inode_entry           The inode to append a block to.
  * @param data                  The contents of the new block.
@@ -212,39 +213,62 @@ nffs_write_append(struct nffs_cache_inode *cache_inode, const void *data,
     struct nffs_inode_entry *inode_entry;
     struct nffs_hash_entry *entry;
     struct nffs_disk_block disk_block;
+    struct nffs_block block;
     uint32_t area_offset;
     uint8_t area_idx;
     int rc;
 
-    entry = nffs_block_entry_alloc();
-    if (entry == NULL) {
-        return NFFS_ENOMEM;
-    }
-
     inode_entry = cache_inode->nci_inode.ni_inode_entry;
 
     disk_block.ndb_magic = NFFS_BLOCK_MAGIC;
-    disk_block.ndb_id = nffs_hash_next_block_id++;
-    disk_block.ndb_seq = 0;
     disk_block.ndb_inode_id = inode_entry->nie_hash_entry.nhe_id;
-    if (inode_entry->nie_last_block_entry == NULL) {
+    disk_block.ndb_data_len = len;
+
+    if (cache_inode->nci_file_size == 0 &&
+        inode_entry->nie_last_block_entry != NULL) {
+
+        entry = inode_entry->nie_last_block_entry;
+        rc = nffs_block_from_hash_entry(&block, entry);
+        if (rc != 0) {
+            return rc;
+        }
+        assert(block.nb_data_len == 0 && block.nb_prev == NULL);
+
+        disk_block.ndb_id = entry->nhe_id;
+        disk_block.ndb_seq = block.nb_seq + 1;
         disk_block.ndb_prev_id = NFFS_ID_NONE;
     } else {
-        disk_block.ndb_prev_id = inode_entry->nie_last_block_entry->nhe_id;
+        entry = nffs_block_entry_alloc();
+        if (entry == NULL) {
+            return NFFS_ENOMEM;
+        }
+
+        entry->nhe_id = nffs_hash_next_block_id++;
+
+        disk_block.ndb_id = entry->nhe_id;
+        disk_block.ndb_seq = 0;
+        if (inode_entry->nie_last_block_entry == NULL) {
+            disk_block.ndb_prev_id = NFFS_ID_NONE;
+        } else {
+            disk_block.ndb_prev_id =
+                inode_entry->nie_last_block_entry->nhe_id;
+        }
     }
-    disk_block.ndb_data_len = len;
     nffs_crc_disk_block_fill(&disk_block, data);
 
     rc = nffs_block_write_disk(&disk_block, data, &area_idx, &area_offset);
     if (rc != 0) {
+        if (entry != inode_entry->nie_last_block_entry) {
+            nffs_block_entry_free(entry);
+        }
         return rc;
     }
 
-    entry->nhe_id = disk_block.ndb_id;
     entry->nhe_flash_loc = nffs_flash_loc(area_idx, area_offset);
-    nffs_hash_insert(entry);
-
-    inode_entry->nie_last_block_entry = entry;
+    if (entry != inode_entry->nie_last_block_entry) {
+        nffs_hash_insert(entry);
+        inode_entry->nie_last_block_entry = entry;
+    }
 
     /* Update cached inode with the new file size. */
     cache_inode->nci_file_size += len;
@@ -272,12 +296,17 @@ nffs_write_chunk(struct nffs_cache_inode *cache_inode, uint32_t file_offset,
                 const void *data, uint16_t data_len)
 {
     struct nffs_cache_block *cache_block;
+    uint32_t overwrite_len;
     uint32_t append_len;
     uint32_t data_offset;
+    uint32_t area_offset;
     uint32_t block_end;
+    uint32_t cache_gen;
     uint32_t dst_off;
+    uint16_t new_block_len;
     uint16_t chunk_off;
     uint16_t chunk_sz;
+    uint8_t area_idx;
     int rc;
 
     assert(data_len <= nffs_block_max_data_sz);
@@ -296,6 +325,28 @@ nffs_write_chunk(struct nffs_cache_inode *cache_inode, uint32_t file_offset,
 
     if (dst_off > cache_inode->nci_file_size) {
         append_len = dst_off - cache_inode->nci_file_size;
+
+        /* The new data extends the last block.  If that would grow it past
+         * the maximum block size, overwrite the existing data and append the
+         * remainder as a separate block instead.
+         */
+        rc = nffs_cache_seek(cache_inode, cache_inode->nci_file_size - 1,
+                             &cache_block);
+        if (rc != 0) {
+            return rc;
+        }
+        if (dst_off - cache_block->ncb_file_offset > nffs_block_max_data_sz) {
+            overwrite_len = data_len - append_len;
+            rc = nffs_write_chunk(cache_inode, file_offset, data,
+                                  overwrite_len);
+            if (rc != 0) {
+                return rc;
+            }
+
+            return nffs_write_append(cache_inode,
+                                     (const uint8_t *)data + overwrite_len,
+                                     append_len);
+        }
     } else {
         append_len = 0;
     }
@@ -320,19 +371,50 @@ nffs_write_chunk(struct nffs_cache_inode *cache_inode, uint32_t file_offset,
         if (block_end != dst_off) {
             chunk_sz += (int)(dst_off - block_end);
         }
+        if (chunk_off + chunk_sz > cache_block->ncb_block.nb_data_len) {
+            new_block_len = chunk_off + chunk_sz;
+        } else {
+            new_block_len = cache_block->ncb_block.nb_data_len;
+        }
+
+        /* Reserve space for the replacement block before anything is read
+         * from the old one.  If this triggers a garbage collection cycle, the
+         * old block may have been collated with its neighbors, so it gets
+         * looked up again.
+         */
+        cache_gen = nffs_cache_gen;
+        rc = nffs_misc_reserve_space(sizeof (struct nffs_disk_block) +
+                                     new_block_len,
+                                     &area_idx, &area_offset);
+        if (rc != 0) {
+            return rc;
+        }
+        if (nffs_cache_gen != cache_gen) {
+            cache_block = NULL;
+            continue;
+        }
 
         data_offset = cache_block->ncb_file_offset + chunk_off - file_offset;
         rc = nffs_write_over_block(cache_block->ncb_block.nb_hash_entry,
-                                   chunk_off, data + data_offset, chunk_sz);
+                                   chunk_off, data + data_offset, chunk_sz,
+                                   area_idx, area_offset);
         if (rc != 0) {
             return rc;
         }
 
+        /* If the block grew, keep the cached copy and the file size in sync
+         * right away; a later iteration may need to seek again.
+         */
+        if (new_block_len > cache_block->ncb_block.nb_data_len) {
+            cache_inode->nci_file_size +=
+                new_block_len - cache_block->ncb_block.nb_data_len;
+            cache_block->ncb_block.nb_data_len = new_block_len;
+        }
+
         dst_off -= chunk_sz;
         cache_block = TAILQ_PREV(cache_block, nffs_cache_block_list, ncb_link);
     } while (data_offset > 0);
 
-    cache_inode->nci_file_size += append_len;
     return 0;
 }
 
@@ -367,9 +449,12 @@ nffs_write_to_file(struct nffs_file *file, const void *data, int len)
     }
 
     /* The append flag forces all writes to the end of the file, regardless of
-     * seek position.
+     * seek position.  A handle can also be positioned past the end if the file
+     * was truncated through another handle; such a write goes to the end too.
      */
-    if (file->nf_access_flags & NFFS_ACCESS_APPEND) {
+    if (file->nf_access_flags & NFFS_ACCESS_APPEND ||
+        file->nf_offset > cache_inode->nci_file_size) {
+
         file->nf_offset = cache_inode->nci_file_size;
     }
 
@@ -391,6 +476,256 @@ nffs_write_to_file(struct nffs_file *file, const void *data, int len)
         len -= chunk_size;
         data_ptr += chunk_size;
         file->nf_offset += chunk_size;
+
+        /* Expire the oldest blocks of a circular log as soon as they fall
+         * out of it, so that garbage collection never copies them.
+         */
+        if (file->nf_inode_entry->nie_log_order != 0) {
+            rc = nffs_log_expire(cache_inode);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the block that ends a file after a truncation.  The new block
+ * contains the first 'keep_len' bytes of an existing block, and takes that
+ * block's place in the chain.
+ *
+ * @param block                 The block being cut.
+ * @param keep_len              The number of bytes of the block to keep.
+ * @param id                    The ID to give the new block.
+ * @param seq                   The sequence number to give the new block.
+ * @param dst_area_idx          The area to write the new block to.
+ * @param dst_area_offset       The offset within the area to write the new
+ *                                  block to.  The caller must already have
+ *                                  reserved the space.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+nffs_write_cut_block(const struct nffs_block *block, uint16_t keep_len,
+                     uint32_t id, uint32_t seq,
+                     uint8_t dst_area_idx, uint32_t dst_area_offset)
+{
+    struct nffs_disk_block disk_block;
+    uint32_t src_area_offset;
+    uint8_t src_area_idx;
+    int rc;
+
+    assert(keep_len <= block->nb_data_len);
+
+    memset(&disk_block, 0, sizeof disk_block);
+    disk_block.ndb_magic = NFFS_BLOCK_MAGIC;
+    disk_block.ndb_id = id;
+    disk_block.ndb_seq = seq;
+    disk_block.ndb_inode_id = block->nb_inode_entry->nie_hash_entry.nhe_id;
+    if (block->nb_prev == NULL) {
+        disk_block.ndb_prev_id = NFFS_ID_NONE;
+    } else {
+        disk_block.ndb_prev_id = block->nb_prev->nhe_id;
+    }
+    disk_block.ndb_data_len = keep_len;
+
+    nffs_flash_loc_expand(block->nb_hash_entry->nhe_flash_loc,
+                          &src_area_idx, &src_area_offset);
+
+    rc = nffs_write_fill_crc16_overwrite(&disk_block,
+                                         src_area_idx, src_area_offset,
+                                         keep_len, 0, NULL, 0);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = nffs_flash_write(dst_area_idx, dst_area_offset,
+                          &disk_block, sizeof disk_block);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (keep_len > 0) {
+        rc = nffs_flash_copy(src_area_idx,
+                             src_area_offset + sizeof disk_block,
+                             dst_area_idx,
+                             dst_area_offset + sizeof disk_block,
+                             keep_len);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    ASSERT_IF_TEST(nffs_crc_disk_block_validate(&disk_block, dst_area_idx,
+                                                dst_area_offset) == 0);
+
+    return 0;
+}
+
+/**
+ * Truncates a file to the specified length.  Only the end of the block chain
+ * is rewritten:
+ *
+ *     o If the new end of the file falls within the last block, that block
+ *       is superseded by a shorter copy.
+ *     o Otherwise, the block containing the new end of the file is copied
+ *       (up to the new end) into a block with a fresh ID.  As the block with
+ *       the greatest ID, the copy becomes the last block in the chain; the
+ *       blocks that followed it are no longer reachable.  They are deleted
+ *       from RAM now, and from flash when their areas get garbage collected.
+ *
+ * Truncating to zero leaves a zero-length block in place of the first block,
+ * which is superseded by the next append.
+ *
+ * A circular log can only be emptied.  Its oldest live block still refers to
+ * expired blocks on disk, and a shorter log would bring them back to life on
+ * the next restore.  An empty log has no such reference: the first block's
+ * predecessor is always written as none.
+ *
+ * @param file                  The file to truncate.
+ * @param len                   The new length of the file.
+ *
+ * @return                      0 on success;
+ *                              NFFS_ERANGE if the file is shorter than len;
+ *                              NFFS_ENOTSUP if the file is a circular log and
+ *                                  len is neither 0 nor the current length;
+ *                              nonzero on other failure.
+ */
+int
+nffs_write_truncate(struct nffs_file *file, uint32_t len)
+{
+    struct nffs_cache_inode *cache_inode;
+    struct nffs_cache_block *cache_block;
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_hash_entry *new_entry;
+    struct nffs_hash_entry *entry;
+    struct nffs_block block;
+    struct nffs_block cut;
+    uint32_t area_offset;
+    uint32_t cache_gen;
+    uint32_t seq;
+    uint32_t id;
+    uint16_t keep_len;
+    uint8_t area_idx;
+    int rc;
+
+    if (!(file->nf_access_flags & NFFS_ACCESS_WRITE)) {
+        return NFFS_EACCESS;
+    }
+
+    inode_entry = file->nf_inode_entry;
+
+    rc = nffs_cache_inode_ensure(&cache_inode, inode_entry);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (len > cache_inode->nci_file_size) {
+        return NFFS_ERANGE;
+    }
+
+    if (inode_entry->nie_log_order != 0 &&
+        len != 0 && len != cache_inode->nci_file_size) {
+
+        return NFFS_ENOTSUP;
+    }
+
+    if (len < cache_inode->nci_file_size) {
+        /* Find the block containing the last byte to keep (or the first block
+         * if nothing is kept), and reserve space for its replacement.  If
+         * reserving space triggers a garbage collection cycle, the block may
+         * have been collated with its neighbors, so it gets looked up again.
+         */
+        do {
+            if (len == 0) {
+                rc = nffs_cache_seek(cache_inode, 0, &cache_block);
+            } else {
+                rc = nffs_cache_seek(cache_inode, len - 1, &cache_block);
+            }
+            if (rc != 0) {
+                return rc;
+            }
+            keep_len = len - cache_block->ncb_file_offset;
+
+            /* The cached copy of the block may have a stale sequence
+             * number; read the block header again.
+             */
+            rc = nffs_block_from_hash_entry(&cut,
+                                            cache_block->ncb_block.nb_hash_entry);
+            if (rc != 0) {
+                return rc;
+            }
+            if (len == 0) {
+                cut.nb_prev = NULL;
+            }
+
+            cache_gen = nffs_cache_gen;
+            rc = nffs_misc_reserve_space(sizeof (struct nffs_disk_block) +
+                                         keep_len,
+                                         &area_idx, &area_offset);
+            if (rc != 0) {
+                return rc;
+            }
+        } while (nffs_cache_gen != cache_gen);
+
+        if (cut.nb_hash_entry == inode_entry->nie_last_block_entry) {
+            new_entry = cut.nb_hash_entry;
+            id = new_entry->nhe_id;
+            seq = cut.nb_seq + 1;
+        } else {
+            new_entry = nffs_block_entry_alloc();
+            if (new_entry == NULL) {
+                return NFFS_ENOMEM;
+            }
+            new_entry->nhe_id = nffs_hash_next_block_id++;
+            id = new_entry->nhe_id;
+            seq = 0;
+        }
+
+        rc = nffs_write_cut_block(&cut, keep_len, id, seq,
+                                  area_idx, area_offset);
+        if (rc != 0) {
+            if (new_entry != cut.nb_hash_entry) {
+                nffs_block_entry_free(new_entry);
+            }
+            return rc;
+        }
+
+        new_entry->nhe_flash_loc = nffs_flash_loc(area_idx, area_offset);
+
+        if (new_entry != cut.nb_hash_entry) {
+            /* Remove the cut-off blocks from RAM, from the old last block
+             * back to the one that was copied.
+             */
+            entry = inode_entry->nie_last_block_entry;
+            while (entry != NULL) {
+                rc = nffs_block_from_hash_entry(&block, entry);
+                if (rc != 0) {
+                    return rc;
+                }
+
+                nffs_hash_remove(entry);
+                nffs_block_entry_free(entry);
+
+                if (entry == cut.nb_hash_entry) {
+                    entry = NULL;
+                } else {
+                    entry = block.nb_prev;
+                }
+            }
+
+            nffs_hash_insert(new_entry);
+            inode_entry->nie_last_block_entry = new_entry;
+        }
+
+        nffs_cache_inode_delete_blocks(inode_entry);
+        cache_inode->nci_file_size = len;
+    }
+
+    if (file->nf_offset > len) {
+        file->nf_offset = len;
     }
 
     return 0;
@@ -26,7 +26,9 @@
 #include "nffs_test_priv.h"
 #include "../src/nffs_priv.h"
 
+int flash_native_fail_after(int num_ops);
 int flash_native_memset(uint32_t offset, uint8_t c, uint32_t len);
+int flash_native_overwrite(uint32_t address, const void *src, uint32_t length);
 
 static const struct nffs_area_desc nffs_area_descs[] = {
         { 0x00000000, 16 * 1024 },
@@ -283,6 +285,47 @@ nffs_test_util_append_file(const char *filename, const char *contents,
     TEST_ASSERT(rc == 0);
 }
 
+/**
+ * Writes the specified file until the area currently being written to has
+ * exactly the specified number of bytes free, then deletes it.  Only the
+ * file's deletion record is written outside the filled space; it must fit
+ * within the bytes left free.
+ */
+static void
+nffs_test_util_fill_area(const char *filename, const struct nffs_area *area,
+                         uint32_t bytes_left)
+{
+    static char data[1024];
+    struct nffs_file *file;
+    uint32_t avail;
+    uint32_t overhead;
+    int rc;
+
+    overhead = sizeof (struct nffs_disk_block) +
+               sizeof (struct nffs_disk_inode) + bytes_left;
+
+    memset(data, 'f', sizeof data);
+    rc = nffs_open(filename, NFFS_ACCESS_WRITE | NFFS_ACCESS_TRUNCATE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    while (1) {
+        avail = area->na_length - area->na_cur;
+        TEST_ASSERT_FATAL(avail > overhead);
+        if (avail <= sizeof data + overhead) {
+            break;
+        }
+        rc = nffs_write(file, data, sizeof data);
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+    rc = nffs_write(file, data, avail - overhead);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_close(file);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    rc = nffs_unlink(filename);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT_FATAL(area->na_length - area->na_cur == bytes_left);
+}
+
 static void
 nffs_test_copy_area(const struct nffs_area_desc *from,
                    const struct nffs_area_desc *to)
@@ -836,6 +879,63 @@ TEST_CASE(nffs_test_rename)
     nffs_test_assert_system(expected_system, nffs_area_descs);
 }
 
+TEST_CASE(nffs_test_rename_sorted)
+{
+    struct nffs_dirent *dirent;
+    struct nffs_dir *dir;
+    int rc;
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_mkdir("/mydir");
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/mydir/a", "aaaa", 4);
+    nffs_test_util_create_file("/mydir/c", "cccc", 4);
+
+    /* A rename within the same directory must still move the entry to its
+     * sorted position.
+     */
+    rc = nffs_rename("/mydir/a", "/mydir/e");
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_opendir("/mydir", &dir);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_readdir(dir, &dirent);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_ent_name(dirent, "c");
+    rc = nffs_readdir(dir, &dirent);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_ent_name(dirent, "e");
+    rc = nffs_closedir(dir);
+    TEST_ASSERT(rc == 0);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "mydir",
+                .is_dir = 1,
+                .children = (struct nffs_test_file_desc[]) { {
+                    .filename = "c",
+                    .contents = "cccc",
+                    .contents_len = 4,
+                }, {
+                    .filename = "e",
+                    .contents = "aaaa",
+                    .contents_len = 4,
+                }, {
+                    .filename = NULL,
+                } },
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
 TEST_CASE(nffs_test_truncate)
 {
     struct nffs_file *file;
@@ -891,66 +991,58 @@ TEST_CASE(nffs_test_truncate)
     nffs_test_assert_system(expected_system, nffs_area_descs);
 }
 
-TEST_CASE(nffs_test_append)
+TEST_CASE(nffs_test_truncate_unlink_fail)
 {
+    struct nffs_inode_entry *inode_entry;
     struct nffs_file *file;
+    uint32_t flash_offset;
+    uint32_t area_offset;
+    uint8_t area_idx;
+    uint8_t orig;
     int rc;
 
-
     rc = nffs_format(nffs_area_descs);
     TEST_ASSERT(rc == 0);
 
-    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND,
-                   &file);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 0);
-    TEST_ASSERT(nffs_getpos(file) == 0);
+    nffs_test_util_create_file("/myfile.txt", "abcdefgh", 8);
 
-    rc = nffs_write(file, "abcdefgh", 8);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 8);
-    rc = nffs_close(file);
+    /* Make the file's inode record unreadable so that it cannot be
+     * unlinked.
+     */
+    rc = nffs_path_find_inode_entry("/myfile.txt", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                          &area_idx, &area_offset);
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
+    rc = flash_read(flash_offset, &orig, 1);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = flash_native_memset(flash_offset, orig ^ 0xff, 1);
     TEST_ASSERT(rc == 0);
 
-    nffs_test_util_assert_contents("/myfile.txt", "abcdefgh", 8);
-
-    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND,
+    /* Truncating requires unlinking the old file.  If that fails, the open
+     * must fail before a replacement file is written.
+     */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE | NFFS_ACCESS_TRUNCATE,
                    &file);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 8);
+    TEST_ASSERT(rc != 0);
 
-    /* File position should always be at the end of a file after an append.
-     * Seek to the middle prior to writing to test this.
-     */
-    rc = nffs_seek(file, 2);
+    /* Undo the damage and remount; the old file is the only one present. */
+    rc = flash_native_overwrite(flash_offset, &orig, 1);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 2);
 
-    rc = nffs_write(file, "ijklmnop", 8);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 16);
-    TEST_ASSERT(nffs_getpos(file) == 16);
-    rc = nffs_write(file, "qrstuvwx", 8);
+    rc = nffs_misc_reset();
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 24);
-    rc = nffs_close(file);
+    rc = nffs_detect(nffs_area_descs);
     TEST_ASSERT(rc == 0);
 
-    nffs_test_util_assert_contents("/myfile.txt",
-                                  "abcdefghijklmnopqrstuvwx", 24);
-
     struct nffs_test_file_desc *expected_system =
         (struct nffs_test_file_desc[]) { {
             .filename = "",
             .is_dir = 1,
             .children = (struct nffs_test_file_desc[]) { {
                 .filename = "myfile.txt",
-                .contents = "abcdefghijklmnopqrstuvwx",
-                .contents_len = 24,
+                .contents = "abcdefgh",
+                .contents_len = 8,
             }, {
                 .filename = NULL,
             } },
@@ -959,154 +1051,119 @@ TEST_CASE(nffs_test_append)
     nffs_test_assert_system(expected_system, nffs_area_descs);
 }
 
-TEST_CASE(nffs_test_read)
+TEST_CASE(nffs_test_truncate_len)
 {
     struct nffs_file *file;
-    uint8_t buf[16];
+    struct nffs_file *reader;
     uint32_t bytes_read;
+    uint8_t buf[4];
     int rc;
 
+    struct nffs_test_block_desc blocks[4] = { {
+        .data = "abcd",
+        .data_len = 4,
+    }, {
+        .data = "efgh",
+        .data_len = 4,
+    }, {
+        .data = "ijkl",
+        .data_len = 4,
+    }, {
+        .data = "mnop",
+        .data_len = 4,
+    } };
+
     rc = nffs_format(nffs_area_descs);
     TEST_ASSERT(rc == 0);
 
-    nffs_test_util_create_file("/myfile.txt", "1234567890", 10);
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 4);
 
-    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 10);
-    TEST_ASSERT(nffs_getpos(file) == 0);
+    /* Read-only handles cannot truncate. */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &reader);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_truncate(reader, 8);
+    TEST_ASSERT(rc == NFFS_EACCESS);
 
-    rc = nffs_read(file, 4, buf, &bytes_read);
-    TEST_ASSERT(rc == 0);
-    TEST_ASSERT(bytes_read == 4);
-    TEST_ASSERT(memcmp(buf, "1234", 4) == 0);
-    TEST_ASSERT(nffs_getpos(file) == 4);
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
 
-    rc = nffs_read(file, sizeof buf - 4, buf + 4, &bytes_read);
+    /* Cut within the last block. */
+    rc = nffs_truncate(file, 14);
     TEST_ASSERT(rc == 0);
-    TEST_ASSERT(bytes_read == 6);
-    TEST_ASSERT(memcmp(buf, "1234567890", 10) == 0);
-    TEST_ASSERT(nffs_getpos(file) == 10);
+    nffs_test_util_assert_file_len(file, 14);
+    nffs_test_util_assert_contents("/myfile.txt", "abcdefghijklmn", 14);
+    nffs_test_util_assert_block_count("/myfile.txt", 4);
 
-    rc = nffs_close(file);
+    /* Cut within an earlier block; the position is clamped to the new end,
+     * and other handles read nothing past it.
+     */
+    rc = nffs_seek(file, 12);
     TEST_ASSERT(rc == 0);
-}
-
-TEST_CASE(nffs_test_overwrite_one)
-{
-    struct nffs_file *file;
-    int rc;
-
-
-    /*** Setup. */
-    rc = nffs_format(nffs_area_descs);
+    rc = nffs_seek(reader, 12);
     TEST_ASSERT(rc == 0);
-
-    nffs_test_util_append_file("/myfile.txt", "abcdefgh", 8);
-
-    /*** Overwrite within one block (middle). */
-    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    rc = nffs_truncate(file, 6);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 0);
-
-    rc = nffs_seek(file, 3);
+    nffs_test_util_assert_file_len(file, 6);
+    TEST_ASSERT(nffs_getpos(file) == 6);
+    rc = nffs_read(reader, sizeof buf, buf, &bytes_read);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 3);
+    TEST_ASSERT(bytes_read == 0);
+    nffs_test_util_assert_contents("/myfile.txt", "abcdef", 6);
+    nffs_test_util_assert_block_count("/myfile.txt", 2);
 
-    rc = nffs_write(file, "12", 2);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 5);
+    rc = nffs_truncate(file, 8);
+    TEST_ASSERT(rc == NFFS_ERANGE);
+
+    /* The cut-off blocks are still on disk; ensure they don't come back. */
     rc = nffs_close(file);
     TEST_ASSERT(rc == 0);
-
-    nffs_test_util_assert_contents("/myfile.txt", "abc12fgh", 8);
-    nffs_test_util_assert_block_count("/myfile.txt", 1);
-
-    /*** Overwrite within one block (start). */
-    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    rc = nffs_close(reader);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 0);
-
-    rc = nffs_write(file, "xy", 2);
+    rc = nffs_misc_reset();
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 2);
-    rc = nffs_close(file);
+    rc = nffs_detect(nffs_area_descs);
     TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_contents("/myfile.txt", "abcdef", 6);
+    nffs_test_util_assert_block_count("/myfile.txt", 2);
 
-    nffs_test_util_assert_contents("/myfile.txt", "xyc12fgh", 8);
-    nffs_test_util_assert_block_count("/myfile.txt", 1);
-
-    /*** Overwrite within one block (end). */
     rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 0);
-
-    rc = nffs_seek(file, 6);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 6);
+    TEST_ASSERT_FATAL(rc == 0);
 
-    rc = nffs_write(file, "<>", 2);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 8);
-    rc = nffs_close(file);
+    /* Cut at a block boundary. */
+    rc = nffs_truncate(file, 4);
     TEST_ASSERT(rc == 0);
-
-    nffs_test_util_assert_contents("/myfile.txt", "xyc12f<>", 8);
+    nffs_test_util_assert_contents("/myfile.txt", "abcd", 4);
     nffs_test_util_assert_block_count("/myfile.txt", 1);
 
-    /*** Overwrite one block middle, extend. */
-    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 0);
-
     rc = nffs_seek(file, 4);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 8);
-    TEST_ASSERT(nffs_getpos(file) == 4);
-
-    rc = nffs_write(file, "abcdefgh", 8);
-    TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 12);
-    TEST_ASSERT(nffs_getpos(file) == 12);
-    rc = nffs_close(file);
+    rc = nffs_write(file, "XY", 2);
     TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_contents("/myfile.txt", "abcdXY", 6);
+    nffs_test_util_assert_block_count("/myfile.txt", 2);
 
-    nffs_test_util_assert_contents("/myfile.txt", "xyc1abcdefgh", 12);
-    nffs_test_util_assert_block_count("/myfile.txt", 1);
-
-    /*** Overwrite one block start, extend. */
-    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    /* Truncate to zero, then append. */
+    rc = nffs_truncate(file, 0);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 12);
-    TEST_ASSERT(nffs_getpos(file) == 0);
+    nffs_test_util_assert_file_len(file, 0);
+    nffs_test_util_assert_contents("/myfile.txt", "", 0);
 
-    rc = nffs_write(file, "abcdefghijklmnop", 16);
+    rc = nffs_write(file, "123", 3);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 16);
-    TEST_ASSERT(nffs_getpos(file) == 16);
+    nffs_test_util_assert_contents("/myfile.txt", "123", 3);
+    nffs_test_util_assert_block_count("/myfile.txt", 1);
+
     rc = nffs_close(file);
     TEST_ASSERT(rc == 0);
 
-    nffs_test_util_assert_contents("/myfile.txt", "abcdefghijklmnop", 16);
-    nffs_test_util_assert_block_count("/myfile.txt", 1);
-
     struct nffs_test_file_desc *expected_system =
         (struct nffs_test_file_desc[]) { {
             .filename = "",
             .is_dir = 1,
             .children = (struct nffs_test_file_desc[]) { {
                 .filename = "myfile.txt",
-                .contents = "abcdefghijklmnop",
-                .contents_len = 16,
+                .contents = "123",
+                .contents_len = 3,
             }, {
                 .filename = NULL,
             } },
@@ -1115,16 +1172,781 @@ TEST_CASE(nffs_test_overwrite_one)
     nffs_test_assert_system(expected_system, nffs_area_descs);
 }
 
-TEST_CASE(nffs_test_overwrite_two)
+TEST_CASE(nffs_test_log)
 {
-    struct nffs_test_block_desc *blocks = (struct nffs_test_block_desc[]) { {
-        .data = "abcdefgh",
-        .data_len = 8,
-    }, {
-        .data = "ijklmnop",
-        .data_len = 8,
-    } };
-
+    struct nffs_file *file;
+    struct nffs_file *reader1;
+    struct nffs_file *reader2;
+    uint32_t bytes_read;
+    char expected[200];
+    char small[257];
+    char rec[100];
+    char buf[4];
+    int rc;
+    int i;
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_mklog("/log", 300);
+    TEST_ASSERT(rc == NFFS_EINVAL);
+    rc = nffs_mklog("/log", 128);
+    TEST_ASSERT(rc == NFFS_EINVAL);
+    rc = nffs_mklog("/log", 256);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_mklog("/log", 256);
+    TEST_ASSERT(rc == NFFS_EEXIST);
+
+    rc = nffs_open("/log", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    /* Two 100-byte records fit; the third pushes out the first. */
+    for (i = 0; i < 2; i++) {
+        memset(rec, 'a' + i, sizeof rec);
+        rc = nffs_write(file, rec, sizeof rec);
+        TEST_ASSERT(rc == 0);
+    }
+    nffs_test_util_assert_file_len(file, 200);
+
+    /* One reader in the record about to expire, one in the next. */
+    rc = nffs_open("/log", NFFS_ACCESS_READ, &reader1);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_seek(reader1, 50);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_open("/log", NFFS_ACCESS_READ, &reader2);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_seek(reader2, 150);
+    TEST_ASSERT(rc == 0);
+
+    memset(rec, 'c', sizeof rec);
+    rc = nffs_write(file, rec, sizeof rec);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 200);
+    TEST_ASSERT(nffs_getpos(file) == 200);
+
+    memset(expected, 'b', 100);
+    memset(expected + 100, 'c', 100);
+    nffs_test_util_assert_contents("/log", expected, 200);
+    nffs_test_util_assert_block_count("/log", 2);
+
+    TEST_ASSERT(nffs_getpos(reader1) == 0);
+    TEST_ASSERT(nffs_getpos(reader2) == 50);
+    rc = nffs_read(reader1, 1, buf, &bytes_read);
+    TEST_ASSERT(rc == 0 && bytes_read == 1 && buf[0] == 'b');
+    rc = nffs_read(reader2, 1, buf, &bytes_read);
+    TEST_ASSERT(rc == 0 && bytes_read == 1 && buf[0] == 'b');
+
+    rc = nffs_close(reader1);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_close(reader2);
+    TEST_ASSERT(rc == 0);
+
+    for (i = 3; i < 10; i++) {
+        memset(rec, 'a' + i, sizeof rec);
+        rc = nffs_write(file, rec, sizeof rec);
+        TEST_ASSERT(rc == 0);
+        nffs_test_util_assert_file_len(file, 200);
+    }
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    /* The expired records are still on disk; ensure they don't come back. */
+    memset(expected, 'i', 100);
+    memset(expected + 100, 'j', 100);
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_contents("/log", expected, 200);
+    nffs_test_util_assert_block_count("/log", 2);
+
+    /* A log can be emptied, but not otherwise shortened. */
+    rc = nffs_open("/log", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_truncate(file, 100);
+    TEST_ASSERT(rc == NFFS_ENOTSUP);
+    rc = nffs_truncate(file, 0);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_contents("/log", "", 0);
+
+    /* Renaming and reopening with truncation keep the file a log. */
+    rc = nffs_rename("/log", "/log2");
+    TEST_ASSERT(rc == 0);
+    rc = nffs_open("/log2", NFFS_ACCESS_WRITE | NFFS_ACCESS_TRUNCATE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    for (i = 0; i < 3; i++) {
+        memset(rec, 'x' + i, sizeof rec);
+        rc = nffs_write(file, rec, sizeof rec);
+        TEST_ASSERT(rc == 0);
+    }
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    /* Many small records, with garbage collection in between.  Records are
+     * not collated, so they keep expiring one at a time.
+     */
+    rc = nffs_mklog("/small", 256);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_open("/small", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    for (i = 0; i < 100; i++) {
+        if (i % 40 == 39) {
+            rc = nffs_gc(NULL);
+            TEST_ASSERT(rc == 0);
+        }
+        sprintf(rec, "rec%04d", i);
+        rc = nffs_write(file, rec, 8);
+        TEST_ASSERT(rc == 0);
+        nffs_test_util_assert_file_len(file, i < 32 ? (i + 1) * 8 : 256);
+    }
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    for (i = 0; i < 32; i++) {
+        sprintf(small + i * 8, "rec%04d", 68 + i);
+    }
+
+    memset(expected, 'y', 100);
+    memset(expected + 100, 'z', 100);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "log2",
+                .contents = expected,
+                .contents_len = 200,
+            }, {
+                .filename = "small",
+                .contents = small,
+                .contents_len = 256,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_log_legacy_inode)
+{
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_disk_inode disk_inode;
+    uint32_t area_offset;
+    uint8_t area_idx;
+    char filename[NFFS_FILENAME_MAX_LEN];
+    char expected[603];
+    char data[600];
+    int rc;
+    int i;
+
+    struct nffs_test_block_desc blocks[3];
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    for (i = 0; i < sizeof data; i++) {
+        data[i] = i;
+    }
+    for (i = 0; i < 3; i++) {
+        blocks[i].data = data + i * 200;
+        blocks[i].data_len = 200;
+    }
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
+
+    rc = nffs_rename("/myfile.txt", "/renamed.txt");
+    TEST_ASSERT(rc == 0);
+
+    /* Older versions of nffs left the log order byte of a renamed inode
+     * uninitialized.  Rewrite the inode as such a version could have, with a
+     * value that would be a valid log order.
+     */
+    rc = nffs_path_find_inode_entry("/renamed.txt", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                          &area_idx, &area_offset);
+    rc = nffs_inode_read_disk(area_idx, area_offset, &disk_inode);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT(disk_inode.ndi_magic == NFFS_INODE_MAGIC);
+    rc = nffs_flash_read(area_idx, area_offset + sizeof disk_inode, filename,
+                         disk_inode.ndi_filename_len);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    disk_inode.ndi_log_order = 0x08;
+    nffs_crc_disk_inode_fill(&disk_inode, filename);
+    rc = flash_native_overwrite(nffs_areas[area_idx].na_offset + area_offset,
+                                &disk_inode, sizeof disk_inode);
+    TEST_ASSERT(rc == 0);
+
+    /* The file is restored as a regular file; nothing is cut. */
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_path_find_inode_entry("/renamed.txt", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT(inode_entry->nie_log_order == 0);
+    nffs_test_util_assert_contents("/renamed.txt", data, sizeof data);
+
+    nffs_test_util_append_file("/renamed.txt", "abc", 3);
+    rc = nffs_gc(NULL);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_path_find_inode_entry("/renamed.txt", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT(inode_entry->nie_log_order == 0);
+    memcpy(expected, data, sizeof data);
+    memcpy(expected + sizeof data, "abc", 3);
+    nffs_test_util_assert_contents("/renamed.txt", expected, sizeof expected);
+}
+
+TEST_CASE(nffs_test_txn)
+{
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_file *file2;
+    struct nffs_file *file;
+    uint32_t flash_offset;
+    uint32_t area_offset;
+    uint8_t area_idx;
+    char big[600];
+    int rc;
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_create_file("/cfg", "old", 3);
+
+    rc = nffs_txn_commit();
+    TEST_ASSERT(rc == NFFS_EINVAL);
+    rc = nffs_txn_abort();
+    TEST_ASSERT(rc == NFFS_EINVAL);
+
+    /*** Replace a file via a temporary; changes are visible immediately. */
+    rc = nffs_txn_begin();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_txn_begin();
+    TEST_ASSERT(rc == NFFS_EINVAL);
+
+    nffs_test_util_create_file("/cfg.tmp", "new", 3);
+    rc = nffs_rename("/cfg.tmp", "/cfg");
+    TEST_ASSERT(rc == 0);
+    rc = nffs_mkdir("/dir");
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_contents("/cfg", "new", 3);
+
+    rc = nffs_txn_commit();
+    TEST_ASSERT(rc == 0);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "cfg",
+                .contents = "new",
+                .contents_len = 3,
+            }, {
+                .filename = "dir",
+                .is_dir = 1,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+
+    /*** Reset before commit; nothing was written. */
+    rc = nffs_txn_begin();
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/cfg.tmp", "bad", 3);
+    rc = nffs_rename("/cfg.tmp", "/cfg");
+    TEST_ASSERT(rc == 0);
+    rc = nffs_unlink("/dir");
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+    nffs_test_assert_system_once(expected_system);
+
+    /*** Corrupt a committed transaction; all of it gets discarded. */
+    rc = nffs_txn_begin();
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/cfg.tmp", "bad", 3);
+    rc = nffs_rename("/cfg.tmp", "/cfg");
+    TEST_ASSERT(rc == 0);
+    rc = nffs_unlink("/dir");
+    TEST_ASSERT(rc == 0);
+    rc = nffs_txn_commit();
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_path_find_inode_entry("/cfg", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                         &area_idx, &area_offset);
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
+    rc = flash_native_memset(flash_offset + 10, 0xff, 1);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+    nffs_test_assert_system_once(expected_system);
+
+    /*** Overflow the transaction, then abort. */
+    rc = nffs_txn_begin();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_open("/big", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    memset(big, 'x', sizeof big);
+    rc = nffs_write(file, big, sizeof big);
+    TEST_ASSERT(rc == NFFS_EFULL);
+
+    rc = nffs_txn_abort();
+    TEST_ASSERT(rc == NFFS_EINVAL);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_txn_abort();
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+
+    /*** Fail the commit write; the staged changes are discarded. */
+    rc = nffs_txn_begin();
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/cfg", "bad", 3);
+
+    flash_native_fail_after(0);
+    rc = nffs_txn_commit();
+    TEST_ASSERT(rc != 0);
+    TEST_ASSERT(flash_native_fail_after(-1) > 0);
+
+    TEST_ASSERT(nffs_ready());
+    nffs_test_assert_system_once(expected_system);
+
+    /*** Fail the commit write with a file open.  The RAM representation
+     * cannot be rebuilt under the open handle, so the file system must be
+     * detected again.
+     */
+    rc = nffs_txn_begin();
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/cfg", "bad", 3);
+    rc = nffs_open("/cfg", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    flash_native_fail_after(0);
+    rc = nffs_txn_commit();
+    TEST_ASSERT(rc != 0);
+    TEST_ASSERT(flash_native_fail_after(-1) > 0);
+
+    TEST_ASSERT(!nffs_ready());
+    rc = nffs_read(file, 1, big, NULL);
+    TEST_ASSERT(rc == NFFS_EUNINIT);
+    rc = nffs_open("/cfg", NFFS_ACCESS_READ, &file2);
+    TEST_ASSERT(rc == NFFS_EUNINIT);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+    nffs_test_assert_system_once(expected_system);
+}
+
+TEST_CASE(nffs_test_append)
+{
+    struct nffs_file *file;
+    int rc;
+
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND,
+                   &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 0);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_write(file, "abcdefgh", 8);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 8);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents("/myfile.txt", "abcdefgh", 8);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND,
+                   &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 8);
+
+    /* File position should always be at the end of a file after an append.
+     * Seek to the middle prior to writing to test this.
+     */
+    rc = nffs_seek(file, 2);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 2);
+
+    rc = nffs_write(file, "ijklmnop", 8);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 16);
+    TEST_ASSERT(nffs_getpos(file) == 16);
+    rc = nffs_write(file, "qrstuvwx", 8);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 24);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents("/myfile.txt",
+                                  "abcdefghijklmnopqrstuvwx", 24);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "myfile.txt",
+                .contents = "abcdefghijklmnopqrstuvwx",
+                .contents_len = 24,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_read)
+{
+    struct nffs_file *file;
+    uint8_t buf[16];
+    uint32_t bytes_read;
+    int rc;
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_create_file("/myfile.txt", "1234567890", 10);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 10);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_read(file, 4, buf, &bytes_read);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(bytes_read == 4);
+    TEST_ASSERT(memcmp(buf, "1234", 4) == 0);
+    TEST_ASSERT(nffs_getpos(file) == 4);
+
+    rc = nffs_read(file, sizeof buf - 4, buf + 4, &bytes_read);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(bytes_read == 6);
+    TEST_ASSERT(memcmp(buf, "1234567890", 10) == 0);
+    TEST_ASSERT(nffs_getpos(file) == 10);
+
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+}
+
+TEST_CASE(nffs_test_read_ptr)
+{
+    static char data[NFFS_BLOCK_MAX_DATA_SZ_MAX * 3 + 100];
+    static char buf[sizeof data];
+    struct nffs_file *file;
+    const void *ptr;
+    uint32_t bytes_read;
+    uint32_t off;
+    int rc;
+    int i;
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    for (i = 0; i < sizeof data; i++) {
+        data[i] = i;
+    }
+    nffs_test_util_create_file("/myfile.txt", data, sizeof data);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == 0);
+
+    /* Iterate through the file; each chunk is confined to one data block. */
+    off = 0;
+    while (1) {
+        rc = nffs_read_ptr(file, 1000, &ptr, &bytes_read);
+        TEST_ASSERT_FATAL(rc == 0);
+        if (bytes_read == 0) {
+            break;
+        }
+
+        TEST_ASSERT(bytes_read <= 1000);
+        TEST_ASSERT(off / nffs_block_max_data_sz ==
+                    (off + bytes_read - 1) / nffs_block_max_data_sz);
+        TEST_ASSERT_FATAL(off + bytes_read <= sizeof buf);
+        memcpy(buf + off, ptr, bytes_read);
+        off += bytes_read;
+        TEST_ASSERT(nffs_getpos(file) == off);
+
+        rc = nffs_read_ptr_release(ptr);
+        TEST_ASSERT(rc == 0);
+    }
+    TEST_ASSERT(ptr == NULL);
+
+    TEST_ASSERT(off == sizeof data);
+    TEST_ASSERT(memcmp(buf, data, sizeof data) == 0);
+
+    /* Seek into the middle of a block. */
+    rc = nffs_seek(file, nffs_block_max_data_sz + 5);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_read_ptr(file, sizeof data, &ptr, &bytes_read);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(bytes_read == nffs_block_max_data_sz - 5);
+    TEST_ASSERT(memcmp(ptr, data + nffs_block_max_data_sz + 5,
+                       bytes_read) == 0);
+    rc = nffs_read_ptr_release(ptr);
+    TEST_ASSERT(rc == 0);
+
+    /* Every pointer has been released. */
+    rc = nffs_read_ptr_release(data);
+    TEST_ASSERT(rc == NFFS_EINVAL);
+
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    /* Write-only handles cannot be read. */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_read_ptr(file, 1, &ptr, &bytes_read);
+    TEST_ASSERT(rc == NFFS_EACCESS);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+}
+
+TEST_CASE(nffs_test_read_ptr_gc)
+{
+    static const struct nffs_area_desc area_descs_two[] = {
+        { 0x00020000, 128 * 1024 },
+        { 0x00040000, 128 * 1024 },
+        { 0, 0 },
+    };
+
+    static const char data[] = "abcdefghijklmnopqrstuvwxyz";
+    struct nffs_file *file;
+    const void *ptr;
+    uint32_t bytes_read;
+    uint8_t scratch_area_idx;
+    int rc;
+
+    rc = nffs_format(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_create_file("/myfile.txt", data, sizeof data);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_read_ptr(file, sizeof data, &ptr, &bytes_read);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT_FATAL(bytes_read == sizeof data);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    /* Replace the file and attempt a gc cycle while the pointer is held.  The
+     * only candidate area holds the mapped data, so nothing is erased.
+     */
+    rc = nffs_unlink("/myfile.txt");
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/myfile.txt", "12345", 5);
+
+    scratch_area_idx = nffs_scratch_area_idx;
+    rc = nffs_gc(NULL);
+    TEST_ASSERT(rc == NFFS_EBUSY);
+    TEST_ASSERT(nffs_scratch_area_idx == scratch_area_idx);
+    TEST_ASSERT(memcmp(ptr, data, sizeof data) == 0);
+
+    rc = nffs_format(area_descs_two);
+    TEST_ASSERT(rc == NFFS_EBUSY);
+    TEST_ASSERT(memcmp(ptr, data, sizeof data) == 0);
+
+    /* Once the pointer is released, the area can be collected. */
+    rc = nffs_read_ptr_release(ptr);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_gc(NULL);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(nffs_scratch_area_idx != scratch_area_idx);
+    nffs_test_util_assert_contents("/myfile.txt", "12345", 5);
+
+    /* Data staged in an open transaction cannot be mapped. */
+    rc = nffs_txn_begin();
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_test_util_create_file("/staged.txt", data, sizeof data);
+    rc = nffs_open("/staged.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_read_ptr(file, sizeof data, &ptr, &bytes_read);
+    TEST_ASSERT(rc == NFFS_ENOTSUP);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_txn_commit();
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_read_ptr_release(ptr);
+    TEST_ASSERT(rc == NFFS_EINVAL);
+}
+
+TEST_CASE(nffs_test_overwrite_one)
+{
+    struct nffs_file *file;
+    int rc;
+
+
+    /*** Setup. */
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_append_file("/myfile.txt", "abcdefgh", 8);
+
+    /*** Overwrite within one block (middle). */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_seek(file, 3);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 3);
+
+    rc = nffs_write(file, "12", 2);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 5);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents("/myfile.txt", "abc12fgh", 8);
+    nffs_test_util_assert_block_count("/myfile.txt", 1);
+
+    /*** Overwrite within one block (start). */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_write(file, "xy", 2);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 2);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents("/myfile.txt", "xyc12fgh", 8);
+    nffs_test_util_assert_block_count("/myfile.txt", 1);
+
+    /*** Overwrite within one block (end). */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_seek(file, 6);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 6);
+
+    rc = nffs_write(file, "<>", 2);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 8);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents("/myfile.txt", "xyc12f<>", 8);
+    nffs_test_util_assert_block_count("/myfile.txt", 1);
+
+    /*** Overwrite one block middle, extend. */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_seek(file, 4);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 8);
+    TEST_ASSERT(nffs_getpos(file) == 4);
+
+    rc = nffs_write(file, "abcdefgh", 8);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 12);
+    TEST_ASSERT(nffs_getpos(file) == 12);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents("/myfile.txt", "xyc1abcdefgh", 12);
+    nffs_test_util_assert_block_count("/myfile.txt", 1);
+
+    /*** Overwrite one block start, extend. */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 12);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_write(file, "abcdefghijklmnop", 16);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 16);
+    TEST_ASSERT(nffs_getpos(file) == 16);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents("/myfile.txt", "abcdefghijklmnop", 16);
+    nffs_test_util_assert_block_count("/myfile.txt", 1);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "myfile.txt",
+                .contents = "abcdefghijklmnop",
+                .contents_len = 16,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_overwrite_two)
+{
+    struct nffs_test_block_desc *blocks = (struct nffs_test_block_desc[]) { {
+        .data = "abcdefgh",
+        .data_len = 8,
+    }, {
+        .data = "ijklmnop",
+        .data_len = 8,
+    } };
+
     struct nffs_file *file;
     int rc;
 
@@ -1366,24 +2188,176 @@ TEST_CASE(nffs_test_overwrite_three)
                                    "abcdef1234567890!@#$%^&*()", 26);
     nffs_test_util_assert_block_count("/myfile.txt", 3);
 
-    /*** Overwrite three blocks start, extend. */
-    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
+    /*** Overwrite three blocks start, extend. */
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_write(file, "1234567890!@#$%^&*()abcdefghij", 30);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 30);
+    TEST_ASSERT(nffs_getpos(file) == 30);
+
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents( "/myfile.txt",
+                                   "1234567890!@#$%^&*()abcdefghij", 30);
+    nffs_test_util_assert_block_count("/myfile.txt", 3);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "myfile.txt",
+                .contents = "1234567890!@#$%^&*()abcdefghij",
+                .contents_len = 30,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_overwrite_many)
+{
+    struct nffs_test_block_desc *blocks = (struct nffs_test_block_desc[]) { {
+        .data = "abcdefgh",
+        .data_len = 8,
+    }, {
+        .data = "ijklmnop",
+        .data_len = 8,
+    }, {
+        .data = "qrstuvwx",
+        .data_len = 8,
+    } };
+
+    struct nffs_file *file;
+    int rc;
+
+
+    /*** Setup. */
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    /*** Overwrite middle of first block. */
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_seek(file, 3);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 3);
+
+    rc = nffs_write(file, "12", 2);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 5);
+
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents( "/myfile.txt",
+                                   "abc12fghijklmnopqrstuvwx", 24);
+    nffs_test_util_assert_block_count("/myfile.txt", 3);
+
+    /*** Overwrite end of first block, start of second. */
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 0);
+
+    rc = nffs_seek(file, 6);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 6);
+
+    rc = nffs_write(file, "1234", 4);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, 24);
+    TEST_ASSERT(nffs_getpos(file) == 10);
+
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_contents( "/myfile.txt",
+                                   "abcdef1234klmnopqrstuvwx", 24);
+    nffs_test_util_assert_block_count("/myfile.txt", 3);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "myfile.txt",
+                .contents = "abcdef1234klmnopqrstuvwx",
+                .contents_len = 24,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_overwrite_split)
+{
+    static char contents[NFFS_BLOCK_MAX_DATA_SZ_MAX + 8];
+    struct nffs_file *file;
+    uint32_t len;
+    int rc;
+
+    /*** Setup. */
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    len = nffs_block_max_data_sz;
+    memset(contents, 'x', len);
+    nffs_test_util_create_file("/myfile.txt", contents, len);
+    nffs_test_util_assert_block_count("/myfile.txt", 1);
+
+    /*** Overwrite the end of a full block and extend the file; the block
+     * cannot grow, so the remainder goes into a new block.
+     */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_seek(file, len - 4);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_write(file, "12345678", 8);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, len + 4);
+    TEST_ASSERT(nffs_getpos(file) == len + 4);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    memcpy(contents + len - 4, "12345678", 8);
+    len += 4;
+    nffs_test_util_assert_contents("/myfile.txt", contents, len);
+    nffs_test_util_assert_block_count("/myfile.txt", 2);
+
+    /*** Overwrite two blocks and grow the last one. */
     rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 0);
-
-    rc = nffs_write(file, "1234567890!@#$%^&*()abcdefghij", 30);
+    rc = nffs_seek(file, len - 6);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 30);
-    TEST_ASSERT(nffs_getpos(file) == 30);
-
+    rc = nffs_write(file, "abcdefgh", 8);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_file_len(file, len + 2);
     rc = nffs_close(file);
     TEST_ASSERT(rc == 0);
 
-    nffs_test_util_assert_contents( "/myfile.txt",
-                                   "1234567890!@#$%^&*()abcdefghij", 30);
-    nffs_test_util_assert_block_count("/myfile.txt", 3);
+    memcpy(contents + len - 6, "abcdefgh", 8);
+    len += 2;
+    nffs_test_util_assert_contents("/myfile.txt", contents, len);
+    nffs_test_util_assert_block_count("/myfile.txt", 2);
 
     struct nffs_test_file_desc *expected_system =
         (struct nffs_test_file_desc[]) { {
@@ -1391,8 +2365,8 @@ TEST_CASE(nffs_test_overwrite_three)
             .is_dir = 1,
             .children = (struct nffs_test_file_desc[]) { {
                 .filename = "myfile.txt",
-                .contents = "1234567890!@#$%^&*()abcdefghij",
-                .contents_len = 30,
+                .contents = contents,
+                .contents_len = len,
             }, {
                 .filename = NULL,
             } },
@@ -1401,74 +2375,75 @@ TEST_CASE(nffs_test_overwrite_three)
     nffs_test_assert_system(expected_system, nffs_area_descs);
 }
 
-TEST_CASE(nffs_test_overwrite_many)
+TEST_CASE(nffs_test_overwrite_gc)
 {
+    const struct nffs_area *area;
+    struct nffs_file *file;
+    int rc;
+
+    static const struct nffs_area_desc area_descs_two[] = {
+        { 0x00000000, 16 * 1024 },
+        { 0x00004000, 16 * 1024 },
+        { 0, 0 },
+    };
+
     struct nffs_test_block_desc *blocks = (struct nffs_test_block_desc[]) { {
-        .data = "abcdefgh",
-        .data_len = 8,
+        .data = "11",
+        .data_len = 2,
     }, {
-        .data = "ijklmnop",
-        .data_len = 8,
+        .data = "22",
+        .data_len = 2,
     }, {
-        .data = "qrstuvwx",
-        .data_len = 8,
+        .data = "33",
+        .data_len = 2,
     } };
 
-    struct nffs_file *file;
-    int rc;
-
-
     /*** Setup. */
-    rc = nffs_format(nffs_area_descs);
+    rc = nffs_format(area_descs_two);
     TEST_ASSERT(rc == 0);
+    TEST_ASSERT_FATAL(nffs_scratch_area_idx == 0);
+    area = nffs_areas + 1;
 
-    /*** Overwrite middle of first block. */
     nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
+    nffs_test_util_fill_area("/filler", area, 0);
+
+    /*** Overwrite part of the middle block.  Writing the replacement block
+     * requires a garbage collection cycle, which collates the file's blocks.
+     */
     rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 0);
-
-    rc = nffs_seek(file, 3);
+    rc = nffs_seek(file, 2);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 3);
-
-    rc = nffs_write(file, "12", 2);
+    rc = nffs_write(file, "X", 1);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 5);
-
+    nffs_test_util_assert_file_len(file, 6);
     rc = nffs_close(file);
     TEST_ASSERT(rc == 0);
+    TEST_ASSERT(nffs_scratch_area_idx == 1);
 
-    nffs_test_util_assert_contents( "/myfile.txt",
-                                   "abc12fghijklmnopqrstuvwx", 24);
-    nffs_test_util_assert_block_count("/myfile.txt", 3);
+    nffs_test_util_assert_contents("/myfile.txt", "11X233", 6);
+
+    /*** Overwrite the end of the file and extend it.  The grown last block
+     * fits, but replacing the one before it requires a garbage collection
+     * cycle, after which the blocks are cached again using the new file size.
+     */
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 2);
+    area = nffs_areas + 0;
+    nffs_test_util_fill_area("/filler", area,
+                             sizeof (struct nffs_disk_block) + 3);
 
-    /*** Overwrite end of first block, start of second. */
-    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
     rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 0);
-
-    rc = nffs_seek(file, 6);
+    rc = nffs_seek(file, 1);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 6);
-
-    rc = nffs_write(file, "1234", 4);
+    rc = nffs_write(file, "XYZW", 4);
     TEST_ASSERT(rc == 0);
-    nffs_test_util_assert_file_len(file, 24);
-    TEST_ASSERT(nffs_getpos(file) == 10);
-
+    nffs_test_util_assert_file_len(file, 5);
     rc = nffs_close(file);
     TEST_ASSERT(rc == 0);
+    TEST_ASSERT(nffs_scratch_area_idx == 0);
 
-    nffs_test_util_assert_contents( "/myfile.txt",
-                                   "abcdef1234klmnopqrstuvwx", 24);
-    nffs_test_util_assert_block_count("/myfile.txt", 3);
+    nffs_test_util_assert_contents("/myfile.txt", "1XYZW", 5);
 
     struct nffs_test_file_desc *expected_system =
         (struct nffs_test_file_desc[]) { {
@@ -1476,14 +2451,14 @@ TEST_CASE(nffs_test_overwrite_many)
             .is_dir = 1,
             .children = (struct nffs_test_file_desc[]) { {
                 .filename = "myfile.txt",
-                .contents = "abcdef1234klmnopqrstuvwx",
-                .contents_len = 24,
+                .contents = "1XYZW",
+                .contents_len = 5,
             }, {
                 .filename = NULL,
             } },
     } };
 
-    nffs_test_assert_system(expected_system, nffs_area_descs);
+    nffs_test_assert_system(expected_system, area_descs_two);
 }
 
 TEST_CASE(nffs_test_long_filename)
@@ -1680,6 +2655,184 @@ TEST_CASE(nffs_test_gc)
     nffs_test_util_assert_block_count("/myfile.txt", 1);
 }
 
+TEST_CASE(nffs_test_gc_collate)
+{
+    static char big[NFFS_BLOCK_MAX_DATA_SZ_MAX];
+    static char contents[4 + sizeof big + 1];
+    int rc;
+
+    static const struct nffs_area_desc area_descs_two[] = {
+        { 0x00020000, 128 * 1024 },
+        { 0x00040000, 128 * 1024 },
+        { 0, 0 },
+    };
+
+    memset(big, 'x', sizeof big);
+
+    struct nffs_test_block_desc blocks[6] = { {
+        .data = "1",
+        .data_len = 1,
+    }, {
+        .data = "2",
+        .data_len = 1,
+    }, {
+        .data = "3",
+        .data_len = 1,
+    }, {
+        .data = "4",
+        .data_len = 1,
+    }, {
+        .data = big,
+        .data_len = sizeof big,
+    }, {
+        .data = "6",
+        .data_len = 1,
+    } };
+
+    memcpy(contents, "1234", 4);
+    memcpy(contents + 4, big, sizeof big);
+    contents[sizeof contents - 1] = '6';
+
+    rc = nffs_format(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    /* Reading the file caches its blocks. */
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 6);
+
+    /* Only the first four blocks can be collated.  The big block still refers
+     * to the fourth one, so the collated block has to keep that ID.
+     */
+    rc = nffs_gc(NULL);
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_assert_block_count("/myfile.txt", 3);
+
+    /* The cached blocks of the collated ones must have been discarded. */
+    nffs_test_util_assert_contents("/myfile.txt", contents, sizeof contents);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "myfile.txt",
+                .contents = contents,
+                .contents_len = sizeof contents,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, area_descs_two);
+}
+
+TEST_CASE(nffs_test_gc_deletion)
+{
+    const struct nffs_area *area;
+    struct nffs_file *file;
+    uint8_t area_idx;
+    int rc;
+
+    static const struct nffs_area_desc area_descs_three[] = {
+        { 0x00000000, 16 * 1024 },
+        { 0x00004000, 16 * 1024 },
+        { 0x00008000, 16 * 1024 },
+        { 0, 0 },
+    };
+
+    /*** Setup. */
+    rc = nffs_format(area_descs_three);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT_FATAL(nffs_scratch_area_idx == 0);
+    area = nffs_areas + 1;
+
+    /* Fill the first data area until only an inode deletion record fits. */
+    nffs_test_util_fill_area("/filler", area,
+                             sizeof (struct nffs_disk_inode));
+
+    /* The file goes to the second data area; its deletion record to the
+     * first.
+     */
+    nffs_test_util_create_file("/myfile.txt", "abcdefgh", 8);
+    rc = nffs_unlink("/myfile.txt");
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(area->na_cur == area->na_length);
+
+    /* Collecting the first area must keep the deletion record, as the deleted
+     * inode's original record is still on disk.
+     */
+    rc = nffs_gc(&area_idx);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(area_idx == 0);
+    TEST_ASSERT(nffs_scratch_area_idx == 1);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(area_descs_three);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == NFFS_ENOENT);
+}
+
+TEST_CASE(nffs_test_reserve)
+{
+    struct nffs_file *file;
+    uint8_t scratch_area_idx;
+    uint8_t buf[1024];
+    int rc;
+    int i;
+
+    static const struct nffs_area_desc area_descs_two[] = {
+        { 0x00020000, 128 * 1024 },
+        { 0x00040000, 128 * 1024 },
+        { 0, 0 },
+    };
+
+    rc = nffs_format(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    memset(buf, 0xab, sizeof buf);
+
+    /* Fill most of the data area with garbage. */
+    rc = nffs_open("/garbage", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    for (i = 0; i < 100; i++) {
+        rc = nffs_write(file, buf, sizeof buf);
+        TEST_ASSERT(rc == 0);
+    }
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_unlink("/garbage");
+    TEST_ASSERT(rc == 0);
+
+    /* A small reservation fits without garbage collection. */
+    scratch_area_idx = nffs_scratch_area_idx;
+    rc = nffs_reserve(sizeof buf, 1);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(nffs_scratch_area_idx == scratch_area_idx);
+
+    /* A large one requires garbage collection up front... */
+    rc = nffs_reserve(64 * sizeof buf, 64);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(nffs_scratch_area_idx != scratch_area_idx);
+
+    /* ...so that the writes themselves don't. */
+    scratch_area_idx = nffs_scratch_area_idx;
+    rc = nffs_open("/log", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    for (i = 0; i < 64; i++) {
+        rc = nffs_write(file, buf, sizeof buf);
+        TEST_ASSERT(rc == 0);
+    }
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(nffs_scratch_area_idx == scratch_area_idx);
+
+    /* More than an area can hold. */
+    rc = nffs_reserve(128 * sizeof buf, 1);
+    TEST_ASSERT(rc == NFFS_EFULL);
+}
+
 TEST_CASE(nffs_test_wear_level)
 {
     int rc;
@@ -1736,32 +2889,90 @@ TEST_CASE(nffs_test_corrupt_scratch)
     rc = nffs_format(area_descs_two);
     TEST_ASSERT(rc == 0);
 
-    nffs_test_util_create_file("/myfile.txt", "contents", 8);
-
-    /* Copy the current contents of the non-scratch area to the scratch area.
-     * This will make the scratch area look like it only partially participated
-     * in a garbage collection cycle.
-     */
-    scratch_id = nffs_scratch_area_idx;
-    non_scratch_id = scratch_id ^ 1;
-    nffs_test_copy_area(area_descs_two + non_scratch_id,
-                       area_descs_two + nffs_scratch_area_idx);
-
-    /* Add some more data to the non-scratch area. */
+    nffs_test_util_create_file("/myfile.txt", "contents", 8);
+
+    /* Copy the current contents of the non-scratch area to the scratch area.
+     * This will make the scratch area look like it only partially participated
+     * in a garbage collection cycle.
+     */
+    scratch_id = nffs_scratch_area_idx;
+    non_scratch_id = scratch_id ^ 1;
+    nffs_test_copy_area(area_descs_two + non_scratch_id,
+                       area_descs_two + nffs_scratch_area_idx);
+
+    /* Add some more data to the non-scratch area. */
+    rc = nffs_mkdir("/mydir");
+    TEST_ASSERT(rc == 0);
+
+    /* Ensure the file system is successfully detected and valid, despite
+     * corruption.
+     */
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_detect(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    TEST_ASSERT(nffs_scratch_area_idx == scratch_id);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "mydir",
+                .is_dir = 1,
+            }, {
+                .filename = "myfile.txt",
+                .contents = "contents",
+                .contents_len = 8,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, area_descs_two);
+}
+
+TEST_CASE(nffs_test_blank_scratch)
+{
+    const struct nffs_area *scratch;
+    int rc;
+
+    static const struct nffs_area_desc area_descs_two[] = {
+        { 0x00020000, 128 * 1024 },
+        { 0x00040000, 128 * 1024 },
+        { 0, 0 },
+    };
+
+    /*** Setup. */
+    rc = nffs_format(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
     rc = nffs_mkdir("/mydir");
     TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/mydir/a", "aaaa", 4);
+    nffs_test_util_append_file("/mydir/a", "bbbb", 4);
 
-    /* Ensure the file system is successfully detected and valid, despite
-     * corruption.
+    /* Simulate a reset after a garbage collection cycle has erased its source
+     * area, but before the area was turned into the new scratch area.
      */
+    rc = nffs_gc(NULL);
+    TEST_ASSERT(rc == 0);
+    scratch = nffs_areas + nffs_scratch_area_idx;
+    rc = flash_erase(scratch->na_offset, scratch->na_length);
+    TEST_ASSERT(rc == 0);
 
     rc = nffs_misc_reset();
     TEST_ASSERT(rc == 0);
-
     rc = nffs_detect(area_descs_two);
     TEST_ASSERT(rc == 0);
 
-    TEST_ASSERT(nffs_scratch_area_idx == scratch_id);
+    /* The blank area is the scratch area again. */
+    TEST_ASSERT_FATAL(nffs_scratch_area_idx != NFFS_AREA_ID_NONE);
+    rc = nffs_gc(NULL);
+    TEST_ASSERT(rc == 0);
 
     struct nffs_test_file_desc *expected_system =
         (struct nffs_test_file_desc[]) { {
@@ -1770,10 +2981,13 @@ TEST_CASE(nffs_test_corrupt_scratch)
             .children = (struct nffs_test_file_desc[]) { {
                 .filename = "mydir",
                 .is_dir = 1,
-            }, {
-                .filename = "myfile.txt",
-                .contents = "contents",
-                .contents_len = 8,
+                .children = (struct nffs_test_file_desc[]) { {
+                    .filename = "a",
+                    .contents = "aaaabbbb",
+                    .contents_len = 8,
+                }, {
+                    .filename = NULL,
+                } },
             }, {
                 .filename = NULL,
             } },
@@ -1862,10 +3076,292 @@ TEST_CASE(nffs_test_incomplete_block)
 
 TEST_CASE(nffs_test_corrupt_block)
 {
-    struct nffs_block block;
+    struct nffs_block block;
+    struct nffs_file *file;
+    uint32_t flash_offset;
+    uint32_t area_offset;
+    uint8_t area_idx;
+    int rc;
+
+    /*** Setup. */
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_mkdir("/mydir");
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_create_file("/mydir/a", "aaaa", 4);
+    nffs_test_util_create_file("/mydir/b", "bbbb", 4);
+    nffs_test_util_create_file("/mydir/c", "cccc", 4);
+
+    /* Add a second block to the 'b' file. */
+    nffs_test_util_append_file("/mydir/b", "1234", 4);
+
+    /* Corrupt the 'b' file; overwrite the second block's magic number. */
+    rc = nffs_open("/mydir/b", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_block_from_hash_entry(&block,
+                                   file->nf_inode_entry->nie_last_block_entry);
+    TEST_ASSERT(rc == 0);
+
+    nffs_flash_loc_expand(block.nb_hash_entry->nhe_flash_loc, &area_idx,
+                         &area_offset);
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
+    rc = flash_native_memset(flash_offset, 0x43, 4);
+    TEST_ASSERT(rc == 0);
+
+    /* Write a fourth file. This file should get restored even though the
+     * previous object has an invalid magic number.
+     */
+    nffs_test_util_create_file("/mydir/d", "dddd", 4);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    /* The entire second block should be removed; the file should only contain
+     * the first block.
+     */
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "mydir",
+                .is_dir = 1,
+                .children = (struct nffs_test_file_desc[]) { {
+                    .filename = "a",
+                    .contents = "aaaa",
+                    .contents_len = 4,
+                }, {
+                    .filename = "b",
+                    .contents = "bbbb",
+                    .contents_len = 4,
+                }, {
+                    .filename = "c",
+                    .contents = "cccc",
+                    .contents_len = 4,
+                }, {
+                    .filename = "d",
+                    .contents = "dddd",
+                    .contents_len = 4,
+                }, {
+                    .filename = NULL,
+                } },
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_corrupt_block_chain)
+{
+    struct nffs_hash_entry *entry;
+    struct nffs_block block;
+    struct nffs_file *file;
+    uint32_t flash_offset;
+    uint32_t area_offset;
+    uint8_t area_idx;
+    int num_blocks;
+    int rc;
+    int i;
+
+    /*** Setup. */
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_create_file("/a", "aaaa", 4);
+    nffs_test_util_create_file("/b", "1111", 4);
+    nffs_test_util_append_file("/b", "2222", 4);
+    nffs_test_util_append_file("/b", "3333", 4);
+
+    /* Break the middle of the 'b' file's block chain by overwriting the
+     * second block's magic number.
+     */
+    rc = nffs_open("/b", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_block_from_hash_entry(&block,
+                                   file->nf_inode_entry->nie_last_block_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_flash_loc_expand(block.nb_prev->nhe_flash_loc, &area_idx,
+                          &area_offset);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
+    rc = flash_native_memset(flash_offset, 0x43, 4);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    /* The 'b' file is swept; none of its blocks may stay behind, not even the
+     * first one, which is no longer reachable from the file's last block.
+     */
+    num_blocks = 0;
+    NFFS_HASH_FOREACH(entry, i) {
+        if (nffs_hash_id_is_block(entry->nhe_id)) {
+            num_blocks++;
+        }
+    }
+    TEST_ASSERT(num_blocks == 1);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "a",
+                .contents = "aaaa",
+                .contents_len = 4,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_block_gap)
+{
+    struct nffs_inode_entry *inode_entry;
+    struct nffs_hash_entry *last_entry;
+    struct nffs_block block;
+    struct nffs_file *file;
+    int rc;
+
+    /*** Setup. */
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    struct nffs_test_block_desc *blocks = (struct nffs_test_block_desc[]) { {
+        .data = "abcdefgh",
+        .data_len = 8,
+    }, {
+        .data = "ijklmnop",
+        .data_len = 8,
+    }, {
+        .data = "qrstuvwx",
+        .data_len = 8,
+    } };
+    nffs_test_util_create_file_blocks("/myfile.txt", blocks, 3);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == 0);
+    inode_entry = file->nf_inode_entry;
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    last_entry = inode_entry->nie_last_block_entry;
+    rc = nffs_block_from_hash_entry(&block, last_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT_FATAL(block.nb_prev != NULL);
+
+    /* Discard the middle block, as garbage collection does with the blocks of
+     * a deleted inode.  Deleting the last block must still succeed; the chain
+     * ends where the gap is.
+     */
+    nffs_hash_remove(block.nb_prev);
+    nffs_block_entry_free(block.nb_prev);
+
+    rc = nffs_block_delete_from_ram(last_entry);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(inode_entry->nie_last_block_entry == NULL);
+
+    /* Nothing changed on disk; a remount recovers the whole file. */
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "myfile.txt",
+                .contents = "abcdefghijklmnopqrstuvwx",
+                .contents_len = 24,
+            }, {
+                .filename = NULL,
+            } },
+    } };
+
+    nffs_test_assert_system(expected_system, nffs_area_descs);
+}
+
+TEST_CASE(nffs_test_restore_block_order)
+{
+    static char data[NFFS_BLOCK_MAX_DATA_SZ_MAX];
+    struct nffs_file *file;
+    uint32_t area_offset;
+    uint32_t avail;
+    uint8_t area_idx;
+    int rc;
+
+    /*** Setup. */
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    memset(data, '2', sizeof data);
+    nffs_test_util_create_file("/myfile.txt", "11111111", 8);
+
+    /* Fill the first area until only a few hundred bytes remain. */
+    rc = nffs_open("/filler", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    while (nffs_areas[0].na_length - nffs_areas[0].na_cur > 600) {
+        rc = nffs_write(file, data, 256);
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    /* The second block is too big for the first area, but the third one fits.
+     * On disk, the third block now precedes the second.
+     */
+    avail = nffs_areas[0].na_length - nffs_areas[0].na_cur;
+    TEST_ASSERT_FATAL(avail > sizeof (struct nffs_disk_block) + 8);
+    nffs_test_util_append_file("/myfile.txt", data,
+                               avail - sizeof (struct nffs_disk_block) + 1);
+    nffs_test_util_append_file("/myfile.txt", "33333333", 8);
+
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_flash_loc_expand(file->nf_inode_entry->nie_last_block_entry->
+                              nhe_flash_loc,
+                          &area_idx, &area_offset);
+    TEST_ASSERT(area_idx == 0);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    /* Restore must still pick the third block as the last one. */
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    nffs_test_util_assert_block_count("/myfile.txt", 3);
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_test_util_assert_file_len(file,
+        8 + avail - sizeof (struct nffs_disk_block) + 1 + 8);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+}
+
+TEST_CASE(nffs_test_restore_inode_id)
+{
+    struct nffs_inode_entry *inode_entry;
     struct nffs_file *file;
     uint32_t flash_offset;
     uint32_t area_offset;
+    uint32_t lost_id;
     uint8_t area_idx;
     int rc;
 
@@ -1873,69 +3369,48 @@ TEST_CASE(nffs_test_corrupt_block)
     rc = nffs_format(nffs_area_descs);
     TEST_ASSERT(rc == 0);
 
-    rc = nffs_mkdir("/mydir");
-    TEST_ASSERT(rc == 0);
-
-    nffs_test_util_create_file("/mydir/a", "aaaa", 4);
-    nffs_test_util_create_file("/mydir/b", "bbbb", 4);
-    nffs_test_util_create_file("/mydir/c", "cccc", 4);
-
-    /* Add a second block to the 'b' file. */
-    nffs_test_util_append_file("/mydir/b", "1234", 4);
-
-    /* Corrupt the 'b' file; overwrite the second block's magic number. */
-    rc = nffs_open("/mydir/b", NFFS_ACCESS_READ, &file);
-    TEST_ASSERT(rc == 0);
-
-    rc = nffs_block_from_hash_entry(&block,
-                                   file->nf_inode_entry->nie_last_block_entry);
-    TEST_ASSERT(rc == 0);
-
-    nffs_flash_loc_expand(block.nb_hash_entry->nhe_flash_loc, &area_idx,
-                         &area_offset);
-    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
-    rc = flash_native_memset(flash_offset, 0x43, 4);
-    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/a", "aaaa", 4);
+    nffs_test_util_create_file("/b", "bbbb", 4);
 
-    /* Write a fourth file. This file should get restored even though the
-     * previous object has an invalid magic number.
+    /* Corrupt the filename of the newest inode.  Its data block remains on
+     * disk, referring to an inode that no longer exists.
      */
-    nffs_test_util_create_file("/mydir/d", "dddd", 4);
+    rc = nffs_path_find_inode_entry("/b", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    lost_id = inode_entry->nie_hash_entry.nhe_id;
+    nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                          &area_idx, &area_offset);
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset +
+                   sizeof (struct nffs_disk_inode);
+    rc = flash_native_memset(flash_offset, 'x', 1);
+    TEST_ASSERT(rc == 0);
 
     rc = nffs_misc_reset();
     TEST_ASSERT(rc == 0);
     rc = nffs_detect(nffs_area_descs);
     TEST_ASSERT(rc == 0);
 
-    /* The entire second block should be removed; the file should only contain
-     * the first block.
+    /* A new file must not inherit the lost inode's ID, or it would adopt the
+     * orphaned block on the next restore.
      */
+    rc = nffs_open("/c", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    TEST_ASSERT(file->nf_inode_entry->nie_hash_entry.nhe_id != lost_id);
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
     struct nffs_test_file_desc *expected_system =
         (struct nffs_test_file_desc[]) { {
             .filename = "",
             .is_dir = 1,
             .children = (struct nffs_test_file_desc[]) { {
-                .filename = "mydir",
-                .is_dir = 1,
-                .children = (struct nffs_test_file_desc[]) { {
-                    .filename = "a",
-                    .contents = "aaaa",
-                    .contents_len = 4,
-                }, {
-                    .filename = "b",
-                    .contents = "bbbb",
-                    .contents_len = 4,
-                }, {
-                    .filename = "c",
-                    .contents = "cccc",
-                    .contents_len = 4,
-                }, {
-                    .filename = "d",
-                    .contents = "dddd",
-                    .contents_len = 4,
-                }, {
-                    .filename = NULL,
-                } },
+                .filename = "a",
+                .contents = "aaaa",
+                .contents_len = 4,
+            }, {
+                .filename = "c",
+                .contents = "",
+                .contents_len = 0,
             }, {
                 .filename = NULL,
             } },
@@ -2109,6 +3584,226 @@ TEST_CASE(nffs_test_lost_found)
     nffs_test_assert_system(expected_system, nffs_area_descs);
 }
 
+TEST_CASE(nffs_test_lost_found_gc)
+{
+    static char data[1024];
+    char buf[32];
+    char *contents;
+    struct nffs_inode_entry *inode_entry;
+    const struct nffs_area *area;
+    struct nffs_file *file;
+    uint32_t flash_offset;
+    uint32_t area_offset;
+    uint32_t total_len;
+    uint32_t bucket;
+    uint32_t g_id;
+    uint32_t avail;
+    uint32_t len;
+    uint8_t area_idx;
+    int num_blocks;
+    int rc;
+
+    static const struct nffs_area_desc area_descs_two[] = {
+        { 0x00020000, 128 * 1024 },
+        { 0x00040000, 128 * 1024 },
+        { 0, 0 },
+    };
+
+    /*** Setup. */
+    rc = nffs_format(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_mkdir("/mydir");
+    TEST_ASSERT(rc == 0);
+    rc = nffs_path_find_inode_entry("/mydir", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    bucket = inode_entry->nie_hash_entry.nhe_id % NFFS_HASH_SIZE;
+    snprintf(buf, sizeof buf, "%lu",
+             (unsigned long)inode_entry->nie_hash_entry.nhe_id);
+
+    /* Arrange for a file and one of another file's blocks to share the
+     * directory's hash bucket.  On restore, the bucket then holds the dummy
+     * directory, followed by the block, followed by the file.
+     */
+    nffs_hash_next_file_id = NFFS_ID_FILE_MIN + bucket;
+    nffs_test_util_create_file("/g", "gggg", 4);
+    nffs_test_util_append_file("/g", "hhhh", 4);
+    nffs_hash_next_block_id = NFFS_ID_BLOCK_MIN + NFFS_HASH_SIZE + bucket - 1;
+
+    memset(data, 'f', sizeof data);
+    nffs_test_util_create_file("/f", data, 100);
+    nffs_test_util_append_file("/f", data, 100);
+    nffs_test_util_append_file("/f", data, 100);
+    total_len = 300;
+
+    nffs_test_util_create_file("/mydir/x", "", 0);
+
+    /* Fill both the area and the block entry pool.  Migrating the
+     * directory's child into lost+found then requires a garbage collection
+     * cycle, which collates the small blocks and frees the one in the
+     * directory's bucket.  As the pool starts out empty, the freed entry only
+     * leads to other freed entries, never back into the hash table.
+     */
+    area = nffs_areas + (nffs_scratch_area_idx == 0);
+    num_blocks = nffs_block_entry_pool.mp_num_free;
+    TEST_ASSERT_FATAL(num_blocks > 0);
+    rc = nffs_open("/f", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    for (; num_blocks > 0; num_blocks--) {
+        avail = area->na_length - area->na_cur - 8;
+        len = avail / num_blocks - sizeof (struct nffs_disk_block);
+        TEST_ASSERT_FATAL(len > 0 && len <= sizeof data);
+        rc = nffs_write(file, data, len);
+        TEST_ASSERT_FATAL(rc == 0);
+        total_len += len;
+    }
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(nffs_block_entry_pool.mp_num_free == 0);
+
+    /* Corrupt the mydir inode. */
+    rc = nffs_path_find_inode_entry("/mydir", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                          &area_idx, &area_offset);
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
+    rc = flash_native_memset(flash_offset + 10, 0xff, 1);
+    TEST_ASSERT(rc == 0);
+
+    /* Corrupt the 'g' file's inode; its blocks make it a dummy inode, which
+     * the sweep has to delete.
+     */
+    rc = nffs_path_find_inode_entry("/g", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    g_id = inode_entry->nie_hash_entry.nhe_id;
+    nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                          &area_idx, &area_offset);
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
+    rc = flash_native_memset(flash_offset + 10, 0xff, 1);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    /* The sweep must still reach the 'g' dummy after the collection. */
+    TEST_ASSERT(nffs_hash_find_inode(g_id) == NULL);
+
+    contents = malloc(total_len);
+    TEST_ASSERT_FATAL(contents != NULL);
+    memset(contents, 'f', total_len);
+
+    struct nffs_test_file_desc *expected_system =
+        (struct nffs_test_file_desc[]) { {
+            .filename = "",
+            .is_dir = 1,
+            .children = (struct nffs_test_file_desc[]) { {
+                .filename = "f",
+                .contents = contents,
+                .contents_len = total_len,
+            }, {
+                .filename = "lost+found",
+                .is_dir = 1,
+                .children = (struct nffs_test_file_desc[]) { {
+                    .filename = buf,
+                    .is_dir = 1,
+                    .children = (struct nffs_test_file_desc[]) { {
+                        .filename = "x",
+                        .contents = "",
+                        .contents_len = 0,
+                    }, {
+                        .filename = NULL,
+                    } },
+                }, {
+                    .filename = NULL,
+                } },
+            }, {
+                .filename = NULL,
+            } }
+    } };
+
+    nffs_test_assert_system(expected_system, area_descs_two);
+
+    free(contents);
+}
+
+TEST_CASE(nffs_test_restore_inode_nomem)
+{
+    struct nffs_inode_entry *inode_entry;
+    char filename[32];
+    uint32_t flash_offset;
+    uint32_t area_offset;
+    uint32_t x_id;
+    uint8_t area_idx;
+    int num_files;
+    int rc;
+    int i;
+
+    static const struct nffs_area_desc area_descs_two[] = {
+        { 0x00020000, 128 * 1024 },
+        { 0x00040000, 128 * 1024 },
+        { 0, 0 },
+    };
+
+    /*** Setup. */
+    rc = nffs_format(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_mkdir("/mydir");
+    TEST_ASSERT(rc == 0);
+
+    /* Use up every inode entry, then free one for the file in mydir.  The
+     * unlinked file's inode stays on disk, so on restore the mydir file gets
+     * the last free entry and no dummy can be created for its parent.
+     */
+    num_files = nffs_inode_entry_pool.mp_num_free;
+    for (i = 0; i < num_files; i++) {
+        snprintf(filename, sizeof filename, "/f%d", i);
+        nffs_test_util_create_file(filename, NULL, 0);
+    }
+    TEST_ASSERT_FATAL(nffs_inode_entry_pool.mp_num_free == 0);
+
+    rc = nffs_unlink("/f0");
+    TEST_ASSERT(rc == 0);
+    nffs_test_util_create_file("/mydir/x", NULL, 0);
+
+    rc = nffs_path_find_inode_entry("/mydir/x", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    x_id = inode_entry->nie_hash_entry.nhe_id;
+
+    /* Corrupt the mydir inode. */
+    rc = nffs_path_find_inode_entry("/mydir", &inode_entry);
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_flash_loc_expand(inode_entry->nie_hash_entry.nhe_flash_loc,
+                          &area_idx, &area_offset);
+    flash_offset = nffs_areas[area_idx].na_offset + area_offset;
+    rc = flash_native_memset(flash_offset + 10, 0xff, 1);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_misc_reset();
+    TEST_ASSERT(rc == 0);
+    rc = nffs_detect(area_descs_two);
+    TEST_ASSERT(rc == 0);
+
+    /* The file whose restore failed must not linger in the hash table.  Its
+     * entry and that of the deleted /f0 are each freed exactly once.
+     */
+    TEST_ASSERT(nffs_hash_find_inode(x_id) == NULL);
+    TEST_ASSERT(nffs_inode_entry_pool.mp_num_free == 2);
+
+    /* Both entries can be reused. */
+    nffs_test_util_create_file("/n0", "n0", 2);
+    nffs_test_util_create_file("/n1", "n1", 2);
+    nffs_test_util_assert_contents("/n0", "n0", 2);
+    nffs_test_util_assert_contents("/n1", "n1", 2);
+
+    rc = nffs_path_find_inode_entry("/f1", &inode_entry);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_path_find_inode_entry("/f0", &inode_entry);
+    TEST_ASSERT(rc == NFFS_ENOENT);
+}
+
 TEST_CASE(nffs_test_cache_large_file)
 {
     static char data[NFFS_BLOCK_MAX_DATA_SZ_MAX * 5];
@@ -2181,8 +3876,11 @@ TEST_CASE(nffs_test_cache_large_file)
 TEST_CASE(nffs_test_readdir)
 {
     struct nffs_dirent *dirent;
+    struct nffs_file *file;
+    struct nffs_dir *dir2;
     struct nffs_dir *dir;
     int rc;
+    int i;
 
     /*** Setup. */
     rc = nffs_format(nffs_area_descs);
@@ -2196,9 +3894,11 @@ TEST_CASE(nffs_test_readdir)
     rc = nffs_mkdir("/mydir/c");
     TEST_ASSERT_FATAL(rc == 0);
 
-    /* Nonexistent directory. */
-    rc = nffs_opendir("/asdf", &dir);
-    TEST_ASSERT(rc == NFFS_ENOENT);
+    /* Nonexistent directory.  A failed open must not leak its handle. */
+    for (i = 0; i < nffs_config.nc_num_dirs + 1; i++) {
+        rc = nffs_opendir("/asdf", &dir);
+        TEST_ASSERT(rc == NFFS_ENOENT);
+    }
 
     /* Real directory. */
     rc = nffs_opendir("/mydir", &dir);
@@ -2259,6 +3959,118 @@ TEST_CASE(nffs_test_readdir)
     /* Ensure directory is gone. */
     rc = nffs_opendir("/mydir", &dir);
     TEST_ASSERT(rc == NFFS_ENOENT);
+
+    /* Two handles share an entry which is then unlinked.  The first handle
+     * to move on drops a reference under the shared lock; the second drops
+     * the last one and deletes the file.
+     */
+    rc = nffs_mkdir("/mydir");
+    TEST_ASSERT_FATAL(rc == 0);
+    nffs_test_util_create_file("/mydir/a", "aaaa", 4);
+
+    rc = nffs_opendir("/mydir", &dir);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_opendir("/mydir", &dir2);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    rc = nffs_readdir(dir, &dirent);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_readdir(dir2, &dirent);
+    TEST_ASSERT(rc == 0);
+    TEST_ASSERT(dirent->nde_inode_entry->nie_refcnt == 3);
+
+    rc = nffs_unlink("/mydir/a");
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_readdir(dir, &dirent);
+    TEST_ASSERT(rc == NFFS_ENOENT);
+    rc = nffs_readdir(dir2, &dirent);
+    TEST_ASSERT(rc == NFFS_ENOENT);
+
+    rc = nffs_closedir(dir);
+    TEST_ASSERT(rc == 0);
+    rc = nffs_closedir(dir2);
+    TEST_ASSERT(rc == 0);
+
+    rc = nffs_open("/mydir/a", NFFS_ACCESS_READ, &file);
+    TEST_ASSERT(rc == NFFS_ENOENT);
+}
+
+TEST_CASE(nffs_test_hash_walk)
+{
+    struct nffs_hash_entry entries[2];
+    struct nffs_hash_list *list;
+    int rc;
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    /* Two block IDs which share a bucket; the second is at the front. */
+    memset(entries, 0, sizeof entries);
+    entries[0].nhe_id = NFFS_ID_BLOCK_MAX - 2 * NFFS_HASH_SIZE;
+    entries[1].nhe_id = NFFS_ID_BLOCK_MAX - NFFS_HASH_SIZE;
+    nffs_hash_insert(entries + 0);
+    nffs_hash_insert(entries + 1);
+    list = nffs_hash + entries[0].nhe_id % NFFS_HASH_SIZE;
+    TEST_ASSERT_FATAL(SLIST_FIRST(list) == entries + 1);
+
+    nffs_lock_write();
+
+    /* While the table is being walked, a lookup leaves the bucket alone;
+     * moving the entry could skip it or revisit it.
+     */
+    nffs_hash_walk_begin();
+    TEST_ASSERT(nffs_hash_find(entries[0].nhe_id) == entries + 0);
+    TEST_ASSERT(SLIST_FIRST(list) == entries + 1);
+    nffs_hash_walk_end();
+
+    /* Otherwise a writer's lookup moves the entry to the front. */
+    TEST_ASSERT(nffs_hash_find(entries[0].nhe_id) == entries + 0);
+    TEST_ASSERT(SLIST_FIRST(list) == entries + 0);
+
+    nffs_unlock_write();
+
+    nffs_hash_remove(entries + 0);
+    nffs_hash_remove(entries + 1);
+}
+
+TEST_CASE(nffs_test_mem_stats)
+{
+    struct nffs_mem_stats stats_before;
+    struct nffs_mem_stats stats;
+    struct nffs_file *file;
+    int rc;
+
+    rc = nffs_format(nffs_area_descs);
+    TEST_ASSERT(rc == 0);
+
+    nffs_mem_stats_clear();
+    nffs_mem_stats_get(&stats_before);
+    TEST_ASSERT(stats_before.nms_bytes_total > 0);
+    TEST_ASSERT(stats_before.nms_bytes_hwm == stats_before.nms_bytes_in_use);
+
+    /* An open file consumes pool memory. */
+    rc = nffs_open("/myfile.txt", NFFS_ACCESS_WRITE, &file);
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = nffs_write(file, "abcdefgh", 8);
+    TEST_ASSERT(rc == 0);
+
+    nffs_mem_stats_get(&stats);
+    TEST_ASSERT(stats.nms_bytes_total == stats_before.nms_bytes_total);
+    TEST_ASSERT(stats.nms_bytes_in_use > stats_before.nms_bytes_in_use);
+    TEST_ASSERT(stats.nms_bytes_hwm >= stats.nms_bytes_in_use);
+
+    /* Closing the file releases memory, but the high-water mark remains. */
+    rc = nffs_close(file);
+    TEST_ASSERT(rc == 0);
+
+    nffs_mem_stats_get(&stats_before);
+    TEST_ASSERT(stats_before.nms_bytes_in_use < stats.nms_bytes_in_use);
+    TEST_ASSERT(stats_before.nms_bytes_hwm == stats.nms_bytes_hwm);
+
+    nffs_mem_stats_clear();
+    nffs_mem_stats_get(&stats);
+    TEST_ASSERT(stats.nms_bytes_hwm == stats.nms_bytes_in_use);
 }
 
 TEST_SUITE(nffs_suite_cache)
@@ -2286,25 +4098,47 @@ nffs_test_gen(void)
     nffs_test_unlink();
     nffs_test_mkdir();
     nffs_test_rename();
+    nffs_test_rename_sorted();
     nffs_test_truncate();
+    nffs_test_truncate_unlink_fail();
+    nffs_test_truncate_len();
+    nffs_test_log();
+    nffs_test_log_legacy_inode();
+    nffs_test_txn();
     nffs_test_append();
     nffs_test_read();
+    nffs_test_read_ptr();
+    nffs_test_read_ptr_gc();
     nffs_test_overwrite_one();
     nffs_test_overwrite_two();
     nffs_test_overwrite_three();
     nffs_test_overwrite_many();
+    nffs_test_overwrite_split();
+    nffs_test_overwrite_gc();
     nffs_test_long_filename();
     nffs_test_large_write();
     nffs_test_many_children();
     nffs_test_gc();
+    nffs_test_gc_collate();
+    nffs_test_gc_deletion();
+    nffs_test_reserve();
     nffs_test_wear_level();
     nffs_test_corrupt_scratch();
+    nffs_test_blank_scratch();
     nffs_test_incomplete_block();
     nffs_test_corrupt_block();
+    nffs_test_corrupt_block_chain();
+    nffs_test_block_gap();
+    nffs_test_restore_block_order();
+    nffs_test_restore_inode_id();
     nffs_test_large_unlink();
     nffs_test_large_system();
     nffs_test_lost_found();
+    nffs_test_lost_found_gc();
+    nffs_test_restore_inode_nomem();
     nffs_test_readdir();
+    nffs_test_hash_walk();
+    nffs_test_mem_stats();
 }
 
 TEST_SUITE(gen_1_1)
@@ -201,6 +201,9 @@ struct os_mbuf *os_mbuf_get_pkthdr(struct os_mbuf_pool *omp);
 /* Duplicate a mbuf from the pool */
 struct os_mbuf *os_mbuf_dup(struct os_mbuf_pool *omp, struct os_mbuf *m);
 
+/* Copy data out of a mbuf chain */
+int os_mbuf_copydata(const struct os_mbuf *om, int off, int len, void *dst);
+
 /* Append data onto a mbuf */
 int os_mbuf_append(struct os_mbuf_pool *omp, struct os_mbuf *m, void *, 
         uint16_t);
@@ -37,6 +37,7 @@ os_callout_func_init(struct os_callout_func *cf, struct os_eventq *evq,
 {
     os_callout_init(&cf->cf_c, evq, ev_arg);
     cf->cf_func = timo_func;
+    cf->cf_arg = ev_arg;
 }
 
 void
@@ -322,6 +322,42 @@ err:
     return (NULL);
 }
 
+/**
+ * Copy data out of a chain of mbufs into a flat buffer. 
+ *
+ * @param om  The mbuf chain to copy from 
+ * @param off The offset into the chain to start copying from 
+ * @param len The number of bytes to copy 
+ * @param dst The destination buffer 
+ *
+ * @return 0 on success, -1 if the chain holds less than off + len bytes 
+ */
+int
+os_mbuf_copydata(const struct os_mbuf *om, int off, int len, void *dst)
+{
+    int count;
+    uint8_t *udst;
+
+    udst = dst;
+
+    /* Skip the mbufs before the offset */
+    while (om != NULL && off >= om->om_len) {
+        off -= om->om_len;
+        om = SLIST_NEXT(om, om_next);
+    }
+
+    while (om != NULL && len > 0) {
+        count = min(om->om_len - off, len);
+        memcpy(udst, om->om_data + off, count);
+        len -= count;
+        udst += count;
+        off = 0;
+        om = SLIST_NEXT(om, om_next);
+    }
+
+    return (len > 0 ? -1 : 0);
+}
+
 #if 0
 
 /**
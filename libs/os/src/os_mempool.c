@@ -51,6 +51,7 @@ os_mempool_init(struct os_mempool *mp, int blocks, int block_size, void *membuf,
     /* Initialize the memory pool structure */
     mp->mp_block_size = block_size;
     mp->mp_num_free = blocks;
+    mp->mp_min_free = blocks;
     mp->mp_num_blocks = blocks;
     mp->name = name;
     SLIST_FIRST(mp) = membuf;
@@ -100,6 +101,9 @@ os_memblock_get(struct os_mempool *mp)
 
             /* Decrement number free by 1 */
             mp->mp_num_free--;
+            if (mp->mp_num_free < mp->mp_min_free) {
+                mp->mp_min_free = mp->mp_num_free;
+            }
         }
         OS_EXIT_CRITICAL(sr);
     }
@@ -121,8 +121,51 @@ TEST_CASE(os_mbuf_test_case_3)
             "Databuf doesn't match cmpbuf");
 }
 
-TEST_SUITE(os_mbuf_test_case_4)
+TEST_CASE(os_mbuf_test_case_4)
 {
+    struct os_mbuf *m;
+    struct os_mbuf *m2;
+    int rc;
+    uint8_t databuf[] = {0xa, 0xb, 0xc, 0xd};
+    uint8_t databuf2[] = {0xe, 0xf, 0x10};
+    uint8_t cmpbuf[8];
+
+    /* Copy out of a chain of two mbufs */
+    m = os_mbuf_get(&os_mbuf_pool, 0);
+    TEST_ASSERT_FATAL(m != NULL, "Error allocating mbuf");
+    memcpy(OS_MBUF_DATA(m, uint8_t *), databuf, sizeof(databuf));
+    m->om_len = sizeof(databuf);
+
+    m2 = os_mbuf_get(&os_mbuf_pool, 0);
+    TEST_ASSERT_FATAL(m2 != NULL, "Error allocating mbuf");
+    memcpy(OS_MBUF_DATA(m2, uint8_t *), databuf2, sizeof(databuf2));
+    m2->om_len = sizeof(databuf2);
+    SLIST_NEXT(m, om_next) = m2;
+
+    rc = os_mbuf_copydata(m, 0, 7, cmpbuf);
+    TEST_ASSERT_FATAL(rc == 0, "Cannot copy chain %d", rc);
+    TEST_ASSERT(memcmp(cmpbuf, databuf, sizeof(databuf)) == 0);
+    TEST_ASSERT(memcmp(cmpbuf + 4, databuf2, sizeof(databuf2)) == 0);
+
+    /* Start in the first mbuf and end in the second */
+    memset(cmpbuf, 0xff, sizeof(cmpbuf));
+    rc = os_mbuf_copydata(m, 3, 2, cmpbuf);
+    TEST_ASSERT_FATAL(rc == 0, "Cannot copy chain %d", rc);
+    TEST_ASSERT(cmpbuf[0] == 0xd && cmpbuf[1] == 0xe && cmpbuf[2] == 0xff);
+
+    /* Start in the second mbuf */
+    rc = os_mbuf_copydata(m, 5, 2, cmpbuf);
+    TEST_ASSERT_FATAL(rc == 0, "Cannot copy chain %d", rc);
+    TEST_ASSERT(cmpbuf[0] == 0xf && cmpbuf[1] == 0x10);
+
+    /* Past the end of the chain */
+    rc = os_mbuf_copydata(m, 5, 3, cmpbuf);
+    TEST_ASSERT(rc == -1);
+    rc = os_mbuf_copydata(m, 8, 1, cmpbuf);
+    TEST_ASSERT(rc == -1);
+
+    rc = os_mbuf_free_chain(&os_mbuf_pool, m);
+    TEST_ASSERT_FATAL(rc == 0, "Cannot free mbuf chain %d", rc);
 }
 
 TEST_SUITE(os_mbuf_test_suite)
@@ -132,4 +175,5 @@ TEST_SUITE(os_mbuf_test_suite)
     os_mbuf_test_case_1();
     os_mbuf_test_case_2();
     os_mbuf_test_case_3();
+    os_mbuf_test_case_4();
 }
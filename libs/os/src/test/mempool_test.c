@@ -140,6 +140,11 @@ mempool_test(int num_blocks, int block_size)
                 "Number of free blocks incorrect (%u vs %u)",
                 g_TstMempool.mp_num_free, num_blocks);
 
+    /* The low-water mark remembers the block that was taken. */
+    TEST_ASSERT(g_TstMempool.mp_min_free == (num_blocks-1),
+                "Minimum free blocks incorrect (%u vs %u)",
+                g_TstMempool.mp_min_free, (num_blocks-1));
+
     /* remove all the blocks. Make sure we get count. */
     memset(block_array, 0, sizeof(block_array));
     cnt = 0;
@@ -177,6 +182,10 @@ mempool_test(int num_blocks, int block_size)
     TEST_ASSERT(g_TstMempool.mp_num_free == g_TstMempool.mp_num_blocks,
                 "Put all blocks but number free not equal to total!");
 
+    TEST_ASSERT(g_TstMempool.mp_min_free == 0,
+                "Emptied pool but minimum free not zero! (%d)",
+                g_TstMempool.mp_min_free);
+
     /* Better get error when we try these things! */
     rc = os_memblock_put(NULL, block_array[0]);
     TEST_ASSERT(rc != 0,
@@ -61,6 +61,8 @@ struct ll_stats
     uint32_t hci_cmds;
     uint32_t hci_cmd_errs;
     uint32_t hci_events_sent;
+    uint32_t hci_acl_pkts;
+    uint32_t hci_acl_errs;
 };
 
 extern struct ll_stats g_ll_stats;
@@ -78,6 +80,11 @@ extern struct ll_obj g_ll_data;
 #define BLE_LL_EVENT_ADV_TXDONE     (OS_EVENT_T_PERUSER + 1)
 #define BLE_LL_EVENT_RX_PKT_IN      (OS_EVENT_T_PERUSER + 2)
 #define BLE_LL_EVENT_SCAN_WIN_END   (OS_EVENT_T_PERUSER + 3)
+#define BLE_LL_EVENT_HCI_ACL        (OS_EVENT_T_PERUSER + 4)
+#define BLE_LL_EVENT_CONN_SPAWN     (OS_EVENT_T_PERUSER + 5)
+#define BLE_LL_EVENT_CONN_EV_END    (OS_EVENT_T_PERUSER + 6)
+#define BLE_LL_EVENT_ADV_EXT_DONE   (OS_EVENT_T_PERUSER + 7)
+#define BLE_LL_EVENT_ADV_PER_DONE   (OS_EVENT_T_PERUSER + 8)
 
 /* LL Features */
 #define BLE_LL_FEAT_LE_ENCRYPTION   (0x01)
@@ -402,6 +409,9 @@ enum ll_init_filt_policy
 /* Initialize the Link Layer */
 int ll_init(void);
 
+/* Reset the Link Layer (HCI reset) */
+int ll_reset(void);
+
 /* 'Boolean' function returning true if address is a valid random address */
 int ll_is_valid_rand_addr(uint8_t *addr);
 
@@ -425,10 +435,16 @@ int ll_rx_start(struct os_mbuf *rxpdu);
 int ll_rx_end(struct os_mbuf *rxpdu, uint8_t crcok);
 
 /*--- Controller API ---*/
+/* Put a received PDU on the Link Layer receive queue */
+void ll_rx_pdu_in(struct os_mbuf *rxpdu);
+
 /* Set the link layer state */
 void ble_ll_state_set(int ll_state);
 
 /* Send an event to LL task */
 void ble_ll_event_send(struct os_event *ev);
 
+/* Process an event from the LL task's queue (tests drive the LL with this) */
+void ll_event_proc(struct os_event *ev);
+
 #endif /* H_LL_ */
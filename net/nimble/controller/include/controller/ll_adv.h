@@ -48,6 +48,7 @@
  * -> Payload
  */
 #define BLE_ADV_PDU_HDR_TYPE_MASK           (0x0F)
+#define BLE_ADV_PDU_HDR_CHSEL_MASK          (0x20)
 #define BLE_ADV_PDU_HDR_TXADD_MASK          (0x40)
 #define BLE_ADV_PDU_HDR_RXADD_MASK          (0x80)
 #define BLE_ADV_PDU_HDR_LEN_MASK            (0x3F)
@@ -60,6 +61,7 @@
 #define BLE_ADV_PDU_TYPE_SCAN_RSP           (4)
 #define BLE_ADV_PDU_TYPE_CONNECT_REQ        (5)
 #define BLE_ADV_PDU_TYPE_ADV_SCAN_IND       (6)
+#define BLE_ADV_PDU_TYPE_ADV_EXT_IND        (7)
 
 /* 
  * TxAdd and RxAdd bit definitions. A 0 is a public address; a 1 is a
@@ -68,6 +70,12 @@
 #define BLE_ADV_PDU_HDR_TXADD_RAND          (0x40)
 #define BLE_ADV_PDU_HDR_RXADD_RAND          (0x80)
 
+/* 
+ * ChSel bit: set in connectable advertisements and the CONNECT_REQ by
+ * devices that support channel selection algorithm #2.
+ */
+#define BLE_ADV_PDU_HDR_CHSEL               (0x20)
+
 /* Maximum advertisement data length */
 #define BLE_ADV_DATA_MAX_LEN            (31)
 
@@ -120,6 +128,74 @@
 #define BLE_ADV_SCAN_IND_MIN_LEN        (6)
 #define BLE_ADV_SCAN_IND_MAX_LEN        (37)
 
+/*
+ * Common extended advertising payload format (Vol 6 Part B 2.3.4). Used by
+ * the ADV_EXT_IND on the primary advertising channels and by AUX_ADV_IND,
+ * AUX_CHAIN_IND and AUX_SYNC_IND on the secondary (data) channels. These
+ * PDUs all have the ADV_EXT_IND PDU type and a one byte length.
+ *      -> Extended header length (6 bits) and AdvMode (2 bits)
+ *      -> Extended header flags (1 byte)
+ *      -> Extended header fields, in the order of their flags
+ *      -> AdvData  (0 - 254 bytes)
+ */
+#define BLE_ADV_EXT_PAYLOAD_MAX_LEN         (255)
+#define BLE_ADV_EXT_HDR_LEN_MASK            (0x3F)
+#define BLE_ADV_EXT_MODE_NONCONN            (0x00)
+#define BLE_ADV_EXT_MODE_CONN               (0x40)
+#define BLE_ADV_EXT_MODE_SCAN               (0x80)
+
+/* Extended header flags */
+#define BLE_ADV_EXT_FLAG_ADVA               (0x01)
+#define BLE_ADV_EXT_FLAG_TARGETA            (0x02)
+#define BLE_ADV_EXT_FLAG_ADI                (0x08)
+#define BLE_ADV_EXT_FLAG_AUX_PTR            (0x10)
+#define BLE_ADV_EXT_FLAG_SYNC_INFO          (0x20)
+#define BLE_ADV_EXT_FLAG_TX_POWER           (0x40)
+
+/* Length of the extended header fields */
+#define BLE_ADV_EXT_ADI_LEN                 (2)
+#define BLE_ADV_EXT_AUX_PTR_LEN             (3)
+#define BLE_ADV_EXT_SYNC_INFO_LEN           (18)
+#define BLE_ADV_EXT_TX_POWER_LEN            (1)
+
+/* 
+ * ADI: advertising data ID (12 bits) and advertising set ID (4 bits). The
+ * data ID changes whenever the advertising data does.
+ */
+#define BLE_ADV_EXT_ADI_DID_MASK            (0x0FFF)
+#define BLE_ADV_EXT_ADI_SID_SHIFT           (12)
+
+/* 
+ * AuxPtr: where the next PDU of the event is sent.
+ *      -> Channel index (6 bits), clock accuracy (1 bit), offset units (1 bit)
+ *      -> Aux offset (13 bits) and aux PHY (3 bits)
+ *  The offset is from the start of this PDU to the start of the next one.
+ *  The next PDU starts no earlier than the offset and no later than the
+ *  offset plus one offset unit.
+ */
+#define BLE_ADV_EXT_AUX_PTR_CA_50_PPM       (0x40)
+#define BLE_ADV_EXT_AUX_PTR_UNITS_300       (0x80)
+#define BLE_ADV_EXT_AUX_PTR_PHY_1M          (0x0000)
+#define BLE_ADV_EXT_OFFSET_UNIT_USECS       (30)
+#define BLE_ADV_EXT_OFFSET_LARGE_UNIT_USECS (300)
+#define BLE_ADV_EXT_OFFSET_MAX              (0x1FFF)
+
+/* 
+ * SyncInfo: how to find the periodic advertising of the set.
+ *      -> Sync packet offset (13 bits), offset units (1 bit), RFU (2 bits)
+ *      -> Interval (2 bytes; 1.25 msec units)
+ *      -> Channel map (37 bits) and SCA (3 bits)
+ *      -> Access address (4 bytes)
+ *      -> CRCInit (3 bytes)
+ *      -> Periodic event counter (2 bytes)
+ *  The offset is from the start of the AUX_ADV_IND to the start of an
+ *  AUX_SYNC_IND. An offset of zero means it is too far away to tell.
+ */
+#define BLE_ADV_EXT_SYNC_UNITS_300          (0x2000)
+
+/* Minimum time between PDUs of an event on the secondary channels */
+#define BLE_LL_MAFS_USECS                   (300)
+
 /*---- HCI ----*/
 /* Start an advertiser */
 int ll_adv_start_req(uint8_t adv_chanmask, uint8_t adv_type, uint8_t *init_addr,
@@ -150,7 +226,13 @@ void ll_adv_tx_done_proc(void *arg);
 /* Called to initialize advertising functionality. */
 void ll_adv_init(void);
 
+/* Stop advertising and restore the defaults (HCI reset) */
+void ll_adv_reset(void);
+
 /* Called when a scan request has been received. */
 int ll_adv_rx_scan_req(uint8_t *rxbuf);
 
+/* Called when a connect request has been received. */
+int ll_adv_rx_conn_req(uint8_t *rxbuf, uint32_t rx_end);
+
 #endif /* H_LL_ADV_ */
@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_BLE_LL_ADV_EXT_
+#define H_BLE_LL_ADV_EXT_
+
+/* Number of advertising sets (extended advertising) */
+#define BLE_LL_ADV_EXT_CFG_MAX_SETS         (4)
+
+/* Maximum advertising data (and periodic advertising data) of a set */
+#define BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN     (1650)
+
+/* Periodic advertising interval units */
+#define BLE_LL_ADV_PER_ITVL_USECS           (1250)
+
+/*
+ * Advertising set statistics. Air time is the time on air of the PDUs
+ * sent, including the preamble, access address and CRC.
+ */
+struct ble_ll_adv_ext_stats
+{
+    uint32_t adv_events;            /* Extended advertising events */
+    uint32_t per_events;            /* Periodic advertising events */
+    uint32_t per_events_late;       /* Periodic events skipped (late) */
+    uint32_t events_preempted;      /* Events cut short */
+    uint32_t events_postponed;      /* Events started later (way not clear) */
+    uint32_t tx_prim_pdus;          /* ADV_EXT_IND */
+    uint32_t tx_aux_pdus;           /* AUX_ADV_IND and AUX_SYNC_IND */
+    uint32_t tx_chain_pdus;         /* AUX_CHAIN_IND */
+    uint32_t tx_data_bytes;         /* Advertising data sent */
+    uint32_t tx_fail;
+    uint32_t air_usecs;
+    uint32_t cant_set_sched;
+};
+extern struct ble_ll_adv_ext_stats
+    g_ble_ll_adv_ext_stats[BLE_LL_ADV_EXT_CFG_MAX_SETS];
+
+/*---- HCI ----*/
+/* Set the random address of an advertising set */
+int ble_ll_adv_ext_set_rand_addr(uint8_t *cmdbuf);
+
+/* Set extended advertising parameters (creates the set) */
+int ble_ll_adv_ext_set_params(uint8_t *cmdbuf, uint8_t *rspbuf);
+
+/* Set extended advertising data or scan response data */
+int ble_ll_adv_ext_set_data(uint8_t *cmdbuf, uint8_t len);
+int ble_ll_adv_ext_set_scan_rsp_data(uint8_t *cmdbuf, uint8_t len);
+
+/* Enable or disable advertising sets */
+int ble_ll_adv_ext_set_enable(uint8_t *cmdbuf, uint8_t len);
+
+/* Read the maximum data length and the number of advertising sets */
+int ble_ll_adv_ext_rd_max_data_len(uint8_t *rspbuf);
+int ble_ll_adv_ext_rd_num_sets(uint8_t *rspbuf);
+
+/* Remove one or all advertising sets */
+int ble_ll_adv_ext_remove_set(uint8_t *cmdbuf);
+int ble_ll_adv_ext_clear_sets(void);
+
+/* Periodic advertising parameters, data and enable */
+int ble_ll_adv_per_set_params(uint8_t *cmdbuf);
+int ble_ll_adv_per_set_data(uint8_t *cmdbuf, uint8_t len);
+int ble_ll_adv_per_set_enable(uint8_t *cmdbuf);
+
+/*---- API used by BLE LL ----*/
+/* Initialize extended advertising */
+void ble_ll_adv_ext_init(void);
+
+/* Stop and remove all advertising sets (HCI reset) */
+void ble_ll_adv_ext_reset(void);
+
+/* Process the end of an extended or periodic advertising event */
+void ble_ll_adv_ext_event_done_proc(void *arg);
+void ble_ll_adv_per_event_done_proc(void *arg);
+
+#endif /* H_BLE_LL_ADV_EXT_ */
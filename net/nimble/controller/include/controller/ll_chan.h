@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_BLE_LL_CHAN_
+#define H_BLE_LL_CHAN_
+
+#include "controller/phy.h"
+
+/* Length of a data channel map (one bit per data channel) */
+#define BLE_LL_CHAN_MAP_LEN             (5)
+
+/* Channel selection algorithms */
+#define BLE_LL_CHAN_SEL_ALG_1           (0)
+#define BLE_LL_CHAN_SEL_ALG_2           (1)
+
+/*
+ * A data channel map. The remap table holds the used channels in ascending
+ * order; it is built when the map is set so that picking a channel is a
+ * table lookup rather than a scan of the map.
+ */
+struct ble_ll_chan_map
+{
+    uint8_t num_used;
+    uint8_t map[BLE_LL_CHAN_MAP_LEN];
+    uint8_t remap[BLE_PHY_NUM_DATA_CHANS];
+};
+
+/* Count the used channels in a channel map */
+uint8_t ble_ll_chan_num_used(uint8_t *map);
+
+/* Set the channel map and build its remap table */
+void ble_ll_chan_map_set(struct ble_ll_chan_map *chmap, uint8_t *map);
+
+/* Channel selection algorithm #1: the channel for the next event */
+uint8_t ble_ll_chan_sel1(struct ble_ll_chan_map *chmap,
+                         uint8_t *last_unmapped_chan, uint8_t hop_inc);
+
+/* Channel selection algorithm #2: channel identifier and event channel */
+uint16_t ble_ll_chan_sel2_id(uint32_t access_addr);
+uint8_t ble_ll_chan_sel2(struct ble_ll_chan_map *chmap, uint16_t counter,
+                         uint16_t chan_id);
+
+#endif /* H_BLE_LL_CHAN_ */
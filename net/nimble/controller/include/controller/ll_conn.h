@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_BLE_LL_CONN_
+#define H_BLE_LL_CONN_
+
+/* Number of connections supported by the link layer (either role) */
+#define BLE_LL_CONN_CFG_MAX_CONNS           (32)
+
+/* Connection roles */
+#define BLE_LL_CONN_ROLE_NONE               (0)
+#define BLE_LL_CONN_ROLE_MASTER             (1)
+#define BLE_LL_CONN_ROLE_SLAVE              (2)
+
+/*
+ * Connection states
+ *  IDLE: not in use.
+ *  INITIATING: (master) waiting for the advertiser to send a CONNECT_REQ to.
+ *  CREATED: CONNECT_REQ sent/received; no packet received from the peer yet.
+ *  ESTABLISHED: a packet has been received from the peer.
+ */
+#define BLE_LL_CONN_STATE_IDLE              (0)
+#define BLE_LL_CONN_STATE_INITIATING        (1)
+#define BLE_LL_CONN_STATE_CREATED           (2)
+#define BLE_LL_CONN_STATE_ESTABLISHED       (3)
+
+/* Connection interval and transmit window units */
+#define BLE_LL_CONN_ITVL_USECS              (1250)
+#define BLE_LL_CONN_TX_WIN_USECS            (1250)
+
+/*
+ * A connection that has not received a packet from the peer after this
+ * many connection events fails to be established.
+ */
+#define BLE_LL_CONN_ESTABLISH_EVENTS        (6)
+
+/*
+ * Data length defaults and limits (connMaxTxOctets etc). Octets do not
+ * include the PDU header or MIC; time is on-air time in usecs.
+ */
+#define BLE_LL_CONN_SUPP_BYTES_MIN          (27)
+#define BLE_LL_CONN_SUPP_BYTES_MAX          (251)
+#define BLE_LL_CONN_SUPP_TIME_MIN           (328)
+#define BLE_LL_CONN_SUPP_TIME_MAX           (2120)
+
+/* Connection statistics */
+struct ble_ll_conn_stats
+{
+    uint32_t conns_created;
+    uint32_t conns_established;
+    uint32_t conn_ev_late;          /* Connection events skipped */
+    uint32_t conn_ev_missed;        /* Events started too late to run */
+    uint32_t conn_ev_no_rx;         /* Events in which nothing was received */
+    uint32_t cant_set_sched;
+    uint32_t no_free_conn_sm;
+    uint32_t rx_data_pdus;
+    uint32_t rx_data_bytes;
+    uint32_t rx_ctrl_pdus;
+    uint32_t rx_empty_pdus;
+    uint32_t rx_dup_pdus;
+    uint32_t rx_crc_errs;
+    uint32_t rx_bad_llid;
+    uint32_t rx_malformed_ctrl;
+    uint32_t tx_data_pdus;
+    uint32_t tx_data_bytes;
+    uint32_t tx_ctrl_pdus;
+    uint32_t tx_empty_pdus;
+    uint32_t tx_retransmits;
+    uint32_t tx_acl_errs;
+    uint32_t supervision_tmos;
+    uint32_t establish_fails;
+};
+extern struct ble_ll_conn_stats g_ble_ll_conn_stats;
+
+/*---- HCI ----*/
+/* Create a connection (LE create connection command) */
+int ble_ll_conn_create(uint8_t *cmdbuf);
+
+/* Cancel a connection being created */
+int ble_ll_conn_create_cancel(void);
+
+/* Disconnect a connection */
+int ble_ll_conn_hci_disconnect_cmd(uint8_t *cmdbuf);
+
+/* Set the data length of a connection */
+int ble_ll_conn_hci_set_data_len(uint8_t *cmdbuf, uint8_t *rspbuf);
+
+/* Queue an ACL data packet from the host for transmission */
+int ble_ll_conn_tx_pkt_in(struct os_mbuf *om, uint16_t handle, uint16_t len);
+
+/*--- Controller Internal API ---*/
+/* Initialize the connection module */
+void ble_ll_conn_init(void);
+
+/* Drop all connections without telling the host (HCI reset) */
+void ble_ll_conn_reset(void);
+
+/* Process the connection spawn (new connection) event */
+void ble_ll_conn_spawn_proc(void *arg);
+
+/* Process the end of a connection event */
+void ble_ll_conn_event_end_proc(void *arg);
+
+/* Called when a packet reception starts/ends in the connection state */
+int ble_ll_conn_rx_isr_start(struct os_mbuf *rxpdu);
+int ble_ll_conn_rx_isr_end(struct os_mbuf *rxpdu, uint8_t crcok);
+
+/* Process a data channel PDU received by the link layer */
+void ble_ll_conn_rx_data_pdu(struct os_mbuf *rxpdu, uint8_t crcok);
+
+/* Called when a packet reception starts/ends in the initiating state */
+int ble_ll_init_rx_pdu_start(uint8_t pdu_type);
+int ble_ll_init_rx_pdu_end(struct os_mbuf *rxpdu);
+
+/* Start a connection as a slave (advertiser received a CONNECT_REQ) */
+int ble_ll_conn_slave_start(uint8_t *rxbuf, uint32_t conn_req_end);
+
+/* Calculate a random access address */
+uint32_t ble_ll_conn_calc_access_addr(void);
+
+#endif /* H_BLE_LL_CONN_ */
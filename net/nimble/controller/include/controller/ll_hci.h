@@ -17,7 +17,11 @@
 #ifndef H_LL_HCI_
 #define H_LL_HCI_
 
-/* Define the number of data packets that the controller can store */
+/* 
+ * Define the number of data packets that the controller can store. This
+ * is what the host is told (LE read buffer size); the packets themselves
+ * come from the shared mbuf pool.
+ */
 #define BLE_LL_CFG_NUM_ACL_DATA_PKTS    (4)
 #define BLE_LL_CFG_ACL_DATA_PKT_LEN     (256)
 
@@ -30,13 +34,28 @@
 /* Initialize LL HCI */
 void ble_ll_hci_init(void);
 
+/* Restore the event masks and drop data from the host (HCI reset) */
+void ble_ll_hci_reset(void);
+
 /* HCI command processing function */
 void ble_ll_hci_cmd_proc(struct os_event *ev);
 
+/* HCI ACL data processing function */
+void ble_ll_hci_acl_proc(struct os_event *ev);
+
 /* Used to determine if the LE event is enabled or disabled */
 uint8_t ble_ll_hci_is_le_event_enabled(int bitpos);
 
+/* Used to determine if an event is enabled or disabled */
+uint8_t ble_ll_hci_is_event_enabled(int bitpos);
+
+/* Number of HCI commands the host may send now */
+uint8_t ble_ll_hci_get_num_cmd_pkts(void);
+
+/* Send a number of completed packets event to the host */
+int ble_ll_hci_num_comp_pkts_send(uint16_t handle, uint16_t num_pkts);
+
 /* Send event from controller to host */
-int ble_ll_hci_event_send(uint8_t *evbuf);
+int ble_ll_hci_event_send(struct os_mbuf *om);
 
 #endif /* H_LL_ADV_ */
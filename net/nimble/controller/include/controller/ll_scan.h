@@ -17,17 +17,31 @@
 #ifndef H_BLE_LL_SCAN_
 #define H_BLE_LL_SCAN_
 
-#define BLE_LL_SCAN_CFG_NUM_DUP_ADVS         (8)
-#define BLE_LL_SCAN_CFG_NUM_SCAN_RSP_ADVS    (8)
+/*
+ * Number of advertisers remembered by the scanner (for duplicate filtering and
+ * to avoid sending scan requests to advertisers that have already responded).
+ * The table is a hash of sets of BLE_LL_SCAN_CFG_ADV_WAYS entries; the least
+ * recently used entry in a set is replaced when the set is full. Both must be
+ * powers of 2.
+ */
+#define BLE_LL_SCAN_CFG_NUM_ADVS            (32)
+#define BLE_LL_SCAN_CFG_ADV_WAYS            (4)
 
-/* Dont allow more than 255 of these entries */
-#if BLE_LL_SCAN_CFG_NUM_DUP_ADVSS > 255
-    #error "Cannot have more than 255 duplicate entries!"
-#endif
-#if BLE_LL_SCAN_CFG_NUM_SCAN_RSP_ADVS > 255
-    #error "Cannot have more than 255 scan response entries!"
+#if (BLE_LL_SCAN_CFG_NUM_ADVS & (BLE_LL_SCAN_CFG_NUM_ADVS - 1)) || \
+    (BLE_LL_SCAN_CFG_ADV_WAYS & (BLE_LL_SCAN_CFG_ADV_WAYS - 1)) || \
+    (BLE_LL_SCAN_CFG_ADV_WAYS > BLE_LL_SCAN_CFG_NUM_ADVS)
+    #error "Scanner advertiser table sizes must be powers of 2!"
 #endif
 
+/*
+ * Advertising reports are batched into LE advertising report events. An event
+ * is sent to the host when it holds BLE_LL_SCAN_CFG_ADV_RPT_MAX reports, when
+ * the next report does not fit, at the end of a scan window, or when its
+ * oldest report has waited BLE_LL_SCAN_CFG_ADV_RPT_TMO os ticks.
+ */
+#define BLE_LL_SCAN_CFG_ADV_RPT_MAX         (8)
+#define BLE_LL_SCAN_CFG_ADV_RPT_TMO         (OS_TICKS_PER_SEC / 100)
+
 /* Maximum amount of scan response data in a scan response */
 #define BLE_SCAN_RSP_DATA_MAX_LEN       (31)
 
@@ -73,6 +87,9 @@ void ble_ll_scan_win_end_proc(void *arg);
 /* Initialize the scanner */
 void ble_ll_scan_init(void);
 
+/* Stop scanning and restore the defaults (HCI reset) */
+void ble_ll_scan_reset(void);
+
 /* Called when Link Layer starts to receive a PDU and is in scanning state */
 int ble_ll_scan_rx_pdu_start(uint8_t pdu_type, struct os_mbuf *rxpdu);
 
@@ -82,4 +99,18 @@ int ble_ll_scan_rx_pdu_end(uint8_t *rxbuf);
 /* Process a scan response PDU */
 void ble_ll_scan_rx_pdu_proc(uint8_t pdu_type, uint8_t *rxbuf, int8_t rssi);
 
+/* Returns 1 if a report has been sent for this advertiser and type of PDU */
+int ble_ll_scan_is_dup_adv(uint8_t pdu_type, uint8_t addr_type, uint8_t *addr);
+
+/* Set of the advertiser table an advertiser hashes to */
+int ble_ll_scan_adv_set_get(uint8_t *addr, uint8_t addr_type);
+
+/* Start/stop initiating (creating a connection) */
+struct hci_create_conn;
+int ble_ll_scan_initiator_start(struct hci_create_conn *hcc);
+void ble_ll_scan_initiator_stop(void);
+
+/* Called when the CONNECT_REQ has been sent */
+void ble_ll_scan_initiator_isr_stop(void);
+
 #endif /* H_LL_SCAN_ */
@@ -17,14 +17,31 @@
 #ifndef H_LL_SCHED_
 #define H_LL_SCHED_
 
-/* BLE scheduler errors */
-#define BLE_LL_SCHED_ERR_OVERLAP    (1)
+/* 
+ * Number of schedule items. Each connection keeps one queued for its next
+ * event; the scanner and the advertiser need one each and an advertising
+ * set two (extended and periodic advertising events).
+ */
+#define BLE_LL_CFG_SCHED_ITEMS      (48)
 
 /* Types of scheduler events */
 #define BLE_LL_SCHED_TYPE_ADV       (0)
 #define BLE_LL_SCHED_TYPE_SCAN      (1)
 #define BLE_LL_SCHED_TYPE_TX        (2)
 #define BLE_LL_SCHED_TYPE_RX        (3)
+#define BLE_LL_SCHED_TYPE_CONN      (4)
+#define BLE_LL_SCHED_TYPE_ADV_EXT   (5)
+#define BLE_LL_SCHED_TYPE_MAX       (6)
+
+/* 
+ * Priorities of scheduler events. When an item is due while another one is
+ * running, the item with the higher priority runs: the running item is 
+ * preempted or the due item waits until the running item is done. Between
+ * items of the same priority, the one with more losses runs.
+ */
+#define BLE_LL_SCHED_PRIO_SCAN      (0)
+#define BLE_LL_SCHED_PRIO_ADV       (1)
+#define BLE_LL_SCHED_PRIO_CONN      (2)
 
 /* Return values for schedule callback. */
 #define BLE_LL_SCHED_STATE_RUNNING  (0)
@@ -34,23 +51,66 @@
 struct ll_sched_item;
 typedef int (*sched_cb_func)(struct ll_sched_item *sch);
 
+/* 
+ * Preemption callback. Called (from the scheduler) when a running item is
+ * stopped to run an item of higher priority, or of the same priority that
+ * has lost more conflicts (see sched_losses). The item is freed after this
+ * returns. If NULL, the item cannot be preempted.
+ */
+typedef void (*sched_preempt_func)(struct ll_sched_item *sch);
+
+/* 
+ * Schedule item. start_time is when the item is due and end_time is the
+ * latest the item will be done. While running, the callback is called again
+ * at next_wakeup. sched_losses is set by the owner to the number of its
+ * items in a row that lost the radio to another item; it breaks ties
+ * between items of the same priority.
+ */
 struct ll_sched_item
 {
-    int             sched_type;
-    uint32_t        start_time;
-    uint32_t        end_time;
-    uint32_t        next_wakeup;
-    void            *cb_arg;
-    sched_cb_func   sched_cb;
-    TAILQ_ENTRY(ll_sched_item) link;
+    int                 sched_type;
+    uint8_t             sched_prio;
+    uint8_t             sched_state;
+    uint8_t             sched_losses;
+    uint16_t            heap_idx;
+    uint32_t            start_time;
+    uint32_t            end_time;
+    uint32_t            next_wakeup;
+    void                *cb_arg;
+    sched_cb_func       sched_cb;
+    sched_preempt_func  preempt_cb;
 };
 
+/* Scheduler statistics, kept per type of scheduler event */
+struct ll_sched_stats
+{
+    uint32_t runs;                  /* Items started */
+    uint32_t late_usecs_total;      /* Total of start - start_time */
+    uint32_t late_usecs_max;
+    uint32_t deferred;              /* Waited for a higher priority item */
+    uint32_t deferred_usecs_max;
+    uint32_t preempted;             /* Stopped to run another item */
+};
+extern struct ll_sched_stats g_ll_sched_stats[BLE_LL_SCHED_TYPE_MAX];
+
 /* Add an item to the schedule */
 int ll_sched_add(struct ll_sched_item *sch);
 
 /* Remove item(s) from schedule */
 int ll_sched_rmv(uint8_t sched_type);
 
+/* Remove one item from the schedule and free it */
+void ll_sched_rmv_item(struct ll_sched_item *sch);
+
+/* Change the next wakeup time of the running item */
+void ll_sched_wakeup(struct ll_sched_item *sch, uint32_t next_wakeup);
+
+/* Get the start time of the first queued item of at least a priority */
+int ll_sched_next_start(uint8_t sched_prio, uint32_t *start_time);
+
+/* Run the scheduler; the callback of the scheduler timer */
+void ll_sched_run(void *arg);
+
 /* Initialize the scheduler */
 int ll_sched_init(void);
 
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2015 Stack Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_BLE_PHY_SIM_
+#define H_BLE_PHY_SIM_
+
+#include <stdint.h>
+#include "controller/phy.h"
+
+/*
+ * Simulated PHY (sim arch only). Frames are exchanged over a simulated radio
+ * medium, either with peers in the same process (see ble_phy_sim_tx_cb and
+ * ble_phy_sim_rx_frame()) or with controllers in other processes sharing a
+ * medium directory.
+ */
+
+/* Maximum frame length (PDU header plus payload) */
+#define BLE_PHY_SIM_MAX_PDU_LEN     (257)
+
+/*
+ * Simulated medium configuration. Set this before ble_phy_init() is called
+ * (i.e. before the link layer task starts).
+ *
+ *  medium_path: Directory in which each controller sharing the medium binds
+ *  a unix domain socket. NULL for in-process peers only. All controllers on
+ *  a medium must use the same cputime frequency. Frames from other processes
+ *  are only seen when the medium is polled, so exchanges that must meet the
+ *  IFS (e.g. scan request/response) are only reliable with in-process peers.
+ *  path_loss_db: RSSI of a received frame is the transmit power less this.
+ *  rssi_jitter_db: Received RSSI varies randomly by up to +/- this much.
+ *  loss_pct: Percentage of frames that are lost (not received at all).
+ *  crc_err_pct: Percentage of received frames that fail the CRC check.
+ *  seed: Seed for the loss, CRC error and RSSI models.
+ */
+struct ble_phy_sim_cfg
+{
+    const char *medium_path;
+    uint8_t path_loss_db;
+    uint8_t rssi_jitter_db;
+    uint8_t loss_pct;
+    uint8_t crc_err_pct;
+    uint32_t seed;
+};
+extern struct ble_phy_sim_cfg g_ble_phy_sim_cfg;
+
+/* Medium statistics */
+struct ble_phy_sim_stats
+{
+    uint32_t rx_frames;         /* Frames placed on the medium by peers */
+    uint32_t rx_lost;           /* Frames dropped by the loss model */
+    uint32_t rx_missed;         /* Frames on our channel we were not ready for */
+    uint32_t rx_collisions;     /* Frames corrupted by an overlapping frame */
+    uint32_t rx_overruns;       /* Frames dropped; receive queue full */
+    uint32_t medium_errs;       /* Socket errors */
+    uint32_t chan_air_usecs[BLE_PHY_NUM_CHANS]; /* Air time seen per channel */
+};
+extern struct ble_phy_sim_stats g_ble_phy_sim_stats;
+
+/*
+ * In-process peer hook. If set, this is called for every frame transmitted,
+ * with the access address and the cputime at which the frame starts
+ * (preamble) and ends (last CRC bit). Context: interrupt (simulated).
+ */
+typedef void (*ble_phy_sim_tx_func)(uint8_t chan, uint32_t access_addr,
+                                    uint32_t start_time, uint32_t end_time,
+                                    uint8_t *pdu, int len, int8_t txpwr_dbm);
+extern ble_phy_sim_tx_func ble_phy_sim_tx_cb;
+
+/*
+ * Place a frame from an in-process peer on the medium. A frame is only
+ * received if the PHY is set to its channel and access address.
+ */
+int ble_phy_sim_rx_frame(uint8_t chan, uint32_t access_addr,
+                         uint32_t start_time, uint8_t *pdu, int len,
+                         int8_t txpwr_dbm);
+
+#endif /* H_BLE_PHY_SIM_ */
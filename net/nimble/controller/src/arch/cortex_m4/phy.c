@@ -49,6 +49,7 @@ struct ble_phy_obj
     uint8_t phy_chan;
     uint8_t phy_state;
     uint8_t phy_transition;
+    uint32_t phy_access_addr;
     struct os_mbuf *rxpdu;
 };
 struct ble_phy_obj g_ble_phy_data;
@@ -69,6 +70,13 @@ struct ble_phy_statistics
 
 struct ble_phy_statistics g_ble_phy_stats;
 
+/* 
+ * Transmit buffer for PDUs that are a chain of mbufs (e.g. an extended
+ * advertising header in front of the advertising data). The radio reads
+ * the PDU from one buffer, so the chain is copied here.
+ */
+static uint32_t g_ble_phy_txbuf[(BLE_LL_PDU_HDR_LEN + NRF52_MAXLEN + 3) / 4];
+
 /* XXX: TODO:
  
  * 1) Test the following to make sure it works: suppose an event is already
@@ -76,6 +84,27 @@ struct ble_phy_statistics g_ble_phy_stats;
  * interrupt with the event bit already set to 1  
  */
 
+/* 
+ * Logical addresses. Logical address 0 is the advertising access address;
+ * logical address 1 is the access address of the connection using a data 
+ * channel (set in ble_phy_setchan()).
+ */
+#define NRF52_LOG_ADDR_ADV      (0)
+#define NRF52_LOG_ADDR_DATA     (1)
+
+/* Select the logical address to transmit on and receive from */
+static void
+nrf52_addr_select(void)
+{
+    if (g_ble_phy_data.phy_chan < BLE_PHY_NUM_DATA_CHANS) {
+        NRF_RADIO->TXADDRESS = NRF52_LOG_ADDR_DATA;
+        NRF_RADIO->RXADDRESSES = 1 << NRF52_LOG_ADDR_DATA;
+    } else {
+        NRF_RADIO->TXADDRESS = NRF52_LOG_ADDR_ADV;
+        NRF_RADIO->RXADDRESSES = 1 << NRF52_LOG_ADDR_ADV;
+    }
+}
+
 /**
  * ble phy rxpdu get
  *  
@@ -129,6 +158,7 @@ ble_phy_isr(void)
     uint32_t state;
     uint32_t shortcuts;
     struct ble_mbuf_hdr *ble_hdr;
+    struct os_mbuf *rxpdu;
 
     /* Check for disabled event. This only happens for transmits now */
     irq_en = NRF_RADIO->INTENCLR;
@@ -144,8 +174,8 @@ ble_phy_isr(void)
 
         transition = g_ble_phy_data.phy_transition;
         if (transition == BLE_PHY_TRANSITION_TX_RX) {
-            /* XXX: for now, assume we receive on logical address 0 */
-            NRF_RADIO->RXADDRESSES = 1;
+            /* Receive on the address we transmitted on */
+            nrf52_addr_select();
 
             /* Debug check to make sure we go from tx to rx */
             assert((shortcuts & RADIO_SHORTS_DISABLED_RXEN_Msk) != 0);
@@ -230,13 +260,20 @@ ble_phy_isr(void)
         NRF_RADIO->INTENCLR = RADIO_INTENCLR_END_Msk;
 
         /* Construct BLE header before handing up */
-        ble_hdr = BLE_MBUF_HDR_PTR(g_ble_phy_data.rxpdu);
+        rxpdu = g_ble_phy_data.rxpdu;
+        ble_hdr = BLE_MBUF_HDR_PTR(rxpdu);
         ble_hdr->flags = 0;
         assert(NRF_RADIO->EVENTS_RSSIEND != 0);
         ble_hdr->rssi = -1 * NRF_RADIO->RSSISAMPLE;
         ble_hdr->channel = g_ble_phy_data.phy_chan;
         ble_hdr->crcok = (uint8_t)NRF_RADIO->CRCSTATUS;
 
+        /* 
+         * XXX: this is the time the interrupt is serviced, not the time the
+         * frame ended. Capture the END event with a timer instead.
+         */
+        ble_hdr->end_cputime = cputime_get32();
+
         /* Count PHY crc errors and valid packets */
         if (ble_hdr->crcok == 0) {
             ++g_ble_phy_stats.rx_crc_err;
@@ -244,15 +281,18 @@ ble_phy_isr(void)
             ++g_ble_phy_stats.rx_valid;
         }
 
+        /* 
+         * The receive PDU is handed to the Link Layer. This is done first
+         * as a transmit started from ll_rx_end() gets a new receive PDU.
+         */
+        g_ble_phy_data.rxpdu = NULL;
+
         /* Call Link Layer receive payload function */
-        rc = ll_rx_end(g_ble_phy_data.rxpdu, ble_hdr->crcok);
+        rc = ll_rx_end(rxpdu, ble_hdr->crcok);
         if (rc < 0) {
             /* Disable the PHY. */
             ble_phy_disable();
         }
-
-        /* The receive PDU has been handed to the Link Layer */
-        g_ble_phy_data.rxpdu = NULL;
     }
 
 phy_isr_exit:
@@ -345,11 +385,8 @@ ble_phy_rx(void)
         return BLE_PHY_ERR_NO_BUFS;
     }
 
-    /* XXX: Assume that this is an advertising channel */
-    NRF_RADIO->CRCINIT = BLE_LL_CRCINIT_ADV;
-
-    /* XXX: for now, assume we receive on logical address 0 */
-    NRF_RADIO->RXADDRESSES = 1;
+    /* Receive on the address of the channel */
+    nrf52_addr_select();
 
     /* Set packet pointer */
     NRF_RADIO->PACKETPTR = (uint32_t)g_ble_phy_data.rxpdu->om_data;
@@ -413,20 +450,20 @@ ble_phy_tx(struct os_mbuf *txpdu, uint8_t beg_trans, uint8_t end_trans)
     }
 
     /* Select tx address */
-    if (g_ble_phy_data.phy_chan < BLE_PHY_NUM_DATA_CHANS) {
-        /* XXX: fix this */
-        assert(0);
-        NRF_RADIO->TXADDRESS = 0;
-        NRF_RADIO->RXADDRESSES = 0;
-        NRF_RADIO->CRCINIT = 0;
-    } else {
-        NRF_RADIO->TXADDRESS = 0;
-        NRF_RADIO->RXADDRESSES = 1;
-        NRF_RADIO->CRCINIT = BLE_LL_CRCINIT_ADV;
-    }
+    nrf52_addr_select();
 
     /* Set radio transmit data pointer */
-    NRF_RADIO->PACKETPTR = (uint32_t)txpdu->om_data;
+    if (SLIST_NEXT(txpdu, om_next)) {
+        rc = os_mbuf_copydata(txpdu, 0, BLE_LL_PDU_HDR_LEN + txpdu->om_data[1],
+                              g_ble_phy_txbuf);
+        if (rc) {
+            ++g_ble_phy_stats.tx_fail;
+            return BLE_PHY_ERR_INV_PARAM;
+        }
+        NRF_RADIO->PACKETPTR = (uint32_t)g_ble_phy_txbuf;
+    } else {
+        NRF_RADIO->PACKETPTR = (uint32_t)txpdu->om_data;
+    }
 
     /* Clear the ready, end and disabled events */
     NRF_RADIO->EVENTS_READY = 0;
@@ -526,13 +563,18 @@ ble_phy_txpwr_get(void)
  *  
  * Thus, to get a logical frequency of 2402 MHz, you would program the 
  * FREQUENCY register to 2. 
+ *  
+ * Data channels use logical address 1, which is set to the access address 
+ * of the connection. Advertising channels always use logical address 0. 
  * 
  * @param chan This is the Data Channel Index or Advertising Channel index
+ * @param access_addr The access address used on the channel
+ * @param crcinit The CRC init value used on the channel
  * 
  * @return int 0: success; PHY error code otherwise
  */
 int
-ble_phy_setchan(uint8_t chan)
+ble_phy_setchan(uint8_t chan, uint32_t access_addr, uint32_t crcinit)
 {
     uint8_t freq;
 
@@ -543,11 +585,6 @@ ble_phy_setchan(uint8_t chan)
         return BLE_PHY_ERR_INV_PARAM;
     }
 
-    /* If the current channel is set, just return */
-    if (g_ble_phy_data.phy_chan == chan) {
-        return 0;
-    }
-
     /* Get correct nrf52 frequency */
     if (chan < BLE_PHY_NUM_DATA_CHANS) {
         if (chan < 11) {
@@ -571,9 +608,19 @@ ble_phy_setchan(uint8_t chan)
         }
     }
 
-    /* Set the frequency and the data whitening initial value */
+    /* Set the access address of a data channel */
+    if ((chan < BLE_PHY_NUM_DATA_CHANS) && 
+        (g_ble_phy_data.phy_access_addr != access_addr)) {
+        NRF_RADIO->BASE1 = (access_addr << 8) & 0xFFFFFF00;
+        NRF_RADIO->PREFIX0 = (NRF_RADIO->PREFIX0 & 0xFFFF00FF) |
+                             (((access_addr >> 24) & 0xFF) << 8);
+        g_ble_phy_data.phy_access_addr = access_addr;
+    }
+
+    /* Set the frequency, CRC init and the data whitening initial value */
     g_ble_phy_data.phy_chan = chan;
     NRF_RADIO->FREQUENCY = freq;
+    NRF_RADIO->CRCINIT = crcinit;
     NRF_RADIO->DATAWHITEIV = chan;
 
     return 0;
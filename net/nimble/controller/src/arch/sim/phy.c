@@ -0,0 +1,907 @@
+/**
+ * Copyright (c) 2015 Stack Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Simulated BLE PHY.
+ *
+ * Transmitted frames are placed on a simulated medium, stamped with the
+ * cputime at which they start and end on the air. A frame starts
+ * XCVR_TX_START_DELAY_USECS after the transmit request, or BLE_LL_IFS after
+ * the end of the received frame when going from rx to tx. Its length on the
+ * air is given by ll_pdu_tx_time_get().
+ *
+ * Frames from peers are queued in start time order and handed to the link
+ * layer (ll_rx_start() followed by ll_rx_end()) once their end time has
+ * passed. A frame is received only if the receiver was enabled, and on the
+ * frame's channel and access address, when the frame started. Frames that
+ * overlap on the same channel corrupt each other. On top of that, a
+ * configurable percentage of frames are lost or fail the CRC check, and the
+ * RSSI is derived from the transmit power, the path loss and a random jitter.
+ *
+ * The simulated "interrupts" are cputimer callbacks. On the native MCU these
+ * are polled, so the link layer sees events late; the timestamps, and thus
+ * the IFS timing and collisions, are unaffected.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "os/os.h"
+#include "nimble/ble.h"
+#include "controller/phy.h"
+#include "controller/phy_sim.h"
+#include "controller/ll.h"
+#include "hal/hal_cputime.h"
+
+/* Minimum tx power; the simulated radio supports the full BLE range */
+#define BLE_PHY_SIM_TX_PWR_MIN_DBM  (-20)
+
+/* Maximum number of peer frames queued on the medium */
+#define BLE_PHY_SIM_RXQ_LEN         (16)
+
+/* Medium socket poll interval while receiving */
+#define BLE_PHY_SIM_POLL_USECS      (1000)
+
+/* Identifies a frame on the medium socket */
+#define BLE_PHY_SIM_WIRE_MAGIC      (0x424c4546)
+
+/* BLE PHY data structure */
+struct ble_phy_obj
+{
+    int8_t  phy_txpwr_dbm;
+    uint8_t phy_chan;
+    uint8_t phy_state;
+    uint8_t phy_transition;
+    uint8_t phy_rx_txen;        /* LL asked to go from rx to tx */
+    int8_t  phy_rssi;           /* RSSI of last received frame */
+    uint32_t phy_access_addr;   /* Access address of the channel */
+    uint32_t phy_rx_start;      /* Receiver can lock on from this time on */
+    uint32_t phy_rx_end;        /* End of last received frame */
+    uint32_t phy_tx_end;        /* End of frame being transmitted */
+    int phy_sock;               /* Medium socket; -1 if none */
+    struct os_mbuf *rxpdu;
+};
+struct ble_phy_obj g_ble_phy_data;
+
+/* Statistics */
+struct ble_phy_statistics
+{
+    uint32_t tx_good;
+    uint32_t tx_fail;
+    uint32_t tx_bytes;
+    uint32_t rx_starts;
+    uint32_t rx_valid;
+    uint32_t rx_crc_err;
+    uint32_t phy_isrs;
+    uint32_t radio_state_errs;
+    uint32_t no_bufs;
+};
+
+struct ble_phy_statistics g_ble_phy_stats;
+
+struct ble_phy_sim_cfg g_ble_phy_sim_cfg = {
+    .medium_path = NULL,
+    .path_loss_db = 60,
+    .rssi_jitter_db = 4,
+    .loss_pct = 0,
+    .crc_err_pct = 0,
+    .seed = 1,
+};
+
+struct ble_phy_sim_stats g_ble_phy_sim_stats;
+
+ble_phy_sim_tx_func ble_phy_sim_tx_cb;
+
+/* A frame on the medium. The wire header is sent as is over the socket. */
+struct ble_phy_sim_wire
+{
+    uint32_t sw_magic;
+    uint32_t sw_access_addr;
+    uint32_t sw_start;
+    uint8_t  sw_chan;
+    int8_t   sw_txpwr_dbm;
+    uint16_t sw_len;
+    uint8_t  sw_pdu[BLE_PHY_SIM_MAX_PDU_LEN];
+};
+
+struct ble_phy_sim_frame
+{
+    struct ble_phy_sim_wire sf_wire;
+    uint32_t sf_end;
+    TAILQ_ENTRY(ble_phy_sim_frame) sf_link;
+};
+
+#define BLE_PHY_SIM_WIRE_HDR_LEN    \
+    (sizeof(struct ble_phy_sim_wire) - BLE_PHY_SIM_MAX_PDU_LEN)
+
+#define BLE_PHY_SIM_POOL_SIZE       \
+    OS_MEMPOOL_SIZE(BLE_PHY_SIM_RXQ_LEN, sizeof(struct ble_phy_sim_frame))
+
+static struct os_mempool g_ble_phy_sim_pool;
+static os_membuf_t g_ble_phy_sim_mem[BLE_PHY_SIM_POOL_SIZE];
+
+/* Frames from peers, in start time order */
+static TAILQ_HEAD(, ble_phy_sim_frame) g_ble_phy_sim_rxq;
+
+/* End of the most recent frame on each channel */
+static uint32_t g_ble_phy_sim_chan_end[BLE_PHY_NUM_CHANS];
+
+static struct cpu_timer g_ble_phy_sim_timer;
+static uint32_t g_ble_phy_sim_rand;
+static char g_ble_phy_sim_sock_name[32];
+
+/**
+ * ble phy rxpdu get
+ *
+ * Gets a mbuf for PDU reception.
+ *
+ * @return struct os_mbuf* Pointer to retrieved mbuf or NULL if none available
+ */
+static struct os_mbuf *
+ble_phy_rxpdu_get(void)
+{
+    struct os_mbuf *m;
+
+    m = g_ble_phy_data.rxpdu;
+    if (m == NULL) {
+        m = os_mbuf_get_pkthdr(&g_mbuf_pool);
+        if (!m) {
+            ++g_ble_phy_stats.no_bufs;
+        } else {
+            g_ble_phy_data.rxpdu = m;
+        }
+    }
+
+    return m;
+}
+
+/* xorshift32; deterministic for a given seed */
+static uint32_t
+ble_phy_sim_rand(void)
+{
+    uint32_t x;
+
+    x = g_ble_phy_sim_rand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    g_ble_phy_sim_rand = x;
+
+    return x;
+}
+
+static int
+ble_phy_sim_chance(uint8_t pct)
+{
+    if (pct == 0) {
+        return 0;
+    }
+    return (ble_phy_sim_rand() % 100) < pct;
+}
+
+static int8_t
+ble_phy_sim_rssi(int8_t txpwr_dbm)
+{
+    int jitter;
+    int rssi;
+
+    rssi = txpwr_dbm - g_ble_phy_sim_cfg.path_loss_db;
+    jitter = g_ble_phy_sim_cfg.rssi_jitter_db;
+    if (jitter != 0) {
+        rssi += (int)(ble_phy_sim_rand() % (2 * jitter + 1)) - jitter;
+    }
+    if (rssi < -127) {
+        rssi = -127;
+    }
+
+    return rssi;
+}
+
+/**
+ * Opens the medium socket and binds it in the medium directory.
+ *
+ * @return int 0: success; -1 on failure.
+ */
+static int
+ble_phy_sim_medium_open(void)
+{
+    struct sockaddr_un addr;
+    int sock;
+    int rc;
+
+    sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    snprintf(g_ble_phy_sim_sock_name, sizeof g_ble_phy_sim_sock_name,
+             "%d", (int)getpid());
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    rc = snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%s",
+                  g_ble_phy_sim_cfg.medium_path, g_ble_phy_sim_sock_name);
+    if (rc >= sizeof addr.sun_path) {
+        goto err;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        goto err;
+    }
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != 0) {
+        goto err;
+    }
+
+    g_ble_phy_data.phy_sock = sock;
+    return 0;
+
+err:
+    close(sock);
+    return -1;
+}
+
+/**
+ * Sends a frame to every other controller on the medium. Sockets nobody is
+ * bound to any more (left behind by controllers that exited) are removed.
+ *
+ * @param wire Frame to send.
+ */
+static void
+ble_phy_sim_medium_send(struct ble_phy_sim_wire *wire)
+{
+    struct sockaddr_un addr;
+    struct dirent *ent;
+    DIR *dir;
+    int rc;
+
+    dir = opendir(g_ble_phy_sim_cfg.medium_path);
+    if (dir == NULL) {
+        ++g_ble_phy_sim_stats.medium_errs;
+        return;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' ||
+            !strcmp(ent->d_name, g_ble_phy_sim_sock_name)) {
+            continue;
+        }
+
+        rc = snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%s",
+                      g_ble_phy_sim_cfg.medium_path, ent->d_name);
+        if (rc >= sizeof addr.sun_path) {
+            continue;
+        }
+
+        rc = sendto(g_ble_phy_data.phy_sock, wire,
+                    BLE_PHY_SIM_WIRE_HDR_LEN + wire->sw_len, 0,
+                    (struct sockaddr *)&addr, sizeof addr);
+        if (rc < 0) {
+            if (errno == ECONNREFUSED) {
+                unlink(addr.sun_path);
+            } else if (errno != EAGAIN) {
+                ++g_ble_phy_sim_stats.medium_errs;
+            }
+        }
+    }
+
+    closedir(dir);
+}
+
+/**
+ * Sets the timer for the next event: the end of our transmission, the end
+ * of the first queued frame or, while receiving from the medium socket, the
+ * next poll.
+ */
+static void
+ble_phy_sim_timer_set(void)
+{
+    struct ble_phy_sim_frame *frame;
+    uint32_t now;
+    uint32_t next;
+    int set;
+
+    now = cputime_get32();
+    set = 0;
+    next = 0;
+
+    if (g_ble_phy_data.phy_state == BLE_PHY_STATE_TX) {
+        next = g_ble_phy_data.phy_tx_end;
+        set = 1;
+    }
+
+    frame = TAILQ_FIRST(&g_ble_phy_sim_rxq);
+    if (frame != NULL) {
+        if (!set || (int32_t)(frame->sf_end - next) < 0) {
+            next = frame->sf_end;
+            set = 1;
+        }
+    }
+
+    if ((g_ble_phy_data.phy_sock >= 0) &&
+        (g_ble_phy_data.phy_state == BLE_PHY_STATE_RX)) {
+        if (!set || (int32_t)(next - now) >
+                    (int32_t)cputime_usecs_to_ticks(BLE_PHY_SIM_POLL_USECS)) {
+            next = now + cputime_usecs_to_ticks(BLE_PHY_SIM_POLL_USECS);
+            set = 1;
+        }
+    }
+
+    if (set) {
+        cputime_timer_start(&g_ble_phy_sim_timer, next);
+    } else {
+        cputime_timer_stop(&g_ble_phy_sim_timer);
+    }
+}
+
+/**
+ * Places a frame on the medium, in start time order.
+ *
+ * @return int 0: success; PHY error code otherwise
+ */
+static int
+ble_phy_sim_enqueue(struct ble_phy_sim_wire *wire)
+{
+    os_sr_t sr;
+    uint16_t usecs;
+    struct ble_phy_sim_frame *frame;
+    struct ble_phy_sim_frame *entry;
+
+    if ((wire->sw_chan >= BLE_PHY_NUM_CHANS) ||
+        (wire->sw_len < BLE_LL_PDU_HDR_LEN) ||
+        (wire->sw_len > BLE_PHY_SIM_MAX_PDU_LEN)) {
+        return BLE_PHY_ERR_INV_PARAM;
+    }
+
+    OS_ENTER_CRITICAL(sr);
+
+    frame = os_memblock_get(&g_ble_phy_sim_pool);
+    if (frame == NULL) {
+        ++g_ble_phy_sim_stats.rx_overruns;
+        OS_EXIT_CRITICAL(sr);
+        return BLE_PHY_ERR_NO_BUFS;
+    }
+
+    memcpy(&frame->sf_wire, wire, BLE_PHY_SIM_WIRE_HDR_LEN + wire->sw_len);
+    usecs = ll_pdu_tx_time_get(wire->sw_len);
+    frame->sf_end = wire->sw_start + cputime_usecs_to_ticks(usecs);
+
+    ++g_ble_phy_sim_stats.rx_frames;
+    g_ble_phy_sim_stats.chan_air_usecs[wire->sw_chan] += usecs;
+
+    TAILQ_FOREACH(entry, &g_ble_phy_sim_rxq, sf_link) {
+        if ((int32_t)(wire->sw_start - entry->sf_wire.sw_start) < 0) {
+            TAILQ_INSERT_BEFORE(entry, frame, sf_link);
+            break;
+        }
+    }
+    if (!entry) {
+        TAILQ_INSERT_TAIL(&g_ble_phy_sim_rxq, frame, sf_link);
+    }
+
+    ble_phy_sim_timer_set();
+
+    OS_EXIT_CRITICAL(sr);
+
+    return 0;
+}
+
+/* Reads all frames waiting on the medium socket */
+static void
+ble_phy_sim_medium_poll(void)
+{
+    struct ble_phy_sim_wire wire;
+    int rc;
+
+    while (1) {
+        rc = recv(g_ble_phy_data.phy_sock, &wire, sizeof wire, 0);
+        if (rc < 0) {
+            if (errno != EAGAIN) {
+                ++g_ble_phy_sim_stats.medium_errs;
+            }
+            break;
+        }
+
+        if ((rc < BLE_PHY_SIM_WIRE_HDR_LEN) ||
+            (wire.sw_magic != BLE_PHY_SIM_WIRE_MAGIC) ||
+            (rc != BLE_PHY_SIM_WIRE_HDR_LEN + wire.sw_len)) {
+            ++g_ble_phy_sim_stats.medium_errs;
+            continue;
+        }
+
+        ble_phy_sim_enqueue(&wire);
+    }
+}
+
+/* Our transmission has ended; perform the requested transition */
+static void
+ble_phy_sim_tx_end(void)
+{
+    if ((g_ble_phy_data.phy_transition == BLE_PHY_TRANSITION_TX_RX) &&
+        (g_ble_phy_data.rxpdu != NULL)) {
+        g_ble_phy_data.phy_state = BLE_PHY_STATE_RX;
+        g_ble_phy_data.phy_rx_start = g_ble_phy_data.phy_tx_end;
+    } else {
+        g_ble_phy_data.phy_state = BLE_PHY_STATE_IDLE;
+    }
+    g_ble_phy_data.phy_transition = BLE_PHY_TRANSITION_NONE;
+}
+
+/**
+ * Processes a frame whose end time has passed: decides whether it was
+ * received and, if so, hands it to the link layer.
+ *
+ * @param frame The frame; removed from the medium queue.
+ */
+static void
+ble_phy_sim_rx(struct ble_phy_sim_frame *frame)
+{
+    int rc;
+    int collision;
+    uint8_t chan;
+    uint8_t crcok;
+    struct ble_phy_sim_frame *other;
+    struct ble_mbuf_hdr *ble_hdr;
+    struct os_mbuf *rxpdu;
+
+    chan = frame->sf_wire.sw_chan;
+
+    /* An earlier frame still on the air, or a later one starting before
+     * this one ends, corrupts this frame.
+     */
+    collision = (int32_t)(frame->sf_wire.sw_start -
+                          g_ble_phy_sim_chan_end[chan]) < 0;
+    TAILQ_FOREACH(other, &g_ble_phy_sim_rxq, sf_link) {
+        if ((int32_t)(other->sf_wire.sw_start - frame->sf_end) >= 0) {
+            break;
+        }
+        if (other->sf_wire.sw_chan == chan) {
+            collision = 1;
+        }
+    }
+    if ((int32_t)(frame->sf_end - g_ble_phy_sim_chan_end[chan]) > 0) {
+        g_ble_phy_sim_chan_end[chan] = frame->sf_end;
+    }
+
+    if ((g_ble_phy_data.phy_state != BLE_PHY_STATE_RX) ||
+        (g_ble_phy_data.phy_chan != chan) ||
+        (g_ble_phy_data.phy_access_addr != frame->sf_wire.sw_access_addr)) {
+        return;
+    }
+
+    /* We must be listening (and not busy) when the preamble arrives */
+    if ((int32_t)(frame->sf_wire.sw_start -
+                  g_ble_phy_data.phy_rx_start) < 0) {
+        ++g_ble_phy_sim_stats.rx_missed;
+        return;
+    }
+
+    if (ble_phy_sim_chance(g_ble_phy_sim_cfg.loss_pct)) {
+        ++g_ble_phy_sim_stats.rx_lost;
+        return;
+    }
+
+    crcok = !ble_phy_sim_chance(g_ble_phy_sim_cfg.crc_err_pct);
+    if (collision) {
+        ++g_ble_phy_sim_stats.rx_collisions;
+        crcok = 0;
+    }
+
+    rxpdu = ble_phy_rxpdu_get();
+    if (rxpdu == NULL) {
+        return;
+    }
+    memcpy(rxpdu->om_data, frame->sf_wire.sw_pdu, frame->sf_wire.sw_len);
+
+    /* Call Link Layer receive start function */
+    ++g_ble_phy_stats.rx_starts;
+    rc = ll_rx_start(rxpdu);
+    if (rc < 0) {
+        ble_phy_disable();
+        return;
+    }
+    g_ble_phy_data.phy_rx_txen = (rc > 0);
+
+    /* Construct BLE header before handing up */
+    ble_hdr = BLE_MBUF_HDR_PTR(rxpdu);
+    ble_hdr->flags = 0;
+    ble_hdr->rssi = ble_phy_sim_rssi(frame->sf_wire.sw_txpwr_dbm);
+    ble_hdr->channel = chan;
+    ble_hdr->crcok = crcok;
+    ble_hdr->end_cputime = frame->sf_end;
+    g_ble_phy_data.phy_rssi = ble_hdr->rssi;
+
+    /* Count PHY crc errors and valid packets */
+    if (crcok == 0) {
+        ++g_ble_phy_stats.rx_crc_err;
+    } else {
+        ++g_ble_phy_stats.rx_valid;
+    }
+
+    /*
+     * The radio disables itself at the end of the frame. The link layer
+     * may start a transmit (rx to tx) from ll_rx_end().
+     */
+    g_ble_phy_data.phy_state = BLE_PHY_STATE_IDLE;
+    g_ble_phy_data.phy_rx_end = frame->sf_end;
+    g_ble_phy_data.phy_rx_start = frame->sf_end;
+
+    /*
+     * The receive PDU is handed to the Link Layer. This is done first as a
+     * transmit started from ll_rx_end() gets a new receive PDU.
+     */
+    g_ble_phy_data.rxpdu = NULL;
+
+    /* Call Link Layer receive payload function */
+    rc = ll_rx_end(rxpdu, crcok);
+    if (rc < 0) {
+        /* Disable the PHY. */
+        ble_phy_disable();
+    }
+}
+
+/**
+ * The simulated radio interrupt. Processes every event on the medium whose
+ * time has passed, oldest first.
+ *
+ * Context: interrupt (cputimer)
+ */
+static void
+ble_phy_sim_isr(void *arg)
+{
+    uint32_t now;
+    struct ble_phy_sim_frame *frame;
+
+    ++g_ble_phy_stats.phy_isrs;
+
+    if (g_ble_phy_data.phy_sock >= 0) {
+        ble_phy_sim_medium_poll();
+    }
+
+    now = cputime_get32();
+    while (1) {
+        frame = TAILQ_FIRST(&g_ble_phy_sim_rxq);
+
+        if ((g_ble_phy_data.phy_state == BLE_PHY_STATE_TX) &&
+            ((int32_t)(now - g_ble_phy_data.phy_tx_end) >= 0) &&
+            ((frame == NULL) ||
+             ((int32_t)(frame->sf_end - g_ble_phy_data.phy_tx_end) >= 0))) {
+            ble_phy_sim_tx_end();
+            continue;
+        }
+
+        if ((frame == NULL) || ((int32_t)(now - frame->sf_end) < 0)) {
+            break;
+        }
+
+        TAILQ_REMOVE(&g_ble_phy_sim_rxq, frame, sf_link);
+        ble_phy_sim_rx(frame);
+        os_memblock_put(&g_ble_phy_sim_pool, frame);
+    }
+
+    ble_phy_sim_timer_set();
+}
+
+/**
+ * ble phy sim rx frame
+ *
+ * Places a frame from an in-process peer on the medium. The frame is
+ * received (or not) once its end time has passed.
+ *
+ * @param chan          Channel the frame is sent on.
+ * @param access_addr   Access address of the frame.
+ * @param start_time    cputime at which the frame starts.
+ * @param pdu           PDU header and payload.
+ * @param len           Length of 'pdu'.
+ * @param txpwr_dbm     Peer transmit power.
+ *
+ * @return int 0: success; PHY error code otherwise
+ */
+int
+ble_phy_sim_rx_frame(uint8_t chan, uint32_t access_addr, uint32_t start_time,
+                     uint8_t *pdu, int len, int8_t txpwr_dbm)
+{
+    struct ble_phy_sim_wire wire;
+
+    if ((len < BLE_LL_PDU_HDR_LEN) || (len > BLE_PHY_SIM_MAX_PDU_LEN)) {
+        return BLE_PHY_ERR_INV_PARAM;
+    }
+
+    wire.sw_magic = BLE_PHY_SIM_WIRE_MAGIC;
+    wire.sw_access_addr = access_addr;
+    wire.sw_start = start_time;
+    wire.sw_chan = chan;
+    wire.sw_txpwr_dbm = txpwr_dbm;
+    wire.sw_len = len;
+    memcpy(wire.sw_pdu, pdu, len);
+
+    return ble_phy_sim_enqueue(&wire);
+}
+
+/**
+ * ble phy init
+ *
+ * Initialize the PHY. This is expected to be called once.
+ *
+ * @return int 0: success; PHY error code otherwise
+ */
+int
+ble_phy_init(void)
+{
+    os_error_t err;
+    uint32_t now;
+    int i;
+
+    /* Set phy channel to an invalid channel so first set channel works */
+    g_ble_phy_data.phy_chan = BLE_PHY_NUM_CHANS;
+    g_ble_phy_data.phy_state = BLE_PHY_STATE_IDLE;
+    g_ble_phy_data.phy_sock = -1;
+    g_ble_phy_data.rxpdu = NULL;
+
+    err = os_mempool_init(&g_ble_phy_sim_pool, BLE_PHY_SIM_RXQ_LEN,
+                          sizeof(struct ble_phy_sim_frame),
+                          g_ble_phy_sim_mem, "ble_phy_sim");
+    if (err != OS_OK) {
+        return BLE_PHY_ERR_INIT;
+    }
+    TAILQ_INIT(&g_ble_phy_sim_rxq);
+
+    now = cputime_get32();
+    for (i = 0; i < BLE_PHY_NUM_CHANS; i++) {
+        g_ble_phy_sim_chan_end[i] = now;
+    }
+
+    g_ble_phy_sim_rand = g_ble_phy_sim_cfg.seed;
+    if (g_ble_phy_sim_rand == 0) {
+        g_ble_phy_sim_rand = 1;
+    }
+
+    cputime_timer_init(&g_ble_phy_sim_timer, ble_phy_sim_isr, NULL);
+
+    if (g_ble_phy_sim_cfg.medium_path != NULL) {
+        if (ble_phy_sim_medium_open() != 0) {
+            return BLE_PHY_ERR_INIT;
+        }
+    }
+
+    return 0;
+}
+
+int
+ble_phy_rx(void)
+{
+    /* Radio must be disabled */
+    if (g_ble_phy_data.phy_state != BLE_PHY_STATE_IDLE) {
+        ble_phy_disable();
+        ++g_ble_phy_stats.radio_state_errs;
+        return BLE_PHY_ERR_RADIO_STATE;
+    }
+
+    /* If no pdu, get one */
+    if (ble_phy_rxpdu_get() == NULL) {
+        return BLE_PHY_ERR_NO_BUFS;
+    }
+
+    g_ble_phy_data.phy_rx_start = cputime_get32() +
+        cputime_usecs_to_ticks(XCVR_RX_START_DELAY_USECS);
+    g_ble_phy_data.phy_rx_txen = 0;
+    g_ble_phy_data.phy_state = BLE_PHY_STATE_RX;
+
+    ble_phy_sim_timer_set();
+
+    return 0;
+}
+
+int
+ble_phy_tx(struct os_mbuf *txpdu, uint8_t beg_trans, uint8_t end_trans)
+{
+    uint8_t chan;
+    uint16_t usecs;
+    struct ble_phy_sim_wire wire;
+
+    /* Better have a pdu! */
+    assert(txpdu != NULL);
+
+    if (beg_trans == BLE_PHY_TRANSITION_RX_TX) {
+        /* The link layer must have asked for this when the rx started */
+        if (!g_ble_phy_data.phy_rx_txen ||
+            (g_ble_phy_data.phy_state != BLE_PHY_STATE_IDLE)) {
+            ble_phy_disable();
+            ++g_ble_phy_stats.radio_state_errs;
+            return BLE_PHY_ERR_RADIO_STATE;
+        }
+        wire.sw_start = g_ble_phy_data.phy_rx_end +
+                        cputime_usecs_to_ticks(BLE_LL_IFS);
+    } else {
+        /* Radio should be in disabled state */
+        if (g_ble_phy_data.phy_state != BLE_PHY_STATE_IDLE) {
+            ble_phy_disable();
+            ++g_ble_phy_stats.radio_state_errs;
+            return BLE_PHY_ERR_RADIO_STATE;
+        }
+        wire.sw_start = cputime_get32() +
+                        cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+    }
+    g_ble_phy_data.phy_rx_txen = 0;
+
+    chan = g_ble_phy_data.phy_chan;
+    if (chan >= BLE_PHY_NUM_CHANS) {
+        ++g_ble_phy_stats.tx_fail;
+        return BLE_PHY_ERR_INV_PARAM;
+    }
+
+    /* 
+     * The PDU header holds the payload length. The PDU may be a chain of
+     * mbufs (e.g. a header in front of advertising data); the radio
+     * gathers it as it goes out.
+     */
+    wire.sw_magic = BLE_PHY_SIM_WIRE_MAGIC;
+    wire.sw_access_addr = g_ble_phy_data.phy_access_addr;
+    wire.sw_chan = chan;
+    wire.sw_txpwr_dbm = g_ble_phy_data.phy_txpwr_dbm;
+    wire.sw_len = BLE_LL_PDU_HDR_LEN + txpdu->om_data[1];
+    if (os_mbuf_copydata(txpdu, 0, wire.sw_len, wire.sw_pdu)) {
+        ++g_ble_phy_stats.tx_fail;
+        return BLE_PHY_ERR_INV_PARAM;
+    }
+
+    usecs = ll_pdu_tx_time_get(wire.sw_len);
+    g_ble_phy_data.phy_tx_end = wire.sw_start + cputime_usecs_to_ticks(usecs);
+    g_ble_phy_sim_stats.chan_air_usecs[chan] += usecs;
+
+    /* If we are going into receive after this, try to get a buffer. */
+    if (end_trans == BLE_PHY_TRANSITION_TX_RX) {
+        ble_phy_rxpdu_get();
+    }
+
+    /* Set the PHY transition */
+    g_ble_phy_data.phy_transition = end_trans;
+    g_ble_phy_data.phy_state = BLE_PHY_STATE_TX;
+    ++g_ble_phy_stats.tx_good;
+    g_ble_phy_stats.tx_bytes += OS_MBUF_PKTHDR(txpdu)->omp_len;
+
+    /* Put the frame on the medium */
+    if (ble_phy_sim_tx_cb != NULL) {
+        ble_phy_sim_tx_cb(chan, wire.sw_access_addr, wire.sw_start,
+                          g_ble_phy_data.phy_tx_end, wire.sw_pdu, wire.sw_len,
+                          wire.sw_txpwr_dbm);
+    }
+    if (g_ble_phy_data.phy_sock >= 0) {
+        ble_phy_sim_medium_send(&wire);
+    }
+
+    ble_phy_sim_timer_set();
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * ble phy txpwr set
+ *
+ * Set the transmit output power (in dBm).
+ *
+ * NOTE: If the output power specified is within the BLE limits but below
+ * the simulated radio's minimum, we "rail" the power level.
+ *
+ * @param dbm Power output in dBm.
+ *
+ * @return int 0: success; anything else is an error
+ */
+int
+ble_phy_txpwr_set(int dbm)
+{
+    /* Check valid range */
+    assert(dbm <= BLE_PHY_MAX_PWR_DBM);
+
+    /* "Rail" power level if outside supported range */
+    if (dbm < BLE_PHY_SIM_TX_PWR_MIN_DBM) {
+        dbm = BLE_PHY_SIM_TX_PWR_MIN_DBM;
+    }
+
+    g_ble_phy_data.phy_txpwr_dbm = dbm;
+
+    return 0;
+}
+
+/**
+ * ble phy txpwr get
+ *
+ * Get the transmit power.
+ *
+ * @return int  The current PHY transmit power, in dBm
+ */
+int
+ble_phy_txpwr_get(void)
+{
+    return g_ble_phy_data.phy_txpwr_dbm;
+}
+
+/**
+ * ble phy rssi get
+ *
+ * @return int The RSSI of the last received frame, in dBm.
+ */
+int
+ble_phy_rssi_get(void)
+{
+    return g_ble_phy_data.phy_rssi;
+}
+
+/**
+ * ble phy setchan
+ *
+ * Sets the logical frequency of the transceiver. The input parameter is the
+ * BLE channel index (0 to 39, inclusive). Only frames with the given access
+ * address are received. The simulated medium does not model the CRC, so the
+ * CRC init value is not used.
+ *
+ * @param chan This is the Data Channel Index or Advertising Channel index
+ * @param access_addr The access address used on the channel
+ * @param crcinit The CRC init value used on the channel
+ *
+ * @return int 0: success; PHY error code otherwise
+ */
+int
+ble_phy_setchan(uint8_t chan, uint32_t access_addr, uint32_t crcinit)
+{
+    assert(chan < BLE_PHY_NUM_CHANS);
+
+    /* Check for valid channel range */
+    if (chan >= BLE_PHY_NUM_CHANS) {
+        return BLE_PHY_ERR_INV_PARAM;
+    }
+
+    g_ble_phy_data.phy_chan = chan;
+    g_ble_phy_data.phy_access_addr = access_addr;
+
+    return 0;
+}
+
+/**
+ * Disable the PHY. This will do the following:
+ *  -> Cancel any pending transition.
+ *  -> Sets phy state to idle.
+ *
+ * A frame that is being transmitted has already been placed on the medium
+ * and is not recalled.
+ */
+void
+ble_phy_disable(void)
+{
+    g_ble_phy_data.phy_transition = BLE_PHY_TRANSITION_NONE;
+    g_ble_phy_data.phy_rx_txen = 0;
+    g_ble_phy_data.phy_state = BLE_PHY_STATE_IDLE;
+}
+
+/**
+ * Return the phy state
+ *
+ * @return int The current PHY state.
+ */
+int
+ble_phy_state_get(void)
+{
+    return g_ble_phy_data.phy_state;
+}
@@ -0,0 +1,2044 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "os/os.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "controller/phy.h"
+#include "controller/ll.h"
+#include "controller/ll_adv.h"
+#include "controller/ll_adv_ext.h"
+#include "controller/ll_sched.h"
+#include "controller/ll_hci.h"
+#include "controller/ll_conn.h"
+#include "controller/ll_chan.h"
+#include "hal/hal_cputime.h"
+
+/* XXX: things to do
+ *  1) Connectable and scannable extended advertising (AUX_CONNECT_REQ,
+ *  AUX_SCAN_REQ) and legacy PDUs through the extended commands.
+ *  2) LE 2M and Coded PHYs. Everything is sent on the 1M PHY.
+ *  3) Periodic advertising without extended advertising (it is only sent
+ *  while its advertising set is enabled).
+ *  4) Extended scanning.
+ */
+
+/*
+ * Each advertising set needs one schedule item for its extended advertising
+ * event and one for its periodic advertising event.
+ */
+#if (BLE_LL_CFG_SCHED_ITEMS < \
+     (BLE_LL_CONN_CFG_MAX_CONNS + 2 + (2 * BLE_LL_ADV_EXT_CFG_MAX_SETS)))
+    #error "Not enough schedule items for the number of advertising sets!"
+#endif
+
+/*
+ * Advertising data per PDU. The data of a set is kept as a chain of mbufs
+ * with one mbuf per PDU, so each mbuf holds no more than what fits in the
+ * PDU after the largest extended header the PDU can have:
+ *  AUX_ADV_IND: AdvA, ADI, AuxPtr, SyncInfo and TxPower (32 bytes)
+ *  AUX_CHAIN_IND: ADI and AuxPtr (7 bytes)
+ *  AUX_SYNC_IND: AuxPtr and TxPower (6 bytes)
+ *  AUX_CHAIN_IND (periodic): AuxPtr (5 bytes)
+ */
+#define BLE_LL_ADV_EXT_AUX_DATA_MAX     (223)
+#define BLE_LL_ADV_EXT_CHAIN_DATA_MAX   (248)
+#define BLE_LL_ADV_PER_SYNC_DATA_MAX    (249)
+#define BLE_LL_ADV_PER_CHAIN_DATA_MAX   (250)
+
+/* Worst case extended header (with its length byte) of the aux PDUs */
+#define BLE_LL_ADV_EXT_AUX_HDR_MAX      (32)
+#define BLE_LL_ADV_EXT_CHAIN_HDR_MAX    (7)
+#define BLE_LL_ADV_PER_SYNC_HDR_MAX     (6)
+
+/*
+ * How late a periodic advertising event may start. Scanners synchronized
+ * to the train widen their receive window by this much; later than this,
+ * the event is skipped.
+ */
+#define BLE_LL_ADV_PER_JITTER_USECS     (16)
+
+/* PDUs of an advertising event (the next one to send) */
+#define BLE_LL_ADV_EXT_PDU_PRIM         (0)     /* ADV_EXT_IND */
+#define BLE_LL_ADV_EXT_PDU_AUX          (1)     /* AUX_ADV_IND */
+#define BLE_LL_ADV_EXT_PDU_CHAIN        (2)     /* AUX_CHAIN_IND */
+#define BLE_LL_ADV_EXT_PDU_SYNC         (3)     /* AUX_SYNC_IND */
+#define BLE_LL_ADV_EXT_PDU_SYNC_CHAIN   (4)     /* AUX_CHAIN_IND (periodic) */
+#define BLE_LL_ADV_EXT_PDU_END          (5)     /* Last PDU is on the air */
+
+/*
+ * Advertising (or periodic advertising) data. New data set by the host
+ * while the set is advertising waits for the end of the current event.
+ *  om: one mbuf per PDU (see BLE_LL_ADV_EXT_AUX_DATA_MAX).
+ *  om_new: data being received (fragments) or waiting to replace om.
+ */
+struct ble_ll_adv_ext_data
+{
+    uint8_t frag;
+    uint8_t pending;
+    uint16_t len;
+    uint16_t new_len;
+    struct os_mbuf *om;
+    struct os_mbuf *om_new;
+};
+
+/*
+ * An advertising event (or periodic advertising event) in progress. The
+ * PDU header is built in the header mbuf just before it is sent, and the
+ * data mbuf of the PDU is chained to it: the data is never copied.
+ */
+struct ble_ll_adv_ext_ev
+{
+    uint8_t active;
+    uint8_t pdu;
+    uint8_t chan;
+    uint8_t aux_chan;
+    uint8_t aux_ptr_off;
+    uint32_t aux_time;
+    struct os_mbuf *seg;
+    struct os_mbuf *hdr;
+    struct ll_sched_item *sch;
+    struct os_event done_ev;
+};
+
+/* An advertising set */
+struct ble_ll_adv_ext_set
+{
+    uint8_t in_use;
+    uint8_t enabled;
+    uint8_t adv_handle;
+    uint8_t sid;
+    uint8_t own_addr_type;
+    uint8_t chanmask;
+    uint8_t rand_addr_set;
+    uint8_t did_update;
+    uint8_t postponed;
+    int8_t txpwr;
+    uint8_t max_events;
+    uint16_t props;
+    uint16_t did;
+    uint16_t events;
+    uint16_t duration;
+    uint32_t itvl_usecs;
+    uint32_t event_start_time;
+    uint32_t end_time;
+    uint8_t rand_addr[BLE_DEV_ADDR_LEN];
+    struct ble_ll_adv_ext_data adv;
+    struct ble_ll_adv_ext_ev adv_ev;
+
+    /* Periodic advertising */
+    uint8_t per_configured;
+    uint8_t per_enabled;
+    uint8_t per_running;
+    uint16_t per_props;
+    uint16_t per_itvl;
+    uint16_t per_cntr;
+    uint16_t per_chan_id;
+    uint32_t per_access_addr;
+    uint32_t per_crcinit;
+    uint32_t per_anchor;
+    struct ble_ll_chan_map per_chmap;
+    struct ble_ll_adv_ext_data per;
+    struct ble_ll_adv_ext_ev per_ev;
+};
+
+struct ble_ll_adv_ext_set g_ble_ll_adv_ext_sets[BLE_LL_ADV_EXT_CFG_MAX_SETS];
+
+/* Statistics (per advertising set; indexed like g_ble_ll_adv_ext_sets) */
+struct ble_ll_adv_ext_stats g_ble_ll_adv_ext_stats[BLE_LL_ADV_EXT_CFG_MAX_SETS];
+
+static struct ble_ll_adv_ext_stats *
+ble_ll_adv_ext_stats_get(struct ble_ll_adv_ext_set *set)
+{
+    return &g_ble_ll_adv_ext_stats[set - g_ble_ll_adv_ext_sets];
+}
+
+/* Find the advertising set with the given handle */
+static struct ble_ll_adv_ext_set *
+ble_ll_adv_ext_set_find(uint8_t adv_handle)
+{
+    int i;
+    struct ble_ll_adv_ext_set *set;
+
+    set = g_ble_ll_adv_ext_sets;
+    for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+        if (set->in_use && (set->adv_handle == adv_handle)) {
+            return set;
+        }
+        ++set;
+    }
+
+    return NULL;
+}
+
+/* Free data (and any new data) */
+static void
+ble_ll_adv_ext_data_free(struct ble_ll_adv_ext_data *advd)
+{
+    if (advd->om) {
+        os_mbuf_free_chain(&g_mbuf_pool, advd->om);
+    }
+    if (advd->om_new) {
+        os_mbuf_free_chain(&g_mbuf_pool, advd->om_new);
+    }
+    memset(advd, 0, sizeof(struct ble_ll_adv_ext_data));
+}
+
+/* Replace the data with the new data */
+static void
+ble_ll_adv_ext_data_swap(struct ble_ll_adv_ext_data *advd)
+{
+    if (advd->om) {
+        os_mbuf_free_chain(&g_mbuf_pool, advd->om);
+    }
+    advd->om = advd->om_new;
+    advd->len = advd->new_len;
+    advd->om_new = NULL;
+    advd->new_len = 0;
+    advd->pending = 0;
+}
+
+/**
+ * Add host data to the new data. The new data is filled one mbuf per PDU:
+ * the first mbuf holds up to first_max bytes and the others up to
+ * next_max bytes.
+ *
+ * @param advd
+ * @param data
+ * @param len
+ * @param first_max
+ * @param next_max
+ *
+ * @return int 0: success; BLE_ERR_MEM_CAPACITY if out of mbufs.
+ */
+static int
+ble_ll_adv_ext_data_append(struct ble_ll_adv_ext_data *advd, uint8_t *data,
+                           uint8_t len, uint16_t first_max, uint16_t next_max)
+{
+    uint16_t max;
+    uint16_t cnt;
+    struct os_mbuf *m;
+    struct os_mbuf *last;
+
+    last = advd->om_new;
+    while (last && SLIST_NEXT(last, om_next)) {
+        last = SLIST_NEXT(last, om_next);
+    }
+
+    while (len) {
+        if (last == advd->om_new) {
+            max = first_max;
+        } else {
+            max = next_max;
+        }
+        if (max > g_mbuf_pool.omp_databuf_len) {
+            max = g_mbuf_pool.omp_databuf_len;
+        }
+
+        /* Start a new PDU once this one is full */
+        if (!last || (last->om_len == max)) {
+            m = os_mbuf_get(&g_mbuf_pool, 0);
+            if (!m) {
+                return BLE_ERR_MEM_CAPACITY;
+            }
+            if (last) {
+                SLIST_NEXT(last, om_next) = m;
+            } else {
+                advd->om_new = m;
+            }
+            last = m;
+            continue;
+        }
+
+        cnt = max - last->om_len;
+        if (cnt > len) {
+            cnt = len;
+        }
+        memcpy(last->om_data + last->om_len, data, cnt);
+        last->om_len += cnt;
+        advd->new_len += cnt;
+        data += cnt;
+        len -= cnt;
+    }
+
+    return 0;
+}
+
+/**
+ * Process data (or a fragment of it) sent by the host. A complete or last
+ * fragment replaces the data right away if not advertising; otherwise the
+ * data is replaced at the end of the current event.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param advd
+ * @param running The data is in use by advertising events
+ * @param op Operation (BLE_HCI_ADV_DATA_OP_xxx)
+ * @param data
+ * @param len
+ * @param first_max Bytes in the first PDU
+ * @param next_max Bytes in the other PDUs
+ *
+ * @return int
+ */
+static int
+ble_ll_adv_ext_data_set(struct ble_ll_adv_ext_data *advd, uint8_t running,
+                        uint8_t op, uint8_t *data, uint8_t len,
+                        uint16_t first_max, uint16_t next_max)
+{
+    int rc;
+
+    switch (op) {
+    case BLE_HCI_ADV_DATA_OP_FIRST:
+    case BLE_HCI_ADV_DATA_OP_COMPLETE:
+        if (advd->om_new) {
+            os_mbuf_free_chain(&g_mbuf_pool, advd->om_new);
+            advd->om_new = NULL;
+        }
+        advd->new_len = 0;
+        advd->pending = 0;
+        advd->frag = (op == BLE_HCI_ADV_DATA_OP_FIRST);
+        break;
+    case BLE_HCI_ADV_DATA_OP_INT:
+    case BLE_HCI_ADV_DATA_OP_LAST:
+        if (!advd->frag) {
+            return BLE_ERR_CMD_DISALLOWED;
+        }
+        break;
+    default:
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    if ((advd->new_len + len) > BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN) {
+        rc = BLE_ERR_MEM_CAPACITY;
+        goto err;
+    }
+
+    rc = ble_ll_adv_ext_data_append(advd, data, len, first_max, next_max);
+    if (rc) {
+        goto err;
+    }
+
+    if ((op == BLE_HCI_ADV_DATA_OP_LAST) ||
+        (op == BLE_HCI_ADV_DATA_OP_COMPLETE)) {
+        advd->frag = 0;
+        if (running) {
+            advd->pending = 1;
+        } else {
+            ble_ll_adv_ext_data_swap(advd);
+        }
+    }
+
+    return 0;
+
+err:
+    /* The fragments received so far are discarded */
+    if (advd->om_new) {
+        os_mbuf_free_chain(&g_mbuf_pool, advd->om_new);
+        advd->om_new = NULL;
+    }
+    advd->new_len = 0;
+    advd->frag = 0;
+    return rc;
+}
+
+/* Number of primary advertising channels used by a set */
+static uint8_t
+ble_ll_adv_ext_num_prim_chans(struct ble_ll_adv_ext_set *set)
+{
+    return (set->chanmask & 0x01) + ((set->chanmask >> 1) & 0x01) +
+           ((set->chanmask >> 2) & 0x01);
+}
+
+/* Length of the ADV_EXT_IND of a set (PDU header included) */
+static uint8_t
+ble_ll_adv_ext_prim_len(struct ble_ll_adv_ext_set *set)
+{
+    uint8_t len;
+
+    len = BLE_LL_PDU_HDR_LEN + 2 + BLE_ADV_EXT_ADI_LEN +
+          BLE_ADV_EXT_AUX_PTR_LEN;
+    if (set->props & BLE_HCI_EXT_ADV_PROP_INC_TX_PWR) {
+        len += BLE_ADV_EXT_TX_POWER_LEN;
+    }
+
+    return len;
+}
+
+/* Round a time between PDUs up to the aux offset unit */
+static uint32_t
+ble_ll_adv_ext_offset_roundup(uint32_t usecs)
+{
+    return ((usecs + BLE_ADV_EXT_OFFSET_UNIT_USECS - 1) /
+            BLE_ADV_EXT_OFFSET_UNIT_USECS) * BLE_ADV_EXT_OFFSET_UNIT_USECS;
+}
+
+/**
+ * Worst case duration of an advertising event of a set, from the start of
+ * the first ADV_EXT_IND to the end of the last aux PDU.
+ *
+ * @param set
+ *
+ * @return uint32_t usecs
+ */
+static uint32_t
+ble_ll_adv_ext_event_usecs(struct ble_ll_adv_ext_set *set)
+{
+    uint32_t usecs;
+    uint16_t pdulen;
+    struct os_mbuf *seg;
+
+    usecs = ble_ll_adv_ext_num_prim_chans(set) *
+        (ll_pdu_tx_time_get(ble_ll_adv_ext_prim_len(set)) + BLE_LL_MAFS_USECS);
+
+    pdulen = BLE_LL_PDU_HDR_LEN + BLE_LL_ADV_EXT_AUX_HDR_MAX;
+    seg = set->adv.om;
+    if (seg) {
+        pdulen += seg->om_len;
+        seg = SLIST_NEXT(seg, om_next);
+    }
+    usecs += ll_pdu_tx_time_get(pdulen);
+
+    while (seg) {
+        pdulen = BLE_LL_PDU_HDR_LEN + BLE_LL_ADV_EXT_CHAIN_HDR_MAX +
+                 seg->om_len;
+        usecs += ble_ll_adv_ext_offset_roundup(BLE_LL_MAFS_USECS) +
+                 BLE_ADV_EXT_OFFSET_UNIT_USECS + ll_pdu_tx_time_get(pdulen);
+        seg = SLIST_NEXT(seg, om_next);
+    }
+
+    return usecs;
+}
+
+/* Worst case duration of a periodic advertising event of a set */
+static uint32_t
+ble_ll_adv_per_event_usecs(struct ble_ll_adv_ext_set *set)
+{
+    uint32_t usecs;
+    struct os_mbuf *seg;
+
+    usecs = 0;
+    seg = set->per.om;
+    do {
+        if (usecs) {
+            usecs += BLE_LL_MAFS_USECS + BLE_ADV_EXT_OFFSET_UNIT_USECS;
+        }
+        usecs += ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN +
+                                    BLE_LL_ADV_PER_SYNC_HDR_MAX +
+                                    (seg ? seg->om_len : 0));
+        if (seg) {
+            seg = SLIST_NEXT(seg, om_next);
+        }
+    } while (seg);
+
+    return usecs;
+}
+
+/*
+ * Time (usecs) reserved for the periodic events of a set when placing the
+ * periodic events of other sets: a whole event and the time to get the
+ * next one going, in periodic interval units.
+ */
+static uint32_t
+ble_ll_adv_per_slot_usecs(struct ble_ll_adv_ext_set *set)
+{
+    uint32_t usecs;
+
+    usecs = ble_ll_adv_per_event_usecs(set) + XCVR_TX_SCHED_DELAY_USECS;
+    usecs = (usecs + BLE_LL_ADV_PER_ITVL_USECS - 1) /
+        BLE_LL_ADV_PER_ITVL_USECS;
+
+    return usecs * BLE_LL_ADV_PER_ITVL_USECS;
+}
+
+/**
+ * Write an AuxPtr: the channel and offset of the next PDU of the event.
+ * The offset is rounded down so that the next PDU starts within one offset
+ * unit after it.
+ *
+ * @param dptr
+ * @param chan
+ * @param offset_usecs Time from the start of this PDU to the next one
+ */
+static void
+ble_ll_adv_ext_aux_ptr_put(uint8_t *dptr, uint8_t chan, uint32_t offset_usecs)
+{
+    uint32_t offset;
+
+    dptr[0] = chan | BLE_ADV_EXT_AUX_PTR_CA_50_PPM;
+    offset = offset_usecs / BLE_ADV_EXT_OFFSET_UNIT_USECS;
+    if (offset > BLE_ADV_EXT_OFFSET_MAX) {
+        dptr[0] |= BLE_ADV_EXT_AUX_PTR_UNITS_300;
+        offset = offset_usecs / BLE_ADV_EXT_OFFSET_LARGE_UNIT_USECS;
+    }
+    htole16(dptr + 1, (uint16_t)offset | BLE_ADV_EXT_AUX_PTR_PHY_1M);
+}
+
+/**
+ * Write a SyncInfo: where the periodic advertising of the set is. Points to
+ * the first AUX_SYNC_IND after the start of this PDU.
+ *
+ * Context: Interrupt
+ *
+ * @param set
+ * @param dptr
+ * @param start Start of the AUX_ADV_IND (cputime)
+ */
+static void
+ble_ll_adv_ext_sync_info_put(struct ble_ll_adv_ext_set *set, uint8_t *dptr,
+                             uint32_t start)
+{
+    uint16_t cntr;
+    uint32_t itvl;
+    uint32_t anchor;
+    uint32_t offset;
+    uint32_t offset_usecs;
+
+    anchor = set->per_anchor;
+    cntr = set->per_cntr;
+    itvl = cputime_usecs_to_ticks((uint32_t)set->per_itvl *
+                                  BLE_LL_ADV_PER_ITVL_USECS);
+    while ((int32_t)(anchor - start) <= 0) {
+        anchor += itvl;
+        ++cntr;
+    }
+
+    /* An offset of zero: too far to tell */
+    offset_usecs = cputime_ticks_to_usecs(anchor - start);
+    offset = offset_usecs / BLE_ADV_EXT_OFFSET_UNIT_USECS;
+    if (offset > BLE_ADV_EXT_OFFSET_MAX) {
+        offset = offset_usecs / BLE_ADV_EXT_OFFSET_LARGE_UNIT_USECS;
+        if (offset > BLE_ADV_EXT_OFFSET_MAX) {
+            offset = 0;
+        } else {
+            offset |= BLE_ADV_EXT_SYNC_UNITS_300;
+        }
+    }
+    htole16(dptr, (uint16_t)offset);
+    htole16(dptr + 2, set->per_itvl);
+    memcpy(dptr + 4, set->per_chmap.map, BLE_LL_CHAN_MAP_LEN);
+    dptr[8] |= BLE_MASTER_SCA_31_50_PPM << 5;
+    htole32(dptr + 9, set->per_access_addr);
+    dptr[13] = (uint8_t)set->per_crcinit;
+    dptr[14] = (uint8_t)(set->per_crcinit >> 8);
+    dptr[15] = (uint8_t)(set->per_crcinit >> 16);
+    htole16(dptr + 16, cntr);
+}
+
+/**
+ * Make a PDU of an advertising event: the PDU header and extended header
+ * are written into the header mbuf of the event and the data mbuf (if any)
+ * is chained to it.
+ *
+ * Context: Interrupt
+ *
+ * @param set
+ * @param ev The event (ev->hdr is the PDU)
+ * @param pdu BLE_LL_ADV_EXT_PDU_xxx
+ * @param start Start of this PDU (cputime)
+ * @param aux_chan Channel of the next PDU (if an AuxPtr is sent)
+ * @param aux_time Start of the next PDU (if an AuxPtr is sent)
+ *
+ * @return uint16_t The PDU length (header included)
+ */
+static uint16_t
+ble_ll_adv_ext_pdu_make(struct ble_ll_adv_ext_set *set,
+                        struct ble_ll_adv_ext_ev *ev, uint8_t pdu,
+                        uint32_t start, uint8_t aux_chan, uint32_t aux_time)
+{
+    uint8_t flags;
+    uint8_t ext_len;
+    uint8_t datalen;
+    uint8_t *dptr;
+    uint8_t *ext;
+    struct os_mbuf *m;
+    struct os_mbuf *seg;
+
+    m = ev->hdr;
+    dptr = m->om_data;
+    dptr[0] = BLE_ADV_PDU_TYPE_ADV_EXT_IND;
+
+    /* Skip the extended header length and flags */
+    flags = 0;
+    ext = dptr + BLE_LL_PDU_HDR_LEN + 2;
+    seg = NULL;
+    if (pdu != BLE_LL_ADV_EXT_PDU_PRIM) {
+        seg = ev->seg;
+    }
+
+    if ((pdu == BLE_LL_ADV_EXT_PDU_AUX) &&
+        !(set->props & BLE_HCI_EXT_ADV_PROP_ANON_ADV)) {
+        flags |= BLE_ADV_EXT_FLAG_ADVA;
+        if (set->own_addr_type == BLE_HCI_ADV_OWN_ADDR_RANDOM) {
+            dptr[0] |= BLE_ADV_PDU_HDR_TXADD_RAND;
+            memcpy(ext, set->rand_addr, BLE_DEV_ADDR_LEN);
+        } else {
+            memcpy(ext, g_dev_addr, BLE_DEV_ADDR_LEN);
+        }
+        ext += BLE_DEV_ADDR_LEN;
+    }
+
+    if (pdu <= BLE_LL_ADV_EXT_PDU_CHAIN) {
+        flags |= BLE_ADV_EXT_FLAG_ADI;
+        htole16(ext, set->did | ((uint16_t)set->sid <<
+                                 BLE_ADV_EXT_ADI_SID_SHIFT));
+        ext += BLE_ADV_EXT_ADI_LEN;
+    }
+
+    if ((pdu == BLE_LL_ADV_EXT_PDU_PRIM) ||
+        (seg && SLIST_NEXT(seg, om_next))) {
+        flags |= BLE_ADV_EXT_FLAG_AUX_PTR;
+        ev->aux_ptr_off = ext - dptr;
+        ble_ll_adv_ext_aux_ptr_put(ext, aux_chan,
+                                   cputime_ticks_to_usecs(aux_time - start));
+        ext += BLE_ADV_EXT_AUX_PTR_LEN;
+    }
+
+    if ((pdu == BLE_LL_ADV_EXT_PDU_AUX) && set->per_running) {
+        flags |= BLE_ADV_EXT_FLAG_SYNC_INFO;
+        ble_ll_adv_ext_sync_info_put(set, ext, start);
+        ext += BLE_ADV_EXT_SYNC_INFO_LEN;
+    }
+
+    if (((pdu <= BLE_LL_ADV_EXT_PDU_AUX) &&
+         (set->props & BLE_HCI_EXT_ADV_PROP_INC_TX_PWR)) ||
+        ((pdu == BLE_LL_ADV_EXT_PDU_SYNC) &&
+         (set->per_props & BLE_HCI_PER_ADV_PROP_INC_TX_PWR))) {
+        flags |= BLE_ADV_EXT_FLAG_TX_POWER;
+        *ext = (uint8_t)set->txpwr;
+        ext += BLE_ADV_EXT_TX_POWER_LEN;
+    }
+
+    /* Without any field, there is no flags byte either */
+    if (flags) {
+        dptr[BLE_LL_PDU_HDR_LEN + 1] = flags;
+        ext_len = ext - (dptr + BLE_LL_PDU_HDR_LEN + 1);
+    } else {
+        ext_len = 0;
+    }
+    dptr[BLE_LL_PDU_HDR_LEN] = ext_len | BLE_ADV_EXT_MODE_NONCONN;
+
+    datalen = 0;
+    if (seg) {
+        datalen = seg->om_len;
+    }
+    dptr[1] = 1 + ext_len + datalen;
+    m->om_len = BLE_LL_PDU_HDR_LEN + 1 + ext_len;
+    SLIST_NEXT(m, om_next) = seg;
+    OS_MBUF_PKTHDR(m)->omp_len = m->om_len + datalen;
+
+    return OS_MBUF_PKTHDR(m)->omp_len;
+}
+
+/* Count a PDU sent */
+static void
+ble_ll_adv_ext_tx_stats(struct ble_ll_adv_ext_set *set, uint8_t pdu,
+                        uint16_t pdulen, uint8_t datalen)
+{
+    struct ble_ll_adv_ext_stats *stats;
+
+    stats = ble_ll_adv_ext_stats_get(set);
+    switch (pdu) {
+    case BLE_LL_ADV_EXT_PDU_PRIM:
+        ++stats->tx_prim_pdus;
+        break;
+    case BLE_LL_ADV_EXT_PDU_AUX:
+    case BLE_LL_ADV_EXT_PDU_SYNC:
+        ++stats->tx_aux_pdus;
+        break;
+    default:
+        ++stats->tx_chain_pdus;
+        break;
+    }
+    stats->tx_data_bytes += datalen;
+    stats->air_usecs += ll_pdu_tx_time_get(pdulen);
+}
+
+/**
+ * End an advertising (or periodic advertising) event. The Link Layer task
+ * sets up the next one.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param ev
+ *
+ * @return int BLE_LL_SCHED_STATE_DONE
+ */
+static int
+ble_ll_adv_ext_ev_end(struct ble_ll_adv_ext_ev *ev)
+{
+    if (ev->active) {
+        ev->active = 0;
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    }
+    ev->sch = NULL;
+    SLIST_NEXT(ev->hdr, om_next) = NULL;
+    os_eventq_put(&g_ll_data.ll_evq, &ev->done_ev);
+    return BLE_LL_SCHED_STATE_DONE;
+}
+
+/**
+ * Scheduler callback when an advertising event is stopped for a schedule
+ * item of higher priority. The rest of the event is not sent.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param sch
+ */
+static void
+ble_ll_adv_ext_sched_preempt(struct ll_sched_item *sch)
+{
+    struct ble_ll_adv_ext_ev *ev;
+    struct ble_ll_adv_ext_set *set;
+
+    set = (struct ble_ll_adv_ext_set *)sch->cb_arg;
+    if (sch == set->adv_ev.sch) {
+        ev = &set->adv_ev;
+    } else {
+        ev = &set->per_ev;
+    }
+
+    ble_phy_disable();
+    ++ble_ll_adv_ext_stats_get(set)->events_preempted;
+    ble_ll_adv_ext_ev_end(ev);
+}
+
+/* First primary advertising channel at or after chan */
+static uint8_t
+ble_ll_adv_ext_prim_chan(struct ble_ll_adv_ext_set *set, uint8_t chan)
+{
+    while (chan < BLE_PHY_NUM_CHANS) {
+        if (set->chanmask & (1 << (chan - BLE_PHY_ADV_CHAN_START))) {
+            break;
+        }
+        ++chan;
+    }
+
+    return chan;
+}
+
+/**
+ * Send the aux PDU (AUX_ADV_IND, AUX_CHAIN_IND, AUX_SYNC_IND) of an event
+ * that is due now and set up the next one, if the data does not end here.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param set
+ * @param ev
+ * @param sch
+ * @param chan
+ * @param access_addr
+ * @param crcinit
+ *
+ * @return int
+ */
+static int
+ble_ll_adv_ext_aux_tx(struct ble_ll_adv_ext_set *set,
+                      struct ble_ll_adv_ext_ev *ev, struct ll_sched_item *sch,
+                      uint8_t chan, uint32_t access_addr, uint32_t crcinit)
+{
+    int rc;
+    uint8_t pdu;
+    uint8_t next_chan;
+    uint16_t pdulen;
+    uint32_t start;
+    uint32_t next_time;
+    uint32_t air;
+    struct os_mbuf *next;
+    struct ble_ll_chan_map *chmap;
+
+    start = cputime_get32() + cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+
+    /* The next aux PDU is as soon as possible after this one */
+    next = NULL;
+    if (ev->seg) {
+        next = SLIST_NEXT(ev->seg, om_next);
+    }
+    next_chan = 0;
+    next_time = 0;
+    if (next) {
+        if (ev == &set->per_ev) {
+            chmap = &set->per_chmap;
+            next_chan = chmap->remap[rand() % chmap->num_used];
+        } else {
+            next_chan = rand() % BLE_PHY_NUM_DATA_CHANS;
+        }
+    }
+
+    /* The offset depends on the length of this PDU: set it afterwards */
+    pdu = ev->pdu;
+    pdulen = ble_ll_adv_ext_pdu_make(set, ev, pdu, start, next_chan, start);
+    air = ll_pdu_tx_time_get(pdulen);
+    if (next) {
+        next_time = start + cputime_usecs_to_ticks(
+            ble_ll_adv_ext_offset_roundup(air + BLE_LL_MAFS_USECS));
+        ble_ll_adv_ext_aux_ptr_put(ev->hdr->om_data + ev->aux_ptr_off,
+                                   next_chan,
+                                   cputime_ticks_to_usecs(next_time - start));
+    }
+
+    rc = ble_phy_setchan(chan, access_addr, crcinit);
+    assert(rc == 0);
+    rc = ble_phy_tx(ev->hdr, BLE_PHY_TRANSITION_NONE, BLE_PHY_TRANSITION_NONE);
+    if (rc) {
+        ++ble_ll_adv_ext_stats_get(set)->tx_fail;
+        return ble_ll_adv_ext_ev_end(ev);
+    }
+    ble_ll_adv_ext_tx_stats(set, pdu, pdulen, ev->seg ? ev->seg->om_len : 0);
+
+    if (next) {
+        ev->seg = next;
+        ev->aux_chan = next_chan;
+        ev->aux_time = next_time;
+        if (ev == &set->per_ev) {
+            ev->pdu = BLE_LL_ADV_EXT_PDU_SYNC_CHAIN;
+        } else {
+            ev->pdu = BLE_LL_ADV_EXT_PDU_CHAIN;
+        }
+        sch->next_wakeup = next_time -
+            cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+    } else {
+        /* Done once the radio is done with the PDU */
+        ev->pdu = BLE_LL_ADV_EXT_PDU_END;
+        sch->next_wakeup = start +
+            cputime_usecs_to_ticks(air + XCVR_PROC_DELAY_USECS);
+    }
+
+    return BLE_LL_SCHED_STATE_RUNNING;
+}
+
+/**
+ * Scheduler callback of an extended advertising event. Sends an ADV_EXT_IND
+ * on each primary advertising channel, then the AUX_ADV_IND and any
+ * AUX_CHAIN_IND on data channels. The ADV_EXT_INDs are MAFS apart and all
+ * point to the AUX_ADV_IND, which follows the last one by MAFS.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param sch
+ *
+ * @return int
+ */
+static int
+ble_ll_adv_ext_event_cb(struct ll_sched_item *sch)
+{
+    int rc;
+    uint8_t nchans;
+    uint16_t pdulen;
+    uint32_t air;
+    uint32_t start;
+    uint32_t next_start;
+    struct ble_ll_adv_ext_ev *ev;
+    struct ble_ll_adv_ext_set *set;
+
+    set = (struct ble_ll_adv_ext_set *)sch->cb_arg;
+    ev = &set->adv_ev;
+    SLIST_NEXT(ev->hdr, om_next) = NULL;
+
+    switch (ev->pdu) {
+    case BLE_LL_ADV_EXT_PDU_PRIM:
+        start = cputime_get32() +
+            cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+        air = ll_pdu_tx_time_get(ble_ll_adv_ext_prim_len(set));
+
+        if (!ev->active) {
+            /*
+             * Do not start an event that a periodic advertising event or a
+             * connection event would cut short: wait until it is over.
+             */
+            if (!ll_sched_next_start(BLE_LL_SCHED_PRIO_CONN, &next_start) &&
+                ((int32_t)(next_start - sch->end_time) < 0)) {
+                ++ble_ll_adv_ext_stats_get(set)->events_postponed;
+                set->event_start_time = next_start + 1 +
+                    cputime_usecs_to_ticks(XCVR_TX_SCHED_DELAY_USECS);
+                set->postponed = 1;
+                return ble_ll_adv_ext_ev_end(ev);
+            }
+
+            /* Start of the event: pick the aux channel and time */
+            ev->active = 1;
+            ble_ll_state_set(BLE_LL_STATE_ADV);
+            ev->chan = ble_ll_adv_ext_prim_chan(set, BLE_PHY_ADV_CHAN_START);
+            ev->seg = set->adv.om;
+            ev->aux_chan = rand() % BLE_PHY_NUM_DATA_CHANS;
+            nchans = ble_ll_adv_ext_num_prim_chans(set);
+            ev->aux_time = start +
+                cputime_usecs_to_ticks(nchans * (air + BLE_LL_MAFS_USECS));
+        } else if ((int32_t)(ev->aux_time - start -
+                   cputime_usecs_to_ticks(air + XCVR_TX_SCHED_DELAY_USECS))
+                   < 0) {
+            /* Too late for this channel; the AUX_ADV_IND cannot wait */
+            ev->pdu = BLE_LL_ADV_EXT_PDU_AUX;
+            sch->next_wakeup = ev->aux_time -
+                cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+            return BLE_LL_SCHED_STATE_RUNNING;
+        }
+
+        pdulen = ble_ll_adv_ext_pdu_make(set, ev, BLE_LL_ADV_EXT_PDU_PRIM,
+                                         start, ev->aux_chan, ev->aux_time);
+        rc = ble_phy_setchan(ev->chan, BLE_ACCESS_ADDR_ADV,
+                             BLE_LL_CRCINIT_ADV);
+        assert(rc == 0);
+        rc = ble_phy_tx(ev->hdr, BLE_PHY_TRANSITION_NONE,
+                        BLE_PHY_TRANSITION_NONE);
+        if (rc) {
+            ++ble_ll_adv_ext_stats_get(set)->tx_fail;
+            return ble_ll_adv_ext_ev_end(ev);
+        }
+        ble_ll_adv_ext_tx_stats(set, BLE_LL_ADV_EXT_PDU_PRIM, pdulen, 0);
+
+        ev->chan = ble_ll_adv_ext_prim_chan(set, ev->chan + 1);
+        if (ev->chan == BLE_PHY_NUM_CHANS) {
+            ev->pdu = BLE_LL_ADV_EXT_PDU_AUX;
+            sch->next_wakeup = ev->aux_time -
+                cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+        } else {
+            sch->next_wakeup = start + cputime_usecs_to_ticks(
+                air + BLE_LL_MAFS_USECS - XCVR_TX_START_DELAY_USECS);
+        }
+        rc = BLE_LL_SCHED_STATE_RUNNING;
+        break;
+
+    case BLE_LL_ADV_EXT_PDU_AUX:
+    case BLE_LL_ADV_EXT_PDU_CHAIN:
+        rc = ble_ll_adv_ext_aux_tx(set, ev, sch, ev->aux_chan,
+                                   BLE_ACCESS_ADDR_ADV, BLE_LL_CRCINIT_ADV);
+        break;
+
+    default:
+        rc = ble_ll_adv_ext_ev_end(ev);
+        break;
+    }
+
+    return rc;
+}
+
+/**
+ * Scheduler callback of a periodic advertising event. Sends the
+ * AUX_SYNC_IND at the anchor point of the event, on the channel picked by
+ * channel selection algorithm #2, and then any AUX_CHAIN_IND. An event that
+ * cannot start on time is skipped.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param sch
+ *
+ * @return int
+ */
+static int
+ble_ll_adv_per_event_cb(struct ll_sched_item *sch)
+{
+    int rc;
+    uint32_t start;
+    struct ble_ll_adv_ext_ev *ev;
+    struct ble_ll_adv_ext_set *set;
+    struct ble_ll_adv_ext_stats *stats;
+
+    set = (struct ble_ll_adv_ext_set *)sch->cb_arg;
+    ev = &set->per_ev;
+    SLIST_NEXT(ev->hdr, om_next) = NULL;
+    stats = ble_ll_adv_ext_stats_get(set);
+
+    switch (ev->pdu) {
+    case BLE_LL_ADV_EXT_PDU_SYNC:
+        start = cputime_get32() +
+            cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+        if ((int32_t)(start - set->per_anchor) >
+            (int32_t)cputime_usecs_to_ticks(BLE_LL_ADV_PER_JITTER_USECS)) {
+            ++stats->per_events_late;
+            return ble_ll_adv_ext_ev_end(ev);
+        }
+
+        ev->active = 1;
+        ble_ll_state_set(BLE_LL_STATE_ADV);
+        ev->seg = set->per.om;
+        ev->chan = ble_ll_chan_sel2(&set->per_chmap, set->per_cntr,
+                                    set->per_chan_id);
+        rc = ble_ll_adv_ext_aux_tx(set, ev, sch, ev->chan,
+                                   set->per_access_addr, set->per_crcinit);
+        if (ev->active) {
+            ++stats->per_events;
+        }
+        break;
+
+    case BLE_LL_ADV_EXT_PDU_SYNC_CHAIN:
+        rc = ble_ll_adv_ext_aux_tx(set, ev, sch, ev->aux_chan,
+                                   set->per_access_addr, set->per_crcinit);
+        break;
+
+    default:
+        rc = ble_ll_adv_ext_ev_end(ev);
+        break;
+    }
+
+    return rc;
+}
+
+/**
+ * Schedule the next extended advertising event of a set. Its first
+ * ADV_EXT_IND is sent at set->event_start_time.
+ *
+ * Context: Link Layer task
+ *
+ * @param set
+ *
+ * @return struct ll_sched_item * The schedule item; NULL if none was free.
+ */
+static struct ll_sched_item *
+ble_ll_adv_ext_sched_set(struct ble_ll_adv_ext_set *set)
+{
+    int rc;
+    struct ll_sched_item *sch;
+
+    sch = ll_sched_get_item();
+    if (sch) {
+        sch->sched_type = BLE_LL_SCHED_TYPE_ADV_EXT;
+        sch->sched_prio = BLE_LL_SCHED_PRIO_ADV;
+        sch->preempt_cb = ble_ll_adv_ext_sched_preempt;
+        sch->cb_arg = set;
+        sch->sched_cb = ble_ll_adv_ext_event_cb;
+        sch->start_time = set->event_start_time -
+            cputime_usecs_to_ticks(XCVR_TX_SCHED_DELAY_USECS);
+        sch->end_time = set->event_start_time +
+            cputime_usecs_to_ticks(ble_ll_adv_ext_event_usecs(set));
+
+        set->adv_ev.pdu = BLE_LL_ADV_EXT_PDU_PRIM;
+        set->adv_ev.sch = sch;
+        rc = ll_sched_add(sch);
+        assert(rc == 0);
+    } else {
+        ++ble_ll_adv_ext_stats_get(set)->cant_set_sched;
+    }
+
+    return sch;
+}
+
+/**
+ * Schedule the next periodic advertising event of a set. Its AUX_SYNC_IND
+ * is sent at set->per_anchor.
+ *
+ * Context: Link Layer task
+ *
+ * @param set
+ *
+ * @return struct ll_sched_item * The schedule item; NULL if none was free.
+ */
+static struct ll_sched_item *
+ble_ll_adv_per_sched_set(struct ble_ll_adv_ext_set *set)
+{
+    int rc;
+    struct ll_sched_item *sch;
+
+    sch = ll_sched_get_item();
+    if (sch) {
+        /* Periodic events have fixed anchor points, like connection events */
+        sch->sched_type = BLE_LL_SCHED_TYPE_ADV_EXT;
+        sch->sched_prio = BLE_LL_SCHED_PRIO_CONN;
+        sch->preempt_cb = ble_ll_adv_ext_sched_preempt;
+        sch->cb_arg = set;
+        sch->sched_cb = ble_ll_adv_per_event_cb;
+        sch->start_time = set->per_anchor -
+            cputime_usecs_to_ticks(XCVR_TX_START_DELAY_USECS);
+        sch->end_time = set->per_anchor +
+            cputime_usecs_to_ticks(ble_ll_adv_per_event_usecs(set));
+
+        set->per_ev.pdu = BLE_LL_ADV_EXT_PDU_SYNC;
+        set->per_ev.sch = sch;
+        rc = ll_sched_add(sch);
+        assert(rc == 0);
+    } else {
+        ++ble_ll_adv_ext_stats_get(set)->cant_set_sched;
+    }
+
+    return sch;
+}
+
+/**
+ * Stop an advertising (or periodic advertising) event: remove its schedule
+ * item and, if it is on the air, stop it. Frees the PDU header mbuf.
+ *
+ * Context: Link Layer task
+ *
+ * @param ev
+ */
+static void
+ble_ll_adv_ext_ev_stop(struct ble_ll_adv_ext_ev *ev)
+{
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    if (ev->sch) {
+        ll_sched_rmv_item(ev->sch);
+        ev->sch = NULL;
+    }
+    if (ev->active) {
+        ev->active = 0;
+        ble_phy_disable();
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if (ev->hdr) {
+        SLIST_NEXT(ev->hdr, om_next) = NULL;
+        os_mbuf_free(&g_mbuf_pool, ev->hdr);
+        ev->hdr = NULL;
+    }
+}
+
+/**
+ * Place the first periodic advertising event of a set so that it does not
+ * overlap the periodic events of the other sets, which would make one of
+ * them skip its event every time they meet. The anchor point is moved past
+ * the events in its way until it is clear of all of them; only the event of
+ * each set nearest to the anchor point is checked (see
+ * ble_ll_conn_calc_first_anchor()).
+ *
+ * Context: Link Layer task
+ *
+ * @param set
+ * @param start The earliest anchor point (cputime)
+ *
+ * @return uint32_t The anchor point. If there is no room, start.
+ */
+static uint32_t
+ble_ll_adv_per_calc_first_anchor(struct ble_ll_adv_ext_set *set,
+                                 uint32_t start)
+{
+    int i;
+    int moved;
+    int32_t delta;
+    int32_t itvl;
+    int32_t slot;
+    int32_t tmp_slot;
+    uint32_t offset;
+    uint32_t max_offset;
+    struct ble_ll_adv_ext_set *tmp;
+
+    slot = cputime_usecs_to_ticks(ble_ll_adv_per_slot_usecs(set));
+    max_offset = cputime_usecs_to_ticks((uint32_t)set->per_itvl *
+                                        BLE_LL_ADV_PER_ITVL_USECS) - slot;
+    offset = 0;
+    do {
+        moved = 0;
+        for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+            tmp = &g_ble_ll_adv_ext_sets[i];
+            if ((tmp == set) || !tmp->per_running) {
+                continue;
+            }
+
+            /* Time since the start of the last event before our anchor */
+            itvl = cputime_usecs_to_ticks((uint32_t)tmp->per_itvl *
+                                          BLE_LL_ADV_PER_ITVL_USECS);
+            tmp_slot = cputime_usecs_to_ticks(ble_ll_adv_per_slot_usecs(tmp));
+            delta = (int32_t)(start + offset - tmp->per_anchor) % itvl;
+            if (delta < 0) {
+                delta += itvl;
+            }
+
+            /* Move past the event we overlap */
+            if (delta < tmp_slot) {
+                offset += tmp_slot - delta;
+                moved = 1;
+            } else if ((itvl - delta) < slot) {
+                offset += itvl - delta + tmp_slot;
+                moved = 1;
+            }
+        }
+        if (offset > max_offset) {
+            return start;
+        }
+    } while (moved);
+
+    return start + offset;
+}
+
+/**
+ * Start the periodic advertising of a set: a new access address and CRC
+ * init, all data channels, and the first event half an interval from now
+ * (out of the way of the first advertising event) or, if the periodic
+ * events of other sets are there, a bit later.
+ *
+ * Context: Link Layer task
+ *
+ * @param set
+ *
+ * @return int
+ */
+static int
+ble_ll_adv_per_start(struct ble_ll_adv_ext_set *set)
+{
+    uint8_t chanmap[BLE_LL_CHAN_MAP_LEN];
+    struct ll_sched_item *sch;
+
+    set->per_ev.hdr = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (!set->per_ev.hdr) {
+        return BLE_ERR_MEM_CAPACITY;
+    }
+
+    set->per_access_addr = ble_ll_conn_calc_access_addr();
+    set->per_crcinit = rand() & 0xffffff;
+    set->per_chan_id = ble_ll_chan_sel2_id(set->per_access_addr);
+    memset(chanmap, 0xff, BLE_LL_CHAN_MAP_LEN - 1);
+    chanmap[BLE_LL_CHAN_MAP_LEN - 1] = 0x1f;
+    ble_ll_chan_map_set(&set->per_chmap, chanmap);
+    set->per_cntr = 0;
+    set->per_anchor = ble_ll_adv_per_calc_first_anchor(set,
+        cputime_get32() +
+        cputime_usecs_to_ticks(((uint32_t)set->per_itvl *
+                                BLE_LL_ADV_PER_ITVL_USECS) / 2));
+    set->per_running = 1;
+
+    /*
+     * The periodic events of a set hold one schedule item at a time, and
+     * one is reserved for every set (see the check at the top of this file).
+     */
+    sch = ble_ll_adv_per_sched_set(set);
+    assert(sch != NULL);
+
+    return 0;
+}
+
+/* Stop the periodic advertising of a set */
+static void
+ble_ll_adv_per_stop(struct ble_ll_adv_ext_set *set)
+{
+    ble_ll_adv_ext_ev_stop(&set->per_ev);
+    set->per_running = 0;
+    if (set->per.pending) {
+        ble_ll_adv_ext_data_swap(&set->per);
+    }
+}
+
+/**
+ * Start advertising an advertising set.
+ *
+ * Context: Link Layer task
+ *
+ * @param set
+ *
+ * @return int
+ */
+static int
+ble_ll_adv_ext_start(struct ble_ll_adv_ext_set *set)
+{
+    int rc;
+    struct ll_sched_item *sch;
+
+    if ((set->own_addr_type == BLE_HCI_ADV_OWN_ADDR_RANDOM) &&
+        !(set->props & BLE_HCI_EXT_ADV_PROP_ANON_ADV) &&
+        !set->rand_addr_set) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    /* The data must be complete and an event must fit in the interval */
+    if (set->adv.frag) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+    if (ble_ll_adv_ext_event_usecs(set) > set->itvl_usecs) {
+        return BLE_ERR_PACKET_TOO_LONG;
+    }
+
+    set->adv_ev.hdr = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (!set->adv_ev.hdr) {
+        return BLE_ERR_MEM_CAPACITY;
+    }
+
+    if (set->per_enabled) {
+        rc = ble_ll_adv_per_start(set);
+        if (rc) {
+            os_mbuf_free(&g_mbuf_pool, set->adv_ev.hdr);
+            set->adv_ev.hdr = NULL;
+            return rc;
+        }
+    }
+
+    set->enabled = 1;
+    set->event_start_time = cputime_get32();
+
+    /*
+     * Its advertising events also hold one item at a time (see the check at
+     * the top of this file); stopping the set freed the last one.
+     */
+    sch = ble_ll_adv_ext_sched_set(set);
+    assert(sch != NULL);
+
+    return 0;
+}
+
+/* Stop advertising an advertising set (and its periodic advertising) */
+static void
+ble_ll_adv_ext_stop(struct ble_ll_adv_ext_set *set)
+{
+    if (set->per_running) {
+        ble_ll_adv_per_stop(set);
+    }
+
+    ble_ll_adv_ext_ev_stop(&set->adv_ev);
+    set->enabled = 0;
+    if (set->adv.pending) {
+        ble_ll_adv_ext_data_swap(&set->adv);
+        set->did_update = 1;
+    }
+    if (set->did_update) {
+        set->did = (set->did + 1) & BLE_ADV_EXT_ADI_DID_MASK;
+        set->did_update = 0;
+    }
+}
+
+/**
+ * Send the LE advertising set terminated event.
+ *
+ * Context: Link Layer task
+ *
+ * @param set
+ * @param status
+ */
+static void
+ble_ll_adv_ext_terminated_event_send(struct ble_ll_adv_ext_set *set,
+                                     uint8_t status)
+{
+    uint8_t *evbuf;
+    struct os_mbuf *om;
+
+    if (!ble_ll_hci_is_le_event_enabled(BLE_HCI_LE_SUBEV_ADV_SET_TERMINATED -
+                                        1)) {
+        return;
+    }
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (om) {
+        evbuf = om->om_data;
+        evbuf[0] = BLE_HCI_EVCODE_LE_META;
+        evbuf[1] = BLE_HCI_LE_ADV_SET_TERMINATED_LEN;
+        evbuf[2] = BLE_HCI_LE_SUBEV_ADV_SET_TERMINATED;
+        evbuf[3] = status;
+        evbuf[4] = set->adv_handle;
+        htole16(evbuf + 5, 0);
+        if (set->events > 0xff) {
+            evbuf[7] = 0xff;
+        } else {
+            evbuf[7] = (uint8_t)set->events;
+        }
+        ble_ll_hci_event_send(om);
+    }
+}
+
+/**
+ * Process the end of an extended advertising event: replace the data if
+ * the host changed it, stop if the set has reached its maximum number of
+ * events or its duration, else schedule the next event.
+ *
+ * Context: Link Layer task.
+ *
+ * @param arg Pointer to the advertising set
+ */
+void
+ble_ll_adv_ext_event_done_proc(void *arg)
+{
+    int32_t delta_t;
+    uint32_t itvl;
+    struct ll_sched_item *sch;
+    struct ble_ll_adv_ext_set *set;
+
+    /*
+     * The set may have been stopped (and restarted) since. Otherwise the
+     * item of the event that ended is free, so the next event gets one.
+     */
+    set = (struct ble_ll_adv_ext_set *)arg;
+    if (!set->enabled || set->adv_ev.sch) {
+        return;
+    }
+
+    /* An event that did not start is tried again when the way is clear */
+    if (set->postponed) {
+        set->postponed = 0;
+        sch = ble_ll_adv_ext_sched_set(set);
+        assert(sch != NULL);
+        return;
+    }
+
+    ++set->events;
+    ++ble_ll_adv_ext_stats_get(set)->adv_events;
+
+    if (set->adv.pending) {
+        ble_ll_adv_ext_data_swap(&set->adv);
+        set->did_update = 1;
+    }
+    if (set->did_update) {
+        set->did = (set->did + 1) & BLE_ADV_EXT_ADI_DID_MASK;
+        set->did_update = 0;
+    }
+
+    if (set->max_events && (set->events >= set->max_events)) {
+        ble_ll_adv_ext_stop(set);
+        ble_ll_adv_ext_terminated_event_send(set, BLE_ERR_LIMIT_REACHED);
+        return;
+    }
+
+    /* Calculate start time of next advertising event */
+    itvl = set->itvl_usecs;
+    itvl += rand() % (BLE_LL_ADV_DELAY_MS_MAX * 1000);
+    set->event_start_time += cputime_usecs_to_ticks(itvl);
+
+    /* Catch up if we are late */
+    delta_t = (int32_t)(set->event_start_time - cputime_get32());
+    while (delta_t < 0) {
+        itvl = set->itvl_usecs;
+        itvl += rand() % (BLE_LL_ADV_DELAY_MS_MAX * 1000);
+        itvl = cputime_usecs_to_ticks(itvl);
+        set->event_start_time += itvl;
+        delta_t += (int32_t)itvl;
+    }
+
+    if (set->duration &&
+        ((int32_t)(set->event_start_time - set->end_time) >= 0)) {
+        ble_ll_adv_ext_stop(set);
+        ble_ll_adv_ext_terminated_event_send(set, BLE_ERR_DIR_ADV_TMO);
+        return;
+    }
+
+    sch = ble_ll_adv_ext_sched_set(set);
+    assert(sch != NULL);
+}
+
+/**
+ * Process the end of a periodic advertising event: replace the data if the
+ * host changed it and schedule the next event, one interval later. Events
+ * that can no longer start on time are skipped (the event counter counts
+ * them).
+ *
+ * Context: Link Layer task.
+ *
+ * @param arg Pointer to the advertising set
+ */
+void
+ble_ll_adv_per_event_done_proc(void *arg)
+{
+    os_sr_t sr;
+    uint32_t itvl;
+    uint32_t earliest;
+    struct ll_sched_item *sch;
+    struct ble_ll_adv_ext_set *set;
+
+    /* As for advertising events: the item of the ended event is free */
+    set = (struct ble_ll_adv_ext_set *)arg;
+    if (!set->per_running || set->per_ev.sch) {
+        return;
+    }
+
+    if (set->per.pending) {
+        ble_ll_adv_ext_data_swap(&set->per);
+    }
+
+    /* The anchor and counter are read by the AUX_ADV_IND (SyncInfo) */
+    itvl = cputime_usecs_to_ticks((uint32_t)set->per_itvl *
+                                  BLE_LL_ADV_PER_ITVL_USECS);
+    OS_ENTER_CRITICAL(sr);
+    set->per_anchor += itvl;
+    ++set->per_cntr;
+    earliest = cputime_get32() +
+        cputime_usecs_to_ticks(XCVR_TX_SCHED_DELAY_USECS);
+    while ((int32_t)(set->per_anchor - earliest) < 0) {
+        set->per_anchor += itvl;
+        ++set->per_cntr;
+        ++ble_ll_adv_ext_stats_get(set)->per_events_late;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    sch = ble_ll_adv_per_sched_set(set);
+    assert(sch != NULL);
+}
+
+/**
+ * Called by the HCI command parser when the LE set advertising set random
+ * address command is received.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_set_rand_addr(uint8_t *cmdbuf)
+{
+    os_sr_t sr;
+    struct ble_ll_adv_ext_set *set;
+
+    set = ble_ll_adv_ext_set_find(cmdbuf[0]);
+    if (!set) {
+        return BLE_ERR_UNK_ADV_IDENT;
+    }
+
+    if (!ll_is_valid_rand_addr(cmdbuf + 1)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    /* The address may change while advertising */
+    OS_ENTER_CRITICAL(sr);
+    memcpy(set->rand_addr, cmdbuf + 1, BLE_DEV_ADDR_LEN);
+    OS_EXIT_CRITICAL(sr);
+    set->rand_addr_set = 1;
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE set extended advertising
+ * parameters command is received. Creates the advertising set if it does
+ * not exist. Only non-connectable and non-scannable extended advertising
+ * on the 1M PHY is supported.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ * @param rspbuf The selected transmit power is returned here.
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_set_params(uint8_t *cmdbuf, uint8_t *rspbuf)
+{
+    int i;
+    int8_t txpwr;
+    uint8_t sid;
+    uint8_t adv_handle;
+    uint8_t adv_chanmask;
+    uint8_t own_addr_type;
+    uint8_t peer_addr_type;
+    uint8_t adv_filter_policy;
+    uint8_t prim_phy;
+    uint8_t sec_phy;
+    uint16_t props;
+    uint32_t adv_itvl_min;
+    uint32_t adv_itvl_max;
+    struct ble_ll_adv_ext_set *set;
+
+    /* The response is in the command buffer: read everything first */
+    adv_handle = cmdbuf[0];
+    props = le16toh(cmdbuf + 1);
+    adv_itvl_min = le16toh(cmdbuf + 3) | ((uint32_t)cmdbuf[5] << 16);
+    adv_itvl_max = le16toh(cmdbuf + 6) | ((uint32_t)cmdbuf[8] << 16);
+    adv_chanmask = cmdbuf[9];
+    own_addr_type = cmdbuf[10];
+    peer_addr_type = cmdbuf[11];
+    adv_filter_policy = cmdbuf[18];
+    txpwr = (int8_t)cmdbuf[19];
+    prim_phy = cmdbuf[20];
+    sec_phy = cmdbuf[22];
+    sid = cmdbuf[23];
+    rspbuf[0] = (uint8_t)ble_phy_txpwr_get();
+
+    if ((adv_handle > BLE_HCI_ADV_HANDLE_MAX) ||
+        (props & ~BLE_HCI_EXT_ADV_PROP_MASK) ||
+        (adv_itvl_min > adv_itvl_max) ||
+        (adv_itvl_min < BLE_HCI_EXT_ADV_ITVL_MIN) ||
+        ((adv_chanmask & 0xF8) != 0) || (adv_chanmask == 0) ||
+        (own_addr_type > BLE_HCI_ADV_OWN_ADDR_MAX) ||
+        (peer_addr_type > BLE_HCI_ADV_PEER_ADDR_MAX) ||
+        (adv_filter_policy > BLE_HCI_ADV_FILT_MAX) ||
+        (sid > BLE_HCI_ADV_SID_MAX)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+    if ((txpwr != BLE_HCI_ADV_TXPWR_NO_PREF) &&
+        ((txpwr < BLE_HCI_ADV_TXPWR_MIN) || (txpwr > BLE_HCI_ADV_TXPWR_MAX))) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    /* XXX: support the other kinds of advertising, addresses and PHYs */
+    if ((props & (BLE_HCI_EXT_ADV_PROP_CONNECTABLE |
+                  BLE_HCI_EXT_ADV_PROP_SCANNABLE |
+                  BLE_HCI_EXT_ADV_PROP_DIRECTED |
+                  BLE_HCI_EXT_ADV_PROP_HD_DIRECTED |
+                  BLE_HCI_EXT_ADV_PROP_LEGACY)) ||
+        (own_addr_type > BLE_HCI_ADV_OWN_ADDR_RANDOM) ||
+        (prim_phy != BLE_HCI_ADV_PHY_1M) ||
+        (sec_phy != BLE_HCI_ADV_PHY_1M)) {
+        return BLE_ERR_UNSUPPORTED;
+    }
+
+    set = ble_ll_adv_ext_set_find(adv_handle);
+    if (set) {
+        if (set->enabled) {
+            return BLE_ERR_CMD_DISALLOWED;
+        }
+    } else {
+        for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+            if (!g_ble_ll_adv_ext_sets[i].in_use) {
+                set = &g_ble_ll_adv_ext_sets[i];
+                break;
+            }
+        }
+        if (!set) {
+            return BLE_ERR_MEM_CAPACITY;
+        }
+        set->in_use = 1;
+        set->adv_handle = adv_handle;
+    }
+
+    /* XXX: the transmit power of the set is the transmit power of the PHY */
+    set->props = props;
+    set->itvl_usecs = adv_itvl_max * BLE_LL_ADV_ITVL;
+    set->chanmask = adv_chanmask;
+    set->own_addr_type = own_addr_type;
+    set->sid = sid;
+    set->txpwr = (int8_t)rspbuf[0];
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE set extended advertising
+ * data command is received.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ * @param len Length of the command parameters
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_set_data(uint8_t *cmdbuf, uint8_t len)
+{
+    uint8_t op;
+    uint8_t datalen;
+    struct ble_ll_adv_ext_set *set;
+
+    op = cmdbuf[1];
+    datalen = cmdbuf[3];
+    if ((datalen + BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN) != len) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    set = ble_ll_adv_ext_set_find(cmdbuf[0]);
+    if (!set) {
+        return BLE_ERR_UNK_ADV_IDENT;
+    }
+
+    /* Only whole data while advertising; or a new DID for the same data */
+    if (op == BLE_HCI_ADV_DATA_OP_UNCHANGED) {
+        if (!set->enabled || datalen || !set->adv.len) {
+            return BLE_ERR_INV_HCI_CMD_PARMS;
+        }
+        set->did_update = 1;
+        return BLE_ERR_SUCCESS;
+    }
+    if (set->enabled && (op != BLE_HCI_ADV_DATA_OP_COMPLETE)) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    return ble_ll_adv_ext_data_set(&set->adv, set->enabled, op,
+                                   cmdbuf + BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN,
+                                   datalen, BLE_LL_ADV_EXT_AUX_DATA_MAX,
+                                   BLE_LL_ADV_EXT_CHAIN_DATA_MAX);
+}
+
+/**
+ * Called by the HCI command parser when the LE set extended scan response
+ * data command is received. Advertising sets are not scannable, so the
+ * only scan response data accepted is none.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ * @param len Length of the command parameters
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_set_scan_rsp_data(uint8_t *cmdbuf, uint8_t len)
+{
+    if ((cmdbuf[3] + BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN) != len) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    if (!ble_ll_adv_ext_set_find(cmdbuf[0])) {
+        return BLE_ERR_UNK_ADV_IDENT;
+    }
+
+    if (cmdbuf[3] != 0) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE set extended advertising
+ * enable command is received. All the sets in the command are checked
+ * before any of them is started or stopped. Disabling with no sets
+ * disables all sets.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ * @param len Length of the command parameters
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_set_enable(uint8_t *cmdbuf, uint8_t len)
+{
+    int i;
+    int rc;
+    uint8_t enable;
+    uint8_t num_sets;
+    uint8_t *entry;
+    struct ble_ll_adv_ext_set *set;
+
+    enable = cmdbuf[0];
+    num_sets = cmdbuf[1];
+    if ((enable > 1) ||
+        (len != (BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN +
+                 (num_sets * BLE_HCI_SET_EXT_ADV_ENABLE_SET_LEN)))) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    if (num_sets == 0) {
+        if (enable) {
+            return BLE_ERR_INV_HCI_CMD_PARMS;
+        }
+        for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+            set = &g_ble_ll_adv_ext_sets[i];
+            if (set->in_use && set->enabled) {
+                ble_ll_adv_ext_stop(set);
+            }
+        }
+        return BLE_ERR_SUCCESS;
+    }
+
+    entry = cmdbuf + BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN;
+    for (i = 0; i < num_sets; ++i) {
+        if (!ble_ll_adv_ext_set_find(entry[0])) {
+            return BLE_ERR_UNK_ADV_IDENT;
+        }
+        entry += BLE_HCI_SET_EXT_ADV_ENABLE_SET_LEN;
+    }
+
+    entry = cmdbuf + BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN;
+    for (i = 0; i < num_sets; ++i) {
+        set = ble_ll_adv_ext_set_find(entry[0]);
+        if (enable) {
+            /* Enabling again restarts the duration and event count */
+            if (!set->enabled) {
+                rc = ble_ll_adv_ext_start(set);
+                if (rc) {
+                    return rc;
+                }
+            }
+            set->events = 0;
+            set->duration = le16toh(entry + 1);
+            set->max_events = entry[3];
+            set->end_time = cputime_get32() +
+                cputime_usecs_to_ticks((uint32_t)set->duration *
+                                       BLE_HCI_EXT_ADV_DURATION_MS * 1000);
+        } else if (set->enabled) {
+            ble_ll_adv_ext_stop(set);
+        }
+        entry += BLE_HCI_SET_EXT_ADV_ENABLE_SET_LEN;
+    }
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE read maximum advertising
+ * data length command is received.
+ *
+ * @param rspbuf
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_rd_max_data_len(uint8_t *rspbuf)
+{
+    htole16(rspbuf, BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN);
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE read number of supported
+ * advertising sets command is received.
+ *
+ * @param rspbuf
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_rd_num_sets(uint8_t *rspbuf)
+{
+    rspbuf[0] = BLE_LL_ADV_EXT_CFG_MAX_SETS;
+    return BLE_ERR_SUCCESS;
+}
+
+/* Free an advertising set that is not advertising */
+static void
+ble_ll_adv_ext_set_free(struct ble_ll_adv_ext_set *set)
+{
+    ble_ll_adv_ext_data_free(&set->adv);
+    ble_ll_adv_ext_data_free(&set->per);
+    set->in_use = 0;
+    set->rand_addr_set = 0;
+    set->per_configured = 0;
+    set->did = 0;
+}
+
+/**
+ * Called by the HCI command parser when the LE remove advertising set
+ * command is received.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_remove_set(uint8_t *cmdbuf)
+{
+    struct ble_ll_adv_ext_set *set;
+
+    set = ble_ll_adv_ext_set_find(cmdbuf[0]);
+    if (!set) {
+        return BLE_ERR_UNK_ADV_IDENT;
+    }
+    if (set->enabled || set->per_enabled) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    ble_ll_adv_ext_set_free(set);
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE clear advertising sets
+ * command is received.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @return int
+ */
+int
+ble_ll_adv_ext_clear_sets(void)
+{
+    int i;
+    struct ble_ll_adv_ext_set *set;
+
+    for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+        set = &g_ble_ll_adv_ext_sets[i];
+        if (set->in_use && (set->enabled || set->per_enabled)) {
+            return BLE_ERR_CMD_DISALLOWED;
+        }
+    }
+
+    for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+        set = &g_ble_ll_adv_ext_sets[i];
+        if (set->in_use) {
+            ble_ll_adv_ext_set_free(set);
+        }
+    }
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE set periodic advertising
+ * parameters command is received. The interval used is the maximum.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ *
+ * @return int
+ */
+int
+ble_ll_adv_per_set_params(uint8_t *cmdbuf)
+{
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint16_t props;
+    struct ble_ll_adv_ext_set *set;
+
+    set = ble_ll_adv_ext_set_find(cmdbuf[0]);
+    if (!set) {
+        return BLE_ERR_UNK_ADV_IDENT;
+    }
+    if (set->per_enabled) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    itvl_min = le16toh(cmdbuf + 1);
+    itvl_max = le16toh(cmdbuf + 3);
+    props = le16toh(cmdbuf + 5);
+    if ((itvl_min < BLE_HCI_PER_ADV_ITVL_MIN) || (itvl_min > itvl_max) ||
+        (props & ~BLE_HCI_PER_ADV_PROP_INC_TX_PWR) ||
+        (set->props & BLE_HCI_EXT_ADV_PROP_ANON_ADV)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    set->per_itvl = itvl_max;
+    set->per_props = props;
+    set->per_configured = 1;
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Called by the HCI command parser when the LE set periodic advertising
+ * data command is received.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ * @param len Length of the command parameters
+ *
+ * @return int
+ */
+int
+ble_ll_adv_per_set_data(uint8_t *cmdbuf, uint8_t len)
+{
+    uint8_t op;
+    uint8_t datalen;
+    struct ble_ll_adv_ext_set *set;
+
+    op = cmdbuf[1];
+    datalen = cmdbuf[2];
+    if ((datalen + BLE_HCI_SET_PER_ADV_DATA_HDR_LEN) != len) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    set = ble_ll_adv_ext_set_find(cmdbuf[0]);
+    if (!set) {
+        return BLE_ERR_UNK_ADV_IDENT;
+    }
+    if (!set->per_configured) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+    if (set->per_enabled && (op != BLE_HCI_ADV_DATA_OP_COMPLETE)) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    return ble_ll_adv_ext_data_set(&set->per, set->per_running, op,
+                                   cmdbuf + BLE_HCI_SET_PER_ADV_DATA_HDR_LEN,
+                                   datalen, BLE_LL_ADV_PER_SYNC_DATA_MAX,
+                                   BLE_LL_ADV_PER_CHAIN_DATA_MAX);
+}
+
+/**
+ * Called by the HCI command parser when the LE set periodic advertising
+ * enable command is received. Periodic advertising is sent while its
+ * advertising set is enabled too.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ *
+ * @return int
+ */
+int
+ble_ll_adv_per_set_enable(uint8_t *cmdbuf)
+{
+    int rc;
+    struct ble_ll_adv_ext_set *set;
+
+    if (cmdbuf[0] > 1) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    set = ble_ll_adv_ext_set_find(cmdbuf[1]);
+    if (!set) {
+        return BLE_ERR_UNK_ADV_IDENT;
+    }
+
+    rc = BLE_ERR_SUCCESS;
+    if (cmdbuf[0]) {
+        if (!set->per_configured || set->per.frag) {
+            return BLE_ERR_CMD_DISALLOWED;
+        }
+        if (ble_ll_adv_per_event_usecs(set) >
+            ((uint32_t)set->per_itvl * BLE_LL_ADV_PER_ITVL_USECS)) {
+            return BLE_ERR_PACKET_TOO_LONG;
+        }
+        if (!set->per_enabled) {
+            if (set->enabled) {
+                rc = ble_ll_adv_per_start(set);
+            }
+            if (!rc) {
+                set->per_enabled = 1;
+            }
+        }
+    } else {
+        if (set->per_running) {
+            ble_ll_adv_per_stop(set);
+        }
+        set->per_enabled = 0;
+    }
+
+    return rc;
+}
+
+/**
+ * Stop all advertising sets, without the advertising set terminated events,
+ * and remove them (HCI reset).
+ *
+ * Context: Link Layer task
+ */
+void
+ble_ll_adv_ext_reset(void)
+{
+    int i;
+    struct ble_ll_adv_ext_set *set;
+
+    for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+        set = &g_ble_ll_adv_ext_sets[i];
+        if (set->enabled) {
+            ble_ll_adv_ext_stop(set);
+        } else if (set->per_running) {
+            ble_ll_adv_per_stop(set);
+        }
+        os_eventq_remove(&g_ll_data.ll_evq, &set->adv_ev.done_ev);
+        os_eventq_remove(&g_ll_data.ll_evq, &set->per_ev.done_ev);
+        if (set->in_use) {
+            ble_ll_adv_ext_set_free(set);
+        }
+    }
+
+    ble_ll_adv_ext_init();
+}
+
+/**
+ * Initialize extended and periodic advertising. Should be called once on
+ * initialization.
+ */
+void
+ble_ll_adv_ext_init(void)
+{
+    int i;
+    struct ble_ll_adv_ext_set *set;
+
+    memset(g_ble_ll_adv_ext_sets, 0, sizeof(g_ble_ll_adv_ext_sets));
+    for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; ++i) {
+        set = &g_ble_ll_adv_ext_sets[i];
+        set->adv_ev.done_ev.ev_type = BLE_LL_EVENT_ADV_EXT_DONE;
+        set->adv_ev.done_ev.ev_arg = set;
+        set->per_ev.done_ev.ev_type = BLE_LL_EVENT_ADV_PER_DONE;
+        set->per_ev.done_ev.ev_arg = set;
+    }
+}
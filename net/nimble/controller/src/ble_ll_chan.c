@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "controller/ll_chan.h"
+
+/* Is a channel used in the map? */
+#define BLE_LL_CHAN_IS_USED(map, chan)  \
+    ((map)[(chan) >> 3] & (1 << ((chan) & 0x07)))
+
+/**
+ * Count the used data channels in a channel map.
+ *
+ * @param map
+ *
+ * @return uint8_t Number of used channels.
+ */
+uint8_t
+ble_ll_chan_num_used(uint8_t *map)
+{
+    uint8_t chan;
+    uint8_t cnt;
+
+    cnt = 0;
+    for (chan = 0; chan < BLE_PHY_NUM_DATA_CHANS; ++chan) {
+        if (BLE_LL_CHAN_IS_USED(map, chan)) {
+            ++cnt;
+        }
+    }
+
+    return cnt;
+}
+
+/**
+ * Set a channel map. Counts the used channels and builds the remap table
+ * (the used channels in ascending order). Only needs to be called when the
+ * channel map changes.
+ *
+ * @param chmap
+ * @param map   The channel map (BLE_LL_CHAN_MAP_LEN bytes)
+ */
+void
+ble_ll_chan_map_set(struct ble_ll_chan_map *chmap, uint8_t *map)
+{
+    uint8_t chan;
+    uint8_t cnt;
+
+    memcpy(chmap->map, map, BLE_LL_CHAN_MAP_LEN);
+
+    cnt = 0;
+    for (chan = 0; chan < BLE_PHY_NUM_DATA_CHANS; ++chan) {
+        if (BLE_LL_CHAN_IS_USED(map, chan)) {
+            chmap->remap[cnt] = chan;
+            ++cnt;
+        }
+    }
+    chmap->num_used = cnt;
+}
+
+/**
+ * Channel selection algorithm #1 (Vol 6 Part B 4.5.8.2). The next unmapped
+ * channel is the last one plus the hop increment; if it is not used it is
+ * replaced by the used channel at index (unmapped % number used).
+ *
+ * @param chmap
+ * @param last_unmapped_chan Unmapped channel of the last event; updated.
+ * @param hop_inc
+ *
+ * @return uint8_t The data channel index.
+ */
+uint8_t
+ble_ll_chan_sel1(struct ble_ll_chan_map *chmap, uint8_t *last_unmapped_chan,
+                 uint8_t hop_inc)
+{
+    uint8_t chan;
+
+    chan = (*last_unmapped_chan + hop_inc) % BLE_PHY_NUM_DATA_CHANS;
+    *last_unmapped_chan = chan;
+
+    if (!BLE_LL_CHAN_IS_USED(chmap->map, chan)) {
+        chan = chmap->remap[chan % chmap->num_used];
+    }
+
+    return chan;
+}
+
+/**
+ * Calculate the channel identifier used by channel selection algorithm #2.
+ *
+ * @param access_addr
+ *
+ * @return uint16_t
+ */
+uint16_t
+ble_ll_chan_sel2_id(uint32_t access_addr)
+{
+    return (uint16_t)((access_addr >> 16) ^ access_addr);
+}
+
+/*
+ * The permutation of channel selection algorithm #2: reverse the bits in
+ * each byte. Done with three swap steps instead of a bit at a time.
+ */
+static inline uint16_t
+ble_ll_chan_perm(uint16_t x)
+{
+    x = ((x & 0x5555) << 1) | ((x >> 1) & 0x5555);
+    x = ((x & 0x3333) << 2) | ((x >> 2) & 0x3333);
+    x = ((x & 0x0f0f) << 4) | ((x >> 4) & 0x0f0f);
+    return x;
+}
+
+/* Multiply, add and modulo (2^16) operation */
+static inline uint16_t
+ble_ll_chan_mam(uint16_t a, uint16_t b)
+{
+    return (uint16_t)((17 * (uint32_t)a) + b);
+}
+
+/**
+ * Channel selection algorithm #2 (Vol 6 Part B 4.5.8.3). The event counter
+ * is run through three rounds of permute/multiply-add-modulo to get a
+ * pseudo random number; if the channel it maps to is not used, the number
+ * picks a used channel from the remap table instead.
+ *
+ * @param chmap
+ * @param counter   Event counter (connection event counter)
+ * @param chan_id   Channel identifier: see ble_ll_chan_sel2_id()
+ *
+ * @return uint8_t The data channel index.
+ */
+uint8_t
+ble_ll_chan_sel2(struct ble_ll_chan_map *chmap, uint16_t counter,
+                 uint16_t chan_id)
+{
+    uint8_t chan;
+    uint16_t prn_e;
+
+    prn_e = counter ^ chan_id;
+    prn_e = ble_ll_chan_mam(ble_ll_chan_perm(prn_e), chan_id);
+    prn_e = ble_ll_chan_mam(ble_ll_chan_perm(prn_e), chan_id);
+    prn_e = ble_ll_chan_mam(ble_ll_chan_perm(prn_e), chan_id);
+    prn_e ^= chan_id;
+
+    chan = prn_e % BLE_PHY_NUM_DATA_CHANS;
+    if (!BLE_LL_CHAN_IS_USED(chmap->map, chan)) {
+        chan = chmap->remap[((uint32_t)chmap->num_used * prn_e) >> 16];
+    }
+
+    return chan;
+}
@@ -0,0 +1,2382 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "os/os.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/hci_transport.h"
+#include "controller/phy.h"
+#include "controller/ll.h"
+#include "controller/ll_adv.h"
+#include "controller/ll_scan.h"
+#include "controller/ll_sched.h"
+#include "controller/ll_hci.h"
+#include "controller/ll_conn.h"
+#include "controller/ll_chan.h"
+#include "hal/hal_cputime.h"
+
+/* XXX: things to do
+ *  1) Connection update and channel map update procedures.
+ *  2) Slave latency. The slave listens at every connection event.
+ *  3) Procedure response timeout (40 seconds).
+ *  4) Encryption.
+ */
+
+#if (BLE_LL_CFG_SCHED_ITEMS < (BLE_LL_CONN_CFG_MAX_CONNS + 2))
+    #error "Not enough schedule items for the number of connections!"
+#endif
+
+/* Our sleep clock accuracy, as sent in the CONNECT_REQ */
+#define BLE_LL_CONN_CFG_OUR_SCA         (BLE_MASTER_SCA_31_50_PPM)
+
+/* Features supported; sent in the LL_FEATURE_RSP */
+#define BLE_LL_CONN_SUPP_FEATURES       \
+    (BLE_LL_FEAT_DATA_LEN_EXT | BLE_LL_FEAT_LE_PING)
+
+/* Version information sent in the LL_VERSION_IND (4.2, no company id) */
+#define BLE_LL_CONN_VERS_NR             (0x08)
+#define BLE_LL_CONN_COMPANY_ID          (0xFFFF)
+#define BLE_LL_CONN_SUB_VERS_NR         (0x0000)
+
+/*
+ * Connection event timing
+ *  JITTER: window widening added to the clock drift (the master may be
+ *  this late or early).
+ *  RX_MARGIN: time we keep listening after the longest frame we expect.
+ *  CE_GUARD: time left free at the end of the connection interval so the
+ *  next connection event can be scheduled and started on time.
+ */
+#define BLE_LL_CONN_JITTER_USECS        (16)
+#define BLE_LL_CONN_RX_MARGIN_USECS     (32)
+#define BLE_LL_CONN_CE_GUARD_USECS      (XCVR_TX_SCHED_DELAY_USECS + 150)
+
+/*
+ * Connection state machine
+ *
+ * The fields used during connection events (sequence numbers, the PDU being
+ * sent, the transmit queue and completed packets) are shared between the
+ * Link Layer task and interrupts.
+ *
+ *  cur_tx_pdu
+ *      The PDU being sent: a data PDU (possibly being fragmented), a control
+ *      PDU or the empty PDU. It stays here until acknowledged.
+ *  cur_tx_len
+ *      Payload length of the PDU (fragment) being sent.
+ */
+struct ble_ll_conn_sm
+{
+    /* Free list link (while not in use) */
+    STAILQ_ENTRY(ble_ll_conn_sm) free_stqe;
+
+    /* Current connection state and role */
+    uint8_t conn_state;
+    uint8_t conn_role;
+
+    /* Connection data length management */
+    uint16_t max_tx_octets;
+    uint16_t max_rx_octets;
+    uint16_t max_tx_time;
+    uint16_t max_rx_time;
+    uint16_t remote_max_tx_octets;
+    uint16_t remote_max_rx_octets;
+    uint16_t remote_max_tx_time;
+    uint16_t remote_max_rx_time;
+    uint16_t effective_max_tx_octets;
+    uint16_t effective_max_rx_octets;
+    uint16_t effective_max_tx_time;
+    uint16_t effective_max_rx_time;
+
+    /* Used to calculate data channel index for connection */
+    uint8_t chan_sel;
+    uint8_t last_unmapped_chan;
+    uint8_t data_chan_index;
+    uint8_t hop_inc;
+    uint16_t chan_id;
+    struct ble_ll_chan_map chan_map;
+
+    /* Acknowledgement and flow control */
+    uint8_t tx_seqnum;
+    uint8_t next_exp_seqnum;
+    uint8_t cons_rxd_bad_crc;
+    uint8_t last_txd_md;
+    uint8_t pkt_rxd;
+    uint8_t cur_tx_sent;
+    uint8_t cur_tx_len;
+
+    /* Control procedures */
+    uint8_t datalen_req_pending;
+    uint8_t vers_ind_sent;
+    uint8_t terminate_started;
+    uint8_t terminate_ind_txd;
+    uint8_t terminate_ind_rxd;
+    uint8_t rxd_disconnect_reason;
+
+    /* Connection parameters */
+    uint8_t master_sca;
+    uint8_t own_addr_type;
+    uint8_t init_filt_policy;
+    uint8_t peer_addr_type;
+    uint8_t peer_addr[BLE_DEV_ADDR_LEN];
+    uint16_t conn_handle;
+    uint16_t event_cntr;
+    uint16_t conn_itvl;
+    uint16_t slave_latency;
+    uint16_t supervision_tmo;
+    uint32_t access_addr;
+    uint32_t crcinit;
+
+    /* Connection event timing (cputime) */
+    uint32_t anchor_point;
+    uint32_t last_anchor_point;
+    uint32_t ce_end_time;
+    uint32_t last_rxd_pdu_cputime;
+    uint32_t slave_tx_win_usecs;
+    uint32_t slave_cur_window_widening;
+
+    /* Packets sent (and acknowledged) but not reported to the host yet */
+    uint16_t completed_pkts;
+
+    /* Transmit data */
+    struct os_mbuf *cur_tx_pdu;
+    STAILQ_HEAD(conn_txq_head, os_mbuf_pkthdr) conn_txq;
+
+    /* Scheduling */
+    struct ll_sched_item *conn_sch;
+    uint8_t sched_losses;
+    struct os_event conn_spawn_ev;
+    struct os_event conn_ev_end;
+};
+
+/*
+ * The connection state machines, for either role. The handle of a
+ * connection is its index plus one. State machines not in use are kept on
+ * the free list.
+ */
+struct ble_ll_conn_sm g_ble_ll_conn_sm[BLE_LL_CONN_CFG_MAX_CONNS];
+STAILQ_HEAD(ble_ll_conn_free_list, ble_ll_conn_sm) g_ble_ll_conn_free_list;
+
+/* The connection in a connection event; NULL if none */
+struct ble_ll_conn_sm *g_ble_ll_conn_cur_sm;
+
+/* The connection being created (initiating); NULL if none */
+struct ble_ll_conn_sm *g_ble_ll_conn_create_sm;
+
+/* The empty PDU and the CONNECT_REQ PDU */
+struct os_mbuf *g_ble_ll_conn_empty_pdu;
+struct os_mbuf *g_ble_ll_conn_req_pdu;
+
+/* Connection statistics */
+struct ble_ll_conn_stats g_ble_ll_conn_stats;
+
+/* Sleep clock accuracy (ppm), indexed by the SCA field of the CONNECT_REQ */
+static const uint16_t g_ble_sca_ppm_tbl[8] =
+{
+    500, 250, 150, 100, 75, 50, 30, 20
+};
+
+/**
+ * Calculates the data channel index of the next connection event.
+ *
+ * @param connsm
+ */
+static void
+ble_ll_conn_calc_dci(struct ble_ll_conn_sm *connsm)
+{
+    if (connsm->chan_sel == BLE_LL_CHAN_SEL_ALG_2) {
+        connsm->data_chan_index = ble_ll_chan_sel2(&connsm->chan_map,
+                                                   connsm->event_cntr,
+                                                   connsm->chan_id);
+    } else {
+        connsm->data_chan_index = ble_ll_chan_sel1(&connsm->chan_map,
+                                                   &connsm->last_unmapped_chan,
+                                                   connsm->hop_inc);
+    }
+}
+
+/**
+ * Calculate a random access address for a connection (also used for
+ * periodic advertising). The rules (Vol 6 Part B 2.1.2) are: not the
+ * advertising access address and not differing from it by only one bit;
+ * not all four octets equal; no more than six consecutive zeros or ones; no
+ * more than 24 transitions; at least two transitions in the six most
+ * significant bits.
+ *
+ * @return uint32_t
+ */
+uint32_t
+ble_ll_conn_calc_access_addr(void)
+{
+    int i;
+    int ok;
+    int run;
+    int transitions;
+    uint32_t aa;
+    uint32_t diff;
+    uint8_t bit;
+    uint8_t prev;
+
+    do {
+        aa = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+
+        ok = 1;
+        diff = aa ^ BLE_ACCESS_ADDR_ADV;
+        if ((diff == 0) || ((diff & (diff - 1)) == 0)) {
+            ok = 0;
+        }
+        if (((aa & 0xff) == ((aa >> 8) & 0xff)) &&
+            ((aa & 0xffff) == (aa >> 16))) {
+            ok = 0;
+        }
+
+        run = 1;
+        transitions = 0;
+        prev = aa & 1;
+        for (i = 1; i < 32; ++i) {
+            bit = (aa >> i) & 1;
+            if (bit == prev) {
+                ++run;
+                if (run > 6) {
+                    ok = 0;
+                }
+            } else {
+                run = 1;
+                ++transitions;
+            }
+            prev = bit;
+        }
+        if (transitions > 24) {
+            ok = 0;
+        }
+
+        transitions = 0;
+        for (i = 26; i < 31; ++i) {
+            if (((aa >> i) & 1) != ((aa >> (i + 1)) & 1)) {
+                ++transitions;
+            }
+        }
+        if (transitions < 2) {
+            ok = 0;
+        }
+    } while (!ok);
+
+    return aa;
+}
+
+/**
+ * Get a free connection state machine.
+ *
+ * Context: Link Layer task or interrupt (the advertiser creates connections
+ * when it receives a CONNECT_REQ).
+ *
+ * @return struct ble_ll_conn_sm* NULL if all are in use.
+ */
+static struct ble_ll_conn_sm *
+ble_ll_conn_sm_get(void)
+{
+    os_sr_t sr;
+    struct ble_ll_conn_sm *connsm;
+
+    OS_ENTER_CRITICAL(sr);
+    connsm = STAILQ_FIRST(&g_ble_ll_conn_free_list);
+    if (connsm) {
+        STAILQ_REMOVE_HEAD(&g_ble_ll_conn_free_list, free_stqe);
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if (!connsm) {
+        ++g_ble_ll_conn_stats.no_free_conn_sm;
+    }
+    return connsm;
+}
+
+/**
+ * Put a connection state machine back on the free list. State machines are
+ * used in turn, so a handle is not reused right after its connection ends.
+ *
+ * @param connsm
+ */
+static void
+ble_ll_conn_sm_free(struct ble_ll_conn_sm *connsm)
+{
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    connsm->conn_state = BLE_LL_CONN_STATE_IDLE;
+    connsm->conn_role = BLE_LL_CONN_ROLE_NONE;
+    STAILQ_INSERT_TAIL(&g_ble_ll_conn_free_list, connsm, free_stqe);
+    OS_EXIT_CRITICAL(sr);
+}
+
+/**
+ * Find the connection with the given handle. Only connections that have
+ * been created (CONNECT_REQ sent or received) are found.
+ *
+ * @param handle
+ *
+ * @return struct ble_ll_conn_sm* NULL if no such connection.
+ */
+static struct ble_ll_conn_sm *
+ble_ll_conn_find_active_conn(uint16_t handle)
+{
+    struct ble_ll_conn_sm *connsm;
+
+    if ((handle == 0) || (handle > BLE_LL_CONN_CFG_MAX_CONNS)) {
+        return NULL;
+    }
+
+    connsm = &g_ble_ll_conn_sm[handle - 1];
+    if (connsm->conn_state < BLE_LL_CONN_STATE_CREATED) {
+        return NULL;
+    }
+    return connsm;
+}
+
+/**
+ * Called when a connection state machine gets initialized, for either role.
+ *
+ * @param connsm
+ * @param role
+ */
+static void
+ble_ll_conn_sm_init(struct ble_ll_conn_sm *connsm, uint8_t role)
+{
+    connsm->conn_role = role;
+    connsm->conn_handle = (connsm - &g_ble_ll_conn_sm[0]) + 1;
+
+    /* Data length: we start with the defaults of the spec */
+    connsm->max_tx_time = g_ll_data.ll_params.conn_init_max_tx_time;
+    connsm->max_rx_time = g_ll_data.ll_params.supp_max_rx_time;
+    connsm->max_tx_octets = g_ll_data.ll_params.conn_init_max_tx_octets;
+    connsm->max_rx_octets = g_ll_data.ll_params.supp_max_rx_octets;
+    connsm->remote_max_rx_octets = BLE_LL_CONN_SUPP_BYTES_MIN;
+    connsm->remote_max_tx_octets = BLE_LL_CONN_SUPP_BYTES_MIN;
+    connsm->remote_max_rx_time = BLE_LL_CONN_SUPP_TIME_MIN;
+    connsm->remote_max_tx_time = BLE_LL_CONN_SUPP_TIME_MIN;
+    connsm->effective_max_tx_octets = BLE_LL_CONN_SUPP_BYTES_MIN;
+    connsm->effective_max_rx_octets = BLE_LL_CONN_SUPP_BYTES_MIN;
+    connsm->effective_max_tx_time = BLE_LL_CONN_SUPP_TIME_MIN;
+    connsm->effective_max_rx_time = BLE_LL_CONN_SUPP_TIME_MIN;
+
+    /* Reset flow control and procedures */
+    connsm->tx_seqnum = 0;
+    connsm->next_exp_seqnum = 0;
+    connsm->cons_rxd_bad_crc = 0;
+    connsm->last_txd_md = 0;
+    connsm->pkt_rxd = 0;
+    connsm->cur_tx_sent = 0;
+    connsm->cur_tx_len = 0;
+    connsm->datalen_req_pending = 0;
+    connsm->vers_ind_sent = 0;
+    connsm->terminate_started = 0;
+    connsm->terminate_ind_txd = 0;
+    connsm->terminate_ind_rxd = 0;
+    connsm->completed_pkts = 0;
+    connsm->event_cntr = 0;
+    connsm->chan_sel = BLE_LL_CHAN_SEL_ALG_1;
+    connsm->last_unmapped_chan = 0;
+    connsm->slave_tx_win_usecs = 0;
+    connsm->cur_tx_pdu = NULL;
+    connsm->conn_sch = NULL;
+    connsm->sched_losses = 0;
+    STAILQ_INIT(&connsm->conn_txq);
+}
+
+/**
+ * Recalculate the effective data length values of a connection. The number
+ * of octets sent is also limited by the time allowed to send them.
+ *
+ * @param connsm
+ *
+ * @return int 1 if any of the values changed; 0 otherwise.
+ */
+static int
+ble_ll_conn_calc_effective_datalen(struct ble_ll_conn_sm *connsm)
+{
+    int changed;
+    uint16_t tx_octets;
+    uint16_t rx_octets;
+    uint16_t tx_time;
+    uint16_t rx_time;
+    uint16_t time_octets;
+
+    tx_time = min(connsm->max_tx_time, connsm->remote_max_rx_time);
+    rx_time = min(connsm->max_rx_time, connsm->remote_max_tx_time);
+    tx_octets = min(connsm->max_tx_octets, connsm->remote_max_rx_octets);
+    rx_octets = min(connsm->max_rx_octets, connsm->remote_max_tx_octets);
+
+    time_octets = (tx_time / 8) - BLE_LL_OVERHEAD_LEN - BLE_LL_PDU_HDR_LEN;
+    tx_octets = min(tx_octets, time_octets);
+    time_octets = (rx_time / 8) - BLE_LL_OVERHEAD_LEN - BLE_LL_PDU_HDR_LEN;
+    rx_octets = min(rx_octets, time_octets);
+
+    changed = (tx_octets != connsm->effective_max_tx_octets) ||
+              (rx_octets != connsm->effective_max_rx_octets) ||
+              (tx_time != connsm->effective_max_tx_time) ||
+              (rx_time != connsm->effective_max_rx_time);
+
+    connsm->effective_max_tx_octets = tx_octets;
+    connsm->effective_max_rx_octets = rx_octets;
+    connsm->effective_max_tx_time = tx_time;
+    connsm->effective_max_rx_time = rx_time;
+
+    return changed;
+}
+
+/* Time (usecs) it takes to receive the longest PDU the peer may send */
+static uint32_t
+ble_ll_conn_rx_max_usecs(struct ble_ll_conn_sm *connsm)
+{
+    return ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN +
+                              connsm->effective_max_rx_octets);
+}
+
+/*
+ * Time (usecs) reserved for the events of a connection when placing other
+ * connections: one exchange of the longest PDUs, in 1.25 msec units.
+ */
+static uint32_t
+ble_ll_conn_slot_usecs(struct ble_ll_conn_sm *connsm)
+{
+    uint32_t usecs;
+
+    usecs = ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN +
+                               connsm->effective_max_tx_octets) +
+        BLE_LL_IFS + ble_ll_conn_rx_max_usecs(connsm) +
+        BLE_LL_CONN_RX_MARGIN_USECS;
+    usecs = (usecs + BLE_LL_CONN_ITVL_USECS - 1) / BLE_LL_CONN_ITVL_USECS;
+
+    return usecs * BLE_LL_CONN_ITVL_USECS;
+}
+
+/**
+ * Get the time by which the current connection event must be over: the end
+ * of the connection interval or the start of the next event of another
+ * connection, whichever is first. Running past the start of another
+ * connection's event would make that connection miss it.
+ *
+ * Context: Interrupt
+ *
+ * @param connsm
+ *
+ * @return uint32_t cputime
+ */
+static uint32_t
+ble_ll_conn_event_end_time(struct ble_ll_conn_sm *connsm)
+{
+    uint32_t end;
+    uint32_t next;
+
+    end = connsm->ce_end_time;
+    if (!ll_sched_next_start(BLE_LL_SCHED_PRIO_CONN, &next)) {
+        next -= cputime_usecs_to_ticks(BLE_LL_CONN_RX_MARGIN_USECS);
+        if ((int32_t)(next - end) < 0) {
+            end = next;
+        }
+    }
+
+    return end;
+}
+
+/**
+ * Calculate the window widening of the slave for the next connection event:
+ * the clock drift of both devices since the last anchor point we synced to.
+ *
+ * @param connsm
+ *
+ * @return uint32_t Window widening, in usecs.
+ */
+static uint32_t
+ble_ll_conn_calc_window_widening(struct ble_ll_conn_sm *connsm)
+{
+    uint32_t delta;
+    uint32_t ppm;
+    uint32_t ww;
+    uint32_t max_ww;
+
+    delta = cputime_ticks_to_usecs(connsm->anchor_point -
+                                   connsm->last_anchor_point);
+    ppm = g_ble_sca_ppm_tbl[connsm->master_sca] + BLE_CLOCK_DRIFT_ACTIVE;
+    ww = (((delta / 16) * ppm) / 62500) + BLE_LL_CONN_JITTER_USECS;
+
+    max_ww = ((connsm->conn_itvl * BLE_LL_CONN_ITVL_USECS) / 2) - BLE_LL_IFS;
+    if (ww > max_ww) {
+        ww = max_ww;
+    }
+
+    return ww;
+}
+
+/**
+ * Send a control PDU. Control PDUs are sent before any queued data, in the
+ * order they were queued.
+ *
+ * Context: Link Layer task
+ *
+ * @param connsm
+ * @param opcode
+ * @param ctrdata Control data (after the opcode)
+ * @param len Length of control data
+ *
+ * @return int 0: success; -1 if no buffer.
+ */
+static int
+ble_ll_conn_ctrl_pdu_send(struct ble_ll_conn_sm *connsm, uint8_t opcode,
+                          uint8_t *ctrdata, uint8_t len)
+{
+    os_sr_t sr;
+    uint8_t *dptr;
+    struct os_mbuf *om;
+    struct os_mbuf *m;
+    struct os_mbuf_pkthdr *pkthdr;
+    struct os_mbuf_pkthdr *prev;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (!om) {
+        return -1;
+    }
+
+    dptr = om->om_data;
+    dptr[0] = BLE_LL_LLID_CTRL;
+    dptr[1] = len + 1;
+    dptr[2] = opcode;
+    if (len) {
+        memcpy(dptr + 3, ctrdata, len);
+    }
+    om->om_len = BLE_LL_PDU_HDR_LEN + 1 + len;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    /* Put it after the control PDUs at the head of the queue */
+    prev = NULL;
+    OS_ENTER_CRITICAL(sr);
+    STAILQ_FOREACH(pkthdr, &connsm->conn_txq, omp_next) {
+        m = (struct os_mbuf *)((uint8_t *)pkthdr - sizeof(struct os_mbuf));
+        if ((m->om_data[0] & BLE_LL_DATA_HDR_LLID_MASK) != BLE_LL_LLID_CTRL) {
+            break;
+        }
+        prev = pkthdr;
+    }
+    if (prev) {
+        STAILQ_INSERT_AFTER(&connsm->conn_txq, prev, OS_MBUF_PKTHDR(om),
+                            omp_next);
+    } else {
+        STAILQ_INSERT_HEAD(&connsm->conn_txq, OS_MBUF_PKTHDR(om), omp_next);
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    return 0;
+}
+
+/**
+ * Send a LL_LENGTH_REQ or LL_LENGTH_RSP with our data length parameters.
+ *
+ * @param connsm
+ * @param opcode
+ *
+ * @return int
+ */
+static int
+ble_ll_conn_datalen_pdu_send(struct ble_ll_conn_sm *connsm, uint8_t opcode)
+{
+    uint8_t buf[BLE_LL_CTRL_LENGTH_REQ_LEN];
+
+    htole16(buf, connsm->max_rx_octets);
+    htole16(buf + 2, connsm->max_rx_time);
+    htole16(buf + 4, connsm->max_tx_octets);
+    htole16(buf + 6, connsm->max_tx_time);
+
+    return ble_ll_conn_ctrl_pdu_send(connsm, opcode, buf, sizeof(buf));
+}
+
+/* Start the data length update procedure */
+static void
+ble_ll_conn_datalen_req_send(struct ble_ll_conn_sm *connsm)
+{
+    if (!connsm->datalen_req_pending) {
+        if (!ble_ll_conn_datalen_pdu_send(connsm, BLE_LL_CTRL_LENGTH_REQ)) {
+            connsm->datalen_req_pending = 1;
+        }
+    }
+}
+
+/**
+ * Send a connection complete event (LE meta event) to the host.
+ *
+ * @param connsm
+ * @param status
+ */
+static void
+ble_ll_conn_comp_event_send(struct ble_ll_conn_sm *connsm, uint8_t status)
+{
+    uint8_t *evbuf;
+    struct os_mbuf *om;
+
+    if (!ble_ll_hci_is_le_event_enabled(BLE_HCI_LE_SUBEV_CONN_COMPLETE - 1)) {
+        return;
+    }
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (om) {
+        evbuf = om->om_data;
+        evbuf[0] = BLE_HCI_EVCODE_LE_META;
+        evbuf[1] = BLE_HCI_LE_CONN_COMPLETE_LEN;
+        evbuf[2] = BLE_HCI_LE_SUBEV_CONN_COMPLETE;
+        evbuf[3] = status;
+        if (status == BLE_ERR_SUCCESS) {
+            htole16(evbuf + 4, connsm->conn_handle);
+            if (connsm->conn_role == BLE_LL_CONN_ROLE_MASTER) {
+                evbuf[6] = BLE_HCI_LE_CONN_COMPLETE_ROLE_MASTER;
+            } else {
+                evbuf[6] = BLE_HCI_LE_CONN_COMPLETE_ROLE_SLAVE;
+            }
+            evbuf[7] = connsm->peer_addr_type;
+            memcpy(evbuf + 8, connsm->peer_addr, BLE_DEV_ADDR_LEN);
+            htole16(evbuf + 14, connsm->conn_itvl);
+            htole16(evbuf + 16, connsm->slave_latency);
+            htole16(evbuf + 18, connsm->supervision_tmo);
+            evbuf[20] = connsm->master_sca;
+        } else {
+            memset(evbuf + 4, 0, BLE_HCI_LE_CONN_COMPLETE_LEN - 2);
+        }
+        ble_ll_hci_event_send(om);
+    }
+}
+
+/**
+ * Send a disconnection complete event to the host.
+ *
+ * @param connsm
+ * @param reason
+ */
+static void
+ble_ll_conn_disconn_comp_event_send(struct ble_ll_conn_sm *connsm,
+                                    uint8_t reason)
+{
+    uint8_t *evbuf;
+    struct os_mbuf *om;
+
+    if (!ble_ll_hci_is_event_enabled(BLE_HCI_EVCODE_DISCNXN_CMP - 1)) {
+        return;
+    }
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (om) {
+        evbuf = om->om_data;
+        evbuf[0] = BLE_HCI_EVCODE_DISCNXN_CMP;
+        evbuf[1] = BLE_HCI_EVENT_DISCONN_COMPLETE_LEN;
+        evbuf[2] = BLE_ERR_SUCCESS;
+        htole16(evbuf + 3, connsm->conn_handle);
+        evbuf[5] = reason;
+        ble_ll_hci_event_send(om);
+    }
+}
+
+/**
+ * Send a data length change event (LE meta event) to the host.
+ *
+ * @param connsm
+ */
+static void
+ble_ll_conn_datalen_chg_event_send(struct ble_ll_conn_sm *connsm)
+{
+    uint8_t *evbuf;
+    struct os_mbuf *om;
+
+    if (!ble_ll_hci_is_le_event_enabled(BLE_HCI_LE_SUBEV_DATA_LEN_CHG - 1)) {
+        return;
+    }
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (om) {
+        evbuf = om->om_data;
+        evbuf[0] = BLE_HCI_EVCODE_LE_META;
+        evbuf[1] = BLE_HCI_LE_DATA_LEN_CHG_LEN;
+        evbuf[2] = BLE_HCI_LE_SUBEV_DATA_LEN_CHG;
+        htole16(evbuf + 3, connsm->conn_handle);
+        htole16(evbuf + 5, connsm->effective_max_tx_octets);
+        htole16(evbuf + 7, connsm->effective_max_tx_time);
+        htole16(evbuf + 9, connsm->effective_max_rx_octets);
+        htole16(evbuf + 11, connsm->effective_max_rx_time);
+        ble_ll_hci_event_send(om);
+    }
+}
+
+/**
+ * Send a channel selection algorithm event to the host.
+ *
+ * @param connsm
+ */
+static void
+ble_ll_conn_chan_sel_event_send(struct ble_ll_conn_sm *connsm)
+{
+    uint8_t *evbuf;
+    struct os_mbuf *om;
+
+    if (!ble_ll_hci_is_le_event_enabled(BLE_HCI_LE_SUBEV_CHAN_SEL_ALG - 1)) {
+        return;
+    }
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (om) {
+        evbuf = om->om_data;
+        evbuf[0] = BLE_HCI_EVCODE_LE_META;
+        evbuf[1] = BLE_HCI_LE_CHAN_SEL_ALG_LEN;
+        evbuf[2] = BLE_HCI_LE_SUBEV_CHAN_SEL_ALG;
+        htole16(evbuf + 3, connsm->conn_handle);
+        evbuf[5] = connsm->chan_sel;
+        ble_ll_hci_event_send(om);
+    }
+}
+
+/**
+ * Get the PDU to send next and set its header (LLID, NESN, SN, MD and
+ * length). This is the PDU that has not been acknowledged yet, the next
+ * queued PDU or the empty PDU. PDUs longer than the effective maximum are
+ * sent in fragments, in place: see ble_ll_conn_tx_ack().
+ *
+ * Context: Interrupt
+ *
+ * @param connsm
+ *
+ * @return struct os_mbuf*
+ */
+static struct os_mbuf *
+ble_ll_conn_tx_pdu_get(struct ble_ll_conn_sm *connsm)
+{
+    uint8_t md;
+    uint8_t hdr;
+    struct os_mbuf *m;
+    struct os_mbuf_pkthdr *pkthdr;
+
+    m = connsm->cur_tx_pdu;
+    if (!m) {
+        pkthdr = STAILQ_FIRST(&connsm->conn_txq);
+        if (pkthdr) {
+            STAILQ_REMOVE_HEAD(&connsm->conn_txq, omp_next);
+            m = (struct os_mbuf *)((uint8_t *)pkthdr - sizeof(struct os_mbuf));
+            connsm->cur_tx_len = min(m->om_len - BLE_LL_PDU_HDR_LEN,
+                                     connsm->effective_max_tx_octets);
+        } else {
+            m = g_ble_ll_conn_empty_pdu;
+            connsm->cur_tx_len = 0;
+        }
+        connsm->cur_tx_pdu = m;
+        connsm->cur_tx_sent = 0;
+    }
+
+    /* More data if this PDU is a fragment or more PDUs are queued */
+    md = 0;
+    if ((m != g_ble_ll_conn_empty_pdu) &&
+        ((m->om_len - BLE_LL_PDU_HDR_LEN) > connsm->cur_tx_len)) {
+        md = 1;
+    }
+    if (!STAILQ_EMPTY(&connsm->conn_txq)) {
+        md = 1;
+    }
+
+    hdr = m->om_data[0] & BLE_LL_DATA_HDR_LLID_MASK;
+    if (connsm->next_exp_seqnum) {
+        hdr |= BLE_LL_DATA_HDR_NESN_MASK;
+    }
+    if (connsm->tx_seqnum) {
+        hdr |= BLE_LL_DATA_HDR_SN_MASK;
+    }
+    if (md) {
+        hdr |= BLE_LL_DATA_HDR_MD_MASK;
+    }
+    m->om_data[0] = hdr;
+    m->om_data[1] = connsm->cur_tx_len;
+    connsm->last_txd_md = md;
+
+    return m;
+}
+
+/**
+ * Transmit the PDU returned by ble_ll_conn_tx_pdu_get().
+ *
+ * Context: Interrupt
+ *
+ * @return int 0: success; PHY error code otherwise.
+ */
+static int
+ble_ll_conn_tx(struct ble_ll_conn_sm *connsm, struct os_mbuf *m,
+               uint8_t beg_trans, uint8_t end_trans)
+{
+    int rc;
+
+    rc = ble_phy_tx(m, beg_trans, end_trans);
+    if (!rc) {
+        if (connsm->cur_tx_sent) {
+            ++g_ble_ll_conn_stats.tx_retransmits;
+        } else if (m == g_ble_ll_conn_empty_pdu) {
+            ++g_ble_ll_conn_stats.tx_empty_pdus;
+        }
+        connsm->cur_tx_sent = 1;
+    }
+
+    return rc;
+}
+
+/**
+ * Called when the peer has acknowledged the PDU we sent. The next fragment
+ * of a data PDU is sent from the same mbuf: the data pointer is moved past
+ * the acknowledged data and the PDU header of the next fragment overwrites
+ * the last two bytes sent. Completed data packets are counted so the host
+ * can be told its buffers are free.
+ *
+ * Context: Interrupt
+ *
+ * @param connsm
+ */
+static void
+ble_ll_conn_tx_ack(struct ble_ll_conn_sm *connsm)
+{
+    uint8_t llid;
+    uint16_t remaining;
+    struct os_mbuf *m;
+
+    connsm->tx_seqnum ^= 1;
+    connsm->cur_tx_sent = 0;
+
+    m = connsm->cur_tx_pdu;
+    if (m == g_ble_ll_conn_empty_pdu) {
+        connsm->cur_tx_pdu = NULL;
+        return;
+    }
+
+    llid = m->om_data[0] & BLE_LL_DATA_HDR_LLID_MASK;
+    if (llid == BLE_LL_LLID_CTRL) {
+        ++g_ble_ll_conn_stats.tx_ctrl_pdus;
+    } else {
+        ++g_ble_ll_conn_stats.tx_data_pdus;
+        g_ble_ll_conn_stats.tx_data_bytes += connsm->cur_tx_len;
+    }
+
+    remaining = m->om_len - BLE_LL_PDU_HDR_LEN - connsm->cur_tx_len;
+    if (remaining) {
+        m->om_data += connsm->cur_tx_len;
+        m->om_len -= connsm->cur_tx_len;
+        OS_MBUF_PKTHDR(m)->omp_len = m->om_len;
+        m->om_data[0] = BLE_LL_LLID_DATA_FRAG;
+        connsm->cur_tx_len = min(remaining, connsm->effective_max_tx_octets);
+        return;
+    }
+
+    if (llid == BLE_LL_LLID_CTRL) {
+        if (m->om_data[2] == BLE_LL_CTRL_TERMINATE_IND) {
+            connsm->terminate_ind_txd = 1;
+        }
+    } else {
+        ++connsm->completed_pkts;
+    }
+    os_mbuf_free_chain(&g_mbuf_pool, m);
+    connsm->cur_tx_pdu = NULL;
+}
+
+/**
+ * Get the start time of the next connection event, and the window widening
+ * of the slave. The master starts the item so its first PDU goes out at the
+ * anchor point (late by the interrupt latency, which the window widening of
+ * the slave covers). The slave listens from the anchor point less the window
+ * widening.
+ *
+ * @param connsm
+ *
+ * @return uint32_t
+ */
+static uint32_t
+ble_ll_conn_event_start_time(struct ble_ll_conn_sm *connsm)
+{
+    uint32_t usecs;
+
+    if (connsm->conn_role == BLE_LL_CONN_ROLE_MASTER) {
+        usecs = XCVR_TX_START_DELAY_USECS;
+    } else {
+        connsm->slave_cur_window_widening =
+            ble_ll_conn_calc_window_widening(connsm);
+        usecs = connsm->slave_cur_window_widening + XCVR_RX_SCHED_DELAY_USECS;
+    }
+
+    return connsm->anchor_point - cputime_usecs_to_ticks(usecs);
+}
+
+/**
+ * Scheduler callback at the end of a connection event.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param sch
+ *
+ * @return int
+ */
+static int
+ble_ll_conn_event_end_cb(struct ll_sched_item *sch)
+{
+    struct ble_ll_conn_sm *connsm;
+
+    connsm = (struct ble_ll_conn_sm *)sch->cb_arg;
+
+    ble_phy_disable();
+    ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    g_ble_ll_conn_cur_sm = NULL;
+    connsm->conn_sch = NULL;
+
+    ble_ll_event_send(&connsm->conn_ev_end);
+    return BLE_LL_SCHED_STATE_DONE;
+}
+
+/**
+ * Called by the scheduler when a connection event is stopped for the event
+ * of another connection that lost more conflicts. This connection goes
+ * first the next time the two overlap.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param sch
+ */
+static void
+ble_ll_conn_event_preempt(struct ll_sched_item *sch)
+{
+    struct ble_ll_conn_sm *connsm;
+
+    connsm = (struct ble_ll_conn_sm *)sch->cb_arg;
+    if (connsm->sched_losses < UINT8_MAX) {
+        ++connsm->sched_losses;
+    }
+    ble_ll_conn_event_end_cb(sch);
+}
+
+/**
+ * Scheduler callback at the start of a connection event. The master sends
+ * the first PDU at the anchor point; the slave listens for it.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param sch
+ *
+ * @return int
+ */
+static int
+ble_ll_conn_event_start_cb(struct ll_sched_item *sch)
+{
+    int rc;
+    int32_t late;
+    uint32_t usecs;
+    struct os_mbuf *m;
+    struct ble_ll_conn_sm *connsm;
+
+    /*
+     * An event held up by another connection's event is skipped if it can
+     * no longer start on time: the master would send after the slave has
+     * stopped listening, or the slave would listen after the master sent.
+     */
+    connsm = (struct ble_ll_conn_sm *)sch->cb_arg;
+    late = (int32_t)(cputime_get32() - ble_ll_conn_event_start_time(connsm));
+    if (late > (int32_t)cputime_usecs_to_ticks(BLE_LL_CONN_JITTER_USECS)) {
+        ++g_ble_ll_conn_stats.conn_ev_missed;
+        if (connsm->sched_losses < UINT8_MAX) {
+            ++connsm->sched_losses;
+        }
+        return ble_ll_conn_event_end_cb(sch);
+    }
+
+    g_ble_ll_conn_cur_sm = connsm;
+    connsm->sched_losses = 0;
+    connsm->pkt_rxd = 0;
+    connsm->cons_rxd_bad_crc = 0;
+
+    rc = ble_phy_setchan(connsm->data_chan_index, connsm->access_addr,
+                         connsm->crcinit);
+    assert(rc == 0);
+
+    ble_ll_state_set(BLE_LL_STATE_CONNECT);
+    if (connsm->conn_role == BLE_LL_CONN_ROLE_MASTER) {
+        m = ble_ll_conn_tx_pdu_get(connsm);
+        rc = ble_ll_conn_tx(connsm, m, BLE_PHY_TRANSITION_NONE,
+                            BLE_PHY_TRANSITION_TX_RX);
+        usecs = XCVR_TX_START_DELAY_USECS +
+            ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN + m->om_data[1]) +
+            BLE_LL_IFS + ble_ll_conn_rx_max_usecs(connsm);
+        sch->next_wakeup = cputime_get32() + cputime_usecs_to_ticks(usecs);
+    } else {
+        rc = ble_phy_rx();
+        usecs = connsm->slave_cur_window_widening + connsm->slave_tx_win_usecs +
+            ble_ll_conn_rx_max_usecs(connsm);
+        sch->next_wakeup = connsm->anchor_point + cputime_usecs_to_ticks(usecs);
+    }
+    sch->next_wakeup += cputime_usecs_to_ticks(BLE_LL_CONN_RX_MARGIN_USECS);
+
+    if (rc) {
+        /* Could not start the event; skip it */
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+        return ble_ll_conn_event_end_cb(sch);
+    }
+
+    sch->sched_cb = ble_ll_conn_event_end_cb;
+    return BLE_LL_SCHED_STATE_RUNNING;
+}
+
+/**
+ * Schedule the next connection event.
+ *
+ * @param connsm
+ *
+ * @return struct ll_sched_item* NULL if no schedule item.
+ */
+static struct ll_sched_item *
+ble_ll_conn_sched_set(struct ble_ll_conn_sm *connsm)
+{
+    int rc;
+    uint32_t usecs;
+    struct ll_sched_item *sch;
+
+    sch = ll_sched_get_item();
+    if (sch) {
+        /*
+         * Set sched type and priority. Only the event of another connection
+         * preempts a connection event, when this connection lost fewer
+         * conflicts in a row.
+         */
+        sch->sched_type = BLE_LL_SCHED_TYPE_CONN;
+        sch->sched_prio = BLE_LL_SCHED_PRIO_CONN;
+        sch->sched_losses = connsm->sched_losses;
+        sch->preempt_cb = ble_ll_conn_event_preempt;
+
+        sch->start_time = ble_ll_conn_event_start_time(connsm);
+        sch->cb_arg = connsm;
+        sch->sched_cb = ble_ll_conn_event_start_cb;
+
+        /*
+         * The event must end before the next one starts. The schedule item
+         * only claims the time reserved for the connection: the event goes
+         * on past it only while nothing else needs the radio.
+         */
+        usecs = (connsm->conn_itvl * BLE_LL_CONN_ITVL_USECS) -
+            BLE_LL_CONN_CE_GUARD_USECS;
+        connsm->ce_end_time = connsm->anchor_point +
+            cputime_usecs_to_ticks(usecs);
+        sch->end_time = connsm->anchor_point +
+            cputime_usecs_to_ticks(ble_ll_conn_slot_usecs(connsm));
+
+        connsm->conn_sch = sch;
+        rc = ll_sched_add(sch);
+        assert(rc == 0);
+    } else {
+        ++g_ble_ll_conn_stats.cant_set_sched;
+    }
+
+    return sch;
+}
+
+/**
+ * Move to the next connection event: update the event counter, anchor point
+ * and data channel. Events that can no longer be started on time are
+ * skipped.
+ *
+ * Context: Link Layer task
+ *
+ * @param connsm
+ */
+static void
+ble_ll_conn_next_event(struct ble_ll_conn_sm *connsm)
+{
+    uint32_t itvl;
+
+    connsm->slave_tx_win_usecs = 0;
+    itvl = cputime_usecs_to_ticks(connsm->conn_itvl * BLE_LL_CONN_ITVL_USECS);
+    while (1) {
+        ++connsm->event_cntr;
+        connsm->anchor_point += itvl;
+        ble_ll_conn_calc_dci(connsm);
+        if ((int32_t)(ble_ll_conn_event_start_time(connsm) -
+                      cputime_get32()) >= 0) {
+            break;
+        }
+        ++g_ble_ll_conn_stats.conn_ev_late;
+    }
+}
+
+/**
+ * Called when a connection has been created (CONNECT_REQ sent or received).
+ * Schedules the first connection event and tells the LL task.
+ *
+ * Context: Interrupt
+ *
+ * @param connsm
+ * @param conn_req_end End of the CONNECT_REQ (cputime)
+ * @param anchor_usecs Time from the end of the CONNECT_REQ to the first
+ * anchor point. For the slave, this is the start of the transmit window.
+ */
+static void
+ble_ll_conn_created(struct ble_ll_conn_sm *connsm, uint32_t conn_req_end,
+                    uint32_t anchor_usecs)
+{
+    struct ll_sched_item *sch;
+
+    connsm->conn_state = BLE_LL_CONN_STATE_CREATED;
+    ++g_ble_ll_conn_stats.conns_created;
+
+    connsm->anchor_point = conn_req_end + cputime_usecs_to_ticks(anchor_usecs);
+    connsm->last_anchor_point = conn_req_end;
+    connsm->last_rxd_pdu_cputime = conn_req_end;
+    ble_ll_conn_calc_dci(connsm);
+
+    /*
+     * A connection holds at most one schedule item at a time, and there is
+     * one for every connection (see the check at the top of this file).
+     */
+    sch = ble_ll_conn_sched_set(connsm);
+    assert(sch != NULL);
+
+    ble_ll_event_send(&connsm->conn_spawn_ev);
+}
+
+/**
+ * Free the packets a connection has not sent.
+ *
+ * @param connsm
+ *
+ * @return uint16_t The number of data (not control) packets freed.
+ */
+static uint16_t
+ble_ll_conn_tx_free(struct ble_ll_conn_sm *connsm)
+{
+    uint16_t pkts;
+    struct os_mbuf *m;
+    struct os_mbuf_pkthdr *pkthdr;
+
+    pkts = 0;
+    m = connsm->cur_tx_pdu;
+    if (m && (m != g_ble_ll_conn_empty_pdu)) {
+        if ((m->om_data[0] & BLE_LL_DATA_HDR_LLID_MASK) != BLE_LL_LLID_CTRL) {
+            ++pkts;
+        }
+        os_mbuf_free_chain(&g_mbuf_pool, m);
+    }
+    connsm->cur_tx_pdu = NULL;
+
+    while ((pkthdr = STAILQ_FIRST(&connsm->conn_txq)) != NULL) {
+        STAILQ_REMOVE_HEAD(&connsm->conn_txq, omp_next);
+        m = (struct os_mbuf *)((uint8_t *)pkthdr - sizeof(struct os_mbuf));
+        if ((m->om_data[0] & BLE_LL_DATA_HDR_LLID_MASK) != BLE_LL_LLID_CTRL) {
+            ++pkts;
+        }
+        os_mbuf_free_chain(&g_mbuf_pool, m);
+    }
+
+    return pkts;
+}
+
+/**
+ * End a connection. Packets not sent are freed (and the host given back the
+ * buffers) and the host is told the connection is gone.
+ *
+ * Context: Link Layer task
+ *
+ * @param connsm
+ * @param reason
+ */
+static void
+ble_ll_conn_end(struct ble_ll_conn_sm *connsm, uint8_t reason)
+{
+    os_sr_t sr;
+    uint16_t pkts;
+
+    OS_ENTER_CRITICAL(sr);
+    if (connsm->conn_sch) {
+        ll_sched_rmv_item(connsm->conn_sch);
+        connsm->conn_sch = NULL;
+    }
+    if (g_ble_ll_conn_cur_sm == connsm) {
+        ble_phy_disable();
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+        g_ble_ll_conn_cur_sm = NULL;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    pkts = connsm->completed_pkts + ble_ll_conn_tx_free(connsm);
+    if (pkts) {
+        ble_ll_hci_num_comp_pkts_send(connsm->conn_handle, pkts);
+    }
+    connsm->completed_pkts = 0;
+
+    ble_ll_conn_disconn_comp_event_send(connsm, reason);
+
+    ble_ll_conn_sm_free(connsm);
+}
+
+/**
+ * Process the connection spawn event: tell the host about the new
+ * connection (or that connection creation was cancelled) and start the data
+ * length update procedure if we want more than the defaults.
+ *
+ * Context: Link Layer task
+ *
+ * @param arg Pointer to connection state machine.
+ */
+void
+ble_ll_conn_spawn_proc(void *arg)
+{
+    struct ble_ll_conn_sm *connsm;
+
+    connsm = (struct ble_ll_conn_sm *)arg;
+    if (connsm->conn_state == BLE_LL_CONN_STATE_IDLE) {
+        ble_ll_conn_comp_event_send(connsm, BLE_ERR_UNK_CONN_ID);
+        ble_ll_conn_sm_free(connsm);
+        return;
+    }
+
+    ble_ll_conn_comp_event_send(connsm, BLE_ERR_SUCCESS);
+    ble_ll_conn_chan_sel_event_send(connsm);
+
+    if ((connsm->max_tx_octets != BLE_LL_CONN_SUPP_BYTES_MIN) ||
+        (connsm->max_rx_octets != BLE_LL_CONN_SUPP_BYTES_MIN) ||
+        (connsm->max_tx_time != BLE_LL_CONN_SUPP_TIME_MIN) ||
+        (connsm->max_rx_time != BLE_LL_CONN_SUPP_TIME_MIN)) {
+        ble_ll_conn_datalen_req_send(connsm);
+    }
+}
+
+/**
+ * Process the end of a connection event. Tells the host which packets were
+ * sent, ends the connection if it was terminated or lost and schedules the
+ * next connection event otherwise.
+ *
+ * Context: Link Layer task
+ *
+ * @param arg Pointer to connection state machine.
+ */
+void
+ble_ll_conn_event_end_proc(void *arg)
+{
+    os_sr_t sr;
+    uint16_t pkts;
+    uint32_t tmo;
+    struct ll_sched_item *sch;
+    struct ble_ll_conn_sm *connsm;
+
+    connsm = (struct ble_ll_conn_sm *)arg;
+    if (connsm->conn_state < BLE_LL_CONN_STATE_CREATED) {
+        return;
+    }
+
+    /*
+     * Packets are only taken off the count once the host has been told
+     * about them; if the event cannot be sent they are reported at the end
+     * of the next connection event.
+     */
+    OS_ENTER_CRITICAL(sr);
+    pkts = connsm->completed_pkts;
+    OS_EXIT_CRITICAL(sr);
+    if (pkts && !ble_ll_hci_num_comp_pkts_send(connsm->conn_handle, pkts)) {
+        OS_ENTER_CRITICAL(sr);
+        connsm->completed_pkts -= pkts;
+        OS_EXIT_CRITICAL(sr);
+    }
+
+    if (!connsm->pkt_rxd) {
+        ++g_ble_ll_conn_stats.conn_ev_no_rx;
+    }
+
+    /* Terminated by us or by the peer? */
+    if (connsm->terminate_ind_txd) {
+        ble_ll_conn_end(connsm, BLE_ERR_CONN_TERM_LOCAL);
+        return;
+    }
+    if (connsm->terminate_ind_rxd) {
+        ble_ll_conn_end(connsm, connsm->rxd_disconnect_reason);
+        return;
+    }
+
+    /* Was the connection lost or never established? */
+    if (connsm->conn_state == BLE_LL_CONN_STATE_CREATED) {
+        if (connsm->event_cntr >= (BLE_LL_CONN_ESTABLISH_EVENTS - 1)) {
+            ++g_ble_ll_conn_stats.establish_fails;
+            ble_ll_conn_end(connsm, BLE_ERR_CONN_ESTABLISHMENT);
+            return;
+        }
+    } else {
+        tmo = cputime_usecs_to_ticks(connsm->supervision_tmo *
+                                     BLE_HCI_CONN_SPVN_TMO_UNITS * 1000);
+        if ((int32_t)(cputime_get32() - connsm->last_rxd_pdu_cputime) >=
+            (int32_t)tmo) {
+            ++g_ble_ll_conn_stats.supervision_tmos;
+            ble_ll_conn_end(connsm, BLE_ERR_CONN_TMO);
+            return;
+        }
+    }
+
+    /* The item of the event that just ended was freed when it ended */
+    ble_ll_conn_next_event(connsm);
+    sch = ble_ll_conn_sched_set(connsm);
+    assert(sch != NULL);
+}
+
+/**
+ * ble ll conn rx isr start
+ *
+ * Called when a data channel PDU reception has started.
+ *
+ * Context: Interrupt
+ *
+ * @param rxpdu
+ *
+ * @return int
+ *   < 0: Not in a connection event; abort.
+ *   > 0: Continue to receive; we may respond.
+ */
+int
+ble_ll_conn_rx_isr_start(struct os_mbuf *rxpdu)
+{
+    if (!g_ble_ll_conn_cur_sm) {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * ble ll conn rx isr end
+ *
+ * Called when a data channel PDU has been received. Handles the
+ * acknowledgement of the PDU we sent (NESN) and of the received PDU (SN),
+ * hands new PDUs with a payload to the LL task and decides whether the
+ * connection event continues: the master sends again if either side has more
+ * data (or the PDU failed the CRC) and there is time left in the event; the
+ * slave always responds to the master. Two consecutive CRC errors close the
+ * event.
+ *
+ * Context: Interrupt
+ *
+ * @param rxpdu
+ * @param crcok
+ *
+ * @return int
+ *       < 0: Disable the phy after reception.
+ *      == 0: Success. Do not disable the PHY.
+ *       > 0: Do not disable PHY as that has already been done.
+ */
+int
+ble_ll_conn_rx_isr_end(struct os_mbuf *rxpdu, uint8_t crcok)
+{
+    int rc;
+    int pass_up;
+    uint8_t hdr;
+    uint8_t len;
+    uint8_t llid;
+    uint8_t peer_md;
+    uint8_t end_trans;
+    uint32_t rx_end;
+    uint32_t usecs;
+    uint32_t next;
+    uint32_t end;
+    struct os_mbuf *m;
+    struct ble_mbuf_hdr *ble_hdr;
+    struct ble_ll_conn_sm *connsm;
+
+    connsm = g_ble_ll_conn_cur_sm;
+    if (!connsm) {
+        os_mbuf_free(&g_mbuf_pool, rxpdu);
+        return -1;
+    }
+
+    hdr = rxpdu->om_data[0];
+    len = rxpdu->om_data[1];
+    llid = hdr & BLE_LL_DATA_HDR_LLID_MASK;
+    ble_hdr = BLE_MBUF_HDR_PTR(rxpdu);
+    rx_end = ble_hdr->end_cputime;
+
+    pass_up = 0;
+    peer_md = 0;
+    if (crcok) {
+        connsm->cons_rxd_bad_crc = 0;
+        connsm->last_rxd_pdu_cputime = rx_end;
+        if (connsm->conn_state == BLE_LL_CONN_STATE_CREATED) {
+            connsm->conn_state = BLE_LL_CONN_STATE_ESTABLISHED;
+            ++g_ble_ll_conn_stats.conns_established;
+        }
+
+        /* The slave syncs to the first PDU from the master in the event */
+        if ((connsm->conn_role == BLE_LL_CONN_ROLE_SLAVE) && !connsm->pkt_rxd) {
+            usecs = ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN + len);
+            connsm->anchor_point = rx_end - cputime_usecs_to_ticks(usecs);
+            connsm->last_anchor_point = connsm->anchor_point;
+        }
+
+        /* Did the peer acknowledge what we sent? */
+        if (connsm->cur_tx_sent &&
+            (!!(hdr & BLE_LL_DATA_HDR_NESN_MASK) != connsm->tx_seqnum)) {
+            ble_ll_conn_tx_ack(connsm);
+        }
+
+        /* Is this a new PDU? */
+        if (!!(hdr & BLE_LL_DATA_HDR_SN_MASK) == connsm->next_exp_seqnum) {
+            connsm->next_exp_seqnum ^= 1;
+            if ((llid == BLE_LL_LLID_RSRVD) ||
+                (len > connsm->max_rx_octets)) {
+                ++g_ble_ll_conn_stats.rx_bad_llid;
+            } else if (len || (llid == BLE_LL_LLID_CTRL)) {
+                pass_up = 1;
+            } else {
+                ++g_ble_ll_conn_stats.rx_empty_pdus;
+            }
+        } else {
+            ++g_ble_ll_conn_stats.rx_dup_pdus;
+        }
+
+        peer_md = hdr & BLE_LL_DATA_HDR_MD_MASK;
+    } else {
+        ++connsm->cons_rxd_bad_crc;
+        ++g_ble_ll_conn_stats.rx_crc_errs;
+    }
+    connsm->pkt_rxd = 1;
+
+    rc = -1;
+    end = ble_ll_conn_event_end_time(connsm);
+    if (connsm->cons_rxd_bad_crc < 2) {
+        if (connsm->conn_role == BLE_LL_CONN_ROLE_MASTER) {
+            if (!crcok || peer_md || connsm->last_txd_md ||
+                !STAILQ_EMPTY(&connsm->conn_txq)) {
+                m = ble_ll_conn_tx_pdu_get(connsm);
+                usecs = BLE_LL_IFS +
+                    ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN + m->om_data[1]) +
+                    BLE_LL_IFS + ble_ll_conn_rx_max_usecs(connsm);
+                next = rx_end + cputime_usecs_to_ticks(usecs);
+                if ((int32_t)(next - end) <= 0) {
+                    rc = ble_ll_conn_tx(connsm, m, BLE_PHY_TRANSITION_RX_TX,
+                                        BLE_PHY_TRANSITION_TX_RX);
+                    if (!rc) {
+                        next += cputime_usecs_to_ticks(
+                                    BLE_LL_CONN_RX_MARGIN_USECS);
+                        ll_sched_wakeup(connsm->conn_sch, next);
+                    }
+                }
+            }
+        } else {
+            m = ble_ll_conn_tx_pdu_get(connsm);
+            usecs = BLE_LL_IFS +
+                ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN + m->om_data[1]);
+            next = rx_end + cputime_usecs_to_ticks(usecs);
+            usecs = BLE_LL_IFS + ble_ll_conn_rx_max_usecs(connsm);
+            if ((!crcok || peer_md || connsm->last_txd_md) &&
+                ((int32_t)(next + cputime_usecs_to_ticks(usecs) - end) <= 0)) {
+                end_trans = BLE_PHY_TRANSITION_TX_RX;
+                next += cputime_usecs_to_ticks(usecs);
+            } else {
+                end_trans = BLE_PHY_TRANSITION_NONE;
+            }
+            rc = ble_ll_conn_tx(connsm, m, BLE_PHY_TRANSITION_RX_TX,
+                                end_trans);
+            if (!rc) {
+                next += cputime_usecs_to_ticks(BLE_LL_CONN_RX_MARGIN_USECS);
+                ll_sched_wakeup(connsm->conn_sch, next);
+            }
+        }
+    }
+
+    /* The event is over if we are not sending anything */
+    if (rc) {
+        ll_sched_wakeup(connsm->conn_sch, cputime_get32());
+    }
+
+    if (pass_up) {
+        rxpdu->om_len = BLE_LL_PDU_HDR_LEN + len;
+        OS_MBUF_PKTHDR(rxpdu)->omp_len = rxpdu->om_len;
+        ble_hdr->conn_handle = connsm->conn_handle;
+        ll_rx_pdu_in(rxpdu);
+    } else {
+        os_mbuf_free(&g_mbuf_pool, rxpdu);
+    }
+
+    return rc;
+}
+
+/**
+ * Process a received LL_LENGTH_REQ or LL_LENGTH_RSP.
+ *
+ * Context: Link Layer task
+ *
+ * @param connsm
+ * @param dptr Pointer to control data
+ */
+static void
+ble_ll_conn_rx_datalen(struct ble_ll_conn_sm *connsm, uint8_t *dptr)
+{
+    connsm->remote_max_rx_octets = max(le16toh(dptr),
+                                       BLE_LL_CONN_SUPP_BYTES_MIN);
+    connsm->remote_max_rx_time = max(le16toh(dptr + 2),
+                                     BLE_LL_CONN_SUPP_TIME_MIN);
+    connsm->remote_max_tx_octets = max(le16toh(dptr + 4),
+                                       BLE_LL_CONN_SUPP_BYTES_MIN);
+    connsm->remote_max_tx_time = max(le16toh(dptr + 6),
+                                     BLE_LL_CONN_SUPP_TIME_MIN);
+
+    if (ble_ll_conn_calc_effective_datalen(connsm)) {
+        ble_ll_conn_datalen_chg_event_send(connsm);
+    }
+}
+
+/**
+ * Process a received control PDU.
+ *
+ * Context: Link Layer task
+ *
+ * @param connsm
+ * @param dptr Pointer to the opcode
+ * @param len Length of the PDU payload
+ */
+static void
+ble_ll_conn_rx_ctrl_pdu(struct ble_ll_conn_sm *connsm, uint8_t *dptr,
+                        uint8_t len)
+{
+    uint8_t opcode;
+    uint8_t ctrdata[BLE_LL_CTRL_FEATURE_LEN];
+
+    if (len == 0) {
+        ++g_ble_ll_conn_stats.rx_malformed_ctrl;
+        return;
+    }
+    opcode = dptr[0];
+    ++dptr;
+    --len;
+
+    switch (opcode) {
+    case BLE_LL_CTRL_LENGTH_REQ:
+        if (len != BLE_LL_CTRL_LENGTH_REQ_LEN) {
+            goto malformed;
+        }
+        /* Our response carries our parameters; the new values apply now */
+        ble_ll_conn_datalen_pdu_send(connsm, BLE_LL_CTRL_LENGTH_RSP);
+        ble_ll_conn_rx_datalen(connsm, dptr);
+        break;
+    case BLE_LL_CTRL_LENGTH_RSP:
+        if (len != BLE_LL_CTRL_LENGTH_REQ_LEN) {
+            goto malformed;
+        }
+        connsm->datalen_req_pending = 0;
+        ble_ll_conn_rx_datalen(connsm, dptr);
+        break;
+    case BLE_LL_CTRL_TERMINATE_IND:
+        if (len != BLE_LL_CTRL_TERMINATE_IND_LEN) {
+            goto malformed;
+        }
+        connsm->rxd_disconnect_reason = dptr[0];
+        connsm->terminate_ind_rxd = 1;
+        break;
+    case BLE_LL_CTRL_FEATURE_REQ:
+    case BLE_LL_CTRL_SLAVE_FEATURE_REQ:
+        memset(ctrdata, 0, sizeof(ctrdata));
+        ctrdata[0] = BLE_LL_CONN_SUPP_FEATURES;
+        ble_ll_conn_ctrl_pdu_send(connsm, BLE_LL_CTRL_FEATURE_RSP, ctrdata,
+                                  BLE_LL_CTRL_FEATURE_LEN);
+        break;
+    case BLE_LL_CTRL_PING_REQ:
+        ble_ll_conn_ctrl_pdu_send(connsm, BLE_LL_CTRL_PING_RSP, NULL, 0);
+        break;
+    case BLE_LL_CTRL_VERSION_IND:
+        if (!connsm->vers_ind_sent) {
+            ctrdata[0] = BLE_LL_CONN_VERS_NR;
+            htole16(ctrdata + 1, BLE_LL_CONN_COMPANY_ID);
+            htole16(ctrdata + 3, BLE_LL_CONN_SUB_VERS_NR);
+            if (!ble_ll_conn_ctrl_pdu_send(connsm, BLE_LL_CTRL_VERSION_IND,
+                                           ctrdata,
+                                           BLE_LL_CTRL_VERSION_IND_LEN)) {
+                connsm->vers_ind_sent = 1;
+            }
+        }
+        break;
+    case BLE_LL_CTRL_UNKNOWN_RSP:
+        /* The peer does not do data length updates */
+        if ((len == BLE_LL_CTRL_UNK_RSP_LEN) &&
+            (dptr[0] == BLE_LL_CTRL_LENGTH_REQ)) {
+            connsm->datalen_req_pending = 0;
+        }
+        break;
+    case BLE_LL_CTRL_FEATURE_RSP:
+    case BLE_LL_CTRL_PING_RSP:
+        break;
+    default:
+        ctrdata[0] = opcode;
+        ble_ll_conn_ctrl_pdu_send(connsm, BLE_LL_CTRL_UNKNOWN_RSP, ctrdata,
+                                  BLE_LL_CTRL_UNK_RSP_LEN);
+        break;
+    }
+    return;
+
+malformed:
+    ++g_ble_ll_conn_stats.rx_malformed_ctrl;
+}
+
+/**
+ * Process a data channel PDU passed up by ble_ll_conn_rx_isr_end(). Control
+ * PDUs are handled here; data is sent to the host as ACL data, in the same
+ * mbuf (the LL header is replaced by the HCI ACL data header).
+ *
+ * Context: Link Layer task
+ *
+ * @param rxpdu
+ * @param crcok
+ */
+void
+ble_ll_conn_rx_data_pdu(struct os_mbuf *rxpdu, uint8_t crcok)
+{
+    uint8_t hdr;
+    uint8_t len;
+    uint8_t llid;
+    uint8_t *rxbuf;
+    uint16_t handle;
+    struct ble_mbuf_hdr *ble_hdr;
+    struct ble_ll_conn_sm *connsm;
+
+    /* The connection may have ended since the PDU was received */
+    ble_hdr = BLE_MBUF_HDR_PTR(rxpdu);
+    connsm = ble_ll_conn_find_active_conn(ble_hdr->conn_handle);
+    if (!crcok || !connsm) {
+        goto free_pdu;
+    }
+
+    rxbuf = rxpdu->om_data;
+    hdr = rxbuf[0];
+    len = rxbuf[1];
+    llid = hdr & BLE_LL_DATA_HDR_LLID_MASK;
+
+    if (llid == BLE_LL_LLID_CTRL) {
+        ++g_ble_ll_conn_stats.rx_ctrl_pdus;
+        ble_ll_conn_rx_ctrl_pdu(connsm, rxbuf + BLE_LL_PDU_HDR_LEN, len);
+        goto free_pdu;
+    }
+
+    if (OS_MBUF_TRAILINGSPACE(&g_mbuf_pool, rxpdu) <
+        (len + BLE_HCI_DATA_HDR_LEN)) {
+        goto free_pdu;
+    }
+    ++g_ble_ll_conn_stats.rx_data_pdus;
+    g_ble_ll_conn_stats.rx_data_bytes += len;
+
+    /* Start of a L2CAP message or a continuation fragment */
+    handle = connsm->conn_handle;
+    if (llid == BLE_LL_LLID_DATA_START) {
+        handle |= (BLE_HCI_PB_FIRST_FLUSH << 12);
+    } else {
+        handle |= (BLE_HCI_PB_MIDDLE << 12);
+    }
+
+    memmove(rxbuf + BLE_HCI_DATA_HDR_LEN, rxbuf + BLE_LL_PDU_HDR_LEN, len);
+    htole16(rxbuf, handle);
+    htole16(rxbuf + 2, len);
+    rxpdu->om_len = BLE_HCI_DATA_HDR_LEN + len;
+    OS_MBUF_PKTHDR(rxpdu)->omp_len = rxpdu->om_len;
+    ble_hci_transport_ctlr_acl_data_send(rxpdu);
+    return;
+
+free_pdu:
+    os_mbuf_free(&g_mbuf_pool, rxpdu);
+}
+
+/**
+ * Queue an ACL data packet from the host. The packet is sent from the same
+ * mbuf: the LL data header overlays the last two bytes of the HCI data
+ * header.
+ *
+ * Context: Link Layer task
+ *
+ * @param om Packet header mbuf holding the ACL data packet
+ * @param handle Handle and flags from the HCI data header
+ * @param len Length of the data
+ *
+ * @return int 0: packet queued; -1 otherwise (the caller frees the packet).
+ */
+int
+ble_ll_conn_tx_pkt_in(struct os_mbuf *om, uint16_t handle, uint16_t len)
+{
+    os_sr_t sr;
+    uint8_t llid;
+    struct ble_ll_conn_sm *connsm;
+
+    connsm = ble_ll_conn_find_active_conn(BLE_HCI_DATA_HANDLE(handle));
+    if (!connsm) {
+        return -1;
+    }
+
+    /* XXX: we only send packets held in one mbuf */
+    if ((len == 0) || (om->om_len != OS_MBUF_PKTHDR(om)->omp_len)) {
+        ++g_ble_ll_conn_stats.tx_acl_errs;
+        return -1;
+    }
+
+    if (BLE_HCI_DATA_PB(handle) == BLE_HCI_PB_MIDDLE) {
+        llid = BLE_LL_LLID_DATA_FRAG;
+    } else {
+        llid = BLE_LL_LLID_DATA_START;
+    }
+
+    om->om_data += BLE_HCI_DATA_HDR_LEN - BLE_LL_PDU_HDR_LEN;
+    om->om_len -= BLE_HCI_DATA_HDR_LEN - BLE_LL_PDU_HDR_LEN;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+    om->om_data[0] = llid;
+
+    OS_ENTER_CRITICAL(sr);
+    STAILQ_INSERT_TAIL(&connsm->conn_txq, OS_MBUF_PKTHDR(om), omp_next);
+    OS_EXIT_CRITICAL(sr);
+
+    return 0;
+}
+
+/**
+ * Place the first connection event of a new connection (master) so that it
+ * does not overlap an event of our other connections. We may send anywhere
+ * in the transmit window, so the anchor point is moved past the events in
+ * its way until it is clear of all of them. Only the event of each
+ * connection nearest to the anchor point is checked: connections with the
+ * same interval keep clear of each other afterwards.
+ *
+ * Context: Interrupt
+ *
+ * @param connsm
+ * @param conn_req_end End of the CONNECT_REQ (cputime)
+ *
+ * @return uint32_t Time from the start of the first transmit window (with
+ * no window offset) to the first anchor point, in usecs. Zero if there is no
+ * room for the connection.
+ */
+static uint32_t
+ble_ll_conn_calc_first_anchor(struct ble_ll_conn_sm *connsm,
+                              uint32_t conn_req_end)
+{
+    int i;
+    int moved;
+    int32_t delta;
+    int32_t itvl;
+    int32_t slot;
+    int32_t tmp_slot;
+    uint32_t start;
+    uint32_t offset;
+    uint32_t max_offset;
+    struct ble_ll_conn_sm *tmp;
+
+    start = conn_req_end + cputime_usecs_to_ticks(BLE_LL_CONN_TX_WIN_USECS);
+    slot = cputime_usecs_to_ticks(ble_ll_conn_slot_usecs(connsm));
+    max_offset = cputime_usecs_to_ticks(connsm->conn_itvl *
+                                        BLE_LL_CONN_ITVL_USECS) - slot;
+    offset = 0;
+    do {
+        moved = 0;
+        for (i = 0; i < BLE_LL_CONN_CFG_MAX_CONNS; ++i) {
+            tmp = &g_ble_ll_conn_sm[i];
+            if ((tmp == connsm) ||
+                (tmp->conn_state < BLE_LL_CONN_STATE_CREATED)) {
+                continue;
+            }
+
+            /* Time since the start of the last event before our anchor */
+            itvl = cputime_usecs_to_ticks(tmp->conn_itvl *
+                                          BLE_LL_CONN_ITVL_USECS);
+            tmp_slot = cputime_usecs_to_ticks(ble_ll_conn_slot_usecs(tmp));
+            delta = (int32_t)(start + offset - tmp->anchor_point) % itvl;
+            if (delta < 0) {
+                delta += itvl;
+            }
+
+            /* Move past the event we overlap */
+            if (delta < tmp_slot) {
+                offset += tmp_slot - delta;
+                moved = 1;
+            } else if ((itvl - delta) < slot) {
+                offset += itvl - delta + tmp_slot;
+                moved = 1;
+            }
+        }
+        if (offset > max_offset) {
+            return 0;
+        }
+    } while (moved);
+
+    return cputime_ticks_to_usecs(offset);
+}
+
+/**
+ * ble ll init rx pdu start
+ *
+ * Called when a PDU reception has started and the Link Layer is in the
+ * initiating state.
+ *
+ * Context: Interrupt
+ *
+ * @param pdu_type
+ *
+ * @return int
+ *  0: we will not attempt to reply to this frame
+ *  1: we may send a response to this frame.
+ */
+int
+ble_ll_init_rx_pdu_start(uint8_t pdu_type)
+{
+    if ((pdu_type == BLE_ADV_PDU_TYPE_ADV_IND) ||
+        (pdu_type == BLE_ADV_PDU_TYPE_ADV_DIRECT_IND)) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * ble ll init rx pdu end
+ *
+ * Called when a PDU has been received (CRC ok) in the initiating state. If
+ * this is a connectable advertisement from the device we want to connect
+ * to, the CONNECT_REQ is sent and the connection is created.
+ *
+ * Context: Interrupt
+ *
+ * @param rxpdu
+ *
+ * @return int
+ *       < 0: Disable the phy after reception.
+ *      == 0: Success. Do not disable the PHY.
+ *       > 0: Do not disable PHY as that has already been done.
+ */
+int
+ble_ll_init_rx_pdu_end(struct os_mbuf *rxpdu)
+{
+    int rc;
+    uint8_t pdu_type;
+    uint8_t addr_type;
+    uint8_t *rxbuf;
+    uint8_t *adv_addr;
+    uint8_t *our_addr;
+    uint8_t *dptr;
+    uint32_t anchor_usecs;
+    uint32_t conn_req_end;
+    struct ble_mbuf_hdr *ble_hdr;
+    struct ble_ll_conn_sm *connsm;
+
+    connsm = g_ble_ll_conn_create_sm;
+    if (!connsm) {
+        return -1;
+    }
+
+    rxbuf = rxpdu->om_data;
+    pdu_type = rxbuf[0] & BLE_ADV_PDU_HDR_TYPE_MASK;
+    if ((pdu_type != BLE_ADV_PDU_TYPE_ADV_IND) &&
+        (pdu_type != BLE_ADV_PDU_TYPE_ADV_DIRECT_IND)) {
+        return -1;
+    }
+
+    /* Is this the device we want? */
+    adv_addr = rxbuf + BLE_LL_PDU_HDR_LEN;
+    addr_type = (rxbuf[0] & BLE_ADV_PDU_HDR_TXADD_MASK) ?
+        BLE_HCI_ADV_PEER_ADDR_RANDOM : BLE_HCI_ADV_PEER_ADDR_PUBLIC;
+    if (connsm->init_filt_policy == BLE_HCI_CONN_FILT_NO_WL) {
+        if ((addr_type != connsm->peer_addr_type) ||
+            memcmp(adv_addr, connsm->peer_addr, BLE_DEV_ADDR_LEN)) {
+            return -1;
+        }
+    } else {
+        if (!ble_ll_is_on_whitelist(adv_addr, addr_type)) {
+            return -1;
+        }
+    }
+
+    /* A directed advertisement must be for us */
+    if (pdu_type == BLE_ADV_PDU_TYPE_ADV_DIRECT_IND) {
+        if (connsm->own_addr_type == BLE_HCI_ADV_OWN_ADDR_PUBLIC) {
+            our_addr = g_dev_addr;
+        } else {
+            our_addr = g_random_addr;
+        }
+        if ((!!(rxbuf[0] & BLE_ADV_PDU_HDR_RXADD_MASK) !=
+             (connsm->own_addr_type != BLE_HCI_ADV_OWN_ADDR_PUBLIC)) ||
+            memcmp(rxbuf + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN, our_addr,
+                   BLE_DEV_ADDR_LEN)) {
+            return -1;
+        }
+    }
+
+    /* Fill in the header and AdvA; the rest was made when creating */
+    dptr = g_ble_ll_conn_req_pdu->om_data;
+    dptr[0] = BLE_ADV_PDU_TYPE_CONNECT_REQ;
+    if (connsm->own_addr_type != BLE_HCI_ADV_OWN_ADDR_PUBLIC) {
+        dptr[0] |= BLE_ADV_PDU_HDR_TXADD_RAND;
+    }
+    if (addr_type) {
+        dptr[0] |= BLE_ADV_PDU_HDR_RXADD_RAND;
+    }
+    if (rxbuf[0] & BLE_ADV_PDU_HDR_CHSEL_MASK) {
+        dptr[0] |= BLE_ADV_PDU_HDR_CHSEL;
+        connsm->chan_sel = BLE_LL_CHAN_SEL_ALG_2;
+    }
+    memcpy(dptr + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN, adv_addr,
+           BLE_DEV_ADDR_LEN);
+
+    /* Place the first connection event clear of our other connections */
+    ble_hdr = BLE_MBUF_HDR_PTR(rxpdu);
+    conn_req_end = ble_hdr->end_cputime +
+        cputime_usecs_to_ticks(BLE_LL_IFS +
+            ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN + BLE_CONNECT_REQ_LEN));
+    anchor_usecs = ble_ll_conn_calc_first_anchor(connsm, conn_req_end);
+    htole16(dptr + BLE_LL_PDU_HDR_LEN + (2 * BLE_DEV_ADDR_LEN) + 8,
+            anchor_usecs / BLE_LL_CONN_TX_WIN_USECS);
+
+    rc = ble_phy_tx(g_ble_ll_conn_req_pdu, BLE_PHY_TRANSITION_RX_TX,
+                    BLE_PHY_TRANSITION_NONE);
+    if (rc) {
+        return rc;
+    }
+
+    /* We are done initiating */
+    g_ble_ll_conn_create_sm = NULL;
+    ble_ll_scan_initiator_isr_stop();
+
+    connsm->peer_addr_type = addr_type;
+    memcpy(connsm->peer_addr, adv_addr, BLE_DEV_ADDR_LEN);
+    ble_ll_conn_created(connsm, conn_req_end,
+                        BLE_LL_CONN_TX_WIN_USECS + anchor_usecs);
+
+    return 0;
+}
+
+/**
+ * Start a connection as a slave. Called by the advertiser when it receives a
+ * CONNECT_REQ addressed to it. The connection parameters are checked; a
+ * CONNECT_REQ with invalid parameters is ignored.
+ *
+ * Context: Interrupt
+ *
+ * @param rxbuf The CONNECT_REQ
+ * @param conn_req_end End of the CONNECT_REQ (cputime)
+ *
+ * @return int 0: connection created; -1 otherwise.
+ */
+int
+ble_ll_conn_slave_start(uint8_t *rxbuf, uint32_t conn_req_end)
+{
+    uint8_t winsize;
+    uint8_t hop_inc;
+    uint16_t winoffset;
+    uint16_t itvl;
+    uint16_t latency;
+    uint16_t tmo;
+    uint8_t *dptr;
+    struct ble_ll_conn_sm *connsm;
+
+    /* Check the LLData */
+    dptr = rxbuf + BLE_LL_PDU_HDR_LEN + (2 * BLE_DEV_ADDR_LEN);
+    winsize = dptr[7];
+    winoffset = le16toh(dptr + 8);
+    itvl = le16toh(dptr + 10);
+    latency = le16toh(dptr + 12);
+    tmo = le16toh(dptr + 14);
+    hop_inc = dptr[21] & BLE_CONN_REQ_HOP_MASK;
+    if ((itvl < BLE_HCI_CONN_ITVL_MIN) || (itvl > BLE_HCI_CONN_ITVL_MAX) ||
+        (tmo < BLE_HCI_CONN_SPVN_TIMEOUT_MIN) ||
+        (tmo > BLE_HCI_CONN_SPVN_TIMEOUT_MAX) ||
+        (latency > BLE_HCI_CONN_LATENCY_MAX) ||
+        ((tmo * 4) <= ((1 + latency) * itvl)) ||
+        (winsize < 1) || (winsize > 8) || (winsize >= itvl) ||
+        (winoffset > itvl) || (hop_inc < 5) || (hop_inc > 16) ||
+        (ble_ll_chan_num_used(dptr + 16) < 2)) {
+        return -1;
+    }
+
+    connsm = ble_ll_conn_sm_get();
+    if (!connsm) {
+        return -1;
+    }
+    ble_ll_conn_sm_init(connsm, BLE_LL_CONN_ROLE_SLAVE);
+
+    connsm->access_addr = le32toh(dptr);
+    connsm->crcinit = dptr[4] | (dptr[5] << 8) | (dptr[6] << 16);
+    connsm->conn_itvl = itvl;
+    connsm->slave_latency = latency;
+    connsm->supervision_tmo = tmo;
+    ble_ll_chan_map_set(&connsm->chan_map, dptr + 16);
+    connsm->hop_inc = hop_inc;
+    connsm->chan_id = ble_ll_chan_sel2_id(connsm->access_addr);
+    if (rxbuf[0] & BLE_ADV_PDU_HDR_CHSEL_MASK) {
+        connsm->chan_sel = BLE_LL_CHAN_SEL_ALG_2;
+    }
+    connsm->master_sca = dptr[21] >> 5;
+    connsm->slave_tx_win_usecs = winsize * BLE_LL_CONN_TX_WIN_USECS;
+
+    connsm->peer_addr_type = (rxbuf[0] & BLE_ADV_PDU_HDR_TXADD_MASK) ?
+        BLE_HCI_ADV_PEER_ADDR_RANDOM : BLE_HCI_ADV_PEER_ADDR_PUBLIC;
+    memcpy(connsm->peer_addr, rxbuf + BLE_LL_PDU_HDR_LEN, BLE_DEV_ADDR_LEN);
+
+    /* The transmit window starts 1.25 msecs after the CONNECT_REQ */
+    ble_ll_conn_created(connsm, conn_req_end,
+                        BLE_LL_CONN_TX_WIN_USECS +
+                        (winoffset * BLE_LL_CONN_TX_WIN_USECS));
+
+    return 0;
+}
+
+/**
+ * Make the CONNECT_REQ we will send when initiating: InitA and LLData. The
+ * header and AdvA are filled in when the advertisement is received.
+ *
+ * @param connsm
+ */
+static void
+ble_ll_conn_req_pdu_make(struct ble_ll_conn_sm *connsm)
+{
+    uint8_t *dptr;
+    uint8_t *addr;
+    struct os_mbuf *m;
+
+    m = g_ble_ll_conn_req_pdu;
+    m->om_len = BLE_LL_PDU_HDR_LEN + BLE_CONNECT_REQ_LEN;
+    OS_MBUF_PKTHDR(m)->omp_len = m->om_len;
+
+    if (connsm->own_addr_type == BLE_HCI_ADV_OWN_ADDR_PUBLIC) {
+        addr = g_dev_addr;
+    } else {
+        addr = g_random_addr;
+    }
+
+    dptr = m->om_data;
+    dptr[1] = BLE_CONNECT_REQ_LEN;
+    memcpy(dptr + BLE_LL_PDU_HDR_LEN, addr, BLE_DEV_ADDR_LEN);
+
+    /* LLData; transmit window of 1.25 msecs right after the CONNECT_REQ */
+    dptr += BLE_LL_PDU_HDR_LEN + (2 * BLE_DEV_ADDR_LEN);
+    htole32(dptr, connsm->access_addr);
+    dptr[4] = (uint8_t)connsm->crcinit;
+    dptr[5] = (uint8_t)(connsm->crcinit >> 8);
+    dptr[6] = (uint8_t)(connsm->crcinit >> 16);
+    dptr[7] = 1;
+    htole16(dptr + 8, 0);
+    htole16(dptr + 10, connsm->conn_itvl);
+    htole16(dptr + 12, connsm->slave_latency);
+    htole16(dptr + 14, connsm->supervision_tmo);
+    memcpy(dptr + 16, connsm->chan_map.map, BLE_LL_CHAN_MAP_LEN);
+    dptr[21] = connsm->hop_inc | (connsm->master_sca << 5);
+}
+
+/**
+ * Process the LE create connection command. Checks the parameters and
+ * starts initiating. The command status is sent to the host; the connection
+ * complete event follows when the connection is created (or cancelled).
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ *
+ * @return int BLE error code
+ */
+int
+ble_ll_conn_create(uint8_t *cmdbuf)
+{
+    int rc;
+    uint8_t chanmap[BLE_LL_CHAN_MAP_LEN];
+    struct hci_create_conn ccdata;
+    struct hci_create_conn *hcc;
+    struct ble_ll_conn_sm *connsm;
+
+    /* If we are already creating a connection, this is not allowed */
+    if (g_ble_ll_conn_create_sm) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    hcc = &ccdata;
+    hcc->scan_itvl = le16toh(cmdbuf);
+    hcc->scan_window = le16toh(cmdbuf + 2);
+    hcc->filter_policy = cmdbuf[4];
+    hcc->peer_addr_type = cmdbuf[5];
+    memcpy(hcc->peer_addr, cmdbuf + 6, BLE_DEV_ADDR_LEN);
+    hcc->own_addr_type = cmdbuf[12];
+    hcc->conn_itvl_min = le16toh(cmdbuf + 13);
+    hcc->conn_itvl_max = le16toh(cmdbuf + 15);
+    hcc->conn_latency = le16toh(cmdbuf + 17);
+    hcc->supervision_timeout = le16toh(cmdbuf + 19);
+    hcc->min_ce_len = le16toh(cmdbuf + 21);
+    hcc->max_ce_len = le16toh(cmdbuf + 23);
+
+    /* Check the scan parameters */
+    if ((hcc->scan_itvl < BLE_HCI_SCAN_ITVL_MIN) ||
+        (hcc->scan_itvl > BLE_HCI_SCAN_ITVL_MAX) ||
+        (hcc->scan_window < BLE_HCI_SCAN_WINDOW_MIN) ||
+        (hcc->scan_window > BLE_HCI_SCAN_WINDOW_MAX) ||
+        (hcc->scan_window > hcc->scan_itvl)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    /* Check the addresses. XXX: no privacy yet */
+    if ((hcc->filter_policy > BLE_HCI_CONN_FILT_MAX) ||
+        (hcc->peer_addr_type > BLE_HCI_ADV_PEER_ADDR_MAX) ||
+        (hcc->own_addr_type > BLE_HCI_ADV_OWN_ADDR_RANDOM)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+    if ((hcc->own_addr_type == BLE_HCI_ADV_OWN_ADDR_RANDOM) &&
+        !ll_is_valid_rand_addr(g_random_addr)) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    /* Check the connection parameters */
+    if ((hcc->conn_itvl_min < BLE_HCI_CONN_ITVL_MIN) ||
+        (hcc->conn_itvl_max > BLE_HCI_CONN_ITVL_MAX) ||
+        (hcc->conn_itvl_min > hcc->conn_itvl_max) ||
+        (hcc->conn_latency > BLE_HCI_CONN_LATENCY_MAX) ||
+        (hcc->supervision_timeout < BLE_HCI_CONN_SPVN_TIMEOUT_MIN) ||
+        (hcc->supervision_timeout > BLE_HCI_CONN_SPVN_TIMEOUT_MAX) ||
+        ((hcc->supervision_timeout * 4) <=
+         ((1 + hcc->conn_latency) * hcc->conn_itvl_max)) ||
+        (hcc->min_ce_len > hcc->max_ce_len)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    connsm = ble_ll_conn_sm_get();
+    if (!connsm) {
+        return BLE_ERR_CONN_LIMIT;
+    }
+    ble_ll_conn_sm_init(connsm, BLE_LL_CONN_ROLE_MASTER);
+
+    connsm->own_addr_type = hcc->own_addr_type;
+    connsm->init_filt_policy = hcc->filter_policy;
+    connsm->peer_addr_type = hcc->peer_addr_type;
+    memcpy(connsm->peer_addr, hcc->peer_addr, BLE_DEV_ADDR_LEN);
+
+    /* XXX: the interval should be picked using the CE lengths */
+    connsm->conn_itvl = hcc->conn_itvl_max;
+    connsm->slave_latency = hcc->conn_latency;
+    connsm->supervision_tmo = hcc->supervision_timeout;
+
+    /* Pick the access address, CRC init and hop; use all channels */
+    connsm->access_addr = ble_ll_conn_calc_access_addr();
+    connsm->crcinit = rand() & 0xffffff;
+    connsm->hop_inc = 5 + (rand() % 12);
+    connsm->chan_id = ble_ll_chan_sel2_id(connsm->access_addr);
+    memset(chanmap, 0xff, BLE_LL_CHAN_MAP_LEN - 1);
+    chanmap[BLE_LL_CHAN_MAP_LEN - 1] = 0x1f;
+    ble_ll_chan_map_set(&connsm->chan_map, chanmap);
+    connsm->master_sca = BLE_LL_CONN_CFG_OUR_SCA;
+    ble_ll_conn_req_pdu_make(connsm);
+
+    connsm->conn_state = BLE_LL_CONN_STATE_INITIATING;
+    g_ble_ll_conn_create_sm = connsm;
+    rc = ble_ll_scan_initiator_start(hcc);
+    if (rc) {
+        g_ble_ll_conn_create_sm = NULL;
+        ble_ll_conn_sm_free(connsm);
+    }
+
+    return rc;
+}
+
+/**
+ * Process the LE create connection cancel command.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @return int BLE error code
+ */
+int
+ble_ll_conn_create_cancel(void)
+{
+    os_sr_t sr;
+    struct ble_ll_conn_sm *connsm;
+
+    /* The CONNECT_REQ may be sent (from interrupt) at any time */
+    OS_ENTER_CRITICAL(sr);
+    connsm = g_ble_ll_conn_create_sm;
+    if (connsm) {
+        g_ble_ll_conn_create_sm = NULL;
+        connsm->conn_state = BLE_LL_CONN_STATE_IDLE;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if (!connsm) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    ble_ll_scan_initiator_stop();
+
+    /* The connection complete event must follow the command complete */
+    ble_ll_event_send(&connsm->conn_spawn_ev);
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Process the disconnect command. The connection ends once the peer has
+ * acknowledged our LL_TERMINATE_IND (or the supervision timer expires).
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ *
+ * @return int BLE error code
+ */
+int
+ble_ll_conn_hci_disconnect_cmd(uint8_t *cmdbuf)
+{
+    uint8_t reason;
+    uint16_t handle;
+    struct ble_ll_conn_sm *connsm;
+
+    handle = le16toh(cmdbuf);
+    reason = cmdbuf[2];
+    switch (reason) {
+    case BLE_ERR_AUTH_FAIL:
+    case BLE_ERR_REM_USER_CONN_TERM:
+    case BLE_ERR_RD_CONN_TERM_RESRCS:
+    case BLE_ERR_RD_CONN_TERM_PWROFF:
+    case BLE_ERR_UNSUPP_FEATURE:
+    case BLE_ERR_UNIT_KEY_PAIRING:
+    case BLE_ERR_CONN_PARMS:
+        break;
+    default:
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    connsm = ble_ll_conn_find_active_conn(handle);
+    if (!connsm) {
+        return BLE_ERR_UNK_CONN_ID;
+    }
+    if (connsm->terminate_started) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    if (ble_ll_conn_ctrl_pdu_send(connsm, BLE_LL_CTRL_TERMINATE_IND, &reason,
+                                  BLE_LL_CTRL_TERMINATE_IND_LEN)) {
+        return BLE_ERR_MEM_CAPACITY;
+    }
+    connsm->terminate_started = 1;
+
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Process the LE set data length command. Starts the data length update
+ * procedure with the new transmit parameters.
+ *
+ * Context: Link Layer task (HCI command parser)
+ *
+ * @param cmdbuf
+ * @param rspbuf Response: the connection handle
+ *
+ * @return int BLE error code
+ */
+int
+ble_ll_conn_hci_set_data_len(uint8_t *cmdbuf, uint8_t *rspbuf)
+{
+    uint16_t handle;
+    uint16_t tx_octets;
+    uint16_t tx_time;
+    struct ble_ll_conn_sm *connsm;
+
+    handle = le16toh(cmdbuf);
+    tx_octets = le16toh(cmdbuf + 2);
+    tx_time = le16toh(cmdbuf + 4);
+    htole16(rspbuf, handle);
+
+    connsm = ble_ll_conn_find_active_conn(handle);
+    if (!connsm) {
+        return BLE_ERR_UNK_CONN_ID;
+    }
+
+    if ((tx_octets < BLE_HCI_SET_DATALEN_TX_OCTETS_MIN) ||
+        (tx_octets > BLE_HCI_SET_DATALEN_TX_OCTETS_MAX) ||
+        (tx_time < BLE_HCI_SET_DATALEN_TX_TIME_MIN) ||
+        (tx_time > BLE_HCI_SET_DATALEN_TX_TIME_MAX)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    connsm->max_tx_octets = min(tx_octets,
+                                g_ll_data.ll_params.supp_max_tx_octets);
+    connsm->max_tx_time = min(tx_time, g_ll_data.ll_params.supp_max_tx_time);
+    ble_ll_conn_datalen_req_send(connsm);
+
+    return BLE_ERR_SUCCESS;
+}
+
+/* Clear all the connection state machines and put them on the free list */
+static void
+ble_ll_conn_sm_init_all(void)
+{
+    int i;
+    struct ble_ll_conn_sm *connsm;
+
+    STAILQ_INIT(&g_ble_ll_conn_free_list);
+    for (i = 0; i < BLE_LL_CONN_CFG_MAX_CONNS; ++i) {
+        connsm = &g_ble_ll_conn_sm[i];
+        memset(connsm, 0, sizeof(struct ble_ll_conn_sm));
+        STAILQ_INSERT_TAIL(&g_ble_ll_conn_free_list, connsm, free_stqe);
+        STAILQ_INIT(&connsm->conn_txq);
+        connsm->conn_spawn_ev.ev_type = BLE_LL_EVENT_CONN_SPAWN;
+        connsm->conn_spawn_ev.ev_arg = connsm;
+        connsm->conn_ev_end.ev_type = BLE_LL_EVENT_CONN_EV_END;
+        connsm->conn_ev_end.ev_arg = connsm;
+    }
+}
+
+/**
+ * Drop all connections, and any being created, without telling the host
+ * (HCI reset). Packets not sent are freed.
+ *
+ * Context: Link Layer task
+ */
+void
+ble_ll_conn_reset(void)
+{
+    int i;
+    os_sr_t sr;
+    struct ble_ll_conn_sm *connsm;
+
+    OS_ENTER_CRITICAL(sr);
+    g_ble_ll_conn_create_sm = NULL;
+    if (g_ble_ll_conn_cur_sm) {
+        ble_phy_disable();
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+        g_ble_ll_conn_cur_sm = NULL;
+    }
+    for (i = 0; i < BLE_LL_CONN_CFG_MAX_CONNS; ++i) {
+        connsm = &g_ble_ll_conn_sm[i];
+        if (connsm->conn_sch) {
+            ll_sched_rmv_item(connsm->conn_sch);
+            connsm->conn_sch = NULL;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    for (i = 0; i < BLE_LL_CONN_CFG_MAX_CONNS; ++i) {
+        connsm = &g_ble_ll_conn_sm[i];
+        ble_ll_conn_tx_free(connsm);
+        os_eventq_remove(&g_ll_data.ll_evq, &connsm->conn_spawn_ev);
+        os_eventq_remove(&g_ll_data.ll_evq, &connsm->conn_ev_end);
+    }
+
+    ble_ll_conn_sm_init_all();
+}
+
+/**
+ * Initialize the connection module. Should be called only once.
+ */
+void
+ble_ll_conn_init(void)
+{
+    ble_ll_conn_sm_init_all();
+
+    /* The empty PDU. Only the LLID survives from one use to the next */
+    g_ble_ll_conn_empty_pdu = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    assert(g_ble_ll_conn_empty_pdu != NULL);
+    g_ble_ll_conn_empty_pdu->om_data[0] = BLE_LL_LLID_DATA_FRAG;
+    g_ble_ll_conn_empty_pdu->om_len = BLE_LL_PDU_HDR_LEN;
+    OS_MBUF_PKTHDR(g_ble_ll_conn_empty_pdu)->omp_len = BLE_LL_PDU_HDR_LEN;
+
+    /* Get a CONNECT_REQ mbuf (packet header) */
+    g_ble_ll_conn_req_pdu = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    assert(g_ble_ll_conn_req_pdu != NULL);
+}
@@ -29,10 +29,13 @@
 #include "hal/hal_cputime.h"
 #include "hal/hal_gpio.h"
 
+#if BLE_LL_SCAN_CFG_ADV_RPT_MAX > BLE_HCI_LE_ADV_RPT_NUM_RPTS_MAX
+    #error "Too many reports per advertising report event!"
+#endif
+
  /* 
  * XXX:
  * 1) Implement white list.
- * 2) I need to add addresses to dup filter array.
  * 4) Need to look at packets for us and those not for us. Probably some of
  * this code needs to go into the link layer (in ll.c).
  * 5) Interleave sending scan requests to different advertisers? I guess I need 
@@ -53,6 +56,18 @@
  * code might be made simpler.
  */
 
+/* 
+ * Structure used to store advertisers. This is used to limit sending scan
+ * requests to the same advertiser and also to filter duplicate events sent
+ * to the host. An entry with no flags set is free.
+ */
+struct ble_ll_scan_advertisers
+{
+    uint8_t             sc_adv_flags;
+    uint8_t             adv_addr[BLE_DEV_ADDR_LEN];
+    uint32_t            sc_last_used;
+};
+
 /* 
  * Scanning state machine 
  */
@@ -72,8 +87,26 @@ struct ble_ll_scan_sm
     uint16_t scan_itvl;
     uint16_t scan_window;
     uint32_t scan_win_start_time;
+    uint32_t scan_win_end_time;
+
+    /* Initiating (creating a connection) uses the scanner's windows */
+    uint8_t init_active;
+    uint16_t init_itvl;
+    uint16_t init_window;
+
     struct os_mbuf *scan_req_pdu;
     struct os_event scan_win_end_ev;
+
+    /* 
+     * Advertising report event being built. For each report, the advertiser
+     * entry and flag set for duplicate filtering (undone if the event cannot
+     * be sent).
+     */
+    struct os_mbuf *adv_rpt_om;
+    uint8_t adv_rpt_num;
+    uint8_t adv_rpt_flags[BLE_LL_SCAN_CFG_ADV_RPT_MAX];
+    struct ble_ll_scan_advertisers *adv_rpt_advs[BLE_LL_SCAN_CFG_ADV_RPT_MAX];
+    struct os_callout_func adv_rpt_timer;
 };
 
 /* The scanning state machine global object */
@@ -85,36 +118,35 @@ struct ble_ll_scan_stats
     uint32_t scan_starts;
     uint32_t scan_stops;
     uint32_t scan_win_late;
+    uint32_t scan_win_resumed;
     uint32_t cant_set_sched;
     uint32_t scan_req_txf;
     uint32_t scan_req_txg;
+    uint32_t adv_replaced;
+    uint32_t adv_rpts;
+    uint32_t adv_rpt_events;
+    uint32_t adv_rpt_event_fails;
 };
 
 struct ble_ll_scan_stats g_ble_ll_scan_stats;
 
-/* 
- * Structure used to store advertisers. This is used to limit sending scan
- * requests to the same advertiser and also to filter duplicate events sent
- * to the host.
- */
-struct ble_ll_scan_advertisers
-{
-    uint16_t            sc_adv_flags;
-    struct ble_dev_addr adv_addr;
-};
-
 #define BLE_LL_SC_ADV_F_RANDOM_ADDR     (0x01)
 #define BLE_LL_SC_ADV_F_SCAN_RSP_RXD    (0x02)
 #define BLE_LL_SC_ADV_F_DIRECT_RPT_SENT (0x04)
 #define BLE_LL_SC_ADV_F_ADV_RPT_SENT    (0x08)
+#define BLE_LL_SC_ADV_F_SCAN_RSP_SENT   (0x10)
 
-/* Contains list of advertisers that we have heard scan responses from */
-uint8_t g_ble_ll_scan_num_rsp_advs;
-struct ble_ll_scan_advertisers g_ble_ll_scan_rsp_advs[BLE_LL_SCAN_CFG_NUM_SCAN_RSP_ADVS];
+/* 
+ * Advertisers we have heard scan responses from or sent advertising reports
+ * for. Hashed on the address (and type) into sets of entries.
+ */
+#define BLE_LL_SCAN_ADV_SETS    \
+    (BLE_LL_SCAN_CFG_NUM_ADVS / BLE_LL_SCAN_CFG_ADV_WAYS)
+
+struct ble_ll_scan_advertisers g_ble_ll_scan_advs[BLE_LL_SCAN_CFG_NUM_ADVS];
 
-/* Used to filter duplicate advertising events to host */
-uint8_t g_ble_ll_scan_num_dup_advs;
-struct ble_ll_scan_advertisers g_ble_ll_scan_dup_advs[BLE_LL_SCAN_CFG_NUM_DUP_ADVS];
+/* Incremented on every use of an advertiser entry; used for LRU replacement */
+uint32_t g_ble_ll_scan_adv_uses;
 
 /* See Vol 6 Part B Section 4.4.3.2. Active scanning backoff */
 static void
@@ -200,89 +232,161 @@ ble_ll_scan_req_pdu_make(struct ble_ll_scan_sm *scansm, uint8_t *adv_addr,
 }
 
 /**
- * Check if a packet is a duplicate advertising packet.
+ * Returns the set of the advertiser table that an address hashes to.
  * 
- * @param pdu_type 
- * @param rxbuf 
+ * @param addr Pointer to address
+ * @param addr_type Type of address (0: public; random otherwise)
  * 
- * @return int 0: not a duplicate. 1:duplicate
+ * @return int The set, from 0 to BLE_LL_SCAN_ADV_SETS - 1.
  */
 int
-ble_ll_scan_is_dup_adv(uint8_t pdu_type, uint8_t addr_type, uint8_t *addr)
+ble_ll_scan_adv_set_get(uint8_t *addr, uint8_t addr_type)
 {
-    uint8_t num_advs;
-    struct ble_ll_scan_advertisers *adv;
+    int i;
+    uint32_t hash;
 
-    /* Do we have an address match? Must match address type */
-    adv = &g_ble_ll_scan_dup_advs[0];
-    num_advs = g_ble_ll_scan_num_dup_advs;
-    while (num_advs) {
-        if (!memcmp(&adv->adv_addr, addr, BLE_DEV_ADDR_LEN)) {
-            /* Address type must match */
-            if (addr_type) {
-                if ((adv->sc_adv_flags & BLE_LL_SC_ADV_F_RANDOM_ADDR) == 0) {
-                    continue;
-                }
-            } else {
-                if (adv->sc_adv_flags & BLE_LL_SC_ADV_F_RANDOM_ADDR) {
-                    continue;
-                }
-            }
+    hash = (addr_type != 0);
+    for (i = 0; i < BLE_DEV_ADDR_LEN; ++i) {
+        hash = (hash * 31) + addr[i];
+    }
+    hash ^= hash >> 16;
 
-            /* Check appropriate flag (based on type of PDU) */
-            if (pdu_type == BLE_ADV_PDU_TYPE_ADV_DIRECT_IND) {
-                if (adv->sc_adv_flags & BLE_LL_SC_ADV_F_DIRECT_RPT_SENT) {
-                    return 1;
-                }
-            } else {
-                if (adv->sc_adv_flags & BLE_LL_SC_ADV_F_ADV_RPT_SENT) {
-                    return 1;
-                }
-            }
+    return hash & (BLE_LL_SCAN_ADV_SETS - 1);
+}
+
+/**
+ * Returns the first entry of the set in the advertiser table that an address
+ * hashes to.
+ * 
+ * @param addr Pointer to address
+ * @param addr_type Type of address (0: public; random otherwise)
+ */
+static struct ble_ll_scan_advertisers *
+ble_ll_scan_adv_set(uint8_t *addr, uint8_t addr_type)
+{
+    int set;
+
+    set = ble_ll_scan_adv_set_get(addr, addr_type);
+    return &g_ble_ll_scan_advs[set * BLE_LL_SCAN_CFG_ADV_WAYS];
+}
+
+/**
+ * Look up an advertiser.
+ * 
+ * @param addr Pointer to address
+ * @param addr_type Type of address (0: public; random otherwise)
+ * 
+ * @return struct ble_ll_scan_advertisers* The advertiser entry; NULL if the
+ * advertiser is not in the table.
+ */
+static struct ble_ll_scan_advertisers *
+ble_ll_scan_adv_find(uint8_t *addr, uint8_t addr_type)
+{
+    int i;
+    uint8_t rand_flag;
+    struct ble_ll_scan_advertisers *adv;
+
+    rand_flag = addr_type ? BLE_LL_SC_ADV_F_RANDOM_ADDR : 0;
+    adv = ble_ll_scan_adv_set(addr, addr_type);
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_WAYS; ++i, ++adv) {
+        /* Address and address type must match */
+        if ((adv->sc_adv_flags != 0) &&
+            ((adv->sc_adv_flags & BLE_LL_SC_ADV_F_RANDOM_ADDR) == rand_flag) &&
+            !memcmp(adv->adv_addr, addr, BLE_DEV_ADDR_LEN)) {
+            adv->sc_last_used = ++g_ble_ll_scan_adv_uses;
+            return adv;
         }
-        ++adv;
-        --num_advs;
     }
 
-    /* XXX: This function really should check both the scan response and
-     * dup advs. I dont see any reason why we cant use the scan response
-       array for host advertisement report duplicate checking */
-    return 0;
+    return NULL;
 }
 
 /**
- * Add an advertiser the list of duplicate advertisers. An address gets added to
- * the list of duplicate addresses when the controller sends an advertising 
- * report to the host. 
+ * Add an advertiser to the table, if it is not there already. If the set the
+ * advertiser hashes to is full, the least recently used entry is replaced.
  * 
- * @param addr 
- * @param addr_type 
+ * @param addr Pointer to address
+ * @param addr_type Type of address (0: public; random otherwise)
+ * 
+ * @return struct ble_ll_scan_advertisers* The advertiser entry.
  */
-void
-ble_ll_scan_add_dup_adv(uint8_t *addr, uint8_t addr_type)
+static struct ble_ll_scan_advertisers *
+ble_ll_scan_adv_add(uint8_t *addr, uint8_t addr_type)
 {
-    uint8_t num_advs;
+    int i;
     struct ble_ll_scan_advertisers *adv;
+    struct ble_ll_scan_advertisers *victim;
 
-    /* XXX: for now, if we dont have room, just leave */
-    num_advs = g_ble_ll_scan_num_dup_advs;
-    if (num_advs == BLE_LL_SCAN_CFG_NUM_DUP_ADVS) {
-        return;
+    adv = ble_ll_scan_adv_find(addr, addr_type);
+    if (adv) {
+        return adv;
     }
 
-    /* Add the advertiser to the array */
-    adv = &g_ble_ll_scan_dup_advs[num_advs];
-    memcpy(&adv->adv_addr, addr, BLE_DEV_ADDR_LEN);
+    /* Use a free entry, else the one unused for the longest time */
+    adv = ble_ll_scan_adv_set(addr, addr_type);
+    victim = adv;
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_WAYS; ++i, ++adv) {
+        if (adv->sc_adv_flags == 0) {
+            victim = adv;
+            break;
+        }
+        if ((int32_t)(adv->sc_last_used - victim->sc_last_used) < 0) {
+            victim = adv;
+        }
+    }
+    if (victim->sc_adv_flags != 0) {
+        ++g_ble_ll_scan_stats.adv_replaced;
+    }
 
-    /* 
-     * XXX: need to set correct flag based on type of report being sent
-     * for now, we dont send direct advertising reports
-     */
-    adv->sc_adv_flags = BLE_LL_SC_ADV_F_ADV_RPT_SENT;
-    if (addr_type) {
-        adv->sc_adv_flags |= BLE_LL_SC_ADV_F_RANDOM_ADDR;
+    memcpy(victim->adv_addr, addr, BLE_DEV_ADDR_LEN);
+    victim->sc_adv_flags = addr_type ? BLE_LL_SC_ADV_F_RANDOM_ADDR : 0;
+    victim->sc_last_used = ++g_ble_ll_scan_adv_uses;
+
+    return victim;
+}
+
+/**
+ * Returns the flag recording that an advertising report has been sent for
+ * a PDU of the given type.
+ * 
+ * @param pdu_type 
+ */
+static uint8_t
+ble_ll_scan_adv_rpt_flag(uint8_t pdu_type)
+{
+    uint8_t flag;
+
+    if (pdu_type == BLE_ADV_PDU_TYPE_ADV_DIRECT_IND) {
+        flag = BLE_LL_SC_ADV_F_DIRECT_RPT_SENT;
+    } else if (pdu_type == BLE_ADV_PDU_TYPE_SCAN_RSP) {
+        flag = BLE_LL_SC_ADV_F_SCAN_RSP_SENT;
+    } else {
+        flag = BLE_LL_SC_ADV_F_ADV_RPT_SENT;
     }
-    ++g_ble_ll_scan_num_dup_advs;
+
+    return flag;
+}
+
+/**
+ * Check if a packet is a duplicate advertising packet.
+ * 
+ * @param pdu_type 
+ * @param addr_type Type of address (0: public; random otherwise)
+ * @param addr Pointer to advertisers address
+ * 
+ * @return int 0: not a duplicate. 1:duplicate
+ */
+int
+ble_ll_scan_is_dup_adv(uint8_t pdu_type, uint8_t addr_type, uint8_t *addr)
+{
+    struct ble_ll_scan_advertisers *adv;
+
+    adv = ble_ll_scan_adv_find(addr, addr_type);
+    if (adv && (adv->sc_adv_flags & ble_ll_scan_adv_rpt_flag(pdu_type))) {
+        return 1;
+    }
+
+    return 0;
 }
 
 /**
@@ -296,27 +400,11 @@ ble_ll_scan_add_dup_adv(uint8_t *addr, uint8_t addr_type)
 static int
 ble_ll_scan_have_rxd_scan_rsp(uint8_t *addr, uint8_t addr_type)
 {
-    uint8_t num_advs;
     struct ble_ll_scan_advertisers *adv;
 
-    /* Do we have an address match? Must match address type */
-    adv = &g_ble_ll_scan_rsp_advs[0];
-    num_advs = g_ble_ll_scan_num_rsp_advs;
-    while (num_advs) {
-        if (!memcmp(&adv->adv_addr, addr, BLE_DEV_ADDR_LEN)) {
-            /* Address type must match */
-            if (addr_type) {
-                if (adv->sc_adv_flags & BLE_LL_SC_ADV_F_RANDOM_ADDR) {
-                    return 1;
-                }
-            } else {
-                if ((adv->sc_adv_flags & BLE_LL_SC_ADV_F_RANDOM_ADDR) == 0) {
-                    return 1;
-                }
-            }
-        }
-        ++adv;
-        --num_advs;
+    adv = ble_ll_scan_adv_find(addr, addr_type);
+    if (adv && (adv->sc_adv_flags & BLE_LL_SC_ADV_F_SCAN_RSP_RXD)) {
+        return 1;
     }
 
     return 0;
@@ -325,37 +413,66 @@ ble_ll_scan_have_rxd_scan_rsp(uint8_t *addr, uint8_t addr_type)
 static void
 ble_ll_scan_add_scan_rsp_adv(uint8_t *addr, uint8_t addr_type)
 {
-    uint8_t num_advs;
     struct ble_ll_scan_advertisers *adv;
 
-    /* XXX: for now, if we dont have room, just leave */
-    num_advs = g_ble_ll_scan_num_rsp_advs;
-    if (num_advs == BLE_LL_SCAN_CFG_NUM_SCAN_RSP_ADVS) {
-        return;
-    }
+    adv = ble_ll_scan_adv_add(addr, addr_type);
+    adv->sc_adv_flags |= BLE_LL_SC_ADV_F_SCAN_RSP_RXD;
+}
+
+/**
+ * Send the advertising report event being built (if any) to the host.
+ * 
+ * @param scansm Pointer to scanning state machine
+ */
+static void
+ble_ll_scan_adv_rpt_flush(struct ble_ll_scan_sm *scansm)
+{
+    int i;
+    int rc;
+    struct os_mbuf *om;
 
-    /* Check if address is already on the list */
-    if (ble_ll_scan_have_rxd_scan_rsp(addr, addr_type)) {
+    os_callout_stop(&scansm->adv_rpt_timer.cf_c);
+
+    om = scansm->adv_rpt_om;
+    if (!om) {
         return;
     }
+    scansm->adv_rpt_om = NULL;
 
-    /* Add the advertiser to the array */
-    adv = &g_ble_ll_scan_rsp_advs[num_advs];
-    memcpy(&adv->adv_addr, addr, BLE_DEV_ADDR_LEN);
-    adv->sc_adv_flags = BLE_LL_SC_ADV_F_SCAN_RSP_RXD;
-    if (addr_type) {
-        adv->sc_adv_flags |= BLE_LL_SC_ADV_F_RANDOM_ADDR;
+    ++g_ble_ll_scan_stats.adv_rpt_events;
+    rc = ble_ll_hci_event_send(om);
+    if (rc) {
+        /* The reports were lost. Do not filter out the next ones. */
+        ++g_ble_ll_scan_stats.adv_rpt_event_fails;
+        for (i = 0; i < scansm->adv_rpt_num; ++i) {
+            if (scansm->adv_rpt_advs[i]) {
+                scansm->adv_rpt_advs[i]->sc_adv_flags &=
+                    ~scansm->adv_rpt_flags[i];
+            }
+        }
     }
-    ++g_ble_ll_scan_num_rsp_advs;
+    scansm->adv_rpt_num = 0;
+}
 
-    return;
+/**
+ * Advertising report timer callback; sends reports that have waited too long.
+ * 
+ * Context: Link Layer task.
+ * 
+ * @param arg Pointer to scanning state machine
+ */
+static void
+ble_ll_scan_adv_rpt_timer_cb(void *arg)
+{
+    ble_ll_scan_adv_rpt_flush((struct ble_ll_scan_sm *)arg);
 }
 
 /**
  * Send an advertising report to the host.
  * 
- * NOTE: while we are allowed to send multiple devices in one report, we 
- * will just send for one for now. 
+ * The report is added to an advertising report event, which is sent when it
+ * is full, at the end of the scan window, or after at most
+ * BLE_LL_SCAN_CFG_ADV_RPT_TMO os ticks.
  * 
  * @param pdu_type 
  * @param rxadv 
@@ -366,11 +483,16 @@ static int
 ble_ll_hci_send_adv_report(uint8_t pdu_type, uint8_t addr_type, uint8_t *rxbuf,
                            int8_t rssi)
 {
-    int rc;
     uint8_t evtype;
     uint8_t subev;
+    uint8_t flag;
     uint8_t *evbuf;
+    uint8_t *dptr;
     uint8_t adv_data_len;
+    uint8_t rpt_len;
+    struct os_mbuf *om;
+    struct ble_ll_scan_sm *scansm;
+    struct ble_ll_scan_advertisers *adv;
 
     subev = BLE_HCI_LE_SUBEV_ADV_RPT;
     if (pdu_type == BLE_ADV_PDU_TYPE_ADV_DIRECT_IND) {
@@ -395,39 +517,75 @@ ble_ll_hci_send_adv_report(uint8_t pdu_type, uint8_t addr_type, uint8_t *rxbuf,
         adv_data_len -= (BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN);
     }
 
-    rc = BLE_ERR_MEM_CAPACITY;
-    if (ble_ll_hci_is_le_event_enabled(subev - 1)) {
-        evbuf = os_memblock_get(&g_hci_cmd_pool);
-        if (evbuf) {
-            evbuf[0] = BLE_HCI_EVCODE_LE_META;
-            evbuf[1] = 12 + adv_data_len;
-            evbuf[2] = subev;
-            evbuf[3] = 1;       /* number of reports */
-            evbuf[4] = evtype;
-
-            /* XXX: need to deal with resolvable addresses here! */
-            if (addr_type) {
-                evbuf[5] = BLE_HCI_ADV_OWN_ADDR_RANDOM;
-            } else {
-                evbuf[5] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
-            }
-            memcpy(evbuf + 6, rxbuf + BLE_LL_PDU_HDR_LEN, BLE_DEV_ADDR_LEN);
-            evbuf[12] = adv_data_len;
-            memcpy(evbuf + 13, rxbuf + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN,
-                   adv_data_len);
-            evbuf[13 + adv_data_len] = rssi;
+    if (!ble_ll_hci_is_le_event_enabled(subev - 1)) {
+        return BLE_ERR_MEM_CAPACITY;
+    }
+
+    /* Send the pending event first if this report does not fit */
+    scansm = &g_ble_ll_scan_sm;
+    rpt_len = BLE_HCI_LE_ADV_RPT_MIN_LEN + adv_data_len;
+    om = scansm->adv_rpt_om;
+    if (om) {
+        evbuf = om->om_data;
+        if (((evbuf[1] + rpt_len) > BLE_HCI_EVENT_MAX_PARAM_LEN) ||
+            ((BLE_HCI_EVENT_HDR_LEN + evbuf[1] + rpt_len) > 
+             OS_MBUF_TRAILINGSPACE(&g_mbuf_pool, om))) {
+            ble_ll_scan_adv_rpt_flush(scansm);
+            om = NULL;
         }
+    }
 
-        rc = ble_ll_hci_event_send(evbuf);
-        if (!rc) {
-            /* If we are filtering, add it to list of duplicate addresses */
-            if (g_ble_ll_scan_sm.scan_filt_dups) {
-                ble_ll_scan_add_dup_adv(rxbuf + BLE_LL_PDU_HDR_LEN, addr_type);
-            }
+    if (!om) {
+        om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+        if (!om) {
+            return BLE_ERR_MEM_CAPACITY;
         }
+        evbuf = om->om_data;
+        evbuf[0] = BLE_HCI_EVCODE_LE_META;
+        evbuf[1] = BLE_HCI_LE_ADV_RPT_HDR_LEN;
+        evbuf[2] = subev;
+        evbuf[3] = 0;       /* number of reports */
+        scansm->adv_rpt_om = om;
+        os_callout_reset(&scansm->adv_rpt_timer.cf_c,
+                         BLE_LL_SCAN_CFG_ADV_RPT_TMO);
     }
 
-    return rc;
+    /* Append the report */
+    dptr = evbuf + BLE_HCI_EVENT_HDR_LEN + evbuf[1];
+    dptr[0] = evtype;
+
+    /* XXX: need to deal with resolvable addresses here! */
+    if (addr_type) {
+        dptr[1] = BLE_HCI_ADV_OWN_ADDR_RANDOM;
+    } else {
+        dptr[1] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    }
+    memcpy(dptr + 2, rxbuf + BLE_LL_PDU_HDR_LEN, BLE_DEV_ADDR_LEN);
+    dptr[8] = adv_data_len;
+    memcpy(dptr + 9, rxbuf + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN,
+           adv_data_len);
+    dptr[9 + adv_data_len] = rssi;
+    evbuf[1] += rpt_len;
+    ++evbuf[3];
+    ++g_ble_ll_scan_stats.adv_rpts;
+
+    /* If we are filtering, add it to list of duplicate addresses */
+    adv = NULL;
+    flag = 0;
+    if (scansm->scan_filt_dups) {
+        flag = ble_ll_scan_adv_rpt_flag(pdu_type);
+        adv = ble_ll_scan_adv_add(rxbuf + BLE_LL_PDU_HDR_LEN, addr_type);
+        adv->sc_adv_flags |= flag;
+    }
+    scansm->adv_rpt_advs[scansm->adv_rpt_num] = adv;
+    scansm->adv_rpt_flags[scansm->adv_rpt_num] = flag;
+    ++scansm->adv_rpt_num;
+
+    if (scansm->adv_rpt_num == BLE_LL_SCAN_CFG_ADV_RPT_MAX) {
+        ble_ll_scan_adv_rpt_flush(scansm);
+    }
+
+    return 0;
 }
 
 /**
@@ -494,10 +652,53 @@ static int
 ble_ll_scan_win_end_cb(struct ll_sched_item *sch)
 {
     ble_phy_disable();
+    ble_ll_state_set(BLE_LL_STATE_STANDBY);
     ble_ll_event_send(&g_ble_ll_scan_sm.scan_win_end_ev);
     return BLE_LL_SCHED_STATE_DONE;
 }
 
+static int ble_ll_scan_start_cb(struct ll_sched_item *sch);
+
+/**
+ * Scan window stopped for a schedule item of higher priority (e.g. a
+ * connection event). The rest of the window is scheduled again: it starts
+ * once the radio is free (see ll_sched_run()), so the scanner gets the time
+ * between connection events.
+ *
+ * Context: Interrupt (scheduler)
+ *
+ * @param sch
+ */
+static void
+ble_ll_scan_sched_preempt(struct ll_sched_item *sch)
+{
+    int rc;
+    struct ll_sched_item *rsch;
+    struct ble_ll_scan_sm *scansm;
+
+    ble_phy_disable();
+    ble_ll_state_set(BLE_LL_STATE_STANDBY);
+
+    scansm = (struct ble_ll_scan_sm *)sch->cb_arg;
+    rsch = ll_sched_get_item();
+    if (!rsch) {
+        ++g_ble_ll_scan_stats.cant_set_sched;
+        ble_ll_event_send(&scansm->scan_win_end_ev);
+        return;
+    }
+
+    ++g_ble_ll_scan_stats.scan_win_resumed;
+    rsch->sched_type = BLE_LL_SCHED_TYPE_SCAN;
+    rsch->sched_prio = BLE_LL_SCHED_PRIO_SCAN;
+    rsch->preempt_cb = ble_ll_scan_sched_preempt;
+    rsch->cb_arg = scansm;
+    rsch->sched_cb = ble_ll_scan_start_cb;
+    rsch->start_time = cputime_get32();
+    rsch->end_time = scansm->scan_win_end_time;
+    rc = ll_sched_add(rsch);
+    assert(rc == 0);
+}
+
 static int
 ble_ll_scan_start_cb(struct ll_sched_item *sch)
 {
@@ -510,8 +711,21 @@ ble_ll_scan_start_cb(struct ll_sched_item *sch)
     /* Get the state machine for the event */
     scansm = (struct ble_ll_scan_sm *)sch->cb_arg;
 
+    /* The window may be over if we waited for other items */
+    if ((int32_t)(cputime_get32() - scansm->scan_win_end_time) >= 0) {
+        ble_ll_event_send(&scansm->scan_win_end_ev);
+        return BLE_LL_SCHED_STATE_DONE;
+    }
+
+    /* The radio may still be sending the CONNECT_REQ of a new connection */
+    if (ble_phy_state_get() != BLE_PHY_STATE_IDLE) {
+        sch->next_wakeup = cputime_get32() + cputime_usecs_to_ticks(BLE_LL_IFS);
+        return BLE_LL_SCHED_STATE_RUNNING;
+    }
+
     /* Set channel */
-    rc = ble_phy_setchan(scansm->scan_chan);
+    rc = ble_phy_setchan(scansm->scan_chan, BLE_ACCESS_ADDR_ADV, 
+                         BLE_LL_CRCINIT_ADV);
     assert(rc == 0);
 
     /* Start receiving */
@@ -521,13 +735,17 @@ ble_ll_scan_start_cb(struct ll_sched_item *sch)
         ble_ll_event_send(&g_ble_ll_scan_sm.scan_win_end_ev);
         rc =  BLE_LL_SCHED_STATE_DONE;
     } else {
-        /* Set link layer state to scanning */
-        ble_ll_state_set(BLE_LL_STATE_SCANNING);
+        /* Set link layer state to scanning (or initiating) */
+        if (scansm->init_active) {
+            ble_ll_state_set(BLE_LL_STATE_INITITATING);
+        } else {
+            ble_ll_state_set(BLE_LL_STATE_SCANNING);
+        }
 
         /* XXX: scan forever? */
 
         /* Set end time to end of scan window */
-        sch->next_wakeup = sch->end_time;
+        sch->next_wakeup = scansm->scan_win_end_time;
         sch->sched_cb = ble_ll_scan_win_end_cb;
         rc = BLE_LL_SCHED_STATE_RUNNING;
     }
@@ -545,16 +763,29 @@ ble_ll_scan_start_cb(struct ll_sched_item *sch)
 static void
 ble_ll_scan_sm_stop(struct ble_ll_scan_sm *scansm)
 {
+    os_sr_t sr;
+
     /* XXX: Stop any timers we may have started */
 
-    /* Remove any scheduled advertising items */
+    /* 
+     * Remove any scheduled scanning items. The PHY is disabled only if we
+     * are using it; it may be busy with something else (a connection).
+     */
+    OS_ENTER_CRITICAL(sr);
     ll_sched_rmv(BLE_LL_SCHED_TYPE_SCAN);
-
-    /* Disable the PHY */
-    ble_phy_disable();
+    if ((g_ll_data.ll_state == BLE_LL_STATE_SCANNING) ||
+        (g_ll_data.ll_state == BLE_LL_STATE_INITITATING)) {
+        ble_phy_disable();
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    }
 
     /* Disable scanning state machine */
     scansm->scan_enabled = 0;
+    scansm->init_active = 0;
+    OS_EXIT_CRITICAL(sr);
+
+    /* Send any advertising reports we are holding */
+    ble_ll_scan_adv_rpt_flush(scansm);
 
     /* Count # of times stopped */
     ++g_ble_ll_scan_stats.scan_stops;
@@ -564,12 +795,15 @@ static struct ll_sched_item *
 ble_ll_scan_sched_set(struct ble_ll_scan_sm *scansm)
 {
     int rc;
+    uint16_t window;
     struct ll_sched_item *sch;
 
     sch = ll_sched_get_item();
     if (sch) {
-        /* Set sched type */
+        /* Set sched type and priority */
         sch->sched_type = BLE_LL_SCHED_TYPE_SCAN;
+        sch->sched_prio = BLE_LL_SCHED_PRIO_SCAN;
+        sch->preempt_cb = ble_ll_scan_sched_preempt;
 
         /* XXX: probably the PHY should provide an API to return this stuff
            to me as opposed to # define (XCVR_RX_SCHED) */
@@ -581,10 +815,15 @@ ble_ll_scan_sched_set(struct ble_ll_scan_sm *scansm)
         /* Set the callback, arg, start and end time */
         sch->cb_arg = scansm;
         sch->sched_cb = ble_ll_scan_start_cb;
+        if (scansm->init_active) {
+            window = scansm->init_window;
+        } else {
+            window = scansm->scan_window;
+        }
         sch->end_time = sch->start_time + 
-            cputime_usecs_to_ticks(scansm->scan_window * BLE_HCI_SCAN_ITVL);
+            cputime_usecs_to_ticks(window * BLE_HCI_SCAN_ITVL);
+        scansm->scan_win_end_time = sch->end_time;
 
-        /* XXX: for now, we cant get an overlap so assert on error. */
         /* Add the item to the scheduler */
         rc = ll_sched_add(sch);
         assert(rc == 0);
@@ -604,9 +843,11 @@ ble_ll_scan_sm_start(struct ble_ll_scan_sm *scansm)
      * XXX: not sure if I should do this or just report whatever random
      * address the host sent. For now, I will reject the command with a
      * command disallowed error. All the parameter errors refer to the command
-     * parameter (which in this case is just enable or disable).
+     * parameter (which in this case is just enable or disable). The
+     * initiator checks its own address when the connection is created.
      */ 
-    if (scansm->own_addr_type != BLE_HCI_ADV_OWN_ADDR_PUBLIC) {
+    if (!scansm->init_active &&
+        (scansm->own_addr_type != BLE_HCI_ADV_OWN_ADDR_PUBLIC)) {
         if (!ll_is_valid_rand_addr(g_random_addr)) {
             return BLE_ERR_CMD_DISALLOWED;
         }
@@ -631,6 +872,9 @@ ble_ll_scan_sm_start(struct ble_ll_scan_sm *scansm)
     scansm->backoff_count = 1;
     scansm->scan_rsp_pending = 0;
 
+    /* Forget advertisers heard during any previous scan */
+    memset(g_ble_ll_scan_advs, 0, sizeof(g_ble_ll_scan_advs));
+
     /* Schedule start time now */
     scansm->scan_win_start_time = cputime_get32();
 
@@ -651,12 +895,17 @@ ble_ll_scan_win_end_proc(void *arg)
     uint32_t itvl;
     struct ble_ll_scan_sm *scansm;
 
+    /* Scanning may have stopped (e.g. a connection was created) */
+    scansm = (struct ble_ll_scan_sm *)arg;
+    if (!scansm->scan_enabled) {
+        return;
+    }
+
     /* Toggle the LED */
     gpio_toggle(LED_BLINK_PIN);
 
-    /* We are no longer scanning  */
-    scansm = (struct ble_ll_scan_sm *)arg;
-    ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    /* Send any advertising reports we are holding */
+    ble_ll_scan_adv_rpt_flush(scansm);
 
     /* Move to next channel */
     ++scansm->scan_chan;
@@ -672,7 +921,12 @@ ble_ll_scan_win_end_proc(void *arg)
     /* XXX: deal with scan forever */
 
     /* Set next scan window start time */
-    itvl = cputime_usecs_to_ticks(scansm->scan_itvl * BLE_HCI_SCAN_ITVL);
+    if (scansm->init_active) {
+        itvl = scansm->init_itvl;
+    } else {
+        itvl = scansm->scan_itvl;
+    }
+    itvl = cputime_usecs_to_ticks(itvl * BLE_HCI_SCAN_ITVL);
     scansm->scan_win_start_time += itvl;
         
     /* 
@@ -991,8 +1245,13 @@ ble_ll_scan_set_enable(uint8_t *cmd)
         return BLE_ERR_INV_HCI_CMD_PARMS;
     }
 
-    rc = BLE_ERR_SUCCESS;
+    /* Not while the scanner is used to create a connection */
     scansm = &g_ble_ll_scan_sm;
+    if (scansm->init_active) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    rc = BLE_ERR_SUCCESS;
     if (enable) {
         /* If already enabled, do nothing */
         if (!scansm->scan_enabled) {
@@ -1010,26 +1269,152 @@ ble_ll_scan_set_enable(uint8_t *cmd)
 }
 
 /**
- * ble ll scan init 
+ * ble ll scan initiator start
  *  
- * Initialize a scanner. 
+ * Start initiating: the scanner listens for the advertiser we want to
+ * connect to, using the scan interval and window of the create connection
+ * command. 
+ *  
+ * Context: Link Layer task (HCI Command parser).
+ * 
+ * @param hcc The create connection command parameters
+ * 
+ * @return int BLE error code. 
+ */
+int
+ble_ll_scan_initiator_start(struct hci_create_conn *hcc)
+{
+    int rc;
+    struct ble_ll_scan_sm *scansm;
+
+    scansm = &g_ble_ll_scan_sm;
+    if (scansm->scan_enabled) {
+        return BLE_ERR_CMD_DISALLOWED;
+    }
+
+    scansm->init_active = 1;
+    scansm->init_itvl = hcc->scan_itvl;
+    scansm->init_window = hcc->scan_window;
+    rc = ble_ll_scan_sm_start(scansm);
+    if (rc) {
+        scansm->init_active = 0;
+    }
+
+    return rc;
+}
+
+/**
+ * ble ll scan initiator stop
+ *  
+ * Stop initiating (create connection cancelled). 
+ *  
+ * Context: Link Layer task (HCI Command parser).
  */
 void
-ble_ll_scan_init(void)
+ble_ll_scan_initiator_stop(void)
 {
     struct ble_ll_scan_sm *scansm;
 
-    /* Clear state machine in case re-initialized */
     scansm = &g_ble_ll_scan_sm;
+    if (scansm->init_active) {
+        ble_ll_scan_sm_stop(scansm);
+    }
+}
+
+/**
+ * ble ll scan initiator isr stop
+ *  
+ * Stop initiating once the CONNECT_REQ has been sent. The PHY is still
+ * sending it; it goes idle when done. 
+ *  
+ * Context: Interrupt
+ */
+void
+ble_ll_scan_initiator_isr_stop(void)
+{
+    struct ble_ll_scan_sm *scansm;
+
+    scansm = &g_ble_ll_scan_sm;
+    ll_sched_rmv(BLE_LL_SCHED_TYPE_SCAN);
+    scansm->scan_enabled = 0;
+    scansm->init_active = 0;
+    ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    ++g_ble_ll_scan_stats.scan_stops;
+}
+
+/* Clear the scanner and set the default parameters; the mbuf is kept */
+static void
+ble_ll_scan_sm_init(struct ble_ll_scan_sm *scansm)
+{
+    struct os_mbuf *scan_req_pdu;
+
+    /* Clear state machine in case re-initialized */
+    scan_req_pdu = scansm->scan_req_pdu;
     memset(scansm, 0, sizeof(struct ble_ll_scan_sm));
+    scansm->scan_req_pdu = scan_req_pdu;
 
     /* Initialize scanning window end event */
     scansm->scan_win_end_ev.ev_type = BLE_LL_EVENT_SCAN_WIN_END;
     scansm->scan_win_end_ev.ev_arg = scansm;
 
+    /* Initialize advertising report timer */
+    os_callout_func_init(&scansm->adv_rpt_timer, &g_ll_data.ll_evq,
+                         ble_ll_scan_adv_rpt_timer_cb, scansm);
+
     /* Set all non-zero default parameters */
     scansm->scan_itvl = BLE_HCI_SCAN_ITVL_DEF;
     scansm->scan_window = BLE_HCI_SCAN_WINDOW_DEF;
+}
+
+/**
+ * ble ll scan reset 
+ *  
+ * Stop scanning (or initiating) and restore the default scanning
+ * parameters. Unlike a scan stop, advertising reports we are holding are
+ * dropped, not sent. 
+ *  
+ * Context: Link Layer task (HCI reset).
+ */
+void
+ble_ll_scan_reset(void)
+{
+    os_sr_t sr;
+    struct ble_ll_scan_sm *scansm;
+
+    scansm = &g_ble_ll_scan_sm;
+    OS_ENTER_CRITICAL(sr);
+    ll_sched_rmv(BLE_LL_SCHED_TYPE_SCAN);
+    if ((g_ll_data.ll_state == BLE_LL_STATE_SCANNING) ||
+        (g_ll_data.ll_state == BLE_LL_STATE_INITITATING)) {
+        ble_phy_disable();
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    }
+    scansm->scan_enabled = 0;
+    scansm->init_active = 0;
+    OS_EXIT_CRITICAL(sr);
+
+    os_callout_stop(&scansm->adv_rpt_timer.cf_c);
+    if (scansm->adv_rpt_om) {
+        os_mbuf_free_chain(&g_mbuf_pool, scansm->adv_rpt_om);
+    }
+    os_eventq_remove(&g_ll_data.ll_evq, &scansm->scan_win_end_ev);
+
+    ble_ll_scan_sm_init(scansm);
+}
+
+/**
+ * ble ll scan init 
+ *  
+ * Initialize a scanner. 
+ */
+void
+ble_ll_scan_init(void)
+{
+    struct ble_ll_scan_sm *scansm;
+
+    scansm = &g_ble_ll_scan_sm;
+    scansm->scan_req_pdu = NULL;
+    ble_ll_scan_sm_init(scansm);
 
     /* Get a scan request mbuf (packet header) and attach to state machine */
     scansm->scan_req_pdu = os_mbuf_get_pkthdr(&g_mbuf_pool);
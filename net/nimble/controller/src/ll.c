@@ -21,16 +21,14 @@
 #include "controller/phy.h"
 #include "controller/ll.h"
 #include "controller/ll_adv.h"
+#include "controller/ll_adv_ext.h"
 #include "controller/ll_sched.h"
 #include "controller/ll_scan.h"
 #include "controller/ll_hci.h"
+#include "controller/ll_conn.h"
 
 /* XXX: use the sanity task! */
 
-/* Connection related define */
-#define BLE_LL_CONN_INIT_MAX_REMOTE_OCTETS  (27)
-#define BLE_LL_CONN_INIT_MAX_REMOTE_TIME    (238)
-
 /* The global BLE LL data object */
 struct ll_obj g_ll_data;
 
@@ -43,100 +41,6 @@ struct ll_stats g_ll_stats;
 struct os_task g_ll_task;
 os_stack_t g_ll_stack[BLE_LL_STACK_SIZE];
 
-/* XXX: this is just temporary; used to calculate the channel index */
-struct ll_sm_connection
-{
-    /* Data channel index for connection */
-    uint8_t unmapped_chan;
-    uint8_t last_unmapped_chan;
-    uint8_t num_used_channels;
-
-    /* Flow control */
-    uint8_t tx_seq;
-    uint8_t next_exp_seq;
-
-    /* Parameters kept by the link-layer per connection */
-    uint8_t max_tx_octets;
-    uint8_t max_rx_octets;
-    uint8_t max_tx_time;
-    uint8_t max_rx_time;
-    uint8_t remote_max_tx_octets;
-    uint8_t remote_max_rx_octets;
-    uint8_t remote_max_tx_time;
-    uint8_t remote_max_rx_time;
-    uint8_t effective_max_tx_octets;
-    uint8_t effective_max_rx_octets;
-    uint8_t effective_max_tx_time;
-    uint8_t effective_max_rx_time;
-
-    /* The connection request data */
-    struct ble_conn_req_data req_data; 
-};
-
-uint8_t
-ll_next_data_channel(struct ll_sm_connection *cnxn)
-{
-    int     i;
-    int     j;
-    uint8_t curchan;
-    uint8_t remap_index;
-    uint8_t bitpos;
-    uint8_t cntr;
-    uint8_t mask;
-    uint8_t usable_chans;
-
-    /* Get next un mapped channel */
-    curchan = (cnxn->last_unmapped_chan + cnxn->req_data.hop_inc) % 
-              BLE_PHY_NUM_DATA_CHANS;
-
-    /* Set the current unmapped channel */
-    cnxn->unmapped_chan = curchan;
-
-    /* Is this a valid channel? */
-    bitpos = 1 << (curchan & 0x07);
-    if ((cnxn->req_data.chanmap[curchan >> 3] & bitpos) == 0) {
-
-        /* Calculate remap index */
-        remap_index = curchan % cnxn->num_used_channels;
-
-        /* Iterate through channel map to find this channel */
-        cntr = 0;
-        for (i = 0; i < 5; i++) {
-            usable_chans = cnxn->req_data.chanmap[i];
-            if (usable_chans != 0) {
-                mask = 0x01;
-                for (j = 0; j < 8; j++) {
-                    if (usable_chans & mask) {
-                        if (cntr == remap_index) {
-                            return cntr;
-                        }
-                        ++cntr;
-                    }
-                    mask <<= 1;
-                }
-            }
-        }
-    }
-
-    return curchan;
-}
-
-/* Called when a connection gets initialized */
-int
-ble_init_conn_sm(struct ll_sm_connection *cnxn)
-{
-    cnxn->max_tx_time = g_ll_data.ll_params.conn_init_max_tx_time;
-    cnxn->max_rx_time = g_ll_data.ll_params.supp_max_rx_time;
-    cnxn->max_tx_octets = g_ll_data.ll_params.conn_init_max_tx_octets;
-    cnxn->max_rx_octets = g_ll_data.ll_params.supp_max_rx_octets;
-    cnxn->remote_max_rx_octets = BLE_LL_CONN_INIT_MAX_REMOTE_OCTETS;
-    cnxn->remote_max_tx_octets = BLE_LL_CONN_INIT_MAX_REMOTE_OCTETS;
-    cnxn->remote_max_rx_time = BLE_LL_CONN_INIT_MAX_REMOTE_TIME;
-    cnxn->remote_max_tx_time = BLE_LL_CONN_INIT_MAX_REMOTE_TIME;
-
-    return 0;
-}
-
 static void
 ble_ll_count_rx_pkts(uint8_t pdu_type)
 {
@@ -300,12 +204,16 @@ ll_rx_pkt_in_proc(void)
         STAILQ_REMOVE_HEAD(&g_ll_data.ll_rx_pkt_q, omp_next);
         OS_EXIT_CRITICAL(sr);
 
-        /* XXX: need to check if this is an adv channel or data channel */
+        /* Data channel PDUs belong to the connection */
+        ble_hdr = BLE_MBUF_HDR_PTR(m); 
+        if (ble_hdr->channel < BLE_PHY_NUM_DATA_CHANS) {
+            ble_ll_conn_rx_data_pdu(m, ble_hdr->crcok);
+            continue;
+        }
 
         /* Count statistics */
         rxbuf = m->om_data;
         pdu_type = rxbuf[0] & BLE_ADV_PDU_HDR_TYPE_MASK;
-        ble_hdr = BLE_MBUF_HDR_PTR(m); 
         if (ble_hdr->crcok) {
             /* The total bytes count the PDU header and PDU payload */
             g_ll_stats.rx_bytes += pkthdr->omp_len;
@@ -338,9 +246,14 @@ ll_rx_pkt_in_proc(void)
                 ble_phy_rx();
             }
             break;
+        case BLE_LL_STATE_INITITATING:
+            /* Keep listening unless the CONNECT_REQ has been sent */
+            if (ble_phy_state_get() == BLE_PHY_STATE_IDLE) {
+                ble_phy_rx();
+            }
+            break;
         default:
-            /* XXX: implement */
-            assert(0);
+            /* The state changed since the PDU was received. Drop it */
             break;
         }
 
@@ -404,10 +317,15 @@ ll_rx_start(struct os_mbuf *rxpdu)
     case BLE_LL_STATE_SCANNING:
         rc = ble_ll_scan_rx_pdu_start(pdu_type, rxpdu);
         break;
+    case BLE_LL_STATE_INITITATING:
+        rc = ble_ll_init_rx_pdu_start(pdu_type);
+        break;
+    case BLE_LL_STATE_CONNECT:
+        rc = ble_ll_conn_rx_isr_start(rxpdu);
+        break;
     default:
-        /* XXX: should we really assert here? What to do... */
+        /* Not expecting a frame in this state. Abort it */
         rc = -1;
-        assert(0);
         break;
     }
 
@@ -437,11 +355,16 @@ ll_rx_end(struct os_mbuf *rxpdu, uint8_t crcok)
     uint8_t len;
     uint16_t mblen;
     uint8_t *rxbuf;
+    struct ble_mbuf_hdr *ble_hdr;
+
+    /* Data channel PDUs are handled by the connection */
+    if (g_ll_data.ll_state == BLE_LL_STATE_CONNECT) {
+        return ble_ll_conn_rx_isr_end(rxpdu, crcok);
+    }
 
     /* Set the rx buffer pointer to the start of the received data */
     rxbuf = rxpdu->om_data;
 
-    /* XXX: need to check if this is an adv channel or data channel */
     pdu_type = rxbuf[0] & BLE_ADV_PDU_HDR_TYPE_MASK;
     len = rxbuf[1] & BLE_ADV_PDU_HDR_LEN_MASK;
 
@@ -503,10 +426,10 @@ ll_rx_end(struct os_mbuf *rxpdu, uint8_t crcok)
                      */
                 }
             }
-        } else {
-            if (pdu_type == BLE_ADV_PDU_TYPE_CONNECT_REQ) {
-                rc = 0;
-                /* XXX: deal with this */
+        } else if (pdu_type == BLE_ADV_PDU_TYPE_CONNECT_REQ) {
+            if (crcok) {
+                ble_hdr = BLE_MBUF_HDR_PTR(rxpdu);
+                rc = ll_adv_rx_conn_req(rxbuf, ble_hdr->end_cputime);
             }
         }
         break;
@@ -520,8 +443,12 @@ ll_rx_end(struct os_mbuf *rxpdu, uint8_t crcok)
             rc = ble_ll_scan_rx_pdu_end(rxbuf);
         }
         break;
+    case BLE_LL_STATE_INITITATING:
+        if (crcok) {
+            rc = ble_ll_init_rx_pdu_end(rxpdu);
+        }
+        break;
     default:
-        assert(0);
         break;
     }
 
@@ -531,6 +458,62 @@ ll_rx_end(struct os_mbuf *rxpdu, uint8_t crcok)
     return rc;
 }
 
+/**
+ * Process an event sent to the Link Layer task.
+ *
+ * Context: Link Layer task
+ *
+ * @param ev The event to process.
+ */
+void
+ll_event_proc(struct os_event *ev)
+{
+    struct os_callout_func *cf;
+
+    switch (ev->ev_type) {
+    case OS_EVENT_T_TIMER:
+        cf = (struct os_callout_func *)ev;
+        assert(cf->cf_func);
+        cf->cf_func(cf->cf_arg);
+        break;
+    case BLE_LL_EVENT_HCI_CMD:
+        /* Process HCI command */
+        ble_ll_hci_cmd_proc(ev);
+        break;
+    case BLE_LL_EVENT_HCI_ACL:
+        /* Process HCI ACL data */
+        ble_ll_hci_acl_proc(ev);
+        break;
+    case BLE_LL_EVENT_ADV_TXDONE:
+        ll_adv_tx_done_proc(ev->ev_arg);
+        break;
+    case BLE_LL_EVENT_SCAN_WIN_END:
+        ble_ll_scan_win_end_proc(ev->ev_arg);
+        break;
+    case BLE_LL_EVENT_RX_PKT_IN:
+        ll_rx_pkt_in_proc();
+        break;
+    case BLE_LL_EVENT_CONN_SPAWN:
+        ble_ll_conn_spawn_proc(ev->ev_arg);
+        break;
+    case BLE_LL_EVENT_CONN_EV_END:
+        ble_ll_conn_event_end_proc(ev->ev_arg);
+        break;
+    case BLE_LL_EVENT_ADV_EXT_DONE:
+        ble_ll_adv_ext_event_done_proc(ev->ev_arg);
+        break;
+    case BLE_LL_EVENT_ADV_PER_DONE:
+        ble_ll_adv_per_event_done_proc(ev->ev_arg);
+        break;
+    default:
+        assert(0);
+        break;
+    }
+
+    /* XXX: we can possibly take any finished schedule items and
+       free them here. Have a queue for them. */
+}
+
 void
 ll_task(void *arg)
 {
@@ -545,29 +528,7 @@ ll_task(void *arg)
     /* Wait for an event */
     while (1) {
         ev = os_eventq_get(&g_ll_data.ll_evq);
-        switch (ev->ev_type) {
-        case OS_EVENT_T_TIMER:
-            break;
-        case BLE_LL_EVENT_HCI_CMD:
-            /* Process HCI command */
-            ble_ll_hci_cmd_proc(ev);
-            break;
-        case BLE_LL_EVENT_ADV_TXDONE:
-            ll_adv_tx_done_proc(ev->ev_arg);
-            break;
-        case BLE_LL_EVENT_SCAN_WIN_END:
-            ble_ll_scan_win_end_proc(ev->ev_arg);
-            break;
-        case BLE_LL_EVENT_RX_PKT_IN:
-            ll_rx_pkt_in_proc();
-            break;
-        default:
-            assert(0);
-            break;
-        }
-
-        /* XXX: we can possibly take any finished schedule items and
-           free them here. Have a queue for them. */
+        ll_event_proc(ev);
     }
 }
 
@@ -599,6 +560,69 @@ ble_ll_event_send(struct os_event *ev)
     os_eventq_put(&g_ll_data.ll_evq, ev);
 }
 
+/* Data length: the defaults for new connections and what we support */
+static void
+ll_set_default_params(void)
+{
+    g_ll_data.ll_params.conn_init_max_tx_octets = BLE_LL_CONN_SUPP_BYTES_MIN;
+    g_ll_data.ll_params.conn_init_max_tx_time = BLE_LL_CONN_SUPP_TIME_MIN;
+    g_ll_data.ll_params.supp_max_tx_octets = BLE_LL_CONN_SUPP_BYTES_MAX;
+    g_ll_data.ll_params.supp_max_tx_time = BLE_LL_CONN_SUPP_TIME_MAX;
+    g_ll_data.ll_params.supp_max_rx_octets = BLE_LL_CONN_SUPP_BYTES_MAX;
+    g_ll_data.ll_params.supp_max_rx_time = BLE_LL_CONN_SUPP_TIME_MAX;
+}
+
+/**
+ * ll reset 
+ *  
+ * Called by the HCI reset command. Stops advertising, scanning and all
+ * connections (the host is not told about them) and puts the Link Layer
+ * back in its power-up state: default parameters, no random address and
+ * nothing received or queued from the host. 
+ *  
+ * Context: Link Layer task (HCI command parser) 
+ * 
+ * @return int BLE_ERR_SUCCESS
+ */
+int
+ll_reset(void)
+{
+    os_sr_t sr;
+    struct os_mbuf *m;
+    struct os_mbuf_pkthdr *pkthdr;
+
+    /* Stop everything that may be using the PHY */
+    ble_ll_conn_reset();
+    ble_ll_scan_reset();
+    ll_adv_reset();
+    ble_ll_adv_ext_reset();
+
+    /* Drop the packets received but not processed yet */
+    os_eventq_remove(&g_ll_data.ll_evq, &g_ll_data.ll_rx_pkt_ev);
+    while (1) {
+        OS_ENTER_CRITICAL(sr);
+        pkthdr = STAILQ_FIRST(&g_ll_data.ll_rx_pkt_q);
+        if (pkthdr) {
+            STAILQ_REMOVE_HEAD(&g_ll_data.ll_rx_pkt_q, omp_next);
+        }
+        OS_EXIT_CRITICAL(sr);
+        if (!pkthdr) {
+            break;
+        }
+        m = (struct os_mbuf *)((uint8_t *)pkthdr - sizeof(struct os_mbuf));
+        os_mbuf_free_chain(&g_mbuf_pool, m);
+    }
+
+    /* Event masks and data from the host */
+    ble_ll_hci_reset();
+
+    ll_set_default_params();
+    memset(g_random_addr, 0, BLE_DEV_ADDR_LEN);
+    ble_ll_state_set(BLE_LL_STATE_STANDBY);
+
+    return BLE_ERR_SUCCESS;
+}
+
 /**
  * Initialize the Link Layer. Should be called only once 
  * 
@@ -616,18 +640,25 @@ ll_init(void)
     /* Initialize receive packet (from phy) event */
     g_ll_data.ll_rx_pkt_ev.ev_type = BLE_LL_EVENT_RX_PKT_IN;
 
+    /* Set the default parameters */
+    ll_set_default_params();
+
     /* Initialize LL HCI */
     ble_ll_hci_init();
 
     /* Init the scheduler */
     ll_sched_init();
 
-    /* Initialize advertiser */
+    /* Initialize advertiser and the advertising sets */
     ll_adv_init();
+    ble_ll_adv_ext_init();
 
     /* Initialize a scanner */
     ble_ll_scan_init();
 
+    /* Initialize the connection module */
+    ble_ll_conn_init();
+
     /* Initialize the LL task */
     os_task_init(&g_ll_task, "ble_ll", ll_task, NULL, BLE_LL_TASK_PRI, 
                  OS_WAIT_FOREVER, g_ll_stack, BLE_LL_STACK_SIZE);
@@ -24,6 +24,7 @@
 #include "controller/ll_adv.h"
 #include "controller/ll_sched.h"
 #include "controller/ll_scan.h"
+#include "controller/ll_conn.h"
 #include "hal/hal_cputime.h"
 
 /* 
@@ -221,6 +222,12 @@ ll_adv_pdu_make(struct ll_adv_sm *advsm)
     dptr = m->om_data;
     dptr[0] = pdu_type;
     dptr[1] = (uint8_t)pdulen;
+
+    /* Connectable: tell the initiator we support channel selection #2 */
+    if ((advsm->adv_type != BLE_HCI_ADV_TYPE_ADV_NONCONN_IND) &&
+        (advsm->adv_type != BLE_HCI_ADV_TYPE_ADV_SCAN_IND)) {
+        dptr[0] |= BLE_ADV_PDU_HDR_CHSEL;
+    }
     memcpy(dptr + BLE_LL_PDU_HDR_LEN, addr, BLE_DEV_ADDR_LEN);
     dptr += BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN;
 
@@ -304,11 +311,28 @@ ll_adv_rx_cb(struct ll_sched_item *sch)
 {
     /* Disable the PHY as we might be receiving */
     ble_phy_disable();
+    ble_ll_state_set(BLE_LL_STATE_STANDBY);
     os_eventq_put(&g_ll_data.ll_evq, &g_ll_adv_sm.adv_txdone_ev);
     return BLE_LL_SCHED_STATE_DONE;
 }
 
 
+/**
+ * ll adv sched preempt
+ *  
+ * Scheduler callback when the advertising event is stopped for a schedule 
+ * item of higher priority. Moves on as if the PDU had been sent. 
+ *  
+ * Context: Interrupt (scheduler) 
+ * 
+ * @param sch 
+ */
+static void
+ll_adv_sched_preempt(struct ll_sched_item *sch)
+{
+    ll_adv_rx_cb(sch);
+}
+
 /**
  * ble ll adv tx done cb 
  *  
@@ -319,6 +343,7 @@ ll_adv_rx_cb(struct ll_sched_item *sch)
 static int
 ll_adv_tx_done_cb(struct ll_sched_item *sch)
 {
+    ble_ll_state_set(BLE_LL_STATE_STANDBY);
     os_eventq_put(&g_ll_data.ll_evq, &g_ll_adv_sm.adv_txdone_ev);
     return BLE_LL_SCHED_STATE_DONE;
 }
@@ -346,7 +371,8 @@ ll_adv_tx_start_cb(struct ll_sched_item *sch)
     advsm = (struct ll_adv_sm *)sch->cb_arg;
 
     /* Set channel */
-    rc = ble_phy_setchan(advsm->adv_chan);
+    rc = ble_phy_setchan(advsm->adv_chan, BLE_ACCESS_ADDR_ADV, 
+                         BLE_LL_CRCINIT_ADV);
     assert(rc == 0);
 
     /* Set phy mode based on type of advertisement */
@@ -399,8 +425,10 @@ ll_adv_sched_set(struct ll_adv_sm *advsm)
 
     sch = ll_sched_get_item();
     if (sch) {
-        /* Set sched type */
+        /* Set sched type and priority */
         sch->sched_type = BLE_LL_SCHED_TYPE_ADV;
+        sch->sched_prio = BLE_LL_SCHED_PRIO_ADV;
+        sch->preempt_cb = ll_adv_sched_preempt;
 
         /* XXX: HW output compare to trigger tx start? Look into this */
         /* Set the start time of the event */
@@ -419,7 +447,6 @@ ll_adv_sched_set(struct ll_adv_sm *advsm)
         sch->end_time = advsm->adv_pdu_start_time +
             cputime_usecs_to_ticks(max_usecs);
 
-        /* XXX: for now, we cant get an overlap so assert on error. */
         /* Add the item to the scheduler */
         rc = ll_sched_add(sch);
         assert(rc == 0);
@@ -531,10 +558,18 @@ ll_adv_set_adv_params(uint8_t *cmd)
 static void
 ll_adv_sm_stop(struct ll_adv_sm *advsm)
 {
+    os_sr_t sr;
+
     /* XXX: Stop any timers we may have started */
 
     /* Remove any scheduled advertising items */
+    OS_ENTER_CRITICAL(sr);
     ll_sched_rmv(BLE_LL_SCHED_TYPE_ADV);
+    if (g_ll_data.ll_state == BLE_LL_STATE_ADV) {
+        ble_phy_disable();
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    }
+    OS_EXIT_CRITICAL(sr);
 
     /* Disable advertising */
     advsm->enabled = 0;
@@ -797,6 +832,67 @@ ll_adv_rx_scan_req(uint8_t *rxbuf)
     return rc;
 }
 
+/**
+ * ll adv rx conn req
+ *  
+ * Called when the LL receives a connect request. If the request is for us,
+ * advertising stops and we become the slave of the connection. 
+ *  
+ * NOTE: Called from interrupt context. 
+ * 
+ * @param rxbuf 
+ * @param rx_end End of the connect request (cputime)
+ * 
+ * @return int -1: the PHY is disabled after reception.
+ */
+int
+ll_adv_rx_conn_req(uint8_t *rxbuf, uint32_t rx_end)
+{
+    uint8_t *our_addr;
+    struct ll_adv_sm *advsm;
+
+    /* Only connectable advertising accepts connect requests */
+    advsm = &g_ll_adv_sm;
+    if ((advsm->adv_type == BLE_HCI_ADV_TYPE_ADV_SCAN_IND) ||
+        (advsm->adv_type == BLE_HCI_ADV_TYPE_ADV_NONCONN_IND)) {
+        return -1;
+    }
+
+    /* Must be addressed to us */
+    if (advsm->own_addr_type == BLE_HCI_ADV_OWN_ADDR_PUBLIC) {
+        our_addr = g_dev_addr;
+    } else {
+        our_addr = g_random_addr;
+    }
+    if ((!!(rxbuf[0] & BLE_ADV_PDU_HDR_RXADD_MASK) !=
+         (advsm->own_addr_type != BLE_HCI_ADV_OWN_ADDR_PUBLIC)) ||
+        memcmp(our_addr, rxbuf + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN,
+               BLE_DEV_ADDR_LEN)) {
+        return -1;
+    }
+
+    /* Directed advertising only accepts the device it was directed at */
+    if ((advsm->adv_type == BLE_HCI_ADV_TYPE_ADV_DIRECT_IND_HD) ||
+        (advsm->adv_type == BLE_HCI_ADV_TYPE_ADV_DIRECT_IND_LD)) {
+        if ((!!(rxbuf[0] & BLE_ADV_PDU_HDR_TXADD_MASK) !=
+             advsm->peer_addr_type) ||
+            memcmp(advsm->initiator_addr, rxbuf + BLE_LL_PDU_HDR_LEN,
+                   BLE_DEV_ADDR_LEN)) {
+            return -1;
+        }
+    }
+
+    /* XXX: deal with the filter policy */
+
+    if (!ble_ll_conn_slave_start(rxbuf, rx_end)) {
+        ll_sched_rmv(BLE_LL_SCHED_TYPE_ADV);
+        advsm->enabled = 0;
+        ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    }
+
+    return -1;
+}
+
 /**
  * ll adv tx done proc
  *  
@@ -815,9 +911,11 @@ ll_adv_tx_done_proc(void *arg)
     uint32_t itvl;
     struct ll_adv_sm *advsm;
 
-    /* Free the advertising packet */
+    /* Advertising may have stopped (e.g. a connection was created) */
     advsm = (struct ll_adv_sm *)arg;
-    ble_ll_state_set(BLE_LL_STATE_STANDBY);
+    if (!advsm->enabled) {
+        return;
+    }
 
     /* 
      * Check if we have ended our advertising event. If our last advertising
@@ -893,6 +991,45 @@ ll_adv_tx_done_proc(void *arg)
     }
 }
 
+/* Set the advertising parameters to their defaults; the mbufs are kept */
+static void
+ll_adv_sm_init(struct ll_adv_sm *advsm)
+{
+    struct os_mbuf *adv_pdu;
+    struct os_mbuf *scan_rsp_pdu;
+
+    adv_pdu = advsm->adv_pdu;
+    scan_rsp_pdu = advsm->scan_rsp_pdu;
+    memset(advsm, 0, sizeof(struct ll_adv_sm));
+    advsm->adv_pdu = adv_pdu;
+    advsm->scan_rsp_pdu = scan_rsp_pdu;
+
+    advsm->adv_itvl_min = BLE_HCI_ADV_ITVL_DEF;
+    advsm->adv_itvl_max = BLE_HCI_ADV_ITVL_DEF;
+    advsm->adv_chanmask = BLE_HCI_ADV_CHANMASK_DEF;
+
+    /* Initialize advertising tx done event */
+    advsm->adv_txdone_ev.ev_type = BLE_LL_EVENT_ADV_TXDONE;
+    advsm->adv_txdone_ev.ev_arg = advsm;
+}
+
+/**
+ * Stop advertising and go back to the default advertising parameters and
+ * no advertising data (HCI reset).
+ *
+ * Context: Link Layer task
+ */
+void
+ll_adv_reset(void)
+{
+    struct ll_adv_sm *advsm;
+
+    advsm = &g_ll_adv_sm;
+    ll_adv_sm_stop(advsm);
+    os_eventq_remove(&g_ll_data.ll_evq, &advsm->adv_txdone_ev);
+    ll_adv_sm_init(advsm);
+}
+
 /**
  * ll adv init 
  *  
@@ -907,14 +1044,7 @@ ll_adv_init(void)
     /* Set default advertising parameters */
     advsm = &g_ll_adv_sm;
     memset(advsm, 0, sizeof(struct ll_adv_sm));
-
-    advsm->adv_itvl_min = BLE_HCI_ADV_ITVL_DEF;
-    advsm->adv_itvl_max = BLE_HCI_ADV_ITVL_DEF;
-    advsm->adv_chanmask = BLE_HCI_ADV_CHANMASK_DEF;
-
-    /* Initialize advertising tx done event */
-    advsm->adv_txdone_ev.ev_type = BLE_LL_EVENT_ADV_TXDONE;
-    advsm->adv_txdone_ev.ev_arg = advsm;
+    ll_adv_sm_init(advsm);
 
     /* Get an advertising mbuf (packet header) and attach to state machine */
     advsm->adv_pdu = os_mbuf_get_pkthdr(&g_mbuf_pool);
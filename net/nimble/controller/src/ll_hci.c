@@ -21,49 +21,189 @@
 #include "nimble/hci_common.h"
 #include "nimble/hci_transport.h"
 #include "controller/ll_adv.h"
+#include "controller/ll_adv_ext.h"
 #include "controller/ll_scan.h"
 #include "controller/ll.h"
 #include "controller/ll_hci.h"
+#include "controller/ll_conn.h"
 
 /* LE event mask */
 uint8_t g_ble_ll_hci_le_event_mask[BLE_HCI_SET_LE_EVENT_MASK_LEN];
 uint8_t g_ble_ll_hci_event_mask[BLE_HCI_SET_EVENT_MASK_LEN];
 
+/* What we tell the host in the read local version information response */
+#define BLE_LL_HCI_REVISION     (0)
+#define BLE_LL_MFRG_ID          (0xFFFF)    /* Not assigned */
+#define BLE_LL_SUB_VERS_NR      (0)
+
+/* LMP features byte 4: LE supported (controller), BR/EDR not supported */
+#define BLE_LL_LMP_FEAT_BYTE4   (0x60)
+
+/* 
+ * The commands we support: Vol 2 Part E 6.27. A bit must be set here for
+ * every command the HCI command parser handles; a stock host does not send
+ * commands the controller does not say it supports.
+ */
+static const uint8_t g_ble_ll_supp_cmds[BLE_HCI_RD_LOC_SUPP_CMD_RSPLEN] =
+{
+    0x20,           /* Octet 0: Disconnect */
+    0, 0, 0, 0,
+    0xc0,           /* Octet 5: Set event mask, reset */
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0x28,           /* Octet 14: Read local version, supported features */
+    0x02,           /* Octet 15: Read BD_ADDR */
+    0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xf3,           /* Octet 25: LE set event mask to LE set adv data */
+    0x3f,           /* Octet 26: LE set scan rsp data to create conn cancel */
+    0, 0, 0, 0, 0, 0,
+    0xc0,           /* Octet 33: LE set data len, rd sugg def data len */
+    0x01,           /* Octet 34: LE wr sugg def data len */
+    0x08,           /* Octet 35: LE rd max data len */
+    0xfe,           /* Octet 36: LE set adv set rand addr to rd num sets */
+    0x1f,           /* Octet 37: LE remove adv set to set per adv enable */
+};
+
+/* 
+ * Packets from the host waiting for the Link Layer task. Each queue has
+ * one event which is posted to the Link Layer task when a packet is queued.
+ */
+struct ble_ll_hci_pktq
+{
+    uint8_t num_pkts;
+    struct os_event ev;
+    STAILQ_HEAD(, os_mbuf_pkthdr) pkts;
+};
+
+struct ble_ll_hci_pktq g_ble_ll_hci_cmd_q;
+struct ble_ll_hci_pktq g_ble_ll_hci_acl_q;
+
 /**
  * ll hci get num cmd pkts 
  *  
  * Returns the number of command packets that the host is allowed to send 
- * to the controller. 
+ * to the controller. Commands that have been received but not processed yet
+ * use up the allowance.
  *  
  * @return uint8_t 
  */
-static uint8_t
+uint8_t
 ble_ll_hci_get_num_cmd_pkts(void)
 {
-    return BLE_LL_CFG_NUM_HCI_CMD_PKTS;
+    uint8_t queued;
+
+    queued = g_ble_ll_hci_cmd_q.num_pkts;
+    if (queued >= BLE_LL_CFG_NUM_HCI_CMD_PKTS) {
+        return 0;
+    }
+    return BLE_LL_CFG_NUM_HCI_CMD_PKTS - queued;
+}
+
+/**
+ * Queue a packet from the host for the Link Layer task.
+ * 
+ * @param q The queue
+ * @param om The packet
+ */
+static void
+ble_ll_hci_pktq_put(struct ble_ll_hci_pktq *q, struct os_mbuf *om)
+{
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    STAILQ_INSERT_TAIL(&q->pkts, OS_MBUF_PKTHDR(om), omp_next);
+    ++q->num_pkts;
+    OS_EXIT_CRITICAL(sr);
+
+    os_eventq_put(&g_ll_data.ll_evq, &q->ev);
+}
+
+/**
+ * Remove the first packet from a queue of packets from the host.
+ * 
+ * @param q The queue
+ * 
+ * @return struct os_mbuf* The packet; NULL if the queue is empty.
+ */
+static struct os_mbuf *
+ble_ll_hci_pktq_get(struct ble_ll_hci_pktq *q)
+{
+    os_sr_t sr;
+    struct os_mbuf_pkthdr *pkthdr;
+
+    OS_ENTER_CRITICAL(sr);
+    pkthdr = STAILQ_FIRST(&q->pkts);
+    if (pkthdr) {
+        STAILQ_REMOVE_HEAD(&q->pkts, omp_next);
+        --q->num_pkts;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if (!pkthdr) {
+        return NULL;
+    }
+    return (struct os_mbuf *)((uint8_t *)pkthdr - sizeof(struct os_mbuf));
 }
 
 /**
- * Send an event to the host. 
+ * Send an event to the host. The event is built in place, starting at
+ * om_data; its length is taken from the event header.
  * 
- * @param evbuf Pointer to event buffer to send
+ * @param om Packet header mbuf holding the event. Ownership is passed to
+ * the transport.
  * 
  * @return int 0: success; -1 otherwise.
  */
 int
-ble_ll_hci_event_send(uint8_t *evbuf)
+ble_ll_hci_event_send(struct os_mbuf *om)
 {
     int rc;
 
     /* Count number of events sent */
     ++g_ll_stats.hci_events_sent;
 
+    /* Set the packet length from the event header */
+    om->om_len = BLE_HCI_EVENT_HDR_LEN + om->om_data[1];
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
     /* Send the event to the host */
-    rc = ble_hci_transport_ctlr_event_send(evbuf);
+    rc = ble_hci_transport_ctlr_event_send(om);
 
     return rc;
 }
 
+/**
+ * Send a number of completed packets event for one connection handle.
+ * 
+ * @param handle Connection handle
+ * @param num_pkts Number of packets completed
+ * 
+ * @return int 0: success; -1 if no buffer was free or the transport did not
+ * take the event. The caller still owes the host these packets.
+ */
+int
+ble_ll_hci_num_comp_pkts_send(uint16_t handle, uint16_t num_pkts)
+{
+    uint8_t *evbuf;
+    struct os_mbuf *om;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (!om) {
+        return -1;
+    }
+
+    evbuf = om->om_data;
+    evbuf[0] = BLE_HCI_EVCODE_NUM_COMP_PKTS;
+    evbuf[1] = 1 + (2 * sizeof(uint16_t));
+    evbuf[2] = 1;
+    htole16(evbuf + 3, handle);
+    htole16(evbuf + 5, num_pkts);
+    if (ble_ll_hci_event_send(om)) {
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * ll hci set le event mask
  *  
@@ -103,6 +243,100 @@ ble_ll_hci_le_read_bufsize(uint8_t *rspbuf)
     return BLE_ERR_SUCCESS;
 }
 
+/**
+ * ll hci rd sugg def data len
+ *  
+ * Process the LE read suggested default data length command. 
+ *  
+ * Context: Link Layer task (HCI command parser) 
+ * 
+ * @param rspbuf 
+ * 
+ * @return int BLE_ERR_SUCCESS
+ */
+static int
+ble_ll_hci_rd_sugg_def_data_len(uint8_t *rspbuf)
+{
+    htole16(rspbuf, g_ll_data.ll_params.conn_init_max_tx_octets);
+    htole16(rspbuf + 2, g_ll_data.ll_params.conn_init_max_tx_time);
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * ll hci wr sugg def data len
+ *  
+ * Process the LE write suggested default data length command. These are 
+ * the transmit values used by new connections. 
+ *  
+ * Context: Link Layer task (HCI command parser) 
+ * 
+ * @param cmdbuf 
+ * 
+ * @return int 
+ */
+static int
+ble_ll_hci_wr_sugg_def_data_len(uint8_t *cmdbuf)
+{
+    uint16_t tx_octets;
+    uint16_t tx_time;
+
+    tx_octets = le16toh(cmdbuf);
+    tx_time = le16toh(cmdbuf + 2);
+    if ((tx_octets < BLE_HCI_SET_DATALEN_TX_OCTETS_MIN) ||
+        (tx_octets > BLE_HCI_SET_DATALEN_TX_OCTETS_MAX) ||
+        (tx_time < BLE_HCI_SET_DATALEN_TX_TIME_MIN) ||
+        (tx_time > BLE_HCI_SET_DATALEN_TX_TIME_MAX)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    g_ll_data.ll_params.conn_init_max_tx_octets = tx_octets;
+    g_ll_data.ll_params.conn_init_max_tx_time = tx_time;
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * ll hci rd max data len
+ *  
+ * Process the LE read maximum data length command. 
+ *  
+ * Context: Link Layer task (HCI command parser) 
+ * 
+ * @param rspbuf 
+ * 
+ * @return int BLE_ERR_SUCCESS
+ */
+static int
+ble_ll_hci_rd_max_data_len(uint8_t *rspbuf)
+{
+    htole16(rspbuf, g_ll_data.ll_params.supp_max_tx_octets);
+    htole16(rspbuf + 2, g_ll_data.ll_params.supp_max_tx_time);
+    htole16(rspbuf + 4, g_ll_data.ll_params.supp_max_rx_octets);
+    htole16(rspbuf + 6, g_ll_data.ll_params.supp_max_rx_time);
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Checks to see if an event has been disabled by the host. 
+ * 
+ * @param bitpos This is the bit position of the event. Note that this can 
+ * be a value from 0 to 63, inclusive. 
+ * 
+ * @return uint8_t 0: event is not enabled; otherwise event is enabled.
+ */
+uint8_t
+ble_ll_hci_is_event_enabled(int bitpos)
+{
+    uint8_t enabled;
+    uint8_t bytenum;
+    uint8_t bitmask;
+
+    bytenum = bitpos / 8;
+    bitmask = 1 << (bitpos & 0x7);
+    enabled = g_ble_ll_hci_event_mask[bytenum] & bitmask;
+
+    return enabled;
+}
+
 /**
  * Checks to see if a LE event has been disabled by the host. 
  * 
@@ -219,34 +453,314 @@ ble_ll_hci_le_cmd_proc(uint8_t *cmdbuf, uint16_t ocf, uint8_t *rsplen)
             rc = ble_ll_scan_set_scan_params(cmdbuf);
         }
         break;
+    case BLE_HCI_OCF_LE_CREATE_CNXN:
+        if (len == BLE_HCI_CREATE_CONN_LEN) {
+            rc = ble_ll_conn_create(cmdbuf);
+        }
+        /* This command gets a command status, not a command complete */
+        rc += (BLE_ERR_MAX + 1);
+        break;
+    case BLE_HCI_OCF_LE_CREATE_CNXN_CANCEL:
+        if (len == 0) {
+            rc = ble_ll_conn_create_cancel();
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_DATA_LEN:
+        if (len == BLE_HCI_SET_DATALEN_LEN) {
+            rc = ble_ll_conn_hci_set_data_len(cmdbuf, rspbuf);
+            *rsplen = 2;
+        }
+        break;
+    case BLE_HCI_OCF_LE_RD_SUGG_DEF_DATA_LEN:
+        if (len == 0) {
+            rc = ble_ll_hci_rd_sugg_def_data_len(rspbuf);
+            *rsplen = 4;
+        }
+        break;
+    case BLE_HCI_OCF_LE_WR_SUGG_DEF_DATA_LEN:
+        if (len == BLE_HCI_WR_SUGG_DATALEN_LEN) {
+            rc = ble_ll_hci_wr_sugg_def_data_len(cmdbuf);
+        }
+        break;
+    case BLE_HCI_OCF_LE_RD_MAX_DATA_LEN:
+        if (len == 0) {
+            rc = ble_ll_hci_rd_max_data_len(rspbuf);
+            *rsplen = 8;
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_ADV_SET_RAND_ADDR:
+        if (len == BLE_HCI_SET_ADV_SET_RAND_ADDR_LEN) {
+            rc = ble_ll_adv_ext_set_rand_addr(cmdbuf);
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_EXT_ADV_PARAMS:
+        if (len == BLE_HCI_SET_EXT_ADV_PARAM_LEN) {
+            rc = ble_ll_adv_ext_set_params(cmdbuf, rspbuf);
+            *rsplen = 1;
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_EXT_ADV_DATA:
+        if (len >= BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN) {
+            rc = ble_ll_adv_ext_set_data(cmdbuf, len);
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_EXT_SCAN_RSP_DATA:
+        if (len >= BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN) {
+            rc = ble_ll_adv_ext_set_scan_rsp_data(cmdbuf, len);
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_EXT_ADV_ENABLE:
+        if (len >= BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN) {
+            rc = ble_ll_adv_ext_set_enable(cmdbuf, len);
+        }
+        break;
+    case BLE_HCI_OCF_LE_RD_MAX_ADV_DATA_LEN:
+        if (len == 0) {
+            rc = ble_ll_adv_ext_rd_max_data_len(rspbuf);
+            *rsplen = 2;
+        }
+        break;
+    case BLE_HCI_OCF_LE_RD_NUM_ADV_SETS:
+        if (len == 0) {
+            rc = ble_ll_adv_ext_rd_num_sets(rspbuf);
+            *rsplen = 1;
+        }
+        break;
+    case BLE_HCI_OCF_LE_REMOVE_ADV_SET:
+        if (len == 1) {
+            rc = ble_ll_adv_ext_remove_set(cmdbuf);
+        }
+        break;
+    case BLE_HCI_OCF_LE_CLEAR_ADV_SETS:
+        if (len == 0) {
+            rc = ble_ll_adv_ext_clear_sets();
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_PER_ADV_PARAMS:
+        if (len == BLE_HCI_SET_PER_ADV_PARAM_LEN) {
+            rc = ble_ll_adv_per_set_params(cmdbuf);
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_PER_ADV_DATA:
+        if (len >= BLE_HCI_SET_PER_ADV_DATA_HDR_LEN) {
+            rc = ble_ll_adv_per_set_data(cmdbuf, len);
+        }
+        break;
+    case BLE_HCI_OCF_LE_SET_PER_ADV_ENABLE:
+        if (len == BLE_HCI_SET_PER_ADV_ENABLE_LEN) {
+            rc = ble_ll_adv_per_set_enable(cmdbuf);
+        }
+        break;
     default:
-        /* XXX: deal with unsupported command */
+        rc = BLE_ERR_UNKNOWN_HCI_CMD;
         break;
     }
 
     return rc;
 }
 
-void
-ble_ll_hci_cmd_proc(struct os_event *ev)
+/**
+ * Process a link control command sent from the host to the controller.
+ * 
+ * @param cmdbuf Pointer to command buffer. Points to start of command header.
+ * @param ocf 
+ * 
+ * @return int 
+ */
+static int
+ble_ll_hci_link_ctrl_cmd_proc(uint8_t *cmdbuf, uint16_t ocf)
+{
+    int rc;
+    uint8_t len;
+
+    /* Assume error; if all pass rc gets set to 0 */
+    rc = BLE_ERR_INV_HCI_CMD_PARMS;
+
+    /* Get length from command */
+    len = cmdbuf[sizeof(uint16_t)];
+
+    /* Move past HCI command header */
+    cmdbuf += BLE_HCI_CMD_HDR_LEN;
+
+    switch (ocf) {
+    case BLE_HCI_OCF_DISCONNECT_CMD:
+        if (len == BLE_HCI_DISCONNECT_CMD_LEN) {
+            rc = ble_ll_conn_hci_disconnect_cmd(cmdbuf);
+        }
+        /* This command gets a command status, not a command complete */
+        rc += (BLE_ERR_MAX + 1);
+        break;
+    default:
+        rc = BLE_ERR_UNKNOWN_HCI_CMD;
+        break;
+    }
+
+    return rc;
+}
+
+/**
+ * Process a controller and baseband command sent from the host to the
+ * controller.
+ * 
+ * @param cmdbuf Pointer to command buffer. Points to start of command header.
+ * @param ocf 
+ * 
+ * @return int 
+ */
+static int
+ble_ll_hci_ctlr_bb_cmd_proc(uint8_t *cmdbuf, uint16_t ocf)
+{
+    int rc;
+    uint8_t len;
+
+    /* Assume error; if all pass rc gets set to 0 */
+    rc = BLE_ERR_INV_HCI_CMD_PARMS;
+
+    /* Get length from command */
+    len = cmdbuf[sizeof(uint16_t)];
+
+    /* Move past HCI command header */
+    cmdbuf += BLE_HCI_CMD_HDR_LEN;
+
+    switch (ocf) {
+    case BLE_HCI_OCF_CB_SET_EVENT_MASK:
+        if (len == BLE_HCI_SET_EVENT_MASK_LEN) {
+            memcpy(g_ble_ll_hci_event_mask, cmdbuf, BLE_HCI_SET_EVENT_MASK_LEN);
+            rc = BLE_ERR_SUCCESS;
+        }
+        break;
+    case BLE_HCI_OCF_CB_RESET:
+        if (len == 0) {
+            rc = ll_reset();
+        }
+        break;
+    default:
+        rc = BLE_ERR_UNKNOWN_HCI_CMD;
+        break;
+    }
+
+    return rc;
+}
+
+/**
+ * ll hci rd local ver 
+ *  
+ * Process the read local version information command. 
+ * 
+ * @param rspbuf 
+ * 
+ * @return int BLE_ERR_SUCCESS
+ */
+static int
+ble_ll_hci_rd_local_version(uint8_t *rspbuf)
+{
+    rspbuf[0] = BLE_HCI_VER_BCS_5_0;
+    htole16(rspbuf + 1, BLE_LL_HCI_REVISION);
+    rspbuf[3] = BLE_LMP_VER_BCS_5_0;
+    htole16(rspbuf + 4, BLE_LL_MFRG_ID);
+    htole16(rspbuf + 6, BLE_LL_SUB_VERS_NR);
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * ll hci rd local supp feat 
+ *  
+ * Process the read local supported features command. These are the LMP
+ * features: all we say is that this is an LE only controller. 
+ * 
+ * @param rspbuf 
+ * 
+ * @return int BLE_ERR_SUCCESS
+ */
+static int
+ble_ll_hci_rd_local_supp_feat(uint8_t *rspbuf)
+{
+    memset(rspbuf, 0, BLE_HCI_RD_LOC_SUPP_FEAT_RSPLEN);
+    rspbuf[4] = BLE_LL_LMP_FEAT_BYTE4;
+    return BLE_ERR_SUCCESS;
+}
+
+/**
+ * Process an informational parameters command sent from the host to the
+ * controller.
+ * 
+ * @param cmdbuf Pointer to command buffer. Points to start of command header.
+ * @param ocf 
+ * @param rsplen 
+ * 
+ * @return int 
+ */
+static int
+ble_ll_hci_info_params_cmd_proc(uint8_t *cmdbuf, uint16_t ocf, uint8_t *rsplen)
+{
+    int rc;
+    uint8_t len;
+    uint8_t *rspbuf;
+
+    /* Assume error; if all pass rc gets set to 0 */
+    rc = BLE_ERR_INV_HCI_CMD_PARMS;
+
+    /* Get length from command */
+    len = cmdbuf[sizeof(uint16_t)];
+
+    /* The response is built in place (see ble_ll_hci_le_cmd_proc) */
+    rspbuf = cmdbuf + BLE_HCI_EVENT_CMD_COMPLETE_HDR_LEN;
+
+    switch (ocf) {
+    case BLE_HCI_OCF_IP_RD_LOCAL_VER:
+        if (len == 0) {
+            rc = ble_ll_hci_rd_local_version(rspbuf);
+            *rsplen = BLE_HCI_RD_LOC_VER_INFO_RSPLEN;
+        }
+        break;
+    case BLE_HCI_OCF_IP_RD_LOC_SUPP_CMD:
+        if (len == 0) {
+            memcpy(rspbuf, g_ble_ll_supp_cmds, BLE_HCI_RD_LOC_SUPP_CMD_RSPLEN);
+            *rsplen = BLE_HCI_RD_LOC_SUPP_CMD_RSPLEN;
+            rc = BLE_ERR_SUCCESS;
+        }
+        break;
+    case BLE_HCI_OCF_IP_RD_LOC_SUPP_FEAT:
+        if (len == 0) {
+            rc = ble_ll_hci_rd_local_supp_feat(rspbuf);
+            *rsplen = BLE_HCI_RD_LOC_SUPP_FEAT_RSPLEN;
+        }
+        break;
+    case BLE_HCI_OCF_IP_RD_BD_ADDR:
+        if (len == 0) {
+            memcpy(rspbuf, g_dev_addr, BLE_DEV_ADDR_LEN);
+            *rsplen = BLE_HCI_RD_BD_ADDR_RSPLEN;
+            rc = BLE_ERR_SUCCESS;
+        }
+        break;
+    default:
+        rc = BLE_ERR_UNKNOWN_HCI_CMD;
+        break;
+    }
+
+    return rc;
+}
+
+/**
+ * Process one HCI command. The command complete (or command status) event is
+ * built in the command's mbuf and sent to the host. Commands answered with a
+ * command status return their status plus (BLE_ERR_MAX + 1).
+ * 
+ * @param om Packet header mbuf holding the command.
+ */
+static void
+ble_ll_hci_cmd_proc_one(struct os_mbuf *om)
 {
     int rc;
     uint8_t ogf;
     uint8_t rsplen;
+    uint8_t status;
     uint8_t *cmdbuf;
     uint16_t opcode;
     uint16_t ocf;
-    os_error_t err;
-
-    /* The command buffer is the event argument */
-    cmdbuf = (uint8_t *)ev->ev_arg;
-    assert(cmdbuf != NULL);
-
-    /* Free the event */
-    err = os_memblock_put(&g_hci_os_event_pool, ev);
-    assert(err == OS_OK);
 
     /* Get the opcode from the command buffer */
+    cmdbuf = om->om_data;
     opcode = le16toh(cmdbuf);
     ocf = BLE_HCI_OCF(opcode);
     ogf = BLE_HCI_OGF(opcode);
@@ -254,13 +768,25 @@ ble_ll_hci_cmd_proc(struct os_event *ev)
     /* Assume response length is zero */
     rsplen = 0;
 
+    /* The parameters must be in the packet header mbuf */
+    if ((om->om_len < BLE_HCI_CMD_HDR_LEN) || 
+        (om->om_len != (BLE_HCI_CMD_HDR_LEN + cmdbuf[2]))) {
+        rc = BLE_ERR_INV_HCI_CMD_PARMS;
+        goto done;
+    }
+
     switch (ogf) {
+    case BLE_HCI_OGF_LINK_CTRL:
+        rc = ble_ll_hci_link_ctrl_cmd_proc(cmdbuf, ocf);
+        break;
     case BLE_HCI_OGF_LE:
         rc = ble_ll_hci_le_cmd_proc(cmdbuf, ocf, &rsplen);
         break;
     case BLE_HCI_OGF_CTLR_BASEBAND:
-        /* XXX: Implement  */
-        rc = BLE_ERR_UNKNOWN_HCI_CMD;
+        rc = ble_ll_hci_ctlr_bb_cmd_proc(cmdbuf, ocf);
+        break;
+    case BLE_HCI_OGF_INFO_PARAMS:
+        rc = ble_ll_hci_info_params_cmd_proc(cmdbuf, ocf, &rsplen);
         break;
     default:
         /* XXX: Need to support other OGF. For now, return unsupported */
@@ -268,65 +794,118 @@ ble_ll_hci_cmd_proc(struct os_event *ev)
         break;
     }
 
+done:
     /* Make sure valid error code */
     assert(rc >= 0);
-    if (rc) {
+    status = rc;
+    if (rc > BLE_ERR_MAX) {
+        status = rc - (BLE_ERR_MAX + 1);
+    }
+    if (status) {
         ++g_ll_stats.hci_cmd_errs;
     } else {
         ++g_ll_stats.hci_cmds;
     }
 
-    /* If no response is generated, we free the buffers */
     if (rc <= BLE_ERR_MAX) {
         /* Create a command complete event with status from command */
         cmdbuf[0] = BLE_HCI_EVCODE_COMMAND_COMPLETE;
         cmdbuf[1] = 4 + rsplen;    /* Length of the data */
         cmdbuf[2] = ble_ll_hci_get_num_cmd_pkts();
         htole16(cmdbuf + 3, opcode);
-        cmdbuf[5] = (uint8_t)rc;
-
-        /* Send the event. This event cannot be masked */
-        ble_ll_hci_event_send(cmdbuf);
+        cmdbuf[5] = status;
     } else {
-        /* XXX: placeholder for sending command status or other events */
-        assert(0);
+        /* Create a command status event */
+        cmdbuf[0] = BLE_HCI_EVCODE_COMMAND_STATE;
+        cmdbuf[1] = 4;
+        cmdbuf[2] = status;
+        cmdbuf[3] = ble_ll_hci_get_num_cmd_pkts();
+        htole16(cmdbuf + 4, opcode);
     }
+
+    /* Send the event. These events cannot be masked */
+    ble_ll_hci_event_send(om);
 }
 
-/* XXX: For now, put this here */
-int
-ble_hci_transport_host_cmd_send(uint8_t *cmd)
+/**
+ * Process the HCI commands received from the host.
+ * 
+ * Context: Link Layer task.
+ * 
+ * @param ev The command queue event.
+ */
+void
+ble_ll_hci_cmd_proc(struct os_event *ev)
 {
-    os_error_t err;
-    struct os_event *ev;
-
-    /* Get an event structure off the queue */
-    ev = (struct os_event *)os_memblock_get(&g_hci_os_event_pool);
-    if (!ev) {
-        err = os_memblock_put(&g_hci_cmd_pool, cmd);
-        assert(err == OS_OK);
-        return -1;
-    }
+    struct os_mbuf *om;
 
-    /* Fill out the event and post to Link Layer */
-    ev->ev_queued = 0;
-    ev->ev_type = BLE_LL_EVENT_HCI_CMD;
-    ev->ev_arg = cmd;
-    os_eventq_put(&g_ll_data.ll_evq, ev);
-
-    return 0;
+    while ((om = ble_ll_hci_pktq_get(&g_ble_ll_hci_cmd_q)) != NULL) {
+        ble_ll_hci_cmd_proc_one(om);
+    }
 }
 
 /**
- * Initalize the LL HCI.
+ * Process the ACL data packets received from the host.
+ * 
+ * Context: Link Layer task.
+ * 
+ * @param ev The ACL data queue event.
  */
 void
-ble_ll_hci_init(void)
+ble_ll_hci_acl_proc(struct os_event *ev)
+{
+    int rc;
+    uint16_t handle;
+    struct os_mbuf *om;
+
+    while ((om = ble_ll_hci_pktq_get(&g_ble_ll_hci_acl_q)) != NULL) {
+        /* Header must be in the first mbuf and match the packet length */
+        if ((om->om_len < BLE_HCI_DATA_HDR_LEN) ||
+            (OS_MBUF_PKTHDR(om)->omp_len != 
+             (BLE_HCI_DATA_HDR_LEN + le16toh(om->om_data + 2)))) {
+            ++g_ll_stats.hci_acl_errs;
+            os_mbuf_free_chain(&g_mbuf_pool, om);
+            continue;
+        }
+        ++g_ll_stats.hci_acl_pkts;
+        handle = le16toh(om->om_data);
+
+        /* 
+         * Hand the data to the connection. If it cannot be sent the packet
+         * is dropped; the host still gets its buffer back.
+         */
+        rc = ble_ll_conn_tx_pkt_in(om, handle, le16toh(om->om_data + 2));
+        if (rc) {
+            os_mbuf_free_chain(&g_mbuf_pool, om);
+            ble_ll_hci_num_comp_pkts_send(BLE_HCI_DATA_HANDLE(handle), 1);
+        }
+    }
+}
+
+/* XXX: For now, put this here */
+int
+ble_hci_transport_host_cmd_send(struct os_mbuf *om)
+{
+    ble_ll_hci_pktq_put(&g_ble_ll_hci_cmd_q, om);
+    return 0;
+}
+
+int
+ble_hci_transport_host_acl_data_send(struct os_mbuf *om)
+{
+    ble_ll_hci_pktq_put(&g_ble_ll_hci_acl_q, om);
+    return 0;
+}
+
+static void
+ble_ll_hci_set_default_event_masks(void)
 {
     /* Set defaults for LE events: Vol 2 Part E 7.8.1 */
+    memset(g_ble_ll_hci_le_event_mask, 0, BLE_HCI_SET_LE_EVENT_MASK_LEN);
     g_ble_ll_hci_le_event_mask[0] = 0x1f;
 
     /* Set defaults for controller/baseband events: Vol 2 Part E 7.3.1 */
+    memset(g_ble_ll_hci_event_mask, 0, BLE_HCI_SET_EVENT_MASK_LEN);
     g_ble_ll_hci_event_mask[0] = 0xff;
     g_ble_ll_hci_event_mask[1] = 0xff;
     g_ble_ll_hci_event_mask[2] = 0xff;
@@ -334,3 +913,37 @@ ble_ll_hci_init(void)
     g_ble_ll_hci_event_mask[4] = 0xff;
     g_ble_ll_hci_event_mask[5] = 0x1f;
 }
+
+/**
+ * Restore the event masks and drop the ACL data packets from the host not
+ * processed yet (HCI reset). The host gets no completed packets for them.
+ * 
+ * Context: Link Layer task (HCI command parser)
+ */
+void
+ble_ll_hci_reset(void)
+{
+    struct os_mbuf *om;
+
+    while ((om = ble_ll_hci_pktq_get(&g_ble_ll_hci_acl_q)) != NULL) {
+        os_mbuf_free_chain(&g_mbuf_pool, om);
+    }
+    os_eventq_remove(&g_ll_data.ll_evq, &g_ble_ll_hci_acl_q.ev);
+
+    ble_ll_hci_set_default_event_masks();
+}
+
+/**
+ * Initalize the LL HCI.
+ */
+void
+ble_ll_hci_init(void)
+{
+    /* Initialize the queues of packets from the host */
+    STAILQ_INIT(&g_ble_ll_hci_cmd_q.pkts);
+    g_ble_ll_hci_cmd_q.ev.ev_type = BLE_LL_EVENT_HCI_CMD;
+    STAILQ_INIT(&g_ble_ll_hci_acl_q.pkts);
+    g_ble_ll_hci_acl_q.ev.ev_type = BLE_LL_EVENT_HCI_ACL;
+
+    ble_ll_hci_set_default_event_masks();
+}
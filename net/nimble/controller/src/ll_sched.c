@@ -25,21 +25,154 @@
 /* XXX: this is temporary. Not sure what I want to do here */
 struct cpu_timer g_ll_sched_timer;
 
-/* XXX: TODO:
- *  1) Add a "priority" scheme possibly. This would allow items to be
- *  added if they overlapped.
- *  2) Add some accounting to the schedule code to see how late we are
- *  (min/max?)
- */
-#define BLE_LL_CFG_SCHED_ITEMS      (8)
 #define BLE_LL_SCHED_POOL_SIZE      \
     OS_MEMPOOL_SIZE(BLE_LL_CFG_SCHED_ITEMS, sizeof(struct ll_sched_item))
 
 struct os_mempool g_ll_sched_pool;
 os_membuf_t g_ll_sched_mem[BLE_LL_SCHED_POOL_SIZE];
 
-/* Queue for timers */
-TAILQ_HEAD(ll_sched_qhead, ll_sched_item) g_ll_sched_q;
+/* States of a schedule item */
+#define BLE_LL_SCHED_ITEM_IDLE      (0)
+#define BLE_LL_SCHED_ITEM_QUEUED    (1)
+#define BLE_LL_SCHED_ITEM_RUNNING   (2)
+
+/* 
+ * Items waiting to start are kept in a binary min-heap ordered by start time.
+ * The item that has started and is not done yet is kept apart.
+ */
+struct ll_sched_item *g_ll_sched_heap[BLE_LL_CFG_SCHED_ITEMS];
+uint16_t g_ll_sched_heap_cnt;
+struct ll_sched_item *g_ll_sched_cur;
+
+/* Statistics */
+struct ll_sched_stats g_ll_sched_stats[BLE_LL_SCHED_TYPE_MAX];
+
+/* Returns true if schedule item a starts before item b */
+#define LL_SCHED_BEFORE(a, b)   \
+    ((int32_t)((a)->start_time - (b)->start_time) < 0)
+
+static void
+ll_sched_heap_set(uint16_t idx, struct ll_sched_item *sch)
+{
+    g_ll_sched_heap[idx] = sch;
+    sch->heap_idx = idx;
+}
+
+/* Move the item at idx towards the root until its parent starts first */
+static void
+ll_sched_heap_up(uint16_t idx)
+{
+    uint16_t parent;
+    struct ll_sched_item *sch;
+
+    sch = g_ll_sched_heap[idx];
+    while (idx) {
+        parent = (idx - 1) / 2;
+        if (!LL_SCHED_BEFORE(sch, g_ll_sched_heap[parent])) {
+            break;
+        }
+        ll_sched_heap_set(idx, g_ll_sched_heap[parent]);
+        idx = parent;
+    }
+    ll_sched_heap_set(idx, sch);
+}
+
+/* Move the item at idx away from the root until it starts before both children */
+static void
+ll_sched_heap_down(uint16_t idx)
+{
+    uint16_t child;
+    struct ll_sched_item *sch;
+
+    sch = g_ll_sched_heap[idx];
+    while (1) {
+        child = (2 * idx) + 1;
+        if (child >= g_ll_sched_heap_cnt) {
+            break;
+        }
+        if (((child + 1) < g_ll_sched_heap_cnt) &&
+            LL_SCHED_BEFORE(g_ll_sched_heap[child + 1], 
+                            g_ll_sched_heap[child])) {
+            ++child;
+        }
+        if (!LL_SCHED_BEFORE(g_ll_sched_heap[child], sch)) {
+            break;
+        }
+        ll_sched_heap_set(idx, g_ll_sched_heap[child]);
+        idx = child;
+    }
+    ll_sched_heap_set(idx, sch);
+}
+
+static void
+ll_sched_heap_insert(struct ll_sched_item *sch)
+{
+    /* Cannot have more items queued than there are in the pool */
+    assert(g_ll_sched_heap_cnt < BLE_LL_CFG_SCHED_ITEMS);
+
+    sch->sched_state = BLE_LL_SCHED_ITEM_QUEUED;
+    ll_sched_heap_set(g_ll_sched_heap_cnt, sch);
+    ++g_ll_sched_heap_cnt;
+    ll_sched_heap_up(sch->heap_idx);
+}
+
+static void
+ll_sched_heap_remove(struct ll_sched_item *sch)
+{
+    uint16_t idx;
+    struct ll_sched_item *last;
+
+    idx = sch->heap_idx;
+    assert(g_ll_sched_heap[idx] == sch);
+
+    sch->sched_state = BLE_LL_SCHED_ITEM_IDLE;
+    --g_ll_sched_heap_cnt;
+    if (idx != g_ll_sched_heap_cnt) {
+        /* Put the last item in its place and restore the heap */
+        last = g_ll_sched_heap[g_ll_sched_heap_cnt];
+        ll_sched_heap_set(idx, last);
+        if (idx && LL_SCHED_BEFORE(last, g_ll_sched_heap[(idx - 1) / 2])) {
+            ll_sched_heap_up(idx);
+        } else {
+            ll_sched_heap_down(idx);
+        }
+    }
+}
+
+/**
+ * Set the scheduler timer to the next time something needs doing: the
+ * next wakeup of the running item or the start of the first queued item,
+ * whichever is first.
+ * 
+ * Context: interrupts disabled.
+ */
+static void
+ll_sched_timer_set(void)
+{
+    int have_time;
+    uint32_t next;
+    struct ll_sched_item *sch;
+
+    have_time = 0;
+    next = 0;
+    if (g_ll_sched_cur) {
+        next = g_ll_sched_cur->next_wakeup;
+        have_time = 1;
+    }
+    if (g_ll_sched_heap_cnt) {
+        sch = g_ll_sched_heap[0];
+        if (!have_time || ((int32_t)(sch->start_time - next) < 0)) {
+            next = sch->start_time;
+            have_time = 1;
+        }
+    }
+
+    if (have_time) {
+        cputime_timer_start(&g_ll_sched_timer, next);
+    } else {
+        cputime_timer_stop(&g_ll_sched_timer);
+    }
+}
 
 /**
  * ll sched execute
@@ -82,48 +215,106 @@ ll_sched_free_item(struct ll_sched_item *sch)
     assert(err == OS_OK);
 }
 
-/* Schedule a LL event */
+/**
+ * Schedule a LL event. Items may overlap; conflicts are resolved by
+ * priority when an item is due (see ll_sched_run()).
+ * 
+ * @param sch Pointer to schedule item
+ * 
+ * @return int 0: success.
+ */
 int
 ll_sched_add(struct ll_sched_item *sch)
 {
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    ll_sched_heap_insert(sch);
+    ll_sched_timer_set();
+    OS_EXIT_CRITICAL(sr);
+
+    return 0;
+}
+
+/**
+ * Remove one item (queued or running) from the schedule and free it.
+ * 
+ * @param sch Pointer to schedule item
+ */
+void
+ll_sched_rmv_item(struct ll_sched_item *sch)
+{
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    if (sch == g_ll_sched_cur) {
+        g_ll_sched_cur = NULL;
+    } else if (sch->sched_state == BLE_LL_SCHED_ITEM_QUEUED) {
+        ll_sched_heap_remove(sch);
+    }
+    ll_sched_free_item(sch);
+    ll_sched_timer_set();
+    OS_EXIT_CRITICAL(sr);
+}
+
+/**
+ * Change the time at which the running item's callback is called next. Used
+ * by items that run until something happens (e.g. a connection event that
+ * lasts as long as data is exchanged).
+ * 
+ * Context: Interrupt 
+ * 
+ * @param sch Pointer to the running schedule item
+ * @param next_wakeup cputime at which to call the item's callback
+ */
+void
+ll_sched_wakeup(struct ll_sched_item *sch, uint32_t next_wakeup)
+{
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    sch->next_wakeup = next_wakeup;
+    if (sch == g_ll_sched_cur) {
+        ll_sched_timer_set();
+    }
+    OS_EXIT_CRITICAL(sr);
+}
+
+/**
+ * Get the start time of the first queued item with the given priority or
+ * higher. Items of lower priority do not matter to the running item: they
+ * wait for it or preempt nothing. Used by items that decide how long they
+ * can keep running without delaying an item that cannot wait.
+ * 
+ * Context: Interrupt 
+ * 
+ * @param sched_prio The lowest priority of interest
+ * @param start_time Set to the start time of the item, if any.
+ * 
+ * @return int 0: item found; -1 otherwise.
+ */
+int
+ll_sched_next_start(uint8_t sched_prio, uint32_t *start_time)
+{
+    int i;
     int rc;
     os_sr_t sr;
     struct ll_sched_item *entry;
 
-    /* Determine if we are able to add this to the schedule */
+    rc = -1;
     OS_ENTER_CRITICAL(sr);
-
-    rc = 0;
-    if (TAILQ_EMPTY(&g_ll_sched_q)) {
-        TAILQ_INSERT_HEAD(&g_ll_sched_q, sch, link);
-    } else {
-        cputime_timer_stop(&g_ll_sched_timer);
-        TAILQ_FOREACH(entry, &g_ll_sched_q, link) {
-            if ((int32_t)(sch->start_time - entry->start_time) < 0) {
-                /* Make sure this event does not overlap current event */
-                if ((int32_t)(sch->end_time - entry->start_time) < 0) {
-                    TAILQ_INSERT_BEFORE(entry, sch, link);   
-                } else {
-                    rc = BLE_LL_SCHED_ERR_OVERLAP;
-                }
-                break;
-            } else {
-                /* Check for overlap */
-                if ((int32_t)(sch->start_time - entry->end_time) < 0) {
-                    rc = BLE_LL_SCHED_ERR_OVERLAP;
-                    break;
-                }
-            }
+    for (i = 0; i < g_ll_sched_heap_cnt; ++i) {
+        entry = g_ll_sched_heap[i];
+        if (entry->sched_prio < sched_prio) {
+            continue;
         }
-        if (!entry) {
-            TAILQ_INSERT_TAIL(&g_ll_sched_q, sch, link);
+        if (rc || ((int32_t)(entry->start_time - *start_time) < 0)) {
+            *start_time = entry->start_time;
+            rc = 0;
         }
     }
-
     OS_EXIT_CRITICAL(sr);
 
-    cputime_timer_start(&g_ll_sched_timer, sch->start_time);
-
     return rc;
 }
 
@@ -131,70 +322,171 @@ ll_sched_add(struct ll_sched_item *sch)
 int
 ll_sched_rmv(uint8_t sched_type)
 {
+    int i;
+    int cnt;
     os_sr_t sr;
     struct ll_sched_item *entry;
-    struct ll_sched_item *next;
 
     OS_ENTER_CRITICAL(sr);
 
-    entry = TAILQ_FIRST(&g_ll_sched_q);
-    if (entry) {
-        cputime_timer_stop(&g_ll_sched_timer);
-        while (entry) {
-            next = TAILQ_NEXT(entry, link);
-            if (entry->sched_type == sched_type) {
-                TAILQ_REMOVE(&g_ll_sched_q, entry, link);
-                os_memblock_put(&g_ll_sched_pool, entry);
-            } 
-            entry = next;
-        }
+    entry = g_ll_sched_cur;
+    if (entry && (entry->sched_type == sched_type)) {
+        g_ll_sched_cur = NULL;
+        ll_sched_free_item(entry);
+    }
 
-        /* Start the timer if there is an item */
-        entry = TAILQ_FIRST(&g_ll_sched_q);
-        if (entry) {
-            cputime_timer_start(&g_ll_sched_timer, entry->start_time);
+    /* Keep the other items and rebuild the heap from them */
+    cnt = 0;
+    for (i = 0; i < g_ll_sched_heap_cnt; ++i) {
+        entry = g_ll_sched_heap[i];
+        if (entry->sched_type == sched_type) {
+            ll_sched_free_item(entry);
+        } else {
+            ll_sched_heap_set(cnt, entry);
+            ++cnt;
         }
     }
+    if (cnt != g_ll_sched_heap_cnt) {
+        g_ll_sched_heap_cnt = cnt;
+        for (i = (cnt / 2) - 1; i >= 0; --i) {
+            ll_sched_heap_down(i);
+        }
+    }
+
+    ll_sched_timer_set();
 
     OS_EXIT_CRITICAL(sr);
 
     return 0;
 }
 
+/**
+ * Check if a due item takes the radio from the running item. Between items
+ * of the same priority, the one whose owner lost more conflicts in a row
+ * wins, so that the same item does not lose every time two items overlap.
+ * 
+ * @param sch The due item
+ * @param cur The running item
+ * 
+ * @return int 1 if the running item is to be preempted; 0 otherwise.
+ */
+static int
+ll_sched_preempts(struct ll_sched_item *sch, struct ll_sched_item *cur)
+{
+    if (!cur->preempt_cb) {
+        return 0;
+    }
+    if (sch->sched_prio != cur->sched_prio) {
+        return sch->sched_prio > cur->sched_prio;
+    }
+    return sch->sched_losses > cur->sched_losses;
+}
+
+/**
+ * Start a schedule item that is due.
+ * 
+ * Context: interrupt (scheduler) 
+ * 
+ * @param sch Pointer to schedule item
+ * @param now The current cputime
+ */
+static void
+ll_sched_start(struct ll_sched_item *sch, uint32_t now)
+{
+    int rc;
+    uint32_t late;
+    struct ll_sched_stats *stats;
+
+    stats = &g_ll_sched_stats[sch->sched_type];
+    ++stats->runs;
+    late = cputime_ticks_to_usecs(now - sch->start_time);
+    stats->late_usecs_total += late;
+    if (late > stats->late_usecs_max) {
+        stats->late_usecs_max = late;
+    }
+
+    sch->sched_state = BLE_LL_SCHED_ITEM_RUNNING;
+    g_ll_sched_cur = sch;
+    rc = ll_sched_execute(sch);
+    if (rc && (g_ll_sched_cur == sch)) {
+        g_ll_sched_cur = NULL;
+        ll_sched_free_item(sch);
+    }
+}
+
 /**
  * ll sched run 
  *  
- * Run the BLE scheduler. Iterate through all items on the schedule queue.
+ * Run the BLE scheduler. Calls the running item when its next wakeup time
+ * has passed and starts items that are due.
+ *  
+ * An item that is due while another item is running starts only if it has
+ * a higher priority, or the same priority and more losses; the running item
+ * is then preempted. Otherwise, the due item waits until the running item's
+ * next wakeup time.
  *  
  * Context: interrupt (scheduler) 
- * 
- * @return int 
  */
 void
 ll_sched_run(void *arg)
 {
     int rc;
+    uint32_t now;
+    uint32_t delay;
     struct ll_sched_item *sch;
+    struct ll_sched_item *cur;
+    struct ll_sched_stats *stats;
 
-    /* Look through schedule queue */
-    while ((sch = TAILQ_FIRST(&g_ll_sched_q)) != NULL) {
-        /* Make sure we have passed the start time of the first event */
-        if ((int32_t)(cputime_get32() - sch->start_time) >= 0) {
-            /* Execute the schedule item */
-            rc = ll_sched_execute(sch);
-            if (rc) {
-                TAILQ_REMOVE(&g_ll_sched_q, sch, link);
-                os_memblock_put(&g_ll_sched_pool, sch);
-            } else {
-                /* Event is not over; schedule next wakeup time */
-                cputime_timer_start(&g_ll_sched_timer, sch->next_wakeup);
-                break;
+    while (1) {
+        now = cputime_get32();
+
+        /* Call the running item if it wanted to be woken up */
+        cur = g_ll_sched_cur;
+        if (cur && ((int32_t)(now - cur->next_wakeup) >= 0)) {
+            rc = ll_sched_execute(cur);
+            if (rc && (g_ll_sched_cur == cur)) {
+                g_ll_sched_cur = NULL;
+                ll_sched_free_item(cur);
             }
-        } else {
-            cputime_timer_start(&g_ll_sched_timer, sch->start_time);
+            continue;
+        }
+
+        /* Is the first queued item due? */
+        if (!g_ll_sched_heap_cnt) {
             break;
         }
+        sch = g_ll_sched_heap[0];
+        if ((int32_t)(now - sch->start_time) < 0) {
+            break;
+        }
+        ll_sched_heap_remove(sch);
+
+        if (cur) {
+            if (ll_sched_preempts(sch, cur)) {
+                /* Stop the running item */
+                ++g_ll_sched_stats[cur->sched_type].preempted;
+                g_ll_sched_cur = NULL;
+                cur->preempt_cb(cur);
+                ll_sched_free_item(cur);
+            } else {
+                /* Wait for the running item */
+                stats = &g_ll_sched_stats[sch->sched_type];
+                ++stats->deferred;
+                delay = cur->next_wakeup - sch->start_time;
+                if (cputime_ticks_to_usecs(delay) > stats->deferred_usecs_max) {
+                    stats->deferred_usecs_max = cputime_ticks_to_usecs(delay);
+                }
+                sch->start_time += delay;
+                sch->end_time += delay;
+                ll_sched_heap_insert(sch);
+                continue;
+            }
+        }
+
+        ll_sched_start(sch, now);
     }
+
+    ll_sched_timer_set();
 }
 
 /**
@@ -215,6 +507,10 @@ ll_sched_init(void)
                           g_ll_sched_mem, "ll_sched");
     assert(err == OS_OK);
 
+    /* Nothing is queued or running */
+    g_ll_sched_heap_cnt = 0;
+    g_ll_sched_cur = NULL;
+
     /* Start cputimer for the scheduler */
     cputime_timer_init(&g_ll_sched_timer, ll_sched_run, NULL);
 
@@ -0,0 +1,953 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+#include "testutil/testutil.h"
+#include "os/os.h"
+#include "hal/hal_cputime.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "controller/ll.h"
+#include "controller/ll_adv.h"
+#include "controller/ll_adv_ext.h"
+#include "controller/ll_chan.h"
+#include "controller/phy_sim.h"
+#include "ll_test_priv.h"
+
+/*
+ * Extended and periodic advertising over the simulated PHY. The test plays
+ * a scanner that follows the advertising of one set, as a real one would:
+ * from the ADV_EXT_INDs to the AUX_ADV_IND and down the chain of
+ * AUX_CHAIN_INDs by their AuxPtrs, and from the SyncInfo to the periodic
+ * advertising train. Every PDU must be on the channel and within the window
+ * the PDU before it gave.
+ */
+
+/* Advertising data sent per HCI command */
+#define LL_ADV_EXT_TEST_FRAG_LEN    (200)
+
+/* Channel index of an AuxPtr */
+#define LL_ADV_EXT_TEST_AUX_CHAN_MASK   (0x3F)
+
+/* How late a periodic event may start (the LL's BLE_LL_ADV_PER_JITTER_USECS) */
+#define LL_ADV_EXT_TEST_PER_JITTER  (16)
+
+/* What the scanner waits for next */
+#define LL_ADV_EXT_TEST_WANT_NONE   (0)
+#define LL_ADV_EXT_TEST_WANT_AUX    (1)     /* AUX_ADV_IND or AUX_SYNC_IND */
+#define LL_ADV_EXT_TEST_WANT_CHAIN  (2)     /* AUX_CHAIN_IND */
+
+/* The fields of an extended advertising PDU */
+struct ll_adv_ext_test_pdu
+{
+    uint8_t *adva;
+    int sid;
+    int did;
+    uint8_t *aux_ptr;
+    uint8_t *sync_info;
+    uint8_t *data;
+    int data_len;
+};
+
+/* A chain of PDUs being received: the advertising data of one event */
+struct ll_adv_ext_test_chain
+{
+    int want;
+    uint8_t chan;
+    uint32_t t0;            /* The next PDU starts in [t0, t1) */
+    uint32_t t1;
+    uint32_t last_end;
+    int did;
+    uint8_t data[BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN];
+    int len;
+    int complete;           /* Chains received whole, with the right data */
+    int complete_old;       /* ... with the data before the last update */
+    int bad;                /* Chains received whole, with other data */
+    int errs;               /* PDUs not where or what they should be */
+};
+
+/* The scanner */
+struct ll_adv_ext_test_rx
+{
+    int sid;                /* The set followed */
+    struct ll_adv_ext_test_chain adv;
+    struct ll_adv_ext_test_chain per;
+
+    /* Periodic advertising train, once synchronized */
+    int synced;
+    int locked;             /* An AUX_SYNC_IND was received */
+    uint32_t per_aa;
+    uint32_t per_anchor;    /* Anchor of the next periodic event */
+    uint32_t per_itvl;
+    uint16_t per_cntr;
+    uint16_t per_chan_id;
+    struct ble_ll_chan_map per_chmap;
+    uint64_t per_chans;     /* Channels the train was heard on */
+    int sync_errs;          /* SyncInfo that did not match the train */
+
+    /* Air time of the advertising events of each set and of each train */
+    uint32_t air_usecs[BLE_LL_ADV_EXT_CFG_MAX_SETS];
+    uint32_t per_aas[BLE_LL_ADV_EXT_CFG_MAX_SETS];  /* Train of each set */
+    uint32_t train_aas[BLE_LL_ADV_EXT_CFG_MAX_SETS];
+    uint32_t train_air_usecs[BLE_LL_ADV_EXT_CFG_MAX_SETS];
+    uint32_t air_unknown;
+};
+
+static struct ll_adv_ext_test_rx ll_adv_ext_test_rx;
+
+/* Data of each set (set i uses SID i) */
+static uint8_t ll_adv_ext_test_data[BLE_LL_ADV_EXT_CFG_MAX_SETS]
+                                   [BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN];
+static int ll_adv_ext_test_data_len[BLE_LL_ADV_EXT_CFG_MAX_SETS];
+static uint8_t ll_adv_ext_test_old_data[BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN];
+static int ll_adv_ext_test_old_data_len;
+static uint8_t ll_adv_ext_test_per_data[BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN];
+static int ll_adv_ext_test_per_data_len;
+
+/**
+ * Finds the fields of an extended advertising PDU.
+ *
+ * @return int 0: success; -1 if the PDU is malformed.
+ */
+static int
+ll_adv_ext_test_parse(uint8_t *pdu, int len, struct ll_adv_ext_test_pdu *p)
+{
+    uint16_t adi;
+    uint8_t flags;
+    uint8_t *ext;
+    uint8_t *dptr;
+    int ext_len;
+
+    memset(p, 0, sizeof *p);
+    p->sid = -1;
+    p->did = -1;
+
+    if ((pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) != BLE_ADV_PDU_TYPE_ADV_EXT_IND ||
+        len != BLE_LL_PDU_HDR_LEN + pdu[1] || pdu[1] < 1) {
+        return -1;
+    }
+
+    ext = pdu + BLE_LL_PDU_HDR_LEN;
+    ext_len = ext[0] & BLE_ADV_EXT_HDR_LEN_MASK;
+    dptr = ext + 1;
+    flags = 0;
+    if (ext_len != 0) {
+        flags = *dptr++;
+    }
+    if (flags & BLE_ADV_EXT_FLAG_ADVA) {
+        p->adva = dptr;
+        dptr += BLE_DEV_ADDR_LEN;
+    }
+    if (flags & BLE_ADV_EXT_FLAG_TARGETA) {
+        dptr += BLE_DEV_ADDR_LEN;
+    }
+    if (flags & BLE_ADV_EXT_FLAG_ADI) {
+        adi = le16toh(dptr);
+        p->did = adi & BLE_ADV_EXT_ADI_DID_MASK;
+        p->sid = adi >> BLE_ADV_EXT_ADI_SID_SHIFT;
+        dptr += BLE_ADV_EXT_ADI_LEN;
+    }
+    if (flags & BLE_ADV_EXT_FLAG_AUX_PTR) {
+        p->aux_ptr = dptr;
+        dptr += BLE_ADV_EXT_AUX_PTR_LEN;
+    }
+    if (flags & BLE_ADV_EXT_FLAG_SYNC_INFO) {
+        p->sync_info = dptr;
+        dptr += BLE_ADV_EXT_SYNC_INFO_LEN;
+    }
+    if (flags & BLE_ADV_EXT_FLAG_TX_POWER) {
+        dptr += BLE_ADV_EXT_TX_POWER_LEN;
+    }
+
+    if (dptr > ext + 1 + ext_len || 1 + ext_len > pdu[1]) {
+        return -1;
+    }
+    p->data = ext + 1 + ext_len;
+    p->data_len = pdu[1] - 1 - ext_len;
+
+    return 0;
+}
+
+/* Sets up the chain to wait for the PDU an AuxPtr points to */
+static void
+ll_adv_ext_test_aux_ptr(struct ll_adv_ext_test_chain *chain, uint8_t *aux_ptr,
+                        uint32_t start, uint32_t end)
+{
+    uint32_t unit;
+    uint32_t offset;
+
+    if (aux_ptr[0] & BLE_ADV_EXT_AUX_PTR_UNITS_300) {
+        unit = BLE_ADV_EXT_OFFSET_LARGE_UNIT_USECS;
+    } else {
+        unit = BLE_ADV_EXT_OFFSET_UNIT_USECS;
+    }
+    offset = (le16toh(aux_ptr + 1) & BLE_ADV_EXT_OFFSET_MAX) * unit;
+
+    chain->want = LL_ADV_EXT_TEST_WANT_CHAIN;
+    chain->chan = aux_ptr[0] & LL_ADV_EXT_TEST_AUX_CHAN_MASK;
+    chain->t0 = start + cputime_usecs_to_ticks(offset);
+    chain->t1 = chain->t0 + cputime_usecs_to_ticks(unit);
+    chain->last_end = end;
+}
+
+/**
+ * Checks that a PDU on a secondary channel is where the chain expects it:
+ * on its channel, in its window and far enough from the PDU before it.
+ */
+static void
+ll_adv_ext_test_chain_check(struct ll_adv_ext_test_chain *chain, uint8_t chan,
+                            uint32_t start)
+{
+    if (chan != chain->chan ||
+        (int32_t)(start - chain->t0) < 0 ||
+        (int32_t)(start - chain->t1) >= 0 ||
+        (int32_t)(start - chain->last_end) <
+            (int32_t)cputime_usecs_to_ticks(BLE_LL_MAFS_USECS)) {
+        chain->errs++;
+    }
+}
+
+/* Adds the data of a PDU; completes the chain if it ends here */
+static void
+ll_adv_ext_test_chain_rx(struct ll_adv_ext_test_chain *chain,
+                         struct ll_adv_ext_test_pdu *p, uint32_t start,
+                         uint32_t end, const uint8_t *exp, int exp_len)
+{
+    if (chain->len + p->data_len > sizeof chain->data) {
+        chain->errs++;
+        chain->want = LL_ADV_EXT_TEST_WANT_NONE;
+        return;
+    }
+    memcpy(chain->data + chain->len, p->data, p->data_len);
+    chain->len += p->data_len;
+
+    if (p->aux_ptr != NULL) {
+        ll_adv_ext_test_aux_ptr(chain, p->aux_ptr, start, end);
+        return;
+    }
+
+    if (chain->len == exp_len && memcmp(chain->data, exp, exp_len) == 0) {
+        chain->complete++;
+    } else if (exp != ll_adv_ext_test_per_data &&
+               chain->len == ll_adv_ext_test_old_data_len &&
+               memcmp(chain->data, ll_adv_ext_test_old_data,
+                      chain->len) == 0) {
+        chain->complete_old++;
+    } else {
+        chain->bad++;
+    }
+    chain->want = LL_ADV_EXT_TEST_WANT_NONE;
+}
+
+/**
+ * Synchronizes to the periodic advertising train from a SyncInfo or, once
+ * synchronized, checks that the SyncInfo points to the next event of the
+ * train.
+ */
+static void
+ll_adv_ext_test_sync_info(uint8_t *sync_info, uint32_t start)
+{
+    struct ll_adv_ext_test_rx *rx;
+    uint8_t chmap[BLE_LL_CHAN_MAP_LEN];
+    uint32_t anchor;
+    uint32_t unit;
+    uint32_t t0;
+    uint16_t offset;
+    uint16_t cntr;
+
+    rx = &ll_adv_ext_test_rx;
+    offset = le16toh(sync_info);
+    if (offset & BLE_ADV_EXT_SYNC_UNITS_300) {
+        unit = BLE_ADV_EXT_OFFSET_LARGE_UNIT_USECS;
+    } else {
+        unit = BLE_ADV_EXT_OFFSET_UNIT_USECS;
+    }
+    offset &= BLE_ADV_EXT_OFFSET_MAX;
+    if (offset == 0) {
+        rx->sync_errs++;
+        return;
+    }
+    t0 = start + cputime_usecs_to_ticks(offset * unit);
+
+    if (!rx->synced) {
+        rx->synced = 1;
+        rx->per_aa = le32toh(sync_info + 9);
+        rx->per_itvl = cputime_usecs_to_ticks(le16toh(sync_info + 2) *
+                                              BLE_LL_ADV_PER_ITVL_USECS);
+        rx->per_cntr = le16toh(sync_info + 16);
+        rx->per_chan_id = ble_ll_chan_sel2_id(rx->per_aa);
+        memcpy(chmap, sync_info + 4, BLE_LL_CHAN_MAP_LEN);
+        chmap[BLE_LL_CHAN_MAP_LEN - 1] &= 0x1f;
+        ble_ll_chan_map_set(&rx->per_chmap, chmap);
+
+        rx->per.want = LL_ADV_EXT_TEST_WANT_AUX;
+        rx->per.chan = ble_ll_chan_sel2(&rx->per_chmap, rx->per_cntr,
+                                        rx->per_chan_id);
+        rx->per.t0 = t0;
+        rx->per.t1 = t0 + cputime_usecs_to_ticks(unit +
+                                                 LL_ADV_EXT_TEST_PER_JITTER);
+        rx->per_anchor = t0;
+        return;
+    }
+
+    if (!rx->locked) {
+        return;
+    }
+
+    /* The first event of the train after this PDU */
+    anchor = rx->per_anchor;
+    cntr = rx->per_cntr;
+    while ((int32_t)(anchor - start) <= 0) {
+        anchor += rx->per_itvl;
+        cntr++;
+    }
+    if ((int32_t)(anchor - t0) < 0 ||
+        (int32_t)(anchor - t0) >= (int32_t)cputime_usecs_to_ticks(unit) ||
+        le16toh(sync_info + 16) != cntr ||
+        le32toh(sync_info + 9) != rx->per_aa) {
+        rx->sync_errs++;
+    }
+}
+
+/* A PDU of the periodic advertising train */
+static void
+ll_adv_ext_test_per_rx(struct ll_adv_ext_test_pdu *p, uint8_t chan,
+                       uint32_t start, uint32_t end)
+{
+    struct ll_adv_ext_test_rx *rx;
+    struct ll_adv_ext_test_chain *chain;
+
+    rx = &ll_adv_ext_test_rx;
+    chain = &rx->per;
+
+    /* Periodic PDUs have no AdvA or ADI */
+    if (p->adva != NULL || p->did >= 0) {
+        chain->errs++;
+    }
+
+    switch (chain->want) {
+    case LL_ADV_EXT_TEST_WANT_AUX:
+        if (chan != chain->chan ||
+            (int32_t)(start - chain->t0) < 0 ||
+            (int32_t)(start - chain->t1) >= 0) {
+            chain->errs++;
+        }
+        if (!rx->locked) {
+            rx->locked = 1;
+            rx->per_anchor = start;
+        }
+        rx->per_chans |= (uint64_t)1 << chan;
+        chain->len = 0;
+        break;
+
+    case LL_ADV_EXT_TEST_WANT_CHAIN:
+        ll_adv_ext_test_chain_check(chain, chan, start);
+        break;
+
+    default:
+        chain->errs++;
+        return;
+    }
+
+    ll_adv_ext_test_chain_rx(chain, p, start, end, ll_adv_ext_test_per_data,
+                             ll_adv_ext_test_per_data_len);
+    if (chain->want == LL_ADV_EXT_TEST_WANT_NONE) {
+        /* The next event, one interval on */
+        rx->per_anchor += rx->per_itvl;
+        rx->per_cntr++;
+        chain->want = LL_ADV_EXT_TEST_WANT_AUX;
+        chain->chan = ble_ll_chan_sel2(&rx->per_chmap, rx->per_cntr,
+                                       rx->per_chan_id);
+        chain->t0 = rx->per_anchor;
+        chain->t1 = rx->per_anchor +
+            cputime_usecs_to_ticks(LL_ADV_EXT_TEST_PER_JITTER + 1);
+    }
+}
+
+/* A PDU of the advertising events of the set followed */
+static void
+ll_adv_ext_test_adv_rx(struct ll_adv_ext_test_pdu *p, uint8_t chan,
+                       uint32_t start, uint32_t end)
+{
+    struct ll_adv_ext_test_rx *rx;
+    struct ll_adv_ext_test_chain *chain;
+    uint8_t aux_chan;
+    uint32_t t0;
+    uint32_t t1;
+    int want;
+
+    rx = &ll_adv_ext_test_rx;
+    chain = &rx->adv;
+
+    if (chan >= BLE_PHY_ADV_CHAN_START) {
+        /* ADV_EXT_IND: ADI and AuxPtr only */
+        if (p->aux_ptr == NULL || p->adva != NULL || p->data_len != 0 ||
+            chain->want == LL_ADV_EXT_TEST_WANT_CHAIN) {
+            chain->errs++;
+            chain->want = LL_ADV_EXT_TEST_WANT_NONE;
+            return;
+        }
+
+        /* The ADV_EXT_INDs of an event all point to the same AUX_ADV_IND */
+        want = chain->want;
+        aux_chan = chain->chan;
+        t0 = chain->t0;
+        t1 = chain->t1;
+        ll_adv_ext_test_aux_ptr(chain, p->aux_ptr, start, end);
+        if (want == LL_ADV_EXT_TEST_WANT_AUX) {
+            if ((int32_t)(t0 - chain->t0) > 0) {
+                chain->t0 = t0;
+            }
+            if ((int32_t)(t1 - chain->t1) < 0) {
+                chain->t1 = t1;
+            }
+            if (aux_chan != chain->chan || p->did != chain->did ||
+                (int32_t)(chain->t1 - chain->t0) <= 0) {
+                chain->errs++;
+            }
+        }
+        chain->want = LL_ADV_EXT_TEST_WANT_AUX;
+        chain->did = p->did;
+        chain->len = 0;
+        return;
+    }
+
+    switch (chain->want) {
+    case LL_ADV_EXT_TEST_WANT_AUX:
+        if (p->adva == NULL ||
+            memcmp(p->adva, g_dev_addr, BLE_DEV_ADDR_LEN) != 0) {
+            chain->errs++;
+        }
+        if (p->sync_info != NULL) {
+            ll_adv_ext_test_sync_info(p->sync_info, start);
+        }
+        break;
+
+    case LL_ADV_EXT_TEST_WANT_CHAIN:
+        if (p->adva != NULL || p->sync_info != NULL) {
+            chain->errs++;
+        }
+        break;
+
+    default:
+        chain->errs++;
+        return;
+    }
+
+    ll_adv_ext_test_chain_check(chain, chan, start);
+    if (p->did != chain->did) {
+        chain->errs++;
+    }
+    ll_adv_ext_test_chain_rx(chain, p, start, end,
+                             ll_adv_ext_test_data[rx->sid],
+                             ll_adv_ext_test_data_len[rx->sid]);
+}
+
+static void
+ll_adv_ext_test_tx_cb(uint8_t chan, uint32_t access_addr, uint32_t start_time,
+                      uint32_t end_time, uint8_t *pdu, int len,
+                      int8_t txpwr_dbm)
+{
+    struct ll_adv_ext_test_rx *rx;
+    struct ll_adv_ext_test_pdu p;
+    uint32_t air;
+    int sid;
+    int rc;
+    int i;
+
+    rx = &ll_adv_ext_test_rx;
+    air = cputime_ticks_to_usecs(end_time - start_time);
+
+    rc = ll_adv_ext_test_parse(pdu, len, &p);
+    if (rc != 0) {
+        rx->adv.errs++;
+        rx->air_unknown += air;
+        return;
+    }
+
+    /*
+     * Whose PDU it is: the ADI says, or the access address of the train. A
+     * periodic event may come before the SyncInfo that names its train, so
+     * the air time of the trains is kept by access address.
+     */
+    sid = -1;
+    if (access_addr == BLE_ACCESS_ADDR_ADV) {
+        sid = p.sid;
+        if (sid < 0) {
+            rx->air_unknown += air;
+            return;
+        }
+        rx->air_usecs[sid] += air;
+        if (p.sync_info != NULL) {
+            rx->per_aas[sid] = le32toh(p.sync_info + 9);
+        }
+    } else {
+        for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; i++) {
+            if (rx->train_aas[i] == access_addr || rx->train_aas[i] == 0) {
+                rx->train_aas[i] = access_addr;
+                rx->train_air_usecs[i] += air;
+                break;
+            }
+        }
+        if (i == BLE_LL_ADV_EXT_CFG_MAX_SETS) {
+            rx->air_unknown += air;
+        }
+        for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; i++) {
+            if (rx->per_aas[i] == access_addr) {
+                sid = i;
+            }
+        }
+    }
+
+    if (sid != rx->sid) {
+        return;
+    }
+    if (access_addr == BLE_ACCESS_ADDR_ADV) {
+        ll_adv_ext_test_adv_rx(&p, chan, start_time, end_time);
+    } else if (rx->synced && access_addr == rx->per_aa) {
+        ll_adv_ext_test_per_rx(&p, chan, start_time, end_time);
+    }
+}
+
+/* Air time of a set: its advertising events and its periodic train */
+static uint32_t
+ll_adv_ext_test_set_air(int sid)
+{
+    struct ll_adv_ext_test_rx *rx;
+    uint32_t air;
+    int i;
+
+    rx = &ll_adv_ext_test_rx;
+    air = rx->air_usecs[sid];
+    for (i = 0; i < BLE_LL_ADV_EXT_CFG_MAX_SETS; i++) {
+        if (rx->train_aas[i] != 0 && rx->train_aas[i] == rx->per_aas[sid]) {
+            air += rx->train_air_usecs[i];
+        }
+    }
+
+    return air;
+}
+
+static void
+ll_adv_ext_test_init(void)
+{
+    ll_test_util_init();
+
+    memset(&ll_adv_ext_test_rx, 0, sizeof ll_adv_ext_test_rx);
+    memset(g_ble_ll_adv_ext_stats, 0, sizeof g_ble_ll_adv_ext_stats);
+    memset(&g_ble_phy_sim_stats, 0, sizeof g_ble_phy_sim_stats);
+    ll_adv_ext_test_old_data_len = -1;
+    ll_adv_ext_test_per_data_len = 0;
+    ll_test_util_peer_cb = ll_adv_ext_test_tx_cb;
+}
+
+/* Sends advertising or periodic advertising data, in fragments */
+static void
+ll_adv_ext_test_data_send(uint16_t ocf, uint8_t handle, const uint8_t *data,
+                          int len)
+{
+    uint8_t cmd[BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN + LL_ADV_EXT_TEST_FRAG_LEN];
+    uint8_t hdr_len;
+    int off;
+    int rc;
+    int n;
+
+    if (ocf == BLE_HCI_OCF_LE_SET_EXT_ADV_DATA) {
+        hdr_len = BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN;
+    } else {
+        hdr_len = BLE_HCI_SET_PER_ADV_DATA_HDR_LEN;
+    }
+
+    off = 0;
+    do {
+        n = len - off;
+        if (n > LL_ADV_EXT_TEST_FRAG_LEN) {
+            n = LL_ADV_EXT_TEST_FRAG_LEN;
+        }
+
+        cmd[0] = handle;
+        if (off == 0 && n == len) {
+            cmd[1] = BLE_HCI_ADV_DATA_OP_COMPLETE;
+        } else if (off == 0) {
+            cmd[1] = BLE_HCI_ADV_DATA_OP_FIRST;
+        } else if (off + n == len) {
+            cmd[1] = BLE_HCI_ADV_DATA_OP_LAST;
+        } else {
+            cmd[1] = BLE_HCI_ADV_DATA_OP_INT;
+        }
+        cmd[2] = 0;
+        cmd[hdr_len - 1] = n;
+        memcpy(cmd + hdr_len, data + off, n);
+        rc = ll_test_util_cmd(BLE_HCI_OGF_LE, ocf, cmd, hdr_len + n);
+        TEST_ASSERT_FATAL(rc == 0);
+
+        off += n;
+    } while (off < len);
+}
+
+/* Sets the advertising data of a set: len bytes of a pattern of the set */
+static void
+ll_adv_ext_test_data_set(uint8_t handle, int len, uint8_t seed)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        ll_adv_ext_test_data[handle][i] = seed + i * 7;
+    }
+    ll_adv_ext_test_data_len[handle] = len;
+    ll_adv_ext_test_data_send(BLE_HCI_OCF_LE_SET_EXT_ADV_DATA, handle,
+                              ll_adv_ext_test_data[handle], len);
+}
+
+/**
+ * Creates advertising set handle, with SID handle, advertising every itvl
+ * usecs on the channels of chanmask with len bytes of data.
+ */
+static void
+ll_adv_ext_test_set_create(uint8_t handle, uint8_t chanmask, uint32_t itvl,
+                           int len)
+{
+    uint8_t params[BLE_HCI_SET_EXT_ADV_PARAM_LEN];
+    uint32_t units;
+    int rc;
+
+    units = itvl / BLE_HCI_ADV_ITVL;
+    memset(params, 0, sizeof params);
+    params[0] = handle;
+    htole16(params + 1, 0);
+    htole16(params + 3, units);
+    params[5] = units >> 16;
+    htole16(params + 6, units);
+    params[8] = units >> 16;
+    params[9] = chanmask;
+    params[10] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    params[19] = BLE_HCI_ADV_TXPWR_NO_PREF;
+    params[20] = BLE_HCI_ADV_PHY_1M;
+    params[22] = BLE_HCI_ADV_PHY_1M;
+    params[23] = handle;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_ADV_PARAMS,
+                          params, sizeof params);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    ll_adv_ext_test_data_set(handle, len, handle * 37);
+}
+
+/* Sets up and enables the periodic advertising of a set */
+static void
+ll_adv_ext_test_per_start(uint8_t handle, uint16_t itvl, int len)
+{
+    uint8_t params[BLE_HCI_SET_PER_ADV_PARAM_LEN];
+    int rc;
+    int i;
+
+    params[0] = handle;
+    htole16(params + 1, itvl);
+    htole16(params + 3, itvl);
+    htole16(params + 5, 0);
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_PER_ADV_PARAMS,
+                          params, sizeof params);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    for (i = 0; i < len; i++) {
+        ll_adv_ext_test_per_data[i] = 0x80 + i * 3;
+    }
+    ll_adv_ext_test_per_data_len = len;
+    ll_adv_ext_test_data_send(BLE_HCI_OCF_LE_SET_PER_ADV_DATA, handle,
+                              ll_adv_ext_test_per_data, len);
+
+    params[0] = 1;
+    params[1] = handle;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_PER_ADV_ENABLE,
+                          params, BLE_HCI_SET_PER_ADV_ENABLE_LEN);
+    TEST_ASSERT_FATAL(rc == 0);
+}
+
+/* Enables or disables the first num sets */
+static void
+ll_adv_ext_test_enable(uint8_t enable, int num)
+{
+    uint8_t cmd[BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN +
+                BLE_LL_ADV_EXT_CFG_MAX_SETS *
+                BLE_HCI_SET_EXT_ADV_ENABLE_SET_LEN];
+    uint8_t *entry;
+    int rc;
+    int i;
+
+    cmd[0] = enable;
+    cmd[1] = num;
+    entry = cmd + BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN;
+    for (i = 0; i < num; i++) {
+        entry[0] = i;
+        htole16(entry + 1, 0);
+        entry[3] = 0;
+        entry += BLE_HCI_SET_EXT_ADV_ENABLE_SET_LEN;
+    }
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_ADV_ENABLE,
+                          cmd, entry - cmd);
+    TEST_ASSERT_FATAL(rc == 0);
+}
+
+/**
+ * Checks the ADV_EXT_INDs of the first event against the captured frames:
+ * one per channel of chanmask, in order and MAFS apart, all pointing to the
+ * AUX_ADV_IND that follows them.
+ */
+static void
+ll_adv_ext_test_prim_check(uint8_t chanmask)
+{
+    struct ll_adv_ext_test_pdu p;
+    struct ll_test_util_tx *aux;
+    struct ll_test_util_tx *tx;
+    uint32_t offset;
+    int nprim;
+    int rc;
+    int i;
+
+    nprim = 0;
+    for (i = 0; i < 3; i++) {
+        if (chanmask & (1 << i)) {
+            tx = ll_test_util_txs + nprim;
+            TEST_ASSERT(tx->chan == BLE_PHY_ADV_CHAN_START + i);
+            nprim++;
+        }
+    }
+    TEST_ASSERT_FATAL(ll_test_util_num_txs == nprim + 1);
+
+    aux = ll_test_util_txs + nprim;
+    TEST_ASSERT(aux->chan < BLE_PHY_NUM_DATA_CHANS);
+    TEST_ASSERT(aux->access_addr == BLE_ACCESS_ADDR_ADV);
+
+    for (i = 0; i < nprim; i++) {
+        tx = ll_test_util_txs + i;
+        TEST_ASSERT(tx->access_addr == BLE_ACCESS_ADDR_ADV);
+        rc = ll_adv_ext_test_parse(tx->pdu, tx->len, &p);
+        TEST_ASSERT_FATAL(rc == 0);
+        TEST_ASSERT(p.adva == NULL);
+        TEST_ASSERT(p.sid == 0);
+        TEST_ASSERT(p.data_len == 0);
+        TEST_ASSERT_FATAL(p.aux_ptr != NULL);
+
+        /* 30 usec units, rounded down; 1M PHY */
+        TEST_ASSERT((p.aux_ptr[0] & LL_ADV_EXT_TEST_AUX_CHAN_MASK) ==
+                    aux->chan);
+        TEST_ASSERT(!(p.aux_ptr[0] & BLE_ADV_EXT_AUX_PTR_UNITS_300));
+        TEST_ASSERT((le16toh(p.aux_ptr + 1) & ~BLE_ADV_EXT_OFFSET_MAX) ==
+                    BLE_ADV_EXT_AUX_PTR_PHY_1M);
+        offset = (le16toh(p.aux_ptr + 1) & BLE_ADV_EXT_OFFSET_MAX) *
+                 BLE_ADV_EXT_OFFSET_UNIT_USECS;
+        TEST_ASSERT(aux->start_time - tx->start_time >= offset);
+        TEST_ASSERT(aux->start_time - tx->start_time <
+                    offset + BLE_ADV_EXT_OFFSET_UNIT_USECS);
+
+        if (i + 1 < nprim) {
+            TEST_ASSERT((tx + 1)->start_time - tx->end_time ==
+                        BLE_LL_MAFS_USECS);
+        }
+    }
+
+    /* The AUX_ADV_IND follows the last ADV_EXT_IND by MAFS */
+    tx = ll_test_util_txs + nprim - 1;
+    TEST_ASSERT(aux->start_time - tx->end_time == BLE_LL_MAFS_USECS);
+}
+
+TEST_CASE(ll_adv_ext_test_case_aux_ptr)
+{
+    static const uint8_t chanmasks[] = { 0x07, 0x05, 0x02 };
+    struct ll_adv_ext_test_pdu p;
+    struct ll_test_util_tx *aux;
+    int rc;
+    int i;
+
+    for (i = 0; i < sizeof chanmasks; i++) {
+        ll_adv_ext_test_init();
+        ll_adv_ext_test_set_create(0, chanmasks[i], 20000, 100);
+        ll_test_util_num_txs = 0;
+        ll_adv_ext_test_enable(1, 1);
+        ll_test_util_run(5000);
+
+        ll_adv_ext_test_prim_check(chanmasks[i]);
+
+        /* The AUX_ADV_IND: AdvA, the ADI of the ADV_EXT_INDs and the data */
+        aux = ll_test_util_txs + ll_test_util_num_txs - 1;
+        rc = ll_adv_ext_test_parse(aux->pdu, aux->len, &p);
+        TEST_ASSERT_FATAL(rc == 0);
+        TEST_ASSERT(p.adva != NULL &&
+                    memcmp(p.adva, g_dev_addr, BLE_DEV_ADDR_LEN) == 0);
+        TEST_ASSERT(p.sid == 0);
+        TEST_ASSERT(p.aux_ptr == NULL);
+        TEST_ASSERT(p.data_len == 100);
+        TEST_ASSERT(memcmp(p.data, ll_adv_ext_test_data[0], 100) == 0);
+
+        /* Every event of the next second can be followed the same way */
+        ll_test_util_run(1000000);
+        TEST_ASSERT(ll_adv_ext_test_rx.adv.errs == 0);
+        TEST_ASSERT(ll_adv_ext_test_rx.adv.bad == 0);
+        TEST_ASSERT(ll_adv_ext_test_rx.adv.complete >= 30);
+        TEST_ASSERT(ll_adv_ext_test_rx.adv.complete ==
+                    g_ble_ll_adv_ext_stats[0].adv_events ||
+                    ll_adv_ext_test_rx.adv.complete ==
+                    g_ble_ll_adv_ext_stats[0].adv_events + 1);
+    }
+}
+
+TEST_CASE(ll_adv_ext_test_case_chain)
+{
+    struct ble_ll_adv_ext_stats *stats;
+    struct ll_adv_ext_test_rx *rx;
+    int did;
+
+    ll_adv_ext_test_init();
+    rx = &ll_adv_ext_test_rx;
+    stats = g_ble_ll_adv_ext_stats;
+
+    /*
+     * The most data a set can have: an AUX_ADV_IND and six AUX_CHAIN_INDs,
+     * set with nine commands.
+     */
+    ll_adv_ext_test_set_create(0, 0x07, 100000, BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN);
+    ll_adv_ext_test_enable(1, 1);
+    ll_test_util_run(50000);
+    TEST_ASSERT(rx->adv.complete == 1);
+    TEST_ASSERT(rx->adv.errs == 0);
+    TEST_ASSERT(stats->tx_aux_pdus == 1);
+    TEST_ASSERT(stats->tx_chain_pdus == 6);
+    TEST_ASSERT(stats->tx_data_bytes == BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN);
+
+    ll_test_util_run(1000000);
+    TEST_ASSERT(rx->adv.errs == 0);
+    TEST_ASSERT(rx->adv.bad == 0);
+    TEST_ASSERT(rx->adv.complete >= 9);
+    did = rx->adv.did;
+
+    /*
+     * New data while advertising replaces the data between events, under a
+     * new DID: no chain mixes the two.
+     */
+    memcpy(ll_adv_ext_test_old_data, ll_adv_ext_test_data[0],
+           BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN);
+    ll_adv_ext_test_old_data_len = BLE_LL_ADV_EXT_CFG_MAX_DATA_LEN;
+    rx->adv.complete = 0;
+    ll_adv_ext_test_data_set(0, LL_ADV_EXT_TEST_FRAG_LEN, 0x55);
+    ll_test_util_run(1000000);
+    TEST_ASSERT(rx->adv.errs == 0);
+    TEST_ASSERT(rx->adv.bad == 0);
+    TEST_ASSERT(rx->adv.complete >= 9);
+    TEST_ASSERT(rx->adv.did != did);
+}
+
+TEST_CASE(ll_adv_ext_test_case_per_sync)
+{
+    struct ble_ll_adv_ext_stats *stats;
+    struct ll_adv_ext_test_rx *rx;
+    int nchans;
+    int i;
+
+    ll_adv_ext_test_init();
+    rx = &ll_adv_ext_test_rx;
+    stats = g_ble_ll_adv_ext_stats;
+
+    /* 50 msec periodic interval; 400 bytes is an AUX_SYNC_IND and a chain */
+    ll_adv_ext_test_set_create(0, 0x07, 100000, 100);
+    ll_adv_ext_test_per_start(0, 40, 400);
+    ll_adv_ext_test_enable(1, 1);
+    ll_test_util_run(2000000);
+
+    TEST_ASSERT_FATAL(rx->synced && rx->locked);
+    TEST_ASSERT(rx->per_itvl == cputime_usecs_to_ticks(50000));
+    TEST_ASSERT(rx->sync_errs == 0);
+    TEST_ASSERT(rx->per.errs == 0);
+    TEST_ASSERT(rx->per.bad == 0);
+    TEST_ASSERT(rx->per.complete >= 38);
+    TEST_ASSERT(rx->per.complete == stats->per_events ||
+                rx->per.complete + 1 == stats->per_events);
+    TEST_ASSERT(stats->per_events_late == 0);
+
+    /* The advertising events got out of the way of the periodic ones */
+    TEST_ASSERT(rx->adv.errs == 0);
+    TEST_ASSERT(rx->adv.bad == 0);
+    TEST_ASSERT(rx->adv.complete >= 18);
+
+    /* Channel selection #2 hops over the data channels */
+    nchans = 0;
+    for (i = 0; i < BLE_PHY_NUM_DATA_CHANS; i++) {
+        if (rx->per_chans & ((uint64_t)1 << i)) {
+            nchans++;
+        }
+    }
+    TEST_ASSERT(nchans >= 10);
+}
+
+TEST_CASE(ll_adv_ext_test_case_air_time)
+{
+    static const int lens[] = { 50, 400, 1000 };
+    static const uint32_t itvls[] = { 30000, 50000, 70000 };
+    struct ll_adv_ext_test_rx *rx;
+    uint32_t medium;
+    uint32_t total;
+    uint32_t air;
+    int i;
+
+    ll_adv_ext_test_init();
+    rx = &ll_adv_ext_test_rx;
+
+    for (i = 0; i < 3; i++) {
+        ll_adv_ext_test_set_create(i, 0x07, itvls[i], lens[i]);
+    }
+    ll_adv_ext_test_per_start(1, 24, 300);
+    ll_adv_ext_test_enable(1, 3);
+    ll_test_util_run(2000000);
+
+    /* Each set is charged for its own PDUs, periodic ones included */
+    TEST_ASSERT(rx->air_unknown == 0);
+    total = 0;
+    for (i = 0; i < 3; i++) {
+        air = g_ble_ll_adv_ext_stats[i].air_usecs;
+        TEST_ASSERT(air == ll_adv_ext_test_set_air(i));
+        TEST_ASSERT(g_ble_ll_adv_ext_stats[i].adv_events > 0);
+        total += air;
+    }
+    TEST_ASSERT(g_ble_ll_adv_ext_stats[1].per_events > 0);
+    TEST_ASSERT(ll_adv_ext_test_set_air(1) > rx->air_usecs[1]);
+
+    /* ... and nothing else was on the air */
+    medium = 0;
+    for (i = 0; i < BLE_PHY_NUM_CHANS; i++) {
+        medium += g_ble_phy_sim_stats.chan_air_usecs[i];
+    }
+    TEST_ASSERT(medium == total);
+
+    /* More data, more air time */
+    TEST_ASSERT(g_ble_ll_adv_ext_stats[2].air_usecs /
+                g_ble_ll_adv_ext_stats[2].adv_events >
+                g_ble_ll_adv_ext_stats[0].air_usecs /
+                g_ble_ll_adv_ext_stats[0].adv_events);
+
+    /* Nothing is sent once the sets are disabled */
+    ll_adv_ext_test_enable(0, 3);
+    ll_test_util_run(200000);
+    medium = 0;
+    for (i = 0; i < BLE_PHY_NUM_CHANS; i++) {
+        medium += g_ble_phy_sim_stats.chan_air_usecs[i];
+    }
+    TEST_ASSERT(medium == total);
+}
+
+TEST_SUITE(ll_adv_ext_test_suite)
+{
+    ll_adv_ext_test_case_aux_ptr();
+    ll_adv_ext_test_case_chain();
+    ll_adv_ext_test_case_per_sync();
+    ll_adv_ext_test_case_air_time();
+}
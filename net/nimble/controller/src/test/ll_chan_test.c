@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "testutil/testutil.h"
+#include "controller/ll_chan.h"
+#include "ll_test_priv.h"
+
+/* Sample data from the specification (Vol 6 Part C 3) */
+#define LL_CHAN_TEST_ACCESS_ADDR    (0x8E89BED6)
+#define LL_CHAN_TEST_CHAN_ID        (0x305F)
+
+static uint8_t ll_chan_test_map_all[BLE_LL_CHAN_MAP_LEN] =
+{
+    0xff, 0xff, 0xff, 0xff, 0x1f
+};
+
+/* Channels 9, 10, 21, 22, 23, 33, 34, 35 and 36 */
+static uint8_t ll_chan_test_map_9[BLE_LL_CHAN_MAP_LEN] =
+{
+    0x00, 0x06, 0xe0, 0x00, 0x1e
+};
+
+/*
+ * Reference implementations: channel selection done straight from the
+ * specification, scanning the channel map and permuting a bit at a time.
+ */
+static uint8_t
+ll_chan_test_ref_remap(uint8_t *map, uint8_t remap_index)
+{
+    uint8_t chan;
+    uint8_t cntr;
+
+    cntr = 0;
+    for (chan = 0; chan < BLE_PHY_NUM_DATA_CHANS; ++chan) {
+        if (map[chan >> 3] & (1 << (chan & 7))) {
+            if (cntr == remap_index) {
+                return chan;
+            }
+            ++cntr;
+        }
+    }
+
+    return 0xff;
+}
+
+static uint8_t
+ll_chan_test_ref_sel1(uint8_t *map, uint8_t *last_unmapped_chan,
+                      uint8_t hop_inc)
+{
+    uint8_t chan;
+
+    chan = (*last_unmapped_chan + hop_inc) % BLE_PHY_NUM_DATA_CHANS;
+    *last_unmapped_chan = chan;
+    if (!(map[chan >> 3] & (1 << (chan & 7)))) {
+        chan = ll_chan_test_ref_remap(map, chan % ble_ll_chan_num_used(map));
+    }
+
+    return chan;
+}
+
+static uint16_t
+ll_chan_test_ref_perm(uint16_t x)
+{
+    uint16_t y;
+    int i;
+
+    y = 0;
+    for (i = 0; i < 8; ++i) {
+        if (x & (1 << i)) {
+            y |= 1 << (7 - i);
+        }
+        if (x & (1 << (i + 8))) {
+            y |= 1 << (15 - i);
+        }
+    }
+
+    return y;
+}
+
+static uint8_t
+ll_chan_test_ref_sel2(uint8_t *map, uint16_t counter, uint16_t chan_id)
+{
+    uint8_t chan;
+    uint16_t prn_e;
+    int i;
+
+    prn_e = counter ^ chan_id;
+    for (i = 0; i < 3; ++i) {
+        prn_e = ll_chan_test_ref_perm(prn_e);
+        prn_e = (uint16_t)((17 * prn_e) + chan_id);
+    }
+    prn_e ^= chan_id;
+
+    chan = prn_e % BLE_PHY_NUM_DATA_CHANS;
+    if (!(map[chan >> 3] & (1 << (chan & 7)))) {
+        chan = ll_chan_test_ref_remap(map, (ble_ll_chan_num_used(map) *
+                                            (uint32_t)prn_e) >> 16);
+    }
+
+    return chan;
+}
+
+static void
+ll_chan_test_rand_map(uint8_t *map)
+{
+    int i;
+
+    do {
+        for (i = 0; i < BLE_LL_CHAN_MAP_LEN; ++i) {
+            map[i] = rand();
+        }
+        map[BLE_LL_CHAN_MAP_LEN - 1] &= 0x1f;
+    } while (ble_ll_chan_num_used(map) < 2);
+}
+
+TEST_CASE(ll_chan_test_case_map)
+{
+    static const uint8_t remap[] = { 9, 10, 21, 22, 23, 33, 34, 35, 36 };
+    struct ble_ll_chan_map chmap;
+    int i;
+
+    ble_ll_chan_map_set(&chmap, ll_chan_test_map_all);
+    TEST_ASSERT(chmap.num_used == BLE_PHY_NUM_DATA_CHANS);
+    for (i = 0; i < BLE_PHY_NUM_DATA_CHANS; ++i) {
+        TEST_ASSERT(chmap.remap[i] == i);
+    }
+
+    ble_ll_chan_map_set(&chmap, ll_chan_test_map_9);
+    TEST_ASSERT(ble_ll_chan_num_used(ll_chan_test_map_9) == 9);
+    TEST_ASSERT_FATAL(chmap.num_used == 9);
+    TEST_ASSERT(memcmp(chmap.remap, remap, sizeof remap) == 0);
+}
+
+TEST_CASE(ll_chan_test_case_sel1)
+{
+    static const uint8_t chans_all[] = { 7, 14, 21, 28, 35, 5, 12, 19 };
+    static const uint8_t chans_9[] = { 33, 10, 34, 21, 35, 22, 35, 22 };
+    struct ble_ll_chan_map chmap;
+    uint8_t unmapped;
+    int i;
+
+    ble_ll_chan_map_set(&chmap, ll_chan_test_map_all);
+    unmapped = 0;
+    for (i = 0; i < sizeof chans_all; ++i) {
+        TEST_ASSERT(ble_ll_chan_sel1(&chmap, &unmapped, 7) == chans_all[i]);
+    }
+
+    /* Unused channels are remapped to a used one, not to the remap index */
+    ble_ll_chan_map_set(&chmap, ll_chan_test_map_9);
+    unmapped = 0;
+    for (i = 0; i < sizeof chans_9; ++i) {
+        TEST_ASSERT(ble_ll_chan_sel1(&chmap, &unmapped, 5) == chans_9[i]);
+    }
+    TEST_ASSERT(unmapped == 3);
+}
+
+TEST_CASE(ll_chan_test_case_sel2)
+{
+    struct ble_ll_chan_map chmap;
+    uint16_t chan_id;
+
+    chan_id = ble_ll_chan_sel2_id(LL_CHAN_TEST_ACCESS_ADDR);
+    TEST_ASSERT_FATAL(chan_id == LL_CHAN_TEST_CHAN_ID);
+
+    /* Sample data 1: all channels used */
+    ble_ll_chan_map_set(&chmap, ll_chan_test_map_all);
+    TEST_ASSERT(ble_ll_chan_sel2(&chmap, 1, chan_id) == 20);
+    TEST_ASSERT(ble_ll_chan_sel2(&chmap, 2, chan_id) == 6);
+    TEST_ASSERT(ble_ll_chan_sel2(&chmap, 3, chan_id) == 21);
+
+    /* Sample data 2: nine channels used */
+    ble_ll_chan_map_set(&chmap, ll_chan_test_map_9);
+    TEST_ASSERT(ble_ll_chan_sel2(&chmap, 6, chan_id) == 23);
+    TEST_ASSERT(ble_ll_chan_sel2(&chmap, 7, chan_id) == 9);
+    TEST_ASSERT(ble_ll_chan_sel2(&chmap, 8, chan_id) == 34);
+}
+
+TEST_CASE(ll_chan_test_case_ref)
+{
+    struct ble_ll_chan_map chmap;
+    uint8_t map[BLE_LL_CHAN_MAP_LEN];
+    uint8_t unmapped;
+    uint8_t ref_unmapped;
+    uint8_t hop_inc;
+    uint16_t chan_id;
+    int counter;
+    int i;
+
+    srand(1);
+    for (i = 0; i < 64; ++i) {
+        ll_chan_test_rand_map(map);
+        ble_ll_chan_map_set(&chmap, map);
+        TEST_ASSERT_FATAL(chmap.num_used == ble_ll_chan_num_used(map));
+
+        hop_inc = 5 + (rand() % 12);
+        unmapped = 0;
+        ref_unmapped = 0;
+        chan_id = rand();
+        for (counter = 0; counter < 0x10000; ++counter) {
+            TEST_ASSERT_FATAL(ble_ll_chan_sel1(&chmap, &unmapped, hop_inc) ==
+                              ll_chan_test_ref_sel1(map, &ref_unmapped,
+                                                    hop_inc));
+            TEST_ASSERT_FATAL(ble_ll_chan_sel2(&chmap, counter, chan_id) ==
+                              ll_chan_test_ref_sel2(map, counter, chan_id));
+        }
+    }
+}
+
+/*
+ * Microbenchmark: the cost of picking the channel of a connection event,
+ * with the table driven selection and with the reference (map scanning)
+ * implementations. Informational; prints nsecs per event.
+ */
+TEST_CASE(ll_chan_test_case_bench)
+{
+    struct ble_ll_chan_map chmap;
+    volatile uint8_t sink;
+    uint8_t unmapped;
+    clock_t start;
+    double nsecs[4];
+    int loops;
+    int i;
+
+    loops = 1000000;
+    ble_ll_chan_map_set(&chmap, ll_chan_test_map_9);
+
+    start = clock();
+    unmapped = 0;
+    for (i = 0; i < loops; ++i) {
+        sink = ble_ll_chan_sel1(&chmap, &unmapped, 7);
+    }
+    nsecs[0] = (clock() - start) * 1e9 / CLOCKS_PER_SEC / loops;
+
+    start = clock();
+    unmapped = 0;
+    for (i = 0; i < loops; ++i) {
+        sink = ll_chan_test_ref_sel1(ll_chan_test_map_9, &unmapped, 7);
+    }
+    nsecs[1] = (clock() - start) * 1e9 / CLOCKS_PER_SEC / loops;
+
+    start = clock();
+    for (i = 0; i < loops; ++i) {
+        sink = ble_ll_chan_sel2(&chmap, i, LL_CHAN_TEST_CHAN_ID);
+    }
+    nsecs[2] = (clock() - start) * 1e9 / CLOCKS_PER_SEC / loops;
+
+    start = clock();
+    for (i = 0; i < loops; ++i) {
+        sink = ll_chan_test_ref_sel2(ll_chan_test_map_9, i,
+                                     LL_CHAN_TEST_CHAN_ID);
+    }
+    nsecs[3] = (clock() - start) * 1e9 / CLOCKS_PER_SEC / loops;
+    (void)sink;
+
+    printf("channel selection (9 channels used), nsecs/event: "
+           "#1 %.1f (ref %.1f), #2 %.1f (ref %.1f)\n",
+           nsecs[0], nsecs[1], nsecs[2], nsecs[3]);
+}
+
+TEST_SUITE(ll_chan_test_suite)
+{
+    ll_chan_test_case_map();
+    ll_chan_test_case_sel1();
+    ll_chan_test_case_sel2();
+    ll_chan_test_case_ref();
+}
+
+TEST_SUITE(ll_chan_bench_suite)
+{
+    ll_chan_test_case_bench();
+}
@@ -0,0 +1,840 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "testutil/testutil.h"
+#include "os/os.h"
+#include "hal/hal_cputime.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/hci_transport.h"
+#include "controller/ll.h"
+#include "controller/ll_adv.h"
+#include "controller/ll_hci.h"
+#include "controller/ll_sched.h"
+#include "controller/ll_conn.h"
+#include "controller/phy_sim.h"
+#include "ll_test_priv.h"
+
+/*
+ * Connections over the simulated PHY. The link layer is the master; the test
+ * plays the slave, answering every PDU of the master one IFS after it ends.
+ */
+
+/* 30 ms, in 1.25 ms units */
+#define LL_CONN_TEST_ITVL           (0x0018)
+#define LL_CONN_TEST_ITVL_USECS     \
+    (LL_CONN_TEST_ITVL * BLE_LL_CONN_ITVL_USECS)
+
+/* 100 ms, in 10 ms units */
+#define LL_CONN_TEST_SPVN_TMO       (0x000A)
+#define LL_CONN_TEST_SPVN_TMO_USECS (100000)
+
+/* Size of the ACL data packets sent by the host */
+#define LL_CONN_TEST_ACL_LEN        (20)
+
+/* Size of the data PDUs sent by the peer */
+#define LL_CONN_TEST_PEER_LEN       (BLE_LL_CONN_SUPP_BYTES_MIN)
+
+static uint8_t ll_conn_test_peer_addr[BLE_DEV_ADDR_LEN] =
+{
+    0x66, 0x55, 0x44, 0x33, 0x22, 0x11
+};
+
+/* The simulated slave */
+struct ll_conn_test_peer
+{
+    int connected;
+    uint32_t access_addr;
+    uint16_t max_octets;
+
+    /* Sequence numbers, and the PDU being sent until it is acknowledged */
+    uint8_t sn;
+    uint8_t nesn;
+    uint8_t pdu[BLE_LL_PDU_HDR_LEN + BLE_LL_CONN_SUPP_BYTES_MAX];
+    int pdu_valid;
+
+    /* Control PDU to send next, and data PDUs still to send */
+    uint8_t ctrl[BLE_LL_CTRL_LENGTH_REQ_LEN + 1];
+    int ctrl_len;
+    int data_left;
+
+    /*
+     * Misbehaviour: do not acknowledge the next nak PDUs; send the next
+     * ignore_ack PDUs again although they were acknowledged; stop answering.
+     */
+    int nak;
+    int ignore_ack;
+    int silent;
+
+    /* What the peer received; data is checked against the sequence sent */
+    int rx_data_pdus;
+    uint32_t rx_data_bytes;
+    int rx_dups;
+    int rx_ctrl_pdus;
+    int seq_errs;
+    uint8_t rx_seq;
+
+    /* End of the last PDU the peer sent */
+    uint32_t last_tx_end;
+};
+
+static struct ll_conn_test_peer ll_conn_test_peer;
+
+/* Handle of the connection, and the next data byte the host sends */
+static uint16_t ll_conn_test_handle;
+static uint8_t ll_conn_test_tx_seq;
+
+/* A schedule item standing for another connection's event */
+static uint32_t ll_conn_test_item_time;
+
+static void
+ll_conn_test_peer_start(uint8_t *pdu)
+{
+    uint8_t *lldata;
+
+    lldata = pdu + BLE_LL_PDU_HDR_LEN + 2 * BLE_DEV_ADDR_LEN;
+    ll_conn_test_peer.access_addr = le32toh(lldata);
+    ll_conn_test_peer.connected = 1;
+}
+
+/* The peer receives a PDU from the master */
+static void
+ll_conn_test_peer_rx(uint8_t *pdu)
+{
+    struct ll_conn_test_peer *peer;
+    uint8_t llid;
+    uint8_t len;
+    uint8_t *ctrl;
+    int i;
+
+    peer = &ll_conn_test_peer;
+    llid = pdu[0] & BLE_LL_DATA_HDR_LLID_MASK;
+    len = pdu[1];
+
+    if (!!(pdu[0] & BLE_LL_DATA_HDR_SN_MASK) != peer->nesn) {
+        peer->rx_dups++;
+    } else if (peer->nak > 0) {
+        peer->nak--;
+    } else {
+        peer->nesn ^= 1;
+        if (llid == BLE_LL_LLID_CTRL) {
+            peer->rx_ctrl_pdus++;
+            if (pdu[2] == BLE_LL_CTRL_LENGTH_REQ) {
+                ctrl = peer->ctrl;
+                ctrl[0] = BLE_LL_CTRL_LENGTH_RSP;
+                htole16(ctrl + 1, peer->max_octets);
+                htole16(ctrl + 3, (peer->max_octets + 14) * 8);
+                htole16(ctrl + 5, peer->max_octets);
+                htole16(ctrl + 7, (peer->max_octets + 14) * 8);
+                peer->ctrl_len = BLE_LL_CTRL_LENGTH_REQ_LEN + 1;
+            }
+        } else if (len != 0) {
+            peer->rx_data_pdus++;
+            peer->rx_data_bytes += len;
+            for (i = 0; i < len; i++) {
+                if (pdu[BLE_LL_PDU_HDR_LEN + i] != peer->rx_seq) {
+                    peer->seq_errs++;
+                }
+                peer->rx_seq++;
+            }
+        }
+    }
+
+    /* Did the master acknowledge our last PDU? */
+    if (!!(pdu[0] & BLE_LL_DATA_HDR_NESN_MASK) != peer->sn) {
+        if (peer->ignore_ack > 0) {
+            peer->ignore_ack--;
+        } else {
+            peer->sn ^= 1;
+            peer->pdu_valid = 0;
+        }
+    }
+}
+
+/* Gets the PDU the peer sends next; returns its length */
+static int
+ll_conn_test_peer_next(void)
+{
+    struct ll_conn_test_peer *peer;
+    uint8_t md;
+
+    peer = &ll_conn_test_peer;
+    if (!peer->pdu_valid) {
+        if (peer->ctrl_len) {
+            peer->pdu[0] = BLE_LL_LLID_CTRL;
+            peer->pdu[1] = peer->ctrl_len;
+            memcpy(peer->pdu + BLE_LL_PDU_HDR_LEN, peer->ctrl, peer->ctrl_len);
+            peer->ctrl_len = 0;
+        } else if (peer->data_left > 0) {
+            peer->pdu[0] = BLE_LL_LLID_DATA_START;
+            peer->pdu[1] = LL_CONN_TEST_PEER_LEN;
+            memset(peer->pdu + BLE_LL_PDU_HDR_LEN, 0xa5, LL_CONN_TEST_PEER_LEN);
+            peer->data_left--;
+        } else {
+            peer->pdu[0] = BLE_LL_LLID_DATA_FRAG;
+            peer->pdu[1] = 0;
+        }
+        peer->pdu_valid = 1;
+    }
+
+    md = (peer->ctrl_len != 0) || (peer->data_left > 0);
+    peer->pdu[0] &= BLE_LL_DATA_HDR_LLID_MASK;
+    if (peer->nesn) {
+        peer->pdu[0] |= BLE_LL_DATA_HDR_NESN_MASK;
+    }
+    if (peer->sn) {
+        peer->pdu[0] |= BLE_LL_DATA_HDR_SN_MASK;
+    }
+    if (md) {
+        peer->pdu[0] |= BLE_LL_DATA_HDR_MD_MASK;
+    }
+
+    return BLE_LL_PDU_HDR_LEN + peer->pdu[1];
+}
+
+static void
+ll_conn_test_peer_cb(uint8_t chan, uint32_t access_addr, uint32_t start_time,
+                     uint32_t end_time, uint8_t *pdu, int len,
+                     int8_t txpwr_dbm)
+{
+    struct ll_conn_test_peer *peer;
+    uint32_t start;
+    int rc;
+
+    peer = &ll_conn_test_peer;
+    if (access_addr == BLE_ACCESS_ADDR_ADV) {
+        if ((pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) ==
+                BLE_ADV_PDU_TYPE_CONNECT_REQ &&
+            memcmp(pdu + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN,
+                   ll_conn_test_peer_addr, BLE_DEV_ADDR_LEN) == 0) {
+            ll_conn_test_peer_start(pdu);
+        }
+        return;
+    }
+
+    if (!peer->connected || access_addr != peer->access_addr ||
+        peer->silent) {
+        return;
+    }
+
+    ll_conn_test_peer_rx(pdu);
+    len = ll_conn_test_peer_next();
+    start = end_time + BLE_LL_IFS;
+    rc = ble_phy_sim_rx_frame(chan, access_addr, start, peer->pdu, len, 0);
+    TEST_ASSERT(rc == 0);
+    peer->last_tx_end = start + ll_pdu_tx_time_get(len);
+}
+
+/* The peer advertises once on each advertising channel */
+static void
+ll_conn_test_peer_adv(void)
+{
+    uint8_t pdu[BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN];
+    uint32_t start;
+    int rc;
+    int i;
+
+    pdu[0] = BLE_ADV_PDU_TYPE_ADV_IND;
+    pdu[1] = BLE_DEV_ADDR_LEN;
+    memcpy(pdu + BLE_LL_PDU_HDR_LEN, ll_conn_test_peer_addr, BLE_DEV_ADDR_LEN);
+
+    start = cputime_get32() + 1000;
+    for (i = 0; i < 3; i++) {
+        rc = ble_phy_sim_rx_frame(BLE_PHY_ADV_CHAN_START + i,
+                                  BLE_ACCESS_ADDR_ADV, start, pdu, sizeof pdu,
+                                  0);
+        TEST_ASSERT_FATAL(rc == 0);
+        start += 1000;
+    }
+}
+
+/* Returns the captured event with the given code (and subevent), or NULL */
+static uint8_t *
+ll_conn_test_ev_find(uint8_t evcode, uint8_t subev, uint32_t *time)
+{
+    uint8_t *b;
+    int i;
+
+    for (i = 0; i < ll_test_util_num_evs; i++) {
+        b = ll_test_util_evs[i].buf;
+        if (b[0] == evcode &&
+            (evcode != BLE_HCI_EVCODE_LE_META || b[2] == subev)) {
+            if (time != NULL) {
+                *time = ll_test_util_evs[i].time;
+            }
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+/* Number of packets completed, from the captured events */
+static int
+ll_conn_test_num_comp_pkts(void)
+{
+    uint8_t *b;
+    int num;
+    int i;
+
+    num = 0;
+    for (i = 0; i < ll_test_util_num_evs; i++) {
+        b = ll_test_util_evs[i].buf;
+        if (b[0] == BLE_HCI_EVCODE_NUM_COMP_PKTS) {
+            TEST_ASSERT(b[2] == 1);
+            TEST_ASSERT(le16toh(b + 3) == ll_conn_test_handle);
+            num += le16toh(b + 5);
+        }
+    }
+
+    return num;
+}
+
+/**
+ * Creates a connection to the peer, without initializing the link layer
+ * first, and runs until the first connection event is over. Captured frames
+ * and events are cleared.
+ */
+static void
+ll_conn_test_create(uint16_t itvl, uint16_t spvn_tmo)
+{
+    uint8_t params[BLE_HCI_CREATE_CONN_LEN];
+    uint8_t *b;
+    int rc;
+    int i;
+
+    memset(&ll_conn_test_peer, 0, sizeof ll_conn_test_peer);
+    ll_conn_test_peer.max_octets = BLE_LL_CONN_SUPP_BYTES_MIN;
+    memset(&g_ble_ll_conn_stats, 0, sizeof g_ble_ll_conn_stats);
+    ll_conn_test_tx_seq = 0;
+    ll_test_util_peer_cb = ll_conn_test_peer_cb;
+
+    memset(params, 0, sizeof params);
+    htole16(params, 0x0010);
+    htole16(params + 2, 0x0010);
+    params[4] = BLE_HCI_CONN_FILT_NO_WL;
+    params[5] = BLE_HCI_ADV_PEER_ADDR_PUBLIC;
+    memcpy(params + 6, ll_conn_test_peer_addr, BLE_DEV_ADDR_LEN);
+    params[12] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    htole16(params + 13, itvl);
+    htole16(params + 15, itvl);
+    htole16(params + 17, 0);
+    htole16(params + 19, spvn_tmo);
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_CREATE_CNXN,
+                          params, sizeof params);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    for (i = 0; !ll_conn_test_peer.connected; i++) {
+        TEST_ASSERT_FATAL(i < 20);
+        ll_conn_test_peer_adv();
+        ll_test_util_run(10000);
+    }
+    ll_test_util_run(2 * itvl * BLE_LL_CONN_ITVL_USECS);
+
+    b = ll_conn_test_ev_find(BLE_HCI_EVCODE_LE_META,
+                             BLE_HCI_LE_SUBEV_CONN_COMPLETE, NULL);
+    TEST_ASSERT_FATAL(b != NULL);
+    TEST_ASSERT_FATAL(b[3] == BLE_ERR_SUCCESS);
+    TEST_ASSERT(b[6] == BLE_HCI_LE_CONN_COMPLETE_ROLE_MASTER);
+    TEST_ASSERT(le16toh(b + 14) == itvl);
+    ll_conn_test_handle = le16toh(b + 4);
+    TEST_ASSERT_FATAL(g_ble_ll_conn_stats.conns_established == 1);
+
+    ll_test_util_clear_evs();
+    ll_test_util_num_txs = 0;
+}
+
+/* Initializes the link layer and creates a connection to the peer */
+static void
+ll_conn_test_connect(uint16_t itvl, uint16_t spvn_tmo)
+{
+    ll_test_util_init();
+    ll_conn_test_create(itvl, spvn_tmo);
+}
+
+/* The host sends an ACL data packet of len bytes */
+static void
+ll_conn_test_acl_send(int len)
+{
+    struct os_mbuf *om;
+    int rc;
+    int i;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    TEST_ASSERT_FATAL(om != NULL);
+    htole16(om->om_data, ll_conn_test_handle | (BLE_HCI_PB_FIRST_FLUSH << 12));
+    htole16(om->om_data + 2, len);
+    for (i = 0; i < len; i++) {
+        om->om_data[BLE_HCI_DATA_HDR_LEN + i] = ll_conn_test_tx_seq++;
+    }
+    om->om_len = BLE_HCI_DATA_HDR_LEN + len;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    rc = ble_hci_transport_host_acl_data_send(om);
+    TEST_ASSERT_FATAL(rc == 0);
+}
+
+/**
+ * Runs until shortly before the next anchor point and returns it. The
+ * master sends its first PDU of an event at the anchor point.
+ */
+static uint32_t
+ll_conn_test_run_to_anchor(void)
+{
+    uint32_t anchor;
+
+    ll_test_util_num_txs = 0;
+    ll_test_util_run(LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT_FATAL(ll_test_util_num_txs > 0);
+
+    anchor = ll_test_util_txs[0].start_time;
+    while ((int32_t)(anchor - cputime_get32()) < 1000) {
+        anchor += LL_CONN_TEST_ITVL_USECS;
+    }
+    ll_test_util_run(anchor - cputime_get32() - 500);
+    ll_test_util_num_txs = 0;
+    ll_test_util_clear_evs();
+
+    return anchor;
+}
+
+/* Number of frames the master sent in the event at the anchor point */
+static int
+ll_conn_test_event_txs(uint32_t anchor, struct ll_test_util_tx **last)
+{
+    struct ll_test_util_tx *tx;
+    int num;
+    int i;
+
+    num = 0;
+    for (i = 0; i < ll_test_util_num_txs; i++) {
+        tx = ll_test_util_txs + i;
+        if ((int32_t)(tx->start_time - anchor) >= 0 &&
+            (int32_t)(tx->start_time - anchor) < LL_CONN_TEST_ITVL_USECS) {
+            if (last != NULL) {
+                *last = tx;
+            }
+            num++;
+        }
+    }
+
+    return num;
+}
+
+TEST_CASE(ll_conn_test_case_ack)
+{
+    struct ll_test_util_tx *tx;
+    int sn;
+    int i;
+
+    ll_conn_test_connect(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+
+    ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    ll_conn_test_peer.data_left = 1;
+    ll_test_util_run(4 * LL_CONN_TEST_ITVL_USECS);
+
+    /* Each side got the other's data once, and the host its buffer back */
+    TEST_ASSERT(ll_conn_test_peer.rx_data_pdus == 1);
+    TEST_ASSERT(ll_conn_test_peer.rx_data_bytes == LL_CONN_TEST_ACL_LEN);
+    TEST_ASSERT(ll_conn_test_peer.seq_errs == 0);
+    TEST_ASSERT(ll_conn_test_peer.rx_dups == 0);
+    TEST_ASSERT(ll_test_util_num_acl == 1);
+    TEST_ASSERT(ll_conn_test_num_comp_pkts() == 1);
+    TEST_ASSERT(g_ble_ll_conn_stats.tx_retransmits == 0);
+    TEST_ASSERT(g_ble_ll_conn_stats.rx_dup_pdus == 0);
+
+    /*
+     * Every PDU is acknowledged and every PDU of the peer is new, so SN and
+     * NESN of the master both toggle from one PDU to the next.
+     */
+    TEST_ASSERT_FATAL(ll_test_util_num_txs >= 4);
+    sn = !!(ll_test_util_txs[0].pdu[0] & BLE_LL_DATA_HDR_SN_MASK);
+    for (i = 0; i < ll_test_util_num_txs; i++) {
+        tx = ll_test_util_txs + i;
+        TEST_ASSERT(tx->access_addr == ll_conn_test_peer.access_addr);
+        TEST_ASSERT(!!(tx->pdu[0] & BLE_LL_DATA_HDR_SN_MASK) == sn);
+        TEST_ASSERT(!!(tx->pdu[0] & BLE_LL_DATA_HDR_NESN_MASK) == sn);
+        sn ^= 1;
+    }
+}
+
+TEST_CASE(ll_conn_test_case_num_comp_retry)
+{
+    ll_conn_test_connect(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+
+    /* The host cannot be told about the packets the peer acknowledged */
+    ll_test_util_event_send_rc = -1;
+    ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    ll_test_util_run(4 * LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT(ll_conn_test_peer.rx_data_pdus == 2);
+    TEST_ASSERT(ll_conn_test_num_comp_pkts() == 0);
+
+    /* They are reported at the end of a later event, once only */
+    ll_test_util_event_send_rc = 0;
+    ll_test_util_run(4 * LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT(ll_conn_test_num_comp_pkts() == 2);
+    TEST_ASSERT(ll_conn_test_peer.seq_errs == 0);
+}
+
+TEST_CASE(ll_conn_test_case_retransmit)
+{
+    struct ll_test_util_tx *first;
+    struct ll_test_util_tx *tx;
+    int num;
+    int i;
+
+    ll_conn_test_connect(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+
+    /* The peer does not acknowledge the data twice */
+    ll_conn_test_peer.nak = 2;
+    ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    ll_test_util_run(6 * LL_CONN_TEST_ITVL_USECS);
+
+    /* The same PDU, with the same SN, went out three times */
+    num = 0;
+    first = NULL;
+    for (i = 0; i < ll_test_util_num_txs; i++) {
+        tx = ll_test_util_txs + i;
+        if (tx->pdu[1] != LL_CONN_TEST_ACL_LEN) {
+            continue;
+        }
+        if (first == NULL) {
+            first = tx;
+        }
+        TEST_ASSERT((tx->pdu[0] & BLE_LL_DATA_HDR_SN_MASK) ==
+                    (first->pdu[0] & BLE_LL_DATA_HDR_SN_MASK));
+        TEST_ASSERT(memcmp(tx->pdu + BLE_LL_PDU_HDR_LEN,
+                           first->pdu + BLE_LL_PDU_HDR_LEN,
+                           LL_CONN_TEST_ACL_LEN) == 0);
+        num++;
+    }
+    TEST_ASSERT(num == 3);
+    TEST_ASSERT(g_ble_ll_conn_stats.tx_retransmits == 2);
+    TEST_ASSERT(ll_conn_test_peer.rx_data_pdus == 1);
+    TEST_ASSERT(ll_conn_test_peer.seq_errs == 0);
+    TEST_ASSERT(ll_conn_test_num_comp_pkts() == 1);
+
+    /*
+     * The peer misses the acknowledgement of its data and sends it again:
+     * the master drops the copy.
+     */
+    ll_test_util_clear_evs();
+    ll_conn_test_peer.data_left = 1;
+    ll_conn_test_peer.ignore_ack = 1;
+    ll_test_util_run(4 * LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT(ll_conn_test_peer.ignore_ack == 0);
+    TEST_ASSERT(g_ble_ll_conn_stats.rx_dup_pdus == 1);
+    TEST_ASSERT(ll_test_util_num_acl == 1);
+}
+
+TEST_CASE(ll_conn_test_case_md)
+{
+    struct ll_test_util_tx *last;
+    struct ll_test_util_tx *tx;
+    uint32_t anchor;
+    int num;
+    int i;
+
+    ll_conn_test_connect(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+
+    /* Three packets queued before an event all go in that event */
+    anchor = ll_conn_test_run_to_anchor();
+    for (i = 0; i < 3; i++) {
+        ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    }
+    ll_test_util_run(LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT(ll_conn_test_event_txs(anchor, NULL) == 3);
+    for (i = 0; i < 3; i++) {
+        tx = ll_test_util_txs + i;
+        TEST_ASSERT(tx->pdu[1] == LL_CONN_TEST_ACL_LEN);
+        TEST_ASSERT(!!(tx->pdu[0] & BLE_LL_DATA_HDR_MD_MASK) == (i < 2));
+    }
+    TEST_ASSERT(ll_conn_test_num_comp_pkts() == 3);
+    TEST_ASSERT(ll_conn_test_peer.rx_data_pdus == 3);
+
+    /* The master keeps the event open while the peer has more data */
+    anchor = ll_conn_test_run_to_anchor();
+    ll_conn_test_peer.data_left = 5;
+    ll_test_util_run(LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT(ll_conn_test_event_txs(anchor, NULL) == 5);
+    TEST_ASSERT(ll_test_util_num_acl == 5);
+
+    /* With nothing to send, an event is one exchange */
+    anchor = ll_conn_test_run_to_anchor();
+    ll_test_util_run(4 * LL_CONN_TEST_ITVL_USECS);
+    for (i = 0; i < 4; i++) {
+        TEST_ASSERT(ll_conn_test_event_txs(anchor, NULL) == 1);
+        anchor += LL_CONN_TEST_ITVL_USECS;
+    }
+
+    /*
+     * A peer that always has more data gets the whole interval, but the
+     * event is over before the next anchor point.
+     */
+    anchor = ll_conn_test_run_to_anchor();
+    ll_conn_test_peer.data_left = 1000;
+    ll_test_util_run(LL_CONN_TEST_ITVL_USECS);
+    num = ll_conn_test_event_txs(anchor, &last);
+    TEST_ASSERT(num > 20);
+    TEST_ASSERT((int32_t)(last->end_time + BLE_LL_IFS +
+                          ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN +
+                                             LL_CONN_TEST_PEER_LEN) -
+                          (anchor + LL_CONN_TEST_ITVL_USECS)) < 0);
+    TEST_ASSERT(ll_conn_test_peer.seq_errs == 0);
+}
+
+TEST_CASE(ll_conn_test_case_spvn_tmo)
+{
+    struct ll_test_util_tx *tx;
+    uint32_t last_rx;
+    uint32_t time;
+    uint8_t *b;
+    int i;
+
+    ll_conn_test_connect(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+
+    /* A connection whose peer answers stays up */
+    ll_test_util_run(3 * LL_CONN_TEST_SPVN_TMO_USECS);
+    TEST_ASSERT(ll_conn_test_ev_find(BLE_HCI_EVCODE_DISCNXN_CMP, 0,
+                                     NULL) == NULL);
+
+    /* It is lost once the peer has not been heard for the timeout */
+    ll_conn_test_peer.silent = 1;
+    last_rx = ll_conn_test_peer.last_tx_end;
+    ll_test_util_num_txs = 0;
+    ll_test_util_run(3 * LL_CONN_TEST_SPVN_TMO_USECS);
+
+    time = 0;
+    b = ll_conn_test_ev_find(BLE_HCI_EVCODE_DISCNXN_CMP, 0, &time);
+    TEST_ASSERT_FATAL(b != NULL);
+    TEST_ASSERT(le16toh(b + 3) == ll_conn_test_handle);
+    TEST_ASSERT(b[5] == BLE_ERR_CONN_TMO);
+    TEST_ASSERT(time - last_rx >= LL_CONN_TEST_SPVN_TMO_USECS);
+    TEST_ASSERT(time - last_rx <=
+                LL_CONN_TEST_SPVN_TMO_USECS + LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT(g_ble_ll_conn_stats.supervision_tmos == 1);
+
+    /* The master kept trying until then, and stopped */
+    TEST_ASSERT(ll_test_util_num_txs >= 3);
+    for (i = 0; i < ll_test_util_num_txs; i++) {
+        tx = ll_test_util_txs + i;
+        TEST_ASSERT((int32_t)(tx->start_time - time) < 0);
+    }
+}
+
+TEST_CASE(ll_conn_test_case_reset)
+{
+    int num_free;
+    int rc;
+
+    ll_test_util_init();
+    num_free = g_mbuf_pool.omp_pool->mp_num_free;
+    ll_conn_test_create(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+
+    /* The peer never acknowledges, so the data is still queued */
+    ll_conn_test_peer.nak = 1000;
+    ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    ll_test_util_run(2 * LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT_FATAL(ll_test_util_num_txs > 0);
+
+    rc = ll_test_util_cmd(BLE_HCI_OGF_CTLR_BASEBAND, BLE_HCI_OCF_CB_RESET,
+                          NULL, 0);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+    ll_test_util_clear_evs();
+    ll_test_util_num_txs = 0;
+    ll_test_util_run(3 * LL_CONN_TEST_SPVN_TMO_USECS);
+
+    /* The connection is gone silently, and so is its data */
+    TEST_ASSERT(ll_test_util_num_txs == 0);
+    TEST_ASSERT(ll_test_util_num_evs == 0);
+
+    /* All buffers are back, but for the one the PHY keeps for receiving */
+    TEST_ASSERT(g_mbuf_pool.omp_pool->mp_num_free >= num_free - 1);
+
+    /* A new connection works */
+    ll_conn_test_create(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+    ll_conn_test_acl_send(LL_CONN_TEST_ACL_LEN);
+    ll_test_util_run(4 * LL_CONN_TEST_ITVL_USECS);
+    TEST_ASSERT(ll_conn_test_peer.rx_data_pdus == 1);
+    TEST_ASSERT(ll_conn_test_peer.seq_errs == 0);
+    TEST_ASSERT(ll_conn_test_num_comp_pkts() == 1);
+}
+
+static int
+ll_conn_test_item_cb(struct ll_sched_item *sch)
+{
+    ll_conn_test_item_time = cputime_get32();
+    return BLE_LL_SCHED_STATE_DONE;
+}
+
+TEST_CASE(ll_conn_test_case_ev_end)
+{
+    struct ll_test_util_tx *last;
+    struct ll_sched_item *sch;
+    uint32_t deferred;
+    uint32_t anchor;
+    uint32_t start;
+    int num;
+    int rc;
+
+    ll_conn_test_connect(LL_CONN_TEST_ITVL, LL_CONN_TEST_SPVN_TMO);
+
+    /*
+     * Another connection's event starts 5 ms into an event in which the
+     * peer always has more data.
+     */
+    anchor = ll_conn_test_run_to_anchor();
+    start = anchor + 5000;
+    sch = ll_sched_get_item();
+    TEST_ASSERT_FATAL(sch != NULL);
+    sch->sched_type = BLE_LL_SCHED_TYPE_CONN;
+    sch->sched_prio = BLE_LL_SCHED_PRIO_CONN;
+    sch->preempt_cb = NULL;
+    sch->start_time = start;
+    sch->end_time = start + 1000;
+    sch->cb_arg = NULL;
+    sch->sched_cb = ll_conn_test_item_cb;
+    rc = ll_sched_add(sch);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    deferred = g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].deferred;
+    ll_conn_test_item_time = 0;
+    ll_conn_test_peer.data_left = 1000;
+    ll_test_util_run(2 * LL_CONN_TEST_ITVL_USECS);
+
+    /*
+     * The event went on as long as it could and was over, the peer's last
+     * PDU included, before the other event was due. That one ran on time.
+     */
+    num = ll_conn_test_event_txs(anchor, &last);
+    TEST_ASSERT(num >= 3);
+    TEST_ASSERT((int32_t)(last->end_time + BLE_LL_IFS +
+                          ll_pdu_tx_time_get(BLE_LL_PDU_HDR_LEN +
+                                             LL_CONN_TEST_PEER_LEN) -
+                          start) <= 0);
+    TEST_ASSERT((int32_t)(start - last->end_time) < 2000);
+    TEST_ASSERT(ll_conn_test_item_time == start);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].deferred == deferred);
+
+    /* The connection carries on at the next anchor point */
+    TEST_ASSERT(ll_conn_test_event_txs(anchor + LL_CONN_TEST_ITVL_USECS,
+                                       NULL) > 0);
+    TEST_ASSERT(ll_conn_test_peer.seq_errs == 0);
+}
+
+/**
+ * Sustained goodput to the peer, in kbps, over the given interval and data
+ * length. The host keeps all the controller's ACL buffers full with packets
+ * of the largest size the controller takes in one PDU.
+ */
+static uint32_t
+ll_conn_test_goodput(uint16_t itvl, uint16_t octets)
+{
+    uint8_t params[6];
+    uint32_t usecs;
+    uint32_t start;
+    int acl_len;
+    int in_flight;
+    int done;
+    int rc;
+
+    ll_conn_test_connect(itvl, 100);
+    ll_conn_test_peer.max_octets = octets;
+    if (octets != BLE_LL_CONN_SUPP_BYTES_MIN) {
+        htole16(params, ll_conn_test_handle);
+        htole16(params + 2, octets);
+        htole16(params + 4, (octets + 14) * 8);
+        rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_DATA_LEN,
+                              params, sizeof params);
+        TEST_ASSERT_FATAL(rc == 0);
+        ll_test_util_run(4 * itvl * BLE_LL_CONN_ITVL_USECS);
+    }
+
+    acl_len = BLE_LL_CONN_SUPP_BYTES_MAX - 4;
+    in_flight = 0;
+    done = 0;
+    usecs = 2000000;
+    start = cputime_get32();
+    ll_conn_test_peer.rx_data_bytes = 0;
+    while ((int32_t)(cputime_get32() - start) < (int32_t)usecs) {
+        while (in_flight < BLE_LL_CFG_NUM_ACL_DATA_PKTS) {
+            ll_conn_test_acl_send(acl_len);
+            in_flight++;
+        }
+        ll_test_util_run(1000);
+
+        done = ll_conn_test_num_comp_pkts();
+        in_flight -= done;
+        ll_test_util_clear_evs();
+    }
+
+    TEST_ASSERT(ll_conn_test_peer.seq_errs == 0);
+    TEST_ASSERT(ll_conn_test_peer.rx_data_bytes > 0);
+
+    return ll_conn_test_peer.rx_data_bytes * 8 / (usecs / 1000);
+}
+
+TEST_CASE(ll_conn_test_case_bench)
+{
+    static const uint16_t itvls[] = { 0x0006, 0x0018 };
+    static const uint16_t octets[] = { BLE_LL_CONN_SUPP_BYTES_MIN,
+                                       BLE_LL_CONN_SUPP_BYTES_MAX };
+    uint32_t kbps[2][2];
+    int i;
+    int j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            kbps[i][j] = ll_conn_test_goodput(itvls[i], octets[j]);
+        }
+    }
+
+    /* Longer PDUs can only help */
+    for (i = 0; i < 2; i++) {
+        TEST_ASSERT(kbps[i][1] >= kbps[i][0]);
+    }
+
+    printf("LL connection goodput, kbps:");
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            printf(" %u.%02u ms/%u octets %u",
+                   itvls[i] * BLE_LL_CONN_ITVL_USECS / 1000,
+                   (itvls[i] * BLE_LL_CONN_ITVL_USECS % 1000) / 10,
+                   octets[j], (unsigned)kbps[i][j]);
+        }
+    }
+    printf("\n");
+}
+
+TEST_SUITE(ll_conn_test_suite)
+{
+    ll_conn_test_case_ack();
+    ll_conn_test_case_num_comp_retry();
+    ll_conn_test_case_retransmit();
+    ll_conn_test_case_md();
+    ll_conn_test_case_spvn_tmo();
+    ll_conn_test_case_reset();
+    ll_conn_test_case_ev_end();
+}
+
+TEST_SUITE(ll_conn_bench_suite)
+{
+    ll_conn_test_case_bench();
+}
@@ -0,0 +1,291 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+#include "testutil/testutil.h"
+#include "os/os.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "controller/ll.h"
+#include "controller/ll_hci.h"
+#include "ll_test_priv.h"
+
+/*
+ * The HCI commands a stock host sends before anything else: reset, the
+ * informational parameters and the event masks.
+ */
+
+/* A command, and its bit in the supported commands (Vol 2 Part E 6.27) */
+struct ll_hci_test_cmd
+{
+    uint8_t octet;
+    uint8_t bit;
+    uint8_t ogf;
+    uint16_t ocf;
+};
+
+static const struct ll_hci_test_cmd ll_hci_test_cmds[] =
+{
+    { 0, 5, BLE_HCI_OGF_LINK_CTRL, BLE_HCI_OCF_DISCONNECT_CMD },
+    { 5, 6, BLE_HCI_OGF_CTLR_BASEBAND, BLE_HCI_OCF_CB_SET_EVENT_MASK },
+    { 5, 7, BLE_HCI_OGF_CTLR_BASEBAND, BLE_HCI_OCF_CB_RESET },
+    { 14, 3, BLE_HCI_OGF_INFO_PARAMS, BLE_HCI_OCF_IP_RD_LOCAL_VER },
+    { 14, 5, BLE_HCI_OGF_INFO_PARAMS, BLE_HCI_OCF_IP_RD_LOC_SUPP_FEAT },
+    { 15, 1, BLE_HCI_OGF_INFO_PARAMS, BLE_HCI_OCF_IP_RD_BD_ADDR },
+    { 25, 0, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EVENT_MASK },
+    { 25, 1, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_RD_BUF_SIZE },
+    { 25, 4, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_RAND_ADDR },
+    { 25, 5, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_PARAMS },
+    { 25, 6, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_RD_ADV_CHAN_TXPWR },
+    { 25, 7, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_DATA },
+    { 26, 0, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_RSP_DATA },
+    { 26, 1, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_ENABLE },
+    { 26, 2, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_PARAMS },
+    { 26, 3, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_ENABLE },
+    { 26, 4, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_CREATE_CNXN },
+    { 26, 5, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_CREATE_CNXN_CANCEL },
+    { 33, 6, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_DATA_LEN },
+    { 33, 7, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_RD_SUGG_DEF_DATA_LEN },
+    { 34, 0, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_WR_SUGG_DEF_DATA_LEN },
+    { 35, 3, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_RD_MAX_DATA_LEN },
+    { 36, 1, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_SET_RAND_ADDR },
+    { 36, 2, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_ADV_PARAMS },
+    { 36, 3, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_ADV_DATA },
+    { 36, 4, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_SCAN_RSP_DATA },
+    { 36, 5, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_ADV_ENABLE },
+    { 36, 6, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_RD_MAX_ADV_DATA_LEN },
+    { 36, 7, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_RD_NUM_ADV_SETS },
+    { 37, 0, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_REMOVE_ADV_SET },
+    { 37, 1, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_CLEAR_ADV_SETS },
+    { 37, 2, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_PER_ADV_PARAMS },
+    { 37, 3, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_PER_ADV_DATA },
+    { 37, 4, BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_PER_ADV_ENABLE },
+};
+
+#define LL_HCI_TEST_NUM_CMDS    \
+    (sizeof ll_hci_test_cmds / sizeof ll_hci_test_cmds[0])
+
+/*
+ * Sends a command without parameters and returns the parameters of its
+ * command complete event (after the status), checking their length.
+ */
+static uint8_t *
+ll_hci_test_rd(uint8_t ogf, uint16_t ocf, int rsplen)
+{
+    uint8_t *b;
+    int rc;
+
+    rc = ll_test_util_cmd(ogf, ocf, NULL, 0);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+
+    b = ll_test_util_evs[ll_test_util_num_evs - 1].buf;
+    TEST_ASSERT_FATAL(b[0] == BLE_HCI_EVCODE_COMMAND_COMPLETE);
+    TEST_ASSERT(b[1] == 4 + rsplen);
+    TEST_ASSERT(ll_test_util_evs[ll_test_util_num_evs - 1].len ==
+                BLE_HCI_EVENT_HDR_LEN + 4 + rsplen);
+
+    return b + BLE_HCI_EVENT_CMD_COMPLETE_HDR_LEN;
+}
+
+/* Enables advertising set 0, advertising every 20 ms without data */
+static void
+ll_hci_test_ext_adv_start(void)
+{
+    uint8_t params[BLE_HCI_SET_EXT_ADV_PARAM_LEN];
+    int rc;
+
+    memset(params, 0, sizeof params);
+    htole16(params + 1, 0);
+    htole16(params + 3, 32);
+    htole16(params + 6, 32);
+    params[9] = BLE_HCI_ADV_CHANMASK_DEF;
+    params[10] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    params[19] = BLE_HCI_ADV_TXPWR_NO_PREF;
+    params[20] = BLE_HCI_ADV_PHY_1M;
+    params[22] = BLE_HCI_ADV_PHY_1M;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_ADV_PARAMS,
+                          params, sizeof params);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+
+    memset(params, 0, sizeof params);
+    params[0] = 1;
+    params[1] = 1;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EXT_ADV_ENABLE,
+                          params, BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN +
+                                  BLE_HCI_SET_EXT_ADV_ENABLE_SET_LEN);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+}
+
+TEST_CASE(ll_hci_test_case_info)
+{
+    uint8_t *rsp;
+
+    ll_test_util_init();
+
+    rsp = ll_hci_test_rd(BLE_HCI_OGF_INFO_PARAMS, BLE_HCI_OCF_IP_RD_LOCAL_VER,
+                         BLE_HCI_RD_LOC_VER_INFO_RSPLEN);
+    TEST_ASSERT(rsp[0] == BLE_HCI_VER_BCS_5_0);
+    TEST_ASSERT(rsp[3] == BLE_LMP_VER_BCS_5_0);
+
+    rsp = ll_hci_test_rd(BLE_HCI_OGF_INFO_PARAMS, BLE_HCI_OCF_IP_RD_BD_ADDR,
+                         BLE_HCI_RD_BD_ADDR_RSPLEN);
+    TEST_ASSERT(memcmp(rsp, g_dev_addr, BLE_DEV_ADDR_LEN) == 0);
+
+    /* LE supported (controller), BR/EDR not supported */
+    rsp = ll_hci_test_rd(BLE_HCI_OGF_INFO_PARAMS,
+                         BLE_HCI_OCF_IP_RD_LOC_SUPP_FEAT,
+                         BLE_HCI_RD_LOC_SUPP_FEAT_RSPLEN);
+    TEST_ASSERT(rsp[4] == 0x60);
+
+    /* Parameters are not expected */
+    TEST_ASSERT(ll_test_util_cmd(BLE_HCI_OGF_INFO_PARAMS,
+                                 BLE_HCI_OCF_IP_RD_BD_ADDR, g_dev_addr, 1) ==
+                BLE_ERR_INV_HCI_CMD_PARMS);
+}
+
+TEST_CASE(ll_hci_test_case_supp_cmds)
+{
+    uint8_t expected[BLE_HCI_RD_LOC_SUPP_CMD_RSPLEN];
+    const struct ll_hci_test_cmd *cmd;
+    uint8_t *rsp;
+    int rc;
+    int i;
+
+    ll_test_util_init();
+
+    /* The commands we say we support are the ones handled */
+    memset(expected, 0, sizeof expected);
+    for (i = 0; i < LL_HCI_TEST_NUM_CMDS; i++) {
+        cmd = ll_hci_test_cmds + i;
+        expected[cmd->octet] |= 1 << cmd->bit;
+    }
+    rsp = ll_hci_test_rd(BLE_HCI_OGF_INFO_PARAMS,
+                         BLE_HCI_OCF_IP_RD_LOC_SUPP_CMD,
+                         BLE_HCI_RD_LOC_SUPP_CMD_RSPLEN);
+    TEST_ASSERT(memcmp(rsp, expected, sizeof expected) == 0);
+
+    for (i = 0; i < LL_HCI_TEST_NUM_CMDS; i++) {
+        cmd = ll_hci_test_cmds + i;
+        rc = ll_test_util_cmd(cmd->ogf, cmd->ocf, NULL, 0);
+        TEST_ASSERT(rc >= 0);
+        TEST_ASSERT(rc != BLE_ERR_UNKNOWN_HCI_CMD);
+    }
+
+    /* The others are unknown, whatever their group */
+    TEST_ASSERT(ll_test_util_cmd(BLE_HCI_OGF_CTLR_BASEBAND,
+                                 BLE_HCI_OCF_CB_SET_EV_FILT, NULL, 0) ==
+                BLE_ERR_UNKNOWN_HCI_CMD);
+    TEST_ASSERT(ll_test_util_cmd(BLE_HCI_OGF_LE,
+                                 BLE_HCI_OCF_LE_RD_WHITE_LIST_SIZE, NULL, 0) ==
+                BLE_ERR_UNKNOWN_HCI_CMD);
+    TEST_ASSERT(ll_test_util_cmd(BLE_HCI_OGF_STATUS_PARAMS, 1, NULL, 0) ==
+                BLE_ERR_UNKNOWN_HCI_CMD);
+}
+
+TEST_CASE(ll_hci_test_case_event_mask)
+{
+    uint8_t mask[BLE_HCI_SET_EVENT_MASK_LEN];
+    int rc;
+
+    ll_test_util_init();
+    TEST_ASSERT(ble_ll_hci_is_event_enabled(BLE_HCI_EVCODE_DISCNXN_CMP - 1));
+
+    memset(mask, 0xff, sizeof mask);
+    mask[0] &= ~(1 << (BLE_HCI_EVCODE_DISCNXN_CMP - 1));
+    rc = ll_test_util_cmd(BLE_HCI_OGF_CTLR_BASEBAND,
+                          BLE_HCI_OCF_CB_SET_EVENT_MASK, mask, sizeof mask);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+    TEST_ASSERT(!ble_ll_hci_is_event_enabled(BLE_HCI_EVCODE_DISCNXN_CMP - 1));
+    TEST_ASSERT(ble_ll_hci_is_event_enabled(63));
+
+    memset(mask, 0, sizeof mask);
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_EVENT_MASK,
+                          mask, sizeof mask);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+    TEST_ASSERT(!ble_ll_hci_is_le_event_enabled(0));
+
+    /* The wrong length is rejected; the mask does not change */
+    rc = ll_test_util_cmd(BLE_HCI_OGF_CTLR_BASEBAND,
+                          BLE_HCI_OCF_CB_SET_EVENT_MASK, mask, 4);
+    TEST_ASSERT(rc == BLE_ERR_INV_HCI_CMD_PARMS);
+    TEST_ASSERT(ble_ll_hci_is_event_enabled(63));
+
+    /* Reset restores the defaults */
+    rc = ll_test_util_cmd(BLE_HCI_OGF_CTLR_BASEBAND, BLE_HCI_OCF_CB_RESET,
+                          NULL, 0);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+    TEST_ASSERT(ble_ll_hci_is_event_enabled(BLE_HCI_EVCODE_DISCNXN_CMP - 1));
+    TEST_ASSERT(!ble_ll_hci_is_event_enabled(63));
+    TEST_ASSERT(ble_ll_hci_is_le_event_enabled(0));
+}
+
+TEST_CASE(ll_hci_test_case_reset_adv)
+{
+    uint8_t rand_addr[BLE_DEV_ADDR_LEN] = { 1, 2, 3, 4, 5, 0xc6 };
+    uint8_t enable;
+    int num_free;
+    int rc;
+
+    ll_test_util_init();
+    num_free = g_mbuf_pool.omp_pool->mp_num_free;
+
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_RAND_ADDR,
+                          rand_addr, sizeof rand_addr);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+
+    /* Legacy advertising and an advertising set */
+    enable = 1;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_ENABLE,
+                          &enable, BLE_HCI_SET_ADV_ENABLE_LEN);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+    ll_hci_test_ext_adv_start();
+    ll_test_util_run(100000);
+    TEST_ASSERT_FATAL(ll_test_util_num_txs > 0);
+
+    rc = ll_test_util_cmd(BLE_HCI_OGF_CTLR_BASEBAND, BLE_HCI_OCF_CB_RESET,
+                          NULL, 0);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+    TEST_ASSERT(g_ll_data.ll_state == BLE_LL_STATE_STANDBY);
+    ll_test_util_clear_evs();
+    ll_test_util_num_txs = 0;
+    ll_test_util_run(100000);
+
+    /* Nothing is sent; the set and the random address are gone */
+    TEST_ASSERT(ll_test_util_num_txs == 0);
+    TEST_ASSERT(ll_test_util_num_evs == 0);
+    TEST_ASSERT(memcmp(g_random_addr, "\0\0\0\0\0\0", BLE_DEV_ADDR_LEN) == 0);
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_REMOVE_ADV_SET,
+                          "\0", 1);
+    TEST_ASSERT(rc == BLE_ERR_UNK_ADV_IDENT);
+
+    /* All buffers are back, but for the one the PHY keeps for receiving */
+    TEST_ASSERT(g_mbuf_pool.omp_pool->mp_num_free >= num_free - 1);
+
+    /* Advertising starts again */
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_ENABLE,
+                          &enable, BLE_HCI_SET_ADV_ENABLE_LEN);
+    TEST_ASSERT_FATAL(rc == BLE_ERR_SUCCESS);
+    ll_hci_test_ext_adv_start();
+    ll_test_util_run(100000);
+    TEST_ASSERT(ll_test_util_num_txs > 0);
+}
+
+TEST_SUITE(ll_hci_test_suite)
+{
+    ll_hci_test_case_info();
+    ll_hci_test_case_supp_cmds();
+    ll_hci_test_case_event_mask();
+    ll_hci_test_case_reset_adv();
+}
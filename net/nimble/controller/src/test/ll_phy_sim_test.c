@@ -0,0 +1,311 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "testutil/testutil.h"
+#include "hal/hal_cputime.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "controller/ll.h"
+#include "controller/ll_adv.h"
+#include "controller/phy_sim.h"
+#include "ll_test_priv.h"
+
+/*
+ * Advertising and scanning over the simulated PHY, with the test playing the
+ * peer device.
+ */
+
+/* 100 ms, in 0.625 ms units */
+#define LL_PHY_SIM_TEST_ITVL        (0x00A0)
+
+/* The advertiser uses the maximum interval: 110 ms */
+#define LL_PHY_SIM_TEST_ADV_ITVL_MAX    (0x00B0)
+#define LL_PHY_SIM_TEST_ADV_ITVL_USECS  (110000)
+
+static uint8_t ll_phy_sim_test_peer_addr[BLE_DEV_ADDR_LEN] =
+{
+    0x11, 0x22, 0x33, 0x44, 0x55, 0x66
+};
+
+/* When the peer's advertising PDUs end */
+#define LL_PHY_SIM_TEST_MAX_ADVS    (32)
+static uint32_t ll_phy_sim_test_adv_ends[LL_PHY_SIM_TEST_MAX_ADVS];
+static int ll_phy_sim_test_num_advs;
+
+/* Scan requests answered, or sent, by the peer */
+static int ll_phy_sim_test_num_reqs;
+
+static void
+ll_phy_sim_test_set_scan(uint8_t scan_type)
+{
+    uint8_t params[7];
+    int rc;
+
+    params[0] = scan_type;
+    htole16(params + 1, LL_PHY_SIM_TEST_ITVL);
+    htole16(params + 3, LL_PHY_SIM_TEST_ITVL);
+    params[5] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    params[6] = BLE_HCI_SCAN_FILT_NO_WL;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_PARAMS,
+                          params, sizeof params);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    params[0] = 1;
+    params[1] = 0;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_ENABLE,
+                          params, 2);
+    TEST_ASSERT_FATAL(rc == 0);
+}
+
+/**
+ * The peer advertises once on each advertising channel, leaving room after
+ * each PDU for a scan request and response.
+ */
+static void
+ll_phy_sim_test_peer_adv(uint8_t pdu_type)
+{
+    uint8_t pdu[2 + BLE_DEV_ADDR_LEN + 8];
+    uint32_t start;
+    int rc;
+    int i;
+
+    pdu[0] = pdu_type;
+    pdu[1] = BLE_DEV_ADDR_LEN + 8;
+    memcpy(pdu + 2, ll_phy_sim_test_peer_addr, BLE_DEV_ADDR_LEN);
+    memset(pdu + 2 + BLE_DEV_ADDR_LEN, 0xa5, 8);
+
+    start = cputime_get32() + 1000;
+    for (i = 0; i < 3; i++) {
+        rc = ble_phy_sim_rx_frame(BLE_PHY_ADV_CHAN_START + i,
+                                  BLE_ACCESS_ADDR_ADV, start, pdu, sizeof pdu,
+                                  0);
+        TEST_ASSERT_FATAL(rc == 0);
+        start += ll_pdu_tx_time_get(sizeof pdu);
+
+        TEST_ASSERT_FATAL(ll_phy_sim_test_num_advs < LL_PHY_SIM_TEST_MAX_ADVS);
+        ll_phy_sim_test_adv_ends[ll_phy_sim_test_num_advs++] = start;
+        start += 1000;
+    }
+}
+
+static int
+ll_phy_sim_test_adv_ended(uint32_t time)
+{
+    int i;
+
+    for (i = 0; i < ll_phy_sim_test_num_advs; i++) {
+        if (ll_phy_sim_test_adv_ends[i] == time) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* The peer answers scan requests for its address */
+static void
+ll_phy_sim_test_scan_rsp_cb(uint8_t chan, uint32_t access_addr,
+                            uint32_t start_time, uint32_t end_time,
+                            uint8_t *pdu, int len, int8_t txpwr_dbm)
+{
+    uint8_t rsp[2 + BLE_DEV_ADDR_LEN + 4];
+
+    if ((pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) != BLE_ADV_PDU_TYPE_SCAN_REQ ||
+        memcmp(pdu + 2 + BLE_DEV_ADDR_LEN, ll_phy_sim_test_peer_addr,
+               BLE_DEV_ADDR_LEN) != 0) {
+        return;
+    }
+
+    rsp[0] = BLE_ADV_PDU_TYPE_SCAN_RSP;
+    rsp[1] = BLE_DEV_ADDR_LEN + 4;
+    memcpy(rsp + 2, ll_phy_sim_test_peer_addr, BLE_DEV_ADDR_LEN);
+    memset(rsp + 2 + BLE_DEV_ADDR_LEN, 0x5a, 4);
+    ble_phy_sim_rx_frame(chan, access_addr, end_time + BLE_LL_IFS, rsp,
+                         sizeof rsp, 0);
+    ll_phy_sim_test_num_reqs++;
+}
+
+/* The peer scans: it sends a scan request after each scannable PDU */
+static void
+ll_phy_sim_test_scan_req_cb(uint8_t chan, uint32_t access_addr,
+                            uint32_t start_time, uint32_t end_time,
+                            uint8_t *pdu, int len, int8_t txpwr_dbm)
+{
+    uint8_t req[2 + 2 * BLE_DEV_ADDR_LEN];
+
+    if ((pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) != BLE_ADV_PDU_TYPE_ADV_SCAN_IND) {
+        return;
+    }
+
+    req[0] = BLE_ADV_PDU_TYPE_SCAN_REQ;
+    req[1] = 2 * BLE_DEV_ADDR_LEN;
+    memcpy(req + 2, ll_phy_sim_test_peer_addr, BLE_DEV_ADDR_LEN);
+    memcpy(req + 2 + BLE_DEV_ADDR_LEN, pdu + 2, BLE_DEV_ADDR_LEN);
+    ble_phy_sim_rx_frame(chan, access_addr, end_time + BLE_LL_IFS, req,
+                         sizeof req, 0);
+    ll_phy_sim_test_num_reqs++;
+}
+
+TEST_CASE(ll_phy_sim_test_passive_scan)
+{
+    int by_type[8];
+    int num;
+    int i;
+
+    ll_test_util_init();
+    ll_phy_sim_test_num_advs = 0;
+    ll_phy_sim_test_set_scan(BLE_HCI_SCAN_TYPE_PASSIVE);
+
+    for (i = 0; i < 10; i++) {
+        ll_phy_sim_test_peer_adv(BLE_ADV_PDU_TYPE_ADV_IND);
+        ll_test_util_run(20000);
+    }
+
+    /* Reports are batched; the last one goes out within the flush timeout */
+    ll_test_util_run(50000);
+
+    /* The scanner is on one channel at a time, so it hears one PDU of each
+     * advertising event.
+     */
+    memset(by_type, 0, sizeof by_type);
+    num = ll_test_util_adv_rpts(by_type);
+    TEST_ASSERT(num == 10);
+    TEST_ASSERT(by_type[BLE_HCI_ADV_RPT_EVTYPE_ADV_IND] == 10);
+
+    /* A passive scanner never transmits */
+    TEST_ASSERT(ll_test_util_num_txs == 0);
+}
+
+TEST_CASE(ll_phy_sim_test_active_scan)
+{
+    struct ll_test_util_tx *tx;
+    int by_type[8];
+    int i;
+
+    ll_test_util_init();
+    ll_phy_sim_test_num_advs = 0;
+    ll_phy_sim_test_num_reqs = 0;
+    ll_test_util_peer_cb = ll_phy_sim_test_scan_rsp_cb;
+    ll_phy_sim_test_set_scan(BLE_HCI_SCAN_TYPE_ACTIVE);
+
+    for (i = 0; i < 10; i++) {
+        ll_phy_sim_test_peer_adv(BLE_ADV_PDU_TYPE_ADV_SCAN_IND);
+        ll_test_util_run(20000);
+    }
+    ll_test_util_run(50000);
+
+    /* Each scan request starts one IFS after the end of the PDU it answers */
+    TEST_ASSERT_FATAL(ll_test_util_num_txs > 0);
+    for (i = 0; i < ll_test_util_num_txs; i++) {
+        tx = ll_test_util_txs + i;
+        TEST_ASSERT(tx->access_addr == BLE_ACCESS_ADDR_ADV);
+        TEST_ASSERT((tx->pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) ==
+                    BLE_ADV_PDU_TYPE_SCAN_REQ);
+        TEST_ASSERT(memcmp(tx->pdu + 2, g_dev_addr, BLE_DEV_ADDR_LEN) == 0);
+        TEST_ASSERT(ll_phy_sim_test_adv_ended(tx->start_time - BLE_LL_IFS));
+    }
+
+    /* Every advertising PDU heard is reported, and every scan response;
+     * once it has the response the scanner stops sending requests.
+     */
+    memset(by_type, 0, sizeof by_type);
+    ll_test_util_adv_rpts(by_type);
+    TEST_ASSERT(ll_phy_sim_test_num_reqs >= 1);
+    TEST_ASSERT(by_type[BLE_HCI_ADV_RPT_EVTYPE_SCAN_RSP] ==
+                ll_phy_sim_test_num_reqs);
+    TEST_ASSERT(by_type[BLE_HCI_ADV_RPT_EVTYPE_SCAN_IND] == 10);
+}
+
+TEST_CASE(ll_phy_sim_test_adv)
+{
+    struct ll_test_util_tx *tx;
+    struct ll_test_util_tx *rsp;
+    uint32_t ev_start;
+    uint8_t params[15];
+    int num_events;
+    int rc;
+    int i;
+
+    ll_test_util_init();
+    ll_phy_sim_test_num_reqs = 0;
+    ll_test_util_peer_cb = ll_phy_sim_test_scan_req_cb;
+
+    memset(params, 0, sizeof params);
+    htole16(params, LL_PHY_SIM_TEST_ITVL);
+    htole16(params + 2, LL_PHY_SIM_TEST_ADV_ITVL_MAX);
+    params[4] = BLE_HCI_ADV_TYPE_ADV_SCAN_IND;
+    params[5] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    params[13] = BLE_HCI_ADV_CHANMASK_DEF;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_PARAMS,
+                          params, sizeof params);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    params[0] = 1;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_ENABLE,
+                          params, 1);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    ll_test_util_run(350000);
+
+    /* Every advertising event is a scannable PDU on channel 37, 38 and 39,
+     * each answered by a scan response exactly one IFS after the request.
+     */
+    num_events = 0;
+    ev_start = 0;
+    for (i = 0; i + 1 < ll_test_util_num_txs; i += 2) {
+        tx = ll_test_util_txs + i;
+        rsp = tx + 1;
+
+        TEST_ASSERT(tx->chan == BLE_PHY_ADV_CHAN_START + (i / 2) % 3);
+        TEST_ASSERT((tx->pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) ==
+                    BLE_ADV_PDU_TYPE_ADV_SCAN_IND);
+        TEST_ASSERT(memcmp(tx->pdu + 2, g_dev_addr, BLE_DEV_ADDR_LEN) == 0);
+        TEST_ASSERT(tx->end_time - tx->start_time ==
+                    ll_pdu_tx_time_get(tx->len));
+
+        TEST_ASSERT((rsp->pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) ==
+                    BLE_ADV_PDU_TYPE_SCAN_RSP);
+        TEST_ASSERT(rsp->chan == tx->chan);
+        TEST_ASSERT(rsp->start_time ==
+                    tx->end_time + BLE_LL_IFS +
+                    ll_pdu_tx_time_get(2 + 2 * BLE_DEV_ADDR_LEN) +
+                    BLE_LL_IFS);
+
+        /* Events are at least the interval apart; the random delay added
+         * to each is at most 10 ms.
+         */
+        if (tx->chan == BLE_PHY_ADV_CHAN_START) {
+            if (num_events != 0) {
+                TEST_ASSERT(tx->start_time - ev_start >=
+                            LL_PHY_SIM_TEST_ADV_ITVL_USECS);
+                TEST_ASSERT(tx->start_time - ev_start <=
+                            LL_PHY_SIM_TEST_ADV_ITVL_USECS + 10000);
+            }
+            ev_start = tx->start_time;
+            num_events++;
+        }
+    }
+    TEST_ASSERT(num_events >= 3);
+    TEST_ASSERT(ll_phy_sim_test_num_reqs == ll_test_util_num_txs / 2);
+}
+
+TEST_SUITE(ll_phy_sim_test_suite)
+{
+    ll_phy_sim_test_passive_scan();
+    ll_phy_sim_test_active_scan();
+    ll_phy_sim_test_adv();
+}
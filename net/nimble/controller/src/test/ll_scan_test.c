@@ -0,0 +1,484 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "testutil/testutil.h"
+#include "os/os.h"
+#include "hal/hal_cputime.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "controller/ll.h"
+#include "controller/ll_adv.h"
+#include "controller/ll_scan.h"
+#include "ll_test_priv.h"
+
+/*
+ * The scanner's advertiser table, through duplicate filtering: an advertiser
+ * is reported once while it is in the table, and again once it has been
+ * replaced.
+ */
+
+#define LL_SCAN_TEST_SETS   \
+    (BLE_LL_SCAN_CFG_NUM_ADVS / BLE_LL_SCAN_CFG_ADV_WAYS)
+
+/* Enough advertisers to overflow any set of the table several times */
+#define LL_SCAN_TEST_MAX_ADDRS      (512)
+
+static uint8_t ll_scan_test_addrs[LL_SCAN_TEST_MAX_ADDRS][BLE_DEV_ADDR_LEN];
+
+static void
+ll_scan_test_addr(uint8_t *addr, int idx)
+{
+    addr[0] = idx;
+    addr[1] = idx >> 8;
+    addr[2] = 0x5a;
+    addr[3] = 0xa5;
+    addr[4] = 0x00;
+    addr[5] = 0xc0;
+}
+
+/**
+ * Fills ll_scan_test_addrs with num addresses that hash to the given set.
+ */
+static void
+ll_scan_test_addrs_in_set(int set, int num)
+{
+    int found;
+    int idx;
+
+    found = 0;
+    for (idx = 0; found < num; idx++) {
+        TEST_ASSERT_FATAL(idx < 0x10000);
+        ll_scan_test_addr(ll_scan_test_addrs[found], idx);
+        if (ble_ll_scan_adv_set_get(ll_scan_test_addrs[found], 0) == set) {
+            found++;
+        }
+    }
+}
+
+/* Starts a passive scan that filters duplicates */
+static void
+ll_scan_test_start(uint16_t itvl, uint16_t window)
+{
+    uint8_t params[7];
+    int rc;
+
+    ll_test_util_init();
+
+    params[0] = BLE_HCI_SCAN_TYPE_PASSIVE;
+    htole16(params + 1, itvl);
+    htole16(params + 3, window);
+    params[5] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    params[6] = BLE_HCI_SCAN_FILT_NO_WL;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_PARAMS,
+                          params, sizeof params);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    params[0] = 1;
+    params[1] = 1;
+    rc = ll_test_util_cmd(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_ENABLE,
+                          params, 2);
+    TEST_ASSERT_FATAL(rc == 0);
+    ll_test_util_clear_evs();
+}
+
+static void
+ll_scan_test_init(void)
+{
+    ll_scan_test_start(BLE_HCI_SCAN_ITVL_DEF, BLE_HCI_SCAN_ITVL_DEF);
+}
+
+/* Hands the scanner a received advertising PDU with data_len bytes of data */
+static void
+ll_scan_test_rx_data(uint8_t *addr, uint8_t pdu_type, uint8_t data_len)
+{
+    uint8_t pdu[BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN + BLE_ADV_DATA_MAX_LEN];
+
+    pdu[0] = pdu_type;
+    pdu[1] = BLE_DEV_ADDR_LEN + data_len;
+    memcpy(pdu + BLE_LL_PDU_HDR_LEN, addr, BLE_DEV_ADDR_LEN);
+    memset(pdu + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN, 0x33, data_len);
+    ble_ll_scan_rx_pdu_proc(pdu_type, pdu, -50);
+}
+
+static void
+ll_scan_test_rx(uint8_t *addr, uint8_t pdu_type)
+{
+    ll_scan_test_rx_data(addr, pdu_type, 4);
+}
+
+/* Returns the number of advertising report events sent to the host */
+static int
+ll_scan_test_rpt_evs(void)
+{
+    uint8_t *b;
+    int num;
+    int i;
+
+    num = 0;
+    for (i = 0; i < ll_test_util_num_evs; i++) {
+        b = ll_test_util_evs[i].buf;
+        if (b[0] == BLE_HCI_EVCODE_LE_META && b[2] == BLE_HCI_LE_SUBEV_ADV_RPT) {
+            TEST_ASSERT(b[1] <= BLE_HCI_EVENT_MAX_PARAM_LEN);
+            num++;
+        }
+    }
+
+    return num;
+}
+
+/* Returns the number of reports sent to the host since the last call */
+static int
+ll_scan_test_rpts(void)
+{
+    int num;
+
+    /* Let the pending report event go out */
+    ll_test_util_run(20000);
+
+    num = ll_test_util_adv_rpts(NULL);
+    ll_test_util_clear_evs();
+
+    return num;
+}
+
+TEST_CASE(ll_scan_test_case_hit)
+{
+    uint8_t *addr;
+    int i;
+
+    ll_scan_test_init();
+    addr = ll_scan_test_addrs[0];
+    ll_scan_test_addr(addr, 1);
+
+    TEST_ASSERT(!ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0, addr));
+    for (i = 0; i < 5; i++) {
+        ll_scan_test_rx(addr, BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+    TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0, addr));
+
+    /* The same address with the other address type is another advertiser */
+    TEST_ASSERT(!ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 1, addr));
+
+    /* Scan responses are filtered separately from advertising PDUs */
+    TEST_ASSERT(!ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_SCAN_RSP, 0, addr));
+    ll_scan_test_rx(addr, BLE_ADV_PDU_TYPE_SCAN_RSP);
+    ll_scan_test_rx(addr, BLE_ADV_PDU_TYPE_SCAN_RSP);
+    ll_scan_test_rx(addr, BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+    TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_SCAN_RSP, 0, addr));
+}
+
+TEST_CASE(ll_scan_test_case_lru)
+{
+    uint8_t (*addrs)[BLE_DEV_ADDR_LEN];
+    int i;
+
+    ll_scan_test_init();
+    addrs = ll_scan_test_addrs;
+    ll_scan_test_addrs_in_set(3, BLE_LL_SCAN_CFG_ADV_WAYS + 2);
+
+    /* Fill the set: 0, 1, 2, 3 from least to most recently used */
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_WAYS; i++) {
+        ll_scan_test_rx(addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    TEST_ASSERT(ll_scan_test_rpts() == BLE_LL_SCAN_CFG_ADV_WAYS);
+
+    /* Hearing 0 again makes it the most recent: 1, 2, 3, 0 */
+    ll_scan_test_rx(addrs[0], BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpts() == 0);
+
+    /* A new advertiser replaces the least recent: 2, 3, 0, 4 */
+    ll_scan_test_rx(addrs[4], BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+
+    /* The replaced advertiser is reported again, and replaces the next:
+     * 3, 0, 4, 1 and then 0, 4, 1, 2.
+     */
+    ll_scan_test_rx(addrs[1], BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+    ll_scan_test_rx(addrs[2], BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+
+    /* A lookup that misses changes nothing; hits in the same order keep
+     * the order.
+     */
+    TEST_ASSERT(!ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                        addrs[3]));
+    TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                       addrs[0]));
+    TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                       addrs[4]));
+    TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                       addrs[1]));
+    TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                       addrs[2]));
+
+    /* So the next new advertiser replaces 0 */
+    ll_scan_test_rx(addrs[5], BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+    TEST_ASSERT(!ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                        addrs[0]));
+    for (i = 1; i <= 5; i++) {
+        TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                           addrs[i]) == (i != 3));
+    }
+}
+
+TEST_CASE(ll_scan_test_case_full)
+{
+    uint8_t addrs[BLE_LL_SCAN_CFG_NUM_ADVS][BLE_DEV_ADDR_LEN];
+    uint8_t extra[BLE_DEV_ADDR_LEN];
+    int set;
+    int i;
+
+    ll_scan_test_init();
+
+    /* Exactly fill every set */
+    for (set = 0; set < LL_SCAN_TEST_SETS; set++) {
+        ll_scan_test_addrs_in_set(set, BLE_LL_SCAN_CFG_ADV_WAYS);
+        memcpy(addrs + set * BLE_LL_SCAN_CFG_ADV_WAYS, ll_scan_test_addrs,
+               BLE_LL_SCAN_CFG_ADV_WAYS * BLE_DEV_ADDR_LEN);
+    }
+    memcpy(extra, ll_scan_test_addrs[0], BLE_DEV_ADDR_LEN);
+    extra[5] ^= 0xff;
+
+    for (i = 0; i < BLE_LL_SCAN_CFG_NUM_ADVS; i++) {
+        ll_scan_test_rx(addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    TEST_ASSERT(ll_scan_test_rpts() == BLE_LL_SCAN_CFG_NUM_ADVS);
+
+    /* The whole table is in use; nothing has been replaced */
+    for (i = 0; i < BLE_LL_SCAN_CFG_NUM_ADVS; i++) {
+        ll_scan_test_rx(addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    TEST_ASSERT(ll_scan_test_rpts() == 0);
+
+    /* One more advertiser replaces exactly one entry: the least recently
+     * used one of its set.
+     */
+    set = ble_ll_scan_adv_set_get(extra, 0);
+    ll_scan_test_rx(extra, BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+    for (i = 0; i < BLE_LL_SCAN_CFG_NUM_ADVS; i++) {
+        TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                           addrs[i]) ==
+                    (i != set * BLE_LL_SCAN_CFG_ADV_WAYS));
+    }
+}
+
+/* An event is sent as soon as it holds the maximum number of reports */
+TEST_CASE(ll_scan_test_case_flush_count)
+{
+    uint8_t *b;
+    int i;
+
+    ll_scan_test_init();
+
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_RPT_MAX; i++) {
+        TEST_ASSERT(ll_scan_test_rpt_evs() == 0);
+        ll_scan_test_addr(ll_scan_test_addrs[i], i);
+        ll_scan_test_rx(ll_scan_test_addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    TEST_ASSERT_FATAL(ll_scan_test_rpt_evs() == 1);
+    b = ll_test_util_evs[0].buf;
+    TEST_ASSERT(b[3] == BLE_LL_SCAN_CFG_ADV_RPT_MAX);
+    TEST_ASSERT(ll_test_util_evs[0].time == cputime_get32());
+
+    /* The next report starts a new event */
+    ll_scan_test_addr(ll_scan_test_addrs[i], i);
+    ll_scan_test_rx(ll_scan_test_addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    TEST_ASSERT(ll_scan_test_rpt_evs() == 1);
+    TEST_ASSERT(ll_scan_test_rpts() == BLE_LL_SCAN_CFG_ADV_RPT_MAX + 1);
+}
+
+/* A report that would take the event past 255 bytes goes in the next one */
+TEST_CASE(ll_scan_test_case_flush_size)
+{
+    uint8_t *b;
+    int rpt_len;
+    int i;
+
+    ll_scan_test_init();
+
+    /* Reports with the most data: fewer fit than the maximum number */
+    i = 0;
+    while (ll_scan_test_rpt_evs() == 0) {
+        TEST_ASSERT_FATAL(i < BLE_LL_SCAN_CFG_ADV_RPT_MAX);
+        ll_scan_test_addr(ll_scan_test_addrs[i], i);
+        ll_scan_test_rx_data(ll_scan_test_addrs[i], BLE_ADV_PDU_TYPE_ADV_IND,
+                             BLE_ADV_DATA_MAX_LEN);
+        i++;
+    }
+
+    /* The event was sent when the last report did not fit in it */
+    b = ll_test_util_evs[0].buf;
+    rpt_len = BLE_HCI_LE_ADV_RPT_MIN_LEN + b[4 + 8];
+    TEST_ASSERT(b[3] == i - 1);
+    TEST_ASSERT(b[1] == BLE_HCI_LE_ADV_RPT_HDR_LEN + b[3] * rpt_len);
+    TEST_ASSERT(b[1] + rpt_len > BLE_HCI_EVENT_MAX_PARAM_LEN);
+    TEST_ASSERT(ll_scan_test_rpts() == i);
+}
+
+/* Reports are sent at the end of the scan window */
+TEST_CASE(ll_scan_test_case_flush_win_end)
+{
+    uint32_t start;
+    int i;
+
+    /* 2.5 ms windows every 10 ms */
+    ll_scan_test_start(0x0010, 0x0004);
+    start = cputime_get32();
+
+    for (i = 0; i < 2; i++) {
+        ll_scan_test_addr(ll_scan_test_addrs[i], i);
+        ll_scan_test_rx(ll_scan_test_addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    ll_test_util_run(2000);
+    TEST_ASSERT(ll_scan_test_rpt_evs() == 0);
+
+    ll_test_util_run(1000);
+    TEST_ASSERT_FATAL(ll_scan_test_rpt_evs() == 1);
+    TEST_ASSERT(ll_test_util_evs[0].buf[3] == 2);
+    TEST_ASSERT(ll_test_util_evs[0].time - start <= 2500);
+}
+
+/* Without another trigger, a report waits at most the flush timeout */
+TEST_CASE(ll_scan_test_case_flush_timeout)
+{
+    uint32_t tmo_usecs;
+    uint32_t start;
+
+    ll_scan_test_start(0x00A0, 0x00A0);
+    tmo_usecs = BLE_LL_SCAN_CFG_ADV_RPT_TMO * (1000000 / OS_TICKS_PER_SEC);
+
+    start = cputime_get32();
+    ll_scan_test_addr(ll_scan_test_addrs[0], 0);
+    ll_scan_test_rx(ll_scan_test_addrs[0], BLE_ADV_PDU_TYPE_ADV_IND);
+    ll_test_util_run(tmo_usecs - 1000);
+    TEST_ASSERT(ll_scan_test_rpt_evs() == 0);
+
+    ll_test_util_run(2000);
+    TEST_ASSERT_FATAL(ll_scan_test_rpt_evs() == 1);
+    TEST_ASSERT(ll_test_util_evs[0].buf[3] == 1);
+    TEST_ASSERT(ll_test_util_evs[0].time - start >= tmo_usecs - 1000);
+    TEST_ASSERT(ll_test_util_evs[0].time - start <= tmo_usecs + 1000);
+}
+
+/* Reports that could not be sent are not treated as duplicates */
+TEST_CASE(ll_scan_test_case_flush_drop)
+{
+    uint8_t *addr;
+    int i;
+
+    ll_scan_test_init();
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_RPT_MAX; i++) {
+        ll_scan_test_addr(ll_scan_test_addrs[i], i);
+    }
+    addr = ll_scan_test_addrs[0];
+
+    /* The first advertiser's scan response gets through */
+    ll_scan_test_rx(addr, BLE_ADV_PDU_TYPE_SCAN_RSP);
+    TEST_ASSERT(ll_scan_test_rpts() == 1);
+
+    /* A full event of advertising reports is lost */
+    ll_test_util_event_send_rc = -1;
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_RPT_MAX; i++) {
+        ll_scan_test_rx(ll_scan_test_addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    TEST_ASSERT(ll_scan_test_rpt_evs() == 0);
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_RPT_MAX; i++) {
+        TEST_ASSERT(!ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                            ll_scan_test_addrs[i]));
+    }
+
+    /* Only the lost reports' marks were undone */
+    TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_SCAN_RSP, 0, addr));
+
+    /* So the advertisers are reported when they are heard again */
+    ll_test_util_event_send_rc = 0;
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_RPT_MAX; i++) {
+        ll_scan_test_rx(ll_scan_test_addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+    }
+    TEST_ASSERT(ll_scan_test_rpts() == BLE_LL_SCAN_CFG_ADV_RPT_MAX);
+    for (i = 0; i < BLE_LL_SCAN_CFG_ADV_RPT_MAX; i++) {
+        TEST_ASSERT(ble_ll_scan_is_dup_adv(BLE_ADV_PDU_TYPE_ADV_IND, 0,
+                                           ll_scan_test_addrs[i]));
+    }
+}
+
+/*
+ * Benchmark: the cost of processing a received advertising PDU while
+ * filtering duplicates, against the number of advertisers heard round robin.
+ * While the advertisers fit in the table every PDU is a duplicate; once
+ * their sets overflow, PDUs miss and are reported again. Informational;
+ * prints nsecs per PDU.
+ */
+TEST_CASE(ll_scan_test_case_bench)
+{
+    static const int nums[] = { 8, 32, 128, 512 };
+    clock_t start;
+    double nsecs[sizeof nums / sizeof nums[0]];
+    int loops;
+    int n;
+    int i;
+    int j;
+
+    loops = 200000;
+    for (n = 0; n < sizeof nums / sizeof nums[0]; n++) {
+        ll_scan_test_init();
+        for (i = 0; i < nums[n]; i++) {
+            ll_scan_test_addr(ll_scan_test_addrs[i], i);
+            ll_scan_test_rx(ll_scan_test_addrs[i], BLE_ADV_PDU_TYPE_ADV_IND);
+        }
+
+        start = clock();
+        for (i = 0, j = 0; i < loops; i++) {
+            ll_scan_test_rx(ll_scan_test_addrs[j], BLE_ADV_PDU_TYPE_ADV_IND);
+            if (++j == nums[n]) {
+                j = 0;
+            }
+        }
+        nsecs[n] = (clock() - start) * 1e9 / CLOCKS_PER_SEC / loops;
+    }
+
+    printf("advertising PDU processing (%d entry table), nsecs/PDU:",
+           BLE_LL_SCAN_CFG_NUM_ADVS);
+    for (n = 0; n < sizeof nums / sizeof nums[0]; n++) {
+        printf(" %d advertisers %.1f", nums[n], nsecs[n]);
+    }
+    printf("\n");
+}
+
+TEST_SUITE(ll_scan_test_suite)
+{
+    ll_scan_test_case_hit();
+    ll_scan_test_case_lru();
+    ll_scan_test_case_full();
+    ll_scan_test_case_flush_count();
+    ll_scan_test_case_flush_size();
+    ll_scan_test_case_flush_win_end();
+    ll_scan_test_case_flush_timeout();
+    ll_scan_test_case_flush_drop();
+}
+
+TEST_SUITE(ll_scan_bench_suite)
+{
+    ll_scan_test_case_bench();
+}
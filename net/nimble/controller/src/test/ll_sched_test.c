@@ -0,0 +1,566 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "testutil/testutil.h"
+#include "os/os.h"
+#include "hal/hal_cputime.h"
+#include "controller/ll_sched.h"
+#include "ll_test_priv.h"
+
+/*
+ * The scheduler on its own: items run in start time order (across the
+ * cputime wrap), removing items keeps that order, and an item that is due
+ * while another one runs either preempts it or waits for its next wakeup.
+ */
+
+#define LL_SCHED_TEST_MAX_RUNS      (64)
+
+/* A call to an item's callback (or preempt callback) */
+struct ll_sched_test_run
+{
+    int id;
+    uint32_t time;
+};
+
+static struct ll_sched_test_run ll_sched_test_runs[LL_SCHED_TEST_MAX_RUNS];
+static int ll_sched_test_num_runs;
+static struct ll_sched_test_run ll_sched_test_preempts[LL_SCHED_TEST_MAX_RUNS];
+static int ll_sched_test_num_preempts;
+
+/* Number of times each item's callback has been called */
+static int ll_sched_test_calls[LL_SCHED_TEST_MAX_RUNS];
+
+static uint32_t ll_sched_test_now;
+
+static void
+ll_sched_test_record(struct ll_sched_test_run *runs, int *num,
+                     struct ll_sched_item *sch)
+{
+    TEST_ASSERT_FATAL(*num < LL_SCHED_TEST_MAX_RUNS);
+    runs[*num].id = (int)(intptr_t)sch->cb_arg;
+    runs[*num].time = cputime_get32();
+    (*num)++;
+}
+
+static int
+ll_sched_test_done_cb(struct ll_sched_item *sch)
+{
+    ll_sched_test_record(ll_sched_test_runs, &ll_sched_test_num_runs, sch);
+    return BLE_LL_SCHED_STATE_DONE;
+}
+
+static void
+ll_sched_test_preempt_cb(struct ll_sched_item *sch)
+{
+    ll_sched_test_record(ll_sched_test_preempts, &ll_sched_test_num_preempts,
+                         sch);
+}
+
+/* Runs until 5000 usecs after it started */
+static int
+ll_sched_test_long_cb(struct ll_sched_item *sch)
+{
+    ll_sched_test_record(ll_sched_test_runs, &ll_sched_test_num_runs, sch);
+    if (cputime_get32() - sch->start_time >= 5000) {
+        return BLE_LL_SCHED_STATE_DONE;
+    }
+    sch->next_wakeup = sch->start_time + 5000;
+    return BLE_LL_SCHED_STATE_RUNNING;
+}
+
+/*
+ * Wakes up 2000 usecs after it started, then moves its wakeup to 4000 usecs
+ * after it started; done then.
+ */
+static int
+ll_sched_test_extend_cb(struct ll_sched_item *sch)
+{
+    int id;
+
+    ll_sched_test_record(ll_sched_test_runs, &ll_sched_test_num_runs, sch);
+    id = (int)(intptr_t)sch->cb_arg;
+    switch (ll_sched_test_calls[id]++) {
+    case 0:
+        sch->next_wakeup = sch->start_time + 2000;
+        return BLE_LL_SCHED_STATE_RUNNING;
+    case 1:
+        ll_sched_wakeup(sch, sch->start_time + 4000);
+        return BLE_LL_SCHED_STATE_RUNNING;
+    default:
+        return BLE_LL_SCHED_STATE_DONE;
+    }
+}
+
+static void
+ll_sched_test_init(uint32_t cputime)
+{
+    ll_test_util_init();
+    ll_test_util_set_time(cputime);
+    ll_sched_test_now = cputime;
+
+    memset(g_ll_sched_stats, 0, sizeof g_ll_sched_stats);
+    memset(ll_sched_test_calls, 0, sizeof ll_sched_test_calls);
+    ll_sched_test_num_runs = 0;
+    ll_sched_test_num_preempts = 0;
+}
+
+/* Adds an item starting offset usecs after the test started */
+static struct ll_sched_item *
+ll_sched_test_add(int id, int sched_type, uint8_t sched_prio, uint32_t offset,
+                  sched_cb_func sched_cb)
+{
+    struct ll_sched_item *sch;
+    int rc;
+
+    sch = ll_sched_get_item();
+    TEST_ASSERT_FATAL(sch != NULL);
+    sch->sched_type = sched_type;
+    sch->sched_prio = sched_prio;
+    sch->start_time = ll_sched_test_now + offset;
+    sch->end_time = sch->start_time + 1000;
+    sch->next_wakeup = sch->end_time;
+    sch->cb_arg = (void *)(intptr_t)id;
+    sch->sched_cb = sched_cb;
+
+    rc = ll_sched_add(sch);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    return sch;
+}
+
+/* Returns the number of schedule items that can be allocated */
+static int
+ll_sched_test_num_free(void)
+{
+    struct ll_sched_item *schs[BLE_LL_CFG_SCHED_ITEMS];
+    int num;
+    int i;
+
+    num = 0;
+    while ((num < BLE_LL_CFG_SCHED_ITEMS) &&
+           ((schs[num] = ll_sched_get_item()) != NULL)) {
+        num++;
+    }
+    for (i = 0; i < num; i++) {
+        ll_sched_free_item(schs[i]);
+    }
+
+    return num;
+}
+
+/* Items run in start time order, on time, when the clock wraps among them */
+TEST_CASE(ll_sched_test_case_order_wrap)
+{
+    int num_items;
+    int i;
+
+    /* Half of the items start after the wrap */
+    ll_sched_test_init(0xFFFFFFFF - 4000);
+
+    /* Added in scrambled order, 500 usecs apart */
+    num_items = 16;
+    for (i = 0; i < num_items; i++) {
+        ll_sched_test_add(i, BLE_LL_SCHED_TYPE_ADV, BLE_LL_SCHED_PRIO_ADV,
+                          300 + ((i * 7) % num_items) * 500,
+                          ll_sched_test_done_cb);
+    }
+
+    ll_test_util_run(10000);
+
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == num_items);
+    for (i = 0; i < num_items; i++) {
+        TEST_ASSERT(ll_sched_test_runs[i].time - ll_sched_test_now ==
+                    300 + i * 500);
+        TEST_ASSERT((ll_sched_test_runs[i].id * 7) % num_items == i);
+    }
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_ADV].runs == num_items);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_ADV].late_usecs_max == 0);
+    TEST_ASSERT(ll_sched_test_num_free() == BLE_LL_CFG_SCHED_ITEMS);
+}
+
+/* Removing items keeps the rest in order and frees what was removed */
+TEST_CASE(ll_sched_test_case_rmv)
+{
+    struct ll_sched_item *schs[24];
+    uint32_t last;
+    int num_items;
+    int i;
+
+    ll_sched_test_init(0xFFFFFFFF - 2000);
+
+    num_items = 24;
+    for (i = 0; i < num_items; i++) {
+        schs[i] = ll_sched_test_add(i, (i & 1) ? BLE_LL_SCHED_TYPE_SCAN :
+                                                 BLE_LL_SCHED_TYPE_ADV,
+                                    0, 1000 + ((i * 5) % num_items) * 200,
+                                    ll_sched_test_done_cb);
+    }
+
+    /* Every scan item, then one advertising item from the middle */
+    ll_sched_rmv(BLE_LL_SCHED_TYPE_SCAN);
+    TEST_ASSERT(ll_sched_test_num_free() ==
+                BLE_LL_CFG_SCHED_ITEMS - num_items / 2);
+    ll_sched_rmv_item(schs[10]);
+    TEST_ASSERT(ll_sched_test_num_free() ==
+                BLE_LL_CFG_SCHED_ITEMS - num_items / 2 + 1);
+
+    ll_test_util_run(10000);
+
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == num_items / 2 - 1);
+    last = 0;
+    for (i = 0; i < ll_sched_test_num_runs; i++) {
+        TEST_ASSERT(!(ll_sched_test_runs[i].id & 1));
+        TEST_ASSERT(ll_sched_test_runs[i].id != 10);
+        TEST_ASSERT(ll_sched_test_runs[i].time - ll_sched_test_now ==
+                    1000 + ((ll_sched_test_runs[i].id * 5) % num_items) * 200);
+        TEST_ASSERT(i == 0 || (int32_t)(ll_sched_test_runs[i].time - last) > 0);
+        last = ll_sched_test_runs[i].time;
+    }
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_SCAN].runs == 0);
+    TEST_ASSERT(ll_sched_test_num_free() == BLE_LL_CFG_SCHED_ITEMS);
+}
+
+/* A higher priority item preempts the running item */
+TEST_CASE(ll_sched_test_case_preempt)
+{
+    struct ll_sched_item *sch;
+
+    ll_sched_test_init(1000);
+
+    sch = ll_sched_test_add(0, BLE_LL_SCHED_TYPE_SCAN, BLE_LL_SCHED_PRIO_SCAN,
+                            1000, ll_sched_test_long_cb);
+    sch->preempt_cb = ll_sched_test_preempt_cb;
+    ll_sched_test_add(1, BLE_LL_SCHED_TYPE_ADV, BLE_LL_SCHED_PRIO_ADV, 3000,
+                      ll_sched_test_done_cb);
+
+    ll_test_util_run(10000);
+
+    /* The scan item was stopped when the advertising item was due */
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == 2);
+    TEST_ASSERT(ll_sched_test_runs[0].id == 0);
+    TEST_ASSERT(ll_sched_test_runs[1].id == 1);
+    TEST_ASSERT(ll_sched_test_runs[1].time - ll_sched_test_now == 3000);
+    TEST_ASSERT_FATAL(ll_sched_test_num_preempts == 1);
+    TEST_ASSERT(ll_sched_test_preempts[0].id == 0);
+    TEST_ASSERT(ll_sched_test_preempts[0].time == ll_sched_test_runs[1].time);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_SCAN].preempted == 1);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_ADV].deferred == 0);
+    TEST_ASSERT(ll_sched_test_num_free() == BLE_LL_CFG_SCHED_ITEMS);
+}
+
+/*
+ * An item that cannot be preempted is not, even by a higher priority item;
+ * the due item waits for the running item's next wakeup.
+ */
+TEST_CASE(ll_sched_test_case_no_preempt)
+{
+    ll_sched_test_init(1000);
+
+    ll_sched_test_add(0, BLE_LL_SCHED_TYPE_SCAN, BLE_LL_SCHED_PRIO_SCAN, 1000,
+                      ll_sched_test_long_cb);
+    ll_sched_test_add(1, BLE_LL_SCHED_TYPE_ADV, BLE_LL_SCHED_PRIO_ADV, 3000,
+                      ll_sched_test_done_cb);
+
+    ll_test_util_run(10000);
+
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == 3);
+    TEST_ASSERT(ll_sched_test_runs[1].id == 0);
+    TEST_ASSERT(ll_sched_test_runs[2].id == 1);
+    TEST_ASSERT(ll_sched_test_runs[2].time - ll_sched_test_now == 6000);
+    TEST_ASSERT(ll_sched_test_num_preempts == 0);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_ADV].deferred == 1);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_ADV].deferred_usecs_max ==
+                3000);
+    TEST_ASSERT(ll_sched_test_num_free() == BLE_LL_CFG_SCHED_ITEMS);
+}
+
+/*
+ * A lower priority item that is due waits for the running item, again each
+ * time the running item moves its next wakeup.
+ */
+TEST_CASE(ll_sched_test_case_wakeup_defer)
+{
+    ll_sched_test_init(1000);
+
+    ll_sched_test_add(0, BLE_LL_SCHED_TYPE_CONN, BLE_LL_SCHED_PRIO_CONN, 1000,
+                      ll_sched_test_extend_cb);
+    ll_sched_test_add(1, BLE_LL_SCHED_TYPE_SCAN, BLE_LL_SCHED_PRIO_SCAN, 2000,
+                      ll_sched_test_done_cb);
+
+    ll_test_util_run(10000);
+
+    /* Woken at 1000, 3000 and 5000; the scan item after that */
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == 4);
+    TEST_ASSERT(ll_sched_test_runs[0].time - ll_sched_test_now == 1000);
+    TEST_ASSERT(ll_sched_test_runs[1].time - ll_sched_test_now == 3000);
+    TEST_ASSERT(ll_sched_test_runs[2].time - ll_sched_test_now == 5000);
+    TEST_ASSERT(ll_sched_test_runs[3].id == 1);
+    TEST_ASSERT(ll_sched_test_runs[3].time - ll_sched_test_now == 5000);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_SCAN].deferred == 2);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_SCAN].deferred_usecs_max ==
+                2000);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].preempted == 0);
+    TEST_ASSERT(ll_sched_test_num_free() == BLE_LL_CFG_SCHED_ITEMS);
+}
+
+/*
+ * Between items of the same priority, the running item keeps the radio
+ * unless the due item lost more conflicts in a row.
+ */
+TEST_CASE(ll_sched_test_case_equal_prio)
+{
+    struct ll_sched_item *sch;
+
+    /* Neither lost before: the due item waits */
+    ll_sched_test_init(1000);
+
+    sch = ll_sched_test_add(0, BLE_LL_SCHED_TYPE_CONN, BLE_LL_SCHED_PRIO_CONN,
+                            1000, ll_sched_test_long_cb);
+    sch->preempt_cb = ll_sched_test_preempt_cb;
+    sch = ll_sched_test_add(1, BLE_LL_SCHED_TYPE_CONN, BLE_LL_SCHED_PRIO_CONN,
+                            3000, ll_sched_test_done_cb);
+    sch->preempt_cb = ll_sched_test_preempt_cb;
+
+    ll_test_util_run(10000);
+
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == 3);
+    TEST_ASSERT(ll_sched_test_runs[2].id == 1);
+    TEST_ASSERT(ll_sched_test_runs[2].time - ll_sched_test_now == 6000);
+    TEST_ASSERT(ll_sched_test_num_preempts == 0);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].deferred == 1);
+
+    /* The due item lost last time: it takes the radio */
+    ll_sched_test_init(1000);
+
+    sch = ll_sched_test_add(0, BLE_LL_SCHED_TYPE_CONN, BLE_LL_SCHED_PRIO_CONN,
+                            1000, ll_sched_test_long_cb);
+    sch->preempt_cb = ll_sched_test_preempt_cb;
+    sch = ll_sched_test_add(1, BLE_LL_SCHED_TYPE_CONN, BLE_LL_SCHED_PRIO_CONN,
+                            3000, ll_sched_test_done_cb);
+    sch->preempt_cb = ll_sched_test_preempt_cb;
+    sch->sched_losses = 1;
+
+    ll_test_util_run(10000);
+
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == 2);
+    TEST_ASSERT(ll_sched_test_runs[1].id == 1);
+    TEST_ASSERT(ll_sched_test_runs[1].time - ll_sched_test_now == 3000);
+    TEST_ASSERT_FATAL(ll_sched_test_num_preempts == 1);
+    TEST_ASSERT(ll_sched_test_preempts[0].id == 0);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].preempted == 1);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].deferred == 0);
+
+    /* The running item lost more: the due item waits */
+    ll_sched_test_init(1000);
+
+    sch = ll_sched_test_add(0, BLE_LL_SCHED_TYPE_CONN, BLE_LL_SCHED_PRIO_CONN,
+                            1000, ll_sched_test_long_cb);
+    sch->preempt_cb = ll_sched_test_preempt_cb;
+    sch->sched_losses = 2;
+    sch = ll_sched_test_add(1, BLE_LL_SCHED_TYPE_CONN, BLE_LL_SCHED_PRIO_CONN,
+                            3000, ll_sched_test_done_cb);
+    sch->preempt_cb = ll_sched_test_preempt_cb;
+    sch->sched_losses = 1;
+
+    ll_test_util_run(10000);
+
+    TEST_ASSERT_FATAL(ll_sched_test_num_runs == 3);
+    TEST_ASSERT(ll_sched_test_runs[2].id == 1);
+    TEST_ASSERT(ll_sched_test_num_preempts == 0);
+    TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].deferred == 1);
+    TEST_ASSERT(ll_sched_test_num_free() == BLE_LL_CFG_SCHED_ITEMS);
+}
+
+/*
+ * Benchmark: periodic items, each added again one period later every time
+ * it runs, with the heap and with a sorted list (the way the scheduler used
+ * to keep its items). All items are due, so the clock does not matter. The
+ * list does the rest of the work the old scheduler did for each event: it
+ * allocates and frees items and restarts the scheduler timer on each add.
+ * Informational; prints nsecs per scheduled event.
+ */
+
+/* An item of the sorted list */
+struct ll_sched_test_ref_item
+{
+    TAILQ_ENTRY(ll_sched_test_ref_item) link;
+    struct ll_sched_item sch;
+};
+
+#define LL_SCHED_TEST_REF_POOL_SIZE                                 \
+    OS_MEMPOOL_SIZE(BLE_LL_CFG_SCHED_ITEMS,                         \
+                    sizeof(struct ll_sched_test_ref_item))
+
+static TAILQ_HEAD(, ll_sched_test_ref_item) ll_sched_test_ref_q;
+static struct os_mempool ll_sched_test_ref_pool;
+static os_membuf_t ll_sched_test_ref_mem[LL_SCHED_TEST_REF_POOL_SIZE];
+static struct cpu_timer ll_sched_test_ref_timer;
+
+static int ll_sched_test_bench_left;
+
+static void
+ll_sched_test_ref_timer_cb(void *arg)
+{
+}
+
+static void
+ll_sched_test_ref_add(struct ll_sched_test_ref_item *item)
+{
+    struct ll_sched_test_ref_item *entry;
+
+    cputime_timer_stop(&ll_sched_test_ref_timer);
+    TAILQ_FOREACH(entry, &ll_sched_test_ref_q, link) {
+        if ((int32_t)(item->sch.start_time - entry->sch.start_time) < 0) {
+            TAILQ_INSERT_BEFORE(entry, item, link);
+            break;
+        }
+    }
+    if (!entry) {
+        TAILQ_INSERT_TAIL(&ll_sched_test_ref_q, item, link);
+    }
+    cputime_timer_start(&ll_sched_test_ref_timer,
+                        TAILQ_FIRST(&ll_sched_test_ref_q)->sch.start_time);
+}
+
+static struct ll_sched_test_ref_item *
+ll_sched_test_ref_get(void)
+{
+    struct ll_sched_test_ref_item *item;
+
+    item = os_memblock_get(&ll_sched_test_ref_pool);
+    TEST_ASSERT_FATAL(item != NULL);
+    memset(item, 0, sizeof *item);
+    return item;
+}
+
+static void
+ll_sched_test_ref_run(uint32_t now)
+{
+    struct ll_sched_test_ref_item *item;
+    struct ll_sched_test_ref_item *next;
+
+    while (((item = TAILQ_FIRST(&ll_sched_test_ref_q)) != NULL) &&
+           ((int32_t)(now - item->sch.start_time) >= 0)) {
+        TAILQ_REMOVE(&ll_sched_test_ref_q, item, link);
+        if (ll_sched_test_bench_left > 0) {
+            ll_sched_test_bench_left--;
+            next = ll_sched_test_ref_get();
+            next->sch = item->sch;
+            next->sch.start_time += (uint32_t)(intptr_t)item->sch.cb_arg;
+            ll_sched_test_ref_add(next);
+        }
+        os_memblock_put(&ll_sched_test_ref_pool, item);
+    }
+    cputime_timer_stop(&ll_sched_test_ref_timer);
+}
+
+static int
+ll_sched_test_bench_cb(struct ll_sched_item *sch)
+{
+    struct ll_sched_item *next;
+    int rc;
+
+    if (ll_sched_test_bench_left > 0) {
+        ll_sched_test_bench_left--;
+        next = ll_sched_get_item();
+        TEST_ASSERT_FATAL(next != NULL);
+        *next = *sch;
+        next->start_time += (uint32_t)(intptr_t)sch->cb_arg;
+        rc = ll_sched_add(next);
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+    return BLE_LL_SCHED_STATE_DONE;
+}
+
+TEST_CASE(ll_sched_test_case_bench)
+{
+    static const int nums[] = { 4, 8, 16, 32, BLE_LL_CFG_SCHED_ITEMS - 1 };
+    struct ll_sched_test_ref_item *ref;
+    struct ll_sched_item *sch;
+    clock_t start;
+    uint32_t first;
+    double nsecs[2][sizeof nums / sizeof nums[0]];
+    int loops;
+    int n;
+    int i;
+
+    loops = 200000;
+    for (n = 0; n < sizeof nums / sizeof nums[0]; n++) {
+        /* Everything is due from the start and stays due */
+        ll_sched_test_init(0x80000000);
+        first = ll_sched_test_now - 0x40000000;
+
+        for (i = 0; i < nums[n]; i++) {
+            sch = ll_sched_get_item();
+            TEST_ASSERT_FATAL(sch != NULL);
+            sch->sched_type = BLE_LL_SCHED_TYPE_CONN;
+            sch->start_time = first + i * 10;
+            sch->end_time = sch->start_time;
+            sch->cb_arg = (void *)(intptr_t)(1000 + 13 * i);
+            sch->sched_cb = ll_sched_test_bench_cb;
+            ll_sched_add(sch);
+        }
+        ll_sched_test_bench_left = loops;
+        start = clock();
+        ll_sched_run(NULL);
+        nsecs[0][n] = (clock() - start) * 1e9 / CLOCKS_PER_SEC / loops;
+        TEST_ASSERT(g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].runs ==
+                    loops + nums[n]);
+        TEST_ASSERT(ll_sched_test_num_free() == BLE_LL_CFG_SCHED_ITEMS);
+
+        os_mempool_init(&ll_sched_test_ref_pool, BLE_LL_CFG_SCHED_ITEMS,
+                        sizeof(struct ll_sched_test_ref_item),
+                        ll_sched_test_ref_mem, "ll_sched_test_ref");
+        cputime_timer_init(&ll_sched_test_ref_timer,
+                           ll_sched_test_ref_timer_cb, NULL);
+        TAILQ_INIT(&ll_sched_test_ref_q);
+        for (i = 0; i < nums[n]; i++) {
+            ref = ll_sched_test_ref_get();
+            ref->sch.start_time = first + i * 10;
+            ref->sch.cb_arg = (void *)(intptr_t)(1000 + 13 * i);
+            ll_sched_test_ref_add(ref);
+        }
+        ll_sched_test_bench_left = loops;
+        start = clock();
+        ll_sched_test_ref_run(ll_sched_test_now);
+        nsecs[1][n] = (clock() - start) * 1e9 / CLOCKS_PER_SEC / loops;
+    }
+
+    printf("LL scheduler, nsecs/event:");
+    for (n = 0; n < sizeof nums / sizeof nums[0]; n++) {
+        printf(" %d items %.1f (list %.1f)", nums[n], nsecs[0][n],
+               nsecs[1][n]);
+    }
+    printf("\n");
+}
+
+TEST_SUITE(ll_sched_test_suite)
+{
+    ll_sched_test_case_order_wrap();
+    ll_sched_test_case_rmv();
+    ll_sched_test_case_preempt();
+    ll_sched_test_case_no_preempt();
+    ll_sched_test_case_wakeup_defer();
+    ll_sched_test_case_equal_prio();
+}
+
+TEST_SUITE(ll_sched_bench_suite)
+{
+    ll_sched_test_case_bench();
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include "testutil/testutil.h"
+#include "controller/ll_test.h"
+#include "ll_test_priv.h"
+
+int
+ll_test_all(void)
+{
+    ll_adv_ext_test_suite();
+    ll_chan_test_suite();
+    ll_conn_test_suite();
+    ll_hci_test_suite();
+    ll_phy_sim_test_suite();
+    ll_scan_test_suite();
+    ll_sched_test_suite();
+
+    return tu_case_failed;
+}
+
+int
+ll_bench_all(void)
+{
+    ll_chan_bench_suite();
+    ll_conn_bench_suite();
+    ll_scan_bench_suite();
+    ll_sched_bench_suite();
+
+    return tu_case_failed;
+}
+
+#ifdef PKG_TEST
+
+int
+main(void)
+{
+    tu_config.tc_print_results = 1;
+    tu_init();
+
+    ll_test_all();
+
+    return tu_any_failed;
+}
+
+#endif
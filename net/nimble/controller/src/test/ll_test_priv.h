@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_BLE_LL_TEST_PRIV_
+#define H_BLE_LL_TEST_PRIV_
+
+#include <inttypes.h>
+#include "controller/phy_sim.h"
+
+int ll_adv_ext_test_suite(void);
+int ll_chan_test_suite(void);
+int ll_conn_test_suite(void);
+int ll_hci_test_suite(void);
+int ll_phy_sim_test_suite(void);
+int ll_scan_test_suite(void);
+int ll_sched_test_suite(void);
+
+/* Benchmarks; informational, run by project/ll_bench only */
+int ll_chan_bench_suite(void);
+int ll_conn_bench_suite(void);
+int ll_scan_bench_suite(void);
+int ll_sched_bench_suite(void);
+
+/* Test utilities (ll_test_util.c) */
+#define LL_TEST_UTIL_NUM_MBUFS      (32)
+#define LL_TEST_UTIL_MAX_EVS        (64)
+#define LL_TEST_UTIL_MAX_TXS        (64)
+
+/* An event sent to the host */
+struct ll_test_util_ev
+{
+    uint8_t buf[260];
+    int len;
+    uint32_t time;
+};
+extern struct ll_test_util_ev ll_test_util_evs[LL_TEST_UTIL_MAX_EVS];
+extern int ll_test_util_num_evs;
+extern int ll_test_util_num_acl;
+
+/* If non-zero, events are dropped and the send fails with this */
+extern int ll_test_util_event_send_rc;
+
+/* A frame transmitted by the link layer */
+struct ll_test_util_tx
+{
+    uint8_t chan;
+    uint32_t access_addr;
+    uint32_t start_time;
+    uint32_t end_time;
+    uint8_t pdu[BLE_PHY_SIM_MAX_PDU_LEN];
+    int len;
+};
+extern struct ll_test_util_tx ll_test_util_txs[LL_TEST_UTIL_MAX_TXS];
+extern int ll_test_util_num_txs;
+
+/* Called for every frame transmitted; lets a test play the peer */
+extern ble_phy_sim_tx_func ll_test_util_peer_cb;
+
+void ll_test_util_init(void);
+void ll_test_util_clear_evs(void);
+void ll_test_util_set_time(uint32_t cputime);
+void ll_test_util_run(uint32_t usecs);
+int ll_test_util_cmd(uint8_t ogf, uint16_t ocf, const void *params,
+                     uint8_t len);
+int ll_test_util_adv_rpts(int *num_by_type);
+
+#endif
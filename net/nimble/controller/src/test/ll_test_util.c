@@ -0,0 +1,305 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "os/os.h"
+#include "testutil/testutil.h"
+#include "hal/hal_cputime.h"
+#include "mcu/native_cputime.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/hci_transport.h"
+#include "controller/phy.h"
+#include "controller/phy_sim.h"
+#include "controller/ll.h"
+#include "ll_test_priv.h"
+
+/*
+ * The link layer is driven without starting the OS: cputime runs in manual
+ * mode, the LL task's events are processed by ll_test_util_run() and the
+ * host is replaced by a capture of the events and ACL data the controller
+ * sends it.
+ */
+
+/* Cputime at which every test starts */
+#define LL_TEST_UTIL_START_TIME     (1000)
+
+/* How far the clock moves between passes over the LL's event queue */
+#define LL_TEST_UTIL_STEP_USECS     (50)
+
+#define LL_TEST_UTIL_MBUF_BUF_SIZE  (256)
+#define LL_TEST_UTIL_MBUF_MEMBLOCK_SIZE                         \
+    (LL_TEST_UTIL_MBUF_BUF_SIZE + sizeof(struct os_mbuf) +      \
+     sizeof(struct os_mbuf_pkthdr) + sizeof(struct ble_mbuf_hdr))
+#define LL_TEST_UTIL_MBUF_MEMPOOL_SIZE                          \
+    OS_MEMPOOL_SIZE(LL_TEST_UTIL_NUM_MBUFS, LL_TEST_UTIL_MBUF_MEMBLOCK_SIZE)
+
+struct os_mbuf_pool g_mbuf_pool;
+static struct os_mempool ll_test_util_mbuf_mempool;
+static os_membuf_t ll_test_util_mbuf_buffer[LL_TEST_UTIL_MBUF_MEMPOOL_SIZE];
+
+uint8_t g_dev_addr[BLE_DEV_ADDR_LEN];
+uint8_t g_random_addr[BLE_DEV_ADDR_LEN];
+
+struct ll_test_util_ev ll_test_util_evs[LL_TEST_UTIL_MAX_EVS];
+int ll_test_util_num_evs;
+int ll_test_util_num_acl;
+int ll_test_util_event_send_rc;
+
+struct ll_test_util_tx ll_test_util_txs[LL_TEST_UTIL_MAX_TXS];
+int ll_test_util_num_txs;
+
+ble_phy_sim_tx_func ll_test_util_peer_cb;
+
+static uint32_t ll_test_util_tick_time;
+
+int
+ble_hci_transport_ctlr_event_send(struct os_mbuf *om)
+{
+    struct ll_test_util_ev *ev;
+    int rc;
+
+    /* A failed send still consumes the event */
+    if (ll_test_util_event_send_rc != 0) {
+        os_mbuf_free_chain(&g_mbuf_pool, om);
+        return ll_test_util_event_send_rc;
+    }
+
+    if (ll_test_util_num_evs < LL_TEST_UTIL_MAX_EVS) {
+        ev = ll_test_util_evs + ll_test_util_num_evs;
+        ev->len = OS_MBUF_PKTHDR(om)->omp_len;
+        TEST_ASSERT(ev->len <= sizeof ev->buf);
+        rc = os_mbuf_copydata(om, 0, ev->len, ev->buf);
+        TEST_ASSERT(rc == 0);
+        ev->time = cputime_get32();
+        ll_test_util_num_evs++;
+    }
+
+    os_mbuf_free_chain(&g_mbuf_pool, om);
+    return 0;
+}
+
+int
+ble_hci_transport_ctlr_acl_data_send(struct os_mbuf *om)
+{
+    ll_test_util_num_acl++;
+    os_mbuf_free_chain(&g_mbuf_pool, om);
+    return 0;
+}
+
+static void
+ll_test_util_tx_cb(uint8_t chan, uint32_t access_addr, uint32_t start_time,
+                   uint32_t end_time, uint8_t *pdu, int len, int8_t txpwr_dbm)
+{
+    struct ll_test_util_tx *tx;
+
+    if (ll_test_util_num_txs < LL_TEST_UTIL_MAX_TXS) {
+        tx = ll_test_util_txs + ll_test_util_num_txs;
+        tx->chan = chan;
+        tx->access_addr = access_addr;
+        tx->start_time = start_time;
+        tx->end_time = end_time;
+        tx->len = len;
+        memcpy(tx->pdu, pdu, len);
+        ll_test_util_num_txs++;
+    }
+
+    if (ll_test_util_peer_cb != NULL) {
+        ll_test_util_peer_cb(chan, access_addr, start_time, end_time, pdu, len,
+                             txpwr_dbm);
+    }
+}
+
+/**
+ * Processes everything on the LL task's event queue, including the events
+ * that processing posts.
+ */
+static void
+ll_test_util_pump(void)
+{
+    struct os_event *ev;
+
+    while ((ev = STAILQ_FIRST(&g_ll_data.ll_evq.evq_list)) != NULL) {
+        os_eventq_remove(&g_ll_data.ll_evq, ev);
+        ll_event_proc(ev);
+    }
+}
+
+void
+ll_test_util_init(void)
+{
+    int rc;
+
+    os_init();
+
+    rc = os_mempool_init(&ll_test_util_mbuf_mempool, LL_TEST_UTIL_NUM_MBUFS,
+                         LL_TEST_UTIL_MBUF_MEMBLOCK_SIZE,
+                         ll_test_util_mbuf_buffer, "ll_test_mbuf");
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = os_mbuf_pool_init(&g_mbuf_pool, &ll_test_util_mbuf_mempool,
+                           sizeof(struct ble_mbuf_hdr),
+                           LL_TEST_UTIL_MBUF_MEMBLOCK_SIZE,
+                           LL_TEST_UTIL_NUM_MBUFS);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    rc = cputime_init(1000000);
+    TEST_ASSERT_FATAL(rc == 0);
+    cputime_native_manual_set(LL_TEST_UTIL_START_TIME);
+    ll_test_util_tick_time = LL_TEST_UTIL_START_TIME;
+
+    memset(g_dev_addr, 0, sizeof g_dev_addr);
+    g_dev_addr[0] = 0x01;
+    memset(g_random_addr, 0, sizeof g_random_addr);
+
+    rc = ll_init();
+    TEST_ASSERT_FATAL(rc == 0);
+
+    memset(&g_ble_phy_sim_cfg, 0, sizeof g_ble_phy_sim_cfg);
+    rc = ble_phy_init();
+    TEST_ASSERT_FATAL(rc == 0);
+    ble_phy_txpwr_set(0);
+    ble_phy_sim_tx_cb = ll_test_util_tx_cb;
+
+    ll_test_util_peer_cb = NULL;
+    ll_test_util_event_send_rc = 0;
+    ll_test_util_num_txs = 0;
+    ll_test_util_clear_evs();
+}
+
+void
+ll_test_util_clear_evs(void)
+{
+    ll_test_util_num_evs = 0;
+    ll_test_util_num_acl = 0;
+}
+
+/* Moves the clock to the given cputime without running anything */
+void
+ll_test_util_set_time(uint32_t cputime)
+{
+    cputime_native_manual_set(cputime);
+    ll_test_util_tick_time = cputime;
+}
+
+/**
+ * Runs the link layer for the given time. Timers expire on time; the OS
+ * ticks every millisecond and the LL task's events are processed every
+ * LL_TEST_UTIL_STEP_USECS.
+ */
+void
+ll_test_util_run(uint32_t usecs)
+{
+    uint32_t step;
+    uint32_t end;
+
+    ll_test_util_pump();
+
+    end = cputime_get32() + cputime_usecs_to_ticks(usecs);
+    while ((int32_t)(end - cputime_get32()) > 0) {
+        step = end - cputime_get32();
+        if (step > cputime_usecs_to_ticks(LL_TEST_UTIL_STEP_USECS)) {
+            step = cputime_usecs_to_ticks(LL_TEST_UTIL_STEP_USECS);
+        }
+        cputime_native_advance(step);
+
+        while (cputime_get32() - ll_test_util_tick_time >=
+               cputime_usecs_to_ticks(1000000 / OS_TICKS_PER_SEC)) {
+            os_time_tick();
+            os_callout_tick();
+            ll_test_util_tick_time +=
+                cputime_usecs_to_ticks(1000000 / OS_TICKS_PER_SEC);
+        }
+
+        ll_test_util_pump();
+    }
+}
+
+/**
+ * Sends an HCI command to the link layer and returns the status from its
+ * command complete or command status event (-1 if there was neither).
+ */
+int
+ll_test_util_cmd(uint8_t ogf, uint16_t ocf, const void *params, uint8_t len)
+{
+    struct os_mbuf *om;
+    uint16_t opcode;
+    uint8_t *b;
+    int rc;
+    int i;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    TEST_ASSERT_FATAL(om != NULL);
+
+    opcode = (ogf << 10) | ocf;
+    htole16(om->om_data, opcode);
+    om->om_data[2] = len;
+    memcpy(om->om_data + BLE_HCI_CMD_HDR_LEN, params, len);
+    om->om_len = BLE_HCI_CMD_HDR_LEN + len;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    rc = ble_hci_transport_host_cmd_send(om);
+    TEST_ASSERT_FATAL(rc == 0);
+    ll_test_util_pump();
+
+    for (i = ll_test_util_num_evs - 1; i >= 0; i--) {
+        b = ll_test_util_evs[i].buf;
+        if (b[0] == BLE_HCI_EVCODE_COMMAND_COMPLETE &&
+            le16toh(b + 3) == opcode) {
+            return b[5];
+        }
+        if (b[0] == BLE_HCI_EVCODE_COMMAND_STATE &&
+            le16toh(b + 4) == opcode) {
+            return b[2];
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Returns the number of advertising reports captured so far, and counts
+ * the reports of each advertising event type in num_by_type (if not NULL).
+ */
+int
+ll_test_util_adv_rpts(int *num_by_type)
+{
+    uint8_t *rpt;
+    uint8_t *b;
+    int num;
+    int i;
+    int j;
+
+    num = 0;
+    for (i = 0; i < ll_test_util_num_evs; i++) {
+        b = ll_test_util_evs[i].buf;
+        if (b[0] != BLE_HCI_EVCODE_LE_META || b[2] != BLE_HCI_LE_SUBEV_ADV_RPT) {
+            continue;
+        }
+
+        rpt = b + 4;
+        for (j = 0; j < b[3]; j++) {
+            if (num_by_type != NULL) {
+                num_by_type[rpt[0] & 7]++;
+            }
+            rpt += 10 + rpt[8];
+            num++;
+        }
+        TEST_ASSERT(rpt == b + BLE_HCI_EVENT_HDR_LEN + b[1]);
+    }
+
+    return num;
+}
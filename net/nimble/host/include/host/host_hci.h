@@ -26,10 +26,18 @@ int host_hci_cmd_le_set_adv_data(uint8_t *data, uint8_t len);
 int host_hci_cmd_le_set_adv_params(struct hci_adv_params *adv);
 int host_hci_cmd_le_set_rand_addr(uint8_t *addr);
 int host_hci_cmd_le_set_event_mask(uint64_t event_mask);
+int host_hci_cmd_le_read_buf_size(void);
 int host_hci_cmd_le_set_adv_enable(uint8_t enable);
 int host_hci_cmd_le_set_scan_enable(uint8_t enable, uint8_t filter_dups);
 int host_hci_cmd_le_set_scan_params(uint8_t scan_type, uint16_t scan_itvl, 
                                     uint16_t scan_window, uint8_t own_addr_type,
                                     uint8_t filter_policy);
+int host_hci_cmd_le_create_connection(struct hci_create_conn *hcc);
+int host_hci_cmd_le_create_conn_cancel(void);
+int host_hci_cmd_disconnect(uint16_t handle, uint8_t reason);
+int host_hci_cmd_le_set_data_len(uint16_t handle, uint16_t tx_octets, 
+                                 uint16_t tx_time);
+int host_hci_cmd_le_write_sugg_datalen(uint16_t tx_octets, uint16_t tx_time);
+int host_hci_data_send(struct os_mbuf *om);
 
 #endif /* H_HOST_HCI_ */
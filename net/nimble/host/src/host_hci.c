@@ -18,32 +18,30 @@
 #include <string.h>
 #include "os/os.h"
 #include "console/console.h"
+#include "nimble/ble.h"
 #include "nimble/hci_common.h"
 #include "nimble/hci_transport.h"
-
-#define HCI_CMD_BUFS        (4)
-#define HCI_CMD_BUF_SIZE    (260)       /* XXX: temporary, Fix later */
-struct os_mempool g_hci_cmd_pool;
-os_membuf_t g_hci_cmd_buf[OS_MEMPOOL_SIZE(HCI_CMD_BUFS, HCI_CMD_BUF_SIZE)];
-
-/* XXX: this might be transport layer*/
-#define HCI_NUM_OS_EVENTS       (32)
-#define HCI_OS_EVENT_BUF_SIZE   (sizeof(struct os_event))
-
-struct os_mempool g_hci_os_event_pool;
-os_membuf_t g_hci_os_event_buf[OS_MEMPOOL_SIZE(HCI_NUM_OS_EVENTS, 
-                                               HCI_OS_EVENT_BUF_SIZE)];
+#include "host_hci_priv.h"
 
 /* Host HCI Task Events */
 struct os_eventq g_ble_host_hci_evq;
 #define BLE_HOST_HCI_EVENT_CTLR_EVENT   (OS_EVENT_T_PERUSER)
+#define BLE_HOST_HCI_EVENT_CTLR_DATA    (OS_EVENT_T_PERUSER + 1)
 
-/* Statistics */
-struct host_hci_stats
+/* 
+ * Packets from the controller waiting for the host task. Each queue has one
+ * event which is posted to the host task when a packet is queued.
+ */
+struct host_hci_pktq
 {
-    uint32_t events_rxd;
+    struct os_event ev;
+    STAILQ_HEAD(, os_mbuf_pkthdr) pkts;
 };
 
+struct host_hci_pktq g_host_hci_event_q;
+struct host_hci_pktq g_host_hci_data_q;
+
+struct host_hci_flow g_host_hci_flow;
 struct host_hci_stats g_host_hci_stats;
 
 
@@ -51,34 +49,169 @@ struct host_hci_stats g_host_hci_stats;
 extern void bletest_execute(void);
 struct os_callout_func g_ble_host_hci_timer;
 
-static int
-host_hci_cmd_send(uint8_t *cmdbuf)
+/* Convert a pointer to a packet header back to its mbuf */
+#define HOST_HCI_PKTHDR_TO_MBUF(omp)    \
+    (struct os_mbuf *)((uint8_t *)(omp) - sizeof(struct os_mbuf))
+
+/**
+ * Send commands and ACL data packets that were waiting for the controller
+ * to have room for them.
+ * 
+ * Context: host task
+ */
+static void
+host_hci_flow_drain(void)
 {
-    return ble_hci_transport_host_cmd_send(cmdbuf);
+    struct os_mbuf_pkthdr *omp;
+    struct host_hci_flow *flow;
+
+    flow = &g_host_hci_flow;
+    while (flow->cmd_credits && 
+           ((omp = STAILQ_FIRST(&flow->cmd_pend)) != NULL)) {
+        STAILQ_REMOVE_HEAD(&flow->cmd_pend, omp_next);
+        --flow->cmd_credits;
+        ++g_host_hci_stats.cmds_sent;
+        ble_hci_transport_host_cmd_send(HOST_HCI_PKTHDR_TO_MBUF(omp));
+    }
+
+    while (flow->acl_credits && 
+           ((omp = STAILQ_FIRST(&flow->acl_pend)) != NULL)) {
+        STAILQ_REMOVE_HEAD(&flow->acl_pend, omp_next);
+        --flow->acl_credits;
+        ++g_host_hci_stats.acl_pkts_sent;
+        ble_hci_transport_host_acl_data_send(HOST_HCI_PKTHDR_TO_MBUF(omp));
+    }
 }
 
+/**
+ * Send a command to the controller. If the controller cannot accept a 
+ * command now, the command is queued and sent when it can. 
+ *  
+ * Context: host task
+ * 
+ * @param om Packet header mbuf holding the command. 
+ * 
+ * @return int 0: success. 
+ */
 static int
-host_hci_le_cmd_send(uint16_t ocf, uint8_t len, void *cmddata)
+host_hci_cmd_send(struct os_mbuf *om)
+{
+    STAILQ_INSERT_TAIL(&g_host_hci_flow.cmd_pend, OS_MBUF_PKTHDR(om), 
+                       omp_next);
+    if (!g_host_hci_flow.cmd_credits) {
+        ++g_host_hci_stats.cmds_delayed;
+    }
+    host_hci_flow_drain();
+    return 0;
+}
+
+/**
+ * Get a buffer for a command. The command header is filled in; the
+ * parameters are written by the caller at om_data + BLE_HCI_CMD_HDR_LEN.
+ * 
+ * @param ogf Command opcode group field
+ * @param ocf Command opcode command field
+ * @param len Length of the parameters
+ * 
+ * @return struct os_mbuf* The command; NULL if no buffer was available.
+ */
+static struct os_mbuf *
+host_hci_cmd_get(uint8_t ogf, uint16_t ocf, uint8_t len)
 {
-    int rc;
     uint8_t *cmd;
     uint16_t opcode;
+    struct os_mbuf *om;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (!om) {
+        ++g_host_hci_stats.cmd_alloc_fails;
+        return NULL;
+    }
+
+    cmd = om->om_data;
+    opcode = (ogf << 10) | ocf;
+    htole16(cmd, opcode);
+    cmd[2] = len;
+    om->om_len = BLE_HCI_CMD_HDR_LEN + len;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    return om;
+}
+
+/**
+ * Send a command with no parameters, or with parameters that the caller
+ * has already built.
+ * 
+ * @param ogf Command opcode group field
+ * @param ocf Command opcode command field
+ * @param len Length of the parameters
+ * @param cmddata Parameters (may be NULL if len is 0)
+ * 
+ * @return int 0: success; -1 if no buffer was available.
+ */
+static int
+host_hci_cmd_send_buf(uint8_t ogf, uint16_t ocf, uint8_t len, void *cmddata)
+{
+    int rc;
+    struct os_mbuf *om;
 
     rc = -1;
-    cmd = os_memblock_get(&g_hci_cmd_pool);
-    if (cmd) {
-        opcode = (BLE_HCI_OGF_LE << 10) | ocf;
-        htole16(cmd, opcode);
-        cmd[2] = len;
+    om = host_hci_cmd_get(ogf, ocf, len);
+    if (om) {
         if (len) {
-            memcpy(cmd + BLE_HCI_CMD_HDR_LEN, cmddata, len);
+            memcpy(om->om_data + BLE_HCI_CMD_HDR_LEN, cmddata, len);
         }
-        rc = host_hci_cmd_send(cmd);
+        rc = host_hci_cmd_send(om);
     }
 
     return rc;
 }
 
+/* Send a LE command */
+static int
+host_hci_le_cmd_send(uint16_t ocf, uint8_t len, void *cmddata)
+{
+    return host_hci_cmd_send_buf(BLE_HCI_OGF_LE, ocf, len, cmddata);
+}
+
+/**
+ * Send an ACL data packet to the controller. The packet starts with the
+ * HCI ACL data header. If the controller has no room for the packet it is
+ * queued and sent once the controller reports completed packets.
+ * 
+ * Context: host task
+ * 
+ * @param om Packet header mbuf holding the packet. 
+ * 
+ * @return int 0: success; -1 if the packet is malformed or larger than the
+ * controller accepts (the packet is freed).
+ */
+int
+host_hci_data_send(struct os_mbuf *om)
+{
+    uint16_t len;
+
+    if (om->om_len < BLE_HCI_DATA_HDR_LEN) {
+        os_mbuf_free_chain(&g_mbuf_pool, om);
+        return -1;
+    }
+
+    len = le16toh(om->om_data + 2);
+    if ((OS_MBUF_PKTHDR(om)->omp_len != (BLE_HCI_DATA_HDR_LEN + len)) ||
+        (g_host_hci_flow.acl_pkt_len && (len > g_host_hci_flow.acl_pkt_len))) {
+        os_mbuf_free_chain(&g_mbuf_pool, om);
+        return -1;
+    }
+
+    STAILQ_INSERT_TAIL(&g_host_hci_flow.acl_pend, OS_MBUF_PKTHDR(om), 
+                       omp_next);
+    if (!g_host_hci_flow.acl_credits) {
+        ++g_host_hci_stats.acl_pkts_delayed;
+    }
+    host_hci_flow_drain();
+    return 0;
+}
+
 int
 host_hci_cmd_le_set_adv_params(struct hci_adv_params *adv)
 {
@@ -136,37 +269,49 @@ host_hci_cmd_le_set_adv_params(struct hci_adv_params *adv)
 int
 host_hci_cmd_le_set_adv_data(uint8_t *data, uint8_t len)
 {
-    int rc;
-    uint8_t cmd[BLE_HCI_MAX_ADV_DATA_LEN + 1];
+    uint8_t *cmd;
+    struct os_mbuf *om;
 
     /* Check for valid parameters */
     if (((data == NULL) && (len != 0)) || (len > BLE_HCI_MAX_ADV_DATA_LEN)) {
         return BLE_ERR_INV_HCI_CMD_PARMS;
     }
 
+    /* Build the parameters in the command buffer */
+    om = host_hci_cmd_get(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_ADV_DATA,
+                          len + 1);
+    if (!om) {
+        return -1;
+    }
+    cmd = om->om_data + BLE_HCI_CMD_HDR_LEN;
     cmd[0] = len;
     memcpy(cmd + 1, data, len);
-    rc = host_hci_le_cmd_send(BLE_HCI_OCF_LE_SET_ADV_DATA, len + 1, cmd);
 
-    return rc;
+    return host_hci_cmd_send(om);
 }
 
 int
 host_hci_cmd_le_set_scan_rsp_data(uint8_t *data, uint8_t len)
 {
-    int rc;
-    uint8_t cmd[BLE_HCI_MAX_SCAN_RSP_DATA_LEN + 1];
+    uint8_t *cmd;
+    struct os_mbuf *om;
 
     /* Check for valid parameters */
     if (((data == NULL) && (len != 0)) || (len > BLE_HCI_MAX_SCAN_RSP_DATA_LEN)) {
         return BLE_ERR_INV_HCI_CMD_PARMS;
     }
 
+    /* Build the parameters in the command buffer */
+    om = host_hci_cmd_get(BLE_HCI_OGF_LE, BLE_HCI_OCF_LE_SET_SCAN_RSP_DATA,
+                          len + 1);
+    if (!om) {
+        return -1;
+    }
+    cmd = om->om_data + BLE_HCI_CMD_HDR_LEN;
     cmd[0] = len;
     memcpy(cmd + 1, data, len);
-    rc = host_hci_le_cmd_send(BLE_HCI_OCF_LE_SET_SCAN_RSP_DATA, len + 1, cmd);
 
-    return rc;
+    return host_hci_cmd_send(om);
 }
 
 /**
@@ -182,18 +327,31 @@ int
 host_hci_cmd_le_set_rand_addr(uint8_t *addr)
 {
     int rc;
-    uint8_t cmd[BLE_DEV_ADDR_LEN];
 
     /* Check for valid parameters */
     rc = -1;
     if (addr) {
         rc = host_hci_le_cmd_send(BLE_HCI_OCF_LE_SET_RAND_ADDR,
-                                  BLE_DEV_ADDR_LEN, cmd);
+                                  BLE_DEV_ADDR_LEN, addr);
     }
 
     return rc;
 }
 
+/**
+ * Read the LE buffer size of the controller. The response tells the host
+ * how many ACL data packets it may send to the controller, and how long
+ * they may be.
+ * 
+ * @return int 0: success; -1 if no buffer was available.
+ */
+int
+host_hci_cmd_le_read_buf_size(void)
+{
+    return host_hci_le_cmd_send(BLE_HCI_OCF_LE_RD_BUF_SIZE, 
+                                BLE_HCI_RD_BUF_SIZE_LEN, NULL);
+}
+
 int
 host_hci_cmd_le_set_event_mask(uint64_t event_mask)
 {
@@ -277,51 +435,247 @@ host_hci_cmd_le_set_scan_enable(uint8_t enable, uint8_t filter_dups)
     return rc;
 }
 
+int
+host_hci_cmd_le_create_connection(struct hci_create_conn *hcc)
+{
+    int rc;
+    uint8_t cmd[BLE_HCI_CREATE_CONN_LEN];
+
+    /* Check the scan interval and window */
+    if ((hcc->scan_itvl < BLE_HCI_SCAN_ITVL_MIN) || 
+        (hcc->scan_itvl > BLE_HCI_SCAN_ITVL_MAX) ||
+        (hcc->scan_window < BLE_HCI_SCAN_WINDOW_MIN) ||
+        (hcc->scan_window > BLE_HCI_SCAN_WINDOW_MAX) ||
+        (hcc->scan_itvl < hcc->scan_window)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    /* Check the filter policy and addresses */
+    if ((hcc->filter_policy > BLE_HCI_CONN_FILT_MAX) ||
+        (hcc->peer_addr_type > BLE_HCI_ADV_PEER_ADDR_MAX) ||
+        (hcc->own_addr_type > BLE_HCI_ADV_OWN_ADDR_MAX)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    /* Check the connection interval, latency and supervision timeout */
+    if ((hcc->conn_itvl_min < BLE_HCI_CONN_ITVL_MIN) ||
+        (hcc->conn_itvl_max > BLE_HCI_CONN_ITVL_MAX) ||
+        (hcc->conn_itvl_min > hcc->conn_itvl_max) ||
+        (hcc->conn_latency > BLE_HCI_CONN_LATENCY_MAX) ||
+        (hcc->supervision_timeout < BLE_HCI_CONN_SPVN_TIMEOUT_MIN) ||
+        (hcc->supervision_timeout > BLE_HCI_CONN_SPVN_TIMEOUT_MAX) ||
+        (hcc->min_ce_len > hcc->max_ce_len)) {
+        return BLE_ERR_INV_HCI_CMD_PARMS;
+    }
+
+    htole16(cmd, hcc->scan_itvl);
+    htole16(cmd + 2, hcc->scan_window);
+    cmd[4] = hcc->filter_policy;
+    cmd[5] = hcc->peer_addr_type;
+    memcpy(cmd + 6, hcc->peer_addr, BLE_DEV_ADDR_LEN);
+    cmd[12] = hcc->own_addr_type;
+    htole16(cmd + 13, hcc->conn_itvl_min);
+    htole16(cmd + 15, hcc->conn_itvl_max);
+    htole16(cmd + 17, hcc->conn_latency);
+    htole16(cmd + 19, hcc->supervision_timeout);
+    htole16(cmd + 21, hcc->min_ce_len);
+    htole16(cmd + 23, hcc->max_ce_len);
+
+    rc = host_hci_le_cmd_send(BLE_HCI_OCF_LE_CREATE_CNXN, 
+                              BLE_HCI_CREATE_CONN_LEN, cmd);
+    return rc;
+}
+
+int
+host_hci_cmd_le_create_conn_cancel(void)
+{
+    return host_hci_le_cmd_send(BLE_HCI_OCF_LE_CREATE_CNXN_CANCEL, 0, NULL);
+}
+
+int
+host_hci_cmd_disconnect(uint16_t handle, uint8_t reason)
+{
+    int rc;
+    uint8_t cmd[BLE_HCI_DISCONNECT_CMD_LEN];
+
+    htole16(cmd, handle);
+    cmd[2] = reason;
+    rc = host_hci_cmd_send_buf(BLE_HCI_OGF_LINK_CTRL, 
+                               BLE_HCI_OCF_DISCONNECT_CMD, 
+                               BLE_HCI_DISCONNECT_CMD_LEN, cmd);
+    return rc;
+}
+
+int
+host_hci_cmd_le_set_data_len(uint16_t handle, uint16_t tx_octets, 
+                             uint16_t tx_time)
+{
+    int rc;
+    uint8_t cmd[BLE_HCI_SET_DATALEN_LEN];
+
+    htole16(cmd, handle);
+    htole16(cmd + 2, tx_octets);
+    htole16(cmd + 4, tx_time);
+    rc = host_hci_le_cmd_send(BLE_HCI_OCF_LE_SET_DATA_LEN, 
+                              BLE_HCI_SET_DATALEN_LEN, cmd);
+    return rc;
+}
+
+int
+host_hci_cmd_le_write_sugg_datalen(uint16_t tx_octets, uint16_t tx_time)
+{
+    int rc;
+    uint8_t cmd[BLE_HCI_WR_SUGG_DATALEN_LEN];
+
+    htole16(cmd, tx_octets);
+    htole16(cmd + 2, tx_time);
+    rc = host_hci_le_cmd_send(BLE_HCI_OCF_LE_WR_SUGG_DEF_DATA_LEN, 
+                              BLE_HCI_WR_SUGG_DATALEN_LEN, cmd);
+    return rc;
+}
+
+/**
+ * Update flow control from an event received from the controller.
+ * 
+ * @param evbuf The event
+ */
+static void
+host_hci_event_flow_proc(uint8_t *evbuf)
+{
+    int i;
+    uint8_t num_handles;
+    uint8_t *pkts;
+    uint16_t opcode;
+    struct host_hci_flow *flow;
+
+    flow = &g_host_hci_flow;
+    switch (evbuf[0]) {
+    case BLE_HCI_EVCODE_COMMAND_COMPLETE:
+        flow->cmd_credits = evbuf[2];
+        opcode = le16toh(evbuf + 3);
+        if ((opcode == ((BLE_HCI_OGF_LE << 10) | BLE_HCI_OCF_LE_RD_BUF_SIZE)) &&
+            (evbuf[1] >= 7) && (evbuf[5] == BLE_ERR_SUCCESS)) {
+            flow->acl_pkt_len = le16toh(evbuf + 6);
+            flow->acl_credits = evbuf[8];
+        }
+        break;
+    case BLE_HCI_EVCODE_COMMAND_STATE:
+        flow->cmd_credits = evbuf[3];
+        break;
+    case BLE_HCI_EVCODE_NUM_COMP_PKTS:
+        num_handles = evbuf[2];
+        if (evbuf[1] < (1 + (4 * num_handles))) {
+            break;
+        }
+        pkts = evbuf + 3 + (2 * num_handles);
+        for (i = 0; i < num_handles; ++i) {
+            flow->acl_credits += le16toh(pkts + (2 * i));
+        }
+        break;
+    default:
+        return;
+    }
+
+    host_hci_flow_drain();
+}
+
+/**
+ * Process the HCI events received from the controller.
+ * 
+ * Context: host task
+ * 
+ * @param ev The event queue event
+ */
 void
 host_hci_event_proc(struct os_event *ev)
 {
+    os_sr_t sr;
     uint8_t *evbuf;
-    os_error_t err;
+    struct os_mbuf *om;
+    struct os_mbuf_pkthdr *omp;
+
+    while (1) {
+        OS_ENTER_CRITICAL(sr);
+        omp = STAILQ_FIRST(&g_host_hci_event_q.pkts);
+        if (omp) {
+            STAILQ_REMOVE_HEAD(&g_host_hci_event_q.pkts, omp_next);
+        }
+        OS_EXIT_CRITICAL(sr);
+        if (!omp) {
+            break;
+        }
 
-    /* Count events received */
-    ++g_host_hci_stats.events_rxd;
+        /* Count events received */
+        ++g_host_hci_stats.events_rxd;
 
-    /* Display to console */
-    evbuf = (uint8_t *)ev->ev_arg;
-    console_printf("Host received event %u", evbuf[0]);
+        /* Display to console */
+        om = HOST_HCI_PKTHDR_TO_MBUF(omp);
+        evbuf = om->om_data;
+        console_printf("Host received event %u", evbuf[0]);
 
-    /* XXX: Process the event */
+        /* XXX: Process the event */
+        host_hci_event_flow_proc(evbuf);
 
-    /* Free the command buffer */
-    err = os_memblock_put(&g_hci_cmd_pool, ev->ev_arg);
-    assert(err == OS_OK);
+        /* Free the event */
+        os_mbuf_free_chain(&g_mbuf_pool, om);
+    }
+}
+
+/**
+ * Process the ACL data packets received from the controller.
+ * 
+ * Context: host task
+ * 
+ * @param ev The data queue event
+ */
+void
+host_hci_data_proc(struct os_event *ev)
+{
+    os_sr_t sr;
+    struct os_mbuf_pkthdr *omp;
+
+    while (1) {
+        OS_ENTER_CRITICAL(sr);
+        omp = STAILQ_FIRST(&g_host_hci_data_q.pkts);
+        if (omp) {
+            STAILQ_REMOVE_HEAD(&g_host_hci_data_q.pkts, omp_next);
+        }
+        OS_EXIT_CRITICAL(sr);
+        if (!omp) {
+            break;
+        }
+
+        ++g_host_hci_stats.acl_pkts_rxd;
+
+        /* XXX: hand to L2CAP */
+        os_mbuf_free_chain(&g_mbuf_pool, HOST_HCI_PKTHDR_TO_MBUF(omp));
+    }
+}
 
-    /* Free the event */
-    err = os_memblock_put(&g_hci_os_event_pool, ev);
-    assert(err == OS_OK);
+static void
+host_hci_pktq_put(struct host_hci_pktq *q, struct os_mbuf *om)
+{
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    STAILQ_INSERT_TAIL(&q->pkts, OS_MBUF_PKTHDR(om), omp_next);
+    OS_EXIT_CRITICAL(sr);
+
+    os_eventq_put(&g_ble_host_hci_evq, &q->ev);
 }
 
 /* XXX: For now, put this here */
 int
-ble_hci_transport_ctlr_event_send(uint8_t *hci_ev)
+ble_hci_transport_ctlr_event_send(struct os_mbuf *om)
 {
-    os_error_t err;
-    struct os_event *ev;
-
-    /* Get an event structure off the queue */
-    ev = (struct os_event *)os_memblock_get(&g_hci_os_event_pool);
-    if (!ev) {
-        err = os_memblock_put(&g_hci_cmd_pool, hci_ev);
-        assert(err == OS_OK);
-        return -1;
-    }
-
-    /* Fill out the event and post to Link Layer */
-    ev->ev_queued = 0;
-    ev->ev_type = BLE_HOST_HCI_EVENT_CTLR_EVENT;
-    ev->ev_arg = hci_ev;
-    os_eventq_put(&g_ble_host_hci_evq, ev);
+    host_hci_pktq_put(&g_host_hci_event_q, om);
+    return 0;
+}
 
+int
+ble_hci_transport_ctlr_acl_data_send(struct os_mbuf *om)
+{
+    host_hci_pktq_put(&g_host_hci_data_q, om);
     return 0;
 }
 
@@ -335,49 +689,63 @@ host_hci_timer_cb(void *arg)
     os_callout_reset(&g_ble_host_hci_timer.cf_c, OS_TICKS_PER_SEC);
 }
 
+/**
+ * Process an event taken from the host task's event queue.
+ * 
+ * Context: host task
+ * 
+ * @param ev The event
+ */
 void
-host_hci_task(void *arg)
+host_hci_os_event_proc(struct os_event *ev)
 {
-    struct os_event *ev;
     struct os_callout_func *cf;
 
+    switch (ev->ev_type) {
+    case OS_EVENT_T_TIMER:
+        cf = (struct os_callout_func *)ev;
+        assert(cf->cf_func);
+        cf->cf_func(cf->cf_arg);
+        break;
+    case BLE_HOST_HCI_EVENT_CTLR_EVENT:
+        /* Process HCI event from controller */
+        host_hci_event_proc(ev);
+        break;
+    case BLE_HOST_HCI_EVENT_CTLR_DATA:
+        /* Process ACL data from controller */
+        host_hci_data_proc(ev);
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+void
+host_hci_task(void *arg)
+{
     host_hci_timer_cb(NULL);
 
     while (1) {
-        ev = os_eventq_get(&g_ble_host_hci_evq);
-        switch (ev->ev_type) {
-        case OS_EVENT_T_TIMER:
-            cf = (struct os_callout_func *)ev;
-            assert(cf->cf_func);
-            cf->cf_func(cf->cf_arg);
-            break;
-        case BLE_HOST_HCI_EVENT_CTLR_EVENT:
-            /* Process HCI event from controller */
-            host_hci_event_proc(ev);
-            break;
-        default:
-            assert(0);
-            break;
-        }
+        host_hci_os_event_proc(os_eventq_get(&g_ble_host_hci_evq));
     }
 }
 
 int
 host_hci_init(void)
 {
-    int rc;
-
-    /* Create memory pool of command buffers */
-    rc = os_mempool_init(&g_hci_cmd_pool, HCI_CMD_BUFS, HCI_CMD_BUF_SIZE, 
-                         &g_hci_cmd_buf, "HCICmdPool");
-    assert(rc == 0);
-
-    /* XXX: really only needed by the transport */
-    /* Create memory pool of OS events */
-    rc = os_mempool_init(&g_hci_os_event_pool, HCI_NUM_OS_EVENTS, 
-                         HCI_OS_EVENT_BUF_SIZE, &g_hci_os_event_buf, 
-                         "HCIOsEventPool");
-    assert(rc == 0);
+    /* Initialize the queues of packets from the controller */
+    STAILQ_INIT(&g_host_hci_event_q.pkts);
+    g_host_hci_event_q.ev.ev_type = BLE_HOST_HCI_EVENT_CTLR_EVENT;
+    STAILQ_INIT(&g_host_hci_data_q.pkts);
+    g_host_hci_data_q.ev.ev_type = BLE_HOST_HCI_EVENT_CTLR_DATA;
+
+    /* The controller can accept one command until it tells us otherwise */
+    g_host_hci_flow.cmd_credits = 1;
+    g_host_hci_flow.acl_credits = 0;
+    g_host_hci_flow.acl_pkt_len = 0;
+    STAILQ_INIT(&g_host_hci_flow.cmd_pend);
+    STAILQ_INIT(&g_host_hci_flow.acl_pend);
 
     /* Initialize the host timer */
     os_callout_func_init(&g_ble_host_hci_timer, &g_ble_host_hci_evq,
@@ -386,5 +754,5 @@ host_hci_init(void)
     /* Initialize eventq */
     os_eventq_init(&g_ble_host_hci_evq);
 
-    return rc;
+    return 0;
 }
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_HOST_HCI_PRIV_
+#define H_HOST_HCI_PRIV_
+
+#include <inttypes.h>
+#include "os/os.h"
+
+/* Host HCI task event queue */
+extern struct os_eventq g_ble_host_hci_evq;
+
+/*
+ * Flow control. Commands and ACL data are only sent to the controller when it
+ * has told us it has room for them; otherwise they wait on these queues. The
+ * controller allows one command until it says otherwise; ACL data may not be
+ * sent until the LE buffer size has been read.
+ */
+struct host_hci_flow
+{
+    uint8_t cmd_credits;
+    uint8_t acl_credits;
+    uint16_t acl_pkt_len;
+    STAILQ_HEAD(, os_mbuf_pkthdr) cmd_pend;
+    STAILQ_HEAD(, os_mbuf_pkthdr) acl_pend;
+};
+
+extern struct host_hci_flow g_host_hci_flow;
+
+/* Statistics */
+struct host_hci_stats
+{
+    uint32_t events_rxd;
+    uint32_t cmds_sent;
+    uint32_t cmds_delayed;
+    uint32_t cmd_alloc_fails;
+    uint32_t acl_pkts_sent;
+    uint32_t acl_pkts_delayed;
+    uint32_t acl_pkts_rxd;
+};
+
+extern struct host_hci_stats g_host_hci_stats;
+
+void host_hci_os_event_proc(struct os_event *ev);
+
+#endif /* H_HOST_HCI_PRIV_ */
@@ -0,0 +1,338 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "os/os.h"
+#include "testutil/testutil.h"
+#include "hal/hal_cputime.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/hci_transport.h"
+#include "controller/ll.h"
+#include "controller/ll_hci.h"
+#include "host/host_hci.h"
+#include "host_test_priv.h"
+#include "../../src/host_hci_priv.h"
+
+/*
+ * The host and the link layer are linked together, as they are in bletest:
+ * every command, event and ACL data packet goes through the real transport
+ * in both directions. Neither task is started; host_hci_test_pump() runs
+ * their event queues until both are empty.
+ */
+
+#define HOST_HCI_TEST_NUM_MBUFS         (16)
+#define HOST_HCI_TEST_MBUF_BUF_SIZE     (256)
+#define HOST_HCI_TEST_MBUF_MEMBLOCK_SIZE                        \
+    (HOST_HCI_TEST_MBUF_BUF_SIZE + sizeof(struct os_mbuf) +     \
+     sizeof(struct os_mbuf_pkthdr) + sizeof(struct ble_mbuf_hdr))
+#define HOST_HCI_TEST_MBUF_MEMPOOL_SIZE                         \
+    OS_MEMPOOL_SIZE(HOST_HCI_TEST_NUM_MBUFS,                    \
+                    HOST_HCI_TEST_MBUF_MEMBLOCK_SIZE)
+
+/* A handle with no connection; the LL drops data sent on it */
+#define HOST_HCI_TEST_HANDLE            (0x0001)
+
+struct os_mbuf_pool g_mbuf_pool;
+static struct os_mempool host_hci_test_mbuf_mempool;
+static os_membuf_t
+    host_hci_test_mbuf_buffer[HOST_HCI_TEST_MBUF_MEMPOOL_SIZE];
+
+/* Free mbufs once both sides are initialized */
+static int host_hci_test_mbufs_idle;
+
+uint8_t g_dev_addr[BLE_DEV_ADDR_LEN];
+uint8_t g_random_addr[BLE_DEV_ADDR_LEN];
+
+/* The host task's timer runs the bletest code; it never fires here */
+void
+bletest_execute(void)
+{
+}
+
+static void
+host_hci_test_init(void)
+{
+    int rc;
+
+    os_init();
+
+    rc = os_mempool_init(&host_hci_test_mbuf_mempool, HOST_HCI_TEST_NUM_MBUFS,
+                         HOST_HCI_TEST_MBUF_MEMBLOCK_SIZE,
+                         host_hci_test_mbuf_buffer, "host_test_mbuf");
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = os_mbuf_pool_init(&g_mbuf_pool, &host_hci_test_mbuf_mempool,
+                           sizeof(struct ble_mbuf_hdr),
+                           HOST_HCI_TEST_MBUF_MEMBLOCK_SIZE,
+                           HOST_HCI_TEST_NUM_MBUFS);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    rc = cputime_init(1000000);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    memset(g_dev_addr, 0, sizeof g_dev_addr);
+    g_dev_addr[0] = 0x01;
+    memset(g_random_addr, 0, sizeof g_random_addr);
+
+    rc = host_hci_init();
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = ll_init();
+    TEST_ASSERT_FATAL(rc == 0);
+
+    memset(&g_host_hci_stats, 0, sizeof g_host_hci_stats);
+    memset(&g_ll_stats, 0, sizeof g_ll_stats);
+
+    host_hci_test_mbufs_idle = host_hci_test_mbuf_mempool.mp_num_free;
+}
+
+/**
+ * Processes the events on the LL and host task queues, including the ones
+ * that processing posts, until both queues are empty.
+ */
+static void
+host_hci_test_pump(void)
+{
+    struct os_event *ev;
+    int busy;
+
+    do {
+        busy = 0;
+        while ((ev = STAILQ_FIRST(&g_ll_data.ll_evq.evq_list)) != NULL) {
+            os_eventq_remove(&g_ll_data.ll_evq, ev);
+            ll_event_proc(ev);
+            busy = 1;
+        }
+        while ((ev = STAILQ_FIRST(&g_ble_host_hci_evq.evq_list)) != NULL) {
+            os_eventq_remove(&g_ble_host_hci_evq, ev);
+            host_hci_os_event_proc(ev);
+            busy = 1;
+        }
+    } while (busy);
+}
+
+/* Every packet has been freed by whoever consumed it */
+static int
+host_hci_test_mbufs_free(void)
+{
+    return host_hci_test_mbuf_mempool.mp_num_free == host_hci_test_mbufs_idle;
+}
+
+/* Reads the LE buffer size, which gives the host its ACL data credits */
+static void
+host_hci_test_read_buf_size(void)
+{
+    int rc;
+
+    rc = host_hci_cmd_le_read_buf_size();
+    TEST_ASSERT_FATAL(rc == 0);
+    host_hci_test_pump();
+    TEST_ASSERT_FATAL(g_host_hci_flow.acl_credits ==
+                      BLE_LL_CFG_NUM_ACL_DATA_PKTS);
+}
+
+/* Builds an ACL data packet of len bytes for the given handle */
+static struct os_mbuf *
+host_hci_test_acl_pkt(uint16_t handle, uint16_t len)
+{
+    struct os_mbuf *om;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    TEST_ASSERT_FATAL(om != NULL);
+
+    htole16(om->om_data, handle);
+    htole16(om->om_data + 2, len);
+    memset(om->om_data + BLE_HCI_DATA_HDR_LEN, 0x5a, len);
+    om->om_len = BLE_HCI_DATA_HDR_LEN + len;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    return om;
+}
+
+/* A command goes to the LL and its command complete comes back */
+TEST_CASE(host_hci_test_case_cmd)
+{
+    host_hci_test_init();
+    TEST_ASSERT(g_host_hci_flow.cmd_credits == 1);
+    TEST_ASSERT(g_host_hci_flow.acl_pkt_len == 0);
+
+    host_hci_test_read_buf_size();
+    TEST_ASSERT(g_host_hci_stats.cmds_sent == 1);
+    TEST_ASSERT(g_host_hci_stats.cmds_delayed == 0);
+    TEST_ASSERT(g_host_hci_stats.events_rxd == 1);
+    TEST_ASSERT(g_ll_stats.hci_cmds == 1);
+    TEST_ASSERT(g_ll_stats.hci_events_sent == 1);
+
+    /* The command complete returned the credit and the buffer size */
+    TEST_ASSERT(g_host_hci_flow.cmd_credits == BLE_LL_CFG_NUM_HCI_CMD_PKTS);
+    TEST_ASSERT(g_host_hci_flow.acl_pkt_len == BLE_LL_CFG_ACL_DATA_PKT_LEN);
+
+    /* The command's mbuf carried the event back and was freed */
+    TEST_ASSERT(host_hci_test_mbufs_free());
+}
+
+/* Commands wait for a command credit */
+TEST_CASE(host_hci_test_case_cmd_credits)
+{
+    int rc;
+    int i;
+
+    host_hci_test_init();
+
+    for (i = 0; i < 3; i++) {
+        rc = host_hci_cmd_le_set_adv_enable(0);
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+
+    /* Only the first was sent; the LL has not processed it yet */
+    TEST_ASSERT(g_host_hci_stats.cmds_sent == 1);
+    TEST_ASSERT(g_host_hci_stats.cmds_delayed == 2);
+    TEST_ASSERT(g_host_hci_flow.cmd_credits == 0);
+    TEST_ASSERT(ble_ll_hci_get_num_cmd_pkts() ==
+                BLE_LL_CFG_NUM_HCI_CMD_PKTS - 1);
+
+    /* Each command complete lets the next command go */
+    host_hci_test_pump();
+    TEST_ASSERT(g_host_hci_stats.cmds_sent == 3);
+    TEST_ASSERT(g_host_hci_stats.events_rxd == 3);
+    TEST_ASSERT(g_ll_stats.hci_cmds == 3);
+    TEST_ASSERT(g_host_hci_flow.cmd_credits == BLE_LL_CFG_NUM_HCI_CMD_PKTS);
+    TEST_ASSERT(STAILQ_EMPTY(&g_host_hci_flow.cmd_pend));
+    TEST_ASSERT(host_hci_test_mbufs_free());
+}
+
+/* No ACL data is sent before the host knows the controller's buffers */
+TEST_CASE(host_hci_test_case_acl_no_credits)
+{
+    int rc;
+
+    host_hci_test_init();
+
+    rc = host_hci_data_send(host_hci_test_acl_pkt(HOST_HCI_TEST_HANDLE, 20));
+    TEST_ASSERT_FATAL(rc == 0);
+    host_hci_test_pump();
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_sent == 0);
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_delayed == 1);
+    TEST_ASSERT(g_ll_stats.hci_acl_pkts == 0);
+
+    /* Reading the buffer size releases it */
+    host_hci_test_read_buf_size();
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_sent == 1);
+    TEST_ASSERT(g_ll_stats.hci_acl_pkts == 1);
+    TEST_ASSERT(STAILQ_EMPTY(&g_host_hci_flow.acl_pend));
+    TEST_ASSERT(host_hci_test_mbufs_free());
+}
+
+/*
+ * Sending more ACL data than the controller has buffers for uses up the
+ * credits; number of completed packets events give them back and the
+ * packets that waited are sent.
+ */
+TEST_CASE(host_hci_test_case_acl_credits)
+{
+    int num_pkts;
+    int rc;
+    int i;
+
+    host_hci_test_init();
+    host_hci_test_read_buf_size();
+
+    num_pkts = BLE_LL_CFG_NUM_ACL_DATA_PKTS + 3;
+    for (i = 0; i < num_pkts; i++) {
+        rc = host_hci_data_send(host_hci_test_acl_pkt(HOST_HCI_TEST_HANDLE,
+                                                      20));
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+
+    /* The credits are used up and the rest of the packets wait */
+    TEST_ASSERT(g_host_hci_flow.acl_credits == 0);
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_sent ==
+                BLE_LL_CFG_NUM_ACL_DATA_PKTS);
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_delayed == 3);
+    TEST_ASSERT(!STAILQ_EMPTY(&g_host_hci_flow.acl_pend));
+
+    /*
+     * There is no connection, so the LL drops each packet and returns its
+     * credit with a number of completed packets event.
+     */
+    host_hci_test_pump();
+    TEST_ASSERT(g_ll_stats.hci_acl_pkts == num_pkts);
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_sent == num_pkts);
+    TEST_ASSERT(g_host_hci_stats.events_rxd == 1 + num_pkts);
+    TEST_ASSERT(STAILQ_EMPTY(&g_host_hci_flow.acl_pend));
+
+    /* Every credit came back */
+    TEST_ASSERT(g_host_hci_flow.acl_credits == BLE_LL_CFG_NUM_ACL_DATA_PKTS);
+    TEST_ASSERT(host_hci_test_mbufs_free());
+}
+
+/* The host rejects ACL data that does not match its header or is too long */
+TEST_CASE(host_hci_test_case_acl_bad)
+{
+    struct os_mbuf *om;
+    int rc;
+
+    host_hci_test_init();
+    host_hci_test_read_buf_size();
+
+    om = host_hci_test_acl_pkt(HOST_HCI_TEST_HANDLE, 20);
+    OS_MBUF_PKTHDR(om)->omp_len--;
+    rc = host_hci_data_send(om);
+    TEST_ASSERT(rc == -1);
+
+    om = host_hci_test_acl_pkt(HOST_HCI_TEST_HANDLE, 20);
+    htole16(om->om_data + 2, BLE_LL_CFG_ACL_DATA_PKT_LEN + 1);
+    OS_MBUF_PKTHDR(om)->omp_len = BLE_HCI_DATA_HDR_LEN +
+                                  BLE_LL_CFG_ACL_DATA_PKT_LEN + 1;
+    rc = host_hci_data_send(om);
+    TEST_ASSERT(rc == -1);
+
+    host_hci_test_pump();
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_sent == 0);
+    TEST_ASSERT(g_ll_stats.hci_acl_pkts == 0);
+    TEST_ASSERT(g_host_hci_flow.acl_credits == BLE_LL_CFG_NUM_ACL_DATA_PKTS);
+    TEST_ASSERT(host_hci_test_mbufs_free());
+}
+
+/* ACL data from the controller reaches the host task, which frees it */
+TEST_CASE(host_hci_test_case_acl_rx)
+{
+    int rc;
+    int i;
+
+    host_hci_test_init();
+
+    for (i = 0; i < 3; i++) {
+        rc = ble_hci_transport_ctlr_acl_data_send(
+            host_hci_test_acl_pkt(HOST_HCI_TEST_HANDLE, 27));
+        TEST_ASSERT_FATAL(rc == 0);
+    }
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_rxd == 0);
+
+    host_hci_test_pump();
+    TEST_ASSERT(g_host_hci_stats.acl_pkts_rxd == 3);
+    TEST_ASSERT(host_hci_test_mbufs_free());
+}
+
+TEST_SUITE(host_hci_test_suite)
+{
+    host_hci_test_case_cmd();
+    host_hci_test_case_cmd_credits();
+    host_hci_test_case_acl_no_credits();
+    host_hci_test_case_acl_credits();
+    host_hci_test_case_acl_bad();
+    host_hci_test_case_acl_rx();
+}
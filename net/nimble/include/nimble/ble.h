@@ -19,11 +19,9 @@
 
 /* XXX: some or all of these should not be here */
 #include "os/os.h"
-extern struct os_mbuf_pool g_mbuf_pool;
 
-/* Shared command pool for transort between host and controller */
-extern struct os_mempool g_hci_cmd_pool;
-extern struct os_mempool g_hci_os_event_pool;
+/* Shared by the controller, the host and the HCI transport between them */
+extern struct os_mbuf_pool g_mbuf_pool;
 
 /*
  * BLE MBUF structure:
@@ -32,13 +30,15 @@ extern struct os_mempool g_hci_os_event_pool;
  * the packet header mbuf (not mbufs that are part of a "packet chain"):
  *      struct os_mbuf          (12)
  *      struct os_mbuf_pkthdr   (8)
- *      struct ble_mbuf_hdr     (4)
+ *      struct ble_mbuf_hdr     (12)
  * 
  * The BLE mbuf header contains the following:
  *  flags: currently unused
  *  channel: The logical BLE channel PHY channel # (0 - 39)
  *  crcok: flag denoting CRC check passed (1) or failed (0).
  *  rssi: RSSI, in dBm.
+ *  conn_handle: connection a data channel PDU was received on.
+ *  end_cputime: cputime at which reception of the PDU ended.
  */
 struct ble_mbuf_hdr
 {
@@ -46,6 +46,8 @@ struct ble_mbuf_hdr
     uint8_t channel;
     uint8_t crcok;
     int8_t rssi;
+    uint16_t conn_handle;
+    uint32_t end_cputime;
 };
 
 #define BLE_MBUF_HDR_PTR(om)    \
@@ -56,6 +58,20 @@ struct ble_mbuf_hdr
 extern uint8_t g_dev_addr[BLE_DEV_ADDR_LEN];
 extern uint8_t g_random_addr[BLE_DEV_ADDR_LEN];
 
+/*
+ * glibc defines macros with these names (that convert values rather than
+ * read and write buffers). Pull them in now and get rid of them.
+ */
+#ifdef __linux__
+#include <endian.h>
+#undef htole16
+#undef htole32
+#undef htole64
+#undef le16toh
+#undef le32toh
+#undef le64toh
+#endif
+
 void htole16(uint8_t *buf, uint16_t x);
 void htole32(uint8_t *buf, uint32_t x);
 void htole64(uint8_t *buf, uint64_t x);
@@ -133,6 +149,10 @@ enum ble_error_codes
     BLE_ERR_MAC_CONN_FAIL       = 63,
     BLE_ERR_COARSE_CLK_ADJ      = 64,
     BLE_ERR_ATTR_NOT_FOUND      = 65,
+    BLE_ERR_UNK_ADV_IDENT       = 66,
+    BLE_ERR_LIMIT_REACHED       = 67,
+    BLE_ERR_OPERATION_CANCELLED = 68,
+    BLE_ERR_PACKET_TOO_LONG     = 69,
     BLE_ERR_MAX                 = 255
 };
 
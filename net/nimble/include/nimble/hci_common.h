@@ -44,6 +44,13 @@
 /* NOTE: 0x07 not defined in specification  */
 #define BLE_HCI_OGF_LE                      (0x08)
 
+/* List of OCF for Link Control commands (OGF=0x01) */
+#define BLE_HCI_OCF_DISCONNECT_CMD          (0x0006)
+
+/* Command specific definitions */
+/* Disconnect */
+#define BLE_HCI_DISCONNECT_CMD_LEN          (3)
+
 /* List of OCF for Controller and Baseband commands (OGF=0x03) */
 #define BLE_HCI_OCF_CB_SET_EVENT_MASK       (0x0001)
 #define BLE_HCI_OCF_CB_RESET                (0x0003)
@@ -53,6 +60,22 @@
 /* Set event mask */
 #define BLE_HCI_SET_EVENT_MASK_LEN          (8)
 
+/* List of OCF for Informational Parameters commands (OGF=0x04) */
+#define BLE_HCI_OCF_IP_RD_LOCAL_VER         (0x0001)
+#define BLE_HCI_OCF_IP_RD_LOC_SUPP_CMD      (0x0002)
+#define BLE_HCI_OCF_IP_RD_LOC_SUPP_FEAT     (0x0003)
+#define BLE_HCI_OCF_IP_RD_BD_ADDR           (0x0009)
+
+/* Response lengths (the status is not included) */
+#define BLE_HCI_RD_LOC_VER_INFO_RSPLEN      (8)
+#define BLE_HCI_RD_LOC_SUPP_CMD_RSPLEN      (64)
+#define BLE_HCI_RD_LOC_SUPP_FEAT_RSPLEN     (8)
+#define BLE_HCI_RD_BD_ADDR_RSPLEN           (6)
+
+/* HCI and LMP versions: Vol 2 Part E 7.4.1 (Bluetooth assigned numbers) */
+#define BLE_HCI_VER_BCS_5_0                 (9)
+#define BLE_LMP_VER_BCS_5_0                 (9)
+
 /* List of OCF for LE commands (OGF = 0x08) */
 #define BLE_HCI_OCF_LE_SET_EVENT_MASK       (0x0001)
 #define BLE_HCI_OCF_LE_RD_BUF_SIZE          (0x0002)
@@ -101,6 +124,19 @@
 #define BLE_HCI_OCF_LE_SET_ADDR_RES_EN      (0x002D)
 #define BLE_HCI_OCF_LE_SET_RESOLV_PRIV_ADDR (0x002E)
 #define BLE_HCI_OCF_LE_RD_MAX_DATA_LEN      (0x002F)
+/* NOTE: 0x0030 to 0x0034 are not supported (LE 2M and Coded PHYs) */
+#define BLE_HCI_OCF_LE_SET_ADV_SET_RAND_ADDR (0x0035)
+#define BLE_HCI_OCF_LE_SET_EXT_ADV_PARAMS   (0x0036)
+#define BLE_HCI_OCF_LE_SET_EXT_ADV_DATA     (0x0037)
+#define BLE_HCI_OCF_LE_SET_EXT_SCAN_RSP_DATA (0x0038)
+#define BLE_HCI_OCF_LE_SET_EXT_ADV_ENABLE   (0x0039)
+#define BLE_HCI_OCF_LE_RD_MAX_ADV_DATA_LEN  (0x003A)
+#define BLE_HCI_OCF_LE_RD_NUM_ADV_SETS      (0x003B)
+#define BLE_HCI_OCF_LE_REMOVE_ADV_SET       (0x003C)
+#define BLE_HCI_OCF_LE_CLEAR_ADV_SETS       (0x003D)
+#define BLE_HCI_OCF_LE_SET_PER_ADV_PARAMS   (0x003E)
+#define BLE_HCI_OCF_LE_SET_PER_ADV_DATA     (0x003F)
+#define BLE_HCI_OCF_LE_SET_PER_ADV_ENABLE   (0x0040)
 
 /* Command Specific Definitions */
 /* Set event mask */
@@ -169,6 +205,57 @@
 #define BLE_HCI_ADV_ITVL_DEF                (0x800)         /* 1.28 seconds */
 #define BLE_HCI_ADV_CHANMASK_DEF            (0x7)           /* all channels */
 
+/* Set advertising set random address */
+#define BLE_HCI_SET_ADV_SET_RAND_ADDR_LEN   (7)
+
+/* Set extended advertising parameters */
+#define BLE_HCI_SET_EXT_ADV_PARAM_LEN       (25)
+#define BLE_HCI_ADV_HANDLE_MAX              (0xEF)
+#define BLE_HCI_ADV_SID_MAX                 (0x0F)
+#define BLE_HCI_EXT_ADV_ITVL_MIN            (0x000020)      /* units */
+#define BLE_HCI_ADV_PHY_1M                  (1)
+#define BLE_HCI_ADV_TXPWR_MIN               (-127)          /* dBm */
+#define BLE_HCI_ADV_TXPWR_MAX               (20)            /* dBm */
+#define BLE_HCI_ADV_TXPWR_NO_PREF           (127)
+
+/* Advertising event properties (extended advertising parameters) */
+#define BLE_HCI_EXT_ADV_PROP_CONNECTABLE    (0x0001)
+#define BLE_HCI_EXT_ADV_PROP_SCANNABLE      (0x0002)
+#define BLE_HCI_EXT_ADV_PROP_DIRECTED       (0x0004)
+#define BLE_HCI_EXT_ADV_PROP_HD_DIRECTED    (0x0008)
+#define BLE_HCI_EXT_ADV_PROP_LEGACY         (0x0010)
+#define BLE_HCI_EXT_ADV_PROP_ANON_ADV       (0x0020)
+#define BLE_HCI_EXT_ADV_PROP_INC_TX_PWR     (0x0040)
+#define BLE_HCI_EXT_ADV_PROP_MASK           (0x007F)
+
+/* 
+ * Set extended advertising data, extended scan response data and periodic
+ * advertising data. The data may be sent in fragments; the operation says
+ * which fragment this is.
+ */
+#define BLE_HCI_SET_EXT_ADV_DATA_HDR_LEN    (4)
+#define BLE_HCI_SET_PER_ADV_DATA_HDR_LEN    (3)
+#define BLE_HCI_MAX_EXT_ADV_DATA_LEN        (251)   /* per command */
+#define BLE_HCI_ADV_DATA_OP_INT             (0)
+#define BLE_HCI_ADV_DATA_OP_FIRST           (1)
+#define BLE_HCI_ADV_DATA_OP_LAST            (2)
+#define BLE_HCI_ADV_DATA_OP_COMPLETE        (3)
+#define BLE_HCI_ADV_DATA_OP_UNCHANGED       (4)
+
+/* Set extended advertising enable: header, then one entry per set */
+#define BLE_HCI_SET_EXT_ADV_ENABLE_HDR_LEN  (2)
+#define BLE_HCI_SET_EXT_ADV_ENABLE_SET_LEN  (4)
+#define BLE_HCI_EXT_ADV_DURATION_MS         (10)            /* msecs */
+
+/* Set periodic advertising parameters */
+#define BLE_HCI_SET_PER_ADV_PARAM_LEN       (7)
+#define BLE_HCI_PER_ADV_ITVL                (1250)          /* usecs */
+#define BLE_HCI_PER_ADV_ITVL_MIN            (0x0006)        /* units */
+#define BLE_HCI_PER_ADV_PROP_INC_TX_PWR     (0x0040)
+
+/* Set periodic advertising enable */
+#define BLE_HCI_SET_PER_ADV_ENABLE_LEN      (2)
+
 /* Set scan parameters */
 #define BLE_HCI_SET_SCAN_PARAM_LEN          (7)
 #define BLE_HCI_SCAN_TYPE_PASSIVE           (0)
@@ -206,6 +293,29 @@
 #define BLE_HCI_SCAN_FILT_USE_WL_INITA      (3)
 #define BLE_HCI_SCAN_FILT_MAX               (3)
 
+/* Create connection */
+#define BLE_HCI_CREATE_CONN_LEN             (25)
+#define BLE_HCI_CONN_ITVL                   (1250)          /* usecs */
+#define BLE_HCI_CONN_ITVL_MIN               (0x0006)        /* units */
+#define BLE_HCI_CONN_ITVL_MAX               (0x0c80)        /* units */
+#define BLE_HCI_CONN_LATENCY_MAX            (0x01f3)
+#define BLE_HCI_CONN_SPVN_TIMEOUT_MIN       (0x000a)        /* units */
+#define BLE_HCI_CONN_SPVN_TIMEOUT_MAX       (0x0c80)        /* units */
+#define BLE_HCI_CONN_SPVN_TMO_UNITS         (10)            /* msecs */
+#define BLE_HCI_CONN_FILT_NO_WL             (0)
+#define BLE_HCI_CONN_FILT_USE_WL            (1)
+#define BLE_HCI_CONN_FILT_MAX               (1)
+
+/* Set data length */
+#define BLE_HCI_SET_DATALEN_LEN             (6)
+#define BLE_HCI_SET_DATALEN_TX_OCTETS_MIN   (0x001b)
+#define BLE_HCI_SET_DATALEN_TX_OCTETS_MAX   (0x00fb)
+#define BLE_HCI_SET_DATALEN_TX_TIME_MIN     (0x0148)
+#define BLE_HCI_SET_DATALEN_TX_TIME_MAX     (0x0848)
+
+/* Write suggested default data length */
+#define BLE_HCI_WR_SUGG_DATALEN_LEN         (4)
+
 /* Event Codes */
 #define BLE_HCI_EVCODE_INQUIRY_CMP          (0x01)
 #define BLE_HCI_EVCODE_INQUIRY_RESULT       (0x02)
@@ -223,6 +333,7 @@
 #define BLE_HCI_EVCODE_COMMAND_COMPLETE     (0x0E)
 #define BLE_HCI_EVCODE_COMMAND_STATE        (0x0F)
 #define BLE_HCI_EVCODE_HW_ERROR             (0x10)
+#define BLE_HCI_EVCODE_NUM_COMP_PKTS        (0x13)
 #define BLE_HCI_EVCODE_LE_META              (0x3E)
 /* XXX: Define them all... */
 
@@ -238,17 +349,67 @@
 #define BLE_HCI_LE_SUBEV_GEN_DHKEY_COMPLETE (0x09)
 #define BLE_HCI_LE_SUBEV_ENH_CONN_COMPLETE  (0x0A)
 #define BLE_HCI_LE_SUBEV_DIRECT_ADV_RPT     (0x0B)
+#define BLE_HCI_LE_SUBEV_ADV_SET_TERMINATED (0x12)
+#define BLE_HCI_LE_SUBEV_CHAN_SEL_ALG       (0x14)
+
+/* Event header (event code and parameter length) */
+#define BLE_HCI_EVENT_HDR_LEN               (2)
+#define BLE_HCI_EVENT_MAX_PARAM_LEN         (255)
 
 /* Event specific definitions */
 /* Event command complete */
 #define BLE_HCI_EVENT_CMD_COMPLETE_HDR_LEN  (6)
 
+/* Event command status */
+#define BLE_HCI_EVENT_CMD_STATUS_LEN        (6)
+
+/* Number of completed packets (one handle) */
+#define BLE_HCI_EVENT_NUM_COMP_PKTS_LEN     (7)
+
+/* Disconnection complete */
+#define BLE_HCI_EVENT_DISCONN_COMPLETE_LEN  (4)
+
+/* LE connection complete */
+#define BLE_HCI_LE_CONN_COMPLETE_LEN        (19)
+#define BLE_HCI_LE_CONN_COMPLETE_ROLE_MASTER    (0x00)
+#define BLE_HCI_LE_CONN_COMPLETE_ROLE_SLAVE     (0x01)
+
+/* LE data length change */
+#define BLE_HCI_LE_DATA_LEN_CHG_LEN         (11)
+
+/* LE channel selection algorithm */
+#define BLE_HCI_LE_CHAN_SEL_ALG_LEN         (4)
+
+/* LE advertising set terminated */
+#define BLE_HCI_LE_ADV_SET_TERMINATED_LEN   (6)
+
 /* Advertising report */
 #define BLE_HCI_ADV_RPT_EVTYPE_ADV_IND      (0)
 #define BLE_HCI_ADV_RPT_EVTYPE_DIR_IND      (1)
 #define BLE_HCI_ADV_RPT_EVTYPE_SCAN_IND     (2)
 #define BLE_HCI_ADV_RPT_EVTYPE_NONCONN_IND  (3)
 #define BLE_HCI_ADV_RPT_EVTYPE_SCAN_RSP     (5)
+#define BLE_HCI_LE_ADV_RPT_HDR_LEN          (2)     /* subevent, num reports */
+#define BLE_HCI_LE_ADV_RPT_MIN_LEN          (10)    /* report with no data */
+#define BLE_HCI_LE_ADV_RPT_NUM_RPTS_MAX     (0x19)
+
+/* 
+ * HCI ACL Data Packet Header
+ * 
+ *  -> Handle and flags     (2)
+ *      Connection handle (12 bits), packet boundary flag (2 bits) and
+ *      broadcast flag (2 bits).
+ *  -> Data Total Length    (2)
+ */
+#define BLE_HCI_DATA_HDR_LEN                (4)
+#define BLE_HCI_DATA_HANDLE(handle_pb_bc)   ((handle_pb_bc) & 0x0fff)
+#define BLE_HCI_DATA_PB(handle_pb_bc)       (((handle_pb_bc) >> 12) & 0x03)
+#define BLE_HCI_DATA_BC(handle_pb_bc)       (((handle_pb_bc) >> 14) & 0x03)
+
+/* Packet boundary flags */
+#define BLE_HCI_PB_FIRST_NON_FLUSH          (0)
+#define BLE_HCI_PB_MIDDLE                   (1)
+#define BLE_HCI_PB_FIRST_FLUSH              (2)
 
 /*--- Shared data structures ---*/
 
@@ -265,4 +426,21 @@ struct hci_adv_params
     uint8_t peer_addr[BLE_DEV_ADDR_LEN];
 };
 
+/* LE create connection command (ocf=0x000D) */
+struct hci_create_conn
+{
+    uint16_t scan_itvl;
+    uint16_t scan_window;
+    uint8_t filter_policy;
+    uint8_t peer_addr_type;
+    uint8_t peer_addr[BLE_DEV_ADDR_LEN];
+    uint8_t own_addr_type;
+    uint16_t conn_itvl_min;
+    uint16_t conn_itvl_max;
+    uint16_t conn_latency;
+    uint16_t supervision_timeout;
+    uint16_t min_ce_len;
+    uint16_t max_ce_len;
+};
+
 #endif /* H_BLE_HCI_COMMON_ */
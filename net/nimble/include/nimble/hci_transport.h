@@ -16,10 +16,30 @@
 #ifndef H_HCI_TRANSPORT_
 #define H_HCI_TRANSPORT_
 
+/*
+ * HCI packets (commands, events and ACL data) are carried in mbufs from
+ * g_mbuf_pool. The packet starts at om_data with its HCI header (no packet
+ * indicator) and is contained in the packet header mbuf. The transport takes
+ * ownership of the mbuf; packets are queued to the receiving task through the
+ * packet header so sending a packet never allocates.
+ * 
+ * When the host and controller are in the same image, the host implements the
+ * controller to host functions and the controller implements the host to
+ * controller functions. When the controller is a co-processor, a transport
+ * (e.g. net/nimble/transport/uart) implements the controller to host
+ * functions instead of the host.
+ */
+
 /* Send a HCI command from the host to the controller */
-int ble_hci_transport_host_cmd_send(uint8_t *cmd);
+int ble_hci_transport_host_cmd_send(struct os_mbuf *om);
+
+/* Send ACL data from the host to the controller */
+int ble_hci_transport_host_acl_data_send(struct os_mbuf *om);
 
 /* Send a HCI event from the controller to the host */
-int ble_hci_transport_ctlr_event_send(uint8_t *hci_ev);
+int ble_hci_transport_ctlr_event_send(struct os_mbuf *om);
+
+/* Send ACL data from the controller to the host */
+int ble_hci_transport_ctlr_acl_data_send(struct os_mbuf *om);
 
 #endif /* H_HCI_COMMON_ */
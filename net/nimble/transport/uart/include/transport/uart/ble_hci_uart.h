@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2015 Stack Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_BLE_HCI_UART_
+#define H_BLE_HCI_UART_
+
+#include <stdint.h>
+#include "hal/hal_uart.h"
+
+/*
+ * HCI UART (H4) transport, controller side. This is used when the controller
+ * runs as a co-processor: HCI commands and ACL data from an external host are
+ * received on a UART and handed to the controller; events and ACL data from
+ * the controller are sent back on the UART. An image using this transport
+ * does not include the host.
+ * 
+ * Bytes received are placed in a ring buffer by the UART driver and parsed in
+ * bursts by the transport task; the parameters of each packet are copied in
+ * contiguous runs into a single mbuf. Packets to send are queued and sent
+ * back to back, straight from their mbufs.
+ */
+
+/* H4 packet indicators */
+#define BLE_HCI_UART_H4_NONE        (0x00)
+#define BLE_HCI_UART_H4_CMD         (0x01)
+#define BLE_HCI_UART_H4_ACL         (0x02)
+#define BLE_HCI_UART_H4_SCO         (0x03)
+#define BLE_HCI_UART_H4_EVT         (0x04)
+
+/* Size of the receive ring buffer. Must be a power of 2. */
+#define BLE_HCI_UART_CFG_RX_BUF_SZ  (512)
+
+/* Transport task stack size */
+#define BLE_HCI_UART_STACK_SIZE     OS_STACK_ALIGN(256)
+
+/* Transport statistics */
+struct ble_hci_uart_stats
+{
+    uint32_t rx_bytes;
+    uint32_t rx_cmds;
+    uint32_t rx_acl_pkts;
+    uint32_t rx_bursts;         /* Number of times the ring was drained */
+    uint32_t rx_ring_full;      /* Driver had to hold a byte; ring full */
+    uint32_t rx_sync_errs;      /* Bytes skipped looking for a packet type */
+    uint32_t rx_no_bufs;        /* Packets dropped; no mbuf */
+    uint32_t rx_too_long;       /* Packets dropped; too long for an mbuf */
+    uint32_t tx_events;
+    uint32_t tx_acl_pkts;
+    uint32_t tx_bytes;
+    uint32_t tx_starts;         /* Number of times the UART was started */
+};
+extern struct ble_hci_uart_stats g_ble_hci_uart_stats;
+
+/* Initialize the HCI UART transport and start its task */
+int ble_hci_uart_init(int uart, int32_t speed, 
+                      enum hal_uart_flow_ctl flow_ctl, uint8_t prio);
+
+#endif /* H_BLE_HCI_UART_ */
@@ -0,0 +1,530 @@
+/**
+ * Copyright (c) 2015 Stack Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include "os/os.h"
+#include "hal/hal_uart.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/hci_transport.h"
+#include "transport/uart/ble_hci_uart.h"
+#include "ble_hci_uart_priv.h"
+
+#if (BLE_HCI_UART_CFG_RX_BUF_SZ & (BLE_HCI_UART_CFG_RX_BUF_SZ - 1))
+    #error "HCI UART receive buffer size must be a power of 2!"
+#endif
+
+/* Receive parser states */
+#define BLE_HCI_UART_RX_ST_TYPE     (0)     /* Waiting for packet indicator */
+#define BLE_HCI_UART_RX_ST_HDR      (1)     /* Receiving the HCI header */
+#define BLE_HCI_UART_RX_ST_DATA     (2)     /* Receiving the parameters */
+#define BLE_HCI_UART_RX_ST_DISCARD  (3)     /* Skipping a dropped packet */
+
+/* Largest HCI header received (ACL data) */
+#define BLE_HCI_UART_RX_HDR_MAX     (BLE_HCI_DATA_HDR_LEN)
+
+/*
+ * Receive ring. The UART driver adds bytes at the head (interrupt context);
+ * the transport task removes them from the tail.
+ */
+struct ble_hci_uart_ring
+{
+    uint16_t head;
+    uint16_t tail;
+    uint8_t stalled;
+    uint8_t buf[BLE_HCI_UART_CFG_RX_BUF_SZ];
+};
+
+#define BLE_HCI_UART_RING_MASK      (BLE_HCI_UART_CFG_RX_BUF_SZ - 1)
+
+/* Receive parser */
+struct ble_hci_uart_rx
+{
+    uint8_t state;
+    uint8_t pkt_type;
+    uint8_t hdr_len;
+    uint8_t hdr_rxd;
+    uint16_t remaining;
+    uint8_t hdr[BLE_HCI_UART_RX_HDR_MAX];
+    struct os_mbuf *om;
+};
+
+/*
+ * Transmit state. Events are sent before ACL data. The packet being sent is
+ * removed from its queue; tx_om is the mbuf in its chain being sent.
+ */
+struct ble_hci_uart_tx
+{
+    uint8_t active;
+    uint8_t pkt_type;
+    uint16_t off;
+    struct os_mbuf *pkt;
+    struct os_mbuf *tx_om;
+    STAILQ_HEAD(, os_mbuf_pkthdr) evt_q;
+    STAILQ_HEAD(, os_mbuf_pkthdr) acl_q;
+};
+
+struct ble_hci_uart
+{
+    int uart;
+    struct ble_hci_uart_ring ring;
+    struct ble_hci_uart_rx rx;
+    struct ble_hci_uart_tx tx;
+    struct os_event rx_ev;
+};
+
+struct ble_hci_uart g_ble_hci_uart;
+struct ble_hci_uart_stats g_ble_hci_uart_stats;
+
+/* Transport task */
+#define BLE_HCI_UART_EVENT_RX       (OS_EVENT_T_PERUSER)
+struct os_eventq g_ble_hci_uart_evq;
+struct os_task g_ble_hci_uart_task;
+os_stack_t g_ble_hci_uart_stack[BLE_HCI_UART_STACK_SIZE];
+
+#define BLE_HCI_UART_PKTHDR_TO_MBUF(omp)    \
+    (struct os_mbuf *)((uint8_t *)(omp) - sizeof(struct os_mbuf))
+
+/**
+ * Get the next packet to send, events first.
+ *
+ * Context: interrupts disabled.
+ *
+ * @param tx Transmit state
+ *
+ * @return int 0: a packet was found; -1 if there is nothing to send.
+ */
+static int
+ble_hci_uart_tx_next_pkt(struct ble_hci_uart_tx *tx)
+{
+    struct os_mbuf_pkthdr *omp;
+
+    omp = STAILQ_FIRST(&tx->evt_q);
+    if (omp) {
+        STAILQ_REMOVE_HEAD(&tx->evt_q, omp_next);
+        tx->pkt_type = BLE_HCI_UART_H4_EVT;
+        ++g_ble_hci_uart_stats.tx_events;
+    } else {
+        omp = STAILQ_FIRST(&tx->acl_q);
+        if (!omp) {
+            return -1;
+        }
+        STAILQ_REMOVE_HEAD(&tx->acl_q, omp_next);
+        tx->pkt_type = BLE_HCI_UART_H4_ACL;
+        ++g_ble_hci_uart_stats.tx_acl_pkts;
+    }
+
+    tx->pkt = BLE_HCI_UART_PKTHDR_TO_MBUF(omp);
+    tx->tx_om = tx->pkt;
+    tx->off = 0;
+    return 0;
+}
+
+/**
+ * UART transmit callback. Returns the next byte to send. Packets are sent
+ * one after another, as long as there are some queued, each starting with
+ * its packet indicator.
+ *
+ * Context: interrupts disabled.
+ *
+ * @param arg Unused
+ *
+ * @return int The byte to send; -1 if there is nothing to send.
+ */
+static int
+ble_hci_uart_tx_char(void *arg)
+{
+    uint8_t byte;
+    struct ble_hci_uart_tx *tx;
+
+    tx = &g_ble_hci_uart.tx;
+    if (!tx->pkt) {
+        if (ble_hci_uart_tx_next_pkt(tx)) {
+            tx->active = 0;
+            return -1;
+        }
+        ++g_ble_hci_uart_stats.tx_bytes;
+        return tx->pkt_type;
+    }
+
+    /* Skip empty mbufs in the chain */
+    while (tx->off == tx->tx_om->om_len) {
+        tx->tx_om = SLIST_NEXT(tx->tx_om, om_next);
+        tx->off = 0;
+        assert(tx->tx_om != NULL);
+    }
+
+    byte = tx->tx_om->om_data[tx->off];
+    ++tx->off;
+
+    /* Free the packet once its last byte has been taken */
+    if ((tx->off == tx->tx_om->om_len) && !SLIST_NEXT(tx->tx_om, om_next)) {
+        os_mbuf_free_chain(&g_mbuf_pool, tx->pkt);
+        tx->pkt = NULL;
+        tx->tx_om = NULL;
+    }
+
+    ++g_ble_hci_uart_stats.tx_bytes;
+    return byte;
+}
+
+/**
+ * Queue a packet to send to the host and start the UART if it is idle.
+ *
+ * @param om The packet. Freed once it has been sent.
+ * @param pkt_type H4 packet indicator (event or ACL data)
+ */
+static void
+ble_hci_uart_tx_pkt(struct os_mbuf *om, uint8_t pkt_type)
+{
+    os_sr_t sr;
+    int start;
+    struct ble_hci_uart_tx *tx;
+
+    tx = &g_ble_hci_uart.tx;
+
+    OS_ENTER_CRITICAL(sr);
+    if (pkt_type == BLE_HCI_UART_H4_EVT) {
+        STAILQ_INSERT_TAIL(&tx->evt_q, OS_MBUF_PKTHDR(om), omp_next);
+    } else {
+        STAILQ_INSERT_TAIL(&tx->acl_q, OS_MBUF_PKTHDR(om), omp_next);
+    }
+    start = !tx->active;
+    tx->active = 1;
+    OS_EXIT_CRITICAL(sr);
+
+    /* A running UART keeps taking bytes until the queues are empty */
+    if (start) {
+        ++g_ble_hci_uart_stats.tx_starts;
+        hal_uart_start_tx(g_ble_hci_uart.uart);
+    }
+}
+
+/**
+ * UART receive callback. Adds the byte to the receive ring and wakes up the
+ * transport task if the ring was empty.
+ *
+ * Context: interrupts disabled.
+ *
+ * @param arg Unused
+ * @param byte The byte received
+ *
+ * @return int 0: byte accepted; -1 if the ring is full.
+ */
+static int
+ble_hci_uart_rx_char(void *arg, uint8_t byte)
+{
+    uint16_t head;
+    struct ble_hci_uart_ring *ring;
+
+    ring = &g_ble_hci_uart.ring;
+    head = ring->head;
+    if (((head + 1) & BLE_HCI_UART_RING_MASK) == ring->tail) {
+        ring->stalled = 1;
+        ++g_ble_hci_uart_stats.rx_ring_full;
+        return -1;
+    }
+
+    ring->buf[head] = byte;
+    ring->head = (head + 1) & BLE_HCI_UART_RING_MASK;
+    ++g_ble_hci_uart_stats.rx_bytes;
+
+    if (head == ring->tail) {
+        os_eventq_put(&g_ble_hci_uart_evq, &g_ble_hci_uart.rx_ev);
+    }
+
+    return 0;
+}
+
+/**
+ * Hand a complete packet to the controller.
+ *
+ * @param rx The receive parser
+ */
+static void
+ble_hci_uart_rx_pkt_done(struct ble_hci_uart_rx *rx)
+{
+    struct os_mbuf *om;
+
+    om = rx->om;
+    rx->om = NULL;
+    rx->state = BLE_HCI_UART_RX_ST_TYPE;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    if (rx->pkt_type == BLE_HCI_UART_H4_CMD) {
+        ++g_ble_hci_uart_stats.rx_cmds;
+        ble_hci_transport_host_cmd_send(om);
+    } else {
+        ++g_ble_hci_uart_stats.rx_acl_pkts;
+        ble_hci_transport_host_acl_data_send(om);
+    }
+}
+
+/**
+ * The HCI header of a packet has been received. Get an mbuf for the packet,
+ * or drop the packet if there is no mbuf or the packet does not fit in one.
+ *
+ * @param rx The receive parser
+ */
+static void
+ble_hci_uart_rx_hdr_done(struct ble_hci_uart_rx *rx)
+{
+    struct os_mbuf *om;
+
+    if (rx->pkt_type == BLE_HCI_UART_H4_CMD) {
+        rx->remaining = rx->hdr[2];
+    } else {
+        rx->remaining = le16toh(rx->hdr + 2);
+    }
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    if (!om) {
+        ++g_ble_hci_uart_stats.rx_no_bufs;
+    } else if ((rx->hdr_len + rx->remaining) >
+               OS_MBUF_TRAILINGSPACE(&g_mbuf_pool, om)) {
+        ++g_ble_hci_uart_stats.rx_too_long;
+        os_mbuf_free_chain(&g_mbuf_pool, om);
+        om = NULL;
+    }
+
+    if (!om) {
+        rx->state = BLE_HCI_UART_RX_ST_DISCARD;
+        if (!rx->remaining) {
+            rx->state = BLE_HCI_UART_RX_ST_TYPE;
+        }
+        return;
+    }
+
+    memcpy(om->om_data, rx->hdr, rx->hdr_len);
+    om->om_len = rx->hdr_len;
+    rx->om = om;
+    rx->state = BLE_HCI_UART_RX_ST_DATA;
+    if (!rx->remaining) {
+        ble_hci_uart_rx_pkt_done(rx);
+    }
+}
+
+/**
+ * Parse a run of bytes from the receive ring.
+ *
+ * @param rx The receive parser
+ * @param data The bytes
+ * @param len The number of bytes
+ *
+ * @return int The number of bytes consumed.
+ */
+static int
+ble_hci_uart_rx_parse(struct ble_hci_uart_rx *rx, uint8_t *data, int len)
+{
+    int n;
+
+    switch (rx->state) {
+    case BLE_HCI_UART_RX_ST_TYPE:
+        rx->pkt_type = data[0];
+        rx->hdr_rxd = 0;
+        if (rx->pkt_type == BLE_HCI_UART_H4_CMD) {
+            rx->hdr_len = BLE_HCI_CMD_HDR_LEN;
+            rx->state = BLE_HCI_UART_RX_ST_HDR;
+        } else if (rx->pkt_type == BLE_HCI_UART_H4_ACL) {
+            rx->hdr_len = BLE_HCI_DATA_HDR_LEN;
+            rx->state = BLE_HCI_UART_RX_ST_HDR;
+        } else {
+            /* Not something a host sends us. Look for the next packet. */
+            ++g_ble_hci_uart_stats.rx_sync_errs;
+        }
+        return 1;
+
+    case BLE_HCI_UART_RX_ST_HDR:
+        n = min(len, rx->hdr_len - rx->hdr_rxd);
+        memcpy(rx->hdr + rx->hdr_rxd, data, n);
+        rx->hdr_rxd += n;
+        if (rx->hdr_rxd == rx->hdr_len) {
+            ble_hci_uart_rx_hdr_done(rx);
+        }
+        return n;
+
+    case BLE_HCI_UART_RX_ST_DATA:
+        n = min(len, rx->remaining);
+        memcpy(rx->om->om_data + rx->om->om_len, data, n);
+        rx->om->om_len += n;
+        rx->remaining -= n;
+        if (!rx->remaining) {
+            ble_hci_uart_rx_pkt_done(rx);
+        }
+        return n;
+
+    case BLE_HCI_UART_RX_ST_DISCARD:
+        n = min(len, rx->remaining);
+        rx->remaining -= n;
+        if (!rx->remaining) {
+            rx->state = BLE_HCI_UART_RX_ST_TYPE;
+        }
+        return n;
+
+    default:
+        assert(0);
+        return len;
+    }
+}
+
+/**
+ * Drain the receive ring. Each contiguous run of bytes in the ring is parsed
+ * at once; the ring is only locked to read the head and to move the tail.
+ *
+ * Context: transport task.
+ */
+static void
+ble_hci_uart_rx_proc(void)
+{
+    int n;
+    int len;
+    int stalled;
+    os_sr_t sr;
+    uint16_t head;
+    uint16_t tail;
+    struct ble_hci_uart_ring *ring;
+
+    ++g_ble_hci_uart_stats.rx_bursts;
+
+    ring = &g_ble_hci_uart.ring;
+    while (1) {
+        OS_ENTER_CRITICAL(sr);
+        head = ring->head;
+        OS_EXIT_CRITICAL(sr);
+
+        tail = ring->tail;
+        if (head == tail) {
+            break;
+        }
+
+        /* Bytes up to the head, or to the end of the buffer if it wrapped */
+        if (head > tail) {
+            len = head - tail;
+        } else {
+            len = BLE_HCI_UART_CFG_RX_BUF_SZ - tail;
+        }
+
+        while (len) {
+            n = ble_hci_uart_rx_parse(&g_ble_hci_uart.rx, ring->buf + tail,
+                                      len);
+            tail += n;
+            len -= n;
+        }
+
+        OS_ENTER_CRITICAL(sr);
+        ring->tail = tail & BLE_HCI_UART_RING_MASK;
+        stalled = ring->stalled;
+        ring->stalled = 0;
+        OS_EXIT_CRITICAL(sr);
+
+        /* Let the driver give us the bytes it is holding */
+        if (stalled) {
+            hal_uart_start_rx(g_ble_hci_uart.uart);
+        }
+    }
+}
+
+/**
+ * Process an event taken from the transport task's event queue.
+ *
+ * Context: transport task.
+ *
+ * @param ev The event
+ */
+void
+ble_hci_uart_os_event_proc(struct os_event *ev)
+{
+    switch (ev->ev_type) {
+    case BLE_HCI_UART_EVENT_RX:
+        ble_hci_uart_rx_proc();
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+static void
+ble_hci_uart_task(void *arg)
+{
+    while (1) {
+        ble_hci_uart_os_event_proc(os_eventq_get(&g_ble_hci_uart_evq));
+    }
+}
+
+int
+ble_hci_transport_ctlr_event_send(struct os_mbuf *om)
+{
+    ble_hci_uart_tx_pkt(om, BLE_HCI_UART_H4_EVT);
+    return 0;
+}
+
+int
+ble_hci_transport_ctlr_acl_data_send(struct os_mbuf *om)
+{
+    ble_hci_uart_tx_pkt(om, BLE_HCI_UART_H4_ACL);
+    return 0;
+}
+
+/**
+ * Initialize the HCI UART transport. The UART is configured for 8 data bits,
+ * 1 stop bit and no parity, as H4 requires. This must be called before the
+ * OS is started (or from a task at a higher priority than prio).
+ *
+ * @param uart The UART to use
+ * @param speed The UART speed
+ * @param flow_ctl UART flow control. H4 expects RTS/CTS.
+ * @param prio Priority of the transport task
+ *
+ * @return int 0: success; -1 otherwise.
+ */
+int
+ble_hci_uart_init(int uart, int32_t speed, enum hal_uart_flow_ctl flow_ctl,
+                  uint8_t prio)
+{
+    int rc;
+    struct ble_hci_uart *hu;
+
+    hu = &g_ble_hci_uart;
+    memset(hu, 0, sizeof(struct ble_hci_uart));
+    hu->uart = uart;
+    hu->rx.state = BLE_HCI_UART_RX_ST_TYPE;
+    hu->rx_ev.ev_type = BLE_HCI_UART_EVENT_RX;
+    STAILQ_INIT(&hu->tx.evt_q);
+    STAILQ_INIT(&hu->tx.acl_q);
+    os_eventq_init(&g_ble_hci_uart_evq);
+
+    rc = os_task_init(&g_ble_hci_uart_task, "ble_hci_uart", ble_hci_uart_task,
+                      NULL, prio, OS_WAIT_FOREVER, g_ble_hci_uart_stack,
+                      BLE_HCI_UART_STACK_SIZE);
+    if (rc) {
+        return -1;
+    }
+
+    rc = hal_uart_init_cbs(uart, ble_hci_uart_tx_char, NULL,
+                           ble_hci_uart_rx_char, NULL);
+    if (rc) {
+        return -1;
+    }
+
+    rc = hal_uart_config(uart, speed, 8, 1, HAL_UART_PARITY_NONE, flow_ctl);
+    if (rc) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_BLE_HCI_UART_PRIV_
+#define H_BLE_HCI_UART_PRIV_
+
+#include "os/os.h"
+
+/* Transport task event queue */
+extern struct os_eventq g_ble_hci_uart_evq;
+
+void ble_hci_uart_os_event_proc(struct os_event *ev);
+
+#endif /* H_BLE_HCI_UART_PRIV_ */
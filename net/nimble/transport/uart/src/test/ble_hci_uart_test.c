@@ -0,0 +1,526 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "os/os.h"
+#include "testutil/testutil.h"
+#include "hal/hal_uart.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/hci_transport.h"
+#include "transport/uart/ble_hci_uart.h"
+#include "transport/uart/ble_hci_uart_test.h"
+#include "../ble_hci_uart_priv.h"
+
+/*
+ * The transport is tested against a fake UART driver: the test decides how
+ * many received bytes the driver hands over before the transport task runs,
+ * and takes the bytes the transport sends. The controller is replaced by a
+ * capture of the packets the transport gives it.
+ */
+
+#define BLE_HCI_UART_TEST_NUM_MBUFS     (16)
+#define BLE_HCI_UART_TEST_MBUF_BUF_SIZE (256)
+#define BLE_HCI_UART_TEST_MBUF_MEMBLOCK_SIZE                        \
+    (BLE_HCI_UART_TEST_MBUF_BUF_SIZE + sizeof(struct os_mbuf) +     \
+     sizeof(struct os_mbuf_pkthdr) + sizeof(struct ble_mbuf_hdr))
+#define BLE_HCI_UART_TEST_MBUF_MEMPOOL_SIZE                         \
+    OS_MEMPOOL_SIZE(BLE_HCI_UART_TEST_NUM_MBUFS,                    \
+                    BLE_HCI_UART_TEST_MBUF_MEMBLOCK_SIZE)
+
+#define BLE_HCI_UART_TEST_MAX_PKTS      (64)
+#define BLE_HCI_UART_TEST_MAX_BYTES     (4096)
+
+struct os_mbuf_pool g_mbuf_pool;
+static struct os_mempool ble_hci_uart_test_mbuf_mempool;
+static os_membuf_t
+    ble_hci_uart_test_mbuf_buffer[BLE_HCI_UART_TEST_MBUF_MEMPOOL_SIZE];
+
+/* Fake UART driver */
+static hal_uart_tx_char ble_hci_uart_test_tx_func;
+static hal_uart_rx_char ble_hci_uart_test_rx_func;
+static void *ble_hci_uart_test_cb_arg;
+static int ble_hci_uart_test_tx_started;
+static int ble_hci_uart_test_rx_restarts;
+
+/* Bytes from the host the driver has not handed over yet */
+static uint8_t ble_hci_uart_test_in[BLE_HCI_UART_TEST_MAX_BYTES];
+static int ble_hci_uart_test_in_len;
+static int ble_hci_uart_test_in_off;
+
+/* Bytes the transport sent to the host */
+static uint8_t ble_hci_uart_test_out[BLE_HCI_UART_TEST_MAX_BYTES];
+static int ble_hci_uart_test_out_len;
+
+/* Packets the transport handed to the controller */
+struct ble_hci_uart_test_pkt
+{
+    uint8_t pkt_type;
+    uint8_t buf[BLE_HCI_UART_TEST_MBUF_BUF_SIZE];
+    int len;
+};
+static struct ble_hci_uart_test_pkt
+    ble_hci_uart_test_pkts[BLE_HCI_UART_TEST_MAX_PKTS];
+static int ble_hci_uart_test_num_pkts;
+
+int
+hal_uart_init_cbs(int uart, hal_uart_tx_char tx_func, hal_uart_tx_done tx_done,
+                  hal_uart_rx_char rx_func, void *arg)
+{
+    ble_hci_uart_test_tx_func = tx_func;
+    ble_hci_uart_test_rx_func = rx_func;
+    ble_hci_uart_test_cb_arg = arg;
+    return 0;
+}
+
+int
+hal_uart_config(int uart, int32_t speed, uint8_t databits, uint8_t stopbits,
+                enum hal_uart_parity parity, enum hal_uart_flow_ctl flow_ctl)
+{
+    return 0;
+}
+
+void
+hal_uart_start_tx(int uart)
+{
+    ble_hci_uart_test_tx_started = 1;
+}
+
+void
+hal_uart_start_rx(int uart)
+{
+    ble_hci_uart_test_rx_restarts++;
+}
+
+static void
+ble_hci_uart_test_pkt_in(uint8_t pkt_type, struct os_mbuf *om)
+{
+    struct ble_hci_uart_test_pkt *pkt;
+    int rc;
+
+    TEST_ASSERT_FATAL(ble_hci_uart_test_num_pkts < BLE_HCI_UART_TEST_MAX_PKTS);
+    pkt = ble_hci_uart_test_pkts + ble_hci_uart_test_num_pkts;
+    pkt->pkt_type = pkt_type;
+    pkt->len = OS_MBUF_PKTHDR(om)->omp_len;
+    TEST_ASSERT_FATAL(pkt->len <= sizeof pkt->buf);
+    rc = os_mbuf_copydata(om, 0, pkt->len, pkt->buf);
+    TEST_ASSERT(rc == 0);
+    ble_hci_uart_test_num_pkts++;
+
+    os_mbuf_free_chain(&g_mbuf_pool, om);
+}
+
+int
+ble_hci_transport_host_cmd_send(struct os_mbuf *om)
+{
+    ble_hci_uart_test_pkt_in(BLE_HCI_UART_H4_CMD, om);
+    return 0;
+}
+
+int
+ble_hci_transport_host_acl_data_send(struct os_mbuf *om)
+{
+    ble_hci_uart_test_pkt_in(BLE_HCI_UART_H4_ACL, om);
+    return 0;
+}
+
+static void
+ble_hci_uart_test_init(void)
+{
+    int rc;
+
+    os_init();
+
+    rc = os_mempool_init(&ble_hci_uart_test_mbuf_mempool,
+                         BLE_HCI_UART_TEST_NUM_MBUFS,
+                         BLE_HCI_UART_TEST_MBUF_MEMBLOCK_SIZE,
+                         ble_hci_uart_test_mbuf_buffer, "uart_test_mbuf");
+    TEST_ASSERT_FATAL(rc == 0);
+    rc = os_mbuf_pool_init(&g_mbuf_pool, &ble_hci_uart_test_mbuf_mempool,
+                           sizeof(struct ble_mbuf_hdr),
+                           BLE_HCI_UART_TEST_MBUF_MEMBLOCK_SIZE,
+                           BLE_HCI_UART_TEST_NUM_MBUFS);
+    TEST_ASSERT_FATAL(rc == 0);
+
+    ble_hci_uart_test_tx_started = 0;
+    ble_hci_uart_test_rx_restarts = 0;
+    ble_hci_uart_test_in_len = 0;
+    ble_hci_uart_test_in_off = 0;
+    ble_hci_uart_test_out_len = 0;
+    ble_hci_uart_test_num_pkts = 0;
+    memset(&g_ble_hci_uart_stats, 0, sizeof g_ble_hci_uart_stats);
+
+    rc = ble_hci_uart_init(1, 1000000, HAL_UART_FLOW_CTL_RTS_CTS, 5);
+    TEST_ASSERT_FATAL(rc == 0);
+}
+
+/* Queues bytes for the driver to hand to the transport */
+static void
+ble_hci_uart_test_host_put(const void *data, int len)
+{
+    TEST_ASSERT_FATAL(ble_hci_uart_test_in_len + len <=
+                      BLE_HCI_UART_TEST_MAX_BYTES);
+    memcpy(ble_hci_uart_test_in + ble_hci_uart_test_in_len, data, len);
+    ble_hci_uart_test_in_len += len;
+}
+
+/* Queues an H4 LE command with the given parameters */
+static int
+ble_hci_uart_test_cmd_put(uint16_t ocf, const uint8_t *params, uint8_t len)
+{
+    uint8_t hdr[1 + BLE_HCI_CMD_HDR_LEN];
+
+    hdr[0] = BLE_HCI_UART_H4_CMD;
+    htole16(hdr + 1, (BLE_HCI_OGF_LE << 10) | ocf);
+    hdr[3] = len;
+    ble_hci_uart_test_host_put(hdr, sizeof hdr);
+    ble_hci_uart_test_host_put(params, len);
+
+    return sizeof hdr + len;
+}
+
+/* Queues an H4 ACL data packet of len bytes, each set to fill */
+static int
+ble_hci_uart_test_acl_put(uint16_t handle, uint16_t len, uint8_t fill)
+{
+    uint8_t hdr[1 + BLE_HCI_DATA_HDR_LEN];
+    uint8_t data[BLE_HCI_UART_TEST_MAX_BYTES];
+
+    hdr[0] = BLE_HCI_UART_H4_ACL;
+    htole16(hdr + 1, handle);
+    htole16(hdr + 3, len);
+    memset(data, fill, len);
+    ble_hci_uart_test_host_put(hdr, sizeof hdr);
+    ble_hci_uart_test_host_put(data, len);
+
+    return sizeof hdr + len;
+}
+
+/**
+ * Hands up to max_bytes of the queued bytes to the transport (stopping if
+ * its ring is full), then runs the transport task and takes what it sends.
+ *
+ * @return int The number of bytes handed over.
+ */
+static int
+ble_hci_uart_test_step(int max_bytes)
+{
+    struct os_event *ev;
+    int num;
+    int c;
+
+    num = 0;
+    while ((num < max_bytes) &&
+           (ble_hci_uart_test_in_off < ble_hci_uart_test_in_len)) {
+        if (ble_hci_uart_test_rx_func(ble_hci_uart_test_cb_arg,
+                ble_hci_uart_test_in[ble_hci_uart_test_in_off]) != 0) {
+            break;
+        }
+        ble_hci_uart_test_in_off++;
+        num++;
+    }
+
+    while ((ev = STAILQ_FIRST(&g_ble_hci_uart_evq.evq_list)) != NULL) {
+        os_eventq_remove(&g_ble_hci_uart_evq, ev);
+        ble_hci_uart_os_event_proc(ev);
+    }
+
+    while (ble_hci_uart_test_tx_started) {
+        c = ble_hci_uart_test_tx_func(ble_hci_uart_test_cb_arg);
+        if (c < 0) {
+            ble_hci_uart_test_tx_started = 0;
+        } else {
+            TEST_ASSERT_FATAL(ble_hci_uart_test_out_len <
+                              BLE_HCI_UART_TEST_MAX_BYTES);
+            ble_hci_uart_test_out[ble_hci_uart_test_out_len++] = c;
+        }
+    }
+
+    return num;
+}
+
+/* Runs until every queued byte has been handed over */
+static void
+ble_hci_uart_test_run(int bytes_per_step)
+{
+    do {
+        ble_hci_uart_test_step(bytes_per_step);
+    } while (ble_hci_uart_test_in_off < ble_hci_uart_test_in_len);
+}
+
+static int
+ble_hci_uart_test_mbufs_free(void)
+{
+    return ble_hci_uart_test_mbuf_mempool.mp_num_free ==
+           BLE_HCI_UART_TEST_NUM_MBUFS;
+}
+
+/* Checks that captured packet idx is the H4 packet at off in the input */
+static void
+ble_hci_uart_test_pkt_check(int idx, int off, int len)
+{
+    struct ble_hci_uart_test_pkt *pkt;
+
+    TEST_ASSERT_FATAL(idx < ble_hci_uart_test_num_pkts);
+    pkt = ble_hci_uart_test_pkts + idx;
+    TEST_ASSERT(pkt->pkt_type == ble_hci_uart_test_in[off]);
+    TEST_ASSERT(pkt->len == len - 1);
+    TEST_ASSERT(memcmp(pkt->buf, ble_hci_uart_test_in + off + 1,
+                       len - 1) == 0);
+}
+
+/* Packets are reassembled however the bytes are split up on arrival */
+TEST_CASE(ble_hci_uart_test_case_split)
+{
+    uint8_t params[7] = { 0, 0xa0, 0x00, 0xa0, 0x00, 0, 0 };
+    int offs[3];
+    int lens[3];
+    int step;
+    int i;
+
+    for (step = 1; step <= 40; step++) {
+        ble_hci_uart_test_init();
+
+        offs[0] = 0;
+        lens[0] = ble_hci_uart_test_cmd_put(BLE_HCI_OCF_LE_SET_SCAN_PARAMS,
+                                            params, sizeof params);
+        offs[1] = offs[0] + lens[0];
+        lens[1] = ble_hci_uart_test_acl_put(0x0001, 27, step);
+        offs[2] = offs[1] + lens[1];
+        lens[2] = ble_hci_uart_test_cmd_put(BLE_HCI_OCF_LE_RD_BUF_SIZE,
+                                            NULL, 0);
+
+        ble_hci_uart_test_run(step);
+
+        TEST_ASSERT_FATAL(ble_hci_uart_test_num_pkts == 3);
+        for (i = 0; i < 3; i++) {
+            ble_hci_uart_test_pkt_check(i, offs[i], lens[i]);
+        }
+        TEST_ASSERT(g_ble_hci_uart_stats.rx_cmds == 2);
+        TEST_ASSERT(g_ble_hci_uart_stats.rx_acl_pkts == 1);
+        TEST_ASSERT(g_ble_hci_uart_stats.rx_sync_errs == 0);
+        TEST_ASSERT(ble_hci_uart_test_mbufs_free());
+    }
+}
+
+/* Packets that cross the end of the receive ring are reassembled */
+TEST_CASE(ble_hci_uart_test_case_ring_wrap)
+{
+    int offs[BLE_HCI_UART_TEST_MAX_PKTS];
+    int lens[BLE_HCI_UART_TEST_MAX_PKTS];
+    int num_pkts;
+    int off;
+    int i;
+
+    ble_hci_uart_test_init();
+
+    /* Odd lengths, so the packets end up at every offset in the ring */
+    off = 0;
+    num_pkts = 0;
+    while (off < 3 * BLE_HCI_UART_CFG_RX_BUF_SZ) {
+        offs[num_pkts] = off;
+        lens[num_pkts] = ble_hci_uart_test_acl_put(num_pkts, 37 + num_pkts % 5,
+                                                   num_pkts);
+        off += lens[num_pkts];
+        num_pkts++;
+    }
+
+    ble_hci_uart_test_run(100);
+
+    TEST_ASSERT_FATAL(ble_hci_uart_test_num_pkts == num_pkts);
+    for (i = 0; i < num_pkts; i++) {
+        ble_hci_uart_test_pkt_check(i, offs[i], lens[i]);
+    }
+    TEST_ASSERT(ble_hci_uart_test_mbufs_free());
+}
+
+/* Bytes that are not a packet indicator a host sends are skipped */
+TEST_CASE(ble_hci_uart_test_case_bad_type)
+{
+    uint8_t junk[] = {
+        BLE_HCI_UART_H4_NONE, BLE_HCI_UART_H4_SCO, BLE_HCI_UART_H4_EVT, 0xff
+    };
+    int off;
+    int len;
+
+    ble_hci_uart_test_init();
+
+    ble_hci_uart_test_host_put(junk, sizeof junk);
+    off = ble_hci_uart_test_in_len;
+    len = ble_hci_uart_test_cmd_put(BLE_HCI_OCF_LE_RD_BUF_SIZE, NULL, 0);
+    ble_hci_uart_test_run(1);
+
+    TEST_ASSERT(g_ble_hci_uart_stats.rx_sync_errs == sizeof junk);
+    TEST_ASSERT_FATAL(ble_hci_uart_test_num_pkts == 1);
+    ble_hci_uart_test_pkt_check(0, off, len);
+}
+
+/*
+ * A packet that does not fit in an mbuf, or arrives when there is none, is
+ * dropped; the parser skips its parameters and receives the next packet.
+ */
+TEST_CASE(ble_hci_uart_test_case_resync)
+{
+    struct os_mbuf *oms[BLE_HCI_UART_TEST_NUM_MBUFS];
+    int off;
+    int len;
+    int i;
+
+    ble_hci_uart_test_init();
+
+    /* Too long for an mbuf */
+    ble_hci_uart_test_acl_put(0x0001, BLE_HCI_UART_TEST_MBUF_BUF_SIZE + 1,
+                              BLE_HCI_UART_H4_CMD);
+    off = ble_hci_uart_test_in_len;
+    len = ble_hci_uart_test_acl_put(0x0001, 10, 0x22);
+    ble_hci_uart_test_run(64);
+
+    TEST_ASSERT(g_ble_hci_uart_stats.rx_too_long == 1);
+    TEST_ASSERT(g_ble_hci_uart_stats.rx_sync_errs == 0);
+    TEST_ASSERT_FATAL(ble_hci_uart_test_num_pkts == 1);
+    ble_hci_uart_test_pkt_check(0, off, len);
+
+    /* No mbuf */
+    for (i = 0; i < BLE_HCI_UART_TEST_NUM_MBUFS; i++) {
+        oms[i] = os_mbuf_get_pkthdr(&g_mbuf_pool);
+        TEST_ASSERT_FATAL(oms[i] != NULL);
+    }
+    ble_hci_uart_test_acl_put(0x0001, 20, BLE_HCI_UART_H4_ACL);
+    ble_hci_uart_test_run(64);
+    TEST_ASSERT(g_ble_hci_uart_stats.rx_no_bufs == 1);
+    for (i = 0; i < BLE_HCI_UART_TEST_NUM_MBUFS; i++) {
+        os_mbuf_free_chain(&g_mbuf_pool, oms[i]);
+    }
+
+    off = ble_hci_uart_test_in_len;
+    len = ble_hci_uart_test_cmd_put(BLE_HCI_OCF_LE_RD_BUF_SIZE, NULL, 0);
+    ble_hci_uart_test_run(64);
+
+    TEST_ASSERT(g_ble_hci_uart_stats.rx_sync_errs == 0);
+    TEST_ASSERT_FATAL(ble_hci_uart_test_num_pkts == 2);
+    ble_hci_uart_test_pkt_check(1, off, len);
+    TEST_ASSERT(ble_hci_uart_test_mbufs_free());
+}
+
+/*
+ * When the ring is full the driver holds the byte; the transport restarts
+ * it once it has made room, and nothing is lost.
+ */
+TEST_CASE(ble_hci_uart_test_case_ring_full)
+{
+    int num_pkts;
+    int num;
+    int i;
+
+    ble_hci_uart_test_init();
+
+    num_pkts = 0;
+    while (ble_hci_uart_test_in_len < 2 * BLE_HCI_UART_CFG_RX_BUF_SZ) {
+        ble_hci_uart_test_acl_put(0x0001, 60, num_pkts);
+        num_pkts++;
+    }
+
+    /* The ring holds one byte less than its size */
+    num = ble_hci_uart_test_step(BLE_HCI_UART_TEST_MAX_BYTES);
+    TEST_ASSERT(num == BLE_HCI_UART_CFG_RX_BUF_SZ - 1);
+    TEST_ASSERT(g_ble_hci_uart_stats.rx_ring_full == 1);
+    TEST_ASSERT(ble_hci_uart_test_rx_restarts == 1);
+
+    ble_hci_uart_test_run(BLE_HCI_UART_TEST_MAX_BYTES);
+    TEST_ASSERT_FATAL(ble_hci_uart_test_num_pkts == num_pkts);
+    for (i = 0; i < num_pkts; i++) {
+        TEST_ASSERT(ble_hci_uart_test_pkts[i].buf[BLE_HCI_DATA_HDR_LEN] == i);
+    }
+}
+
+/* Events are sent before ACL data, each with its packet indicator */
+TEST_CASE(ble_hci_uart_test_case_tx)
+{
+    struct os_mbuf *om;
+    uint8_t *b;
+    int i;
+
+    ble_hci_uart_test_init();
+
+    /* Queue ACL data, then an event, before the UART gets to run */
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    TEST_ASSERT_FATAL(om != NULL);
+    htole16(om->om_data, 0x0001);
+    htole16(om->om_data + 2, 3);
+    memset(om->om_data + BLE_HCI_DATA_HDR_LEN, 0x77, 3);
+    om->om_len = BLE_HCI_DATA_HDR_LEN + 3;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+    ble_hci_transport_ctlr_acl_data_send(om);
+
+    for (i = 0; i < 2; i++) {
+        om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+        TEST_ASSERT_FATAL(om != NULL);
+        om->om_data[0] = BLE_HCI_EVCODE_NUM_COMP_PKTS;
+        om->om_data[1] = 1;
+        om->om_data[2] = i;
+        om->om_len = BLE_HCI_EVENT_HDR_LEN + 1;
+        OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+        ble_hci_transport_ctlr_event_send(om);
+    }
+
+    ble_hci_uart_test_step(0);
+
+    /* The UART was started once, and took the events first */
+    TEST_ASSERT(g_ble_hci_uart_stats.tx_starts == 1);
+    TEST_ASSERT_FATAL(ble_hci_uart_test_out_len == 2 * 4 + 8);
+    b = ble_hci_uart_test_out;
+    TEST_ASSERT(b[0] == BLE_HCI_UART_H4_EVT);
+    TEST_ASSERT(b[1] == BLE_HCI_EVCODE_NUM_COMP_PKTS && b[3] == 0);
+    TEST_ASSERT(b[4] == BLE_HCI_UART_H4_EVT && b[7] == 1);
+    TEST_ASSERT(b[8] == BLE_HCI_UART_H4_ACL);
+    TEST_ASSERT(b[13] == 0x77 && b[15] == 0x77);
+    TEST_ASSERT(g_ble_hci_uart_stats.tx_bytes == ble_hci_uart_test_out_len);
+    TEST_ASSERT(ble_hci_uart_test_mbufs_free());
+}
+
+TEST_SUITE(ble_hci_uart_test_suite)
+{
+    ble_hci_uart_test_case_split();
+    ble_hci_uart_test_case_ring_wrap();
+    ble_hci_uart_test_case_bad_type();
+    ble_hci_uart_test_case_resync();
+    ble_hci_uart_test_case_ring_full();
+    ble_hci_uart_test_case_tx();
+}
+
+int
+ble_hci_uart_test_all(void)
+{
+    ble_hci_uart_test_suite();
+
+    return tu_case_failed;
+}
+
+#ifdef PKG_TEST
+
+int
+main(void)
+{
+    tu_config.tc_print_results = 1;
+    tu_init();
+
+    ble_hci_uart_test_all();
+
+    return tu_any_failed;
+}
+
+#endif
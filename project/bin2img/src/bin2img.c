@@ -4,7 +4,7 @@
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
  * You may obtain a copy of the License at
- * 
+ *
  *   http://www.apache.org/licenses/LICENSE-2.0
  *
  * Unless required by applicable law or agreed to in writing, software
@@ -14,26 +14,89 @@
  * limitations under the License.
  */
 
+/**
+ * bin2img converts raw binaries into boot loader images, and checks existing
+ * images.  Each input file is an independent job; jobs are spread across a
+ * pool of threads, and each job streams its file through a fixed-size buffer
+ * (delta and compressed images excepted, as their encoders need the whole
+ * image in memory).  Results are reported in command line order once all
+ * jobs have finished.
+ */
+
 #include <assert.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include "bootutil/image.h"
-#include "crc32.h"
+#include "bootutil/image_comp.h"
+#include "bootutil/image_delta.h"
+#include "bootutil/crc32.h"
 
 #if !defined(__BYTE_ORDER__) || (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
 #error "Machine must be little endian"
 #endif
 
+#define BIN2IMG_BUF_SZ          (256 * 1024)
+#define BIN2IMG_MSG_SZ          512
+#define BIN2IMG_MAX_THREADS     64
+
+#define BIN2IMG_CRC_START \
+    (offsetof(struct image_header, ih_crc32) + \
+     sizeof ((struct image_header *)0)->ih_crc32)
+
+enum bin2img_mode {
+    BIN2IMG_MODE_CREATE,
+    BIN2IMG_MODE_INSPECT,
+    BIN2IMG_MODE_VERIFY,
+};
+
+struct bin2img_job {
+    const char *bj_in;
+    const char *bj_out;     /* Create only. */
+    int bj_rc;
+    char bj_msg[BIN2IMG_MSG_SZ];
+};
+
+/** Settings shared by all jobs; read only once the workers start. */
+static enum bin2img_mode bin2img_mode;
+static struct image_version bin2img_ver;
+static const char *bin2img_base_filename;
+static int bin2img_compress;
+
+static struct bin2img_job *bin2img_jobs;
+static int bin2img_num_jobs;
+static int bin2img_next_job;
+
 static void
 print_usage(FILE *stream)
 {
-    fprintf(stream, "usage: bin2img <in-filename> <out-filename> <version>\n");
+    fprintf(stream, "usage: bin2img [-j <jobs>] [-d <base-image> | -z] "
+                    "<in-filename> <out-filename> <version>\n");
+    fprintf(stream, "       bin2img [-j <jobs>] [-z] -b <version> "
+                    "<in-filename> <out-filename> [...]\n");
+    fprintf(stream, "       bin2img inspect [-j <jobs>] <image> [...]\n");
+    fprintf(stream, "       bin2img verify [-j <jobs>] <image> [...]\n");
     fprintf(stream, "\n");
     fprintf(stream, "version numbers are of the form: XX.XX.XXXX.XXXXXXXX\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "-b converts any number of input/output pairs, all "
+                    "with the same version.\n");
+    fprintf(stream, "-d generates a delta image, which the boot loader only "
+                    "applies to the\n");
+    fprintf(stream, "specified base image.\n");
+    fprintf(stream, "-j sets the number of files processed in parallel "
+                    "(default: one per core).\n");
+    fprintf(stream, "-z generates a compressed image.\n");
+    fprintf(stream, "inspect prints each image's header and checks its "
+                    "CRC.\n");
+    fprintf(stream, "verify only reports bad images; the exit status is "
+                    "nonzero if there\n");
+    fprintf(stream, "are any.\n");
 }
 
 static int
@@ -76,6 +139,11 @@ parse_ver(struct image_version *out_ver, char *s)
     }
     out_ver->iv_revision = ul;
 
+    tok = strtok(NULL, ".");
+    if (tok == NULL) {
+        return -1;
+    }
+
     ul = strtoul(tok, &ep, 16);
     if (tok[0] == '\0' || ep[0] != '\0' || ul > UINT32_MAX) {
         return -1;
@@ -85,113 +153,597 @@ parse_ver(struct image_version *out_ver, char *s)
     return 0;
 }
 
-static int
-is_image_file(const char *filename)
+static void
+job_fail(struct bin2img_job *job, const char *fmt, const char *filename)
+{
+    snprintf(job->bj_msg, sizeof job->bj_msg, fmt, filename);
+    job->bj_rc = 1;
+}
+
+/**
+ * Reads an entire file into a malloc'd buffer, leaving room for a header in
+ * front of the contents.
+ */
+static uint8_t *
+read_file(struct bin2img_job *job, const char *filename, uint32_t prefix_len,
+          uint32_t *out_len)
 {
+    struct stat st;
+    uint8_t *buf;
     FILE *fp;
-    uint32_t magic;
+    int rc;
 
     fp = fopen(filename, "rb");
     if (fp == NULL) {
-        return 0;
+        job_fail(job, "* error: could not open file %s", filename);
+        return NULL;
+    }
+
+    rc = fstat(fileno(fp), &st);
+    if (rc != 0) {
+        job_fail(job, "* error: could not stat file %s", filename);
+        fclose(fp);
+        return NULL;
     }
 
-    magic = 0;
-    fread(&magic, sizeof magic, 1, fp);
+    buf = malloc(prefix_len + st.st_size + 1);
+    assert(buf != NULL);
+
+    if (fread(buf + prefix_len, 1, st.st_size, fp) != st.st_size) {
+        job_fail(job, "* error: file read error (file=%s)", filename);
+        fclose(fp);
+        free(buf);
+        return NULL;
+    }
 
     fclose(fp);
 
-    return magic == IMAGE_MAGIC;
+    *out_len = st.st_size;
+    return buf;
 }
 
-int
-main(int argc, char **argv)
+static int
+write_file(struct bin2img_job *job, const uint8_t *buf, uint32_t len)
+{
+    FILE *fp;
+    int rc;
+
+    fp = fopen(job->bj_out, "wb");
+    if (fp == NULL) {
+        job_fail(job, "* error: could not open output file %s", job->bj_out);
+        return -1;
+    }
+
+    rc = fwrite(buf, len, 1, fp);
+    if (fclose(fp) != 0 || rc != 1) {
+        job_fail(job, "* error: file write error (file=%s)", job->bj_out);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+fill_header(struct image_header *hdr, uint32_t img_size)
+{
+    memset(hdr, 0, sizeof *hdr);
+    hdr->ih_magic = IMAGE_MAGIC;
+    hdr->ih_hdr_size = sizeof *hdr;
+    hdr->ih_img_size = img_size;
+    hdr->ih_ver = bin2img_ver;
+}
+
+/**
+ * Replaces a full image with a delta or compressed image.  The new image
+ * keeps the full image's version number.
+ */
+static void
+wrap_image(struct bin2img_job *job, uint8_t **buf, uint32_t *len,
+           uint32_t flag, uint8_t *body, uint32_t body_len)
 {
     struct image_header hdr;
-    struct stat st;
+    uint8_t *out;
+
+    memcpy(&hdr, *buf, sizeof hdr);
+    hdr.ih_hdr_size = sizeof hdr;
+    hdr.ih_img_size = body_len;
+    hdr.ih_flags |= flag;
+
+    out = malloc(sizeof hdr + body_len);
+    assert(out != NULL);
+    memcpy(out + sizeof hdr, body, body_len);
+    free(body);
+
+    memcpy(out, &hdr, sizeof hdr);
+    hdr.ih_crc32 = crc32(0, out + BIN2IMG_CRC_START,
+                         sizeof hdr - BIN2IMG_CRC_START + body_len);
+    memcpy(out, &hdr, sizeof hdr);
+
+    snprintf(job->bj_msg, sizeof job->bj_msg,
+             "%s: %s image %u bytes; full image %u bytes (%u%%)",
+             job->bj_out, flag == IMAGE_F_DELTA ? "delta" : "compressed",
+             (unsigned)(sizeof hdr + body_len), (unsigned)*len,
+             (unsigned)((sizeof hdr + body_len) * 100 / *len));
+
+    free(*buf);
+    *buf = out;
+    *len = sizeof hdr + body_len;
+}
+
+/**
+ * Creates a delta or compressed image.  The whole image is held in memory,
+ * as the encoders need random access to it.
+ */
+static int
+create_wrapped(struct bin2img_job *job, FILE *fpin)
+{
+    struct image_header hdr;
+    uint8_t *base;
+    uint8_t *body;
     uint8_t *buf;
+    uint32_t base_len;
+    uint32_t body_len;
+    uint32_t len;
+    int rc;
+
+    fclose(fpin);
+
+    buf = read_file(job, job->bj_in, sizeof hdr, &len);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    fill_header(&hdr, len);
+    memcpy(buf, &hdr, sizeof hdr);
+    hdr.ih_crc32 = crc32(0, buf + BIN2IMG_CRC_START,
+                         sizeof hdr - BIN2IMG_CRC_START + len);
+    memcpy(buf, &hdr, sizeof hdr);
+    len += sizeof hdr;
+
+    if (bin2img_base_filename != NULL) {
+        base = read_file(job, bin2img_base_filename, 0, &base_len);
+        if (base == NULL) {
+            free(buf);
+            return -1;
+        }
+
+        if (base_len < sizeof hdr ||
+            ((struct image_header *)base)->ih_magic != IMAGE_MAGIC) {
+
+            job_fail(job, "* error: base file is not an image (%s)",
+                     bin2img_base_filename);
+            free(base);
+            free(buf);
+            return -1;
+        }
+
+        rc = image_delta_create(base, base_len, buf, len, &body, &body_len);
+        free(base);
+    } else {
+        rc = image_comp_create(buf, len, &body, &body_len);
+    }
+    if (rc != 0) {
+        job_fail(job, "* error: could not encode image (file=%s)",
+                 job->bj_in);
+        free(buf);
+        return -1;
+    }
+
+    if (bin2img_base_filename != NULL) {
+        wrap_image(job, &buf, &len, IMAGE_F_DELTA, body, body_len);
+    } else {
+        wrap_image(job, &buf, &len, IMAGE_F_COMPRESSED, body, body_len);
+    }
+
+    rc = write_file(job, buf, len);
+    free(buf);
+    return rc;
+}
+
+/**
+ * Creates a full image.  The input is copied to the output one buffer at a
+ * time, and the CRC is accumulated along the way; the header is written last.
+ */
+static int
+create_image(struct bin2img_job *job, uint8_t *buf)
+{
+    struct image_header hdr;
+    struct stat st;
+    uint32_t magic;
+    uint32_t crc;
+    size_t total;
+    size_t n;
     FILE *fpout;
     FILE *fpin;
-    int crc_field_off;
-    int crc_start;
-    int crc_len;
     int rc;
 
-    if (argc < 4) {
-        print_usage(stderr);
-        return 1;
+    fpin = fopen(job->bj_in, "rb");
+    if (fpin == NULL) {
+        job_fail(job, "* error: could not open input file %s", job->bj_in);
+        return -1;
     }
 
-    memset(&hdr, 0, sizeof hdr);
+    if (fread(&magic, sizeof magic, 1, fpin) == 1 && magic == IMAGE_MAGIC) {
+        job_fail(job, "* error: source file is already an image (%s)",
+                 job->bj_in);
+        fclose(fpin);
+        return -1;
+    }
+    rewind(fpin);
 
-    fpin = fopen(argv[1], "rb");
-    if (fpin == NULL) {
-        fprintf(stderr, "* error: could not open input file %s\n", argv[1]);
-        print_usage(stderr);
-        return 1;
+    if (bin2img_base_filename != NULL || bin2img_compress) {
+        return create_wrapped(job, fpin);
     }
 
-    if (is_image_file(argv[1])) {
-        fprintf(stderr, "* error: source file is already an image (%s)\n",
-                argv[1]);
-        print_usage(stderr);
-        return 1;
+    rc = fstat(fileno(fpin), &st);
+    if (rc != 0) {
+        job_fail(job, "* error: could not stat file %s", job->bj_in);
+        fclose(fpin);
+        return -1;
     }
 
-    fpout = fopen(argv[2], "wb");
+    fpout = fopen(job->bj_out, "wb");
     if (fpout == NULL) {
-        fprintf(stderr, "* error: could not open output file %s\n", argv[1]);
-        print_usage(stderr);
-        return 1;
+        job_fail(job, "* error: could not open output file %s", job->bj_out);
+        fclose(fpin);
+        return -1;
     }
 
-    rc = parse_ver(&hdr.ih_ver, argv[3]);
-    if (rc != 0) {
-        print_usage(stderr);
-        return 1;
+    fill_header(&hdr, st.st_size);
+    crc = crc32(0, (uint8_t *)&hdr + BIN2IMG_CRC_START,
+                sizeof hdr - BIN2IMG_CRC_START);
+
+    /* Reserve space for the header; it is rewritten once the CRC is known. */
+    rc = 0;
+    if (fwrite(&hdr, sizeof hdr, 1, fpout) != 1) {
+        rc = -1;
     }
 
-    rc = stat(argv[1], &st);
-    if (rc != 0) {
-        perror("stat");
-        print_usage(stderr);
-        return 1;
+    total = 0;
+    while (rc == 0 && (n = fread(buf, 1, BIN2IMG_BUF_SZ, fpin)) > 0) {
+        crc = crc32(crc, buf, n);
+        if (fwrite(buf, 1, n, fpout) != n) {
+            rc = -1;
+        }
+        total += n;
+    }
+
+    if (rc == 0 && ferror(fpin)) {
+        job_fail(job, "* error: file read error (file=%s)", job->bj_in);
+        fclose(fpin);
+        fclose(fpout);
+        return -1;
+    }
+    fclose(fpin);
+
+    if (rc == 0 && total != st.st_size) {
+        job_fail(job, "* error: file read error (inconsistent length) "
+                      "(file=%s)", job->bj_in);
+        fclose(fpout);
+        return -1;
+    }
+
+    hdr.ih_crc32 = crc;
+    if (rc == 0 && (fseek(fpout, 0, SEEK_SET) != 0 ||
+                    fwrite(&hdr, sizeof hdr, 1, fpout) != 1)) {
+        rc = -1;
     }
 
-    buf = malloc(sizeof hdr + st.st_size);
+    if (fclose(fpout) != 0 || rc != 0) {
+        job_fail(job, "* error: file write error (file=%s)", job->bj_out);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks an image file: its header must be sane, its length must match the
+ * header, and its CRC must be correct.  The file is read one buffer at a
+ * time.
+ */
+static int
+check_image(struct bin2img_job *job, uint8_t *buf)
+{
+    struct image_delta_hdr delta_hdr;
+    struct image_comp_hdr comp_hdr;
+    struct image_header hdr;
+    struct stat st;
+    const char *problem;
+    uint64_t expected_len;
+    uint64_t remaining;
+    uint32_t crc;
+    size_t chunk_sz;
+    char extra[128];
+    FILE *fp;
+    int rc;
+
+    fp = fopen(job->bj_in, "rb");
+    if (fp == NULL) {
+        job_fail(job, "%s: BAD (could not open file)", job->bj_in);
+        return -1;
+    }
+
+    rc = fstat(fileno(fp), &st);
+    if (rc != 0 || fread(&hdr, sizeof hdr, 1, fp) != 1) {
+        fclose(fp);
+        job_fail(job, "%s: BAD (too short for an image header)", job->bj_in);
+        return -1;
+    }
+
+    problem = NULL;
+    crc = 0;
+    extra[0] = '\0';
+    expected_len = (uint64_t)hdr.ih_hdr_size + hdr.ih_img_size;
+
+    if (hdr.ih_magic != IMAGE_MAGIC) {
+        problem = "bad magic";
+    } else if (hdr.ih_hdr_size < sizeof hdr) {
+        problem = "bad header size";
+    } else if (expected_len != st.st_size) {
+        problem = "length does not match header";
+    } else {
+        /* The CRC covers the rest of the header, any padding after it, and
+         * the body.
+         */
+        crc = crc32(0, (uint8_t *)&hdr + BIN2IMG_CRC_START,
+                    sizeof hdr - BIN2IMG_CRC_START);
+        remaining = expected_len - sizeof hdr;
+        while (remaining > 0) {
+            chunk_sz = remaining < BIN2IMG_BUF_SZ ? remaining : BIN2IMG_BUF_SZ;
+            if (fread(buf, 1, chunk_sz, fp) != chunk_sz) {
+                problem = "read error";
+                break;
+            }
+
+            if (remaining == expected_len - sizeof hdr &&
+                chunk_sz >= hdr.ih_hdr_size - sizeof hdr + sizeof delta_hdr) {
+
+                /* First chunk; describe delta and compressed bodies. */
+                if (hdr.ih_flags & IMAGE_F_DELTA) {
+                    memcpy(&delta_hdr, buf + hdr.ih_hdr_size - sizeof hdr,
+                           sizeof delta_hdr);
+                    snprintf(extra, sizeof extra,
+                             " base_crc=0x%08x base_size=%u tgt_size=%u",
+                             (unsigned)delta_hdr.idh_base_crc32,
+                             (unsigned)delta_hdr.idh_base_size,
+                             (unsigned)delta_hdr.idh_tgt_size);
+                } else if (hdr.ih_flags & IMAGE_F_COMPRESSED) {
+                    memcpy(&comp_hdr, buf + hdr.ih_hdr_size - sizeof hdr,
+                           sizeof comp_hdr);
+                    snprintf(extra, sizeof extra, " tgt_size=%u",
+                             (unsigned)comp_hdr.ich_tgt_size);
+                }
+            }
+
+            crc = crc32(crc, buf, chunk_sz);
+            remaining -= chunk_sz;
+        }
+
+        if (problem == NULL && crc != hdr.ih_crc32) {
+            problem = "CRC mismatch";
+        }
+    }
+
+    fclose(fp);
+
+    if (problem != NULL) {
+        snprintf(job->bj_msg, sizeof job->bj_msg, "%s: BAD (%s)",
+                 job->bj_in, problem);
+        job->bj_rc = 1;
+    } else if (bin2img_mode == BIN2IMG_MODE_INSPECT) {
+        snprintf(job->bj_msg, sizeof job->bj_msg,
+                 "%s: OK version=%u.%u.%u.%u hdr_size=%u img_size=%u "
+                 "flags=0x%08x%s%s%s crc=0x%08x%s",
+                 job->bj_in, hdr.ih_ver.iv_major, hdr.ih_ver.iv_minor,
+                 hdr.ih_ver.iv_revision, (unsigned)hdr.ih_ver.iv_build_num,
+                 (unsigned)hdr.ih_hdr_size, (unsigned)hdr.ih_img_size,
+                 (unsigned)hdr.ih_flags,
+                 hdr.ih_flags & IMAGE_F_PIC ? " pic" : "",
+                 hdr.ih_flags & IMAGE_F_DELTA ? " delta" : "",
+                 hdr.ih_flags & IMAGE_F_COMPRESSED ? " compressed" : "",
+                 (unsigned)hdr.ih_crc32, extra);
+    }
+
+    return job->bj_rc == 0 ? 0 : -1;
+}
+
+static void *
+worker(void *arg)
+{
+    struct bin2img_job *job;
+    uint8_t *buf;
+    int idx;
+
+    buf = malloc(BIN2IMG_BUF_SZ);
     assert(buf != NULL);
 
-    rc = fread(buf + sizeof hdr, st.st_size, 1, fpin);
-    if (rc != 1) {
-        if (ferror(fpin)) {
-            fprintf(stderr, "* error: file read error (%s) (file=%s)\n",
-                    strerror(errno), argv[1]);
+    while (1) {
+        idx = __atomic_fetch_add(&bin2img_next_job, 1, __ATOMIC_RELAXED);
+        if (idx >= bin2img_num_jobs) {
+            break;
+        }
+
+        job = bin2img_jobs + idx;
+        if (bin2img_mode == BIN2IMG_MODE_CREATE) {
+            create_image(job, buf);
         } else {
-            fprintf(stderr, "* error: file read error (inconsistent length) "
-                            "(file=%s)\n", argv[1]);
+            check_image(job, buf);
         }
-        print_usage(stderr);
-        return 1;
     }
 
-    hdr.ih_magic = IMAGE_MAGIC;
-    hdr.ih_hdr_size = sizeof hdr;
-    hdr.ih_img_size = st.st_size;
-    memcpy(buf, &hdr, sizeof hdr);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Runs all jobs on the specified number of threads, then reports the results
+ * in order.
+ *
+ * @return                      The number of failed jobs.
+ */
+static int
+run_jobs(int num_threads)
+{
+    pthread_t threads[BIN2IMG_MAX_THREADS];
+    int num_failed;
+    int rc;
+    int i;
+
+    if (num_threads > bin2img_num_jobs) {
+        num_threads = bin2img_num_jobs;
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        rc = pthread_create(threads + i, NULL, worker, NULL);
+        if (rc != 0) {
+            break;
+        }
+    }
+    num_threads = i;
+
+    if (num_threads == 0) {
+        /* No threads available; do the work here. */
+        worker(NULL);
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    num_failed = 0;
+    for (i = 0; i < bin2img_num_jobs; i++) {
+        if (bin2img_jobs[i].bj_msg[0] != '\0') {
+            fprintf(bin2img_jobs[i].bj_rc == 0 ? stdout : stderr, "%s\n",
+                    bin2img_jobs[i].bj_msg);
+        }
+        if (bin2img_jobs[i].bj_rc != 0) {
+            num_failed++;
+        }
+    }
+
+    return num_failed;
+}
+
+int
+main(int argc, char **argv)
+{
+    char *batch_ver;
+    long num_threads;
+    char *ep;
+    int num_files;
+    int rc;
+    int ch;
+    int i;
+
+    bin2img_mode = BIN2IMG_MODE_CREATE;
+    if (argc > 1 && strcmp(argv[1], "inspect") == 0) {
+        bin2img_mode = BIN2IMG_MODE_INSPECT;
+    } else if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+        bin2img_mode = BIN2IMG_MODE_VERIFY;
+    }
+    if (bin2img_mode != BIN2IMG_MODE_CREATE) {
+        argc--;
+        argv++;
+    }
+
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    batch_ver = NULL;
+    while ((ch = getopt(argc, argv, "b:d:j:z")) != -1) {
+        switch (ch) {
+        case 'b':
+            batch_ver = optarg;
+            break;
+
+        case 'd':
+            bin2img_base_filename = optarg;
+            break;
+
+        case 'j':
+            num_threads = strtol(optarg, &ep, 10);
+            if (optarg[0] == '\0' || ep[0] != '\0' || num_threads < 1) {
+                print_usage(stderr);
+                return 1;
+            }
+            break;
+
+        case 'z':
+            bin2img_compress = 1;
+            break;
+
+        default:
+            print_usage(stderr);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
 
-    crc_field_off = offsetof(struct image_header, ih_crc32);
-    crc_start = crc_field_off + sizeof hdr.ih_crc32;
-    crc_len = sizeof hdr - crc_start + st.st_size;
-    hdr.ih_crc32 = crc32(0, buf + crc_start, crc_len);
-    memcpy(buf + crc_field_off, &hdr.ih_crc32, sizeof hdr.ih_crc32);
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > BIN2IMG_MAX_THREADS) {
+        num_threads = BIN2IMG_MAX_THREADS;
+    }
 
-    rc = fwrite(buf, sizeof hdr + st.st_size, 1, fpout);
-    if (rc != 1) {
-        fprintf(stderr, "* error: file write error (file=%s)\n", argv[2]);
+    if (bin2img_base_filename != NULL && bin2img_compress) {
         print_usage(stderr);
         return 1;
     }
 
-    return 0;
-}
+    switch (bin2img_mode) {
+    case BIN2IMG_MODE_CREATE:
+        if (batch_ver != NULL) {
+            /* A delta only applies to one base image. */
+            if (argc < 2 || argc % 2 != 0 || bin2img_base_filename != NULL) {
+                print_usage(stderr);
+                return 1;
+            }
+            num_files = argc / 2;
+        } else {
+            if (argc != 3) {
+                print_usage(stderr);
+                return 1;
+            }
+            batch_ver = argv[2];
+            num_files = 1;
+        }
 
+        rc = parse_ver(&bin2img_ver, batch_ver);
+        if (rc != 0) {
+            print_usage(stderr);
+            return 1;
+        }
+        break;
+
+    default:
+        if (argc < 1 || batch_ver != NULL || bin2img_base_filename != NULL ||
+            bin2img_compress) {
+
+            print_usage(stderr);
+            return 1;
+        }
+        num_files = argc;
+        break;
+    }
+
+    bin2img_jobs = calloc(num_files, sizeof *bin2img_jobs);
+    assert(bin2img_jobs != NULL);
+    bin2img_num_jobs = num_files;
+
+    for (i = 0; i < num_files; i++) {
+        if (bin2img_mode == BIN2IMG_MODE_CREATE) {
+            bin2img_jobs[i].bj_in = argv[i * 2];
+            bin2img_jobs[i].bj_out = argv[i * 2 + 1];
+        } else {
+            bin2img_jobs[i].bj_in = argv[i];
+        }
+    }
+
+    /* Build the CRC tables before the workers race to do so. */
+    crc32_init();
+
+    rc = run_jobs(num_threads);
+    free(bin2img_jobs);
+
+    return rc == 0 ? 0 : 1;
+}
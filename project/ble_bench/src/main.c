@@ -0,0 +1,717 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Link layer scheduling benchmark for the sim target.
+ *
+ * The controller is the master of a number of simulated slaves. It sends them
+ * 20 byte ACL data packets round robin, as fast as its ACL buffers are
+ * returned, while it scans passively for 16 other advertisers. Everything
+ * runs over the simulated PHY in simulated time: cputime is a manual clock
+ * and the link layer task's events are processed as it is advanced, so the
+ * results are the same on any machine.
+ *
+ * Each scenario prints one line of space-separated key=value pairs, followed
+ * by one line for each type of scheduler item that ran:
+ *
+ *     ble_bench: itvl_ms=50.00 slaves=8 conn_events=... conn_ev_missed=...
+ *     ble_bench:     sched=conn runs=... late_avg_us=... deferred=... ...
+ *
+ *  conn_events         Connection events started (all connections).
+ *  conn_ev_missed      Events that were started too late to run.
+ *  conn_ev_late        Events skipped; already over when scheduled.
+ *  acl_kbps            Data received by the slaves.
+ *  scan_rpts_per_s     Advertising reports sent to the host.
+ *  disconnects         Connections lost; should be 0.
+ *
+ * The scheduler lines show, per type of item, how late items started, how
+ * many waited for another item and how many were preempted.
+ *
+ * Usage: ble_bench [-i itvl] [-n slaves] [-t secs]
+ *     -i: Connection interval, in 1.25 ms units.
+ *     -n: Number of slaves.
+ *     -t: Seconds to measure each scenario for (default 5).
+ * With -i or -n, only that scenario is run. Each scenario starts from the
+ * same random seed, so it gives the same results run on its own.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "os/os.h"
+#include "hal/hal_cputime.h"
+#include "mcu/native_cputime.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/hci_transport.h"
+#include "controller/phy.h"
+#include "controller/phy_sim.h"
+#include "controller/ll.h"
+#include "controller/ll_adv.h"
+#include "controller/ll_hci.h"
+#include "controller/ll_sched.h"
+#include "controller/ll_conn.h"
+
+#define BLE_BENCH_MAX_SLAVES        (BLE_LL_CONN_CFG_MAX_CONNS)
+#define BLE_BENCH_NUM_ADVS          (16)
+#define BLE_BENCH_ADV_ITVL_USECS    (100000)
+#define BLE_BENCH_ACL_LEN           (20)
+#define BLE_BENCH_SECS              (5)
+
+/* 1 second supervision timeout, in 10 ms units */
+#define BLE_BENCH_SPVN_TMO          (100)
+
+/* The slave being connected to advertises this often */
+#define BLE_BENCH_CONN_ADV_USECS    (5000)
+
+/* Give up on a connection not created in this time */
+#define BLE_BENCH_CONNECT_USECS     (2000000)
+
+/* How far the clock moves between passes over the LL's event queue */
+#define BLE_BENCH_STEP_USECS        (50)
+
+/* Create a mbuf pool of BLE mbufs */
+#define MBUF_NUM_MBUFS      (64)
+#define MBUF_BUF_SIZE       (256)
+#define MBUF_MEMBLOCK_SIZE  \
+    (MBUF_BUF_SIZE + sizeof(struct os_mbuf) + sizeof(struct os_mbuf_pkthdr) + \
+     sizeof(struct ble_mbuf_hdr))
+
+#define MBUF_MEMPOOL_SIZE   OS_MEMPOOL_SIZE(MBUF_NUM_MBUFS, MBUF_MEMBLOCK_SIZE)
+
+struct os_mbuf_pool g_mbuf_pool;
+struct os_mempool g_mbuf_mempool;
+os_membuf_t g_mbuf_buffer[MBUF_MEMPOOL_SIZE];
+
+uint8_t g_dev_addr[BLE_DEV_ADDR_LEN];
+uint8_t g_random_addr[BLE_DEV_ADDR_LEN];
+
+struct ble_bench_scenario {
+    uint16_t bbs_itvl;
+    int bbs_slaves;
+};
+
+static const struct ble_bench_scenario ble_bench_scenarios[] = {
+    { 40, 1 },
+    { 40, 8 },
+    { 40, 16 },
+    { 40, 24 },
+    { 40, 32 },
+    { 24, 16 },
+    { 24, 24 },
+    { 24, 32 },
+    { 0 },
+};
+
+static const char *ble_bench_sched_names[BLE_LL_SCHED_TYPE_MAX] = {
+    [BLE_LL_SCHED_TYPE_ADV] =       "adv",
+    [BLE_LL_SCHED_TYPE_SCAN] =      "scan",
+    [BLE_LL_SCHED_TYPE_TX] =        "tx",
+    [BLE_LL_SCHED_TYPE_RX] =        "rx",
+    [BLE_LL_SCHED_TYPE_CONN] =      "conn",
+    [BLE_LL_SCHED_TYPE_ADV_EXT] =   "adv_ext",
+};
+
+/*
+ * A simulated slave. It answers every PDU of the master one IFS after it
+ * ends, with an empty PDU or the response to a data length request.
+ */
+struct ble_bench_slave {
+    uint8_t bs_addr[BLE_DEV_ADDR_LEN];
+    int bs_advertising;
+    int bs_connected;
+    uint32_t bs_access_addr;
+    uint8_t bs_sn;
+    uint8_t bs_nesn;
+    uint8_t bs_pdu[BLE_LL_PDU_HDR_LEN + BLE_LL_CTRL_LENGTH_REQ_LEN + 1];
+    int bs_pdu_valid;
+    int bs_length_rsp;
+    uint32_t bs_rx_bytes;
+};
+
+static struct ble_bench_slave ble_bench_slaves[BLE_BENCH_MAX_SLAVES];
+
+/*
+ * A simulated advertiser. The PDUs of an advertising event are placed on
+ * the medium one at a time, from a timer, so few frames are queued at once.
+ */
+struct ble_bench_adv {
+    uint8_t ba_addr[BLE_DEV_ADDR_LEN];
+    uint8_t ba_pdu_type;
+    uint32_t ba_itvl;
+    int ba_chan;
+    struct cpu_timer ba_timer;
+};
+
+static struct ble_bench_adv ble_bench_advs[BLE_BENCH_NUM_ADVS];
+static struct ble_bench_adv ble_bench_conn_adv;
+
+/* Host side */
+static int ble_bench_cmd_status;
+static uint16_t ble_bench_handles[BLE_BENCH_MAX_SLAVES];
+static int ble_bench_num_conns;
+static int ble_bench_acl_credits;
+static uint32_t ble_bench_adv_rpts;
+static int ble_bench_disconnects;
+
+static uint32_t ble_bench_tick_time;
+
+int
+ble_hci_transport_ctlr_event_send(struct os_mbuf *om)
+{
+    uint8_t *b;
+    int i;
+
+    b = om->om_data;
+    switch (b[0]) {
+    case BLE_HCI_EVCODE_COMMAND_COMPLETE:
+        ble_bench_cmd_status = b[5];
+        break;
+    case BLE_HCI_EVCODE_COMMAND_STATE:
+        ble_bench_cmd_status = b[2];
+        break;
+    case BLE_HCI_EVCODE_NUM_COMP_PKTS:
+        for (i = 0; i < b[2]; i++) {
+            ble_bench_acl_credits += le16toh(b + 3 + 2 * b[2] + 2 * i);
+        }
+        break;
+    case BLE_HCI_EVCODE_DISCNXN_CMP:
+        ble_bench_disconnects++;
+        break;
+    case BLE_HCI_EVCODE_LE_META:
+        if (b[2] == BLE_HCI_LE_SUBEV_CONN_COMPLETE && b[3] == BLE_ERR_SUCCESS) {
+            assert(ble_bench_num_conns < BLE_BENCH_MAX_SLAVES);
+            ble_bench_handles[ble_bench_num_conns++] = le16toh(b + 4);
+        } else if (b[2] == BLE_HCI_LE_SUBEV_ADV_RPT) {
+            ble_bench_adv_rpts += b[3];
+        }
+        break;
+    default:
+        break;
+    }
+
+    os_mbuf_free_chain(&g_mbuf_pool, om);
+    return 0;
+}
+
+int
+ble_hci_transport_ctlr_acl_data_send(struct os_mbuf *om)
+{
+    os_mbuf_free_chain(&g_mbuf_pool, om);
+    return 0;
+}
+
+/**
+ * Processes everything on the LL task's event queue, including the events
+ * that processing posts.
+ */
+static void
+ble_bench_pump(void)
+{
+    struct os_event *ev;
+
+    while ((ev = STAILQ_FIRST(&g_ll_data.ll_evq.evq_list)) != NULL) {
+        os_eventq_remove(&g_ll_data.ll_evq, ev);
+        ll_event_proc(ev);
+    }
+}
+
+/* Runs the link layer for the given time */
+static void
+ble_bench_run(uint32_t usecs)
+{
+    uint32_t end;
+
+    end = cputime_get32() + cputime_usecs_to_ticks(usecs);
+    while ((int32_t)(end - cputime_get32()) > 0) {
+        cputime_native_advance(cputime_usecs_to_ticks(BLE_BENCH_STEP_USECS));
+        while (cputime_get32() - ble_bench_tick_time >=
+               cputime_usecs_to_ticks(1000000 / OS_TICKS_PER_SEC)) {
+            os_time_tick();
+            os_callout_tick();
+            ble_bench_tick_time +=
+                cputime_usecs_to_ticks(1000000 / OS_TICKS_PER_SEC);
+        }
+        ble_bench_pump();
+    }
+}
+
+/* Sends an LE command; returns the status the controller answered with */
+static int
+ble_bench_cmd(uint16_t ocf, void *params, uint8_t len)
+{
+    struct os_mbuf *om;
+    int rc;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    assert(om != NULL);
+    htole16(om->om_data, (BLE_HCI_OGF_LE << 10) | ocf);
+    om->om_data[2] = len;
+    memcpy(om->om_data + BLE_HCI_CMD_HDR_LEN, params, len);
+    om->om_len = BLE_HCI_CMD_HDR_LEN + len;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    ble_bench_cmd_status = -1;
+    rc = ble_hci_transport_host_cmd_send(om);
+    assert(rc == 0);
+    ble_bench_pump();
+
+    return ble_bench_cmd_status;
+}
+
+static void
+ble_bench_acl_send(uint16_t handle)
+{
+    struct os_mbuf *om;
+    int rc;
+
+    om = os_mbuf_get_pkthdr(&g_mbuf_pool);
+    assert(om != NULL);
+    htole16(om->om_data, handle | (BLE_HCI_PB_FIRST_FLUSH << 12));
+    htole16(om->om_data + 2, BLE_BENCH_ACL_LEN);
+    memset(om->om_data + BLE_HCI_DATA_HDR_LEN, 0x5a, BLE_BENCH_ACL_LEN);
+    om->om_len = BLE_HCI_DATA_HDR_LEN + BLE_BENCH_ACL_LEN;
+    OS_MBUF_PKTHDR(om)->omp_len = om->om_len;
+
+    rc = ble_hci_transport_host_acl_data_send(om);
+    assert(rc == 0);
+}
+
+static void
+ble_bench_adv_timer_cb(void *arg)
+{
+    struct ble_bench_adv *adv;
+    uint8_t pdu[BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN + 8];
+    uint32_t now;
+    uint32_t next;
+
+    adv = arg;
+    pdu[0] = adv->ba_pdu_type;
+    pdu[1] = BLE_DEV_ADDR_LEN + 8;
+    memcpy(pdu + BLE_LL_PDU_HDR_LEN, adv->ba_addr, BLE_DEV_ADDR_LEN);
+    memset(pdu + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN, 0xa5, 8);
+
+    now = cputime_get32();
+    ble_phy_sim_rx_frame(BLE_PHY_ADV_CHAN_START + adv->ba_chan,
+                         BLE_ACCESS_ADDR_ADV, now + 20, pdu, sizeof pdu, 0);
+
+    /* Leave room for a CONNECT_REQ after each PDU */
+    if (++adv->ba_chan < 3) {
+        next = now + ll_pdu_tx_time_get(sizeof pdu) + 600;
+    } else {
+        adv->ba_chan = 0;
+        next = now + adv->ba_itvl + (rand() % 10000);
+    }
+    cputime_timer_start(&adv->ba_timer, next);
+}
+
+static void
+ble_bench_adv_init(struct ble_bench_adv *adv, uint8_t pdu_type,
+                   uint32_t itvl)
+{
+    adv->ba_pdu_type = pdu_type;
+    adv->ba_itvl = itvl;
+    adv->ba_chan = 0;
+    cputime_timer_init(&adv->ba_timer, ble_bench_adv_timer_cb, adv);
+}
+
+static void
+ble_bench_slave_start(struct ble_bench_slave *slave, uint8_t *pdu)
+{
+    uint8_t *lldata;
+
+    lldata = pdu + BLE_LL_PDU_HDR_LEN + 2 * BLE_DEV_ADDR_LEN;
+    slave->bs_access_addr = le32toh(lldata);
+    slave->bs_sn = 0;
+    slave->bs_nesn = 0;
+    slave->bs_pdu_valid = 0;
+    slave->bs_length_rsp = 0;
+    slave->bs_advertising = 0;
+    slave->bs_connected = 1;
+    cputime_timer_stop(&ble_bench_conn_adv.ba_timer);
+}
+
+/* The slave receives a PDU from the master */
+static void
+ble_bench_slave_rx(struct ble_bench_slave *slave, uint8_t *pdu)
+{
+    if (!!(pdu[0] & BLE_LL_DATA_HDR_SN_MASK) == slave->bs_nesn) {
+        slave->bs_nesn ^= 1;
+        if ((pdu[0] & BLE_LL_DATA_HDR_LLID_MASK) == BLE_LL_LLID_CTRL) {
+            if (pdu[BLE_LL_PDU_HDR_LEN] == BLE_LL_CTRL_LENGTH_REQ) {
+                slave->bs_length_rsp = 1;
+            }
+        } else {
+            slave->bs_rx_bytes += pdu[1];
+        }
+    }
+
+    if (!!(pdu[0] & BLE_LL_DATA_HDR_NESN_MASK) != slave->bs_sn) {
+        slave->bs_sn ^= 1;
+        slave->bs_pdu_valid = 0;
+    }
+}
+
+/* Gets the PDU the slave sends next; returns its length */
+static int
+ble_bench_slave_next(struct ble_bench_slave *slave)
+{
+    uint8_t *pdu;
+
+    pdu = slave->bs_pdu;
+    if (!slave->bs_pdu_valid) {
+        if (slave->bs_length_rsp) {
+            pdu[0] = BLE_LL_LLID_CTRL;
+            pdu[1] = BLE_LL_CTRL_LENGTH_REQ_LEN + 1;
+            pdu[2] = BLE_LL_CTRL_LENGTH_RSP;
+            htole16(pdu + 3, BLE_LL_CONN_SUPP_BYTES_MIN);
+            htole16(pdu + 5, BLE_LL_CONN_SUPP_TIME_MIN);
+            htole16(pdu + 7, BLE_LL_CONN_SUPP_BYTES_MIN);
+            htole16(pdu + 9, BLE_LL_CONN_SUPP_TIME_MIN);
+            slave->bs_length_rsp = 0;
+        } else {
+            pdu[0] = BLE_LL_LLID_DATA_FRAG;
+            pdu[1] = 0;
+        }
+        slave->bs_pdu_valid = 1;
+    }
+
+    pdu[0] &= BLE_LL_DATA_HDR_LLID_MASK;
+    if (slave->bs_nesn) {
+        pdu[0] |= BLE_LL_DATA_HDR_NESN_MASK;
+    }
+    if (slave->bs_sn) {
+        pdu[0] |= BLE_LL_DATA_HDR_SN_MASK;
+    }
+
+    return BLE_LL_PDU_HDR_LEN + pdu[1];
+}
+
+/* Called for every frame the controller transmits */
+static void
+ble_bench_tx_cb(uint8_t chan, uint32_t access_addr, uint32_t start_time,
+                uint32_t end_time, uint8_t *pdu, int len, int8_t txpwr_dbm)
+{
+    struct ble_bench_slave *slave;
+    int i;
+
+    for (i = 0; i < BLE_BENCH_MAX_SLAVES; i++) {
+        slave = ble_bench_slaves + i;
+        if (access_addr == BLE_ACCESS_ADDR_ADV) {
+            if (slave->bs_advertising &&
+                (pdu[0] & BLE_ADV_PDU_HDR_TYPE_MASK) ==
+                    BLE_ADV_PDU_TYPE_CONNECT_REQ &&
+                memcmp(pdu + BLE_LL_PDU_HDR_LEN + BLE_DEV_ADDR_LEN,
+                       slave->bs_addr, BLE_DEV_ADDR_LEN) == 0) {
+                ble_bench_slave_start(slave, pdu);
+                return;
+            }
+        } else if (slave->bs_connected &&
+                   slave->bs_access_addr == access_addr) {
+            ble_bench_slave_rx(slave, pdu);
+            len = ble_bench_slave_next(slave);
+            ble_phy_sim_rx_frame(chan, access_addr, end_time + BLE_LL_IFS,
+                                 slave->bs_pdu, len, 0);
+            return;
+        }
+    }
+}
+
+/* Starts the controller and the simulated devices afresh */
+static void
+ble_bench_init(void)
+{
+    struct ble_bench_slave *slave;
+    struct ble_bench_adv *adv;
+    int rc;
+    int i;
+
+    os_init();
+
+    rc = os_mempool_init(&g_mbuf_mempool, MBUF_NUM_MBUFS,
+                         MBUF_MEMBLOCK_SIZE, &g_mbuf_buffer[0], "mbuf_pool");
+    assert(rc == 0);
+    rc = os_mbuf_pool_init(&g_mbuf_pool, &g_mbuf_mempool,
+                           sizeof(struct ble_mbuf_hdr), MBUF_MEMBLOCK_SIZE,
+                           MBUF_NUM_MBUFS);
+    assert(rc == 0);
+
+    /* Set cputime to count at 1 usec increments, on a manual clock */
+    rc = cputime_init(1000000);
+    assert(rc == 0);
+    cputime_native_manual_set(1000);
+    ble_bench_tick_time = 1000;
+
+    memset(g_dev_addr, 0, sizeof g_dev_addr);
+    g_dev_addr[3] = 0x88;
+    g_dev_addr[4] = 0x88;
+    g_dev_addr[5] = 0x08;
+
+    rc = ll_init();
+    assert(rc == 0);
+
+    memset(&g_ble_phy_sim_cfg, 0, sizeof g_ble_phy_sim_cfg);
+    g_ble_phy_sim_cfg.seed = 1;
+    rc = ble_phy_init();
+    assert(rc == 0);
+    ble_phy_txpwr_set(0);
+    ble_phy_sim_tx_cb = ble_bench_tx_cb;
+
+    ble_bench_num_conns = 0;
+    ble_bench_acl_credits = BLE_LL_CFG_NUM_ACL_DATA_PKTS;
+
+    memset(ble_bench_slaves, 0, sizeof ble_bench_slaves);
+    for (i = 0; i < BLE_BENCH_MAX_SLAVES; i++) {
+        slave = ble_bench_slaves + i;
+        slave->bs_addr[0] = i;
+        slave->bs_addr[1] = 0x5b;
+        slave->bs_addr[5] = 0xc0;
+    }
+
+    ble_bench_adv_init(&ble_bench_conn_adv, BLE_ADV_PDU_TYPE_ADV_IND,
+                       BLE_BENCH_CONN_ADV_USECS);
+    for (i = 0; i < BLE_BENCH_NUM_ADVS; i++) {
+        adv = ble_bench_advs + i;
+        memset(adv->ba_addr, 0, BLE_DEV_ADDR_LEN);
+        adv->ba_addr[0] = i;
+        adv->ba_addr[1] = 0xad;
+        adv->ba_addr[5] = 0xc0;
+        ble_bench_adv_init(adv, BLE_ADV_PDU_TYPE_ADV_NONCONN_IND,
+                           BLE_BENCH_ADV_ITVL_USECS);
+    }
+}
+
+/**
+ * Creates a connection to a slave. The slave advertises until it receives
+ * the CONNECT_REQ.
+ *
+ * @return int 0: connection created; -1 if it was not created in time.
+ */
+static int
+ble_bench_connect(int idx, uint16_t itvl)
+{
+    struct ble_bench_slave *slave;
+    uint8_t params[BLE_HCI_CREATE_CONN_LEN];
+    uint32_t usecs;
+    int num_conns;
+    int rc;
+
+    slave = ble_bench_slaves + idx;
+
+    memset(params, 0, sizeof params);
+    htole16(params, 0x0010);
+    htole16(params + 2, 0x0010);
+    params[4] = BLE_HCI_CONN_FILT_NO_WL;
+    params[5] = BLE_HCI_ADV_PEER_ADDR_PUBLIC;
+    memcpy(params + 6, slave->bs_addr, BLE_DEV_ADDR_LEN);
+    params[12] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    htole16(params + 13, itvl);
+    htole16(params + 15, itvl);
+    htole16(params + 19, BLE_BENCH_SPVN_TMO);
+    rc = ble_bench_cmd(BLE_HCI_OCF_LE_CREATE_CNXN, params, sizeof params);
+    assert(rc == 0);
+
+    memcpy(ble_bench_conn_adv.ba_addr, slave->bs_addr, BLE_DEV_ADDR_LEN);
+    ble_bench_conn_adv.ba_chan = 0;
+    slave->bs_advertising = 1;
+    cputime_timer_start(&ble_bench_conn_adv.ba_timer, cputime_get32());
+
+    num_conns = ble_bench_num_conns;
+    for (usecs = 0; ble_bench_num_conns == num_conns; usecs += 1000) {
+        if (usecs >= BLE_BENCH_CONNECT_USECS) {
+            cputime_timer_stop(&ble_bench_conn_adv.ba_timer);
+            slave->bs_advertising = 0;
+            return -1;
+        }
+        ble_bench_run(1000);
+    }
+
+    return 0;
+}
+
+static void
+ble_bench_scan_start(void)
+{
+    uint8_t params[7];
+    int rc;
+
+    params[0] = BLE_HCI_SCAN_TYPE_PASSIVE;
+    htole16(params + 1, BLE_HCI_SCAN_ITVL_DEF);
+    htole16(params + 3, BLE_HCI_SCAN_ITVL_DEF);
+    params[5] = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+    params[6] = BLE_HCI_SCAN_FILT_NO_WL;
+    rc = ble_bench_cmd(BLE_HCI_OCF_LE_SET_SCAN_PARAMS, params, sizeof params);
+    assert(rc == 0);
+
+    /* Report every advertisement heard */
+    params[0] = 1;
+    params[1] = 0;
+    rc = ble_bench_cmd(BLE_HCI_OCF_LE_SET_SCAN_ENABLE, params, 2);
+    assert(rc == 0);
+}
+
+static void
+ble_bench_report(uint16_t itvl, int num_slaves, uint32_t secs)
+{
+    struct ll_sched_stats *st;
+    uint32_t itvl_usecs;
+    uint32_t rx_bytes;
+    int i;
+
+    rx_bytes = 0;
+    for (i = 0; i < num_slaves; i++) {
+        rx_bytes += ble_bench_slaves[i].bs_rx_bytes;
+    }
+
+    itvl_usecs = itvl * BLE_LL_CONN_ITVL_USECS;
+    printf("ble_bench: itvl_ms=%u.%02u slaves=%d conn_events=%u "
+           "conn_ev_missed=%u conn_ev_late=%u acl_kbps=%u "
+           "scan_rpts_per_s=%u disconnects=%d\n",
+           (unsigned)(itvl_usecs / 1000), (unsigned)(itvl_usecs % 1000) / 10,
+           num_slaves,
+           (unsigned)g_ll_sched_stats[BLE_LL_SCHED_TYPE_CONN].runs,
+           (unsigned)g_ble_ll_conn_stats.conn_ev_missed,
+           (unsigned)g_ble_ll_conn_stats.conn_ev_late,
+           (unsigned)(rx_bytes * 8 / (secs * 1000)),
+           (unsigned)(ble_bench_adv_rpts / secs), ble_bench_disconnects);
+
+    for (i = 0; i < BLE_LL_SCHED_TYPE_MAX; i++) {
+        st = g_ll_sched_stats + i;
+        if (st->runs == 0) {
+            continue;
+        }
+        printf("ble_bench:     sched=%s runs=%u late_avg_us=%u "
+               "late_max_us=%u deferred=%u deferred_max_us=%u "
+               "preempted=%u\n",
+               ble_bench_sched_names[i], (unsigned)st->runs,
+               (unsigned)cputime_ticks_to_usecs(st->late_usecs_total /
+                                                st->runs),
+               (unsigned)st->late_usecs_max, (unsigned)st->deferred,
+               (unsigned)st->deferred_usecs_max, (unsigned)st->preempted);
+    }
+}
+
+static void
+ble_bench_scenario(uint16_t itvl, int num_slaves, uint32_t secs)
+{
+    uint32_t usecs;
+    int next;
+    int rc;
+    int i;
+
+    /* Each scenario gets the same random numbers, whichever ran before it */
+    srand(1);
+    ble_bench_init();
+
+    for (i = 0; i < num_slaves; i++) {
+        rc = ble_bench_connect(i, itvl);
+        if (rc != 0) {
+            printf("ble_bench: itvl=%u slaves=%d: no connection to slave %d\n",
+                   itvl, num_slaves, i);
+            return;
+        }
+    }
+
+    ble_bench_scan_start();
+    for (i = 0; i < BLE_BENCH_NUM_ADVS; i++) {
+        cputime_timer_start(&ble_bench_advs[i].ba_timer,
+                            cputime_get32() +
+                            (rand() % BLE_BENCH_ADV_ITVL_USECS));
+    }
+
+    /* Only what happens from here on is measured */
+    memset(&g_ble_ll_conn_stats, 0, sizeof g_ble_ll_conn_stats);
+    memset(g_ll_sched_stats, 0, sizeof g_ll_sched_stats);
+    for (i = 0; i < num_slaves; i++) {
+        ble_bench_slaves[i].bs_rx_bytes = 0;
+    }
+    ble_bench_adv_rpts = 0;
+    ble_bench_disconnects = 0;
+
+    next = 0;
+    for (usecs = 0; usecs < secs * 1000000; usecs += 1000) {
+        while (ble_bench_acl_credits > 0) {
+            ble_bench_acl_send(ble_bench_handles[next]);
+            next = (next + 1) % ble_bench_num_conns;
+            ble_bench_acl_credits--;
+        }
+        ble_bench_run(1000);
+    }
+
+    ble_bench_report(itvl, num_slaves, secs);
+}
+
+static void
+ble_bench_usage(void)
+{
+    fprintf(stderr, "usage: ble_bench [-i itvl] [-n slaves] [-t secs]\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct ble_bench_scenario *sc;
+    int slaves;
+    int itvl;
+    int secs;
+    int ch;
+
+    itvl = 0;
+    slaves = 0;
+    secs = BLE_BENCH_SECS;
+    while ((ch = getopt(argc, argv, "i:n:t:")) != -1) {
+        switch (ch) {
+        case 'i':
+            itvl = atoi(optarg);
+            if (itvl < BLE_HCI_CONN_ITVL_MIN || itvl > BLE_HCI_CONN_ITVL_MAX) {
+                ble_bench_usage();
+            }
+            break;
+
+        case 'n':
+            slaves = atoi(optarg);
+            if (slaves < 1 || slaves > BLE_BENCH_MAX_SLAVES) {
+                ble_bench_usage();
+            }
+            break;
+
+        case 't':
+            secs = atoi(optarg);
+            if (secs < 1) {
+                ble_bench_usage();
+            }
+            break;
+
+        default:
+            ble_bench_usage();
+        }
+    }
+
+    if (itvl != 0 || slaves != 0) {
+        ble_bench_scenario(itvl != 0 ? itvl : ble_bench_scenarios[0].bbs_itvl,
+                           slaves != 0 ? slaves : 1, secs);
+        return 0;
+    }
+
+    for (sc = ble_bench_scenarios; sc->bbs_itvl != 0; sc++) {
+        ble_bench_scenario(sc->bbs_itvl, sc->bbs_slaves, secs);
+    }
+
+    return 0;
+}
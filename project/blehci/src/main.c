@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include "os/os.h"
+#include "bsp/bsp.h"
+#include "hal/hal_cputime.h"
+#include "hal/hal_uart.h"
+
+/* BLE */
+#include "nimble/ble.h"
+#include "controller/ll.h"
+#include "transport/uart/ble_hci_uart.h"
+
+/*
+ * BLE controller as a network co-processor. The host runs elsewhere and
+ * talks to the controller using HCI over a UART (H4). On the native target
+ * the UART is a pseudo tty; its name is printed at start up.
+ */
+
+/* The HCI UART. UART 0 is left for the console. */
+#define BLEHCI_UART             (1)
+#define BLEHCI_UART_SPEED       (1000000)
+#define BLEHCI_UART_TASK_PRIO   (1)
+
+/* Our global device address (public) */
+uint8_t g_dev_addr[BLE_DEV_ADDR_LEN];
+
+/* Our random address (in case we need it) */
+uint8_t g_random_addr[BLE_DEV_ADDR_LEN];
+
+/*
+ * Create a mbuf pool of BLE mbufs. These hold received PDUs and all HCI
+ * packets, so there should be enough for the commands and ACL data the
+ * host may send us plus the events we send back.
+ */
+#define MBUF_NUM_MBUFS      (24)
+#define MBUF_BUF_SIZE       (256)
+#define MBUF_MEMBLOCK_SIZE  \
+    (MBUF_BUF_SIZE + sizeof(struct os_mbuf) + sizeof(struct os_mbuf_pkthdr) + \
+     sizeof(struct ble_mbuf_hdr))
+
+#define MBUF_MEMPOOL_SIZE   OS_MEMPOOL_SIZE(MBUF_NUM_MBUFS, MBUF_MEMBLOCK_SIZE)
+
+struct os_mbuf_pool g_mbuf_pool;
+struct os_mempool g_mbuf_mempool;
+os_membuf_t g_mbuf_buffer[MBUF_MEMPOOL_SIZE];
+
+/**
+ * main
+ *
+ * The main function for the project. This function initializes the os, the
+ * controller and the HCI transport, then starts the OS. We should not return
+ * from os start.
+ *
+ * @return int NOTE: this function should never return!
+ */
+int
+main(void)
+{
+    int i;
+    int rc;
+    uint32_t seed;
+
+    /* Initialize OS */
+    os_init();
+
+    /* Set cputime to count at 1 usec increments */
+    rc = cputime_init(1000000);
+    assert(rc == 0);
+
+    rc = os_mempool_init(&g_mbuf_mempool, MBUF_NUM_MBUFS,
+            MBUF_MEMBLOCK_SIZE, &g_mbuf_buffer[0], "mbuf_pool");
+    assert(rc == 0);
+
+    rc = os_mbuf_pool_init(&g_mbuf_pool, &g_mbuf_mempool,
+                           sizeof(struct ble_mbuf_hdr), MBUF_MEMBLOCK_SIZE,
+                           MBUF_NUM_MBUFS);
+    assert(rc == 0);
+
+    /* Dummy device address */
+    g_dev_addr[0] = 0x00;
+    g_dev_addr[1] = 0x00;
+    g_dev_addr[2] = 0x00;
+    g_dev_addr[3] = 0x88;
+    g_dev_addr[4] = 0x88;
+    g_dev_addr[5] = 0x09;
+
+    /*
+     * Seed random number generator with least significant bytes of device
+     * address.
+     */
+    seed = 0;
+    for (i = 0; i < 4; ++i) {
+        seed |= g_dev_addr[i];
+        seed <<= 8;
+    }
+    srand(seed);
+
+    /* Initialize the BLE LL */
+    ll_init();
+
+    /* Initialize the HCI transport to the host */
+    rc = ble_hci_uart_init(BLEHCI_UART, BLEHCI_UART_SPEED,
+                           HAL_UART_FLOW_CTL_RTS_CTS, BLEHCI_UART_TASK_PRIO);
+    assert(rc == 0);
+
+    /* Start the OS */
+    os_start();
+
+    /* os start should never return. If it does, this should be an error */
+    assert(0);
+
+    return rc;
+}
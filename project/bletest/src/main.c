@@ -171,6 +171,10 @@ host_task_handler(void *arg)
     /* Initialize the BLE LL */
     ll_init();
 
+    /* Find out how much ACL data the controller can take */
+    rc = host_hci_cmd_le_read_buf_size();
+    assert(rc == 0);
+
 #if (BLETEST_CFG_ROLE == BLETEST_ROLE_ADVERTISER)
     /* Initialize the advertiser */
     bletest_init_advertising();
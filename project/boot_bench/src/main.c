@@ -0,0 +1,372 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Boot loader upgrade benchmark for the sim target.  For each scenario, two
+ * images are written to flash and the second is marked as the test image.
+ * The boot loader then swaps the images, and the flash traffic caused by the
+ * swap is reported.  The images are then booted in place with a cold
+ * verification cache, a warm cache, and with verification disabled, to show
+ * the cost of checking image integrity on every boot.
+ *
+ * Scenarios marked compressed store the test image with IMAGE_F_COMPRESSED;
+ * the stored size and the added boot time show the trade-off.  Image contents
+ * are taken from the file named on the command line, if any; otherwise a
+ * synthetic (and unrealistically compressible) pattern is used.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "hal/hal_flash.h"
+#include "mcu/native_flash.h"
+#include "nffs/nffs.h"
+#include "nffs/nffsutil.h"
+#include "bootutil/crc32.h"
+#include "bootutil/image.h"
+#include "bootutil/image_comp.h"
+#include "bootutil/loader.h"
+
+#define BOOT_BENCH_HEADER_SIZE      0x200
+
+/** Location of the boot loader's cache of verified images. */
+#define BOOT_BENCH_PATH_VERIFIED    "/boot/verified"
+
+/** Internal flash layout; matches the STM32F4 boot loader. */
+static struct nffs_area_desc boot_bench_area_descs[] = {
+    [0] =  { 0x00000000, 16 * 1024 },
+    [1] =  { 0x00004000, 16 * 1024 },
+    [2] =  { 0x00008000, 16 * 1024 },
+    [3] =  { 0x0000c000, 16 * 1024 },
+    [4] =  { 0x00010000, 64 * 1024 },
+    [5] =  { 0x00020000, 128 * 1024 },
+    [6] =  { 0x00040000, 128 * 1024 },
+    [7] =  { 0x00060000, 128 * 1024 },
+    [8] =  { 0x00080000, 128 * 1024 },
+    [9] =  { 0x000a0000, 128 * 1024 },
+    [10] = { 0x000c0000, 128 * 1024 },
+    [11] = { 0x000e0000, 128 * 1024 },
+    { 0, 0 },
+};
+
+static const struct nffs_area_desc boot_bench_nffs_descs[] = {
+    [0] =  { 0x00004000, 16 * 1024 },
+    [1] =  { 0x00008000, 16 * 1024 },
+    [2] =  { 0x0000c000, 16 * 1024 },
+    { 0, 0 },
+};
+
+static uint8_t boot_bench_img_areas[] = {
+    5, 6, 7, 8, 9, 10, 11,
+};
+
+static uint8_t boot_bench_slot_areas[] = {
+    5, 8,
+};
+
+static const uint32_t boot_bench_img_addrs[] = {
+    0x20000,
+    0x80000,
+};
+
+#define BOOT_BENCH_NUM_IMG_AREAS \
+    ((int)(sizeof boot_bench_img_areas / sizeof boot_bench_img_areas[0]))
+
+#define BOOT_BENCH_AREA_IDX_SCRATCH 11
+
+struct boot_bench_scenario {
+    const char *bbs_name;
+    uint32_t bbs_img_sizes[2];
+    uint32_t bbs_img1_flags;
+};
+
+static const struct boot_bench_scenario boot_bench_scenarios[] = {
+    { "small",      { 5 * 1024,     32 * 1024 } },
+    { "one_area",   { 100 * 1024,   120 * 1024 } },
+    { "two_areas",  { 150 * 1024,   190 * 1024 } },
+    { "uneven",     { 20 * 1024,    250 * 1024 } },
+    { "two_areas_z", { 150 * 1024,  190 * 1024 },   IMAGE_F_COMPRESSED },
+    { "uneven_z",   { 20 * 1024,    250 * 1024 },   IMAGE_F_COMPRESSED },
+    { NULL },
+};
+
+/** Contents of the sample binary, if one was specified. */
+static uint8_t *boot_bench_sample;
+static long boot_bench_sample_len;
+
+/** Number of bytes the test image occupies in its slot. */
+static uint32_t boot_bench_stored_len;
+
+static uint8_t
+boot_bench_byte_at(int slot, uint32_t off)
+{
+    if (boot_bench_sample != NULL) {
+        /* Start the second image part way into the sample, so the two images
+         * differ.
+         */
+        return boot_bench_sample[(off + slot * 4096) % boot_bench_sample_len];
+    } else {
+        return off ^ (slot << 7);
+    }
+}
+
+static void
+boot_bench_write_image(struct image_header *hdr, int slot, uint32_t flags)
+{
+    struct image_header stored_hdr;
+    uint8_t *body;
+    uint8_t *img;
+    uint32_t img_len;
+    uint32_t body_len;
+    uint32_t crc;
+    uint32_t i;
+    int rc;
+
+    img_len = hdr->ih_hdr_size + hdr->ih_img_size;
+    img = malloc(img_len);
+    assert(img != NULL);
+
+    memset(img, 0xff, hdr->ih_hdr_size);
+    for (i = 0; i < hdr->ih_img_size; i++) {
+        img[hdr->ih_hdr_size + i] = boot_bench_byte_at(slot, i);
+    }
+
+    memcpy(img, hdr, sizeof *hdr);
+    hdr->ih_crc32 = crc32(0, img + IMAGE_HEADER_CRC_OFFSET + 4,
+                          img_len - IMAGE_HEADER_CRC_OFFSET - 4);
+    memcpy(img, hdr, sizeof *hdr);
+
+    if (flags & IMAGE_F_COMPRESSED) {
+        rc = image_comp_create(img, img_len, &body, &body_len);
+        assert(rc == 0);
+
+        stored_hdr = *hdr;
+        stored_hdr.ih_hdr_size = sizeof stored_hdr;
+        stored_hdr.ih_img_size = body_len;
+        stored_hdr.ih_flags |= IMAGE_F_COMPRESSED;
+
+        crc = crc32(0, (uint8_t *)&stored_hdr + IMAGE_HEADER_CRC_OFFSET + 4,
+                    sizeof stored_hdr - IMAGE_HEADER_CRC_OFFSET - 4);
+        stored_hdr.ih_crc32 = crc32(crc, body, body_len);
+
+        free(img);
+        img_len = sizeof stored_hdr + body_len;
+        img = malloc(img_len);
+        assert(img != NULL);
+        memcpy(img, &stored_hdr, sizeof stored_hdr);
+        memcpy(img + sizeof stored_hdr, body, body_len);
+        free(body);
+    }
+
+    rc = flash_write(boot_bench_img_addrs[slot], img, img_len);
+    assert(rc == 0);
+
+    if (slot == 1) {
+        boot_bench_stored_len = img_len;
+    }
+
+    free(img);
+}
+
+static uint32_t
+boot_bench_elapsed_us(const struct timeval *start)
+{
+    struct timeval now;
+    struct timeval diff;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+
+    return diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+/**
+ * Runs the boot loader once and reports the flash traffic and time it
+ * consumed.
+ */
+static void
+boot_bench_boot(const struct boot_bench_scenario *scenario, const char *phase,
+                const struct boot_req *req, const struct image_header *exp_hdr)
+{
+    struct flash_native_stats stats;
+    struct boot_rsp rsp;
+    struct timeval start;
+    uint32_t host_us;
+    int rc;
+
+    flash_native_stats_clear();
+    gettimeofday(&start, NULL);
+
+    rc = boot_go(req, &rsp);
+    assert(rc == 0);
+
+    host_us = boot_bench_elapsed_us(&start);
+    assert(memcmp(rsp.br_hdr, exp_hdr, sizeof *exp_hdr) == 0);
+
+    flash_native_stats_get(&stats);
+
+    printf("boot_bench: scenario=%s phase=%s img0=%u img1=%u "
+           "img1_stored=%u bytes_erased=%llu bytes_written=%llu "
+           "bytes_read=%llu erases=%u device_us=%llu host_us=%u\n",
+           scenario->bbs_name, phase,
+           (unsigned)scenario->bbs_img_sizes[0],
+           (unsigned)scenario->bbs_img_sizes[1],
+           (unsigned)boot_bench_stored_len,
+           (unsigned long long)stats.fns_bytes_erased,
+           (unsigned long long)stats.fns_bytes_written,
+           (unsigned long long)stats.fns_bytes_read,
+           (unsigned)stats.fns_num_erases,
+           (unsigned long long)(stats.fns_device_ns / 1000),
+           (unsigned)host_us);
+}
+
+static void
+boot_bench_setup(const struct boot_bench_scenario *scenario,
+                 struct image_header *hdrs)
+{
+    const struct nffs_area_desc *area_desc;
+    int rc;
+    int i;
+
+    for (area_desc = boot_bench_area_descs;
+         area_desc->nad_length != 0;
+         area_desc++) {
+
+        rc = flash_erase(area_desc->nad_offset, area_desc->nad_length);
+        assert(rc == 0);
+    }
+
+    rc = nffs_init();
+    assert(rc == 0);
+    rc = nffs_format(boot_bench_nffs_descs);
+    assert(rc == 0);
+    rc = nffs_mkdir("/boot");
+    assert(rc == 0);
+
+    for (i = 0; i < 2; i++) {
+        memset(hdrs + i, 0, sizeof hdrs[i]);
+        hdrs[i].ih_magic = IMAGE_MAGIC;
+        hdrs[i].ih_hdr_size = BOOT_BENCH_HEADER_SIZE;
+        hdrs[i].ih_img_size = scenario->bbs_img_sizes[i];
+        hdrs[i].ih_ver.iv_major = i;
+        hdrs[i].ih_ver.iv_build_num = 1;
+
+        boot_bench_write_image(hdrs + i, i,
+                               i == 1 ? scenario->bbs_img1_flags : 0);
+    }
+
+    rc = nffsutil_write_file("/boot/main", &hdrs[0].ih_ver,
+                             sizeof hdrs[0].ih_ver);
+    assert(rc == 0);
+    rc = nffsutil_write_file("/boot/test", &hdrs[1].ih_ver,
+                             sizeof hdrs[1].ih_ver);
+    assert(rc == 0);
+}
+
+static void
+boot_bench_run(const struct boot_bench_scenario *scenario)
+{
+    struct image_header hdrs[2];
+    int rc;
+
+    struct boot_req req = {
+        .br_area_descs = boot_bench_area_descs,
+        .br_image_areas = boot_bench_img_areas,
+        .br_slot_areas = boot_bench_slot_areas,
+        .br_num_image_areas = BOOT_BENCH_NUM_IMG_AREAS,
+        .br_scratch_area_idx = BOOT_BENCH_AREA_IDX_SCRATCH,
+    };
+
+    boot_bench_setup(scenario, hdrs);
+
+    if (scenario->bbs_img1_flags & IMAGE_F_COMPRESSED &&
+        boot_bench_stored_len >
+        boot_bench_area_descs[boot_bench_slot_areas[1]].nad_length) {
+
+        /* The boot loader only rebuilds images which fit in one area. */
+        printf("boot_bench: scenario=%s skipped; img1_stored=%u exceeds "
+               "one area\n", scenario->bbs_name,
+               (unsigned)boot_bench_stored_len);
+        return;
+    }
+
+    /* Swap in the test image. */
+    boot_bench_boot(scenario, "swap", &req, &hdrs[1]);
+
+    /* Confirm the test image, as the application would, and boot it in place
+     * with nothing in the verification cache.
+     */
+    rc = nffsutil_write_file("/boot/main", &hdrs[1].ih_ver,
+                             sizeof hdrs[1].ih_ver);
+    assert(rc == 0);
+    rc = nffs_unlink(BOOT_BENCH_PATH_VERIFIED);
+    assert(rc == 0);
+    boot_bench_boot(scenario, "cold", &req, &hdrs[1]);
+
+    /* Steady state: the image was verified by the previous boot. */
+    boot_bench_boot(scenario, "warm", &req, &hdrs[1]);
+
+    req.br_skip_verify = 1;
+    boot_bench_boot(scenario, "noverify", &req, &hdrs[1]);
+}
+
+static void
+boot_bench_read_sample(const char *path)
+{
+    FILE *fp;
+    int rc;
+
+    fp = fopen(path, "rb");
+    assert(fp != NULL);
+
+    fseek(fp, 0, SEEK_END);
+    boot_bench_sample_len = ftell(fp);
+    rewind(fp);
+    assert(boot_bench_sample_len > 0);
+
+    boot_bench_sample = malloc(boot_bench_sample_len);
+    assert(boot_bench_sample != NULL);
+
+    rc = fread(boot_bench_sample, boot_bench_sample_len, 1, fp);
+    assert(rc == 1);
+
+    fclose(fp);
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct boot_bench_scenario *scenario;
+    int rc;
+
+    if (argc > 1) {
+        boot_bench_read_sample(argv[1]);
+    }
+
+    rc = flash_init();
+    assert(rc == 0);
+
+    for (scenario = boot_bench_scenarios;
+         scenario->bbs_name != NULL;
+         scenario++) {
+
+        boot_bench_run(scenario);
+    }
+
+    return 0;
+}
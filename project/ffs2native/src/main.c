@@ -4,7 +4,7 @@
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
  * You may obtain a copy of the License at
- * 
+ *
  *   http://www.apache.org/licenses/LICENSE-2.0
  *
  * Unless required by applicable law or agreed to in writing, software
@@ -15,111 +15,1210 @@
  */
 
 /**
- * XXX
- * This is a hack of a tool which prints the structure of an nffs file system.
- * It needs to be rewritten properly.
+ * Offline tool for nffs images.  An image is the raw contents of a set of
+ * consecutive 128 kB nffs areas, as they appear in flash starting at the
+ * first area.
+ *
+ * The tool runs nffs itself on top of the native flash driver.  An existing
+ * image is loaded into simulated flash with a single copy out of a read-only
+ * mapping of the image file; a new image is written out in one piece from a
+ * direct mapping of simulated flash.  Nothing is transferred a byte at a
+ * time, so provisioning is limited by the speed of nffs itself.
+ *
+ * Subcommands:
+ *     pack    Builds an image from a host directory tree.
+ *     unpack  Extracts the contents of an image into a host directory.
+ *     fsck    Checks an image for consistency and reports per-area usage.
+ *     ls      Prints the directory tree in an image.
  */
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "../src/nffs_priv.h"
+#include "os/os.h"
 #include "os/queue.h"
 #include "nffs/nffs.h"
 #include "hal/hal_flash.h"
+#include "mcu/native_flash.h"
+
+/** The areas occupy consecutive 128 kB sectors of native flash. */
+#define FFS2NATIVE_AREA_OFFSET      0x00020000
+#define FFS2NATIVE_AREA_SZ          (128 * 1024)
+#define FFS2NATIVE_MIN_AREAS        2
+#define FFS2NATIVE_MAX_AREAS        7
+#define FFS2NATIVE_DFLT_AREAS       2
+
+#define FFS2NATIVE_BUF_SZ           (64 * 1024)
+#define FFS2NATIVE_PATH_MAX         1024
+
+/**
+ * The host has memory to spare, so allow far more objects than a device
+ * would.  fsck reports the number of objects an image contains, so it can be
+ * checked against a device's nffs configuration.
+ */
+#define FFS2NATIVE_NUM_INODES       (64 * 1024)
+#define FFS2NATIVE_NUM_BLOCKS       (64 * 1024)
+
+struct ffs2native_area_stats {
+    uint32_t fas_live_objs;
+    uint32_t fas_live_bytes;
+    uint32_t fas_dead_objs;
+    uint32_t fas_dead_bytes;
+    uint32_t fas_corrupt_bytes;
+    uint32_t fas_free_bytes;
+};
 
-static const struct nffs_area_desc area_descs[] = {
-    { 0x00020000, 128 * 1024 },
-    { 0x00040000, 128 * 1024 },
-    { 0, 0 },
+struct ffs2native_dirent {
+    char fd_name[NFFS_FILENAME_MAX_LEN + 1];
+    int fd_is_dir;
 };
 
+static struct nffs_area_desc ffs2native_area_descs[FFS2NATIVE_MAX_AREAS + 1];
+static int ffs2native_num_areas;
+
+static uint8_t ffs2native_buf[FFS2NATIVE_BUF_SZ];
+
+static uint32_t ffs2native_num_dirs;
+static uint32_t ffs2native_num_files;
+static uint64_t ffs2native_num_bytes;
+static int ffs2native_num_errors;
+static int ffs2native_num_warnings;
+
+static void
+print_usage(FILE *stream)
+{
+    fprintf(stream, "usage: ffs2native pack [-n <num-areas>] <src-dir> "
+                    "<out-image>\n");
+    fprintf(stream, "       ffs2native unpack <image> <dst-dir>\n");
+    fprintf(stream, "       ffs2native fsck <image>\n");
+    fprintf(stream, "       ffs2native ls <image>\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "An image consists of %d to %d areas of %d kB each "
+                    "(default: %d).\n",
+            FFS2NATIVE_MIN_AREAS, FFS2NATIVE_MAX_AREAS,
+            FFS2NATIVE_AREA_SZ / 1024, FFS2NATIVE_DFLT_AREAS);
+}
+
+static uint32_t
+elapsed_ms(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_usec - start->tv_usec) / 1000;
+}
+
 static void
-copyfs(FILE *fp)
+fsck_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+fsck_warning(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+fsck_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stdout, "error: ");
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    fprintf(stdout, "\n");
+
+    ffs2native_num_errors++;
+}
+
+static void
+fsck_warning(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stdout, "warning: ");
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    fprintf(stdout, "\n");
+
+    ffs2native_num_warnings++;
+}
+
+static void
+set_areas(int num_areas)
+{
+    int i;
+
+    assert(num_areas <= FFS2NATIVE_MAX_AREAS);
+
+    for (i = 0; i < num_areas; i++) {
+        ffs2native_area_descs[i].nad_offset =
+            FFS2NATIVE_AREA_OFFSET + i * FFS2NATIVE_AREA_SZ;
+        ffs2native_area_descs[i].nad_length = FFS2NATIVE_AREA_SZ;
+    }
+    ffs2native_area_descs[i].nad_offset = 0;
+    ffs2native_area_descs[i].nad_length = 0;
+
+    ffs2native_num_areas = num_areas;
+}
+
+static int
+init_nffs(void)
+{
+    int rc;
+
+    nffs_config.nc_num_inodes = FFS2NATIVE_NUM_INODES;
+    nffs_config.nc_num_blocks = FFS2NATIVE_NUM_BLOCKS;
+
+    rc = nffs_init();
+    if (rc != 0) {
+        fprintf(stderr, "* error: nffs_init failed; rc=%d\n", rc);
+        return rc;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies an image file into simulated flash and restores the file system it
+ * contains.  The number of areas is derived from the image size.
+ */
+static int
+load_image(const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+    int rc;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "* error: could not open image %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    rc = fstat(fd, &st);
+    if (rc != 0 ||
+        st.st_size % FFS2NATIVE_AREA_SZ != 0 ||
+        st.st_size / FFS2NATIVE_AREA_SZ < FFS2NATIVE_MIN_AREAS ||
+        st.st_size / FFS2NATIVE_AREA_SZ > FFS2NATIVE_MAX_AREAS) {
+
+        fprintf(stderr, "* error: %s is not an image; size must be a "
+                        "multiple of %d kB, from %d to %d areas\n",
+                path, FFS2NATIVE_AREA_SZ / 1024, FFS2NATIVE_MIN_AREAS,
+                FFS2NATIVE_MAX_AREAS);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "* error: could not map image %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    set_areas(st.st_size / FFS2NATIVE_AREA_SZ);
+    rc = flash_native_overwrite(FFS2NATIVE_AREA_OFFSET, map, st.st_size);
+    munmap(map, st.st_size);
+    if (rc != 0) {
+        fprintf(stderr, "* error: could not load image into flash\n");
+        return -1;
+    }
+
+    rc = init_nffs();
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = nffs_detect(ffs2native_area_descs);
+    if (rc != 0) {
+        fprintf(stderr, "* error: no valid file system in %s; rc=%d\n",
+                path, rc);
+        return rc;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the contents of every area to an image file.
+ */
+static int
+save_image(const char *path)
+{
+    const void *ptr;
+    uint32_t len;
+    FILE *fp;
+    int rc;
+
+    len = ffs2native_num_areas * FFS2NATIVE_AREA_SZ;
+    rc = flash_map(FFS2NATIVE_AREA_OFFSET, len, &ptr);
+    assert(rc == 0);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "* error: could not open output file %s: %s\n",
+                path, strerror(errno));
+        return -1;
+    }
+
+    rc = fwrite(ptr, len, 1, fp);
+    if (fclose(fp) != 0 || rc != 1) {
+        fprintf(stderr, "* error: file write error (file=%s)\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Joins a directory path and a filename.
+ */
+static int
+join_path(char *dst, const char *dir, const char *name)
+{
+    int rc;
+
+    rc = snprintf(dst, FFS2NATIVE_PATH_MAX, "%s/%s",
+                  strcmp(dir, "/") == 0 ? "" : dir, name);
+    if (rc < 0 || rc >= FFS2NATIVE_PATH_MAX) {
+        fprintf(stderr, "* error: path too long: %s/%s\n", dir, name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************
+ * pack                                                                      *
+ *****************************************************************************/
+
+static int
+pack_file(const char *host_path, const char *nffs_path)
 {
-    uint32_t dst_addr;
+    struct nffs_file *file;
+    size_t len;
+    FILE *fp;
     int rc;
-    int c;
 
-    dst_addr = area_descs[0].fad_offset;
+    fp = fopen(host_path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "* error: could not open %s: %s\n", host_path,
+                strerror(errno));
+        return -1;
+    }
+
+    rc = nffs_open(nffs_path, NFFS_ACCESS_WRITE | NFFS_ACCESS_TRUNCATE,
+                   &file);
+    if (rc != 0) {
+        fprintf(stderr, "* error: could not create %s; rc=%d\n", nffs_path,
+                rc);
+        fclose(fp);
+        return rc;
+    }
+
+    while ((len = fread(ffs2native_buf, 1, sizeof ffs2native_buf, fp)) > 0) {
+        rc = nffs_write(file, ffs2native_buf, len);
+        if (rc != 0) {
+            fprintf(stderr, "* error: could not write %s%s; rc=%d\n",
+                    nffs_path, rc == NFFS_EFULL ? " (image full)" : "", rc);
+            goto done;
+        }
+        ffs2native_num_bytes += len;
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "* error: file read error (file=%s)\n", host_path);
+        rc = -1;
+        goto done;
+    }
+
+    ffs2native_num_files++;
+    rc = 0;
+
+done:
+    nffs_close(file);
+    fclose(fp);
+    return rc;
+}
+
+/**
+ * Recursively copies a host directory into nffs.  Entries are visited in
+ * sorted order so that the same tree always produces the same image.
+ */
+static int
+pack_dir(const char *host_dir, const char *nffs_dir)
+{
+    char host_path[FFS2NATIVE_PATH_MAX];
+    char nffs_path[FFS2NATIVE_PATH_MAX];
+    struct dirent **entries;
+    struct stat st;
+    int num_entries;
+    int rc;
+    int i;
+
+    num_entries = scandir(host_dir, &entries, NULL, alphasort);
+    if (num_entries < 0) {
+        fprintf(stderr, "* error: could not read directory %s: %s\n",
+                host_dir, strerror(errno));
+        return -1;
+    }
+
+    rc = 0;
+    for (i = 0; i < num_entries; i++) {
+        if (rc != 0 ||
+            strcmp(entries[i]->d_name, ".") == 0 ||
+            strcmp(entries[i]->d_name, "..") == 0) {
+
+            free(entries[i]);
+            continue;
+        }
+
+        if (strlen(entries[i]->d_name) > UINT8_MAX) {
+            fprintf(stderr, "* error: filename too long: %s\n",
+                    entries[i]->d_name);
+            rc = -1;
+        }
+        if (rc == 0) {
+            rc = join_path(host_path, host_dir, entries[i]->d_name);
+        }
+        if (rc == 0) {
+            rc = join_path(nffs_path, nffs_dir, entries[i]->d_name);
+        }
+        if (rc == 0) {
+            rc = lstat(host_path, &st);
+            if (rc != 0) {
+                fprintf(stderr, "* error: could not stat %s: %s\n",
+                        host_path, strerror(errno));
+            }
+        }
+
+        if (rc == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                rc = nffs_mkdir(nffs_path);
+                if (rc == NFFS_EEXIST) {
+                    /* lost+found is created by nffs_format(). */
+                    rc = 0;
+                }
+                if (rc != 0) {
+                    fprintf(stderr, "* error: could not create directory "
+                                    "%s; rc=%d\n", nffs_path, rc);
+                } else {
+                    ffs2native_num_dirs++;
+                    rc = pack_dir(host_path, nffs_path);
+                }
+            } else if (S_ISREG(st.st_mode)) {
+                rc = pack_file(host_path, nffs_path);
+            } else {
+                fprintf(stderr, "warning: skipping %s; not a regular file "
+                                "or directory\n", host_path);
+            }
+        }
+
+        free(entries[i]);
+    }
+    free(entries);
+
+    return rc;
+}
+
+static int
+cmd_pack(int argc, char **argv)
+{
+    struct timeval start;
+    uint32_t used;
+    long num_areas;
+    char *ep;
+    int rc;
+    int ch;
+    int i;
+
+    num_areas = FFS2NATIVE_DFLT_AREAS;
+    while ((ch = getopt(argc, argv, "n:")) != -1) {
+        switch (ch) {
+        case 'n':
+            num_areas = strtol(optarg, &ep, 10);
+            if (optarg[0] == '\0' || ep[0] != '\0' ||
+                num_areas < FFS2NATIVE_MIN_AREAS ||
+                num_areas > FFS2NATIVE_MAX_AREAS) {
+
+                print_usage(stderr);
+                return 1;
+            }
+            break;
+
+        default:
+            print_usage(stderr);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 2) {
+        print_usage(stderr);
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+
+    set_areas(num_areas);
+    rc = init_nffs();
+    if (rc != 0) {
+        return 1;
+    }
+
+    rc = nffs_format(ffs2native_area_descs);
+    if (rc != 0) {
+        fprintf(stderr, "* error: nffs_format failed; rc=%d\n", rc);
+        return 1;
+    }
+
+    rc = pack_dir(argv[0], "/");
+    if (rc != 0) {
+        return 1;
+    }
+
+    rc = save_image(argv[1]);
+    if (rc != 0) {
+        return 1;
+    }
+
+    used = 0;
+    for (i = 0; i < nffs_num_areas; i++) {
+        if (i != nffs_scratch_area_idx) {
+            used += nffs_areas[i].na_cur;
+        }
+    }
+
+    printf("%s: %u dirs, %u files, %llu bytes of data; %u of %u bytes used; "
+           "%u ms\n",
+           argv[1], (unsigned)ffs2native_num_dirs,
+           (unsigned)ffs2native_num_files,
+           (unsigned long long)ffs2native_num_bytes, (unsigned)used,
+           (unsigned)((num_areas - 1) * FFS2NATIVE_AREA_SZ),
+           (unsigned)elapsed_ms(&start));
+
+    return 0;
+}
+
+/*****************************************************************************
+ * unpack / ls                                                               *
+ *****************************************************************************/
+
+/**
+ * Reads all of a directory's entries.  The directory's child list is walked
+ * directly rather than through nffs_opendir(), which does not accept the root
+ * directory.  Entries are copied out so that a deep tree can be walked
+ * recursively without holding anything open.
+ */
+static int
+read_nffs_dir(const char *path, struct ffs2native_dirent **out_entries,
+              int *out_num_entries)
+{
+    struct ffs2native_dirent *entries;
+    struct nffs_inode_entry *child;
+    struct nffs_inode_entry *dir;
+    uint8_t name_len;
+    int num_entries;
+    int max_entries;
+    int rc;
+
+    if (strcmp(path, "/") == 0) {
+        dir = nffs_root_dir;
+    } else {
+        rc = nffs_path_find_inode_entry(path, &dir);
+        if (rc != 0) {
+            fprintf(stderr, "* error: could not find directory %s; rc=%d\n",
+                    path, rc);
+            return rc;
+        }
+    }
+
+    entries = NULL;
+    num_entries = 0;
+    max_entries = 0;
+    rc = 0;
+    SLIST_FOREACH(child, &dir->nie_child_list, nie_sibling_next) {
+        if (num_entries == max_entries) {
+            max_entries = max_entries == 0 ? 16 : max_entries * 2;
+            entries = realloc(entries, max_entries * sizeof *entries);
+            assert(entries != NULL);
+        }
+
+        rc = nffs_inode_read_filename(child,
+                                      sizeof entries[num_entries].fd_name,
+                                      entries[num_entries].fd_name,
+                                      &name_len);
+        if (rc != 0) {
+            fprintf(stderr, "* error: could not read entry in %s; rc=%d\n",
+                    path, rc);
+            free(entries);
+            return rc;
+        }
+        entries[num_entries].fd_is_dir =
+            nffs_hash_id_is_dir(child->nie_hash_entry.nhe_id);
+        num_entries++;
+    }
+
+    *out_entries = entries;
+    *out_num_entries = num_entries;
+    return 0;
+}
+
+static int
+unpack_file(const char *nffs_path, const char *host_path)
+{
+    struct nffs_file *file;
+    uint32_t len;
+    FILE *fp;
+    int rc;
+
+    rc = nffs_open(nffs_path, NFFS_ACCESS_READ, &file);
+    if (rc != 0) {
+        fprintf(stderr, "* error: could not open %s; rc=%d\n", nffs_path, rc);
+        return rc;
+    }
+
+    fp = fopen(host_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "* error: could not create %s: %s\n", host_path,
+                strerror(errno));
+        nffs_close(file);
+        return -1;
+    }
+
     while (1) {
-        c = getc(fp);
-        if (c == EOF) {
-            return;
+        rc = nffs_read(file, sizeof ffs2native_buf, ffs2native_buf, &len);
+        if (rc != 0) {
+            fprintf(stderr, "* error: could not read %s; rc=%d\n", nffs_path,
+                    rc);
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        if (fwrite(ffs2native_buf, len, 1, fp) != 1) {
+            rc = -1;
+            break;
+        }
+        ffs2native_num_bytes += len;
+    }
+
+    nffs_close(file);
+    if (fclose(fp) != 0 || rc == -1) {
+        fprintf(stderr, "* error: file write error (file=%s)\n", host_path);
+        return -1;
+    }
+    if (rc == 0) {
+        ffs2native_num_files++;
+    }
+
+    return rc;
+}
+
+static int
+unpack_dir(const char *nffs_dir, const char *host_dir)
+{
+    struct ffs2native_dirent *entries;
+    char host_path[FFS2NATIVE_PATH_MAX];
+    char nffs_path[FFS2NATIVE_PATH_MAX];
+    int num_entries;
+    int rc;
+    int i;
+
+    rc = mkdir(host_dir, 0755);
+    if (rc != 0 && errno != EEXIST) {
+        fprintf(stderr, "* error: could not create directory %s: %s\n",
+                host_dir, strerror(errno));
+        return -1;
+    }
+
+    rc = read_nffs_dir(nffs_dir, &entries, &num_entries);
+    if (rc != 0) {
+        return rc;
+    }
+
+    for (i = 0; i < num_entries && rc == 0; i++) {
+        if (strcmp(nffs_dir, "/") == 0 &&
+            strcmp(entries[i].fd_name, "lost+found") == 0 &&
+            SLIST_EMPTY(&nffs_lost_found_dir->nie_child_list)) {
+
+            /* Created by nffs itself; only extract it if it has contents. */
+            continue;
         }
 
-        rc = flash_write(dst_addr, &c, 1);
+        rc = join_path(nffs_path, nffs_dir, entries[i].fd_name);
+        if (rc == 0) {
+            rc = join_path(host_path, host_dir, entries[i].fd_name);
+        }
+        if (rc == 0) {
+            if (entries[i].fd_is_dir) {
+                ffs2native_num_dirs++;
+                rc = unpack_dir(nffs_path, host_path);
+            } else {
+                rc = unpack_file(nffs_path, host_path);
+            }
+        }
+    }
+
+    free(entries);
+    return rc;
+}
+
+static int
+cmd_unpack(int argc, char **argv)
+{
+    struct timeval start;
+    int rc;
+
+    if (argc != 3) {
+        print_usage(stderr);
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+
+    rc = load_image(argv[1]);
+    if (rc != 0) {
+        return 1;
+    }
+
+    rc = unpack_dir("/", argv[2]);
+    if (rc != 0) {
+        return 1;
+    }
+
+    printf("%s: %u dirs, %u files, %llu bytes of data; %u ms\n",
+           argv[2], (unsigned)ffs2native_num_dirs,
+           (unsigned)ffs2native_num_files,
+           (unsigned long long)ffs2native_num_bytes,
+           (unsigned)elapsed_ms(&start));
+
+    return 0;
+}
+
+static int
+ls_dir(const char *nffs_dir, int indent)
+{
+    struct nffs_inode_entry *inode_entry;
+    struct ffs2native_dirent *entries;
+    char nffs_path[FFS2NATIVE_PATH_MAX];
+    uint32_t len;
+    int num_entries;
+    int rc;
+    int i;
+
+    rc = read_nffs_dir(nffs_dir, &entries, &num_entries);
+    if (rc != 0) {
+        return rc;
+    }
+
+    for (i = 0; i < num_entries && rc == 0; i++) {
+        rc = join_path(nffs_path, nffs_dir, entries[i].fd_name);
+        if (rc != 0) {
+            break;
+        }
+
+        if (entries[i].fd_is_dir) {
+            printf("%*s%s/\n", indent, "", entries[i].fd_name);
+            rc = ls_dir(nffs_path, indent + 2);
+        } else {
+            rc = nffs_path_find_inode_entry(nffs_path, &inode_entry);
+            if (rc == 0) {
+                rc = nffs_inode_data_len(inode_entry, &len);
+            }
+            if (rc == 0) {
+                printf("%*s%s (%u)\n", indent, "", entries[i].fd_name,
+                       (unsigned)len);
+            }
+        }
+    }
+
+    free(entries);
+    return rc;
+}
+
+static int
+cmd_ls(int argc, char **argv)
+{
+    int rc;
+
+    if (argc != 2) {
+        print_usage(stderr);
+        return 1;
+    }
+
+    rc = load_image(argv[1]);
+    if (rc != 0) {
+        return 1;
+    }
+
+    printf("/\n");
+    rc = ls_dir("/", 2);
+    if (rc != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************
+ * fsck                                                                      *
+ *****************************************************************************/
+
+/**
+ * Indicates whether the object at the specified location is the current
+ * version of its inode or block.
+ */
+static int
+fsck_obj_is_live(uint32_t id, uint8_t area_idx, uint32_t area_offset)
+{
+    struct nffs_hash_entry *entry;
+
+    entry = nffs_hash_find(id);
+    return entry != NULL &&
+           entry->nhe_flash_loc == nffs_flash_loc(area_idx, area_offset);
+}
+
+/**
+ * Verifies that the specified region of an area is fully erased.
+ *
+ * @return                      The number of non-erased bytes.
+ */
+static uint32_t
+fsck_count_unerased(uint8_t area_idx, uint32_t offset, uint32_t len)
+{
+    uint32_t chunk_sz;
+    uint32_t count;
+    uint32_t i;
+    int rc;
+
+    count = 0;
+    while (len > 0) {
+        chunk_sz = len < sizeof ffs2native_buf ? len : sizeof ffs2native_buf;
+        rc = nffs_flash_read(area_idx, offset, ffs2native_buf, chunk_sz);
         assert(rc == 0);
 
-        dst_addr++;
+        for (i = 0; i < chunk_sz; i++) {
+            if (ffs2native_buf[i] != 0xff) {
+                count++;
+            }
+        }
+
+        offset += chunk_sz;
+        len -= chunk_sz;
     }
+
+    return count;
 }
 
+/**
+ * Walks every object in an area, in the same way nffs_restore_full() does,
+ * and classifies its bytes as live, dead (superseded or deleted), corrupt, or
+ * free.
+ */
 static void
-print_inode_entry(struct nffs_inode_entry *inode_entry, int indent)
+fsck_area(uint8_t area_idx, struct ffs2native_area_stats *out_stats)
 {
-    struct nffs_inode inode;
-    char name[NFFS_FILENAME_MAX_LEN + 1];
-    uint32_t area_offset;
-    uint8_t area_idx;
+    struct nffs_disk_object disk_object;
+    struct nffs_disk_block disk_block;
+    struct nffs_disk_inode disk_inode;
+    struct nffs_area *area;
+    uint32_t obj_size;
+    uint32_t magic;
+    uint32_t off;
+    int in_garbage;
+    int valid;
+    int live;
     int rc;
 
-    rc = nffs_inode_from_entry(&inode, inode_entry);
-    assert(rc == 0);
+    memset(out_stats, 0, sizeof *out_stats);
+    area = nffs_areas + area_idx;
 
-    nffs_flash_loc_expand(inode_entry->fie_hash_entry.fhe_flash_loc,
-                         &area_idx, &area_offset);
+    if (area_idx == nffs_scratch_area_idx) {
+        off = sizeof (struct nffs_disk_area);
+        out_stats->fas_free_bytes = area->na_length - off;
+        if (fsck_count_unerased(area_idx, off, area->na_length - off) != 0) {
+            fsck_error("area %d: scratch area is not erased", area_idx);
+        }
+        return;
+    }
 
-    rc = nffs_flash_read(area_idx,
-                         area_offset + sizeof (struct nffs_disk_inode),
-                         name, inode.fi_filename_len);
-    assert(rc == 0);
+    off = sizeof (struct nffs_disk_area);
+    in_garbage = 0;
+    while (off + sizeof magic <= area->na_length) {
+        rc = nffs_flash_read(area_idx, off, &magic, sizeof magic);
+        assert(rc == 0);
+
+        /* As in restore, an object with a readable header is skipped as a
+         * whole even if its CRC is bad; anything else is skipped a byte at a
+         * time.
+         */
+        obj_size = 0;
+        valid = 0;
+        live = 0;
+        switch (magic) {
+        case NFFS_INODE_MAGIC:
+        case NFFS_INODE_LOG_MAGIC:
+            rc = nffs_inode_read_disk(area_idx, off, &disk_inode);
+            if (rc == 0) {
+                obj_size = sizeof disk_inode + disk_inode.ndi_filename_len;
+                valid = off + obj_size <= area->na_length &&
+                        nffs_crc_disk_inode_validate(&disk_inode, area_idx,
+                                                     off) == 0;
+                if (valid) {
+                    live = fsck_obj_is_live(disk_inode.ndi_id, area_idx, off);
+                }
+            }
+            break;
 
-    name[inode.fi_filename_len] = '\0';
+        case NFFS_BLOCK_MAGIC:
+            rc = nffs_block_read_disk(area_idx, off, &disk_block);
+            if (rc == 0) {
+                obj_size = sizeof disk_block + disk_block.ndb_data_len;
+                valid = off + obj_size <= area->na_length &&
+                        nffs_crc_disk_block_validate(&disk_block, area_idx,
+                                                     off) == 0;
+                if (valid) {
+                    live = fsck_obj_is_live(disk_block.ndb_id, area_idx, off);
+                }
+            }
+            break;
 
-    printf("%*s%s\n", indent, "", name);
+        case NFFS_TXN_MAGIC:
+        case NFFS_COMMIT_MAGIC:
+            /* Transaction framing is dropped by garbage collection, as is a
+             * whole transaction that was never committed.
+             */
+            rc = nffs_restore_disk_object(area_idx, off, &disk_object);
+            if (rc == 0) {
+                obj_size = nffs_restore_disk_object_size(&disk_object);
+                valid = 1;
+                if (disk_object.ndo_type == NFFS_OBJECT_TYPE_TXN_BAD) {
+                    fsck_warning("area %d: uncommitted transaction at "
+                                 "offset 0x%x", area_idx, (unsigned)off);
+                }
+            }
+            break;
+
+        case 0xffffffff:
+            /* End of area contents; the rest must be writable. */
+            out_stats->fas_free_bytes = area->na_length - off;
+            if (fsck_count_unerased(area_idx, off,
+                                    area->na_length - off) != 0) {
+
+                fsck_error("area %d: data after end of contents at "
+                           "offset 0x%x", area_idx, (unsigned)off);
+            }
+            return;
+
+        default:
+            break;
+        }
+
+        if (obj_size == 0) {
+            obj_size = 1;
+        }
+        if (off + obj_size > area->na_length) {
+            obj_size = area->na_length - off;
+        }
+
+        if (!valid) {
+            /* Only report the first byte of a run of garbage. */
+            if (obj_size > 1 || !in_garbage) {
+                fsck_warning("area %d: corrupt object at offset 0x%x",
+                             area_idx, (unsigned)off);
+            }
+            in_garbage = obj_size == 1;
+            out_stats->fas_corrupt_bytes += obj_size;
+        } else if (live) {
+            out_stats->fas_live_objs++;
+            out_stats->fas_live_bytes += obj_size;
+        } else {
+            out_stats->fas_dead_objs++;
+            out_stats->fas_dead_bytes += obj_size;
+        }
+        if (valid) {
+            in_garbage = 0;
+        }
+        off += obj_size;
+    }
+
+    /* Any trailing bytes too short to hold an object. */
+    out_stats->fas_corrupt_bytes += area->na_length - off;
 }
 
-static void
-process_inode_entry(struct nffs_inode_entry *inode_entry, int indent)
+/**
+ * Follows a file's block chain from its last block to its first, checking
+ * that every block belongs to the file and has a valid CRC.
+ *
+ * @return                      The number of blocks in the chain.
+ */
+static uint32_t
+fsck_file(struct nffs_inode_entry *file, const char *path)
 {
-    struct nffs_inode_entry *child;
+    struct nffs_disk_block disk_block;
+    struct nffs_hash_entry *cur;
+    struct nffs_block block;
+    uint32_t area_offset;
+    uint32_t num_blocks;
+    uint32_t calc_len;
+    uint32_t len;
+    uint8_t area_idx;
+    int rc;
 
-    print_inode_entry(inode_entry, indent);
+    num_blocks = 0;
+    len = 0;
+    for (cur = file->nie_last_block_entry; cur != NULL; cur = block.nb_prev) {
+        if (num_blocks > FFS2NATIVE_NUM_BLOCKS) {
+            fsck_error("%s: block chain contains a cycle", path);
+            return num_blocks;
+        }
+
+        rc = nffs_block_from_hash_entry(&block, cur);
+        if (rc != 0) {
+            fsck_error("%s: broken block chain at block 0x%08x; rc=%d",
+                       path, (unsigned)cur->nhe_id, rc);
+            return num_blocks;
+        }
 
-    if (nffs_hash_id_is_dir(inode_entry->fie_hash_entry.fhe_id)) {
-        SLIST_FOREACH(child, &inode_entry->fie_child_list, fie_sibling_next) {
-            process_inode_entry(child, indent + 2);
+        if (block.nb_inode_entry != file) {
+            fsck_error("%s: block 0x%08x belongs to another inode", path,
+                       (unsigned)cur->nhe_id);
         }
+
+        nffs_flash_loc_expand(cur->nhe_flash_loc, &area_idx, &area_offset);
+        rc = nffs_block_read_disk(area_idx, area_offset, &disk_block);
+        if (rc != 0 || nffs_crc_disk_block_validate(&disk_block, area_idx,
+                                                    area_offset) != 0) {
+
+            fsck_error("%s: block 0x%08x has a bad CRC", path,
+                       (unsigned)cur->nhe_id);
+        }
+
+        len += block.nb_data_len;
+        num_blocks++;
+    }
+
+    rc = nffs_inode_calc_data_length(file, &calc_len);
+    if (rc != 0 || calc_len != len) {
+        fsck_error("%s: length mismatch (%u != %u)", path, (unsigned)len,
+                   (unsigned)calc_len);
     }
+
+    ffs2native_num_files++;
+    ffs2native_num_bytes += len;
+
+    return num_blocks;
 }
 
+/**
+ * Recursively checks a directory.  Each child must name the directory as its
+ * parent.
+ */
 static void
-printfs(void)
+fsck_dir(struct nffs_inode_entry *dir, const char *path, int depth,
+         uint32_t *num_inodes, uint32_t *num_blocks)
 {
-    process_inode_entry(nffs_root_dir, 0);
+    struct nffs_inode_entry *child;
+    struct nffs_inode inode;
+    char child_path[FFS2NATIVE_PATH_MAX];
+    char name[NFFS_FILENAME_MAX_LEN + 1];
+    uint8_t name_len;
+    int rc;
+
+    (*num_inodes)++;
+    if (dir != nffs_root_dir) {
+        ffs2native_num_dirs++;
+    }
+
+    if (depth > FFS2NATIVE_PATH_MAX / 2) {
+        fsck_error("%s: directory tree contains a cycle", path);
+        return;
+    }
+
+    SLIST_FOREACH(child, &dir->nie_child_list, nie_sibling_next) {
+        rc = nffs_inode_read_filename(child, sizeof name, name, &name_len);
+        if (rc != 0) {
+            fsck_error("%s: unreadable child inode 0x%08x; rc=%d", path,
+                       (unsigned)child->nie_hash_entry.nhe_id, rc);
+            continue;
+        }
+
+        if (join_path(child_path, path, name) != 0) {
+            ffs2native_num_errors++;
+            continue;
+        }
+
+        rc = nffs_inode_from_entry(&inode, child);
+        if (rc != 0 || inode.ni_parent != dir) {
+            fsck_error("%s: parent does not match directory", child_path);
+        }
+
+        if (nffs_hash_id_is_dir(child->nie_hash_entry.nhe_id)) {
+            fsck_dir(child, child_path, depth + 1, num_inodes, num_blocks);
+        } else {
+            (*num_inodes)++;
+            *num_blocks += fsck_file(child, child_path);
+        }
+    }
 }
 
-int
-main(int argc, char **argv)
+static int
+cmd_fsck(int argc, char **argv)
 {
-    FILE *fp;
+    struct ffs2native_area_stats stats;
+    struct ffs2native_area_stats total;
+    struct nffs_disk_area disk_area;
+    struct nffs_hash_entry *entry;
+    uint32_t hash_inodes;
+    uint32_t hash_blocks;
+    uint32_t num_inodes;
+    uint32_t num_blocks;
     int rc;
+    int i;
 
-    assert(argc >= 2);
+    if (argc != 2) {
+        print_usage(stderr);
+        return 1;
+    }
 
-    fp = fopen(argv[1], "rb");
-    assert(fp != NULL);
+    rc = load_image(argv[1]);
+    if (rc != 0) {
+        return 1;
+    }
 
-    copyfs(fp);
+    /* Walk every object on disk. */
+    printf("%4s %4s %6s %8s %10s %8s %10s %10s %10s\n",
+           "area", "id", "gc_seq", "live", "live_bytes", "dead",
+           "dead_bytes", "corrupt", "free");
 
-    rc = nffs_init();
-    assert(rc == 0);
+    memset(&total, 0, sizeof total);
+    for (i = 0; i < nffs_num_areas; i++) {
+        rc = nffs_flash_read(i, 0, &disk_area, sizeof disk_area);
+        assert(rc == 0);
+        if (disk_area.nda_id != nffs_areas[i].na_id ||
+            disk_area.nda_length != nffs_areas[i].na_length) {
 
-    rc = nffs_detect(area_descs);
-    assert(rc == 0);
+            fsck_error("area %d: header does not match restored state", i);
+        }
 
-    printfs();
+        fsck_area(i, &stats);
 
-    return 0;
+        if (i == nffs_scratch_area_idx) {
+            printf("%4d %4s %6u %8s %10s %8s %10s %10s %10u\n",
+                   i, "scr", nffs_areas[i].na_gc_seq, "-", "-", "-", "-",
+                   "-", (unsigned)stats.fas_free_bytes);
+            continue;
+        }
+
+        printf("%4d %4d %6u %8u %10u %8u %10u %10u %10u\n",
+               i, nffs_areas[i].na_id, nffs_areas[i].na_gc_seq,
+               (unsigned)stats.fas_live_objs, (unsigned)stats.fas_live_bytes,
+               (unsigned)stats.fas_dead_objs, (unsigned)stats.fas_dead_bytes,
+               (unsigned)stats.fas_corrupt_bytes,
+               (unsigned)stats.fas_free_bytes);
+
+        total.fas_live_objs += stats.fas_live_objs;
+        total.fas_live_bytes += stats.fas_live_bytes;
+        total.fas_dead_objs += stats.fas_dead_objs;
+        total.fas_dead_bytes += stats.fas_dead_bytes;
+        total.fas_corrupt_bytes += stats.fas_corrupt_bytes;
+        total.fas_free_bytes += stats.fas_free_bytes;
+    }
+
+    printf("%4s %4s %6s %8u %10u %8u %10u %10u %10u\n",
+           "all", "", "",
+           (unsigned)total.fas_live_objs, (unsigned)total.fas_live_bytes,
+           (unsigned)total.fas_dead_objs, (unsigned)total.fas_dead_bytes,
+           (unsigned)total.fas_corrupt_bytes,
+           (unsigned)total.fas_free_bytes);
+
+    /* Walk the directory tree; everything in RAM must be reachable. */
+    num_inodes = 0;
+    num_blocks = 0;
+    fsck_dir(nffs_root_dir, "/", 0, &num_inodes, &num_blocks);
+
+    hash_inodes = 0;
+    hash_blocks = 0;
+    NFFS_HASH_FOREACH(entry, i) {
+        if (nffs_hash_id_is_inode(entry->nhe_id)) {
+            hash_inodes++;
+        } else {
+            hash_blocks++;
+        }
+    }
+
+    if (hash_inodes != num_inodes) {
+        fsck_error("%u inodes unreachable from root",
+                   (unsigned)(hash_inodes - num_inodes));
+    }
+    if (hash_blocks != num_blocks) {
+        fsck_error("%u blocks not owned by any file",
+                   (unsigned)(hash_blocks - num_blocks));
+    }
+    if (hash_inodes + hash_blocks != total.fas_live_objs) {
+        fsck_error("%u live objects on disk; %u in RAM",
+                   (unsigned)total.fas_live_objs,
+                   (unsigned)(hash_inodes + hash_blocks));
+    }
+
+    if (nffs_lost_found_dir != NULL &&
+        !SLIST_EMPTY(&nffs_lost_found_dir->nie_child_list)) {
+
+        fsck_warning("lost+found is not empty");
+    }
+
+    printf("%u dirs, %u files, %llu bytes of data; "
+           "%u inodes, %u blocks (max block data %u)\n",
+           (unsigned)ffs2native_num_dirs, (unsigned)ffs2native_num_files,
+           (unsigned long long)ffs2native_num_bytes,
+           (unsigned)hash_inodes, (unsigned)hash_blocks,
+           (unsigned)nffs_block_max_data_sz);
+    printf("%s: %d errors, %d warnings\n", argv[1], ffs2native_num_errors,
+           ffs2native_num_warnings);
+
+    return ffs2native_num_errors == 0 ? 0 : 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    os_init();
+
+    if (argc < 2) {
+        print_usage(stderr);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "pack") == 0) {
+        return cmd_pack(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "unpack") == 0) {
+        return cmd_unpack(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "fsck") == 0) {
+        return cmd_fsck(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "ls") == 0) {
+        return cmd_ls(argc - 1, argv + 1);
+    }
+
+    print_usage(stderr);
+    return 1;
 }
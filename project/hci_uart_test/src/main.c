@@ -0,0 +1,40 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Unit tests of the HCI UART transport.
+ *
+ * These cannot run in project/test: they replace the UART driver and the
+ * controller (its HCI entry points and the mbuf pool) with fakes, which the
+ * controller tests there provide for themselves.
+ *
+ * Usage: hci_uart_test
+ */
+
+#include <stddef.h>
+#include "transport/uart/ble_hci_uart_test.h"
+#include "testutil/testutil.h"
+
+int
+main(void)
+{
+    tu_config.tc_print_results = 1;
+    tu_init();
+
+    ble_hci_uart_test_all();
+
+    return tu_any_failed;
+}
@@ -0,0 +1,41 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Link layer microbenchmarks for the sim target.
+ *
+ * Runs the controller's benchmark suites: the costs of its table driven
+ * paths, measured against the simple implementations the unit tests check
+ * them with. These print timings rather than pass or fail, so they are kept
+ * out of project/test; each prints one line of results.
+ *
+ * Usage: ll_bench
+ */
+
+#include <stddef.h>
+#include "controller/ll_test.h"
+#include "testutil/testutil.h"
+
+int
+main(void)
+{
+    tu_config.tc_print_results = 1;
+    tu_init();
+
+    ll_bench_all();
+
+    return tu_any_failed;
+}
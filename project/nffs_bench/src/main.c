@@ -0,0 +1,933 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * nffs benchmark suite for the sim target.
+ *
+ * Each workload formats a fresh file system and times a fixed sequence of
+ * operations.  The results are printed as one line per workload, consisting
+ * of space-separated key=value pairs:
+ *
+ *     nffs_bench: workload=seq_append ops=2048 ops_per_s=... ...
+ *
+ * Host time varies from machine to machine; the flash operation counts and
+ * the device time computed by the native flash timing model do not, so they
+ * are the numbers to track for regressions.
+ *
+ * Workloads:
+ *     seq_append       Appends small records to a single file.
+ *     rand_overwrite   Overwrites random ranges of a large file.
+ *     small_files      Creates many small files in one directory.
+ *     deep_dirs        Opens and reads a file at the bottom of a deep tree.
+ *     mount_<pct>      Restores a file system that is <pct>% full.
+ *     gc_churn         Rewrites files in a nearly full file system, so that
+ *                      most writes wait for garbage collection.
+ *     log_rotate       Appends log records, retaining the most recent ones
+ *                      by rotating between two files with unlink and rename.
+ *     log_ring         Appends the same records to a circular log of the same
+ *                      capacity; compare against log_rotate.
+ *     cfg_replace      Atomically replaces a small configuration file by
+ *                      writing a temporary file and renaming it over the
+ *                      original.
+ *     cfg_replace_txn  Performs the same replacements inside transactions,
+ *                      along with an update to a second file.  Each op
+ *                      updates twice as many files in fewer flash writes,
+ *                      but writes more bytes and spends more device time
+ *                      than cfg_replace; compare all three.
+ *     contention       Several tasks share the file system (see below).
+ *
+ * In the contention workload, several low priority "bulk" tasks repeatedly
+ * read a large file while a high priority "probe" task periodically opens and
+ * reads a small file.  A "writer" task appends to a log file at a fixed
+ * interval.  The probe latency shows how long a short read waits behind long
+ * reads and metadata updates performed by other tasks.  It runs under the
+ * scheduler, so it is always the last workload.
+ *
+ * Usage: nffs_bench [-w workload]
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "os/os.h"
+#include "mcu/native_flash.h"
+#include "nffs/nffs.h"
+
+#define NFFS_BENCH_BIG_FILE_SZ      (32 * 1024)
+#define NFFS_BENCH_SMALL_FILE_SZ    64
+#define NFFS_BENCH_NUM_SMALL_FILES  16
+#define NFFS_BENCH_NUM_PROBES       2000
+#define NFFS_BENCH_LOG_ENTRY_SZ     32
+#define NFFS_BENCH_WRITER_ITVL      10
+#define NFFS_BENCH_READ_CHUNK_SZ    1024
+
+#define NFFS_BENCH_NUM_BULK_TASKS   3
+
+#define NFFS_BENCH_PROBE_PRIO       (1)
+#define NFFS_BENCH_WRITER_PRIO      (2)
+#define NFFS_BENCH_BULK_PRIO        (10)
+
+#define NFFS_BENCH_STACK_SIZE       OS_STACK_ALIGN(4096)
+
+/** Maximum number of latency samples per workload. */
+#define NFFS_BENCH_MAX_SAMPLES      4096
+
+#define NFFS_BENCH_APPEND_SZ        128
+#define NFFS_BENCH_APPEND_OPS       2048
+
+#define NFFS_BENCH_OVERWRITE_FILE_SZ    (64 * 1024)
+#define NFFS_BENCH_OVERWRITE_SZ         64
+#define NFFS_BENCH_OVERWRITE_OPS        2048
+
+#define NFFS_BENCH_TINY_FILE_SZ     32
+#define NFFS_BENCH_TINY_FILE_OPS    512
+
+#define NFFS_BENCH_DIR_DEPTH        32
+#define NFFS_BENCH_DIR_OPS          1024
+
+#define NFFS_BENCH_MOUNT_OPS        8
+#define NFFS_BENCH_MOUNT_FILE_SZ    (4 * 1024)
+
+#define NFFS_BENCH_CHURN_FILES      48
+#define NFFS_BENCH_CHURN_FILE_SZ    (6 * 1024)
+#define NFFS_BENCH_CHURN_OPS        1024
+
+#define NFFS_BENCH_LOG_FILL_FILES   40
+#define NFFS_BENCH_LOG_CAPACITY     (32 * 1024)
+#define NFFS_BENCH_LOG_REC_SZ       64
+#define NFFS_BENCH_LOG_OPS          4096
+
+#define NFFS_BENCH_CFG_FILE_SZ      128
+#define NFFS_BENCH_CFG_OPS          1024
+
+static const struct nffs_area_desc nffs_bench_area_descs[] = {
+    { 0x00020000, 128 * 1024 },
+    { 0x00040000, 128 * 1024 },
+    { 0x00060000, 128 * 1024 },
+    { 0x00080000, 128 * 1024 },
+    { 0, 0 },
+};
+
+/** Bytes of file data that fit in the areas, excluding the scratch area. */
+#define NFFS_BENCH_FS_CAPACITY      (3 * 128 * 1024)
+
+struct nffs_bench_task {
+    struct os_task nbt_task;
+    os_stack_t nbt_stack[NFFS_BENCH_STACK_SIZE];
+};
+
+struct nffs_bench_workload {
+    const char *nbw_name;
+    void (*nbw_fn)(void);
+};
+
+static struct nffs_bench_task nffs_bench_probe_task;
+static struct nffs_bench_task nffs_bench_writer_task;
+static struct nffs_bench_task
+    nffs_bench_bulk_tasks[NFFS_BENCH_NUM_BULK_TASKS];
+
+static uint32_t nffs_bench_probe_lat_us[NFFS_BENCH_NUM_PROBES];
+static uint32_t nffs_bench_bulk_bytes[NFFS_BENCH_NUM_BULK_TASKS];
+static uint32_t nffs_bench_writes;
+static struct timeval nffs_bench_start;
+
+/* State of the workload currently being measured. */
+static const char *nffs_bench_wl_name;
+static uint32_t nffs_bench_lat_ns[NFFS_BENCH_MAX_SAMPLES];
+static int nffs_bench_num_ops;
+static uint64_t nffs_bench_wl_start_ns;
+static uint64_t nffs_bench_op_start_ns;
+
+static uint32_t nffs_bench_rand_state = 1;
+
+static uint8_t nffs_bench_buf[NFFS_BENCH_CHURN_FILE_SZ];
+
+static uint32_t
+nffs_bench_elapsed_us(const struct timeval *start)
+{
+    struct timeval now;
+    struct timeval diff;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+
+    return diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+static uint64_t
+nffs_bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t
+nffs_bench_rand(void)
+{
+    /* xorshift32; deterministic so that runs are comparable. */
+    nffs_bench_rand_state ^= nffs_bench_rand_state << 13;
+    nffs_bench_rand_state ^= nffs_bench_rand_state >> 17;
+    nffs_bench_rand_state ^= nffs_bench_rand_state << 5;
+
+    return nffs_bench_rand_state;
+}
+
+static void
+nffs_bench_write_file(const char *path, int len)
+{
+    struct nffs_file *file;
+    uint8_t buf[256];
+    int chunk_sz;
+    int rc;
+    int i;
+
+    for (i = 0; i < sizeof buf; i++) {
+        buf[i] = i;
+    }
+
+    rc = nffs_open(path, NFFS_ACCESS_WRITE | NFFS_ACCESS_TRUNCATE, &file);
+    assert(rc == 0);
+
+    while (len > 0) {
+        if (len > sizeof buf) {
+            chunk_sz = sizeof buf;
+        } else {
+            chunk_sz = len;
+        }
+
+        rc = nffs_write(file, buf, chunk_sz);
+        assert(rc == 0);
+
+        len -= chunk_sz;
+    }
+
+    rc = nffs_close(file);
+    assert(rc == 0);
+}
+
+static int
+nffs_bench_cmp_u32(const void *a, const void *b)
+{
+    uint32_t ua;
+    uint32_t ub;
+
+    ua = *(const uint32_t *)a;
+    ub = *(const uint32_t *)b;
+
+    if (ua < ub) {
+        return -1;
+    } else if (ua > ub) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Starts measuring a workload.  Flash and memory statistics are cleared, so
+ * any setup should be done before calling this.
+ */
+static void
+nffs_bench_wl_begin(const char *name)
+{
+    nffs_bench_wl_name = name;
+    nffs_bench_num_ops = 0;
+
+    flash_native_stats_clear();
+    nffs_mem_stats_clear();
+
+    nffs_bench_wl_start_ns = nffs_bench_now_ns();
+}
+
+static void
+nffs_bench_op_begin(void)
+{
+    nffs_bench_op_start_ns = nffs_bench_now_ns();
+}
+
+static void
+nffs_bench_op_end(void)
+{
+    assert(nffs_bench_num_ops < NFFS_BENCH_MAX_SAMPLES);
+    nffs_bench_lat_ns[nffs_bench_num_ops++] =
+        nffs_bench_now_ns() - nffs_bench_op_start_ns;
+}
+
+static uint32_t
+nffs_bench_pct(int pct)
+{
+    return nffs_bench_lat_ns[(nffs_bench_num_ops - 1) * pct / 100];
+}
+
+/**
+ * Finishes measuring the current workload and prints its results.
+ */
+static void
+nffs_bench_wl_end(void)
+{
+    struct flash_native_stats flash_stats;
+    struct nffs_mem_stats mem_stats;
+    uint64_t elapsed_ns;
+    double ops;
+
+    elapsed_ns = nffs_bench_now_ns() - nffs_bench_wl_start_ns;
+    flash_native_stats_get(&flash_stats);
+    nffs_mem_stats_get(&mem_stats);
+
+    assert(nffs_bench_num_ops > 0);
+    qsort(nffs_bench_lat_ns, nffs_bench_num_ops, sizeof nffs_bench_lat_ns[0],
+          nffs_bench_cmp_u32);
+
+    ops = nffs_bench_num_ops;
+    printf("nffs_bench: workload=%s ops=%d ops_per_s=%.0f "
+           "reads_per_op=%.2f writes_per_op=%.2f erases_per_op=%.4f "
+           "bytes_read_per_op=%.0f bytes_written_per_op=%.0f "
+           "device_us_per_op=%.1f ram_hwm=%u ram_total=%u "
+           "lat_ns_p50=%u lat_ns_p90=%u lat_ns_p99=%u lat_ns_max=%u\n",
+           nffs_bench_wl_name, nffs_bench_num_ops,
+           ops * 1000000000.0 / elapsed_ns,
+           flash_stats.fns_num_reads / ops,
+           flash_stats.fns_num_writes / ops,
+           flash_stats.fns_num_erases / ops,
+           flash_stats.fns_bytes_read / ops,
+           flash_stats.fns_bytes_written / ops,
+           flash_stats.fns_device_ns / 1000.0 / ops,
+           (unsigned)mem_stats.nms_bytes_hwm,
+           (unsigned)mem_stats.nms_bytes_total,
+           (unsigned)nffs_bench_pct(50),
+           (unsigned)nffs_bench_pct(90),
+           (unsigned)nffs_bench_pct(99),
+           (unsigned)nffs_bench_lat_ns[nffs_bench_num_ops - 1]);
+    fflush(stdout);
+}
+
+static void
+nffs_bench_format(void)
+{
+    int rc;
+
+    rc = nffs_format(nffs_bench_area_descs);
+    assert(rc == 0);
+
+    nffs_bench_rand_state = 1;
+}
+
+static void
+nffs_bench_seq_append(void)
+{
+    struct nffs_file *file;
+    int rc;
+    int i;
+
+    nffs_bench_format();
+
+    rc = nffs_open("/seq", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND, &file);
+    assert(rc == 0);
+
+    nffs_bench_wl_begin("seq_append");
+    for (i = 0; i < NFFS_BENCH_APPEND_OPS; i++) {
+        nffs_bench_op_begin();
+        rc = nffs_write(file, nffs_bench_buf, NFFS_BENCH_APPEND_SZ);
+        assert(rc == 0);
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+
+    rc = nffs_close(file);
+    assert(rc == 0);
+}
+
+static void
+nffs_bench_rand_overwrite(void)
+{
+    struct nffs_file *file;
+    uint32_t off;
+    int rc;
+    int i;
+
+    nffs_bench_format();
+    nffs_bench_write_file("/big", NFFS_BENCH_OVERWRITE_FILE_SZ);
+
+    rc = nffs_open("/big", NFFS_ACCESS_WRITE, &file);
+    assert(rc == 0);
+
+    nffs_bench_wl_begin("rand_overwrite");
+    for (i = 0; i < NFFS_BENCH_OVERWRITE_OPS; i++) {
+        off = nffs_bench_rand() %
+              (NFFS_BENCH_OVERWRITE_FILE_SZ - NFFS_BENCH_OVERWRITE_SZ);
+
+        nffs_bench_op_begin();
+        rc = nffs_seek(file, off);
+        assert(rc == 0);
+        rc = nffs_write(file, nffs_bench_buf, NFFS_BENCH_OVERWRITE_SZ);
+        assert(rc == 0);
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+
+    rc = nffs_close(file);
+    assert(rc == 0);
+}
+
+static void
+nffs_bench_small_files(void)
+{
+    struct nffs_file *file;
+    char path[32];
+    int rc;
+    int i;
+
+    nffs_bench_format();
+
+    rc = nffs_mkdir("/tiny");
+    assert(rc == 0);
+
+    nffs_bench_wl_begin("small_files");
+    for (i = 0; i < NFFS_BENCH_TINY_FILE_OPS; i++) {
+        sprintf(path, "/tiny/%d", i);
+
+        nffs_bench_op_begin();
+        rc = nffs_open(path, NFFS_ACCESS_WRITE, &file);
+        assert(rc == 0);
+        rc = nffs_write(file, nffs_bench_buf, NFFS_BENCH_TINY_FILE_SZ);
+        assert(rc == 0);
+        rc = nffs_close(file);
+        assert(rc == 0);
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+}
+
+static void
+nffs_bench_deep_dirs(void)
+{
+    struct nffs_file *file;
+    uint32_t bytes_read;
+    uint8_t buf[NFFS_BENCH_SMALL_FILE_SZ];
+    char path[NFFS_BENCH_DIR_DEPTH * 3 + 16];
+    int len;
+    int rc;
+    int i;
+
+    nffs_bench_format();
+
+    len = 0;
+    for (i = 0; i < NFFS_BENCH_DIR_DEPTH; i++) {
+        len += sprintf(path + len, "/d%d", i % 10);
+        rc = nffs_mkdir(path);
+        assert(rc == 0);
+    }
+    strcpy(path + len, "/file");
+    nffs_bench_write_file(path, NFFS_BENCH_SMALL_FILE_SZ);
+
+    nffs_bench_wl_begin("deep_dirs");
+    for (i = 0; i < NFFS_BENCH_DIR_OPS; i++) {
+        nffs_bench_op_begin();
+        rc = nffs_open(path, NFFS_ACCESS_READ, &file);
+        assert(rc == 0);
+        rc = nffs_read(file, sizeof buf, buf, &bytes_read);
+        assert(rc == 0 && bytes_read == sizeof buf);
+        rc = nffs_close(file);
+        assert(rc == 0);
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+}
+
+static void
+nffs_bench_mount_pct(int fill_pct)
+{
+    char name[32];
+    char path[32];
+    int num_files;
+    int rc;
+    int i;
+
+    nffs_bench_format();
+
+    num_files = NFFS_BENCH_FS_CAPACITY * fill_pct / 100 /
+                NFFS_BENCH_MOUNT_FILE_SZ;
+    for (i = 0; i < num_files; i++) {
+        sprintf(path, "/m%d", i);
+        nffs_bench_write_file(path, NFFS_BENCH_MOUNT_FILE_SZ);
+    }
+
+    sprintf(name, "mount_%d", fill_pct);
+    nffs_bench_wl_begin(name);
+    for (i = 0; i < NFFS_BENCH_MOUNT_OPS; i++) {
+        nffs_bench_op_begin();
+        rc = nffs_detect(nffs_bench_area_descs);
+        assert(rc == 0);
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+}
+
+static void
+nffs_bench_mount(void)
+{
+    nffs_bench_mount_pct(0);
+    nffs_bench_mount_pct(25);
+    nffs_bench_mount_pct(50);
+    nffs_bench_mount_pct(75);
+}
+
+static void
+nffs_bench_gc_churn(void)
+{
+    struct nffs_file *file;
+    char path[32];
+    int rc;
+    int i;
+
+    nffs_bench_format();
+
+    /* Fill most of the file system so that rewrites force frequent garbage
+     * collection.
+     */
+    for (i = 0; i < NFFS_BENCH_CHURN_FILES; i++) {
+        sprintf(path, "/c%d", i);
+        nffs_bench_write_file(path, NFFS_BENCH_CHURN_FILE_SZ);
+    }
+
+    nffs_bench_wl_begin("gc_churn");
+    for (i = 0; i < NFFS_BENCH_CHURN_OPS; i++) {
+        sprintf(path, "/c%d", (int)(nffs_bench_rand() % NFFS_BENCH_CHURN_FILES));
+
+        nffs_bench_op_begin();
+        rc = nffs_open(path, NFFS_ACCESS_WRITE | NFFS_ACCESS_TRUNCATE, &file);
+        assert(rc == 0);
+        rc = nffs_write(file, nffs_bench_buf, NFFS_BENCH_CHURN_FILE_SZ);
+        assert(rc == 0);
+        rc = nffs_close(file);
+        assert(rc == 0);
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+}
+
+/**
+ * Fills most of the file system with static files, so that the log workloads
+ * keep garbage collection busy.
+ */
+static void
+nffs_bench_log_setup(void)
+{
+    char path[32];
+    int i;
+
+    nffs_bench_format();
+
+    for (i = 0; i < NFFS_BENCH_LOG_FILL_FILES; i++) {
+        sprintf(path, "/s%d", i);
+        nffs_bench_write_file(path, NFFS_BENCH_CHURN_FILE_SZ);
+    }
+}
+
+static void
+nffs_bench_log_rotate(void)
+{
+    struct nffs_file *file;
+    uint32_t len;
+    int rc;
+    int i;
+
+    nffs_bench_log_setup();
+
+    rc = nffs_open("/log", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND, &file);
+    assert(rc == 0);
+    len = 0;
+
+    nffs_bench_wl_begin("log_rotate");
+    for (i = 0; i < NFFS_BENCH_LOG_OPS; i++) {
+        nffs_bench_op_begin();
+
+        /* Each file holds half the retained records. */
+        if (len + NFFS_BENCH_LOG_REC_SZ > NFFS_BENCH_LOG_CAPACITY / 2) {
+            rc = nffs_close(file);
+            assert(rc == 0);
+            rc = nffs_unlink("/log.1");
+            assert(rc == 0 || rc == NFFS_ENOENT);
+            rc = nffs_rename("/log", "/log.1");
+            assert(rc == 0);
+            rc = nffs_open("/log", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND,
+                           &file);
+            assert(rc == 0);
+            len = 0;
+        }
+
+        rc = nffs_write(file, nffs_bench_buf, NFFS_BENCH_LOG_REC_SZ);
+        assert(rc == 0);
+        len += NFFS_BENCH_LOG_REC_SZ;
+
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+
+    rc = nffs_close(file);
+    assert(rc == 0);
+}
+
+static void
+nffs_bench_log_ring(void)
+{
+    struct nffs_file *file;
+    int rc;
+    int i;
+
+    nffs_bench_log_setup();
+
+    rc = nffs_mklog("/log", NFFS_BENCH_LOG_CAPACITY);
+    assert(rc == 0);
+    rc = nffs_open("/log", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND, &file);
+    assert(rc == 0);
+
+    nffs_bench_wl_begin("log_ring");
+    for (i = 0; i < NFFS_BENCH_LOG_OPS; i++) {
+        nffs_bench_op_begin();
+        rc = nffs_write(file, nffs_bench_buf, NFFS_BENCH_LOG_REC_SZ);
+        assert(rc == 0);
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+
+    rc = nffs_close(file);
+    assert(rc == 0);
+}
+
+/**
+ * Writes a temporary copy of the configuration file and renames it over the
+ * original.
+ */
+static void
+nffs_bench_cfg_write(void)
+{
+    int rc;
+
+    nffs_bench_write_file("/cfg.tmp", NFFS_BENCH_CFG_FILE_SZ);
+    rc = nffs_rename("/cfg.tmp", "/cfg");
+    assert(rc == 0);
+}
+
+static void
+nffs_bench_cfg_replace(void)
+{
+    int i;
+
+    nffs_bench_log_setup();
+    nffs_bench_cfg_write();
+
+    nffs_bench_wl_begin("cfg_replace");
+    for (i = 0; i < NFFS_BENCH_CFG_OPS; i++) {
+        nffs_bench_op_begin();
+        nffs_bench_cfg_write();
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+}
+
+static void
+nffs_bench_cfg_replace_txn(void)
+{
+    int rc;
+    int i;
+
+    nffs_bench_log_setup();
+    nffs_bench_cfg_write();
+
+    nffs_bench_wl_begin("cfg_replace_txn");
+    for (i = 0; i < NFFS_BENCH_CFG_OPS; i++) {
+        nffs_bench_op_begin();
+
+        rc = nffs_txn_begin();
+        assert(rc == 0);
+        nffs_bench_cfg_write();
+        nffs_bench_write_file("/cfg.gen", NFFS_BENCH_SMALL_FILE_SZ);
+        rc = nffs_txn_commit();
+        assert(rc == 0);
+
+        nffs_bench_op_end();
+    }
+    nffs_bench_wl_end();
+}
+
+static void
+nffs_bench_report(void)
+{
+    struct flash_native_stats flash_stats;
+    uint64_t bulk_total;
+    uint64_t lat_total;
+    uint32_t elapsed_us;
+    int i;
+
+    elapsed_us = nffs_bench_elapsed_us(&nffs_bench_start);
+    flash_native_stats_get(&flash_stats);
+
+    lat_total = 0;
+    for (i = 0; i < NFFS_BENCH_NUM_PROBES; i++) {
+        lat_total += nffs_bench_probe_lat_us[i];
+    }
+    qsort(nffs_bench_probe_lat_us, NFFS_BENCH_NUM_PROBES,
+          sizeof nffs_bench_probe_lat_us[0], nffs_bench_cmp_u32);
+
+    bulk_total = 0;
+    for (i = 0; i < NFFS_BENCH_NUM_BULK_TASKS; i++) {
+        bulk_total += nffs_bench_bulk_bytes[i];
+    }
+
+    printf("nffs_bench: workload=contention elapsed_us=%u bulk_tasks=%d "
+           "probes=%d writes=%u probe_lat_us_min=%u probe_lat_us_avg=%u "
+           "probe_lat_us_p50=%u probe_lat_us_p99=%u probe_lat_us_max=%u "
+           "bulk_read_kbps=%u bytes_read=%llu bytes_written=%llu erases=%u "
+           "device_us=%llu\n",
+           (unsigned)elapsed_us, NFFS_BENCH_NUM_BULK_TASKS,
+           NFFS_BENCH_NUM_PROBES, (unsigned)nffs_bench_writes,
+           (unsigned)nffs_bench_probe_lat_us[0],
+           (unsigned)(lat_total / NFFS_BENCH_NUM_PROBES),
+           (unsigned)nffs_bench_probe_lat_us[NFFS_BENCH_NUM_PROBES / 2],
+           (unsigned)nffs_bench_probe_lat_us[NFFS_BENCH_NUM_PROBES * 99 / 100],
+           (unsigned)nffs_bench_probe_lat_us[NFFS_BENCH_NUM_PROBES - 1],
+           (unsigned)(bulk_total * 1000 / elapsed_us),
+           (unsigned long long)flash_stats.fns_bytes_read,
+           (unsigned long long)flash_stats.fns_bytes_written,
+           (unsigned)flash_stats.fns_num_erases,
+           (unsigned long long)(flash_stats.fns_device_ns / 1000));
+}
+
+static void
+nffs_bench_probe_handler(void *arg)
+{
+    struct nffs_file *file;
+    struct timeval start;
+    uint8_t buf[NFFS_BENCH_SMALL_FILE_SZ];
+    uint32_t bytes_read;
+    char path[32];
+    int rc;
+    int i;
+
+    for (i = 0; i < NFFS_BENCH_NUM_PROBES; i++) {
+        os_time_delay(2);
+
+        sprintf(path, "/small/%d", i % NFFS_BENCH_NUM_SMALL_FILES);
+
+        gettimeofday(&start, NULL);
+
+        rc = nffs_open(path, NFFS_ACCESS_READ, &file);
+        assert(rc == 0);
+        rc = nffs_read(file, sizeof buf, buf, &bytes_read);
+        assert(rc == 0 && bytes_read == sizeof buf);
+        rc = nffs_close(file);
+        assert(rc == 0);
+
+        nffs_bench_probe_lat_us[i] = nffs_bench_elapsed_us(&start);
+    }
+
+    nffs_bench_report();
+    exit(0);
+}
+
+static void
+nffs_bench_writer_handler(void *arg)
+{
+    struct nffs_file *file;
+    uint8_t entry[NFFS_BENCH_LOG_ENTRY_SZ];
+    int rc;
+
+    memset(entry, 0xa5, sizeof entry);
+
+    while (1) {
+        os_time_delay(NFFS_BENCH_WRITER_ITVL);
+
+        rc = nffs_open("/log", NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND, &file);
+        assert(rc == 0);
+        rc = nffs_write(file, entry, sizeof entry);
+        assert(rc == 0);
+        rc = nffs_close(file);
+        assert(rc == 0);
+
+        nffs_bench_writes++;
+    }
+}
+
+static void
+nffs_bench_bulk_handler(void *arg)
+{
+    struct nffs_file *file;
+    uint8_t buf[NFFS_BENCH_READ_CHUNK_SZ];
+    uint32_t bytes_read;
+    int idx;
+    int rc;
+
+    idx = (int)(intptr_t)arg;
+
+    rc = nffs_open("/big", NFFS_ACCESS_READ, &file);
+    assert(rc == 0);
+
+    while (1) {
+        rc = nffs_seek(file, 0);
+        assert(rc == 0);
+
+        do {
+            rc = nffs_read(file, sizeof buf, buf, &bytes_read);
+            assert(rc == 0);
+            nffs_bench_bulk_bytes[idx] += bytes_read;
+        } while (bytes_read > 0);
+
+        /* Let lower priority bulk tasks have a turn. */
+        os_time_delay(1);
+    }
+}
+
+static void
+nffs_bench_populate(void)
+{
+    char path[32];
+    int rc;
+    int i;
+
+    nffs_bench_format();
+
+    nffs_bench_write_file("/big", NFFS_BENCH_BIG_FILE_SZ);
+    nffs_bench_write_file("/log", 0);
+
+    rc = nffs_mkdir("/small");
+    assert(rc == 0);
+    for (i = 0; i < NFFS_BENCH_NUM_SMALL_FILES; i++) {
+        sprintf(path, "/small/%d", i);
+        nffs_bench_write_file(path, NFFS_BENCH_SMALL_FILE_SZ);
+    }
+}
+
+/**
+ * Sets up the contention workload and starts the scheduler.  This function
+ * does not return; the probe task exits the process when it is done.
+ */
+static void
+nffs_bench_contention(void)
+{
+    int i;
+
+    nffs_bench_populate();
+
+    /* Only charge the measured phase to the simulated device. */
+    flash_native_stats_clear();
+
+    os_task_init(&nffs_bench_probe_task.nbt_task, "probe",
+                 nffs_bench_probe_handler, NULL, NFFS_BENCH_PROBE_PRIO,
+                 OS_WAIT_FOREVER, nffs_bench_probe_task.nbt_stack,
+                 NFFS_BENCH_STACK_SIZE);
+
+    os_task_init(&nffs_bench_writer_task.nbt_task, "writer",
+                 nffs_bench_writer_handler, NULL, NFFS_BENCH_WRITER_PRIO,
+                 OS_WAIT_FOREVER, nffs_bench_writer_task.nbt_stack,
+                 NFFS_BENCH_STACK_SIZE);
+
+    for (i = 0; i < NFFS_BENCH_NUM_BULK_TASKS; i++) {
+        os_task_init(&nffs_bench_bulk_tasks[i].nbt_task, "bulk",
+                     nffs_bench_bulk_handler, (void *)(intptr_t)i,
+                     NFFS_BENCH_BULK_PRIO + i, OS_WAIT_FOREVER,
+                     nffs_bench_bulk_tasks[i].nbt_stack,
+                     NFFS_BENCH_STACK_SIZE);
+    }
+
+    gettimeofday(&nffs_bench_start, NULL);
+
+    os_start();
+
+    /* os_start() should never return. */
+    assert(0);
+}
+
+static const struct nffs_bench_workload nffs_bench_workloads[] = {
+    { "seq_append",     nffs_bench_seq_append },
+    { "rand_overwrite", nffs_bench_rand_overwrite },
+    { "small_files",    nffs_bench_small_files },
+    { "deep_dirs",      nffs_bench_deep_dirs },
+    { "mount",          nffs_bench_mount },
+    { "gc_churn",       nffs_bench_gc_churn },
+    { "log_rotate",     nffs_bench_log_rotate },
+    { "log_ring",       nffs_bench_log_ring },
+    { "cfg_replace",    nffs_bench_cfg_replace },
+    { "cfg_replace_txn", nffs_bench_cfg_replace_txn },
+    { "contention",     nffs_bench_contention },
+    { NULL, NULL },
+};
+
+static void
+nffs_bench_usage(void)
+{
+    const struct nffs_bench_workload *wl;
+
+    fprintf(stderr, "usage: nffs_bench [-w workload]\nworkloads:");
+    for (wl = nffs_bench_workloads; wl->nbw_name != NULL; wl++) {
+        fprintf(stderr, " %s", wl->nbw_name);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct nffs_bench_workload *wl;
+    const char *only;
+    int found;
+    int rc;
+    int ch;
+
+    only = NULL;
+    while ((ch = getopt(argc, argv, "w:")) != -1) {
+        switch (ch) {
+        case 'w':
+            only = optarg;
+            break;
+
+        default:
+            nffs_bench_usage();
+        }
+    }
+
+    os_init();
+
+    nffs_config.nc_num_files = NFFS_BENCH_NUM_BULK_TASKS + 2;
+    nffs_config.nc_num_readers = NFFS_BENCH_NUM_BULK_TASKS + 1;
+    nffs_config.nc_num_inodes = 1024;
+    nffs_config.nc_num_blocks = 4096;
+    rc = nffs_init();
+    assert(rc == 0);
+
+    memset(nffs_bench_buf, 0x5a, sizeof nffs_bench_buf);
+
+    found = 0;
+    for (wl = nffs_bench_workloads; wl->nbw_name != NULL; wl++) {
+        if (only == NULL || strcmp(only, wl->nbw_name) == 0) {
+            wl->nbw_fn();
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        nffs_bench_usage();
+    }
+
+    return 0;
+}
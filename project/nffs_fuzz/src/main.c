@@ -0,0 +1,1304 @@
+/**
+ * Copyright (c) 2015 Runtime Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Randomized nffs test harness for the native target.
+ *
+ * Each worker runs a random sequence of file system operations against nffs
+ * and against a simple reference model.  Before some operations, a power
+ * cut is scheduled via flash_native_fail_after(): after a random number of
+ * program and erase operations, every further one fails without modifying
+ * flash.  When a cut occurs, the file system is remounted (sometimes with
+ * another cut during the remount) and the whole tree is compared against the
+ * model.
+ *
+ * Operations other than the interrupted one must be unaffected.  The
+ * interrupted operation may have been applied partially, within limits:
+ *     o create, unlink, rename, mkdir, rmdir: old or new state.
+ *     o write: every byte is either its old or new value; the length is
+ *       between the old and new lengths.  A block cut between its header and
+ *       its data is only caught by its 16-bit CRC; about one torn block in
+ *       65536 reads back as erased (0xff) data that passes the check.  Such a
+ *       block is recognized by recomputing its CRC over the data it was meant
+ *       to hold, and its bytes are then treated as unwritten.
+ *     o truncating write: also permitted to leave the file missing.
+ *     o truncate: old or new length, never anything in between.
+ *     o replace (a file written to a temporary and renamed over the target,
+ *       in one transaction): old or new contents; the temporary never
+ *       survives.
+ * The model then adopts whatever state nffs ended up in.
+ *
+ * Small areas are used so that garbage collection, and cuts during garbage
+ * collection, are frequent.
+ *
+ * Each worker is a separate process with its own simulated flash, so the
+ * harness scales across host cores.  A failure reports the worker's seed and
+ * operation number; rerun with "-s <seed> -j 1 -v" to reproduce it.
+ */
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "../src/nffs_priv.h"
+#include "../src/crc16.h"
+#include "os/os.h"
+#include "mcu/native_flash.h"
+#include "nffs/nffs.h"
+
+#define NFFS_FUZZ_NUM_DIRS          3   /* /d0 - /d2 */
+#define NFFS_FUZZ_NUM_NAMES         8   /* f0 - f7, in / and in each dir. */
+#define NFFS_FUZZ_NUM_PATHS         ((NFFS_FUZZ_NUM_DIRS + 1) * \
+                                     NFFS_FUZZ_NUM_NAMES)
+#define NFFS_FUZZ_MAX_FILE_SZ       4096
+#define NFFS_FUZZ_MAX_WRITE_SZ      3000
+
+/** Must fit in one transaction, along with two inodes and a block header. */
+#define NFFS_FUZZ_MAX_TXN_WRITE_SZ  256
+
+/** Unlinks are preferred once the model holds this much data. */
+#define NFFS_FUZZ_DATA_LIMIT        (20 * 1024)
+
+/** By default, one operation in this many is preceded by a power cut. */
+#define NFFS_FUZZ_DFLT_CUT_FREQ     4
+
+/** One remount in this many is itself interrupted. */
+#define NFFS_FUZZ_REMOUNT_CUT_FREQ  4
+
+/** The whole tree is checked this often, even without a cut. */
+#define NFFS_FUZZ_CHECK_ITVL        64
+
+/** A worker is considered hung if a single operation takes this long. */
+#define NFFS_FUZZ_WATCHDOG_S        10
+
+#define NFFS_FUZZ_MAX_WORKERS       256
+
+#define NFFS_FUZZ_OP_WRITE          0
+#define NFFS_FUZZ_OP_UNLINK         1
+#define NFFS_FUZZ_OP_RENAME         2
+#define NFFS_FUZZ_OP_MKDIR          3
+#define NFFS_FUZZ_OP_RMDIR          4
+#define NFFS_FUZZ_OP_READ           5
+#define NFFS_FUZZ_OP_REMOUNT        6
+#define NFFS_FUZZ_OP_TRUNCATE       7
+#define NFFS_FUZZ_OP_REPLACE        8
+#define NFFS_FUZZ_OP_MAX            9
+
+static const char *nffs_fuzz_op_names[NFFS_FUZZ_OP_MAX] = {
+    [NFFS_FUZZ_OP_WRITE]    = "write",
+    [NFFS_FUZZ_OP_UNLINK]   = "unlink",
+    [NFFS_FUZZ_OP_RENAME]   = "rename",
+    [NFFS_FUZZ_OP_MKDIR]    = "mkdir",
+    [NFFS_FUZZ_OP_RMDIR]    = "rmdir",
+    [NFFS_FUZZ_OP_READ]     = "read",
+    [NFFS_FUZZ_OP_REMOUNT]  = "remount",
+    [NFFS_FUZZ_OP_TRUNCATE] = "truncate",
+    [NFFS_FUZZ_OP_REPLACE]  = "replace",
+};
+
+/** Four 16 kB sectors at the start of native flash. */
+static const struct nffs_area_desc nffs_fuzz_area_descs[] = {
+    { 0x00000000, 16 * 1024 },
+    { 0x00004000, 16 * 1024 },
+    { 0x00008000, 16 * 1024 },
+    { 0x0000c000, 16 * 1024 },
+    { 0, 0 },
+};
+
+struct nffs_fuzz_file {
+    int nff_exists;
+    uint32_t nff_len;
+    uint8_t nff_data[NFFS_FUZZ_MAX_FILE_SZ];
+};
+
+/** Describes the operation in progress, in case it gets interrupted. */
+struct nffs_fuzz_pending {
+    int nfp_op;
+    int nfp_path;
+    int nfp_path2;              /* Rename destination; replace
+                                   temporary. */
+    int nfp_dir;                /* Mkdir / rmdir. */
+    int nfp_truncate;
+    struct nffs_fuzz_file nfp_old;
+    struct nffs_fuzz_file nfp_new;
+};
+
+/** Per-worker results; shared with the parent process. */
+struct nffs_fuzz_stats {
+    uint64_t nfs_ops;
+    uint64_t nfs_cuts;
+    uint64_t nfs_remount_cuts;
+    uint64_t nfs_full;
+    uint32_t nfs_seed;
+    int nfs_failed;
+};
+
+/** The reference model. */
+static struct nffs_fuzz_file nffs_fuzz_files[NFFS_FUZZ_NUM_PATHS];
+static int nffs_fuzz_dirs[NFFS_FUZZ_NUM_DIRS + 1];
+
+static struct nffs_fuzz_pending nffs_fuzz_pending;
+static struct nffs_fuzz_file nffs_fuzz_actual;
+static struct nffs_fuzz_file nffs_fuzz_untorn;
+static uint8_t nffs_fuzz_write_buf[NFFS_FUZZ_MAX_WRITE_SZ];
+
+static struct nffs_fuzz_stats *nffs_fuzz_stats;
+static uint32_t nffs_fuzz_rand_state;
+static uint64_t nffs_fuzz_op_idx;
+static int nffs_fuzz_verbose;
+static uint32_t nffs_fuzz_cut_freq = NFFS_FUZZ_DFLT_CUT_FREQ;
+
+static void
+print_usage(FILE *stream)
+{
+    fprintf(stream, "usage: nffs_fuzz [-j <workers>] [-n <ops-per-worker>] "
+                    "[-t <seconds>] [-s <seed>] [-c <cut-freq>] [-v]\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "One operation in <cut-freq> is interrupted by a power "
+                    "cut (default: %d;\n", NFFS_FUZZ_DFLT_CUT_FREQ);
+    fprintf(stream, "0 disables power cuts).\n");
+    fprintf(stream, "Worker i uses seed <seed> + i.  By default, each of "
+                    "one worker per core\n");
+    fprintf(stream, "runs for 10 seconds, and the seed is taken from the "
+                    "clock.\n");
+}
+
+static uint32_t
+nffs_fuzz_rand(void)
+{
+    /* xorshift32 */
+    nffs_fuzz_rand_state ^= nffs_fuzz_rand_state << 13;
+    nffs_fuzz_rand_state ^= nffs_fuzz_rand_state >> 17;
+    nffs_fuzz_rand_state ^= nffs_fuzz_rand_state << 5;
+    return nffs_fuzz_rand_state;
+}
+
+static uint32_t
+nffs_fuzz_rand_range(uint32_t n)
+{
+    return nffs_fuzz_rand() % n;
+}
+
+static void
+nffs_fuzz_log(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!nffs_fuzz_verbose) {
+        return;
+    }
+
+    printf("[%llu] ", (unsigned long long)nffs_fuzz_op_idx);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+static void
+nffs_fuzz_fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    printf("FAIL: seed=%u op=%llu: ", (unsigned)nffs_fuzz_stats->nfs_seed,
+           (unsigned long long)nffs_fuzz_op_idx);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    fflush(stdout);
+
+    nffs_fuzz_stats->nfs_failed = 1;
+    exit(1);
+}
+
+static int
+nffs_fuzz_path_dir(int path)
+{
+    return path / NFFS_FUZZ_NUM_NAMES;
+}
+
+static void
+nffs_fuzz_dir_name(int dir, char *dst)
+{
+    if (dir == 0) {
+        strcpy(dst, "/");
+    } else {
+        sprintf(dst, "/d%d", dir - 1);
+    }
+}
+
+static void
+nffs_fuzz_path_name(int path, char *dst)
+{
+    int dir;
+
+    dir = nffs_fuzz_path_dir(path);
+    if (dir == 0) {
+        sprintf(dst, "/f%d", path % NFFS_FUZZ_NUM_NAMES);
+    } else {
+        sprintf(dst, "/d%d/f%d", dir - 1, path % NFFS_FUZZ_NUM_NAMES);
+    }
+}
+
+static uint32_t
+nffs_fuzz_model_data_len(void)
+{
+    uint32_t len;
+    int i;
+
+    len = 0;
+    for (i = 0; i < NFFS_FUZZ_NUM_PATHS; i++) {
+        if (nffs_fuzz_files[i].nff_exists) {
+            len += nffs_fuzz_files[i].nff_len;
+        }
+    }
+
+    return len;
+}
+
+/**
+ * Reads a file from nffs.
+ *
+ * @return                      0 on success (including if the file does not
+ *                                  exist); nonzero on unexpected error.
+ */
+static int
+nffs_fuzz_read_file(int path, struct nffs_fuzz_file *out_file)
+{
+    struct nffs_file *file;
+    uint32_t file_len;
+    uint32_t len;
+    char name[32];
+    int rc;
+
+    nffs_fuzz_path_name(path, name);
+
+    out_file->nff_exists = 0;
+    out_file->nff_len = 0;
+
+    rc = nffs_open(name, NFFS_ACCESS_READ, &file);
+    if (rc == NFFS_ENOENT) {
+        return 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = nffs_file_len(file, &file_len);
+    if (rc != 0 || file_len > NFFS_FUZZ_MAX_FILE_SZ) {
+        nffs_close(file);
+        return rc != 0 ? rc : NFFS_ERANGE;
+    }
+
+    rc = nffs_read(file, NFFS_FUZZ_MAX_FILE_SZ, out_file->nff_data, &len);
+    nffs_close(file);
+    if (rc != 0) {
+        return rc;
+    }
+    if (len != file_len) {
+        return NFFS_ECORRUPT;
+    }
+
+    out_file->nff_exists = 1;
+    out_file->nff_len = len;
+
+    return 0;
+}
+
+static int
+nffs_fuzz_file_eq(const struct nffs_fuzz_file *a,
+                  const struct nffs_fuzz_file *b)
+{
+    if (a->nff_exists != b->nff_exists) {
+        return 0;
+    }
+    if (!a->nff_exists) {
+        return 1;
+    }
+    return a->nff_len == b->nff_len &&
+           memcmp(a->nff_data, b->nff_data, a->nff_len) == 0;
+}
+
+/**
+ * Indicates whether the result of an interrupted write is acceptable: each
+ * byte must hold its old or new value, and the length must be between the
+ * old and new lengths.
+ */
+static int
+nffs_fuzz_partial_write_ok(const struct nffs_fuzz_file *base,
+                           const struct nffs_fuzz_file *new_file,
+                           const struct nffs_fuzz_file *actual)
+{
+    uint32_t base_len;
+    uint32_t i;
+
+    if (!actual->nff_exists) {
+        return 0;
+    }
+
+    base_len = base->nff_exists ? base->nff_len : 0;
+    if (actual->nff_len < base_len || actual->nff_len > new_file->nff_len) {
+        return 0;
+    }
+
+    for (i = 0; i < actual->nff_len; i++) {
+        if (actual->nff_data[i] != new_file->nff_data[i] &&
+            (i >= base_len || actual->nff_data[i] != base->nff_data[i])) {
+
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Looks for blocks of a file whose data was cut off after the block header
+ * had been written, but which passed the CRC check anyway.  Such a block
+ * reads back as erased data, yet its CRC matches the data it was meant to
+ * hold.  The intended data of each such block is copied into the output.
+ *
+ * @return                      The number of torn blocks found.
+ */
+static int
+nffs_fuzz_find_torn_blocks(int path, const struct nffs_fuzz_file *new_file,
+                           const struct nffs_fuzz_file *actual,
+                           struct nffs_fuzz_file *out_file)
+{
+    struct nffs_disk_block disk_block;
+    struct nffs_hash_entry *entry;
+    struct nffs_block block;
+    struct nffs_file *file;
+    uint32_t area_offset;
+    uint32_t start;
+    uint32_t end;
+    uint32_t i;
+    uint16_t crc;
+    uint8_t area_idx;
+    char name[32];
+    int num_torn;
+    int rc;
+
+    *out_file = *actual;
+    if (!actual->nff_exists || actual->nff_len > new_file->nff_len) {
+        return 0;
+    }
+
+    nffs_fuzz_path_name(path, name);
+    rc = nffs_open(name, NFFS_ACCESS_READ, &file);
+    if (rc != 0) {
+        return 0;
+    }
+
+    num_torn = 0;
+    end = actual->nff_len;
+    entry = file->nf_inode_entry->nie_last_block_entry;
+    while (entry != NULL) {
+        rc = nffs_block_from_hash_entry(&block, entry);
+        if (rc != 0 || block.nb_data_len > end) {
+            break;
+        }
+        start = end - block.nb_data_len;
+
+        for (i = start; i < end; i++) {
+            if (actual->nff_data[i] != 0xff) {
+                break;
+            }
+        }
+        if (i == end && start != end) {
+            nffs_flash_loc_expand(entry->nhe_flash_loc, &area_idx,
+                                  &area_offset);
+            rc = nffs_flash_read(area_idx, area_offset, &disk_block,
+                                 sizeof disk_block);
+            if (rc == 0) {
+                crc = nffs_crc_disk_block_hdr(&disk_block);
+                crc = crc16_ccitt(crc, new_file->nff_data + start,
+                                  block.nb_data_len);
+                if (crc == disk_block.ndb_crc16) {
+                    memcpy(out_file->nff_data + start,
+                           new_file->nff_data + start, block.nb_data_len);
+                    num_torn++;
+                }
+            }
+        }
+
+        end = start;
+        entry = block.nb_prev;
+    }
+
+    nffs_close(file);
+    return num_torn;
+}
+
+/**
+ * Indicates whether the result of an interrupted write is acceptable,
+ * allowing for torn blocks that went undetected by their CRC.
+ */
+static int
+nffs_fuzz_interrupted_write_ok(int path, const struct nffs_fuzz_file *base,
+                               const struct nffs_fuzz_file *new_file,
+                               const struct nffs_fuzz_file *actual)
+{
+    int num_torn;
+
+    if (nffs_fuzz_partial_write_ok(base, new_file, actual)) {
+        return 1;
+    }
+
+    num_torn = nffs_fuzz_find_torn_blocks(path, new_file, actual,
+                                          &nffs_fuzz_untorn);
+    if (num_torn == 0 ||
+        !nffs_fuzz_partial_write_ok(base, new_file, &nffs_fuzz_untorn)) {
+
+        return 0;
+    }
+
+    nffs_fuzz_log("%d torn block(s) passed their CRC check", num_torn);
+    return 1;
+}
+
+static int
+nffs_fuzz_dir_exists(int dir)
+{
+    struct nffs_dir *nffs_dir;
+    char name[32];
+    int rc;
+
+    nffs_fuzz_dir_name(dir, name);
+    rc = nffs_opendir(name, &nffs_dir);
+    if (rc == 0) {
+        nffs_closedir(nffs_dir);
+        return 1;
+    }
+    if (rc != NFFS_ENOENT) {
+        nffs_fuzz_fail("opendir %s; rc=%d", name, rc);
+    }
+
+    return 0;
+}
+
+/**
+ * Resolves the state of a file touched by an interrupted operation, and
+ * records the actual state in the model.
+ */
+static void
+nffs_fuzz_resolve_file(int path, const struct nffs_fuzz_file *actual)
+{
+    struct nffs_fuzz_pending *p;
+    struct nffs_fuzz_file empty;
+    char name[32];
+    int ok;
+
+    p = &nffs_fuzz_pending;
+    nffs_fuzz_path_name(path, name);
+
+    ok = 0;
+    switch (p->nfp_op) {
+    case NFFS_FUZZ_OP_WRITE:
+        if (nffs_fuzz_file_eq(actual, &p->nfp_old)) {
+            ok = 1;
+        } else if (p->nfp_truncate) {
+            memset(&empty, 0, sizeof empty);
+            ok = !actual->nff_exists ||
+                 nffs_fuzz_interrupted_write_ok(path, &empty, &p->nfp_new,
+                                                actual);
+        } else {
+            ok = nffs_fuzz_interrupted_write_ok(path, &p->nfp_old,
+                                                &p->nfp_new, actual);
+        }
+        break;
+
+    case NFFS_FUZZ_OP_UNLINK:
+        ok = !actual->nff_exists || nffs_fuzz_file_eq(actual, &p->nfp_old);
+        break;
+
+    case NFFS_FUZZ_OP_TRUNCATE:
+        ok = nffs_fuzz_file_eq(actual, &p->nfp_old) ||
+             nffs_fuzz_file_eq(actual, &p->nfp_new);
+        break;
+
+    case NFFS_FUZZ_OP_RENAME:
+        /* Each end of the rename is checked against the other below. */
+        ok = !actual->nff_exists || nffs_fuzz_file_eq(actual, &p->nfp_old);
+        break;
+
+    case NFFS_FUZZ_OP_REPLACE:
+        if (path == p->nfp_path2) {
+            ok = !actual->nff_exists;
+        } else {
+            ok = nffs_fuzz_file_eq(actual, &p->nfp_old) ||
+                 nffs_fuzz_file_eq(actual, &p->nfp_new);
+        }
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+
+    if (!ok) {
+        nffs_fuzz_fail("%s: unacceptable state after interrupted %s "
+                       "(exists=%d len=%u; old exists=%d len=%u; "
+                       "new len=%u)",
+                       name, nffs_fuzz_op_names[p->nfp_op],
+                       actual->nff_exists, (unsigned)actual->nff_len,
+                       p->nfp_old.nff_exists, (unsigned)p->nfp_old.nff_len,
+                       (unsigned)p->nfp_new.nff_len);
+    }
+
+    nffs_fuzz_files[path] = *actual;
+}
+
+/**
+ * Compares the entire file system against the model.  If an operation was
+ * interrupted, the state of whatever it touched is resolved first.
+ */
+static void
+nffs_fuzz_check_all(int resolve)
+{
+    struct nffs_dirent *dirent;
+    struct nffs_dir *dir;
+    char name[32];
+    int pending_path;
+    int exists;
+    int path;
+    int rc;
+    int i;
+
+    for (i = 1; i <= NFFS_FUZZ_NUM_DIRS; i++) {
+        exists = nffs_fuzz_dir_exists(i);
+        if (exists != nffs_fuzz_dirs[i]) {
+            if (resolve && nffs_fuzz_pending.nfp_dir == i) {
+                nffs_fuzz_dirs[i] = exists;
+            } else {
+                nffs_fuzz_dir_name(i, name);
+                nffs_fuzz_fail("%s: exists=%d; expected %d", name, exists,
+                               nffs_fuzz_dirs[i]);
+            }
+        }
+    }
+
+    for (path = 0; path < NFFS_FUZZ_NUM_PATHS; path++) {
+        nffs_fuzz_path_name(path, name);
+
+        rc = nffs_fuzz_read_file(path, &nffs_fuzz_actual);
+        if (rc != 0) {
+            nffs_fuzz_fail("%s: read failed; rc=%d", name, rc);
+        }
+
+        pending_path = resolve &&
+                       nffs_fuzz_pending.nfp_op != NFFS_FUZZ_OP_READ &&
+                       (nffs_fuzz_pending.nfp_path == path ||
+                        nffs_fuzz_pending.nfp_path2 == path);
+        if (pending_path) {
+            nffs_fuzz_resolve_file(path, &nffs_fuzz_actual);
+        } else if (!nffs_fuzz_file_eq(&nffs_fuzz_actual,
+                                      nffs_fuzz_files + path)) {
+
+            nffs_fuzz_fail("%s: contents differ from model (exists=%d "
+                           "len=%u; expected exists=%d len=%u)",
+                           name, nffs_fuzz_actual.nff_exists,
+                           (unsigned)nffs_fuzz_actual.nff_len,
+                           nffs_fuzz_files[path].nff_exists,
+                           (unsigned)nffs_fuzz_files[path].nff_len);
+        }
+    }
+
+    /* An interrupted rename must leave exactly one of its ends. */
+    if (resolve && nffs_fuzz_pending.nfp_op == NFFS_FUZZ_OP_RENAME &&
+        nffs_fuzz_files[nffs_fuzz_pending.nfp_path].nff_exists ==
+        nffs_fuzz_files[nffs_fuzz_pending.nfp_path2].nff_exists) {
+
+        nffs_fuzz_fail("interrupted rename left %s of source and "
+                       "destination",
+                       nffs_fuzz_files[nffs_fuzz_pending.nfp_path].nff_exists ?
+                           "both" : "neither");
+    }
+
+    /* Nothing may be orphaned. */
+    rc = nffs_opendir("/lost+found", &dir);
+    if (rc != 0) {
+        nffs_fuzz_fail("could not open /lost+found; rc=%d", rc);
+    }
+    rc = nffs_readdir(dir, &dirent);
+    nffs_closedir(dir);
+    if (rc != NFFS_ENOENT) {
+        nffs_fuzz_fail("lost+found is not empty");
+    }
+}
+
+/**
+ * Simulates a reset: nffs is restored from flash, possibly with further
+ * power cuts during the restore.
+ */
+static void
+nffs_fuzz_remount(void)
+{
+    int num_failed;
+    int attempts;
+    int rc;
+
+    for (attempts = 0; ; attempts++) {
+        if (attempts < 8 &&
+            nffs_fuzz_rand_range(NFFS_FUZZ_REMOUNT_CUT_FREQ) == 0) {
+
+            flash_native_fail_after(nffs_fuzz_rand_range(16));
+        }
+
+        rc = nffs_detect(nffs_fuzz_area_descs);
+        num_failed = flash_native_fail_after(-1);
+        if (num_failed == 0) {
+            break;
+        }
+
+        nffs_fuzz_log("remount interrupted (rc=%d)", rc);
+        nffs_fuzz_stats->nfs_remount_cuts++;
+    }
+
+    if (rc != 0) {
+        nffs_fuzz_fail("nffs_detect failed; rc=%d", rc);
+    }
+}
+
+static int
+nffs_fuzz_choose_op(void)
+{
+    uint32_t r;
+
+    if (nffs_fuzz_model_data_len() > NFFS_FUZZ_DATA_LIMIT) {
+        return NFFS_FUZZ_OP_UNLINK;
+    }
+
+    r = nffs_fuzz_rand_range(100);
+    if (r < 44) {
+        return NFFS_FUZZ_OP_WRITE;
+    } else if (r < 50) {
+        return NFFS_FUZZ_OP_TRUNCATE;
+    } else if (r < 62) {
+        return NFFS_FUZZ_OP_UNLINK;
+    } else if (r < 77) {
+        return NFFS_FUZZ_OP_RENAME;
+    } else if (r < 83) {
+        return NFFS_FUZZ_OP_MKDIR;
+    } else if (r < 89) {
+        return NFFS_FUZZ_OP_RMDIR;
+    } else if (r < 93) {
+        return NFFS_FUZZ_OP_READ;
+    } else if (r < 98) {
+        return NFFS_FUZZ_OP_REPLACE;
+    } else {
+        return NFFS_FUZZ_OP_REMOUNT;
+    }
+}
+
+/**
+ * Picks a random path whose directory exists and whose existence matches the
+ * request.
+ *
+ * @return                      The path index, or -1 if there is none.
+ */
+static int
+nffs_fuzz_choose_path(int want_exists)
+{
+    int start;
+    int path;
+    int i;
+
+    start = nffs_fuzz_rand_range(NFFS_FUZZ_NUM_PATHS);
+    for (i = 0; i < NFFS_FUZZ_NUM_PATHS; i++) {
+        path = (start + i) % NFFS_FUZZ_NUM_PATHS;
+        if (nffs_fuzz_dirs[nffs_fuzz_path_dir(path)] &&
+            (want_exists == -1 ||
+             nffs_fuzz_files[path].nff_exists == want_exists)) {
+
+            return path;
+        }
+    }
+
+    return -1;
+}
+
+static int
+nffs_fuzz_op_write(struct nffs_fuzz_pending *p)
+{
+    struct nffs_file *file;
+    uint32_t write_len;
+    uint32_t off;
+    uint32_t i;
+    uint8_t flags;
+    char name[32];
+    int rc;
+
+    p->nfp_path = nffs_fuzz_choose_path(-1);
+    assert(p->nfp_path != -1);
+    nffs_fuzz_path_name(p->nfp_path, name);
+    p->nfp_old = nffs_fuzz_files[p->nfp_path];
+
+    switch (nffs_fuzz_rand_range(3)) {
+    case 0:
+        flags = NFFS_ACCESS_WRITE;
+        break;
+    case 1:
+        flags = NFFS_ACCESS_WRITE | NFFS_ACCESS_APPEND;
+        break;
+    default:
+        flags = NFFS_ACCESS_WRITE | NFFS_ACCESS_TRUNCATE;
+        break;
+    }
+
+    p->nfp_truncate = (flags & NFFS_ACCESS_TRUNCATE) &&
+                      p->nfp_old.nff_exists;
+    p->nfp_new = p->nfp_old;
+    if (!p->nfp_old.nff_exists || (flags & NFFS_ACCESS_TRUNCATE)) {
+        p->nfp_new.nff_len = 0;
+    }
+    p->nfp_new.nff_exists = 1;
+
+    if (flags & NFFS_ACCESS_APPEND) {
+        off = p->nfp_new.nff_len;
+    } else if (flags & NFFS_ACCESS_TRUNCATE) {
+        off = 0;
+    } else {
+        off = nffs_fuzz_rand_range(p->nfp_new.nff_len + 1);
+    }
+
+    write_len = nffs_fuzz_rand_range(NFFS_FUZZ_MAX_WRITE_SZ + 1);
+    if (off + write_len > NFFS_FUZZ_MAX_FILE_SZ) {
+        write_len = NFFS_FUZZ_MAX_FILE_SZ - off;
+    }
+    for (i = 0; i < write_len; i++) {
+        nffs_fuzz_write_buf[i] = nffs_fuzz_rand();
+    }
+
+    memcpy(p->nfp_new.nff_data + off, nffs_fuzz_write_buf, write_len);
+    if (off + write_len > p->nfp_new.nff_len) {
+        p->nfp_new.nff_len = off + write_len;
+    }
+
+    nffs_fuzz_log("write %s flags=0x%02x off=%u len=%u", name, flags,
+                  (unsigned)off, (unsigned)write_len);
+
+    rc = nffs_open(name, flags, &file);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (!(flags & NFFS_ACCESS_APPEND) && off != 0) {
+        rc = nffs_seek(file, off);
+    }
+    if (rc == 0) {
+        rc = nffs_write(file, nffs_fuzz_write_buf, write_len);
+    }
+
+    nffs_close(file);
+    return rc;
+}
+
+static int
+nffs_fuzz_op_unlink(struct nffs_fuzz_pending *p)
+{
+    char name[32];
+
+    p->nfp_path = nffs_fuzz_choose_path(1);
+    if (p->nfp_path == -1) {
+        p->nfp_op = NFFS_FUZZ_OP_READ;
+        return 0;
+    }
+    nffs_fuzz_path_name(p->nfp_path, name);
+    p->nfp_old = nffs_fuzz_files[p->nfp_path];
+    memset(&p->nfp_new, 0, sizeof p->nfp_new);
+
+    nffs_fuzz_log("unlink %s", name);
+    return nffs_unlink(name);
+}
+
+static int
+nffs_fuzz_op_truncate(struct nffs_fuzz_pending *p)
+{
+    struct nffs_file *file;
+    char name[32];
+    int rc;
+
+    p->nfp_path = nffs_fuzz_choose_path(1);
+    if (p->nfp_path == -1) {
+        p->nfp_op = NFFS_FUZZ_OP_READ;
+        return 0;
+    }
+    nffs_fuzz_path_name(p->nfp_path, name);
+    p->nfp_old = nffs_fuzz_files[p->nfp_path];
+    p->nfp_new = p->nfp_old;
+    p->nfp_new.nff_len = nffs_fuzz_rand_range(p->nfp_old.nff_len + 1);
+
+    nffs_fuzz_log("truncate %s len=%u", name, (unsigned)p->nfp_new.nff_len);
+
+    rc = nffs_open(name, NFFS_ACCESS_WRITE, &file);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = nffs_truncate(file, p->nfp_new.nff_len);
+
+    nffs_close(file);
+    return rc;
+}
+
+static int
+nffs_fuzz_op_rename(struct nffs_fuzz_pending *p)
+{
+    char from[32];
+    char to[32];
+
+    p->nfp_path = nffs_fuzz_choose_path(1);
+    p->nfp_path2 = nffs_fuzz_choose_path(0);
+    if (p->nfp_path == -1 || p->nfp_path2 == -1) {
+        p->nfp_op = NFFS_FUZZ_OP_READ;
+        return 0;
+    }
+    nffs_fuzz_path_name(p->nfp_path, from);
+    nffs_fuzz_path_name(p->nfp_path2, to);
+    p->nfp_old = nffs_fuzz_files[p->nfp_path];
+    p->nfp_new = p->nfp_old;
+
+    nffs_fuzz_log("rename %s %s", from, to);
+    return nffs_rename(from, to);
+}
+
+/**
+ * Atomically replaces a file's contents: the new contents are written to a
+ * temporary file, which is then renamed over the target, all within one
+ * transaction.
+ */
+static int
+nffs_fuzz_op_replace(struct nffs_fuzz_pending *p)
+{
+    struct nffs_file *file;
+    uint32_t write_len;
+    uint32_t i;
+    char name[32];
+    char tmp[32];
+    int rc;
+
+    p->nfp_path = nffs_fuzz_choose_path(-1);
+    p->nfp_path2 = nffs_fuzz_choose_path(0);
+    if (p->nfp_path == -1 || p->nfp_path2 == -1 ||
+        p->nfp_path == p->nfp_path2) {
+
+        p->nfp_op = NFFS_FUZZ_OP_READ;
+        return 0;
+    }
+    nffs_fuzz_path_name(p->nfp_path, name);
+    nffs_fuzz_path_name(p->nfp_path2, tmp);
+    p->nfp_old = nffs_fuzz_files[p->nfp_path];
+
+    write_len = nffs_fuzz_rand_range(NFFS_FUZZ_MAX_TXN_WRITE_SZ + 1);
+    for (i = 0; i < write_len; i++) {
+        nffs_fuzz_write_buf[i] = nffs_fuzz_rand();
+    }
+    p->nfp_new.nff_exists = 1;
+    p->nfp_new.nff_len = write_len;
+    memcpy(p->nfp_new.nff_data, nffs_fuzz_write_buf, write_len);
+
+    nffs_fuzz_log("replace %s via %s len=%u", name, tmp, (unsigned)write_len);
+
+    rc = nffs_txn_begin();
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = nffs_open(tmp, NFFS_ACCESS_WRITE, &file);
+    if (rc == 0) {
+        rc = nffs_write(file, nffs_fuzz_write_buf, write_len);
+        nffs_close(file);
+    }
+    if (rc == 0) {
+        rc = nffs_rename(tmp, name);
+    }
+    if (rc == 0) {
+        return nffs_txn_commit();
+    }
+
+    nffs_txn_abort();
+    return rc;
+}
+
+static int
+nffs_fuzz_op_dir(struct nffs_fuzz_pending *p)
+{
+    char name[32];
+    int dir;
+    int i;
+
+    dir = 1 + nffs_fuzz_rand_range(NFFS_FUZZ_NUM_DIRS);
+    nffs_fuzz_dir_name(dir, name);
+
+    if (p->nfp_op == NFFS_FUZZ_OP_MKDIR) {
+        if (nffs_fuzz_dirs[dir]) {
+            p->nfp_op = NFFS_FUZZ_OP_READ;
+            return 0;
+        }
+        p->nfp_dir = dir;
+        nffs_fuzz_log("mkdir %s", name);
+        return nffs_mkdir(name);
+    }
+
+    /* Only empty directories are removed. */
+    if (!nffs_fuzz_dirs[dir]) {
+        p->nfp_op = NFFS_FUZZ_OP_READ;
+        return 0;
+    }
+    for (i = 0; i < NFFS_FUZZ_NUM_NAMES; i++) {
+        if (nffs_fuzz_files[dir * NFFS_FUZZ_NUM_NAMES + i].nff_exists) {
+            p->nfp_op = NFFS_FUZZ_OP_READ;
+            return 0;
+        }
+    }
+    p->nfp_dir = dir;
+    nffs_fuzz_log("rmdir %s", name);
+    return nffs_unlink(name);
+}
+
+static void
+nffs_fuzz_op_read(void)
+{
+    char name[32];
+    int path;
+    int rc;
+
+    path = nffs_fuzz_choose_path(-1);
+    nffs_fuzz_path_name(path, name);
+
+    rc = nffs_fuzz_read_file(path, &nffs_fuzz_actual);
+    if (rc != 0) {
+        nffs_fuzz_fail("%s: read failed; rc=%d", name, rc);
+    }
+    if (!nffs_fuzz_file_eq(&nffs_fuzz_actual, nffs_fuzz_files + path)) {
+        nffs_fuzz_fail("%s: contents differ from model", name);
+    }
+}
+
+/**
+ * Applies a completed operation to the model.
+ */
+static void
+nffs_fuzz_apply(const struct nffs_fuzz_pending *p)
+{
+    switch (p->nfp_op) {
+    case NFFS_FUZZ_OP_WRITE:
+    case NFFS_FUZZ_OP_UNLINK:
+    case NFFS_FUZZ_OP_TRUNCATE:
+    case NFFS_FUZZ_OP_REPLACE:
+        nffs_fuzz_files[p->nfp_path] = p->nfp_new;
+        break;
+
+    case NFFS_FUZZ_OP_RENAME:
+        nffs_fuzz_files[p->nfp_path2] = p->nfp_new;
+        nffs_fuzz_files[p->nfp_path].nff_exists = 0;
+        nffs_fuzz_files[p->nfp_path].nff_len = 0;
+        break;
+
+    case NFFS_FUZZ_OP_MKDIR:
+        nffs_fuzz_dirs[p->nfp_dir] = 1;
+        break;
+
+    case NFFS_FUZZ_OP_RMDIR:
+        nffs_fuzz_dirs[p->nfp_dir] = 0;
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void
+nffs_fuzz_step(void)
+{
+    struct nffs_fuzz_pending *p;
+    int num_failed;
+    int cut;
+    int rc;
+
+    p = &nffs_fuzz_pending;
+    p->nfp_op = nffs_fuzz_choose_op();
+    p->nfp_path = -1;
+    p->nfp_path2 = -1;
+    p->nfp_dir = -1;
+    p->nfp_truncate = 0;
+
+    if (p->nfp_op == NFFS_FUZZ_OP_READ) {
+        nffs_fuzz_op_read();
+        return;
+    }
+
+    /* Schedule a power cut.  Most operations need only a few flash writes,
+     * but one that triggers garbage collection needs many more.
+     */
+    cut = nffs_fuzz_cut_freq != 0 &&
+          nffs_fuzz_rand_range(nffs_fuzz_cut_freq) == 0;
+    if (cut) {
+        if (nffs_fuzz_rand_range(2) == 0) {
+            flash_native_fail_after(nffs_fuzz_rand_range(8));
+        } else {
+            flash_native_fail_after(nffs_fuzz_rand_range(256));
+        }
+    }
+
+    switch (p->nfp_op) {
+    case NFFS_FUZZ_OP_WRITE:
+        rc = nffs_fuzz_op_write(p);
+        break;
+
+    case NFFS_FUZZ_OP_UNLINK:
+        rc = nffs_fuzz_op_unlink(p);
+        break;
+
+    case NFFS_FUZZ_OP_TRUNCATE:
+        rc = nffs_fuzz_op_truncate(p);
+        break;
+
+    case NFFS_FUZZ_OP_RENAME:
+        rc = nffs_fuzz_op_rename(p);
+        break;
+
+    case NFFS_FUZZ_OP_MKDIR:
+    case NFFS_FUZZ_OP_RMDIR:
+        rc = nffs_fuzz_op_dir(p);
+        break;
+
+    case NFFS_FUZZ_OP_REPLACE:
+        rc = nffs_fuzz_op_replace(p);
+        break;
+
+    case NFFS_FUZZ_OP_REMOUNT:
+        nffs_fuzz_log("remount");
+        flash_native_fail_after(-1);
+        nffs_fuzz_remount();
+        nffs_fuzz_check_all(0);
+        return;
+
+    default:
+        assert(0);
+        return;
+    }
+
+    num_failed = flash_native_fail_after(-1);
+
+    if (num_failed == 0 && rc == NFFS_EFULL) {
+        /* Out of space; the write may have been partially applied.  Resolve
+         * it as if it had been interrupted.
+         */
+        nffs_fuzz_log("file system full");
+        nffs_fuzz_stats->nfs_full++;
+        num_failed = 1;
+    }
+
+    if (num_failed == 0) {
+        if (rc != 0) {
+            nffs_fuzz_fail("%s failed; rc=%d", nffs_fuzz_op_names[p->nfp_op],
+                           rc);
+        }
+        nffs_fuzz_apply(p);
+        return;
+    }
+
+    nffs_fuzz_log("power cut (rc=%d)", rc);
+    nffs_fuzz_stats->nfs_cuts++;
+    nffs_fuzz_remount();
+    nffs_fuzz_check_all(1);
+}
+
+static void
+nffs_fuzz_worker(uint32_t seed, uint64_t num_ops, uint32_t duration_s)
+{
+    struct timeval start;
+    struct timeval now;
+    int rc;
+
+    nffs_fuzz_stats->nfs_seed = seed;
+    nffs_fuzz_rand_state = seed != 0 ? seed : 1;
+
+    os_init();
+
+    rc = nffs_init();
+    if (rc != 0) {
+        nffs_fuzz_fail("nffs_init failed; rc=%d", rc);
+    }
+
+    rc = nffs_format(nffs_fuzz_area_descs);
+    if (rc != 0) {
+        nffs_fuzz_fail("nffs_format failed; rc=%d", rc);
+    }
+
+    nffs_fuzz_dirs[0] = 1;
+
+    gettimeofday(&start, NULL);
+    for (nffs_fuzz_op_idx = 0; ; nffs_fuzz_op_idx++) {
+        if (num_ops != 0 && nffs_fuzz_op_idx >= num_ops) {
+            break;
+        }
+        if (duration_s != 0 && nffs_fuzz_op_idx % 256 == 0) {
+            gettimeofday(&now, NULL);
+            if (now.tv_sec - start.tv_sec >= duration_s) {
+                break;
+            }
+        }
+
+        /* The default SIGALRM action kills the worker; the parent reports
+         * it as a hang.
+         */
+        alarm(NFFS_FUZZ_WATCHDOG_S);
+        nffs_fuzz_step();
+        nffs_fuzz_stats->nfs_ops++;
+
+        if (nffs_fuzz_op_idx % NFFS_FUZZ_CHECK_ITVL == 0) {
+            nffs_fuzz_check_all(0);
+        }
+    }
+
+    nffs_fuzz_check_all(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    pid_t pids[NFFS_FUZZ_MAX_WORKERS];
+    struct nffs_fuzz_stats *stats;
+    struct timeval start;
+    struct timeval now;
+    uint64_t total_ops;
+    uint64_t total_cuts;
+    uint64_t total_remount_cuts;
+    uint32_t duration_s;
+    uint64_t num_ops;
+    uint32_t seed;
+    double elapsed;
+    long num_workers;
+    int num_failed;
+    int status;
+    int ch;
+    int i;
+
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    num_ops = 0;
+    duration_s = 10;
+    gettimeofday(&start, NULL);
+    seed = start.tv_sec ^ start.tv_usec;
+
+    while ((ch = getopt(argc, argv, "c:j:n:s:t:v")) != -1) {
+        switch (ch) {
+        case 'c':
+            nffs_fuzz_cut_freq = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'j':
+            num_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            num_ops = strtoull(optarg, NULL, 10);
+            duration_s = 0;
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            duration_s = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            nffs_fuzz_verbose = 1;
+            break;
+        default:
+            print_usage(stderr);
+            return 1;
+        }
+    }
+
+    if (num_workers < 1 || num_workers > NFFS_FUZZ_MAX_WORKERS ||
+        (num_ops == 0 && duration_s == 0)) {
+
+        print_usage(stderr);
+        return 1;
+    }
+
+    /* Keep output intact if a worker crashes. */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    /* Each worker writes its results here.  Simulated flash must not be
+     * touched before the fork, or the workers would share it.
+     */
+    stats = mmap(NULL, num_workers * sizeof *stats, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(stats != MAP_FAILED);
+    memset(stats, 0, num_workers * sizeof *stats);
+
+    printf("nffs_fuzz: %ld workers, seed %u\n", num_workers, (unsigned)seed);
+    fflush(stdout);
+
+    for (i = 0; i < num_workers; i++) {
+        pids[i] = fork();
+        assert(pids[i] != -1);
+        if (pids[i] == 0) {
+            nffs_fuzz_stats = stats + i;
+            nffs_fuzz_worker(seed + i, num_ops, duration_s);
+            exit(0);
+        }
+    }
+
+    num_failed = 0;
+    for (i = 0; i < num_workers; i++) {
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            num_failed++;
+            if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+                printf("FAIL: seed=%u op=%llu: worker hung\n",
+                       (unsigned)(seed + i),
+                       (unsigned long long)stats[i].nfs_ops);
+            } else if (!stats[i].nfs_failed) {
+                /* Crashed, e.g., on an assertion in nffs. */
+                printf("FAIL: seed=%u op=%llu: worker crashed\n",
+                       (unsigned)(seed + i),
+                       (unsigned long long)stats[i].nfs_ops);
+            }
+        }
+    }
+
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - start.tv_sec) +
+              (now.tv_usec - start.tv_usec) / 1000000.0;
+
+    total_ops = 0;
+    total_cuts = 0;
+    total_remount_cuts = 0;
+    for (i = 0; i < num_workers; i++) {
+        total_ops += stats[i].nfs_ops;
+        total_cuts += stats[i].nfs_cuts;
+        total_remount_cuts += stats[i].nfs_remount_cuts;
+    }
+
+    printf("%llu ops (%.0f ops/s), %llu power cuts, %llu during remount; "
+           "%d of %ld workers failed\n",
+           (unsigned long long)total_ops, total_ops / elapsed,
+           (unsigned long long)total_cuts,
+           (unsigned long long)total_remount_cuts, num_failed, num_workers);
+
+    return num_failed == 0 ? 0 : 1;
+}
@@ -18,6 +18,8 @@
 #include "os/os_test.h"
 #include "nffs/nffs_test.h"
 #include "bootutil/bootutil_test.h"
+#include "hal/hal_test.h"
+#include "controller/ll_test.h"
 #include "testutil/testutil.h"
 
 int
@@ -29,6 +31,8 @@ main(void)
     os_test_all();
     nffs_test_all();
     boot_test_all();
+    hal_test_all();
+    ll_test_all();
 
     return 0;
 }